@@ -122,6 +122,15 @@
 #  define EV_USE_EPOLL 0
 # endif
 
+# if HAVE_IO_URING
+#  ifndef EV_USE_IOURING
+#   define EV_USE_IOURING EV_FEATURE_BACKENDS
+#  endif
+# else
+#  undef EV_USE_IOURING
+#  define EV_USE_IOURING 0
+# endif
+
 # if HAVE_KQUEUE && HAVE_SYS_EVENT_H
 #  ifndef EV_USE_KQUEUE
 #   define EV_USE_KQUEUE EV_FEATURE_BACKENDS
@@ -314,6 +323,10 @@
 # endif
 #endif
 
+#ifndef EV_USE_IOURING
+# define EV_USE_IOURING 0
+#endif
+
 #ifndef EV_USE_KQUEUE
 # define EV_USE_KQUEUE 0
 #endif
@@ -1781,7 +1794,7 @@ typedef struct
   unsigned char reify;  /* flag set when this ANFD needs reification (EV_ANFD_REIFY, EV__IOFDSET) */
   unsigned char emask;  /* the epoll backend stores the actual kernel mask in here */
   unsigned char unused;
-#if EV_USE_EPOLL
+#if EV_USE_EPOLL || EV_USE_IOURING
   unsigned int egen;    /* generation counter to counter epoll bugs */
 #endif
 #if EV_SELECT_IS_WINSOCKET || EV_USE_IOCP
@@ -2714,6 +2727,9 @@ childcb (EV_P_ ev_signal *sw, int revents)
 #if EV_USE_EPOLL
 # include "ev_epoll.c"
 #endif
+#if EV_USE_IOURING
+# include "ev_iouring.c"
+#endif
 #if EV_USE_POLL
 # include "ev_poll.c"
 #endif
@@ -2754,6 +2770,7 @@ ev_supported_backends (void) EV_NOEXCEPT
   if (EV_USE_PORT  ) flags |= EVBACKEND_PORT;
   if (EV_USE_KQUEUE) flags |= EVBACKEND_KQUEUE;
   if (EV_USE_EPOLL ) flags |= EVBACKEND_EPOLL;
+  if (EV_USE_IOURING) flags |= EVBACKEND_IOURING;
   if (EV_USE_POLL  ) flags |= EVBACKEND_POLL;
   if (EV_USE_SELECT) flags |= EVBACKEND_SELECT;
 
@@ -2779,6 +2796,8 @@ ev_recommended_backends (void) EV_NOEXCEPT
 #ifdef __FreeBSD__
   flags &= ~EVBACKEND_POLL;   /* poll return value is unusable (http://forums.freebsd.org/archive/index.php/t-10270.html) */
 #endif
+  /* io_uring requires a recent kernel and must be requested explicitly */
+  flags &= ~EVBACKEND_IOURING;
 
   return flags;
 }
@@ -2944,6 +2963,9 @@ loop_init (EV_P_ unsigned int flags) EV_NOEXCEPT
 #if EV_USE_KQUEUE
       if (!backend && (flags & EVBACKEND_KQUEUE)) backend = kqueue_init (EV_A_ flags);
 #endif
+#if EV_USE_IOURING
+      if (!backend && (flags & EVBACKEND_IOURING)) backend = iouring_init (EV_A_ flags);
+#endif
 #if EV_USE_EPOLL
       if (!backend && (flags & EVBACKEND_EPOLL )) backend = epoll_init  (EV_A_ flags);
 #endif
@@ -3027,6 +3049,9 @@ ev_loop_destroy (EV_P)
 #if EV_USE_EPOLL
   if (backend == EVBACKEND_EPOLL ) epoll_destroy  (EV_A);
 #endif
+#if EV_USE_IOURING
+  if (backend == EVBACKEND_IOURING) iouring_destroy (EV_A);
+#endif
 #if EV_USE_POLL
   if (backend == EVBACKEND_POLL  ) poll_destroy   (EV_A);
 #endif
@@ -3091,6 +3116,9 @@ loop_fork (EV_P)
 #if EV_USE_EPOLL
   if (backend == EVBACKEND_EPOLL ) epoll_fork  (EV_A);
 #endif
+#if EV_USE_IOURING
+  if (backend == EVBACKEND_IOURING) iouring_fork (EV_A);
+#endif
 #if EV_USE_INOTIFY
   infy_fork (EV_A);
 #endif
@@ -522,7 +522,8 @@ enum {
   EVBACKEND_KQUEUE  = 0x00000008U, /* bsd, broken on osx */
   EVBACKEND_DEVPOLL = 0x00000010U, /* solaris 8 */ /* NYI */
   EVBACKEND_PORT    = 0x00000020U, /* solaris 10 */
-  EVBACKEND_ALL     = 0x0000003FU, /* all known backends */
+  EVBACKEND_IOURING = 0x00000080U, /* linux >= 5.5, opt-in only */
+  EVBACKEND_ALL     = 0x0000003FU, /* all known backends, except opt-in ones */
   EVBACKEND_MASK    = 0x0000FFFFU  /* all future backends */
 };
 
@@ -0,0 +1,447 @@
+/*
+ * libev linux io_uring fd activity backend
+ *
+ * Copyright (c) 2019 Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modifica-
+ * tion, are permitted provided that the following conditions are met:
+ *
+ *   1.  Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *   2.  Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MER-
+ * CHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPE-
+ * CIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTH-
+ * ERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * the GNU General Public License ("GPL") version 2 or any later version,
+ * in which case the provisions of the GPL are applicable instead of
+ * the above. If you wish to allow the use of your version of this file
+ * only under the terms of the GPL and not to allow others to use your
+ * version of this file under the BSD license, indicate your decision
+ * by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL. If you do not delete the
+ * provisions above, a recipient may use your version of this file under
+ * either the BSD or the GPL.
+ */
+
+/*
+ * general notes about linux io_uring:
+ *
+ * a) poll requests are oneshot, so every fd is rearmed via fd_change
+ *    after its completion has been processed.
+ * b) all changes of the interest set done during one loop iteration are
+ *    submitted together with the wait for events in a single io_uring_enter
+ *    call, unlike epoll that requires one epoll_ctl per change.
+ * c) completions are read directly from the shared ring, so when events are
+ *    already there we do not need a syscall at all.
+ * d) we require IORING_FEAT_NODROP (linux 5.5), so completions are never
+ *    lost when the completion ring is full, and IORING_OP_TIMEOUT (5.4)
+ *    to wait with a timeout.
+ * e) the generation counter is stored in the upper 32 bits of user_data,
+ *    so completions of polls that have been removed are ignored.
+ */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+
+#ifndef __NR_io_uring_setup
+# define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+# define __NR_io_uring_enter 426
+#endif
+
+/* number of submission entries, completion ring is twice as large */
+#define EV_IOURING_ENTRIES 1024
+
+/* special user data values, fds are never that large */
+#define EV_IOURING_TIMEOUT_UD 0xffffffffffffffffULL
+#define EV_IOURING_REMOVE_UD  0xfffffffffffffffeULL
+
+/* the same as struct __kernel_timespec, not available in old headers */
+struct ev_iouring_tspec
+{
+  int64_t tv_sec;
+  long long tv_nsec;
+};
+
+#define EV_SQ_VAR(name) (*(unsigned *)((char *)iouring_sq_ring + iouring_sq_ ## name))
+#define EV_CQ_VAR(name) (*(unsigned *)((char *)iouring_cq_ring + iouring_cq_ ## name))
+#define EV_SQ_ARRAY     ((unsigned *)((char *)iouring_sq_ring + iouring_sq_array))
+#define EV_SQES         ((struct io_uring_sqe *)iouring_sqes)
+#define EV_CQES         ((struct io_uring_cqe *)((char *)iouring_cq_ring + iouring_cq_cqes))
+
+inline_size
+int
+evsys_io_uring_setup (unsigned entries, struct io_uring_params *params)
+{
+  return syscall (__NR_io_uring_setup, entries, params);
+}
+
+inline_size
+int
+evsys_io_uring_enter (int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags, (void *)0, (size_t)0);
+}
+
+static void iouring_process_cq (EV_P);
+
+/* submit all queued entries without waiting */
+static void
+iouring_flush (EV_P)
+{
+  while (iouring_to_submit)
+    {
+      int res = evsys_io_uring_enter (backend_fd, iouring_to_submit, 0, 0);
+
+      if (expect_true (res >= 0))
+        iouring_to_submit -= res;
+      else if (errno == EBUSY || errno == EAGAIN)
+        /* completions are backlogged, consume them and try again */
+        iouring_process_cq (EV_A);
+      else if (errno != EINTR)
+        ev_syserr ("(libev) io_uring_enter");
+    }
+}
+
+inline_size
+struct io_uring_sqe *
+iouring_sqe_get (EV_P)
+{
+  unsigned tail = EV_SQ_VAR (tail);
+  struct io_uring_sqe *sqe;
+
+  ECB_MEMORY_FENCE_ACQUIRE;
+
+  if (expect_false (tail - EV_SQ_VAR (head) >= EV_SQ_VAR (ring_entries)))
+    {
+      /* submission ring is full */
+      iouring_flush (EV_A);
+      tail = EV_SQ_VAR (tail);
+    }
+
+  sqe = EV_SQES + (tail & EV_SQ_VAR (ring_mask));
+  memset (sqe, 0, sizeof (*sqe));
+
+  return sqe;
+}
+
+inline_size
+void
+iouring_sqe_submit (EV_P_ struct io_uring_sqe *sqe)
+{
+  unsigned idx = sqe - EV_SQES;
+
+  EV_SQ_ARRAY [idx] = idx;
+  ECB_MEMORY_FENCE_RELEASE;
+  ++EV_SQ_VAR (tail);
+  ++iouring_to_submit;
+}
+
+static void
+iouring_modify (EV_P_ int fd, int oev, int nev)
+{
+  struct io_uring_sqe *sqe;
+
+  if (anfds [fd].emask)
+    {
+      /* there is a poll in flight, remove it */
+      sqe = iouring_sqe_get (EV_A);
+      sqe->opcode    = IORING_OP_POLL_REMOVE;
+      sqe->fd        = -1;
+      sqe->addr      = (uint64_t)(uint32_t)fd
+                     | ((uint64_t)(uint32_t)anfds [fd].egen << 32);
+      sqe->user_data = EV_IOURING_REMOVE_UD;
+      iouring_sqe_submit (EV_A_ sqe);
+
+      anfds [fd].emask = 0;
+    }
+
+  if (nev)
+    {
+      /* store the generation counter in the upper 32 bits, the fd in the lower 32 bits */
+      ++anfds [fd].egen;
+
+      sqe = iouring_sqe_get (EV_A);
+      sqe->opcode      = IORING_OP_POLL_ADD;
+      sqe->fd          = fd;
+      sqe->poll_events = (nev & EV_READ  ? POLLIN  : 0)
+                       | (nev & EV_WRITE ? POLLOUT : 0);
+      sqe->user_data   = (uint64_t)(uint32_t)fd
+                       | ((uint64_t)(uint32_t)anfds [fd].egen << 32);
+      iouring_sqe_submit (EV_A_ sqe);
+
+      anfds [fd].emask = nev;
+    }
+}
+
+inline_size
+void
+iouring_process_cqe (EV_P_ struct io_uring_cqe *cqe)
+{
+  int fd, res;
+
+  if (expect_false (cqe->user_data >= EV_IOURING_REMOVE_UD))
+    {
+      if (cqe->user_data == EV_IOURING_TIMEOUT_UD)
+        iouring_timeout_at = 0.;
+
+      return;
+    }
+
+  fd  = (uint32_t)cqe->user_data;
+  res = cqe->res;
+
+  /* ignore completions of polls that have been removed or rearmed */
+  if (expect_false (fd >= anfdmax
+      || (uint32_t)anfds [fd].egen != (uint32_t)(cqe->user_data >> 32)))
+    return;
+
+  anfds [fd].emask = 0;
+
+  if (expect_false (res < 0))
+    {
+      if (res != -ECANCELED)
+        fd_kill (EV_A_ fd);
+
+      return;
+    }
+
+  fd_event (
+    EV_A_
+    fd,
+    (res & (POLLOUT | POLLERR | POLLHUP) ? EV_WRITE : 0)
+    | (res & (POLLIN | POLLERR | POLLHUP) ? EV_READ : 0)
+  );
+
+  /* poll is oneshot, so rearm it if there are still watchers */
+  anfds [fd].events = 0;
+  fd_change (EV_A_ fd, EV_ANFD_REIFY);
+}
+
+static void
+iouring_process_cq (EV_P)
+{
+  unsigned head, tail, mask;
+
+  head = EV_CQ_VAR (head);
+  ECB_MEMORY_FENCE_ACQUIRE;
+  tail = EV_CQ_VAR (tail);
+  mask = EV_CQ_VAR (ring_mask);
+
+  while (head != tail)
+    {
+      iouring_process_cqe (EV_A_ &EV_CQES [head & mask]);
+      ++head;
+    }
+
+  ECB_MEMORY_FENCE_RELEASE;
+  EV_CQ_VAR (head) = head;
+}
+
+inline_size
+int
+iouring_cq_ready (EV_P)
+{
+  unsigned tail;
+
+  tail = EV_CQ_VAR (tail);
+  ECB_MEMORY_FENCE_ACQUIRE;
+
+  return tail != EV_CQ_VAR (head);
+}
+
+static void
+iouring_poll (EV_P_ ev_tstamp timeout)
+{
+  unsigned min_complete = 0;
+  int res;
+
+  /* if there are completions already, there is no need to wait */
+  if (iouring_cq_ready (EV_A))
+    timeout = 0.;
+
+  if (timeout > 0.)
+    {
+      min_complete = 1;
+
+      /* a timeout that is still in flight might be enough */
+      if (!iouring_timeout_at || iouring_timeout_at > mn_now + timeout + backend_mintime)
+        {
+          struct ev_iouring_tspec *ts = (struct ev_iouring_tspec *)iouring_ts;
+          struct io_uring_sqe *sqe;
+
+          ts->tv_sec  = (int64_t)timeout;
+          ts->tv_nsec = (long long)((timeout - (ev_tstamp)ts->tv_sec) * 1e9);
+
+          sqe = iouring_sqe_get (EV_A);
+          sqe->opcode    = IORING_OP_TIMEOUT;
+          sqe->fd        = -1;
+          sqe->addr      = (uint64_t)(uintptr_t)ts;
+          sqe->len       = 1;
+          sqe->user_data = EV_IOURING_TIMEOUT_UD;
+          iouring_sqe_submit (EV_A_ sqe);
+
+          iouring_timeout_at = mn_now + timeout;
+        }
+    }
+
+  if (iouring_to_submit || min_complete)
+    {
+      EV_RELEASE_CB;
+      res = evsys_io_uring_enter (backend_fd, iouring_to_submit, min_complete,
+                                  min_complete ? IORING_ENTER_GETEVENTS : 0);
+      EV_ACQUIRE_CB;
+
+      if (expect_false (res < 0))
+        {
+          if (errno == EBUSY || errno == EAGAIN)
+            {
+              /* completions are backlogged, they are processed below */
+            }
+          else if (errno != EINTR)
+            ev_syserr ("(libev) io_uring_enter");
+        }
+      else
+        iouring_to_submit -= res;
+    }
+
+  iouring_process_cq (EV_A);
+}
+
+inline_size
+void
+iouring_internal_destroy (EV_P)
+{
+  if (iouring_sq_ring != MAP_FAILED && iouring_sq_ring)
+    munmap (iouring_sq_ring, iouring_sq_ring_size);
+
+  if (iouring_cq_ring != MAP_FAILED && iouring_cq_ring)
+    munmap (iouring_cq_ring, iouring_cq_ring_size);
+
+  if (iouring_sqes != MAP_FAILED && iouring_sqes)
+    munmap (iouring_sqes, iouring_sqes_size);
+
+  iouring_sq_ring = 0;
+  iouring_cq_ring = 0;
+  iouring_sqes    = 0;
+}
+
+inline_size
+int
+iouring_internal_init (EV_P)
+{
+  struct io_uring_params params;
+
+  memset (&params, 0, sizeof (params));
+
+  iouring_to_submit  = 0;
+  iouring_timeout_at = 0.;
+  iouring_sq_ring    = 0;
+  iouring_cq_ring    = 0;
+  iouring_sqes       = 0;
+
+  backend_fd = evsys_io_uring_setup (EV_IOURING_ENTRIES, &params);
+
+  if (backend_fd < 0)
+    return -1;
+
+  if (!(params.features & IORING_FEAT_NODROP))
+    {
+      /* kernel is too old, use epoll instead */
+      close (backend_fd);
+      backend_fd = -1;
+
+      return -1;
+    }
+
+  iouring_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+  iouring_cq_ring_size = params.cq_off.cqes  + params.cq_entries * sizeof (struct io_uring_cqe);
+  iouring_sqes_size    = params.sq_entries * sizeof (struct io_uring_sqe);
+
+  iouring_sq_ring = mmap (0, iouring_sq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, backend_fd, IORING_OFF_SQ_RING);
+  iouring_cq_ring = mmap (0, iouring_cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, backend_fd, IORING_OFF_CQ_RING);
+  iouring_sqes    = mmap (0, iouring_sqes_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, backend_fd, IORING_OFF_SQES);
+
+  if (iouring_sq_ring == MAP_FAILED || iouring_cq_ring == MAP_FAILED
+      || iouring_sqes == MAP_FAILED)
+    {
+      iouring_internal_destroy (EV_A);
+      close (backend_fd);
+      backend_fd = -1;
+
+      return -1;
+    }
+
+  iouring_sq_head         = params.sq_off.head;
+  iouring_sq_tail         = params.sq_off.tail;
+  iouring_sq_ring_mask    = params.sq_off.ring_mask;
+  iouring_sq_ring_entries = params.sq_off.ring_entries;
+  iouring_sq_array        = params.sq_off.array;
+
+  iouring_cq_head         = params.cq_off.head;
+  iouring_cq_tail         = params.cq_off.tail;
+  iouring_cq_ring_mask    = params.cq_off.ring_mask;
+  iouring_cq_cqes         = params.cq_off.cqes;
+
+  fcntl (backend_fd, F_SETFD, FD_CLOEXEC);
+
+  return 0;
+}
+
+inline_size
+int
+iouring_init (EV_P_ int flags)
+{
+  if (iouring_internal_init (EV_A) < 0)
+    return 0;
+
+  iouring_ts = ev_malloc (sizeof (struct ev_iouring_tspec));
+
+  backend_mintime = 1e-3; /* timeouts have nanosecond resolution, but let's be sane */
+  backend_modify  = iouring_modify;
+  backend_poll    = iouring_poll;
+
+  return EVBACKEND_IOURING;
+}
+
+/* backend_fd is closed by loop_destroy */
+inline_size
+void
+iouring_destroy (EV_P)
+{
+  iouring_internal_destroy (EV_A);
+  ev_free (iouring_ts);
+}
+
+inline_size
+void
+iouring_fork (EV_P)
+{
+  iouring_internal_destroy (EV_A);
+  close (backend_fd);
+
+  while (iouring_internal_init (EV_A) < 0)
+    ev_syserr ("(libev) io_uring_setup");
+
+  fd_rearm_all (EV_A);
+}
@@ -107,6 +107,27 @@ VARx(int, epoll_epermcnt)
 VARx(int, epoll_epermmax)
 #endif
 
+#if EV_USE_IOURING || EV_GENWRAP
+VARx(void *, iouring_sq_ring)
+VARx(void *, iouring_cq_ring)
+VARx(void *, iouring_sqes)
+VARx(size_t, iouring_sq_ring_size)
+VARx(size_t, iouring_cq_ring_size)
+VARx(size_t, iouring_sqes_size)
+VARx(unsigned, iouring_sq_head)
+VARx(unsigned, iouring_sq_tail)
+VARx(unsigned, iouring_sq_ring_mask)
+VARx(unsigned, iouring_sq_ring_entries)
+VARx(unsigned, iouring_sq_array)
+VARx(unsigned, iouring_cq_head)
+VARx(unsigned, iouring_cq_tail)
+VARx(unsigned, iouring_cq_ring_mask)
+VARx(unsigned, iouring_cq_cqes)
+VARx(unsigned, iouring_to_submit)
+VARx(void *, iouring_ts) /* timespec of the pending timeout request */
+VARx(ev_tstamp, iouring_timeout_at)
+#endif
+
 #if EV_USE_KQUEUE || EV_GENWRAP
 VARx(pid_t, kqueue_fd_pid)
 VARx(struct kevent *, kqueue_changes)
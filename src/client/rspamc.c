@@ -61,6 +61,7 @@ static gboolean mime_output = FALSE;
 static gboolean empty_input = FALSE;
 static gboolean compressed = FALSE;
 static gboolean profile = FALSE;
+static gboolean msgpack = FALSE;
 static gboolean skip_images = FALSE;
 static gboolean skip_attachments = FALSE;
 static gchar *key = NULL;
@@ -153,6 +154,8 @@ static GOptionEntry entries[] =
 	   "Enable zstd compression", NULL },
 	{ "profile", '\0', 0, G_OPTION_ARG_NONE, &profile,
 	   "Profile symbols execution time", NULL },
+	{ "msgpack", '\0', 0, G_OPTION_ARG_NONE, &msgpack,
+	   "Request binary (msgpack) reply", NULL },
 	{ "dictionary", 'D', 0, G_OPTION_ARG_FILENAME, &dictionary,
 	   "Use dictionary to compress data", NULL },
 	{ "skip-images", '\0', 0, G_OPTION_ARG_NONE, &skip_images,
@@ -667,6 +670,10 @@ add_options (GQueue *opts)
 		ADD_CLIENT_HEADER (opts, "Profile", "true");
 	}
 
+	if (msgpack) {
+		ADD_CLIENT_HEADER (opts, "Accept", "application/msgpack");
+	}
+
 	if (skip_images) {
 		ADD_CLIENT_HEADER (opts, "Skip-Images", "true");
 	}
@@ -109,6 +109,7 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 	struct ucl_parser *parser;
 	GError *err;
 	const rspamd_ftok_t *tok;
+	enum ucl_parse_type parse_type = UCL_PARSE_UCL;
 
 	c = req->conn;
 
@@ -133,6 +134,14 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 			return 0;
 		}
 
+		tok = rspamd_http_message_find_header (msg, "Content-Type");
+
+		if (tok && rspamd_substring_search_caseless (tok->begin, tok->len,
+				"application/msgpack", sizeof ("application/msgpack") - 1) != -1) {
+			/* Binary reply requested by Accept header */
+			parse_type = UCL_PARSE_MSGPACK;
+		}
+
 		tok = rspamd_http_message_find_header (msg, "compression");
 
 		if (tok) {
@@ -192,7 +201,8 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 				ZSTD_freeDStream (zstream);
 
 				parser = ucl_parser_new (0);
-				if (!ucl_parser_add_chunk (parser, zout.dst, zout.pos)) {
+				if (!ucl_parser_add_chunk_full (parser, zout.dst, zout.pos, 0,
+						UCL_DUPLICATE_APPEND, parse_type)) {
 					err = g_error_new (RCLIENT_ERROR, msg->code, "Cannot parse UCL: %s",
 							ucl_parser_get_error (parser));
 					ucl_parser_free (parser);
@@ -218,7 +228,8 @@ rspamd_client_finish_handler (struct rspamd_http_connection *conn,
 		}
 		else {
 			parser = ucl_parser_new (0);
-			if (!ucl_parser_add_chunk (parser, msg->body_buf.begin, msg->body_buf.len)) {
+			if (!ucl_parser_add_chunk_full (parser, msg->body_buf.begin,
+					msg->body_buf.len, 0, UCL_DUPLICATE_APPEND, parse_type)) {
 				err = g_error_new (RCLIENT_ERROR, msg->code, "Cannot parse UCL: %s",
 						ucl_parser_get_error (parser));
 				ucl_parser_free (parser);
@@ -22,6 +22,7 @@
 #include "libutil/map_private.h"
 #include "libutil/http_private.h"
 #include "libutil/http_router.h"
+#include "libutil/http2.h"
 #include "libstat/stat_api.h"
 #include "rspamd.h"
 #include "libserver/worker_util.h"
@@ -60,6 +61,7 @@
 #define PATH_CHECKV2 "/checkv2"
 #define PATH_STAT "/stat"
 #define PATH_STAT_RESET "/statreset"
+#define PATH_METRICS "/metrics"
 #define PATH_COUNTERS "/counters"
 #define PATH_ERRORS "/errors"
 #define PATH_NEIGHBOURS "/neighbours"
@@ -708,7 +710,7 @@ rspamd_controller_handle_auth (struct rspamd_http_connection_entry *conn_ent,
 	struct rspamd_http_message *msg)
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
-	struct rspamd_stat *st;
+	struct rspamd_stat *st, stat_copy;
 	int64_t uptime;
 	gulong data[5];
 	ucl_object_t *obj;
@@ -718,7 +720,8 @@ rspamd_controller_handle_auth (struct rspamd_http_connection_entry *conn_ent,
 	}
 
 	obj = ucl_object_typed_new (UCL_OBJECT);
-	st = session->ctx->srv->stat;
+	rspamd_worker_stat_sum (session->ctx->srv, &stat_copy, TRUE);
+	st = &stat_copy;
 	data[0] = st->actions_stat[METRIC_ACTION_NOACTION];
 	data[1] = st->actions_stat[METRIC_ACTION_ADD_HEADER] +
 		st->actions_stat[METRIC_ACTION_REWRITE_SUBJECT];
@@ -934,6 +937,7 @@ rspamd_controller_handle_maps (struct rspamd_http_connection_entry *conn_ent,
 	GList *cur;
 	struct rspamd_map *map;
 	struct rspamd_map_backend *bk;
+	struct rspamd_map_stat mst;
 	guint i;
 	gboolean editable;
 	ucl_object_t *obj, *top;
@@ -970,6 +974,22 @@ rspamd_controller_handle_maps (struct rspamd_http_connection_entry *conn_ent,
 						"uri", 0, false);
 				ucl_object_insert_key (obj,	  ucl_object_frombool (editable),
 						"editable", 0, false);
+				ucl_object_insert_key (obj, ucl_object_fromdouble (map->load_time),
+						"load_time", 0, false);
+
+				if (map->stat) {
+					rspamd_map_stat_sum (map, &mst);
+					ucl_object_insert_key (obj,
+							ucl_object_fromint (mst.hits),
+							"hits", 0, false);
+					ucl_object_insert_key (obj,
+							ucl_object_fromint (mst.misses),
+							"misses", 0, false);
+					ucl_object_insert_key (obj,
+							ucl_object_fromint (mst.filtered),
+							"filtered", 0, false);
+				}
+
 				ucl_array_append (top, obj);
 			}
 		}
@@ -1120,6 +1140,7 @@ rspamd_controller_handle_pie_chart (
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
 	struct rspamd_controller_worker_ctx *ctx;
+	struct rspamd_stat stat;
 	gdouble data[5], total;
 	ucl_object_t *top;
 
@@ -1130,15 +1151,16 @@ rspamd_controller_handle_pie_chart (
 	}
 
 	top = ucl_object_typed_new (UCL_ARRAY);
-	total = ctx->srv->stat->messages_scanned;
+	rspamd_worker_stat_sum (ctx->srv, &stat, TRUE);
+	total = stat.messages_scanned;
 	if (total != 0) {
 
-		data[0] = ctx->srv->stat->actions_stat[METRIC_ACTION_NOACTION];
-		data[1] = ctx->srv->stat->actions_stat[METRIC_ACTION_SOFT_REJECT];
-		data[2] = (ctx->srv->stat->actions_stat[METRIC_ACTION_ADD_HEADER] +
-			ctx->srv->stat->actions_stat[METRIC_ACTION_REWRITE_SUBJECT]);
-		data[3] = ctx->srv->stat->actions_stat[METRIC_ACTION_GREYLIST];
-		data[4] = ctx->srv->stat->actions_stat[METRIC_ACTION_REJECT];
+		data[0] = stat.actions_stat[METRIC_ACTION_NOACTION];
+		data[1] = stat.actions_stat[METRIC_ACTION_SOFT_REJECT];
+		data[2] = (stat.actions_stat[METRIC_ACTION_ADD_HEADER] +
+			stat.actions_stat[METRIC_ACTION_REWRITE_SUBJECT]);
+		data[3] = stat.actions_stat[METRIC_ACTION_GREYLIST];
+		data[4] = stat.actions_stat[METRIC_ACTION_REJECT];
 	}
 	else {
 		memset (data, 0, sizeof (data));
@@ -1934,7 +1956,8 @@ rspamd_controller_scan_reply (struct rspamd_task *task)
 	rspamd_http_connection_reset (conn_ent->conn);
 	rspamd_http_router_insert_headers (conn_ent->rt, msg);
 	rspamd_http_connection_write_message (conn_ent->conn, msg, NULL,
-			"application/json", conn_ent, conn_ent->rt->timeout);
+			rspamd_protocol_reply_content_type (task), conn_ent,
+			conn_ent->rt->timeout);
 	conn_ent->is_reply = TRUE;
 }
 
@@ -2588,7 +2611,7 @@ rspamd_controller_handle_stat_common (
 
 	memset (&mem_st, 0, sizeof (mem_st));
 	rspamd_mempool_stat (&mem_st);
-	memcpy (&stat_copy, session->ctx->worker->srv->stat, sizeof (stat_copy));
+	rspamd_worker_stat_sum (session->ctx->srv, &stat_copy, TRUE);
 	stat = &stat_copy;
 	ctx = session->ctx;
 
@@ -2629,14 +2652,6 @@ rspamd_controller_handle_stat_common (
 			else {
 				ham += stat->actions_stat[i];
 			}
-			if (do_reset) {
-#ifndef HAVE_ATOMIC_BUILTINS
-				session->ctx->worker->srv->stat->actions_stat[i] = 0;
-#else
-				__atomic_store_n(&session->ctx->worker->srv->stat->actions_stat[i],
-						0, __ATOMIC_RELEASE);
-#endif
-			}
 		}
 		ucl_object_insert_key (top, sub, "actions", 0, false);
 	}
@@ -2650,6 +2665,16 @@ rspamd_controller_handle_stat_common (
 	ucl_object_insert_key (top,
 		ucl_object_fromint (stat->control_connections_count),
 		"control_connections", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->bytes_received), "bytes_received", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->bytes_copied), "bytes_copied", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->keypair_cache_hits), "keypair_cache_hits",
+		0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->keypair_cache_misses),
+		"keypair_cache_misses", 0, false);
 
 	ucl_object_insert_key (top,
 		ucl_object_fromint (mem_st.pools_allocated), "pools_allocated", 0,
@@ -2674,10 +2699,8 @@ rspamd_controller_handle_stat_common (
 			ucl_object_fromint (mem_st.fragmented_size), "fragmented", 0, false);
 
 	if (do_reset) {
-		session->ctx->srv->stat->messages_scanned = 0;
-		session->ctx->srv->stat->messages_learned = 0;
-		session->ctx->srv->stat->connections_count = 0;
-		session->ctx->srv->stat->control_connections_count = 0;
+		/* Workers counters are not touched, only the reported values */
+		rspamd_worker_stat_set (session->ctx->srv, NULL);
 		rspamd_mempool_stat_reset ();
 	}
 
@@ -2722,6 +2745,144 @@ rspamd_controller_handle_statreset (
 }
 
 
+static void
+rspamd_controller_metrics_counter (rspamd_fstring_t **out, const gchar *name,
+		const gchar *help, guint64 value)
+{
+	rspamd_printf_fstring (out, "# HELP %s %s\n# TYPE %s counter\n%s %uL\n",
+			name, help, name, name, value);
+}
+
+static void
+rspamd_controller_metrics_symbol_cb (const gchar *symbol, guint64 hits,
+		gpointer ud)
+{
+	rspamd_fstring_t **out = (rspamd_fstring_t **)ud;
+	const gchar *p, *c;
+
+	*out = rspamd_fstring_append (*out, "rspamd_symbol_hits_total{symbol=\"",
+			sizeof ("rspamd_symbol_hits_total{symbol=\"") - 1);
+
+	/* Escape label value */
+	for (p = symbol, c = symbol; *p != '\0'; p ++) {
+		if (*p == '"' || *p == '\\' || *p == '\n') {
+			*out = rspamd_fstring_append (*out, c, p - c);
+			*out = rspamd_fstring_append (*out, "\\", 1);
+			*out = rspamd_fstring_append (*out, *p == '\n' ? "n" : p, 1);
+			c = p + 1;
+		}
+	}
+
+	*out = rspamd_fstring_append (*out, c, p - c);
+	rspamd_printf_fstring (out, "\"} %uL\n", hits);
+}
+
+/*
+ * Metrics command handler:
+ * request: /metrics
+ * headers: Password
+ * reply: statistics in Prometheus text format
+ *
+ * Counters are summed from the shared memory of all workers, so this handler
+ * performs neither IPC nor disk I/O and values are not affected by /statreset
+ */
+static int
+rspamd_controller_handle_metrics (struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	struct rspamd_http_message *rep_msg;
+	struct rspamd_stat stat;
+	rspamd_fstring_t *reply;
+	const gdouble *bounds;
+	guint64 cumulative = 0;
+	gint i;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	rspamd_worker_stat_sum (session->ctx->srv, &stat, FALSE);
+	reply = rspamd_fstring_sized_new (BUFSIZ);
+
+	rspamd_controller_metrics_counter (&reply, "rspamd_scanned_total",
+			"Messages scanned", stat.messages_scanned);
+	rspamd_controller_metrics_counter (&reply, "rspamd_learned_total",
+			"Messages learned", stat.messages_learned);
+	rspamd_controller_metrics_counter (&reply, "rspamd_connections_total",
+			"Connections to scanners", stat.connections_count);
+	rspamd_controller_metrics_counter (&reply,
+			"rspamd_control_connections_total",
+			"Connections to controllers", stat.control_connections_count);
+	rspamd_controller_metrics_counter (&reply, "rspamd_bytes_received_total",
+			"Bytes of messages received", stat.bytes_received);
+	rspamd_controller_metrics_counter (&reply, "rspamd_bytes_copied_total",
+			"Bytes copied while receiving messages", stat.bytes_copied);
+	rspamd_controller_metrics_counter (&reply,
+			"rspamd_keypair_cache_hits_total",
+			"Encrypted messages that reused shared secret",
+			stat.keypair_cache_hits);
+	rspamd_controller_metrics_counter (&reply,
+			"rspamd_keypair_cache_misses_total",
+			"Encrypted messages that computed shared secret",
+			stat.keypair_cache_misses);
+
+	rspamd_printf_fstring (&reply, "# HELP rspamd_actions_total "
+			"Messages by action\n# TYPE rspamd_actions_total counter\n");
+
+	for (i = METRIC_ACTION_REJECT; i <= METRIC_ACTION_NOACTION; i++) {
+		rspamd_printf_fstring (&reply, "rspamd_actions_total{action=\"%s\"} %uL\n",
+				rspamd_action_to_str (i), stat.actions_stat[i]);
+	}
+
+	rspamd_printf_fstring (&reply, "# HELP rspamd_scan_time_seconds "
+			"Time of messages scan\n# TYPE rspamd_scan_time_seconds histogram\n");
+	bounds = rspamd_worker_stat_scan_time_bounds ();
+
+	for (i = 0; i < RSPAMD_STAT_SCAN_TIME_BUCKETS; i++) {
+		cumulative += stat.scan_time_buckets[i];
+
+		if (i == RSPAMD_STAT_SCAN_TIME_BUCKETS - 1) {
+			rspamd_printf_fstring (&reply,
+					"rspamd_scan_time_seconds_bucket{le=\"+Inf\"} %uL\n",
+					cumulative);
+		}
+		else {
+			rspamd_printf_fstring (&reply,
+					"rspamd_scan_time_seconds_bucket{le=\"%.3f\"} %uL\n",
+					bounds[i], cumulative);
+		}
+	}
+
+	rspamd_printf_fstring (&reply, "rspamd_scan_time_seconds_sum %.6f\n"
+			"rspamd_scan_time_seconds_count %uL\n",
+			stat.scan_time_usec / 1e6, cumulative);
+
+	if (session->ctx->cfg->cache) {
+		rspamd_printf_fstring (&reply, "# HELP rspamd_symbol_hits_total "
+				"Symbol hits\n# TYPE rspamd_symbol_hits_total counter\n");
+		rspamd_symcache_foreach_hits (session->ctx->cfg->cache,
+				rspamd_controller_metrics_symbol_cb, &reply);
+	}
+
+	rep_msg = rspamd_http_new_message (HTTP_RESPONSE);
+	rep_msg->date = time (NULL);
+	rep_msg->code = 200;
+	rep_msg->status = rspamd_fstring_new_init ("OK", 2);
+	rspamd_http_message_set_body_from_fstring_steal (rep_msg, reply);
+	rspamd_http_connection_reset (conn_ent->conn);
+	rspamd_http_router_insert_headers (conn_ent->rt, rep_msg);
+	rspamd_http_connection_write_message (conn_ent->conn,
+			rep_msg,
+			NULL,
+			"text/plain; version=0.0.4",
+			conn_ent,
+			conn_ent->rt->timeout);
+	conn_ent->is_reply = TRUE;
+
+	return 0;
+}
+
 /*
  * Counters command handler:
  * request: /counters
@@ -3055,7 +3216,8 @@ rspamd_controller_finish_handler (struct rspamd_http_connection_entry *conn_ent)
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
 
-	session->ctx->worker->srv->stat->control_connections_count++;
+	RSPAMD_STAT_ADD (rspamd_worker_stat (session->ctx->worker),
+			control_connections_count, 1);
 
 	if (session->task != NULL) {
 		rspamd_session_destroy (session->task->s);
@@ -3073,6 +3235,74 @@ rspamd_controller_finish_handler (struct rspamd_http_connection_entry *conn_ent)
 	g_free (session);
 }
 
+struct rspamd_controller_accept_cbdata {
+	struct rspamd_worker *worker;
+	rspamd_inet_addr_t *addr;
+};
+
+static struct rspamd_controller_session *
+rspamd_controller_session_new (struct rspamd_worker *worker,
+		rspamd_inet_addr_t *addr)
+{
+	struct rspamd_controller_worker_ctx *ctx = worker->ctx;
+	struct rspamd_controller_session *session;
+
+	session = g_malloc0 (sizeof (struct rspamd_controller_session));
+	session->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+			"csession");
+	session->ctx = ctx;
+	session->cfg = ctx->cfg;
+	session->lang_det = ctx->lang_det;
+	REF_RETAIN (session->cfg);
+
+	session->from_addr = addr;
+	session->wrk = worker;
+	worker->nconns ++;
+
+	return session;
+}
+
+/* Each HTTP/2 stream has its own session */
+static gpointer
+rspamd_controller_http2_stream_session (gpointer ud)
+{
+	struct rspamd_controller_accept_cbdata *cbd =
+			(struct rspamd_controller_accept_cbdata *)ud;
+
+	return rspamd_controller_session_new (cbd->worker,
+			rspamd_inet_address_copy (cbd->addr));
+}
+
+static void
+rspamd_controller_accept_cbdata_free (gpointer ud)
+{
+	struct rspamd_controller_accept_cbdata *cbd =
+			(struct rspamd_controller_accept_cbdata *)ud;
+
+	rspamd_inet_address_free (cbd->addr);
+	g_free (cbd);
+}
+
+static void
+rspamd_controller_start_connection (gint fd, gboolean is_http2, gpointer ud)
+{
+	struct rspamd_controller_accept_cbdata *cbd =
+			(struct rspamd_controller_accept_cbdata *)ud;
+	struct rspamd_controller_worker_ctx *ctx = cbd->worker->ctx;
+	struct rspamd_controller_session *session;
+
+	if (is_http2) {
+		rspamd_http_router_handle_http2_socket (ctx->http, fd,
+				rspamd_controller_http2_stream_session,
+				cbd, rspamd_controller_accept_cbdata_free);
+	}
+	else {
+		session = rspamd_controller_session_new (cbd->worker, cbd->addr);
+		g_free (cbd);
+		rspamd_http_router_handle_socket (ctx->http, fd, session);
+	}
+}
+
 static void
 rspamd_controller_accept_socket (EV_P_ ev_io *w, int revents)
 {
@@ -3095,19 +3325,19 @@ rspamd_controller_accept_socket (EV_P_ ev_io *w, int revents)
 		return;
 	}
 
-	session = g_malloc0 (sizeof (struct rspamd_controller_session));
-	session->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
-			"csession");
-	session->ctx = ctx;
-	session->cfg = ctx->cfg;
-	session->lang_det = ctx->lang_det;
-	REF_RETAIN (session->cfg);
-
-	session->from_addr = addr;
-	session->wrk = worker;
-	worker->nconns ++;
+	if (rspamd_http2_server_enabled (ctx->http_ctx)) {
+		struct rspamd_controller_accept_cbdata *cbd;
 
-	rspamd_http_router_handle_socket (ctx->http, nfd, session);
+		cbd = g_malloc0 (sizeof (*cbd));
+		cbd->worker = worker;
+		cbd->addr = addr;
+		rspamd_http2_detect (ctx->http_ctx, nfd, ctx->timeout,
+				rspamd_controller_start_connection, cbd);
+	}
+	else {
+		session = rspamd_controller_session_new (worker, addr);
+		rspamd_http_router_handle_socket (ctx->http, nfd, session);
+	}
 }
 
 static void
@@ -3115,17 +3345,18 @@ rspamd_controller_rrd_update (EV_P_ ev_timer *w, int revents)
 {
 	struct rspamd_controller_worker_ctx *ctx =
 			(struct rspamd_controller_worker_ctx *)w->data;
-	struct rspamd_stat *stat;
+	struct rspamd_stat stat;
 	GArray ar;
 	gdouble points[METRIC_ACTION_MAX];
 	GError *err = NULL;
 	guint i;
 
 	g_assert (ctx->rrd != NULL);
-	stat = ctx->srv->stat;
+	/* Raw counters are monotonic, they are not affected by stat reset */
+	rspamd_worker_stat_sum (ctx->srv, &stat, FALSE);
 
 	for (i = METRIC_ACTION_REJECT; i < METRIC_ACTION_MAX; i ++) {
-		points[i] = stat->actions_stat[i];
+		points[i] = stat.actions_stat[i];
 	}
 
 	ar.data = (gchar *)points;
@@ -3147,7 +3378,7 @@ rspamd_controller_load_saved_stats (struct rspamd_controller_worker_ctx *ctx)
 	struct ucl_parser *parser;
 	ucl_object_t *obj;
 	const ucl_object_t *elt, *subelt;
-	struct rspamd_stat *stat, stat_copy;
+	struct rspamd_stat stat_copy;
 	gint i;
 
 	g_assert (ctx->saved_stats_path != NULL);
@@ -3171,8 +3402,7 @@ rspamd_controller_load_saved_stats (struct rspamd_controller_worker_ctx *ctx)
 	obj = ucl_parser_get_object (parser);
 	ucl_parser_free (parser);
 
-	stat = ctx->srv->stat;
-	memcpy (&stat_copy, stat, sizeof (stat_copy));
+	rspamd_worker_stat_sum (ctx->srv, &stat_copy, TRUE);
 
 	elt = ucl_object_lookup (obj, "scanned");
 
@@ -3211,13 +3441,13 @@ rspamd_controller_load_saved_stats (struct rspamd_controller_worker_ctx *ctx)
 	}
 
 	ucl_object_unref (obj);
-	memcpy (stat, &stat_copy, sizeof (stat_copy));
+	rspamd_worker_stat_set (ctx->srv, &stat_copy);
 }
 
 static void
 rspamd_controller_store_saved_stats (struct rspamd_controller_worker_ctx *ctx)
 {
-	struct rspamd_stat *stat;
+	struct rspamd_stat *stat, stat_copy;
 	ucl_object_t *top, *sub;
 	struct ucl_emitter_functions *efuncs;
 	gint i, fd;
@@ -3240,7 +3470,8 @@ rspamd_controller_store_saved_stats (struct rspamd_controller_worker_ctx *ctx)
 		return;
 	}
 
-	stat = ctx->srv->stat;
+	rspamd_worker_stat_sum (ctx->srv, &stat_copy, TRUE);
+	stat = &stat_copy;
 
 	top = ucl_object_typed_new (UCL_OBJECT);
 	ucl_object_insert_key (top, ucl_object_fromint (
@@ -3765,6 +3996,7 @@ start_controller_worker (struct rspamd_worker *worker)
 	/* Accept event */
 	ctx->http_ctx = rspamd_http_context_create (ctx->cfg, ctx->event_loop,
 			ctx->cfg->ups_ctx);
+	rspamd_http_context_set_stat (ctx->http_ctx, rspamd_worker_stat (worker));
 	ctx->http = rspamd_http_router_new (rspamd_controller_error_handler,
 			rspamd_controller_finish_handler, ctx->timeout,
 			ctx->static_files_dir, ctx->http_ctx);
@@ -3827,6 +4059,9 @@ start_controller_worker (struct rspamd_worker *worker)
 	rspamd_http_router_add_path (ctx->http,
 			PATH_STAT_RESET,
 			rspamd_controller_handle_statreset);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_METRICS,
+			rspamd_controller_handle_metrics);
 	rspamd_http_router_add_path (ctx->http,
 			PATH_COUNTERS,
 			rspamd_controller_handle_counters);
@@ -3886,7 +4121,7 @@ start_controller_worker (struct rspamd_worker *worker)
 			ctx->event_loop, ctx->resolver->r);
 	rspamd_symcache_start_refresh (worker->srv->cfg->cache, ctx->event_loop,
 			worker);
-	rspamd_stat_init (worker->srv->cfg, ctx->event_loop);
+	rspamd_stat_init (worker->srv->cfg, ctx->event_loop, worker);
 
 	if (worker->index == 0) {
 		if (!ctx->cfg->disable_monitored) {
@@ -26,6 +26,8 @@ struct rspamd_keypair_elt {
 
 struct rspamd_keypair_cache {
 	rspamd_lru_hash_t *hash;
+	guint64 hits;
+	guint64 misses;
 };
 
 static void
@@ -69,12 +71,13 @@ rspamd_keypair_cache_new (guint max_items)
 	return c;
 }
 
-void
+gboolean
 rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 		struct rspamd_cryptobox_keypair *lk,
 		struct rspamd_cryptobox_pubkey *rk)
 {
 	struct rspamd_keypair_elt search, *new;
+	gboolean hit = FALSE;
 
 	g_assert (lk != NULL);
 	g_assert (rk != NULL);
@@ -94,6 +97,7 @@ rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 	}
 
 	if (new == NULL) {
+		c->misses ++;
 		new = g_malloc0 (sizeof (*new));
 
 		if (posix_memalign ((void **)&new->nm, 32, sizeof (*new->nm)) != 0) {
@@ -126,11 +130,34 @@ rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 
 		rspamd_lru_hash_insert (c->hash, new, new, time (NULL), -1);
 	}
+	else {
+		c->hits ++;
+		hit = TRUE;
+	}
 
 	g_assert (new != NULL);
 
 	rk->nm = new->nm;
 	REF_RETAIN (rk->nm);
+
+	return hit;
+}
+
+void
+rspamd_keypair_cache_stat (struct rspamd_keypair_cache *c,
+		guint64 *hits, guint64 *misses, guint *size)
+{
+	if (hits) {
+		*hits = c->hits;
+	}
+
+	if (misses) {
+		*misses = c->misses;
+	}
+
+	if (size) {
+		*size = rspamd_lru_hash_size (c->hash);
+	}
 }
 
 void
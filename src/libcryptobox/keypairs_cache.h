@@ -34,11 +34,22 @@ struct rspamd_keypair_cache * rspamd_keypair_cache_new (guint max_items);
  * @param c cache of keypairs
  * @param lk local key
  * @param rk remote key
+ * @return TRUE if the shared secret has been found in the cache
  */
-void rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
+gboolean rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 		struct rspamd_cryptobox_keypair *lk,
 		struct rspamd_cryptobox_pubkey *rk);
 
+/**
+ * Returns statistics of the cache
+ * @param c cache object
+ * @param hits number of lookups that have reused shared secret
+ * @param misses number of lookups that have computed shared secret
+ * @param size current number of elements
+ */
+void rspamd_keypair_cache_stat (struct rspamd_keypair_cache *c,
+		guint64 *hits, guint64 *misses, guint *size);
+
 /**
  * Destroy old keypair cache
  * @param c cache object
@@ -71,19 +71,9 @@ rspamd_mime_part_extract_words (struct rspamd_task *task,
 					task->lang_det);
 
 		for (i = 0; i < part->utf_words->len; i++) {
-			guint64 h;
-
 			w = &g_array_index (part->utf_words, rspamd_stat_token_t, i);
 
 			if (w->stemmed.len > 0) {
-				/*
-				 * We use static hash seed if we would want to use that in shingles
-				 * computation in future
-				 */
-				h = rspamd_cryptobox_fast_hash_specific (
-						RSPAMD_CRYPTOBOX_HASHFAST_INDEPENDENT,
-						w->stemmed.begin, w->stemmed.len, words_hash_seed);
-				g_array_append_val (part->normalized_hashes, h);
 				total_len += w->stemmed.len;
 
 				if (w->stemmed.len <= 3) {
@@ -136,6 +126,40 @@ rspamd_mime_part_extract_words (struct rspamd_task *task,
 	}
 }
 
+/*
+ * Hashes of stemmed words are used to compare alternative parts only, so they
+ * are computed on demand
+ */
+static GArray *
+rspamd_mime_part_words_hashes (struct rspamd_mime_text_part *part)
+{
+	rspamd_stat_token_t *w;
+	guint64 h;
+	guint i;
+
+	if (part->normalized_hashes == NULL && part->utf_words != NULL) {
+		part->normalized_hashes = g_array_sized_new (FALSE, FALSE,
+				sizeof (guint64), part->utf_words->len);
+
+		for (i = 0; i < part->utf_words->len; i++) {
+			w = &g_array_index (part->utf_words, rspamd_stat_token_t, i);
+
+			if (w->stemmed.len > 0) {
+				/*
+				 * We use static hash seed if we would want to use that in shingles
+				 * computation in future
+				 */
+				h = rspamd_cryptobox_fast_hash_specific (
+						RSPAMD_CRYPTOBOX_HASHFAST_INDEPENDENT,
+						w->stemmed.begin, w->stemmed.len, words_hash_seed);
+				g_array_append_val (part->normalized_hashes, h);
+			}
+		}
+	}
+
+	return part->normalized_hashes;
+}
+
 static void
 rspamd_mime_part_create_words (struct rspamd_task *task,
 		struct rspamd_mime_text_part *part)
@@ -189,8 +213,6 @@ rspamd_mime_part_create_words (struct rspamd_task *task,
 
 
 	if (part->utf_words) {
-		part->normalized_hashes = g_array_sized_new (FALSE, FALSE,
-				sizeof (guint64), part->utf_words->len);
 		rspamd_normalize_words (part->utf_words, task->task_pool);
 	}
 
@@ -1398,7 +1420,8 @@ rspamd_message_process (struct rspamd_task *task)
 
 			if (rspamd_ftok_cmp (&p1->mime_part->parent_part->ct->subtype, &srch) == 0) {
 				if (!IS_PART_EMPTY (p1) && !IS_PART_EMPTY (p2) &&
-					p1->normalized_hashes && p2->normalized_hashes) {
+					rspamd_mime_part_words_hashes (p1) &&
+					rspamd_mime_part_words_hashes (p2)) {
 					/*
 					 * We also detect language on one part and propagate it to
 					 * another one
@@ -102,7 +102,7 @@ struct rspamd_mime_text_part {
 	GByteArray *utf_content; /* utf8 encoded processed content */
 	GByteArray *utf_raw_content; /* utf raw content */
 	GByteArray *utf_stripped_content; /* utf content with no newlines */
-	GArray *normalized_hashes;
+	GArray *normalized_hashes; /* hashes of stemmed words, built on demand */
 	GArray *utf_words;
 	UText utf_stripped_text; /* Used by libicu to represent the utf8 content */
 
@@ -149,6 +149,7 @@ struct rspamd_statfile_config {
 	gchar *label;                                   /**< label of this statfile								*/
 	ucl_object_t *opts;                             /**< other options										*/
 	gboolean is_spam;                               /**< spam flag											*/
+	gchar *class_name;                              /**< class for multi-class classifiers					*/
 	struct rspamd_classifier_config *clcf;			/**< parent pointer of classifier configuration			*/
 	gpointer data;									/**< opaque data 										*/
 };
@@ -170,6 +171,10 @@ struct rspamd_tokenizer_config {
  * No backend required for classifier
  */
 #define RSPAMD_FLAG_CLASSIFIER_NO_BACKEND (1 << 2)
+/*
+ * Classifier has arbitrary number of classes and not just spam and ham
+ */
+#define RSPAMD_FLAG_CLASSIFIER_MULTICLASS (1 << 3)
 
 /**
  * Classifier config definition
@@ -416,6 +421,8 @@ struct rspamd_config {
 	gdouble map_timeout;                            /**< maps watch timeout									*/
 	gdouble map_file_watch_multiplier;              /**< multiplier for watch timeout when maps are files	*/
 	gchar *maps_cache_dir;                          /**< where to save HTTP cached data						*/
+	gboolean map_shared_images;                     /**< build maps once and share them between workers		*/
+	guint map_load_threads;                         /**< threads used to preload maps, 1 to load serially	*/
 
 	gdouble monitored_interval;                     /**< interval between monitored checks					*/
 	gboolean disable_monitored;                     /**< disable monitoring completely						*/
@@ -432,6 +439,7 @@ struct rspamd_config {
 	gchar * history_file;                           /**< file to save rolling history						*/
 	gchar * tld_file;                               /**< file to load effective tld list from				*/
 	gchar * hs_cache_dir;                           /**< directory to save hyperscan databases				*/
+	gdouble hs_map_cache_expire;                    /**< remove unused hyperscan databases of maps after	*/
 	gchar * magic_file;                             /**< file to initialize libmagic						*/
 
 	gdouble dns_timeout;                            /**< timeout in milliseconds for waiting for dns reply	*/
@@ -480,6 +488,7 @@ struct rspamd_config {
 	gchar *ssl_ciphers;								/**< set of preferred ciphers							*/
 	gchar *zstd_input_dictionary;					/**< path to zstd input dictionary						*/
 	gchar *zstd_output_dictionary;					/**< path to zstd output dictionary						*/
+	gchar *events_backend;							/**< preferred event loop backend						*/
 	ucl_object_t *neighbours;						/**< other servers in the cluster						*/
 
 	struct rspamd_config_settings_elt *setting_ids;	/**< preprocessed settings ids							*/
@@ -795,6 +804,14 @@ struct rspamd_action * rspamd_config_get_action (struct rspamd_config *cfg,
 struct rspamd_action * rspamd_config_get_action_by_type (struct rspamd_config *cfg,
 												 enum rspamd_action_type type);
 
+/**
+ * Returns libev backend flags for `events_backend` option, io_uring is used
+ * only if it is requested explicitly as it requires a recent kernel
+ * @param cfg
+ * @return flags for ev_loop_new or 0 to use the default backends
+ */
+guint rspamd_config_ev_backend_get (struct rspamd_config *cfg);
+
 #define msg_err_config(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         cfg->cfg_pool->tag.tagname, cfg->checksum, \
         G_STRFUNC, \
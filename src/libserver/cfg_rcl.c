@@ -1113,7 +1113,11 @@ rspamd_rcl_statfile_handler (rspamd_mempool_t *pool, const ucl_object_t *obj,
 		st->clcf = ccf;
 
 		val = ucl_object_lookup (obj, "spam");
-		if (val == NULL) {
+		if (val == NULL && st->class_name != NULL) {
+			/* Multi-class statfile, spam only if it is explicitly named so */
+			st->is_spam = g_ascii_strcasecmp (st->class_name, "spam") == 0;
+		}
+		else if (val == NULL) {
 			msg_info_config (
 				"statfile %s has no explicit 'spam' setting, trying to guess by symbol",
 				st->symbol);
@@ -1885,6 +1889,18 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, maps_cache_dir),
 				0,
 				"Directory to save maps cached data (default: $DBDIR)");
+		rspamd_rcl_add_default_handler (sub,
+				"map_shared_images",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_config, map_shared_images),
+				0,
+				"Build maps data once and share read only images with all workers");
+		rspamd_rcl_add_default_handler (sub,
+				"map_load_threads",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, map_load_threads),
+				RSPAMD_CL_FLAG_UINT,
+				"Number of threads used to read maps at start (1 to read them serially)");
 		rspamd_rcl_add_default_handler (sub,
 				"monitoring_watch_interval",
 				rspamd_rcl_parse_struct_time,
@@ -1969,6 +1985,12 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, hs_cache_dir),
 				RSPAMD_CL_FLAG_STRING_PATH,
 				"Path directory where rspamd would save hyperscan cache");
+		rspamd_rcl_add_default_handler (sub,
+				"hs_map_cache_expire",
+				rspamd_rcl_parse_struct_time,
+				G_STRUCT_OFFSET (struct rspamd_config, hs_map_cache_expire),
+				RSPAMD_CL_FLAG_TIME_FLOAT,
+				"Remove hyperscan cache of regexp maps unused for this time (0 to keep forever)");
 		rspamd_rcl_add_default_handler (sub,
 				"history_rows",
 				rspamd_rcl_parse_struct_integer,
@@ -2047,6 +2069,12 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, ssl_ciphers),
 				0,
 				"List of ssl ciphers (e.g. HIGH:!aNULL:!kRSA:!PSK:!SRP:!MD5:!RC4)");
+		rspamd_rcl_add_default_handler (sub,
+				"events_backend",
+				rspamd_rcl_parse_struct_string,
+				G_STRUCT_OFFSET (struct rspamd_config, events_backend),
+				0,
+				"Events backend to use: auto, epoll, iouring, kqueue, poll or select");
 		rspamd_rcl_add_default_handler (sub,
 				"magic_file",
 				rspamd_rcl_parse_struct_string,
@@ -2416,6 +2444,12 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_statfile_config, is_spam),
 				0,
 				"Sets if this statfile contains spam samples");
+		rspamd_rcl_add_default_handler (ssub,
+				"class",
+				rspamd_rcl_parse_struct_string,
+				G_STRUCT_OFFSET (struct rspamd_statfile_config, class_name),
+				0,
+				"Sets class of this statfile for multi-class classifiers");
 	}
 
 	if (!(skip_sections && g_hash_table_lookup (skip_sections, "composite"))) {
@@ -31,6 +31,7 @@
 #include "libutil/multipattern.h"
 #include "monitored.h"
 #include "ref.h"
+#include "contrib/libev/ev.h"
 #include <math.h>
 
 #define DEFAULT_SCORE 10.0
@@ -39,6 +40,8 @@
 #define DEFAULT_RLIMIT_MAXCORE 0
 #define DEFAULT_MAP_TIMEOUT 60.0 * 5
 #define DEFAULT_MAP_FILE_WATCH_MULTIPLIER 1
+#define DEFAULT_MAP_LOAD_THREADS 4
+#define DEFAULT_HS_MAP_CACHE_EXPIRE 86400.0 * 7
 #define DEFAULT_MIN_WORD 0
 #define DEFAULT_MAX_WORD 40
 #define DEFAULT_WORDS_DECAY 600
@@ -178,6 +181,8 @@ rspamd_config_new (enum rspamd_config_init_flags flags)
 
 	cfg->map_timeout = DEFAULT_MAP_TIMEOUT;
 	cfg->map_file_watch_multiplier = DEFAULT_MAP_FILE_WATCH_MULTIPLIER;
+	cfg->map_load_threads = DEFAULT_MAP_LOAD_THREADS;
+	cfg->hs_map_cache_expire = DEFAULT_HS_MAP_CACHE_EXPIRE;
 
 	cfg->log_level = G_LOG_LEVEL_WARNING;
 	cfg->log_flags = RSPAMD_LOG_FLAG_DEFAULT;
@@ -2116,6 +2121,53 @@ rspamd_config_get_action_by_type (struct rspamd_config *cfg,
 	return NULL;
 }
 
+guint
+rspamd_config_ev_backend_get (struct rspamd_config *cfg)
+{
+	static const struct {
+		const gchar *name;
+		guint flag;
+	} backends[] = {
+		{"epoll", EVBACKEND_EPOLL},
+		{"iouring", EVBACKEND_IOURING},
+		{"io_uring", EVBACKEND_IOURING},
+		{"kqueue", EVBACKEND_KQUEUE},
+		{"poll", EVBACKEND_POLL},
+		{"select", EVBACKEND_SELECT},
+	};
+	guint i;
+
+	if (cfg == NULL || cfg->events_backend == NULL ||
+			strcmp (cfg->events_backend, "auto") == 0) {
+		return 0;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (backends); i ++) {
+		if (strcmp (cfg->events_backend, backends[i].name) != 0) {
+			continue;
+		}
+
+		if (!(ev_supported_backends () & backends[i].flag)) {
+			msg_warn_config ("unsupported events_backend: %s; defaulting to auto",
+					cfg->events_backend);
+
+			return 0;
+		}
+
+		if (backends[i].flag == EVBACKEND_IOURING) {
+			/* Fall back to the default backends on old kernels */
+			return EVBACKEND_IOURING | ev_recommended_backends ();
+		}
+
+		return backends[i].flag;
+	}
+
+	msg_warn_config ("unknown events_backend: %s; defaulting to auto",
+			cfg->events_backend);
+
+	return 0;
+}
+
 gboolean
 rspamd_config_radix_from_ucl (struct rspamd_config *cfg,
 		const ucl_object_t *obj,
@@ -37,6 +37,9 @@
 #define RSPAMD_MEMPOOL_ARC_SIGN_KEY "arc_key"
 #define RSPAMD_MEMPOOL_ARC_SIGN_SELECTOR "arc_selector"
 #define RSPAMD_MEMPOOL_STAT_SIGNATURE "stat_signature"
+#define RSPAMD_MEMPOOL_STAT_LEARN_CLASS "stat_learn_class"
+#define RSPAMD_MEMPOOL_STAT_UNLEARN_CLASS "stat_unlearn_class"
+#define RSPAMD_MEMPOOL_STAT_CLASS "stat_class"
 #define RSPAMD_MEMPOOL_FUZZY_RESULT "fuzzy_hashes"
 
 #endif
@@ -26,6 +26,7 @@
 #include "unix-std.h"
 #include "protocol_internal.h"
 #include "libserver/mempool_vars_internal.h"
+#include "libserver/worker_util.h"
 #include "task.h"
 #include <math.h>
 
@@ -55,10 +56,10 @@ rspamd_protocol_quark (void)
 }
 
 /*
- * Remove <> from the fixed string and copy it to the pool
+ * Remove <> from the token and copy it to the pool
  */
 static gchar *
-rspamd_protocol_escape_braces (struct rspamd_task *task, rspamd_fstring_t *in)
+rspamd_protocol_escape_braces (struct rspamd_task *task, const rspamd_ftok_t *in)
 {
 	guint nchars = 0;
 	const gchar *p;
@@ -68,7 +69,7 @@ rspamd_protocol_escape_braces (struct rspamd_task *task, rspamd_fstring_t *in)
 	g_assert (in != NULL);
 	g_assert (in->len > 0);
 
-	p = in->str;
+	p = in->begin;
 
 	while ((g_ascii_isspace (*p) || *p == '<') && nchars < in->len) {
 		if (*p == '<') {
@@ -81,7 +82,7 @@ rspamd_protocol_escape_braces (struct rspamd_task *task, rspamd_fstring_t *in)
 
 	tok.begin = p;
 
-	p = in->str + in->len - 1;
+	p = in->begin + in->len - 1;
 	tok.len = in->len - nchars;
 
 	while (g_ascii_isspace (*p) && tok.len > 0) {
@@ -208,6 +209,12 @@ rspamd_protocol_handle_url (struct rspamd_task *task,
 			value = v;
 			/* Steal strings */
 			g_hash_table_iter_steal (&it);
+			rspamd_mempool_add_destructor (task->task_pool,
+					(rspamd_mempool_destruct_t)rspamd_fstring_mapped_ftok_free,
+					key);
+			rspamd_mempool_add_destructor (task->task_pool,
+					(rspamd_mempool_destruct_t)rspamd_fstring_mapped_ftok_free,
+					value);
 			rspamd_task_add_request_header (task, key, value);
 			msg_debug_protocol ("added header \"%T\" -> \"%T\" from HTTP query",
 					key, value);
@@ -335,261 +342,428 @@ rspamd_protocol_process_recipients (struct rspamd_task *task,
 	}
 }
 
-#define IF_HEADER(name) \
-	srch.begin = (name); \
-	srch.len = sizeof (name) - 1; \
-	if (rspamd_ftok_casecmp (hn_tok, &srch) == 0)
+enum rspamd_protocol_header_type {
+	RSPAMD_PROTOCOL_HDR_UNKNOWN = 0,
+	RSPAMD_PROTOCOL_HDR_DELIVER_TO,
+	RSPAMD_PROTOCOL_HDR_HELO,
+	RSPAMD_PROTOCOL_HDR_HOSTNAME,
+	RSPAMD_PROTOCOL_HDR_FROM,
+	RSPAMD_PROTOCOL_HDR_FILENAME,
+	RSPAMD_PROTOCOL_HDR_JSON,
+	RSPAMD_PROTOCOL_HDR_QUEUE_ID,
+	RSPAMD_PROTOCOL_HDR_RCPT,
+	RSPAMD_PROTOCOL_HDR_RAW_DATA,
+	RSPAMD_PROTOCOL_HDR_IP_ADDR,
+	RSPAMD_PROTOCOL_HDR_PASS,
+	RSPAMD_PROTOCOL_HDR_PROFILE,
+	RSPAMD_PROTOCOL_HDR_SUBJECT,
+	RSPAMD_PROTOCOL_HDR_SETTINGS_ID,
+	RSPAMD_PROTOCOL_HDR_USER,
+	RSPAMD_PROTOCOL_HDR_URLS,
+	RSPAMD_PROTOCOL_HDR_USER_AGENT,
+	RSPAMD_PROTOCOL_HDR_NO_LOG,
+	RSPAMD_PROTOCOL_HDR_MLEN,
+	RSPAMD_PROTOCOL_HDR_MTA_TAG,
+	RSPAMD_PROTOCOL_HDR_MTA_NAME,
+	RSPAMD_PROTOCOL_HDR_MILTER,
+	RSPAMD_PROTOCOL_HDR_TLS_CIPHER,
+	RSPAMD_PROTOCOL_HDR_ACCEPT,
+	RSPAMD_PROTOCOL_HDR_REPLY_SECTIONS,
+};
+
+struct rspamd_protocol_header_elt {
+	const gchar *name;
+	guint len;
+	enum rspamd_protocol_header_type type;
+};
+
+#define RSPAMD_PROTOCOL_HEADER(id) { \
+	id##_HEADER, sizeof (id##_HEADER) - 1, RSPAMD_PROTOCOL_HDR_##id }
+#define RSPAMD_PROTOCOL_HEADERS_MASK 31
+
+/*
+ * Perfect hash of the known headers: slot is defined by the length of a
+ * header name plus weights of its first, second and last characters (case
+ * insensitive), see rspamd_protocol_header_type. Weights are selected so
+ * that all headers below have distinct slots, they should be recalculated
+ * if a new header is added. A new header should be also added to
+ * test/rspamd_protocol_test.c that checks slots of all known headers.
+ */
+static const guchar rspamd_protocol_header_weights[256] = {
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0, 21,  0, 16, 29, 23, 30, 16, 18, 30,  7,  0,  1,  8, 21, 27,
+	10, 10, 31, 18, 27,  9,  0,  5,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0, 21,  0, 16, 29, 23, 30, 16, 18, 30,  7,  0,  1,  8, 21, 27,
+	10, 10, 31, 18, 27,  9,  0,  5,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+};
+
+static const struct rspamd_protocol_header_elt
+		rspamd_protocol_headers[RSPAMD_PROTOCOL_HEADERS_MASK + 1] = {
+	[0] = RSPAMD_PROTOCOL_HEADER (USER_AGENT),
+	[2] = RSPAMD_PROTOCOL_HEADER (MTA_NAME),
+	[5] = RSPAMD_PROTOCOL_HEADER (TLS_CIPHER),
+	[6] = RSPAMD_PROTOCOL_HEADER (ACCEPT),
+	[7] = RSPAMD_PROTOCOL_HEADER (PROFILE),
+	[8] = RSPAMD_PROTOCOL_HEADER (HELO),
+	[9] = RSPAMD_PROTOCOL_HEADER (FROM),
+	[11] = RSPAMD_PROTOCOL_HEADER (MILTER),
+	[12] = RSPAMD_PROTOCOL_HEADER (HOSTNAME),
+	[13] = RSPAMD_PROTOCOL_HEADER (URLS),
+	[14] = RSPAMD_PROTOCOL_HEADER (RCPT),
+	[15] = RSPAMD_PROTOCOL_HEADER (NO_LOG),
+	[17] = RSPAMD_PROTOCOL_HEADER (SETTINGS_ID),
+	[18] = RSPAMD_PROTOCOL_HEADER (JSON),
+	[20] = RSPAMD_PROTOCOL_HEADER (IP_ADDR),
+	[21] = RSPAMD_PROTOCOL_HEADER (PASS),
+	[22] = RSPAMD_PROTOCOL_HEADER (REPLY_SECTIONS),
+	[24] = RSPAMD_PROTOCOL_HEADER (QUEUE_ID),
+	[25] = RSPAMD_PROTOCOL_HEADER (DELIVER_TO),
+	[26] = RSPAMD_PROTOCOL_HEADER (MTA_TAG),
+	[27] = RSPAMD_PROTOCOL_HEADER (FILENAME),
+	[28] = RSPAMD_PROTOCOL_HEADER (RAW_DATA),
+	[29] = RSPAMD_PROTOCOL_HEADER (SUBJECT),
+	[30] = RSPAMD_PROTOCOL_HEADER (USER),
+	[31] = RSPAMD_PROTOCOL_HEADER (MLEN),
+};
+
+static inline enum rspamd_protocol_header_type
+rspamd_protocol_header_type (const rspamd_ftok_t *name)
+{
+	const guchar *p = (const guchar *)name->begin;
+	const struct rspamd_protocol_header_elt *elt;
+	guint slot;
+
+	if (name->len < 2) {
+		return RSPAMD_PROTOCOL_HDR_UNKNOWN;
+	}
+
+	slot = (name->len +
+			rspamd_protocol_header_weights[p[0]] +
+			rspamd_protocol_header_weights[p[1]] +
+			rspamd_protocol_header_weights[p[name->len - 1]]) &
+			RSPAMD_PROTOCOL_HEADERS_MASK;
+	elt = &rspamd_protocol_headers[slot];
+
+	if (elt->len == name->len &&
+			rspamd_lc_cmp (name->begin, elt->name, elt->len) == 0) {
+		return elt->type;
+	}
+
+	return RSPAMD_PROTOCOL_HDR_UNKNOWN;
+}
+
+gint
+rspamd_protocol_header_id (const gchar *name, gsize len)
+{
+	rspamd_ftok_t tok;
+
+	tok.begin = name;
+	tok.len = len;
+
+	return rspamd_protocol_header_type (&tok);
+}
+
+static inline gboolean
+rspamd_protocol_value_is (const rspamd_ftok_t *value, const gchar *what,
+		gsize len)
+{
+	return value->len == len && rspamd_lc_cmp (value->begin, what, len) == 0;
+}
+
+static const struct rspamd_protocol_section {
+	const gchar *name;
+	enum rspamd_protocol_flags flags;
+} rspamd_protocol_sections[] = {
+	{"default", RSPAMD_PROTOCOL_DEFAULT},
+	{"all", RSPAMD_PROTOCOL_DEFAULT|RSPAMD_PROTOCOL_URLS},
+	{"basic", RSPAMD_PROTOCOL_BASIC},
+	{"action", RSPAMD_PROTOCOL_METRICS},
+	{"metrics", RSPAMD_PROTOCOL_METRICS|RSPAMD_PROTOCOL_SYMBOLS|
+			RSPAMD_PROTOCOL_SYMBOLS_DETAILS},
+	{"symbols", RSPAMD_PROTOCOL_SYMBOLS},
+	{"options", RSPAMD_PROTOCOL_SYMBOLS|RSPAMD_PROTOCOL_SYMBOLS_DETAILS},
+	{"messages", RSPAMD_PROTOCOL_MESSAGES},
+	{"milter", RSPAMD_PROTOCOL_RMILTER},
+	{"rmilter", RSPAMD_PROTOCOL_RMILTER},
+	{"dkim", RSPAMD_PROTOCOL_DKIM},
+	{"urls", RSPAMD_PROTOCOL_URLS},
+	{"extra", RSPAMD_PROTOCOL_EXTRA},
+};
+
+enum rspamd_protocol_flags
+rspamd_protocol_section_flags (const gchar *name, gsize len)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (rspamd_protocol_sections); i ++) {
+		if (strlen (rspamd_protocol_sections[i].name) == len &&
+				rspamd_lc_cmp (name, rspamd_protocol_sections[i].name,
+						len) == 0) {
+			return rspamd_protocol_sections[i].flags;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Parses a comma separated list of the requested reply sections, e.g.
+ * `Reply-Sections: action, symbols`
+ */
+static guint
+rspamd_protocol_parse_reply_sections (struct rspamd_task *task,
+		const rspamd_ftok_t *value)
+{
+	const gchar *p = value->begin, *end = value->begin + value->len, *c;
+	guint flags = 0, fl;
+
+	while (p < end) {
+		while (p < end && (*p == ',' || g_ascii_isspace (*p))) {
+			p ++;
+		}
+
+		c = p;
+
+		while (p < end && *p != ',' && !g_ascii_isspace (*p)) {
+			p ++;
+		}
+
+		if (p > c) {
+			fl = rspamd_protocol_section_flags (c, p - c);
+
+			if (fl == 0) {
+				msg_warn_protocol ("unknown reply section: %*s",
+						(gint)(p - c), c);
+			}
+
+			flags |= fl;
+		}
+	}
+
+	return flags;
+}
 
 gboolean
 rspamd_protocol_handle_headers (struct rspamd_task *task,
 	struct rspamd_http_message *msg)
 {
-	rspamd_fstring_t *hn, *hv;
-	rspamd_ftok_t *hn_tok, *hv_tok, srch;
+	rspamd_ftok_t *hn_tok, *hv_tok;
 	gboolean fl, has_ip = FALSE;
 	struct rspamd_http_header *header, *h, *htmp;
 
+	/* Request headers are kept as views of the message headers */
+	rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t)rspamd_http_message_unref,
+			rspamd_http_message_ref (msg));
+
 	HASH_ITER (hh, msg->headers, header, htmp) {
 		DL_FOREACH (header, h) {
-			hn = rspamd_fstring_new_init (h->name.begin, h->name.len);
-			hv = rspamd_fstring_new_init (h->value.begin, h->value.len);
-			hn_tok = rspamd_ftok_map (hn);
-			hv_tok = rspamd_ftok_map (hv);
-
-			switch (*hn_tok->begin) {
-			case 'd':
-			case 'D':
-				IF_HEADER (DELIVER_TO_HEADER) {
-					task->deliver_to = rspamd_protocol_escape_braces (task, hv);
-					msg_debug_protocol ("read deliver-to header, value: %s",
-							task->deliver_to);
-				}
-				else {
-					msg_debug_protocol ("wrong header: %V", hn);
-				}
+			hn_tok = rspamd_mempool_alloc (task->task_pool, sizeof (*hn_tok));
+			hv_tok = rspamd_mempool_alloc (task->task_pool, sizeof (*hv_tok));
+			*hn_tok = h->name;
+			*hv_tok = h->value;
+
+			switch (rspamd_protocol_header_type (hn_tok)) {
+			case RSPAMD_PROTOCOL_HDR_DELIVER_TO:
+				task->deliver_to = rspamd_protocol_escape_braces (task, hv_tok);
+				msg_debug_protocol ("read deliver-to header, value: %s",
+						task->deliver_to);
 				break;
-			case 'h':
-			case 'H':
-				IF_HEADER (HELO_HEADER) {
-					task->helo = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
-					msg_debug_protocol ("read helo header, value: %s", task->helo);
-				}
-				IF_HEADER (HOSTNAME_HEADER) {
-					task->hostname = rspamd_mempool_ftokdup (task->task_pool,
-							hv_tok);
-					msg_debug_protocol ("read hostname header, value: %s", task->hostname);
-				}
+			case RSPAMD_PROTOCOL_HDR_HELO:
+				task->helo = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
+				msg_debug_protocol ("read helo header, value: %s", task->helo);
 				break;
-			case 'f':
-			case 'F':
-				IF_HEADER (FROM_HEADER) {
-					task->from_envelope = rspamd_email_address_from_smtp (hv->str,
-							hv->len);
-					msg_debug_protocol ("read from header, value: %V", hv);
-
-					if (!task->from_envelope) {
-						msg_err_protocol ("bad from header: '%V'", hv);
-						task->flags |= RSPAMD_TASK_FLAG_BROKEN_HEADERS;
-					}
-				}
-				IF_HEADER (FILENAME_HEADER) {
-					task->msg.fpath = rspamd_mempool_ftokdup (task->task_pool,
-							hv_tok);
-					msg_debug_protocol ("read filename header, value: %s", task->msg.fpath);
-				}
+			case RSPAMD_PROTOCOL_HDR_HOSTNAME:
+				task->hostname = rspamd_mempool_ftokdup (task->task_pool,
+						hv_tok);
+				msg_debug_protocol ("read hostname header, value: %s", task->hostname);
 				break;
-			case 'j':
-			case 'J':
-				IF_HEADER (JSON_HEADER) {
-					msg_debug_protocol ("read json header, value: %V", hv);
-					fl = rspamd_config_parse_flag (hv->str, hv->len);
-					if (fl) {
-						task->flags |= RSPAMD_TASK_FLAG_JSON;
-					}
-					else {
-						task->flags &= ~RSPAMD_TASK_FLAG_JSON;
-					}
-				}
-				else {
-					msg_debug_protocol ("wrong header: %V", hn);
+			case RSPAMD_PROTOCOL_HDR_FROM:
+				task->from_envelope = rspamd_email_address_from_smtp (hv_tok->begin,
+						hv_tok->len);
+				msg_debug_protocol ("read from header, value: %T", hv_tok);
+
+				if (!task->from_envelope) {
+					msg_err_protocol ("bad from header: '%T'", hv_tok);
+					task->flags |= RSPAMD_TASK_FLAG_BROKEN_HEADERS;
 				}
 				break;
-			case 'q':
-			case 'Q':
-				IF_HEADER (QUEUE_ID_HEADER) {
-					task->queue_id = rspamd_mempool_ftokdup (task->task_pool,
-							hv_tok);
-					msg_debug_protocol ("read queue_id header, value: %s", task->queue_id);
+			case RSPAMD_PROTOCOL_HDR_FILENAME:
+				task->msg.fpath = rspamd_mempool_ftokdup (task->task_pool,
+						hv_tok);
+				msg_debug_protocol ("read filename header, value: %s", task->msg.fpath);
+				break;
+			case RSPAMD_PROTOCOL_HDR_JSON:
+				msg_debug_protocol ("read json header, value: %T", hv_tok);
+				fl = rspamd_config_parse_flag (hv_tok->begin, hv_tok->len);
+				if (fl) {
+					task->flags |= RSPAMD_TASK_FLAG_JSON;
 				}
 				else {
-					msg_debug_protocol ("wrong header: %V", hn);
+					task->flags &= ~RSPAMD_TASK_FLAG_JSON;
 				}
 				break;
-			case 'r':
-			case 'R':
-				IF_HEADER (RCPT_HEADER) {
-					rspamd_protocol_process_recipients (task, hv_tok);
-					msg_debug_protocol ("read rcpt header, value: %V", hv);
-				}
-				IF_HEADER (RAW_DATA_HEADER) {
-					srch.begin = "yes";
-					srch.len = 3;
-
-					msg_debug_protocol ("read raw data header, value: %V", hv);
+			case RSPAMD_PROTOCOL_HDR_QUEUE_ID:
+				task->queue_id = rspamd_mempool_ftokdup (task->task_pool,
+						hv_tok);
+				msg_debug_protocol ("read queue_id header, value: %s", task->queue_id);
+				break;
+			case RSPAMD_PROTOCOL_HDR_RCPT:
+				rspamd_protocol_process_recipients (task, hv_tok);
+				msg_debug_protocol ("read rcpt header, value: %T", hv_tok);
+				break;
+			case RSPAMD_PROTOCOL_HDR_RAW_DATA:
+				msg_debug_protocol ("read raw data header, value: %T", hv_tok);
 
-					if (rspamd_ftok_casecmp (hv_tok, &srch) == 0) {
-						task->flags &= ~RSPAMD_TASK_FLAG_MIME;
-						msg_debug_protocol ("disable mime parsing");
-					}
+				if (rspamd_protocol_value_is (hv_tok, "yes", 3)) {
+					task->flags &= ~RSPAMD_TASK_FLAG_MIME;
+					msg_debug_protocol ("disable mime parsing");
 				}
 				break;
-			case 'i':
-			case 'I':
-				IF_HEADER (IP_ADDR_HEADER) {
-					if (!rspamd_parse_inet_address (&task->from_addr, hv->str, hv->len)) {
-						msg_err_protocol ("bad ip header: '%V'", hv);
-					}
-					else {
-						msg_debug_protocol ("read IP header, value: %V", hv);
-						has_ip = TRUE;
-					}
+			case RSPAMD_PROTOCOL_HDR_IP_ADDR:
+				if (!rspamd_parse_inet_address (&task->from_addr, hv_tok->begin,
+						hv_tok->len)) {
+					msg_err_protocol ("bad ip header: '%T'", hv_tok);
 				}
 				else {
-					msg_debug_protocol ("wrong header: %V", hn);
+					msg_debug_protocol ("read IP header, value: %T", hv_tok);
+					has_ip = TRUE;
 				}
 				break;
-			case 'p':
-			case 'P':
-				IF_HEADER (PASS_HEADER) {
-					srch.begin = "all";
-					srch.len = 3;
+			case RSPAMD_PROTOCOL_HDR_PASS:
+				msg_debug_protocol ("read pass header, value: %T", hv_tok);
 
-					msg_debug_protocol ("read pass header, value: %V", hv);
+				if (rspamd_protocol_value_is (hv_tok, "all", 3)) {
+					task->flags |= RSPAMD_TASK_FLAG_PASS_ALL;
+					msg_debug_protocol ("pass all filters");
+				}
+				break;
+			case RSPAMD_PROTOCOL_HDR_PROFILE:
+				msg_debug_protocol ("read profile header, value: %T", hv_tok);
+				task->flags |= RSPAMD_TASK_FLAG_PROFILE;
+				break;
+			case RSPAMD_PROTOCOL_HDR_SUBJECT:
+				msg_debug_protocol ("read subject header, value: %T", hv_tok);
+				task->subject = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
+				break;
+			case RSPAMD_PROTOCOL_HDR_SETTINGS_ID:
+				msg_debug_protocol ("read settings-id header, value: %T", hv_tok);
+				task->settings_elt = rspamd_config_find_settings_name_ref (
+						task->cfg, hv_tok->begin, hv_tok->len);
 
-					if (rspamd_ftok_casecmp (hv_tok, &srch) == 0) {
-						task->flags |= RSPAMD_TASK_FLAG_PASS_ALL;
-						msg_debug_protocol ("pass all filters");
-					}
+				if (task->settings_elt == NULL) {
+					msg_warn_protocol ("unknown settings id: %T",
+							hv_tok);
 				}
-				IF_HEADER (PROFILE_HEADER) {
-					msg_debug_protocol ("read profile header, value: %V", hv);
-					task->flags |= RSPAMD_TASK_FLAG_PROFILE;
+				else {
+					msg_debug_protocol ("applied settings id %T -> %ud", hv_tok,
+							task->settings_elt->id);
 				}
 				break;
-			case 's':
-			case 'S':
-				IF_HEADER (SUBJECT_HEADER) {
-					msg_debug_protocol ("read subject header, value: %V", hv);
-					task->subject = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
+			case RSPAMD_PROTOCOL_HDR_USER:
+				/*
+				 * We must ignore User header in case of spamc, as SA has
+				 * different meaning of this header
+				 */
+				msg_debug_protocol ("read user header, value: %T", hv_tok);
+				if (!RSPAMD_TASK_IS_SPAMC (task)) {
+					task->user = rspamd_mempool_ftokdup (task->task_pool,
+							hv_tok);
 				}
-				IF_HEADER (SETTINGS_ID_HEADER) {
-					msg_debug_protocol ("read settings-id header, value: %V", hv);
-					task->settings_elt = rspamd_config_find_settings_name_ref (
-							task->cfg, hv_tok->begin, hv_tok->len);
-
-					if (task->settings_elt == NULL) {
-						msg_warn_protocol ("unknown settings id: %V",
-								hv);
-					}
-					else {
-						msg_debug_protocol ("applied settings id %V -> %ud", hv,
-								task->settings_elt->id);
-					}
+				else {
+					msg_info_protocol ("ignore user header: legacy SA protocol");
 				}
 				break;
-			case 'u':
-			case 'U':
-				IF_HEADER (USER_HEADER) {
-					/*
-					 * We must ignore User header in case of spamc, as SA has
-					 * different meaning of this header
-					 */
-					msg_debug_protocol ("read user header, value: %V", hv);
-					if (!RSPAMD_TASK_IS_SPAMC (task)) {
-						task->user = rspamd_mempool_ftokdup (task->task_pool,
-								hv_tok);
-					}
-					else {
-						msg_info_protocol ("ignore user header: legacy SA protocol");
-					}
-				}
-				IF_HEADER (URLS_HEADER) {
-					msg_debug_protocol ("read urls header, value: %V", hv);
+			case RSPAMD_PROTOCOL_HDR_URLS:
+				msg_debug_protocol ("read urls header, value: %T", hv_tok);
 
-					srch.begin = "extended";
-					srch.len = 8;
-
-					if (rspamd_ftok_casecmp (hv_tok, &srch) == 0) {
-						task->flags |= RSPAMD_TASK_FLAG_EXT_URLS;
-						msg_debug_protocol ("extended urls information");
-					}
-
-					/* TODO: add more formats there */
+				if (rspamd_protocol_value_is (hv_tok, "extended", 8)) {
+					task->flags |= RSPAMD_TASK_FLAG_EXT_URLS;
+					msg_debug_protocol ("extended urls information");
 				}
-				IF_HEADER (USER_AGENT_HEADER) {
-					msg_debug_protocol ("read user-agent header, value: %V", hv);
 
-					if (hv_tok->len == 6 &&
-							rspamd_lc_cmp (hv_tok->begin, "rspamc", 6) == 0) {
-						task->flags |= RSPAMD_TASK_FLAG_LOCAL_CLIENT;
-					}
-				}
+				/* TODO: add more formats there */
 				break;
-			case 'l':
-			case 'L':
-				IF_HEADER (NO_LOG_HEADER) {
-					msg_debug_protocol ("read log header, value: %V", hv);
-					srch.begin = "no";
-					srch.len = 2;
-
-					if (rspamd_ftok_casecmp (hv_tok, &srch) == 0) {
-						task->flags |= RSPAMD_TASK_FLAG_NO_LOG;
-					}
+			case RSPAMD_PROTOCOL_HDR_USER_AGENT:
+				msg_debug_protocol ("read user-agent header, value: %T", hv_tok);
+
+				if (rspamd_protocol_value_is (hv_tok, "rspamc", 6)) {
+					task->flags |= RSPAMD_TASK_FLAG_LOCAL_CLIENT;
 				}
 				break;
-			case 'm':
-			case 'M':
-				IF_HEADER (MLEN_HEADER) {
-					msg_debug_protocol ("read message length header, value: %V", hv);
-					if (!rspamd_strtoul (hv_tok->begin,
-							hv_tok->len,
-							&task->message_len)) {
-						msg_err_protocol ("Invalid message length header: %V", hv);
-					}
-					else {
-						task->flags |= RSPAMD_TASK_FLAG_HAS_CONTROL;
-					}
-				}
-				IF_HEADER (MTA_TAG_HEADER) {
-					gchar *mta_tag;
-					mta_tag = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
-					rspamd_mempool_set_variable (task->task_pool,
-							RSPAMD_MEMPOOL_MTA_TAG,
-							mta_tag, NULL);
-					msg_debug_protocol ("read MTA-Tag header, value: %s", mta_tag);
+			case RSPAMD_PROTOCOL_HDR_NO_LOG:
+				msg_debug_protocol ("read log header, value: %T", hv_tok);
+
+				if (rspamd_protocol_value_is (hv_tok, "no", 2)) {
+					task->flags |= RSPAMD_TASK_FLAG_NO_LOG;
 				}
-				IF_HEADER (MTA_NAME_HEADER) {
-					gchar *mta_name;
-					mta_name = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
-					rspamd_mempool_set_variable (task->task_pool,
-							RSPAMD_MEMPOOL_MTA_NAME,
-							mta_name, NULL);
-					msg_debug_protocol ("read MTA-Name header, value: %s", mta_name);
+				break;
+			case RSPAMD_PROTOCOL_HDR_MLEN:
+				msg_debug_protocol ("read message length header, value: %T",
+						hv_tok);
+				if (!rspamd_strtoul (hv_tok->begin,
+						hv_tok->len,
+						&task->message_len)) {
+					msg_err_protocol ("Invalid message length header: %T", hv_tok);
 				}
-				IF_HEADER (MILTER_HEADER) {
-					task->flags |= RSPAMD_TASK_FLAG_MILTER;
-					msg_debug_protocol ("read Milter header, value: %V", hv);
+				else {
+					task->flags |= RSPAMD_TASK_FLAG_HAS_CONTROL;
 				}
 				break;
-			case 't':
-			case 'T':
-				IF_HEADER (TLS_CIPHER_HEADER) {
-					task->flags |= RSPAMD_TASK_FLAG_SSL;
-					msg_debug_protocol ("read TLS cipher header, value: %V", hv);
+			case RSPAMD_PROTOCOL_HDR_MTA_TAG: {
+				gchar *mta_tag;
+				mta_tag = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
+				rspamd_mempool_set_variable (task->task_pool,
+						RSPAMD_MEMPOOL_MTA_TAG,
+						mta_tag, NULL);
+				msg_debug_protocol ("read MTA-Tag header, value: %s", mta_tag);
+				break;
+			}
+			case RSPAMD_PROTOCOL_HDR_MTA_NAME: {
+				gchar *mta_name;
+				mta_name = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
+				rspamd_mempool_set_variable (task->task_pool,
+						RSPAMD_MEMPOOL_MTA_NAME,
+						mta_name, NULL);
+				msg_debug_protocol ("read MTA-Name header, value: %s", mta_name);
+				break;
+			}
+			case RSPAMD_PROTOCOL_HDR_MILTER:
+				task->flags |= RSPAMD_TASK_FLAG_MILTER;
+				msg_debug_protocol ("read Milter header, value: %T", hv_tok);
+				break;
+			case RSPAMD_PROTOCOL_HDR_TLS_CIPHER:
+				task->flags |= RSPAMD_TASK_FLAG_SSL;
+				msg_debug_protocol ("read TLS cipher header, value: %T", hv_tok);
+				break;
+			case RSPAMD_PROTOCOL_HDR_ACCEPT:
+				msg_debug_protocol ("read accept header, value: %T", hv_tok);
+
+				if (rspamd_substring_search_caseless (hv_tok->begin, hv_tok->len,
+						RSPAMD_PROTOCOL_MSGPACK_CTYPE,
+						sizeof (RSPAMD_PROTOCOL_MSGPACK_CTYPE) - 1) != -1) {
+					task->reply_format = RSPAMD_TASK_REPLY_MSGPACK;
 				}
 				break;
+			case RSPAMD_PROTOCOL_HDR_REPLY_SECTIONS:
+				msg_debug_protocol ("read reply sections header, value: %T",
+						hv_tok);
+				task->reply_sections = rspamd_protocol_parse_reply_sections (task,
+						hv_tok);
+				break;
 			default:
-				msg_debug_protocol ("generic header: %V", hn);
+				msg_debug_protocol ("generic header: %T", hn_tok);
 				break;
 			}
 
@@ -744,48 +918,254 @@ rspamd_protocol_handle_request (struct rspamd_task *task,
 	return ret;
 }
 
-/* Structure for writing tree data */
-struct tree_cb_data {
+/*
+ * Reply writer: the same field emitters either build the UCL reply object or
+ * write msgpack reply directly to the output buffer, so binary replies are
+ * produced without the intermediate UCL tree. Msgpack maps and arrays always
+ * use 32 bit length which is updated when a container is finished, so
+ * elements are not counted in advance.
+ */
+#define RSPAMD_MSGPACK_FALSE 0xc2
+#define RSPAMD_MSGPACK_TRUE 0xc3
+#define RSPAMD_MSGPACK_FLOAT64 0xcb
+#define RSPAMD_MSGPACK_FIXSTR 0xa0
+#define RSPAMD_MSGPACK_STR8 0xd9
+#define RSPAMD_MSGPACK_STR16 0xda
+#define RSPAMD_MSGPACK_STR32 0xdb
+#define RSPAMD_MSGPACK_ARRAY32 0xdd
+#define RSPAMD_MSGPACK_MAP32 0xdf
+#define RSPAMD_PROTOCOL_WRITER_MAX_DEPTH 16
+
+struct rspamd_msgpack_container {
+	gsize pos;
+	guint32 nelts;
+};
+
+struct rspamd_protocol_writer {
+	/* Msgpack output if not NULL, UCL object is built otherwise */
+	rspamd_fstring_t **out;
 	ucl_object_t *top;
+	ucl_object_t *objs[RSPAMD_PROTOCOL_WRITER_MAX_DEPTH];
+	struct rspamd_msgpack_container containers[RSPAMD_PROTOCOL_WRITER_MAX_DEPTH];
+	guint depth;
+};
+
+static void
+rspamd_msgpack_str (rspamd_fstring_t **out, const gchar *s, gsize len)
+{
+	guchar hdr[5];
+	gsize hlen;
+
+	if (len < 32) {
+		hdr[0] = RSPAMD_MSGPACK_FIXSTR | len;
+		hlen = 1;
+	}
+	else if (len <= G_MAXUINT8) {
+		hdr[0] = RSPAMD_MSGPACK_STR8;
+		hdr[1] = len;
+		hlen = 2;
+	}
+	else if (len <= G_MAXUINT16) {
+		guint16 l = GUINT16_TO_BE (len);
+
+		hdr[0] = RSPAMD_MSGPACK_STR16;
+		memcpy (hdr + 1, &l, sizeof (l));
+		hlen = 3;
+	}
+	else {
+		guint32 l = GUINT32_TO_BE (len);
+
+		hdr[0] = RSPAMD_MSGPACK_STR32;
+		memcpy (hdr + 1, &l, sizeof (l));
+		hlen = 5;
+	}
+
+	*out = rspamd_fstring_append (*out, hdr, hlen);
+	*out = rspamd_fstring_append (*out, s, len);
+}
+
+/* Writes key of a msgpack map element and counts it in the container */
+static inline void
+rspamd_protocol_writer_key (struct rspamd_protocol_writer *w, const gchar *key)
+{
+	if (w->depth > 0) {
+		if (key) {
+			rspamd_msgpack_str (w->out, key, strlen (key));
+		}
+
+		w->containers[w->depth - 1].nelts ++;
+	}
+}
+
+/* Attaches UCL element to the current container */
+static inline void
+rspamd_protocol_writer_insert (struct rspamd_protocol_writer *w,
+		const gchar *key, ucl_object_t *obj)
+{
+	if (w->depth == 0) {
+		w->top = obj;
+	}
+	else if (key) {
+		ucl_object_insert_key (w->objs[w->depth - 1], obj, key, 0, false);
+	}
+	else {
+		ucl_array_append (w->objs[w->depth - 1], obj);
+	}
+}
+
+/*
+ * Starts a new object or array, key must be NULL for array elements
+ */
+static void
+rspamd_protocol_writer_start (struct rspamd_protocol_writer *w,
+		const gchar *key, ucl_type_t type)
+{
+	g_assert (w->depth < RSPAMD_PROTOCOL_WRITER_MAX_DEPTH);
+
+	if (w->out) {
+		struct rspamd_msgpack_container *c;
+		guchar hdr[5] = {0, 0, 0, 0, 0};
+
+		hdr[0] = type == UCL_ARRAY ? RSPAMD_MSGPACK_ARRAY32 :
+				RSPAMD_MSGPACK_MAP32;
+		rspamd_protocol_writer_key (w, key);
+		c = &w->containers[w->depth];
+		c->pos = (*w->out)->len;
+		c->nelts = 0;
+		*w->out = rspamd_fstring_append (*w->out, hdr, sizeof (hdr));
+	}
+	else {
+		ucl_object_t *obj = ucl_object_typed_new (type);
+
+		rspamd_protocol_writer_insert (w, key, obj);
+		w->objs[w->depth] = obj;
+	}
+
+	w->depth ++;
+}
+
+static void
+rspamd_protocol_writer_end (struct rspamd_protocol_writer *w)
+{
+	g_assert (w->depth > 0);
+	w->depth --;
+
+	if (w->out) {
+		struct rspamd_msgpack_container *c = &w->containers[w->depth];
+		guint32 n = GUINT32_TO_BE (c->nelts);
+
+		memcpy ((*w->out)->str + c->pos + 1, &n, sizeof (n));
+	}
+}
+
+static void
+rspamd_protocol_writer_lstring (struct rspamd_protocol_writer *w,
+		const gchar *key, const gchar *s, gsize len)
+{
+	if (w->out) {
+		rspamd_protocol_writer_key (w, key);
+		rspamd_msgpack_str (w->out, s, len);
+	}
+	else {
+		rspamd_protocol_writer_insert (w, key, ucl_object_fromlstring (s, len));
+	}
+}
+
+/* NULL strings are skipped just like NULL objects in ucl_object_insert_key */
+static inline void
+rspamd_protocol_writer_string (struct rspamd_protocol_writer *w,
+		const gchar *key, const gchar *s)
+{
+	if (s != NULL) {
+		rspamd_protocol_writer_lstring (w, key, s, strlen (s));
+	}
+}
+
+static void
+rspamd_protocol_writer_double (struct rspamd_protocol_writer *w,
+		const gchar *key, gdouble d)
+{
+	if (w->out) {
+		guchar buf[9];
+		guint64 v;
+
+		rspamd_protocol_writer_key (w, key);
+		memcpy (&v, &d, sizeof (v));
+		v = GUINT64_TO_BE (v);
+		buf[0] = RSPAMD_MSGPACK_FLOAT64;
+		memcpy (buf + 1, &v, sizeof (v));
+		*w->out = rspamd_fstring_append (*w->out, buf, sizeof (buf));
+	}
+	else {
+		rspamd_protocol_writer_insert (w, key, ucl_object_fromdouble (d));
+	}
+}
+
+static void
+rspamd_protocol_writer_bool (struct rspamd_protocol_writer *w,
+		const gchar *key, gboolean b)
+{
+	if (w->out) {
+		guchar c = b ? RSPAMD_MSGPACK_TRUE : RSPAMD_MSGPACK_FALSE;
+
+		rspamd_protocol_writer_key (w, key);
+		*w->out = rspamd_fstring_append (*w->out, &c, 1);
+	}
+	else {
+		rspamd_protocol_writer_insert (w, key, ucl_object_frombool (b));
+	}
+}
+
+/* Writes an existing UCL object, e.g. task messages or milter reply */
+static void
+rspamd_protocol_writer_ucl (struct rspamd_protocol_writer *w,
+		const gchar *key, const ucl_object_t *obj)
+{
+	if (w->out) {
+		rspamd_protocol_writer_key (w, key);
+		rspamd_ucl_emit_fstring (obj, UCL_EMIT_MSGPACK, w->out);
+	}
+	else {
+		rspamd_protocol_writer_insert (w, key, ucl_object_ref (obj));
+	}
+}
+
+struct tree_cb_data {
+	struct rspamd_protocol_writer *w;
 	GHashTable *seen;
 	struct rspamd_task *task;
 };
 
-static ucl_object_t *
+static void
 rspamd_protocol_extended_url (struct rspamd_task *task,
+		struct rspamd_protocol_writer *w, const gchar *key,
 		struct rspamd_url *url,
 		const gchar *encoded, gsize enclen)
 {
-	ucl_object_t *obj, *elt;
-
-	obj = ucl_object_typed_new (UCL_OBJECT);
-
-	elt = ucl_object_fromlstring (encoded, enclen);
-	ucl_object_insert_key (obj, elt, "url", 0, false);
+	rspamd_protocol_writer_start (w, key, UCL_OBJECT);
+	rspamd_protocol_writer_lstring (w, "url", encoded, enclen);
 
 	if (url->surbllen > 0) {
-		elt = ucl_object_fromlstring (url->surbl, url->surbllen);
-		ucl_object_insert_key (obj, elt, "surbl", 0, false);
+		rspamd_protocol_writer_lstring (w, "surbl", url->surbl,
+				url->surbllen);
 	}
 	if (url->hostlen > 0) {
-		elt = ucl_object_fromlstring (url->host, url->hostlen);
-		ucl_object_insert_key (obj, elt, "host", 0, false);
+		rspamd_protocol_writer_lstring (w, "host", url->host, url->hostlen);
 	}
 
-	elt = ucl_object_frombool (url->flags & RSPAMD_URL_FLAG_PHISHED);
-	ucl_object_insert_key (obj, elt, "phished", 0, false);
+	rspamd_protocol_writer_bool (w, "phished",
+			url->flags & RSPAMD_URL_FLAG_PHISHED);
+	rspamd_protocol_writer_bool (w, "redirected",
+			url->flags & RSPAMD_URL_FLAG_REDIRECTED);
 
-	elt = ucl_object_frombool (url->flags & RSPAMD_URL_FLAG_REDIRECTED);
-	ucl_object_insert_key (obj, elt, "redirected", 0, false);
-
-	if (url->phished_url) {
+	if (url->phished_url &&
+			w->depth < RSPAMD_PROTOCOL_WRITER_MAX_DEPTH) {
 		encoded = rspamd_url_encode (url->phished_url, &enclen, task->task_pool);
-		elt = rspamd_protocol_extended_url (task, url->phished_url, encoded,
-				enclen);
-		ucl_object_insert_key (obj, elt, "orig_url", 0, false);
+		rspamd_protocol_extended_url (task, w, "orig_url", url->phished_url,
+				encoded, enclen);
 	}
 
-	return obj;
+	rspamd_protocol_writer_end (w);
 }
 
 /*
@@ -796,11 +1176,8 @@ urls_protocol_cb (gpointer key, gpointer value, gpointer ud)
 {
 	struct tree_cb_data *cb = ud;
 	struct rspamd_url *url = value;
-	ucl_object_t *obj;
 	struct rspamd_task *task = cb->task;
-	const gchar *user_field = "unknown", *encoded = NULL;
-	gboolean has_user = FALSE;
-	guint len = 0;
+	const gchar *encoded;
 	gsize enclen = 0;
 
 	if (!(task->flags & RSPAMD_TASK_FLAG_EXT_URLS)) {
@@ -810,16 +1187,19 @@ urls_protocol_cb (gpointer key, gpointer value, gpointer ud)
 			}
 
 			const gchar *end = NULL;
+			gsize hostlen;
 
 			if (g_utf8_validate (url->host, url->hostlen, &end)) {
-				obj = ucl_object_fromlstring (url->host, url->hostlen);
+				hostlen = url->hostlen;
 			}
 			else if (end - url->host > 0) {
-				obj = ucl_object_fromlstring (url->host, end - url->host);
+				hostlen = end - url->host;
 			}
 			else {
 				return;
 			}
+
+			rspamd_protocol_writer_lstring (cb->w, NULL, url->host, hostlen);
 		}
 		else {
 			return;
@@ -829,51 +1209,82 @@ urls_protocol_cb (gpointer key, gpointer value, gpointer ud)
 	}
 	else {
 		encoded = rspamd_url_encode (url, &enclen, task->task_pool);
-		obj = rspamd_protocol_extended_url (task, url, encoded, enclen);
+		rspamd_protocol_extended_url (task, cb->w, NULL, url, encoded, enclen);
 	}
+}
 
-	ucl_array_append (cb->top, obj);
+/*
+ * Callback for logging urls, works regardless of the reply sections
+ */
+static void
+urls_log_cb (gpointer key, gpointer value, gpointer ud)
+{
+	struct tree_cb_data *cb = ud;
+	struct rspamd_url *url = value;
+	struct rspamd_task *task = cb->task;
+	const gchar *user_field = "unknown", *encoded;
+	gboolean has_user = FALSE;
+	guint len = 0;
+	gsize enclen = 0;
 
-	if (cb->task->cfg->log_urls) {
-		if (task->user) {
-			user_field = task->user;
-			len = strlen (task->user);
-			has_user = TRUE;
-		}
-		else if (task->from_envelope) {
-			user_field = task->from_envelope->addr;
-			len = task->from_envelope->addr_len;
+	if (!(task->flags & RSPAMD_TASK_FLAG_EXT_URLS)) {
+		/* Log the same urls as the hosts list in reply */
+		if (url->hostlen == 0 || g_hash_table_lookup (cb->seen, url)) {
+			return;
 		}
 
-		if (!encoded) {
-			encoded = rspamd_url_encode (url, &enclen, task->task_pool);
-		}
+		g_hash_table_insert (cb->seen, url, url);
+	}
 
-		msg_notice_task_encrypted ("<%s> %s: %*s; ip: %s; URL: %*s",
-			task->message_id,
-			has_user ? "user" : "from",
-			len, user_field,
-			rspamd_inet_address_to_string (task->from_addr),
-			(gint)enclen, encoded);
+	if (task->user) {
+		user_field = task->user;
+		len = strlen (task->user);
+		has_user = TRUE;
+	}
+	else if (task->from_envelope) {
+		user_field = task->from_envelope->addr;
+		len = task->from_envelope->addr_len;
 	}
+
+	encoded = rspamd_url_encode (url, &enclen, task->task_pool);
+
+	msg_notice_task_encrypted ("<%s> %s: %*s; ip: %s; URL: %*s",
+		task->message_id,
+		has_user ? "user" : "from",
+		len, user_field,
+		rspamd_inet_address_to_string (task->from_addr),
+		(gint)enclen, encoded);
 }
 
-static ucl_object_t *
-rspamd_urls_tree_ucl (GHashTable *input, struct rspamd_task *task)
+static void
+rspamd_protocol_log_urls (struct rspamd_task *task)
 {
 	struct tree_cb_data cb;
-	ucl_object_t *obj;
 
-	obj = ucl_object_typed_new (UCL_ARRAY);
-	cb.top = obj;
+	memset (&cb, 0, sizeof (cb));
 	cb.task = task;
 	cb.seen = g_hash_table_new (rspamd_url_host_hash, rspamd_urls_host_cmp);
 
-	g_hash_table_foreach (input, urls_protocol_cb, &cb);
+	g_hash_table_foreach (task->urls, urls_log_cb, &cb);
 
 	g_hash_table_unref (cb.seen);
+}
+
+static void
+rspamd_urls_tree_write (GHashTable *input, struct rspamd_task *task,
+		struct rspamd_protocol_writer *w)
+{
+	struct tree_cb_data cb;
+
+	rspamd_protocol_writer_start (w, "urls", UCL_ARRAY);
+	cb.w = w;
+	cb.task = task;
+	cb.seen = g_hash_table_new (rspamd_url_host_hash, rspamd_urls_host_cmp);
+
+	g_hash_table_foreach (input, urls_protocol_cb, &cb);
 
-	return obj;
+	g_hash_table_unref (cb.seen);
+	rspamd_protocol_writer_end (w);
 }
 
 static void
@@ -881,29 +1292,28 @@ emails_protocol_cb (gpointer key, gpointer value, gpointer ud)
 {
 	struct tree_cb_data *cb = ud;
 	struct rspamd_url *url = value;
-	ucl_object_t *obj;
 
 	if (url->userlen > 0 && url->hostlen > 0 &&
 			url->host == url->user + url->userlen + 1) {
-		obj = ucl_object_fromlstring (url->user,
+		rspamd_protocol_writer_lstring (cb->w, NULL, url->user,
 				url->userlen + url->hostlen + 1);
-		ucl_array_append (cb->top, obj);
 	}
 }
 
-static ucl_object_t *
-rspamd_emails_tree_ucl (GHashTable *input, struct rspamd_task *task)
+static void
+rspamd_emails_tree_write (GHashTable *input, struct rspamd_task *task,
+		struct rspamd_protocol_writer *w)
 {
 	struct tree_cb_data cb;
-	ucl_object_t *obj;
 
-	obj = ucl_object_typed_new (UCL_ARRAY);
-	cb.top = obj;
+	rspamd_protocol_writer_start (w, "emails", UCL_ARRAY);
+	cb.w = w;
 	cb.task = task;
+	cb.seen = NULL;
 
 	g_hash_table_foreach (input, emails_protocol_cb, &cb);
 
-	return obj;
+	rspamd_protocol_writer_end (w);
 }
 
 
@@ -982,10 +1392,11 @@ rspamd_protocol_rewrite_subject (struct rspamd_task *task)
 	return res;
 }
 
-static ucl_object_t *
-rspamd_metric_symbol_ucl (struct rspamd_task *task, struct rspamd_symbol_result *sym)
+static void
+rspamd_metric_symbol_write (struct rspamd_task *task,
+		struct rspamd_symbol_result *sym, gboolean details,
+		struct rspamd_protocol_writer *w)
 {
-	ucl_object_t *obj = NULL, *ar;
 	const gchar *description = NULL;
 	struct rspamd_symbol_option *opt;
 
@@ -993,123 +1404,97 @@ rspamd_metric_symbol_ucl (struct rspamd_task *task, struct rspamd_symbol_result
 		description = sym->sym->description;
 	}
 
-	obj = ucl_object_typed_new (UCL_OBJECT);
-	ucl_object_insert_key (obj, ucl_object_fromstring (
-			sym->name),	 "name",  0, false);
-	ucl_object_insert_key (obj, ucl_object_fromdouble (
-			sym->score), "score", 0, false);
+	rspamd_protocol_writer_start (w, sym->name, UCL_OBJECT);
+	rspamd_protocol_writer_string (w, "name", sym->name);
+	rspamd_protocol_writer_double (w, "score", sym->score);
 
-	if (task->cmd == CMD_CHECK_V2) {
-		if (sym->sym) {
-			ucl_object_insert_key (obj, ucl_object_fromdouble (
-					sym->sym->score), "metric_score", 0, false);
-		}
-		else {
-			ucl_object_insert_key (obj, ucl_object_fromdouble (0.0),
-					"metric_score", 0, false);
-		}
+	if (!details) {
+		rspamd_protocol_writer_end (w);
+
+		return;
 	}
 
-	if (description) {
-		ucl_object_insert_key (obj, ucl_object_fromstring (
-				description), "description", 0, false);
+	if (task->cmd == CMD_CHECK_V2) {
+		rspamd_protocol_writer_double (w, "metric_score",
+				sym->sym ? sym->sym->score : 0.0);
 	}
 
+	rspamd_protocol_writer_string (w, "description", description);
+
 	if (sym->options != NULL) {
-		ar = ucl_object_typed_new (UCL_ARRAY);
+		rspamd_protocol_writer_start (w, "options", UCL_ARRAY);
 
 		DL_FOREACH (sym->opts_head, opt) {
-			ucl_array_append (ar, ucl_object_fromstring (opt->option));
+			rspamd_protocol_writer_string (w, NULL, opt->option);
 		}
 
-		ucl_object_insert_key (obj, ar, "options", 0, false);
+		rspamd_protocol_writer_end (w);
 	}
 
-	return obj;
+	rspamd_protocol_writer_end (w);
 }
 
-static ucl_object_t *
-rspamd_metric_result_ucl (struct rspamd_task *task,
-	struct rspamd_metric_result *mres, ucl_object_t *top)
+static void
+rspamd_metric_result_write (struct rspamd_task *task,
+	struct rspamd_metric_result *mres, struct rspamd_protocol_writer *w,
+	enum rspamd_protocol_flags flags)
 {
 	struct rspamd_symbol_result *sym;
 	gboolean is_spam;
 	struct rspamd_action *action;
-	ucl_object_t *obj = NULL, *sobj;
 	const gchar *subject;
 
 	action = rspamd_check_action_metric (task);
 	is_spam = !(action->flags & RSPAMD_ACTION_HAM);
 
 	if (task->cmd != CMD_CHECK_V2) {
-		obj = ucl_object_typed_new (UCL_OBJECT);
-		ucl_object_insert_key (obj,
-				ucl_object_frombool (is_spam),
-				"is_spam", 0, false);
-	}
-	else {
-		obj = top;
-	}
-
-	ucl_object_insert_key (obj,
-			ucl_object_frombool (RSPAMD_TASK_IS_SKIPPED (task)),
-			"is_skipped", 0, false);
-
-	if (!isnan (mres->score)) {
-		ucl_object_insert_key (obj, ucl_object_fromdouble (mres->score),
-			"score", 0, false);
-	} else {
-		ucl_object_insert_key (obj,
-			ucl_object_fromdouble (0.0), "score", 0, false);
+		rspamd_protocol_writer_start (w, DEFAULT_METRIC, UCL_OBJECT);
+		rspamd_protocol_writer_bool (w, "is_spam", is_spam);
 	}
 
-	ucl_object_insert_key (obj,
-			ucl_object_fromdouble (rspamd_task_get_required_score (task, mres)),
-			"required_score", 0, false);
-	ucl_object_insert_key (obj,
-			ucl_object_fromstring (action->name),
-			"action", 0, false);
-
-	if (action->action_type == METRIC_ACTION_REWRITE_SUBJECT) {
-		subject = rspamd_protocol_rewrite_subject (task);
-
-		if (subject) {
-			ucl_object_insert_key (obj, ucl_object_fromstring (subject),
-				"subject", 0, false);
-		}
-	}
-	if (action->flags & RSPAMD_ACTION_MILTER) {
-		/* Treat milter action specially */
-		if (action->action_type == METRIC_ACTION_DISCARD) {
-			ucl_object_insert_key (obj, ucl_object_fromstring ("discard"),
-					"reject", 0, false);
+	if (flags & RSPAMD_PROTOCOL_METRICS) {
+		rspamd_protocol_writer_bool (w, "is_skipped",
+				RSPAMD_TASK_IS_SKIPPED (task));
+		rspamd_protocol_writer_double (w, "score",
+				isnan (mres->score) ? 0.0 : mres->score);
+		rspamd_protocol_writer_double (w, "required_score",
+				rspamd_task_get_required_score (task, mres));
+		rspamd_protocol_writer_string (w, "action", action->name);
+
+		if (action->action_type == METRIC_ACTION_REWRITE_SUBJECT) {
+			subject = rspamd_protocol_rewrite_subject (task);
+			rspamd_protocol_writer_string (w, "subject", subject);
 		}
-		else if (action->action_type == METRIC_ACTION_QUARANTINE) {
-			ucl_object_insert_key (obj, ucl_object_fromstring ("quarantine"),
-					"reject", 0, false);
+		if (action->flags & RSPAMD_ACTION_MILTER) {
+			/* Treat milter action specially */
+			if (action->action_type == METRIC_ACTION_DISCARD) {
+				rspamd_protocol_writer_string (w, "reject", "discard");
+			}
+			else if (action->action_type == METRIC_ACTION_QUARANTINE) {
+				rspamd_protocol_writer_string (w, "reject", "quarantine");
+			}
 		}
 	}
 
 	/* Now handle symbols */
 	if (task->cmd == CMD_CHECK_V2) {
-		obj = ucl_object_typed_new (UCL_OBJECT);
-	}
-
-	kh_foreach_value_ptr (mres->symbols, sym, {
-		if (!(sym->flags & RSPAMD_SYMBOL_RESULT_IGNORED)) {
-			sobj = rspamd_metric_symbol_ucl (task, sym);
-			ucl_object_insert_key (obj, sobj, sym->name, 0, false);
+		if (!(flags & RSPAMD_PROTOCOL_SYMBOLS)) {
+			return;
 		}
-	});
 
-	if (task->cmd == CMD_CHECK_V2) {
-		ucl_object_insert_key (top, obj, "symbols", 0, false);
+		rspamd_protocol_writer_start (w, "symbols", UCL_OBJECT);
 	}
-	else {
-		ucl_object_insert_key (top, obj, DEFAULT_METRIC, 0, false);
+
+	if (flags & RSPAMD_PROTOCOL_SYMBOLS) {
+		kh_foreach_value_ptr (mres->symbols, sym, {
+			if (!(sym->flags & RSPAMD_SYMBOL_RESULT_IGNORED)) {
+				rspamd_metric_symbol_write (task, sym,
+						flags & RSPAMD_PROTOCOL_SYMBOLS_DETAILS, w);
+			}
+		});
 	}
 
-	return obj;
+	rspamd_protocol_writer_end (w);
 }
 
 void
@@ -1212,154 +1597,126 @@ rspamd_ucl_tospamc_output (const ucl_object_t *top,
 
 static void
 rspamd_protocol_output_profiling (struct rspamd_task *task,
-		ucl_object_t *top)
+		struct rspamd_protocol_writer *w)
 {
 	GHashTable *tbl;
 	GHashTableIter it;
 	gpointer k, v;
-	ucl_object_t *prof;
-	gdouble val;
 
-	prof = ucl_object_typed_new (UCL_OBJECT);
+	rspamd_protocol_writer_start (w, "profile", UCL_OBJECT);
 	tbl = rspamd_mempool_get_variable (task->task_pool, "profile");
 
 	if (tbl) {
 		g_hash_table_iter_init (&it, tbl);
 
 		while (g_hash_table_iter_next (&it, &k, &v)) {
-			val = *(gdouble *)v;
-			ucl_object_insert_key (prof, ucl_object_fromdouble (val),
-					(const char *)k, 0, false);
+			rspamd_protocol_writer_double (w, (const gchar *)k,
+					*(gdouble *)v);
 		}
 	}
 
-	ucl_object_insert_key (top, prof, "profile", 0, false);
+	rspamd_protocol_writer_end (w);
 }
 
-ucl_object_t *
-rspamd_protocol_write_ucl (struct rspamd_task *task,
-		enum rspamd_protocol_flags flags)
+static GString *
+rspamd_protocol_fold_dkim (struct rspamd_task *task, GString *dkim_sig)
 {
-	ucl_object_t *top = NULL;
-	GString *dkim_sig;
+	if (task->flags & RSPAMD_TASK_FLAG_MILTER) {
+		return rspamd_header_value_fold ("DKIM-Signature",
+				dkim_sig->str, 80, RSPAMD_TASK_NEWLINES_LF, NULL);
+	}
+
+	return rspamd_header_value_fold ("DKIM-Signature",
+			dkim_sig->str, 80, task->nlines_type, NULL);
+}
+
+/*
+ * Writes all reply sections, used for both UCL and msgpack replies
+ */
+static void
+rspamd_protocol_write_sections (struct rspamd_task *task,
+		enum rspamd_protocol_flags flags, struct rspamd_protocol_writer *w)
+{
+	GString *dkim_sig, *folded_header;
 	GList *dkim_sigs;
 	const ucl_object_t *milter_reply;
 
 	rspamd_task_set_finish_time (task);
-	top = ucl_object_typed_new (UCL_OBJECT);
-
-	rspamd_mempool_add_destructor (task->task_pool,
-			(rspamd_mempool_destruct_t)ucl_object_unref, top);
+	rspamd_protocol_writer_start (w, NULL, UCL_OBJECT);
 
-	if (flags & RSPAMD_PROTOCOL_METRICS) {
-		rspamd_metric_result_ucl (task, task->result, top);
+	if (flags & (RSPAMD_PROTOCOL_METRICS|RSPAMD_PROTOCOL_SYMBOLS)) {
+		rspamd_metric_result_write (task, task->result, w, flags);
 	}
 
 	if (flags & RSPAMD_PROTOCOL_MESSAGES) {
 		if (G_UNLIKELY (task->cfg->compat_messages)) {
 			const ucl_object_t *cur;
-			ucl_object_t *msg_object;
 			ucl_object_iter_t iter = NULL;
 
-			msg_object = ucl_object_typed_new (UCL_ARRAY);
+			rspamd_protocol_writer_start (w, "messages", UCL_ARRAY);
 
 			while ((cur = ucl_object_iterate (task->messages, &iter, true)) != NULL) {
 				if (cur->type == UCL_STRING) {
-					ucl_array_append (msg_object, ucl_object_ref (cur));
+					rspamd_protocol_writer_ucl (w, NULL, cur);
 				}
 			}
 
-			ucl_object_insert_key (top, msg_object, "messages", 0, false);
+			rspamd_protocol_writer_end (w);
 		}
 		else {
-			ucl_object_insert_key (top, ucl_object_ref (task->messages),
-					"messages", 0, false);
+			rspamd_protocol_writer_ucl (w, "messages", task->messages);
 		}
 	}
 
 	if (flags & RSPAMD_PROTOCOL_URLS) {
 		if (g_hash_table_size (task->urls) > 0) {
-			ucl_object_insert_key (top,
-					rspamd_urls_tree_ucl (task->urls, task),
-					"urls", 0, false);
+			rspamd_urls_tree_write (task->urls, task, w);
 		}
 
 		if (g_hash_table_size (task->emails) > 0) {
-			ucl_object_insert_key (top,
-					rspamd_emails_tree_ucl (task->emails, task),
-					"emails", 0, false);
+			rspamd_emails_tree_write (task->emails, task, w);
 		}
 	}
 
 	if (flags & RSPAMD_PROTOCOL_EXTRA) {
 		if (G_UNLIKELY (RSPAMD_TASK_IS_PROFILING (task))) {
-			rspamd_protocol_output_profiling (task, top);
+			rspamd_protocol_output_profiling (task, w);
 		}
 	}
 
 	if (flags & RSPAMD_PROTOCOL_BASIC) {
-		ucl_object_insert_key (top, ucl_object_fromstring (task->message_id),
-				"message-id", 0, false);
-		ucl_object_insert_key (top,
-				ucl_object_fromdouble (task->time_real_finish - task->task_timestamp),
-				"time_real", 0, false);
-		ucl_object_insert_key (top,
-				ucl_object_fromdouble (task->time_virtual_finish - task->time_virtual),
-				"time_virtual", 0, false);
+		rspamd_protocol_writer_string (w, "message-id", task->message_id);
+		rspamd_protocol_writer_double (w, "time_real",
+				task->time_real_finish - task->task_timestamp);
+		rspamd_protocol_writer_double (w, "time_virtual",
+				task->time_virtual_finish - task->time_virtual);
 	}
 
 	if (flags & RSPAMD_PROTOCOL_DKIM) {
 		dkim_sigs = rspamd_mempool_get_variable (task->task_pool,
 				RSPAMD_MEMPOOL_DKIM_SIGNATURE);
 
-
 		if (dkim_sigs) {
 			if (dkim_sigs->next) {
 				/* Multiple DKIM signatures */
-				ucl_object_t *ar = ucl_object_typed_new (UCL_ARRAY);
+				rspamd_protocol_writer_start (w, "dkim-signature", UCL_ARRAY);
 
 				for (; dkim_sigs != NULL; dkim_sigs = dkim_sigs->next) {
-					GString *folded_header;
 					dkim_sig = (GString *) dkim_sigs->data;
-
-					if (task->flags & RSPAMD_TASK_FLAG_MILTER) {
-						folded_header = rspamd_header_value_fold ("DKIM-Signature",
-								dkim_sig->str, 80, RSPAMD_TASK_NEWLINES_LF, NULL);
-					}
-					else {
-						folded_header = rspamd_header_value_fold ("DKIM-Signature",
-								dkim_sig->str, 80, task->nlines_type, NULL);
-					}
-
-					ucl_array_append (ar,
-							ucl_object_fromstring_common (folded_header->str,
-									folded_header->len, UCL_STRING_RAW));
+					folded_header = rspamd_protocol_fold_dkim (task, dkim_sig);
+					rspamd_protocol_writer_lstring (w, NULL,
+							folded_header->str, folded_header->len);
 					g_string_free (folded_header, TRUE);
 				}
 
-				ucl_object_insert_key (top,
-						ar,
-						"dkim-signature", 0,
-						false);
+				rspamd_protocol_writer_end (w);
 			}
 			else {
 				/* Single DKIM signature */
-				GString *folded_header;
 				dkim_sig = (GString *) dkim_sigs->data;
-
-				if (task->flags & RSPAMD_TASK_FLAG_MILTER) {
-					folded_header = rspamd_header_value_fold ("DKIM-Signature",
-							dkim_sig->str, 80, RSPAMD_TASK_NEWLINES_LF, NULL);
-				}
-				else {
-					folded_header = rspamd_header_value_fold ("DKIM-Signature",
-							dkim_sig->str, 80, task->nlines_type, NULL);
-				}
-
-				ucl_object_insert_key (top,
-						ucl_object_fromstring_common (folded_header->str,
-								folded_header->len, UCL_STRING_RAW),
-						"dkim-signature", 0, false);
+				folded_header = rspamd_protocol_fold_dkim (task, dkim_sig);
+				rspamd_protocol_writer_lstring (w, "dkim-signature",
+						folded_header->str, folded_header->len);
 				g_string_free (folded_header, TRUE);
 			}
 		}
@@ -1370,18 +1727,55 @@ rspamd_protocol_write_ucl (struct rspamd_task *task,
 				RSPAMD_MEMPOOL_MILTER_REPLY);
 
 		if (milter_reply) {
-			if (task->cmd == CMD_CHECK_V2) {
-				ucl_object_insert_key (top, ucl_object_ref (milter_reply),
-						"milter", 0, false);
-			}
-			else {
-				ucl_object_insert_key (top, ucl_object_ref (milter_reply),
-						"rmilter", 0, false);
-			}
+			rspamd_protocol_writer_ucl (w,
+					task->cmd == CMD_CHECK_V2 ? "milter" : "rmilter",
+					milter_reply);
 		}
 	}
 
-	return top;
+	rspamd_protocol_writer_end (w);
+}
+
+ucl_object_t *
+rspamd_protocol_write_ucl (struct rspamd_task *task,
+		enum rspamd_protocol_flags flags)
+{
+	struct rspamd_protocol_writer w;
+
+	memset (&w, 0, sizeof (w));
+	rspamd_protocol_write_sections (task, flags, &w);
+	rspamd_mempool_add_destructor (task->task_pool,
+			(rspamd_mempool_destruct_t)ucl_object_unref, w.top);
+
+	return w.top;
+}
+
+void
+rspamd_protocol_write_msgpack (struct rspamd_task *task,
+		enum rspamd_protocol_flags flags, rspamd_fstring_t **out)
+{
+	struct rspamd_protocol_writer w;
+
+	memset (&w, 0, sizeof (w));
+	w.out = out;
+	rspamd_protocol_write_sections (task, flags, &w);
+}
+
+static inline gboolean
+rspamd_protocol_reply_is_msgpack (struct rspamd_task *task)
+{
+	return task->reply_format == RSPAMD_TASK_REPLY_MSGPACK &&
+			RSPAMD_TASK_IS_JSON (task) && !RSPAMD_TASK_IS_SPAMC (task);
+}
+
+const gchar *
+rspamd_protocol_reply_content_type (struct rspamd_task *task)
+{
+	if (rspamd_protocol_reply_is_msgpack (task)) {
+		return RSPAMD_PROTOCOL_MSGPACK_CTYPE;
+	}
+
+	return "application/json";
 }
 
 void
@@ -1394,8 +1788,10 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 	gpointer h, v;
 	ucl_object_t *top = NULL;
 	rspamd_fstring_t *reply;
-	gint flags = RSPAMD_PROTOCOL_DEFAULT;
+	gint flags = RSPAMD_PROTOCOL_DEFAULT|RSPAMD_PROTOCOL_URLS;
+	gboolean direct_msgpack;
 	struct rspamd_action *action;
+	struct rspamd_stat *stat;
 
 	/* Write custom headers */
 	g_hash_table_iter_init (&hiter, task->reply_headers);
@@ -1405,12 +1801,26 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 		rspamd_http_message_add_header (msg, hn->begin, hv->begin);
 	}
 
-	flags |= RSPAMD_PROTOCOL_URLS;
+	if (task->reply_sections != 0 && pobj == NULL &&
+			msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task)) {
+		/* Client has requested specific sections, skip all others */
+		flags = task->reply_sections;
+	}
 
-	top = rspamd_protocol_write_ucl (task, flags);
+	reply = rspamd_fstring_sized_new (1000);
+	/* Binary reply is written without UCL unless the caller needs it */
+	direct_msgpack = pobj == NULL && msg->method < HTTP_SYMBOLS &&
+			rspamd_protocol_reply_is_msgpack (task);
+
+	if (direct_msgpack) {
+		rspamd_protocol_write_msgpack (task, flags, &reply);
+	}
+	else {
+		top = rspamd_protocol_write_ucl (task, flags);
 
-	if (pobj) {
-		*pobj = top;
+		if (pobj) {
+			*pobj = top;
+		}
 	}
 
 	if (!(task->flags & RSPAMD_TASK_FLAG_NO_LOG)) {
@@ -1419,6 +1829,11 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 
 	rspamd_task_write_log (task);
 
+	if (task->cfg->log_urls) {
+		/* Urls are logged even if they are not requested in reply */
+		rspamd_protocol_log_urls (task);
+	}
+
 	if (task->cfg->log_flags & RSPAMD_LOG_FLAG_RE_CACHE) {
 		restat = rspamd_re_cache_get_stat (task->re_rt);
 		g_assert (restat != NULL);
@@ -1434,10 +1849,16 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 				restat->bytes_scanned);
 	}
 
-	reply = rspamd_fstring_sized_new (1000);
-
-	if (msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task)) {
-		rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON_COMPACT, &reply);
+	if (direct_msgpack) {
+		/* Already written */
+	}
+	else if (msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task)) {
+		if (rspamd_protocol_reply_is_msgpack (task)) {
+			rspamd_ucl_emit_fstring (top, UCL_EMIT_MSGPACK, &reply);
+		}
+		else {
+			rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON_COMPACT, &reply);
+		}
 	}
 	else {
 		if (RSPAMD_TASK_IS_SPAMC (task)) {
@@ -1511,6 +1932,7 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 
 end:
 	if (!(task->flags & RSPAMD_TASK_FLAG_NO_STAT)) {
+		stat = rspamd_worker_stat (task->worker);
 		/* Update stat for default metric */
 		metric_res = task->result;
 
@@ -1522,30 +1944,17 @@ end:
 			if (action->action_type == METRIC_ACTION_SOFT_REJECT &&
 					(task->flags & RSPAMD_TASK_FLAG_GREYLISTED)) {
 				/* Set stat action to greylist to display greylisted messages */
-#ifndef HAVE_ATOMIC_BUILTINS
-				task->worker->srv->stat->actions_stat[METRIC_ACTION_GREYLIST]++;
-#else
-				__atomic_add_fetch (&task->worker->srv->stat->actions_stat[METRIC_ACTION_GREYLIST],
-						1, __ATOMIC_RELEASE);
-#endif
+				RSPAMD_STAT_ADD (stat, actions_stat[METRIC_ACTION_GREYLIST], 1);
 			}
 			else if (action->action_type < METRIC_ACTION_MAX) {
-#ifndef HAVE_ATOMIC_BUILTINS
-				task->worker->srv->stat->actions_stat[action->action_type]++;
-#else
-				__atomic_add_fetch (&task->worker->srv->stat->actions_stat[action->action_type],
-						1, __ATOMIC_RELEASE);
-#endif
+				RSPAMD_STAT_ADD (stat, actions_stat[action->action_type], 1);
 			}
 		}
 
 		/* Increase counters */
-#ifndef HAVE_ATOMIC_BUILTINS
-		task->worker->srv->stat->messages_scanned++;
-#else
-		__atomic_add_fetch (&task->worker->srv->stat->messages_scanned,
-				1, __ATOMIC_RELEASE);
-#endif
+		RSPAMD_STAT_ADD (stat, messages_scanned, 1);
+		rspamd_worker_stat_scan_time (stat,
+				task->time_real_finish - task->task_timestamp);
 	}
 }
 
@@ -1820,6 +2229,7 @@ rspamd_protocol_write_reply (struct rspamd_task *task, ev_tstamp timeout)
 		case CMD_CHECK_V2:
 			rspamd_protocol_http_reply (msg, task, NULL);
 			rspamd_protocol_write_log_pipe (task);
+			ctype = rspamd_protocol_reply_content_type (task);
 			break;
 		case CMD_PING:
 			rspamd_http_message_set_body (msg, "pong" CRLF, 6);
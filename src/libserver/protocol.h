@@ -18,6 +18,8 @@
 #define RSPAMD_LENGTH_ERROR RSPAMD_BASE_ERROR + 4
 #define RSPAMD_STATFILE_ERROR RSPAMD_BASE_ERROR + 5
 
+#define RSPAMD_PROTOCOL_MSGPACK_CTYPE "application/msgpack"
+
 struct rspamd_protocol_log_symbol_result {
 	guint32 id;
 	float score;
@@ -67,6 +69,13 @@ gboolean rspamd_protocol_handle_request (struct rspamd_task *task,
  */
 void rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 		struct rspamd_task *task, ucl_object_t **pobj);
+/**
+ * Returns content type of the reply written by `rspamd_protocol_http_reply`
+ * @param task
+ * @return
+ */
+const gchar * rspamd_protocol_reply_content_type (struct rspamd_task *task);
+
 /**
  * Write data to log pipes
  * @param task
@@ -81,14 +90,35 @@ enum rspamd_protocol_flags {
 	RSPAMD_PROTOCOL_DKIM = 1 << 4,
 	RSPAMD_PROTOCOL_URLS = 1 << 5,
 	RSPAMD_PROTOCOL_EXTRA = 1 << 6,
+	RSPAMD_PROTOCOL_SYMBOLS = 1 << 7,
+	RSPAMD_PROTOCOL_SYMBOLS_DETAILS = 1 << 8,
 };
 
 #define RSPAMD_PROTOCOL_DEFAULT (RSPAMD_PROTOCOL_BASIC| \
 		RSPAMD_PROTOCOL_METRICS| \
+		RSPAMD_PROTOCOL_SYMBOLS| \
+		RSPAMD_PROTOCOL_SYMBOLS_DETAILS| \
 		RSPAMD_PROTOCOL_MESSAGES| \
 		RSPAMD_PROTOCOL_RMILTER| \
 		RSPAMD_PROTOCOL_DKIM| \
 		RSPAMD_PROTOCOL_EXTRA)
+
+/**
+ * Returns protocol flags for a reply section name, e.g. `action` or `symbols`
+ * @param name
+ * @param len
+ * @return flags or 0 if the section is unknown
+ */
+enum rspamd_protocol_flags rspamd_protocol_section_flags (const gchar *name,
+		gsize len);
+
+/**
+ * Returns internal id of a known request header (case insensitive)
+ * @param name
+ * @param len
+ * @return id or 0 if the header is unknown
+ */
+gint rspamd_protocol_header_id (const gchar *name, gsize len);
 /**
  * Write reply to ucl object filling log buffer
  * @param task
@@ -98,6 +128,16 @@ enum rspamd_protocol_flags {
 ucl_object_t * rspamd_protocol_write_ucl (struct rspamd_task *task,
 		enum rspamd_protocol_flags flags);
 
+/**
+ * Write the same reply as rspamd_protocol_write_ucl in msgpack format
+ * directly to the output buffer, without building of UCL object
+ * @param task
+ * @param flags
+ * @param out
+ */
+void rspamd_protocol_write_msgpack (struct rspamd_task *task,
+		enum rspamd_protocol_flags flags, rspamd_fstring_t **out);
+
 /**
  * Write reply for specified task command
  * @param task task object
@@ -84,5 +84,7 @@
 #define CERT_ISSUER_HEADER "TLS-Cert-Issuer"
 #define MAILER_HEADER "Mailer"
 #define RAW_DATA_HEADER "Raw"
+#define ACCEPT_HEADER "Accept"
+#define REPLY_SECTIONS_HEADER "Reply-Sections"
 
 #endif //RSPAMD_PROTOCOL_INTERNAL_H
@@ -2780,6 +2780,24 @@ rspamd_symcache_foreach (struct rspamd_symcache *cache,
 	}
 }
 
+void
+rspamd_symcache_foreach_hits (struct rspamd_symcache *cache,
+							  void (*func) (const gchar *, guint64, gpointer),
+							  gpointer ud)
+{
+	struct rspamd_symcache_item *item;
+	guint i;
+
+	PTR_ARRAY_FOREACH (cache->items_by_id, i, item) {
+		if (item->symbol != NULL) {
+			/* Hits are moved to total_hits periodically */
+			func (item->symbol,
+					item->st->total_hits + g_atomic_int_get (&item->st->hits),
+					ud);
+		}
+	}
+}
+
 struct rspamd_symcache_item *
 rspamd_symcache_get_cur_item (struct rspamd_task *task)
 {
@@ -349,6 +349,18 @@ void rspamd_symcache_foreach (struct rspamd_symcache *cache,
 											gint /* flags */, gpointer /* userdata */),
 							  gpointer ud);
 
+/**
+ * Calls `func` for each symbol with the number of its hits, counters are
+ * stored in shared memory, so hits from all workers are included
+ * @param cache
+ * @param func
+ * @param ud
+ */
+void rspamd_symcache_foreach_hits (struct rspamd_symcache *cache,
+								   void (*func) (const gchar * /* name */,
+												 guint64 /* hits */, gpointer /* userdata */),
+								   gpointer ud);
+
 /**
  * Returns the current item being processed (if any)
  * @param task
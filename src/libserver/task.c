@@ -55,15 +55,9 @@ static void
 rspamd_request_header_dtor (gpointer p)
 {
 	GPtrArray *ar = p;
-	guint i;
-	rspamd_ftok_t *tok;
 
 	if (ar) {
-		for (i = 0; i < ar->len; i ++) {
-			tok = g_ptr_array_index (ar, i);
-			rspamd_fstring_mapped_ftok_free (tok);
-		}
-
+		/* Tokens are owned by the task pool */
 		g_ptr_array_free (ar, TRUE);
 	}
 }
@@ -127,7 +121,7 @@ rspamd_task_new (struct rspamd_worker *worker, struct rspamd_config *cfg,
 			rspamd_strcase_equal, NULL, rspamd_ptr_array_free_hard);
 	new_task->headers_order = g_queue_new ();
 	new_task->request_headers = g_hash_table_new_full (rspamd_ftok_icase_hash,
-			rspamd_ftok_icase_equal, rspamd_fstring_mapped_ftok_free,
+			rspamd_ftok_icase_equal, NULL,
 			rspamd_request_header_dtor);
 	rspamd_mempool_add_destructor (new_task->task_pool,
 		(rspamd_mempool_destruct_t) g_hash_table_unref,
@@ -1675,9 +1669,6 @@ rspamd_task_add_request_header (struct rspamd_task *task,
 
 	if (ret) {
 		g_ptr_array_add (ret, value);
-
-		/* We need to free name token */
-		rspamd_fstring_mapped_ftok_free (name);
 	}
 	else {
 		ret = g_ptr_array_sized_new (2);
@@ -117,6 +117,7 @@ enum rspamd_task_stage {
 #define RSPAMD_TASK_FLAG_MILTER (1u << 28u)
 #define RSPAMD_TASK_FLAG_SSL (1u << 29u)
 #define RSPAMD_TASK_FLAG_BAD_UNICODE (1u << 30u)
+#define RSPAMD_TASK_FLAG_KEEPALIVE (1u << 31u)
 
 #define RSPAMD_TASK_IS_SKIPPED(task) (((task)->flags & RSPAMD_TASK_FLAG_SKIP))
 #define RSPAMD_TASK_IS_JSON(task) (((task)->flags & RSPAMD_TASK_FLAG_JSON))
@@ -131,12 +132,19 @@ struct rspamd_email_address;
 struct rspamd_lang_detector;
 enum rspamd_newlines_type;
 
+enum rspamd_task_reply_format {
+	RSPAMD_TASK_REPLY_JSON = 0,
+	RSPAMD_TASK_REPLY_MSGPACK,
+};
+
 /**
  * Worker task structure
  */
 struct rspamd_task {
 	struct rspamd_worker *worker;					/**< pointer to worker object						*/
 	enum rspamd_command cmd;						/**< command										*/
+	enum rspamd_task_reply_format reply_format;		/**< format of the scan reply						*/
+	guint reply_sections;							/**< requested reply sections, 0 for defaults		*/
 	gint sock;										/**< socket descriptor								*/
 	guint32 flags;									/**< Bit flags										*/
 	guint32 dns_requests;							/**< number of DNS requests per this task			*/
@@ -320,7 +328,8 @@ GPtrArray* rspamd_task_get_request_header_multiple (struct rspamd_task *task,
 		const gchar *name);
 
 /**
- * Adds a new request header to task (name and value should be mapped to fstring)
+ * Adds a new request header to task (name and value should be valid while
+ * the task pool is alive)
  * @param task
  * @param name
  * @param value
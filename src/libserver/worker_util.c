@@ -63,6 +63,8 @@
 
 #include "contrib/libev/ev.h"
 
+#include <math.h>
+
 static void rspamd_worker_ignore_signal (struct rspamd_worker_signal_handler *);
 /**
  * Return worker's control structure by its type
@@ -130,7 +132,7 @@ rspamd_worker_terminate_handlers (struct rspamd_worker *w)
 	 * - then we run finish actions
 	 * - then we create a special timer to kill worker if it fails to finish
 	 */
-	final_gift = ev_loop_new (EVBACKEND_ALL);
+	final_gift = ev_loop_new (rspamd_config_ev_backend_get (w->srv->cfg));
 	orig_loop = actx->event_loop;
 	actx->event_loop = final_gift;
 	margin_call.data = &nchecks;
@@ -355,7 +357,8 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 	worker->signal_events = g_hash_table_new_full (g_direct_hash, g_direct_equal,
 			NULL, rspamd_sigh_free);
 
-	event_loop = ev_loop_new (EVFLAG_SIGNALFD);
+	event_loop = ev_loop_new (EVFLAG_SIGNALFD|
+			rspamd_config_ev_backend_get (worker->srv->cfg));
 
 	worker->srv->event_loop = event_loop;
 
@@ -664,6 +667,160 @@ rspamd_worker_set_limits (struct rspamd_main *rspamd_main,
 	}
 }
 
+/* Prometheus default buckets */
+static const gdouble rspamd_scan_time_bounds[RSPAMD_STAT_SCAN_TIME_BUCKETS] = {
+	0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, INFINITY
+};
+
+/* All fields of struct rspamd_stat are 64 bit counters */
+#define RSPAMD_STAT_NCOUNTERS (sizeof (struct rspamd_stat) / sizeof (guint64))
+
+void
+rspamd_worker_stat_init (struct rspamd_main *rspamd_main)
+{
+	gpointer p;
+
+	rspamd_main->stat = rspamd_mempool_alloc0_shared (rspamd_main->server_pool,
+			sizeof (struct rspamd_stat));
+	/* Slots are aligned to cache lines to avoid false sharing */
+	p = rspamd_mempool_alloc0_shared (rspamd_main->server_pool,
+			sizeof (struct rspamd_stat_slot) * RSPAMD_STAT_MAX_SLOTS + 64);
+	rspamd_main->stat_slots = align_ptr (p, 64);
+	rspamd_main->stat_slots[0].shared = TRUE;
+}
+
+/*
+ * Called by the main process before fork, slot 0 is shared by all processes
+ * that have no own slot
+ */
+static struct rspamd_stat *
+rspamd_worker_stat_acquire (struct rspamd_main *rspamd_main, GQuark type)
+{
+	struct rspamd_stat_slot *slot;
+	guint i;
+
+	if (rspamd_main->stat_slots == NULL) {
+		return NULL;
+	}
+
+	for (i = 1; i < RSPAMD_STAT_MAX_SLOTS; i ++) {
+		slot = &rspamd_main->stat_slots[i];
+
+		if (slot->pid == 0) {
+			slot->pid = -1;
+			slot->type = type;
+
+			return &slot->st;
+		}
+	}
+
+	msg_warn_main ("no free statistics slots, use the shared one");
+
+	return &rspamd_main->stat_slots[0].st;
+}
+
+struct rspamd_stat *
+rspamd_worker_stat (struct rspamd_worker *w)
+{
+	if (w->stat) {
+		return w->stat;
+	}
+
+	return &w->srv->stat_slots[0].st;
+}
+
+void
+rspamd_worker_stat_release (struct rspamd_main *rspamd_main,
+		struct rspamd_worker *w)
+{
+	struct rspamd_stat_slot *slot;
+
+	if (w->stat && rspamd_main->stat_slots &&
+			w->stat != &rspamd_main->stat_slots[0].st) {
+		/* Counters are kept, so totals are not decreased */
+		slot = (struct rspamd_stat_slot *)w->stat;
+		slot->pid = 0;
+		w->stat = NULL;
+	}
+}
+
+void
+rspamd_worker_stat_scan_time (struct rspamd_stat *st, gdouble seconds)
+{
+	guint i;
+
+	if (isnan (seconds) || seconds < 0) {
+		return;
+	}
+
+	for (i = 0; i < RSPAMD_STAT_SCAN_TIME_BUCKETS - 1; i ++) {
+		if (seconds <= rspamd_scan_time_bounds[i]) {
+			break;
+		}
+	}
+
+	RSPAMD_STAT_ADD (st, scan_time_buckets[i], 1);
+	RSPAMD_STAT_ADD (st, scan_time_usec, (guint64)(seconds * 1e6));
+}
+
+const gdouble *
+rspamd_worker_stat_scan_time_bounds (void)
+{
+	return rspamd_scan_time_bounds;
+}
+
+void
+rspamd_worker_stat_sum (struct rspamd_main *rspamd_main,
+		struct rspamd_stat *st, gboolean with_offset)
+{
+	guint64 *out = (guint64 *)st;
+	const guint64 *cur;
+	guint i, j;
+
+	memset (st, 0, sizeof (*st));
+
+	if (rspamd_main->stat_slots) {
+		for (i = 0; i < RSPAMD_STAT_MAX_SLOTS; i ++) {
+			cur = (const guint64 *)&rspamd_main->stat_slots[i].st;
+
+			for (j = 0; j < RSPAMD_STAT_NCOUNTERS; j ++) {
+				out[j] += cur[j];
+			}
+		}
+	}
+
+	if (with_offset && rspamd_main->stat) {
+		cur = (const guint64 *)rspamd_main->stat;
+
+		/* Offset may be "negative" after reset, so unsigned wrap is used */
+		for (j = 0; j < RSPAMD_STAT_NCOUNTERS; j ++) {
+			out[j] += cur[j];
+		}
+	}
+}
+
+void
+rspamd_worker_stat_set (struct rspamd_main *rspamd_main,
+		const struct rspamd_stat *st)
+{
+	struct rspamd_stat total, offset;
+	guint64 *off = (guint64 *)&offset;
+	const guint64 *tot = (const guint64 *)&total, *req = (const guint64 *)st;
+	guint j;
+
+	if (rspamd_main->stat == NULL) {
+		return;
+	}
+
+	rspamd_worker_stat_sum (rspamd_main, &total, FALSE);
+
+	for (j = 0; j < RSPAMD_STAT_NCOUNTERS; j ++) {
+		off[j] = (req ? req[j] : 0) - tot[j];
+	}
+
+	memcpy (rspamd_main->stat, &offset, sizeof (offset));
+}
+
 static void
 rspamd_worker_on_term (EV_P_ ev_child *w, int revents)
 {
@@ -715,6 +872,7 @@ rspamd_fork_worker (struct rspamd_main *rspamd_main,
 	wrk->ctx = cf->ctx;
 	wrk->finish_actions = g_ptr_array_new ();
 	wrk->ppid = getpid ();
+	wrk->stat = rspamd_worker_stat_acquire (rspamd_main, cf->type);
 	wrk->pid = fork ();
 	wrk->cores_throttled = rspamd_main->cores_throttling;
 	wrk->term_handler = term_handler;
@@ -798,12 +956,19 @@ rspamd_fork_worker (struct rspamd_main *rspamd_main,
 		close (wrk->srv_pipe[0]);
 		rspamd_socket_nonblocking (wrk->control_pipe[1]);
 		rspamd_socket_nonblocking (wrk->srv_pipe[1]);
+
+		if (wrk->stat) {
+			rspamd_map_set_stat_shard ((struct rspamd_stat_slot *)wrk->stat -
+					rspamd_main->stat_slots);
+		}
+
 		/* Execute worker */
 		cf->worker->worker_start_func (wrk);
 		exit (EXIT_FAILURE);
 		break;
 	case -1:
 		msg_err_main ("cannot fork main process. %s", strerror (errno));
+		rspamd_worker_stat_release (rspamd_main, wrk);
 
 		if (rspamd_main->pfh) {
 			rspamd_pidfile_remove (rspamd_main->pfh);
@@ -824,6 +989,10 @@ rspamd_fork_worker (struct rspamd_main *rspamd_main,
 		/* Insert worker into worker's table, pid is index */
 		g_hash_table_insert (rspamd_main->workers, GSIZE_TO_POINTER (
 				wrk->pid), wrk);
+
+		if (wrk->stat) {
+			((struct rspamd_stat_slot *)wrk->stat)->pid = wrk->pid;
+		}
 		break;
 	}
 
@@ -223,6 +223,59 @@ void rspamd_worker_throttle_accept_events (gint sock, void *data);
 gboolean rspamd_check_termination_clause (struct rspamd_main *rspamd_main,
 		struct rspamd_worker *wrk, int status);
 
+/**
+ * Allocates statistics slots for all processes in shared memory
+ * @param rspamd_main
+ */
+void rspamd_worker_stat_init (struct rspamd_main *rspamd_main);
+
+/**
+ * Returns statistics slot of the specified worker
+ * @param w
+ * @return
+ */
+struct rspamd_stat *rspamd_worker_stat (struct rspamd_worker *w);
+
+/**
+ * Marks statistics slot of a terminated worker as free, counters are kept
+ * @param rspamd_main
+ * @param w
+ */
+void rspamd_worker_stat_release (struct rspamd_main *rspamd_main,
+		struct rspamd_worker *w);
+
+/**
+ * Adds scan time of a message to the histogram
+ * @param st
+ * @param seconds
+ */
+void rspamd_worker_stat_scan_time (struct rspamd_stat *st, gdouble seconds);
+
+/**
+ * Returns upper bounds of the scan time histogram buckets
+ * (RSPAMD_STAT_SCAN_TIME_BUCKETS elements, the last one is infinity)
+ * @return
+ */
+const gdouble *rspamd_worker_stat_scan_time_bounds (void);
+
+/**
+ * Sums statistics of all processes without any IPC
+ * @param rspamd_main
+ * @param st output
+ * @param with_offset if TRUE then apply offset set by reset or restore
+ */
+void rspamd_worker_stat_sum (struct rspamd_main *rspamd_main,
+		struct rspamd_stat *st, gboolean with_offset);
+
+/**
+ * Sets the reported statistics to the specified values or resets them if
+ * `st` is NULL, counters in the slots are not modified
+ * @param rspamd_main
+ * @param st
+ */
+void rspamd_worker_stat_set (struct rspamd_main *rspamd_main,
+		const struct rspamd_stat *st);
+
 #ifdef WITH_HYPERSCAN
 struct rspamd_control_command;
 gboolean rspamd_worker_hyperscan_ready (struct rspamd_main *rspamd_main,
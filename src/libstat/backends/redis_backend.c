@@ -19,6 +19,9 @@
 #include "upstream.h"
 #include "lua/lua_common.h"
 #include "libserver/mempool_vars_internal.h"
+#include "libserver/worker_util.h"
+#include "snapshot.h"
+#include "unix-std.h"
 
 #ifdef WITH_HIREDIS
 #include "hiredis.h"
@@ -40,6 +43,54 @@ INIT_LOG_MODULE(stat_redis)
 #define REDIS_DEFAULT_USERS_OBJECT "%s%l%r"
 #define REDIS_DEFAULT_TIMEOUT 0.5
 #define REDIS_STAT_TIMEOUT 30
+#define REDIS_DEFAULT_EXPIRY_BUCKET 86400
+#define REDIS_DEFAULT_EXPIRY_INTERVAL 60
+#define REDIS_DEFAULT_EXPIRY_BATCH 1000
+#define REDIS_EXPIRY_MAX_STEPS 64
+#define REDIS_DEFAULT_SNAPSHOT_INTERVAL 300
+#define REDIS_SNAPSHOT_CHECK_INTERVAL 10
+/* Snapshot older than this number of intervals is not used by default */
+#define REDIS_DEFAULT_SNAPSHOT_MAX_AGE_MULT 3
+#define REDIS_SNAPSHOT_SCAN_COUNT 1000
+
+/*
+ * Drains up to ARGV[1] tokens from a cold bucket KEYS[1]; a token is only
+ * removed if it has not been seen in a bucket newer than ARGV[2]
+ */
+static const gchar *redis_expiry_script = ""
+		"redis.replicate_commands() "
+		"local toks = redis.call('SPOP', KEYS[1], ARGV[1]) "
+		"local cutoff = tonumber(ARGV[2]) "
+		"local deleted, reclaimed = 0, 0 "
+		"for _,t in ipairs(toks) do "
+		"  local ls = redis.call('HGET', t, 'ls') "
+		"  if not ls or tonumber(ls) <= cutoff then "
+		"    local mem = redis.pcall('MEMORY', 'USAGE', t) "
+		"    if type(mem) == 'number' then reclaimed = reclaimed + mem end "
+		"    deleted = deleted + redis.call('DEL', t) "
+		"  end "
+		"end "
+		"local left = redis.call('SCARD', KEYS[1]) "
+		"if left == 0 then "
+		"  redis.call('ZREM', KEYS[2], KEYS[1]) "
+		"  redis.call('HINCRBY', KEYS[3], 'buckets', 1) "
+		"end "
+		"redis.call('HINCRBY', KEYS[3], 'checked', #toks) "
+		"redis.call('HINCRBY', KEYS[3], 'expired', deleted) "
+		"redis.call('HINCRBY', KEYS[3], 'reclaimed', reclaimed) "
+		"return {#toks, deleted, left, reclaimed}";
+
+/*
+ * Touches tokens KEYS[3..] in a bucket ARGV[1]: sets their `ls` field, adds
+ * them to the bucket set KEYS[1] and registers the bucket in the index KEYS[2]
+ */
+static const gchar *redis_touch_script = ""
+		"for i = 3, #KEYS do "
+		"  redis.call('HSET', KEYS[i], 'ls', ARGV[1]) "
+		"  redis.call('SADD', KEYS[1], KEYS[i]) "
+		"end "
+		"redis.call('ZADD', KEYS[2], ARGV[1], KEYS[1]) "
+		"return #KEYS - 2";
 
 struct redis_stat_ctx {
 	lua_State *L;
@@ -55,6 +106,27 @@ struct redis_stat_ctx {
 	gboolean new_schema;
 	gboolean enable_signatures;
 	guint expiry;
+	guint expiry_buckets;
+	guint expiry_bucket_size;
+	guint expiry_batch;
+	gdouble expiry_interval;
+	gboolean expiry_on_classify;
+	const gchar *class_field;
+	const gchar *learned_key;
+	/* Multi-class classifiers: all classes are fetched by a single statfile */
+	GArray *mc_ids;
+	GPtrArray *mc_fields;
+	gboolean mc_checked;
+	gboolean mc_leader;
+	/* Read only local snapshot used for classification */
+	const gchar *snapshot_path;
+	gdouble snapshot_interval;
+	gdouble snapshot_max_age;
+	gdouble snapshot_checked;
+	gboolean snapshot_expired;
+	/* Spam statfile of the classifier, that maps snapshot for both classes */
+	struct redis_stat_ctx *snapshot_owner;
+	struct rspamd_stat_snapshot *snapshot;
 	gint cbref_user;
 };
 
@@ -79,6 +151,7 @@ struct redis_stat_runtime {
 	gint id;
 	gboolean has_event;
 	GError *err;
+	struct rspamd_stat_snapshot *snapshot;
 };
 
 /* Used to get statistics from redis */
@@ -102,6 +175,73 @@ struct rspamd_redis_stat_cbdata {
 	gboolean wanna_die;
 };
 
+/* Used to drop cold expiry buckets */
+struct rspamd_redis_expiry_cbdata;
+
+struct rspamd_redis_expiry_elt {
+	struct redis_stat_ctx *ctx;
+	struct rspamd_stat_async_elt *async;
+	struct ev_loop *event_loop;
+	struct rspamd_redis_expiry_cbdata *cbdata;
+};
+
+struct rspamd_redis_expiry_cbdata {
+	struct rspamd_redis_expiry_elt *elt;
+	redisAsyncContext *redis;
+	struct upstream *selected;
+	gchar *bucket;
+	guint64 cutoff;
+	guint steps;
+	guint64 checked;
+	guint64 expired;
+	guint64 reclaimed;
+	gboolean wanna_die;
+};
+
+/* Used to build local snapshot of tokens */
+struct rspamd_redis_snapshot_cbdata;
+
+struct rspamd_redis_snapshot_elt {
+	struct redis_stat_ctx *ctx;
+	struct rspamd_stat_async_elt *async;
+	struct ev_loop *event_loop;
+	struct rspamd_redis_snapshot_cbdata *cbdata;
+};
+
+enum rspamd_redis_snapshot_mode {
+	/* Scan all tokens in redis */
+	RSPAMD_REDIS_SNAPSHOT_FULL = 0,
+	/* Apply tokens from the recent expiry buckets to the existing snapshot */
+	RSPAMD_REDIS_SNAPSHOT_DELTA,
+};
+
+struct rspamd_redis_snapshot_cbdata {
+	struct rspamd_redis_snapshot_elt *elt;
+	redisAsyncContext *redis;
+	struct upstream *selected;
+	gchar *prefix;
+	enum rspamd_redis_snapshot_mode mode;
+	/* Tokens of the current batch (full) or all changed tokens (delta) */
+	GArray *entries; /* struct rspamd_stat_snapshot_entry */
+	/* Full scan stores tokens in a file and not in memory */
+	gchar *scan_path;
+	gint scan_fd;
+	gsize nscanned;
+	/* Delta is applied to the base snapshot */
+	struct rspamd_stat_snapshot *base;
+	GPtrArray *buckets;
+	guint64 from_bucket;
+	guint cur_bucket;
+	GPtrArray *cur_keys;
+	gchar *cursor;
+	struct rspamd_stat_snapshot_meta meta;
+	guint cur_idx;
+	gint lock_fd;
+	gdouble start;
+	gdouble last_progress;
+	gboolean wanna_die;
+};
+
 #define GET_TASK_ELT(task, elt) (task == NULL ? NULL : (task)->elt)
 
 static const gchar *M = "redis statistics";
@@ -470,7 +610,8 @@ rspamd_redis_tokens_to_query (struct rspamd_task *task,
 								"%s\r\n",
 						cmd_len, command,
 						l0, n0,
-						1, rt->stcf->is_spam ? "S" : "H",
+						(gint)strlen (rt->ctx->class_field),
+						rt->ctx->class_field,
 						l1, n1);
 			}
 			else {
@@ -594,7 +735,8 @@ rspamd_redis_tokens_to_query (struct rspamd_task *task,
 								"%s\r\n",
 						cmd_len, command,
 						l0, n0,
-						1, rt->stcf->is_spam ? "S" : "H");
+						(gint)strlen (rt->ctx->class_field),
+						rt->ctx->class_field);
 
 				ret = redisAsyncFormattedCommand (rt->redis, NULL, NULL,
 						out->str, out->len);
@@ -645,7 +787,7 @@ rspamd_redis_store_stat_signature (struct rspamd_task *task,
 	}
 
 	klen = rspamd_snprintf (keybuf, sizeof (keybuf), "%s_%s_%s",
-			prefix, sig, rt->stcf->is_spam ? "S" : "H");
+			prefix, sig, rt->ctx->class_field);
 
 	out->len = 0;
 
@@ -703,6 +845,98 @@ rspamd_redis_store_stat_signature (struct rspamd_task *task,
 	rspamd_fstring_free (out);
 }
 
+static inline const gchar *
+rspamd_redis_expiry_index (struct redis_stat_ctx *ctx, gchar *buf, gsize len)
+{
+	rspamd_snprintf (buf, len, "%s_expiry",
+			ctx->stcf->clcf->name ? ctx->stcf->clcf->name : "bayes");
+
+	return buf;
+}
+
+/*
+ * Records tokens in the current expiry bucket: each token gets its last seen
+ * bucket id in `ls` field and is added to the set `<prefix>_exp<bucket>`.
+ * All tokens are touched by a single script call.
+ * If `only_found` is set, then only tokens with non-zero values for this
+ * statfile are touched (used on classification).
+ * Returns number of tokens touched, the command is sent with `cb`
+ */
+static guint
+rspamd_redis_touch_tokens (struct rspamd_task *task,
+		struct redis_stat_runtime *rt,
+		GPtrArray *tokens,
+		const gchar *prefix,
+		gboolean only_found,
+		redisCallbackFn *cb)
+{
+	rspamd_fstring_t *out;
+	rspamd_token_t *tok;
+	gchar keybuf[512], idxbuf[512], n0[512], nbuf[64];
+	guint i, klen, l0, blen, ilen, prefix_len, ntouch = 0;
+	guint64 bucket;
+
+	bucket = (guint64)task->task_timestamp / rt->ctx->expiry_bucket_size;
+	prefix_len = strlen (prefix);
+	blen = rspamd_snprintf (nbuf, sizeof (nbuf), "%uL", bucket);
+	klen = rspamd_snprintf (keybuf, sizeof (keybuf), "%s_exp%uL",
+			prefix, bucket);
+	rspamd_redis_expiry_index (rt->ctx, idxbuf, sizeof (idxbuf));
+	ilen = strlen (idxbuf);
+
+	PTR_ARRAY_FOREACH (tokens, i, tok) {
+		if (!only_found || tok->values[rt->id] != 0) {
+			ntouch ++;
+		}
+	}
+
+	if (ntouch == 0) {
+		return 0;
+	}
+
+	l0 = rspamd_snprintf (n0, sizeof (n0), "%d", ntouch + 2);
+	out = rspamd_fstring_sized_new (1024 + ntouch * (prefix_len + 32));
+	rspamd_printf_fstring (&out, ""
+					"*%d\r\n"
+					"$4\r\n"
+					"EVAL\r\n"
+					"$%d\r\n"
+					"%s\r\n"
+					"$%d\r\n"
+					"%s\r\n"
+					"$%d\r\n"
+					"%s\r\n"
+					"$%d\r\n"
+					"%s\r\n",
+			ntouch + 6,
+			(gint)strlen (redis_touch_script), redis_touch_script,
+			l0, n0,
+			klen, keybuf,
+			ilen, idxbuf);
+
+	PTR_ARRAY_FOREACH (tokens, i, tok) {
+		if (only_found && tok->values[rt->id] == 0) {
+			continue;
+		}
+
+		l0 = rspamd_snprintf (n0, sizeof (n0), "%*s_%uL",
+				prefix_len, prefix,
+				tok->data);
+		rspamd_printf_fstring (&out, ""
+				"$%d\r\n"
+				"%s\r\n", l0, n0);
+	}
+
+	rspamd_printf_fstring (&out, ""
+			"$%d\r\n"
+			"%s\r\n", blen, nbuf);
+	redisAsyncFormattedCommand (rt->redis, cb, rt,
+			out->str, out->len);
+	rspamd_fstring_free (out);
+
+	return ntouch;
+}
+
 static void
 rspamd_redis_async_cbdata_cleanup (struct rspamd_redis_stat_cbdata *cbdata)
 {
@@ -830,6 +1064,47 @@ rspamd_redis_stat_key (redisAsyncContext *c, gpointer r, gpointer priv)
 	}
 }
 
+/* Called when we get expiry statistics */
+static void
+rspamd_redis_stat_expiry (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct rspamd_redis_stat_cbdata *cbdata = priv;
+	redisReply *reply = r, *elt;
+	ucl_object_t *obj;
+	static const gchar *fields[] = {"checked", "expired", "reclaimed", "buckets"};
+	gulong num;
+	guint i;
+
+	if (cbdata->wanna_die) {
+		return;
+	}
+
+	cbdata->inflight --;
+
+	if (c->err == 0 && r != NULL && reply->type == REDIS_REPLY_ARRAY &&
+			reply->elements == G_N_ELEMENTS (fields)) {
+		obj = ucl_object_typed_new (UCL_OBJECT);
+
+		for (i = 0; i < reply->elements; i ++) {
+			elt = reply->element[i];
+			num = 0;
+
+			if (elt->type == REDIS_REPLY_STRING) {
+				rspamd_strtoul (elt->str, elt->len, &num);
+			}
+
+			ucl_object_insert_key (obj, ucl_object_fromint (num),
+					fields[i], 0, false);
+		}
+
+		ucl_object_replace_key (cbdata->cur, obj, "expiry", 0, false);
+	}
+
+	if (cbdata->inflight == 0) {
+		rspamd_redis_async_cbdata_cleanup (cbdata);
+	}
+}
+
 /* Called when we have connected to the redis server and got keys to check */
 static void
 rspamd_redis_stat_keys (redisAsyncContext *c, gpointer r, gpointer priv)
@@ -866,15 +1141,9 @@ rspamd_redis_stat_keys (redisAsyncContext *c, gpointer r, gpointer priv)
 					k = (gchar *)g_ptr_array_index (cbdata->cur_keys, i);
 
 					if (k) {
-						const gchar *learned_key = "learns";
+						const gchar *learned_key = cbdata->elt->ctx->learned_key;
 
 						if (cbdata->elt->ctx->new_schema) {
-							if (cbdata->elt->ctx->stcf->is_spam) {
-								learned_key = "learns_spam";
-							}
-							else {
-								learned_key = "learns_ham";
-							}
 							redisAsyncCommand (cbdata->redis,
 									rspamd_redis_stat_learns,
 									cbdata,
@@ -1000,6 +1269,15 @@ rspamd_redis_async_stat_cb (struct rspamd_stat_async_elt *elt, gpointer d)
 	redisAsyncCommand (cbdata->redis, rspamd_redis_stat_keys, cbdata,
 			"SMEMBERS %s_keys",
 			ctx->stcf->symbol);
+
+	if (ctx->expiry_buckets > 0) {
+		gchar idxbuf[512];
+
+		redisAsyncCommand (cbdata->redis, rspamd_redis_stat_expiry, cbdata,
+				"HMGET %s_stat checked expired reclaimed buckets",
+				rspamd_redis_expiry_index (ctx, idxbuf, sizeof (idxbuf)));
+		cbdata->inflight ++;
+	}
 }
 
 static void
@@ -1010,167 +1288,1209 @@ rspamd_redis_async_stat_fin (struct rspamd_stat_async_elt *elt, gpointer d)
 	rspamd_redis_async_cbdata_cleanup (redis_elt->cbdata);
 }
 
-/* Called on connection termination */
 static void
-rspamd_redis_fin (gpointer data)
+rspamd_redis_expiry_cbdata_cleanup (struct rspamd_redis_expiry_cbdata *cbdata)
 {
-	struct redis_stat_runtime *rt = REDIS_RUNTIME (data);
-	redisAsyncContext *redis;
+	if (cbdata && !cbdata->wanna_die) {
+		cbdata->wanna_die = TRUE;
+		redisAsyncFree (cbdata->redis);
 
-	rt->has_event = FALSE;
-	/* Stop timeout */
-	if (ev_is_active (&rt->timeout_event)) {
-		ev_timer_stop (rt->task->event_loop, &rt->timeout_event);
-	}
+		if (cbdata->elt) {
+			cbdata->elt->cbdata = NULL;
+			cbdata->elt->async->enabled = TRUE;
+		}
 
-	if (rt->redis) {
-		redis = rt->redis;
-		rt->redis = NULL;
-		/* This calls for all callbacks pending */
-		redisAsyncFree (redis);
+		g_free (cbdata->bucket);
+		g_free (cbdata);
 	}
 }
 
 static void
-rspamd_redis_fin_learn (gpointer data)
+rspamd_redis_expiry_unlocked (redisAsyncContext *c, gpointer r, gpointer priv)
 {
-	struct redis_stat_runtime *rt = REDIS_RUNTIME (data);
-	redisAsyncContext *redis;
-
-	rt->has_event = FALSE;
-	/* Stop timeout */
-	ev_timer_stop (rt->task->event_loop, &rt->timeout_event);
+	struct rspamd_redis_expiry_cbdata *cbdata = priv;
 
-	if (rt->redis) {
-		redis = rt->redis;
-		rt->redis = NULL;
-		/* This calls for all callbacks pending */
-		redisAsyncFree (redis);
+	if (cbdata->wanna_die) {
+		return;
 	}
+
+	rspamd_redis_expiry_cbdata_cleanup (cbdata);
 }
 
 static void
-rspamd_redis_timeout (EV_P_ ev_timer *w, int revents)
+rspamd_redis_expiry_finish (struct rspamd_redis_expiry_cbdata *cbdata)
 {
-	struct redis_stat_runtime *rt = REDIS_RUNTIME (w->data);
-	struct rspamd_task *task;
-	redisAsyncContext *redis;
-
-	task = rt->task;
-
-	msg_err_task_check ("connection to redis server %s timed out",
-			rspamd_upstream_name (rt->selected));
+	gchar idxbuf[512];
 
-	rspamd_upstream_fail (rt->selected, FALSE);
-
-	if (rt->redis) {
-		redis = rt->redis;
-		rt->redis = NULL;
-		/* This calls for all callbacks pending */
-		redisAsyncFree (redis);
+	if (cbdata->checked > 0) {
+		msg_info ("expiry for %s: checked %uL tokens in %ud steps, "
+				"expired %uL tokens, reclaimed %uL bytes",
+				rspamd_redis_expiry_index (cbdata->elt->ctx, idxbuf,
+						sizeof (idxbuf)),
+				cbdata->checked, cbdata->steps,
+				cbdata->expired, cbdata->reclaimed);
 	}
 
-	if (!rt->err) {
-		g_set_error (&rt->err, rspamd_redis_stat_quark (), ETIMEDOUT,
-				"error getting reply from redis server %s: timeout",
-				rspamd_upstream_name (rt->selected));
-	}
+	rspamd_redis_expiry_index (cbdata->elt->ctx, idxbuf, sizeof (idxbuf));
+	redisAsyncCommand (cbdata->redis, rspamd_redis_expiry_unlocked, cbdata,
+			"DEL %s_lock", idxbuf);
 }
 
-/* Called when we have connected to the redis server and got stats */
+static void rspamd_redis_expiry_step (struct rspamd_redis_expiry_cbdata *cbdata);
+
+/* Called when a batch of tokens has been drained from a cold bucket */
 static void
-rspamd_redis_connected (redisAsyncContext *c, gpointer r, gpointer priv)
+rspamd_redis_expiry_drained (redisAsyncContext *c, gpointer r, gpointer priv)
 {
-	struct redis_stat_runtime *rt = REDIS_RUNTIME (priv);
+	struct rspamd_redis_expiry_cbdata *cbdata = priv;
 	redisReply *reply = r;
-	struct rspamd_task *task;
-	glong val = 0;
+	guint64 checked, expired, left, reclaimed;
 
-	task = rt->task;
+	if (cbdata->wanna_die) {
+		return;
+	}
 
-	if (c->err == 0) {
-		if (r != NULL) {
-			if (G_UNLIKELY (reply->type == REDIS_REPLY_INTEGER)) {
-				val = reply->integer;
-			}
-			else if (reply->type == REDIS_REPLY_STRING) {
-				rspamd_strtol (reply->str, reply->len, &val);
-			}
-			else {
-				if (reply->type != REDIS_REPLY_NIL) {
-					msg_err_task ("bad learned type for %s: %s, nil expected",
-						rt->stcf->symbol,
-						rspamd_redis_type_to_string (reply->type));
-				}
+	if (c->err == 0 && r != NULL && reply->type == REDIS_REPLY_ARRAY &&
+			reply->elements == 4) {
+		checked = reply->element[0]->integer;
+		expired = reply->element[1]->integer;
+		left = reply->element[2]->integer;
+		reclaimed = reply->element[3]->integer;
 
-				val = 0;
-			}
+		cbdata->checked += checked;
+		cbdata->expired += expired;
+		cbdata->reclaimed += reclaimed;
+		cbdata->steps ++;
 
-			if (val < 0) {
-				msg_warn_task ("invalid number of learns for %s: %L",
-						rt->stcf->symbol, val);
-				val = 0;
-			}
+		msg_debug ("expiry bucket %s: checked %uL, expired %uL, "
+				"%uL tokens left, %uL bytes reclaimed",
+				cbdata->bucket, checked, expired, left, reclaimed);
+		rspamd_upstream_ok (cbdata->selected);
 
-			rt->learned = val;
-			msg_debug_stat_redis ("connected to redis server, tokens learned for %s: %uL",
-					rt->redis_object_expanded, rt->learned);
-			rspamd_upstream_ok (rt->selected);
+		if (cbdata->steps < REDIS_EXPIRY_MAX_STEPS) {
+			rspamd_redis_expiry_step (cbdata);
+		}
+		else {
+			/* Continue on the next iteration */
+			rspamd_redis_expiry_finish (cbdata);
 		}
 	}
 	else {
-		msg_err_task ("error getting reply from redis server %s: %s",
-				rspamd_upstream_name (rt->selected), c->errstr);
-		rspamd_upstream_fail (rt->selected, FALSE);
-
-		if (!rt->err) {
-			g_set_error (&rt->err, rspamd_redis_stat_quark (), c->err,
-					"error getting reply from redis server %s: %s",
-					rspamd_upstream_name (rt->selected), c->errstr);
+		if (c->err) {
+			msg_err ("cannot expire bucket %s: %s", cbdata->bucket, c->errstr);
+			rspamd_upstream_fail (cbdata->selected, FALSE);
+			rspamd_redis_expiry_cbdata_cleanup (cbdata);
+		}
+		else {
+			msg_err ("cannot expire bucket %s: %s", cbdata->bucket,
+					(reply && reply->type == REDIS_REPLY_ERROR) ?
+					reply->str : "bad reply");
+			rspamd_redis_expiry_finish (cbdata);
 		}
 	}
-
 }
 
-/* Called when we have received tokens values from redis */
+/* Called when we have got the oldest cold bucket */
 static void
-rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
+rspamd_redis_expiry_bucket (redisAsyncContext *c, gpointer r, gpointer priv)
 {
-	struct redis_stat_runtime *rt = REDIS_RUNTIME (priv);
+	struct rspamd_redis_expiry_cbdata *cbdata = priv;
+	struct redis_stat_ctx *ctx;
 	redisReply *reply = r, *elt;
-	struct rspamd_task *task;
-	rspamd_token_t *tok;
-	guint i, processed = 0, found = 0;
-	gulong val;
-	gdouble float_val;
+	gchar idxbuf[512];
 
-	task = rt->task;
+	if (cbdata->wanna_die) {
+		return;
+	}
 
-	if (c->err == 0) {
-		if (r != NULL) {
-			if (reply->type == REDIS_REPLY_ARRAY) {
+	ctx = cbdata->elt->ctx;
 
-				if (reply->elements == task->tokens->len) {
-					for (i = 0; i < reply->elements; i ++) {
-						tok = g_ptr_array_index (task->tokens, i);
-						elt = reply->element[i];
+	if (c->err == 0 && r != NULL) {
+		if (reply->type == REDIS_REPLY_ARRAY && reply->elements > 0) {
+			elt = reply->element[0];
+
+			if (elt->type == REDIS_REPLY_STRING) {
+				g_free (cbdata->bucket);
+				cbdata->bucket = g_malloc (elt->len + 1);
+				rspamd_strlcpy (cbdata->bucket, elt->str, elt->len + 1);
+				rspamd_redis_expiry_index (ctx, idxbuf, sizeof (idxbuf));
+
+				redisAsyncCommand (cbdata->redis, rspamd_redis_expiry_drained,
+						cbdata,
+						"EVAL %s 3 %s %s %s_stat %d %lld",
+						redis_expiry_script,
+						cbdata->bucket,
+						idxbuf,
+						idxbuf,
+						ctx->expiry_batch,
+						(long long)cbdata->cutoff);
+
+				return;
+			}
+		}
 
-						if (G_UNLIKELY (elt->type == REDIS_REPLY_INTEGER)) {
-							tok->values[rt->id] = elt->integer;
-							found ++;
-						}
-						else if (elt->type == REDIS_REPLY_STRING) {
-							if (rt->stcf->clcf->flags &
-									RSPAMD_FLAG_CLASSIFIER_INTEGER) {
-								rspamd_strtoul (elt->str, elt->len, &val);
-								tok->values[rt->id] = val;
-							}
-							else {
-								float_val = strtod (elt->str, NULL);
-								tok->values[rt->id] = float_val;
-							}
+		/* No more cold buckets */
+		rspamd_redis_expiry_finish (cbdata);
+	}
+	else {
+		msg_err ("cannot get cold expiry buckets: %s",
+				c->err ? c->errstr : "unknown error");
+		rspamd_upstream_fail (cbdata->selected, FALSE);
+		rspamd_redis_expiry_cbdata_cleanup (cbdata);
+	}
+}
 
-							found ++;
+static void
+rspamd_redis_expiry_step (struct rspamd_redis_expiry_cbdata *cbdata)
+{
+	gchar idxbuf[512];
+
+	redisAsyncCommand (cbdata->redis, rspamd_redis_expiry_bucket, cbdata,
+			"ZRANGEBYSCORE %s -inf %lld LIMIT 0 1",
+			rspamd_redis_expiry_index (cbdata->elt->ctx, idxbuf,
+					sizeof (idxbuf)),
+			(long long)cbdata->cutoff);
+}
+
+/* Called when we have tried to acquire expiry lock */
+static void
+rspamd_redis_expiry_locked (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct rspamd_redis_expiry_cbdata *cbdata = priv;
+	redisReply *reply = r;
+
+	if (cbdata->wanna_die) {
+		return;
+	}
+
+	if (c->err == 0 && r != NULL) {
+		if (reply->type == REDIS_REPLY_STATUS) {
+			/* OK, we own the lock */
+			rspamd_redis_expiry_step (cbdata);
+		}
+		else {
+			/* Somebody else performs expiry now */
+			rspamd_redis_expiry_cbdata_cleanup (cbdata);
+		}
+	}
+	else {
+		msg_err ("cannot acquire expiry lock: %s",
+				c->err ? c->errstr : "unknown error");
+		rspamd_upstream_fail (cbdata->selected, FALSE);
+		rspamd_redis_expiry_cbdata_cleanup (cbdata);
+	}
+}
+
+static void
+rspamd_redis_async_expiry_cb (struct rspamd_stat_async_elt *elt, gpointer d)
+{
+	struct redis_stat_ctx *ctx;
+	struct rspamd_redis_expiry_elt *redis_elt = elt->ud;
+	struct rspamd_redis_expiry_cbdata *cbdata;
+	rspamd_inet_addr_t *addr;
+	struct upstream_list *ups;
+	guint64 now_bucket;
+	gchar idxbuf[512];
+
+	g_assert (redis_elt != NULL);
+
+	ctx = redis_elt->ctx;
+
+	if (redis_elt->cbdata) {
+		/* Previous run has stuck */
+		rspamd_redis_expiry_cbdata_cleanup (redis_elt->cbdata);
+	}
+
+	/* Expiry modifies data, so it must be done on write servers */
+	ups = rspamd_redis_get_servers (ctx, "write_servers");
+
+	if (!ups) {
+		return;
+	}
+
+	elt->enabled = FALSE;
+	cbdata = g_malloc0 (sizeof (*cbdata));
+	cbdata->selected = rspamd_upstream_get (ups,
+			RSPAMD_UPSTREAM_MASTER_SLAVE,
+			NULL,
+			0);
+
+	g_assert (cbdata->selected != NULL);
+	addr = rspamd_upstream_addr_next (cbdata->selected);
+	g_assert (addr != NULL);
+
+	if (rspamd_inet_address_get_af (addr) == AF_UNIX) {
+		cbdata->redis = redisAsyncConnectUnix (rspamd_inet_address_to_string (addr));
+	}
+	else {
+		cbdata->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
+				rspamd_inet_address_get_port (addr));
+	}
+
+	g_assert (cbdata->redis != NULL);
+
+	redisLibevAttach (redis_elt->event_loop, cbdata->redis);
+
+	/* Buckets older than this one are cold */
+	now_bucket = (guint64)ev_time () / ctx->expiry_bucket_size;
+	cbdata->cutoff = now_bucket > ctx->expiry_buckets ?
+			now_bucket - ctx->expiry_buckets : 0;
+	cbdata->elt = redis_elt;
+	redis_elt->cbdata = cbdata;
+
+	/* Only one process in the cluster performs expiry at a time */
+	rspamd_redis_maybe_auth (ctx, cbdata->redis);
+	redisAsyncCommand (cbdata->redis, rspamd_redis_expiry_locked, cbdata,
+			"SET %s_lock %d NX EX %d",
+			rspamd_redis_expiry_index (ctx, idxbuf, sizeof (idxbuf)),
+			(gint)getpid (),
+			(gint)(ctx->expiry_interval * 2));
+}
+
+static void
+rspamd_redis_async_expiry_fin (struct rspamd_stat_async_elt *elt, gpointer d)
+{
+	struct rspamd_redis_expiry_elt *redis_elt = elt->ud;
+
+	rspamd_redis_expiry_cbdata_cleanup (redis_elt->cbdata);
+	g_free (redis_elt);
+}
+
+/*
+ * Expands redis object without a task, so user specific objects are not
+ * supported for snapshots
+ */
+static gchar *
+rspamd_redis_snapshot_prefix (struct redis_stat_ctx *ctx)
+{
+	GString *res;
+	const gchar *p;
+
+	res = g_string_new (NULL);
+
+	for (p = ctx->redis_object; *p; p ++) {
+		if (*p == '%' && p[1] != '\0') {
+			p ++;
+
+			switch (*p) {
+			case '%':
+				g_string_append_c (res, '%');
+				break;
+			case 's':
+				g_string_append (res, ctx->new_schema ? "RS" : ctx->stcf->symbol);
+				break;
+			case 'l':
+				if (ctx->stcf->label) {
+					g_string_append (res, ctx->stcf->label);
+				}
+				break;
+			default:
+				g_string_free (res, TRUE);
+
+				return NULL;
+			}
+		}
+		else {
+			g_string_append_c (res, *p);
+		}
+	}
+
+	return g_string_free (res, FALSE);
+}
+
+static void
+rspamd_redis_snapshot_cbdata_cleanup (struct rspamd_redis_snapshot_cbdata *cbdata)
+{
+	guint i;
+
+	if (cbdata && !cbdata->wanna_die) {
+		cbdata->wanna_die = TRUE;
+
+		if (cbdata->redis) {
+			redisAsyncFree (cbdata->redis);
+		}
+
+		for (i = 0; i < cbdata->cur_keys->len; i ++) {
+			g_free (g_ptr_array_index (cbdata->cur_keys, i));
+		}
+
+		g_ptr_array_free (cbdata->cur_keys, TRUE);
+		g_array_free (cbdata->entries, TRUE);
+
+		if (cbdata->buckets) {
+			for (i = 0; i < cbdata->buckets->len; i ++) {
+				g_free (g_ptr_array_index (cbdata->buckets, i));
+			}
+
+			g_ptr_array_free (cbdata->buckets, TRUE);
+		}
+
+		if (cbdata->base) {
+			rspamd_stat_snapshot_close (cbdata->base);
+		}
+
+		if (cbdata->scan_fd != -1) {
+			close (cbdata->scan_fd);
+			unlink (cbdata->scan_path);
+		}
+
+		if (cbdata->lock_fd != -1) {
+			rspamd_file_unlock (cbdata->lock_fd, FALSE);
+			close (cbdata->lock_fd);
+		}
+
+		if (cbdata->elt) {
+			cbdata->elt->cbdata = NULL;
+		}
+
+		g_free (cbdata->scan_path);
+		g_free (cbdata->prefix);
+		g_free (cbdata->cursor);
+		g_free (cbdata);
+	}
+}
+
+static void
+rspamd_redis_snapshot_finish (struct rspamd_redis_snapshot_cbdata *cbdata)
+{
+	struct redis_stat_ctx *ctx = cbdata->elt->ctx;
+	struct rspamd_stat_snapshot_entry *entries = NULL;
+	GError *err = NULL;
+	gsize nelts, map_len = 0;
+	gboolean ret;
+
+	if (cbdata->mode == RSPAMD_REDIS_SNAPSHOT_DELTA) {
+		nelts = cbdata->entries->len;
+		ret = rspamd_stat_snapshot_merge (cbdata->base, ctx->snapshot_path,
+				(struct rspamd_stat_snapshot_entry *)cbdata->entries->data,
+				nelts, &cbdata->meta, &err);
+	}
+	else {
+		/* Scanned tokens are sorted in the file itself */
+		nelts = cbdata->nscanned;
+		map_len = nelts * sizeof (*entries);
+
+		if (map_len > 0) {
+			entries = mmap (NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+					cbdata->scan_fd, 0);
+
+			if (entries == MAP_FAILED) {
+				msg_err ("cannot mmap scanned tokens %s: %s", cbdata->scan_path,
+						strerror (errno));
+				rspamd_redis_snapshot_cbdata_cleanup (cbdata);
+
+				return;
+			}
+		}
+
+		ret = rspamd_stat_snapshot_write (ctx->snapshot_path, entries, nelts,
+				&cbdata->meta, &err);
+
+		if (map_len > 0) {
+			munmap (entries, map_len);
+		}
+	}
+
+	if (!ret) {
+		msg_err ("cannot write bayes snapshot: %e", err);
+		g_error_free (err);
+	}
+	else {
+		msg_info ("written bayes snapshot %s (%s): %uz tokens read, "
+				"%uL spam learns, %uL ham learns, %.2f seconds elapsed",
+				ctx->snapshot_path,
+				cbdata->mode == RSPAMD_REDIS_SNAPSHOT_DELTA ? "delta" : "full",
+				nelts,
+				cbdata->meta.learns_spam, cbdata->meta.learns_ham,
+				ev_time () - cbdata->start);
+	}
+
+	rspamd_redis_snapshot_cbdata_cleanup (cbdata);
+}
+
+static void rspamd_redis_snapshot_scanned (redisAsyncContext *c, gpointer r,
+		gpointer priv);
+
+/* Full scan keeps only the current batch in memory */
+static gboolean
+rspamd_redis_snapshot_flush (struct rspamd_redis_snapshot_cbdata *cbdata)
+{
+	gsize len;
+
+	if (cbdata->mode == RSPAMD_REDIS_SNAPSHOT_FULL && cbdata->entries->len > 0) {
+		len = cbdata->entries->len * sizeof (struct rspamd_stat_snapshot_entry);
+
+		if (write (cbdata->scan_fd, cbdata->entries->data, len) != (gssize)len) {
+			msg_err ("cannot write scanned tokens to %s: %s", cbdata->scan_path,
+					strerror (errno));
+
+			return FALSE;
+		}
+
+		cbdata->nscanned += cbdata->entries->len;
+		g_array_set_size (cbdata->entries, 0);
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_redis_snapshot_scan_next (struct rspamd_redis_snapshot_cbdata *cbdata)
+{
+	if (cbdata->mode == RSPAMD_REDIS_SNAPSHOT_DELTA) {
+		redisAsyncCommand (cbdata->redis, rspamd_redis_snapshot_scanned, cbdata,
+				"SSCAN %s %s COUNT %d",
+				(const gchar *)g_ptr_array_index (cbdata->buckets,
+						cbdata->cur_bucket),
+				cbdata->cursor, REDIS_SNAPSHOT_SCAN_COUNT);
+	}
+	else {
+		redisAsyncCommand (cbdata->redis, rspamd_redis_snapshot_scanned, cbdata,
+				"SCAN %s MATCH %s_* COUNT %d",
+				cbdata->cursor, cbdata->prefix, REDIS_SNAPSHOT_SCAN_COUNT);
+	}
+}
+
+/* Called when all keys of the current batch have been processed */
+static void
+rspamd_redis_snapshot_batch_done (struct rspamd_redis_snapshot_cbdata *cbdata)
+{
+	if (!rspamd_redis_snapshot_flush (cbdata)) {
+		rspamd_redis_snapshot_cbdata_cleanup (cbdata);
+
+		return;
+	}
+
+	if (strcmp (cbdata->cursor, "0") == 0) {
+		if (cbdata->mode == RSPAMD_REDIS_SNAPSHOT_DELTA &&
+				cbdata->cur_bucket + 1 < cbdata->buckets->len) {
+			/* Scan the next bucket from the beginning */
+			cbdata->cur_bucket ++;
+		}
+		else {
+			rspamd_redis_snapshot_finish (cbdata);
+
+			return;
+		}
+	}
+
+	rspamd_redis_snapshot_scan_next (cbdata);
+}
+
+/* Called when we get values for a key from the current scan batch */
+static void
+rspamd_redis_snapshot_values (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct rspamd_redis_snapshot_cbdata *cbdata = priv;
+	struct rspamd_stat_snapshot_entry entry;
+	redisReply *reply = r;
+	const gchar *key;
+	gulong spam = 0, ham = 0, token;
+	gsize prefix_len;
+
+	if (cbdata->wanna_die) {
+		return;
+	}
+
+	if (c->err != 0 || r == NULL) {
+		msg_err ("cannot build bayes snapshot: %s",
+				c->err ? c->errstr : "unknown error");
+		rspamd_upstream_fail (cbdata->selected, FALSE);
+		rspamd_redis_snapshot_cbdata_cleanup (cbdata);
+
+		return;
+	}
+
+	g_assert (cbdata->cur_idx < cbdata->cur_keys->len);
+	key = g_ptr_array_index (cbdata->cur_keys, cbdata->cur_idx);
+	cbdata->cur_idx ++;
+	cbdata->last_progress = ev_time ();
+	prefix_len = strlen (cbdata->prefix);
+
+	/* Other keys with the same prefix (e.g. expiry buckets) are ignored here */
+	if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 2 &&
+			strlen (key) > prefix_len &&
+			rspamd_strtoul (key + prefix_len + 1, strlen (key + prefix_len + 1),
+					&token)) {
+		if (reply->element[0]->type == REDIS_REPLY_STRING) {
+			rspamd_strtoul (reply->element[0]->str, reply->element[0]->len,
+					&spam);
+		}
+		if (reply->element[1]->type == REDIS_REPLY_STRING) {
+			rspamd_strtoul (reply->element[1]->str, reply->element[1]->len,
+					&ham);
+		}
+
+		/* Delta keeps empty tokens, as they are removed from the snapshot */
+		if (spam > 0 || ham > 0 ||
+				cbdata->mode == RSPAMD_REDIS_SNAPSHOT_DELTA) {
+			entry.token = token;
+			entry.spam = MIN (spam, G_MAXUINT32);
+			entry.ham = MIN (ham, G_MAXUINT32);
+			g_array_append_val (cbdata->entries, entry);
+		}
+	}
+
+	if (cbdata->cur_idx == cbdata->cur_keys->len) {
+		rspamd_redis_snapshot_batch_done (cbdata);
+	}
+}
+
+/* Called when we get the next batch of keys */
+static void
+rspamd_redis_snapshot_scanned (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct rspamd_redis_snapshot_cbdata *cbdata = priv;
+	redisReply *reply = r, *keys, *elt;
+	gchar *k;
+	guint i;
+
+	if (cbdata->wanna_die) {
+		return;
+	}
+
+	if (c->err != 0 || r == NULL || reply->type != REDIS_REPLY_ARRAY ||
+			reply->elements != 2 ||
+			reply->element[0]->type != REDIS_REPLY_STRING ||
+			reply->element[1]->type != REDIS_REPLY_ARRAY) {
+		msg_err ("cannot scan keys for bayes snapshot: %s",
+				c->err ? c->errstr : "bad reply");
+		rspamd_upstream_fail (cbdata->selected, FALSE);
+		rspamd_redis_snapshot_cbdata_cleanup (cbdata);
+
+		return;
+	}
+
+	cbdata->last_progress = ev_time ();
+	g_free (cbdata->cursor);
+	cbdata->cursor = g_strndup (reply->element[0]->str,
+			reply->element[0]->len);
+
+	for (i = 0; i < cbdata->cur_keys->len; i ++) {
+		g_free (g_ptr_array_index (cbdata->cur_keys, i));
+	}
+
+	g_ptr_array_set_size (cbdata->cur_keys, 0);
+	keys = reply->element[1];
+
+	for (i = 0; i < keys->elements; i ++) {
+		elt = keys->element[i];
+
+		if (elt->type == REDIS_REPLY_STRING) {
+			k = g_strndup (elt->str, elt->len);
+			g_ptr_array_add (cbdata->cur_keys, k);
+		}
+	}
+
+	cbdata->cur_idx = 0;
+
+	if (cbdata->cur_keys->len == 0) {
+		rspamd_redis_snapshot_batch_done (cbdata);
+
+		return;
+	}
+
+	/* Replies come in order, so cur_idx tracks the key being processed */
+	PTR_ARRAY_FOREACH (cbdata->cur_keys, i, k) {
+		redisAsyncCommand (cbdata->redis, rspamd_redis_snapshot_values, cbdata,
+				"HMGET %s S H", k);
+	}
+}
+
+/* Called when we get expiry buckets touched since the base snapshot */
+static void
+rspamd_redis_snapshot_buckets (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct rspamd_redis_snapshot_cbdata *cbdata = priv;
+	redisReply *reply = r, *elt;
+	gchar bucket_prefix[512];
+	gsize plen;
+	guint i;
+
+	if (cbdata->wanna_die) {
+		return;
+	}
+
+	if (c->err == 0 && r != NULL && reply->type == REDIS_REPLY_ARRAY) {
+		/* Index is shared by all statfiles of the classifier */
+		plen = rspamd_snprintf (bucket_prefix, sizeof (bucket_prefix), "%s_exp",
+				cbdata->prefix);
+
+		for (i = 0; i < reply->elements; i ++) {
+			elt = reply->element[i];
+
+			if (elt->type == REDIS_REPLY_STRING && elt->len > plen &&
+					memcmp (elt->str, bucket_prefix, plen) == 0) {
+				g_ptr_array_add (cbdata->buckets, g_strndup (elt->str, elt->len));
+			}
+		}
+
+		cbdata->last_progress = ev_time ();
+		rspamd_upstream_ok (cbdata->selected);
+
+		if (cbdata->buckets->len == 0) {
+			rspamd_redis_snapshot_finish (cbdata);
+		}
+		else {
+			rspamd_redis_snapshot_scan_next (cbdata);
+		}
+	}
+	else {
+		msg_err ("cannot get expiry buckets for bayes snapshot: %s",
+				c->err ? c->errstr : "bad reply");
+		rspamd_upstream_fail (cbdata->selected, FALSE);
+		rspamd_redis_snapshot_cbdata_cleanup (cbdata);
+	}
+}
+
+/* Called when we get learns for the snapshot */
+static void
+rspamd_redis_snapshot_learns (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct rspamd_redis_snapshot_cbdata *cbdata = priv;
+	redisReply *reply = r;
+	gchar idxbuf[512];
+	gulong num;
+
+	if (cbdata->wanna_die) {
+		return;
+	}
+
+	if (c->err == 0 && r != NULL && reply->type == REDIS_REPLY_ARRAY &&
+			reply->elements == 2) {
+		num = 0;
+
+		if (reply->element[0]->type == REDIS_REPLY_STRING) {
+			rspamd_strtoul (reply->element[0]->str, reply->element[0]->len, &num);
+		}
+
+		cbdata->meta.learns_spam = num;
+		num = 0;
+
+		if (reply->element[1]->type == REDIS_REPLY_STRING) {
+			rspamd_strtoul (reply->element[1]->str, reply->element[1]->len, &num);
+		}
+
+		cbdata->meta.learns_ham = num;
+		cbdata->last_progress = ev_time ();
+		rspamd_upstream_ok (cbdata->selected);
+
+		if (cbdata->mode == RSPAMD_REDIS_SNAPSHOT_DELTA) {
+			redisAsyncCommand (cbdata->redis, rspamd_redis_snapshot_buckets,
+					cbdata,
+					"ZRANGEBYSCORE %s %lld +inf",
+					rspamd_redis_expiry_index (cbdata->elt->ctx, idxbuf,
+							sizeof (idxbuf)),
+					(long long)cbdata->from_bucket);
+		}
+		else {
+			rspamd_redis_snapshot_scan_next (cbdata);
+		}
+	}
+	else {
+		msg_err ("cannot get learns for bayes snapshot: %s",
+				c->err ? c->errstr : "bad reply");
+		rspamd_upstream_fail (cbdata->selected, FALSE);
+		rspamd_redis_snapshot_cbdata_cleanup (cbdata);
+	}
+}
+
+/*
+ * Tokens touched since the previous snapshot are found in the expiry buckets,
+ * so the snapshot is updated by deltas. Tokens removed by expiry are not in
+ * these buckets, hence a full scan is still done once per expiry bucket
+ */
+static void
+rspamd_redis_snapshot_select_mode (struct redis_stat_ctx *ctx,
+		struct rspamd_redis_snapshot_cbdata *cbdata)
+{
+	struct rspamd_stat_snapshot_meta base_meta;
+	gdouble now = cbdata->meta.scan_start;
+
+	cbdata->mode = RSPAMD_REDIS_SNAPSHOT_FULL;
+
+	if (!ctx->new_schema || ctx->expiry_buckets == 0) {
+		return;
+	}
+
+	cbdata->base = rspamd_stat_snapshot_open (ctx->snapshot_path, NULL);
+
+	if (cbdata->base == NULL) {
+		return;
+	}
+
+	rspamd_stat_snapshot_get_meta (cbdata->base, &base_meta);
+
+	if (base_meta.scan_start > 0 && base_meta.full_scan_start > 0 &&
+			now - base_meta.full_scan_start < ctx->expiry_bucket_size) {
+		cbdata->mode = RSPAMD_REDIS_SNAPSHOT_DELTA;
+		cbdata->from_bucket = (guint64)base_meta.scan_start /
+				ctx->expiry_bucket_size;
+		cbdata->meta.full_scan_start = base_meta.full_scan_start;
+		cbdata->buckets = g_ptr_array_new ();
+	}
+	else {
+		rspamd_stat_snapshot_close (cbdata->base);
+		cbdata->base = NULL;
+	}
+}
+
+static void
+rspamd_redis_async_snapshot_cb (struct rspamd_stat_async_elt *elt, gpointer d)
+{
+	struct redis_stat_ctx *ctx;
+	struct rspamd_redis_snapshot_elt *redis_elt = elt->ud;
+	struct rspamd_redis_snapshot_cbdata *cbdata;
+	rspamd_inet_addr_t *addr;
+	struct upstream_list *ups;
+	struct stat st;
+	gchar lockbuf[PATH_MAX], *prefix;
+	gint fd;
+
+	g_assert (redis_elt != NULL);
+
+	ctx = redis_elt->ctx;
+
+	if (redis_elt->cbdata) {
+		if (ev_time () - redis_elt->cbdata->last_progress <
+				ctx->snapshot_interval) {
+			/* Still building */
+			return;
+		}
+
+		msg_warn ("bayes snapshot building has not progressed for %.2f seconds, "
+				"restart it", ev_time () - redis_elt->cbdata->last_progress);
+		rspamd_redis_snapshot_cbdata_cleanup (redis_elt->cbdata);
+	}
+
+	if (stat (ctx->snapshot_path, &st) != -1 &&
+			rspamd_get_calendar_ticks () - st.st_mtime < ctx->snapshot_interval) {
+		/* Fresh enough */
+		return;
+	}
+
+	prefix = rspamd_redis_snapshot_prefix (ctx);
+
+	if (prefix == NULL) {
+		return;
+	}
+
+	/* Only one process on a host builds snapshot */
+	rspamd_snprintf (lockbuf, sizeof (lockbuf), "%s.lock", ctx->snapshot_path);
+	fd = rspamd_file_xopen (lockbuf, O_RDWR | O_CREAT, 00644, FALSE);
+
+	if (fd == -1) {
+		msg_err ("cannot open snapshot lock %s: %s", lockbuf, strerror (errno));
+		g_free (prefix);
+
+		return;
+	}
+
+	if (!rspamd_file_lock (fd, TRUE)) {
+		close (fd);
+		g_free (prefix);
+
+		return;
+	}
+
+	ups = rspamd_redis_get_servers (ctx, "read_servers");
+
+	if (!ups) {
+		rspamd_file_unlock (fd, FALSE);
+		close (fd);
+		g_free (prefix);
+
+		return;
+	}
+
+	cbdata = g_malloc0 (sizeof (*cbdata));
+	cbdata->lock_fd = fd;
+	cbdata->scan_fd = -1;
+	cbdata->prefix = prefix;
+	cbdata->cursor = g_strdup ("0");
+	cbdata->start = ev_time ();
+	cbdata->last_progress = cbdata->start;
+	cbdata->meta.scan_start = rspamd_get_calendar_ticks ();
+	cbdata->meta.full_scan_start = cbdata->meta.scan_start;
+	cbdata->entries = g_array_sized_new (FALSE, FALSE,
+			sizeof (struct rspamd_stat_snapshot_entry), 1024);
+	cbdata->cur_keys = g_ptr_array_new ();
+
+	rspamd_redis_snapshot_select_mode (ctx, cbdata);
+
+	if (cbdata->mode == RSPAMD_REDIS_SNAPSHOT_FULL) {
+		cbdata->scan_path = g_strdup_printf ("%s.scan", ctx->snapshot_path);
+		cbdata->scan_fd = rspamd_file_xopen (cbdata->scan_path,
+				O_RDWR | O_CREAT | O_TRUNC, 00600, FALSE);
+
+		if (cbdata->scan_fd == -1) {
+			msg_err ("cannot open scanned tokens file %s: %s",
+					cbdata->scan_path, strerror (errno));
+			rspamd_redis_snapshot_cbdata_cleanup (cbdata);
+
+			return;
+		}
+	}
+
+	cbdata->selected = rspamd_upstream_get (ups,
+			RSPAMD_UPSTREAM_ROUND_ROBIN,
+			NULL,
+			0);
+
+	g_assert (cbdata->selected != NULL);
+	addr = rspamd_upstream_addr_next (cbdata->selected);
+	g_assert (addr != NULL);
+
+	if (rspamd_inet_address_get_af (addr) == AF_UNIX) {
+		cbdata->redis = redisAsyncConnectUnix (rspamd_inet_address_to_string (addr));
+	}
+	else {
+		cbdata->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
+				rspamd_inet_address_get_port (addr));
+	}
+
+	g_assert (cbdata->redis != NULL);
+
+	redisLibevAttach (redis_elt->event_loop, cbdata->redis);
+	cbdata->elt = redis_elt;
+	redis_elt->cbdata = cbdata;
+
+	rspamd_redis_maybe_auth (ctx, cbdata->redis);
+	redisAsyncCommand (cbdata->redis, rspamd_redis_snapshot_learns, cbdata,
+			"HMGET %s learns_spam learns_ham", prefix);
+}
+
+static void
+rspamd_redis_async_snapshot_fin (struct rspamd_stat_async_elt *elt, gpointer d)
+{
+	struct rspamd_redis_snapshot_elt *redis_elt = elt->ud;
+
+	rspamd_redis_snapshot_cbdata_cleanup (redis_elt->cbdata);
+	g_free (redis_elt);
+}
+
+/*
+ * Snapshot contains counts of both classes, so it is mapped just once
+ * per classifier by its spam statfile
+ */
+static struct redis_stat_ctx *
+rspamd_redis_snapshot_owner (struct redis_stat_ctx *ctx)
+{
+	struct rspamd_stat_ctx *st_ctx;
+	struct rspamd_statfile *st;
+	struct redis_stat_ctx *sibling;
+	guint i;
+
+	if (ctx->snapshot_owner) {
+		return ctx->snapshot_owner;
+	}
+
+	if (ctx->stcf->is_spam) {
+		ctx->snapshot_owner = ctx;
+
+		return ctx;
+	}
+
+	st_ctx = rspamd_stat_get_ctx ();
+
+	for (i = 0; i < st_ctx->statfiles->len; i ++) {
+		st = g_ptr_array_index (st_ctx->statfiles, i);
+
+		if (st->stcf->clcf != ctx->stcf->clcf || !st->stcf->is_spam ||
+				st->backend == NULL || st->bkcf == NULL ||
+				strcmp (st->backend->name, REDIS_BACKEND_TYPE) != 0) {
+			continue;
+		}
+
+		sibling = REDIS_CTX (st->bkcf);
+
+		if (sibling->snapshot_path &&
+				strcmp (sibling->snapshot_path, ctx->snapshot_path) == 0) {
+			ctx->snapshot_owner = sibling;
+
+			return sibling;
+		}
+	}
+
+	msg_err ("no spam statfile builds bayes snapshot %s for %s, disable it",
+			ctx->snapshot_path, ctx->stcf->symbol);
+	ctx->snapshot_path = NULL;
+
+	return NULL;
+}
+
+/*
+ * Maps snapshot and checks if it has been replaced from time to time
+ */
+static struct rspamd_stat_snapshot *
+rspamd_redis_load_snapshot (struct redis_stat_ctx *ctx, gdouble now)
+{
+	struct rspamd_stat_snapshot *nsnap;
+	GError *err = NULL;
+
+	if (now - ctx->snapshot_checked < REDIS_SNAPSHOT_CHECK_INTERVAL) {
+		return ctx->snapshot;
+	}
+
+	ctx->snapshot_checked = now;
+
+	if (ctx->snapshot && !rspamd_stat_snapshot_is_stale (ctx->snapshot)) {
+		return ctx->snapshot;
+	}
+
+	if (access (ctx->snapshot_path, R_OK) == -1) {
+		/* Not yet built */
+		return ctx->snapshot;
+	}
+
+	nsnap = rspamd_stat_snapshot_open (ctx->snapshot_path, &err);
+
+	if (nsnap == NULL) {
+		msg_err ("cannot load bayes snapshot: %e", err);
+		g_error_free (err);
+
+		return ctx->snapshot;
+	}
+
+	if (ctx->snapshot) {
+		rspamd_stat_snapshot_close (ctx->snapshot);
+	}
+
+	ctx->snapshot = nsnap;
+	msg_info ("loaded bayes snapshot %s for %s, created %.0f seconds ago",
+			ctx->snapshot_path, ctx->stcf->clcf->name,
+			rspamd_get_calendar_ticks () -
+			rspamd_stat_snapshot_timestamp (nsnap));
+
+	return ctx->snapshot;
+}
+
+/*
+ * Returns snapshot to classify with or NULL if live redis data should be
+ * used: snapshot is not configured, not yet built or too old
+ */
+static struct rspamd_stat_snapshot *
+rspamd_redis_maybe_load_snapshot (struct redis_stat_ctx *ctx, gdouble now)
+{
+	struct rspamd_stat_snapshot *snap;
+	gdouble age;
+
+	if (ctx->snapshot_path == NULL) {
+		return NULL;
+	}
+
+	ctx = rspamd_redis_snapshot_owner (ctx);
+
+	if (ctx == NULL) {
+		return NULL;
+	}
+
+	snap = rspamd_redis_load_snapshot (ctx, now);
+
+	if (snap == NULL) {
+		return NULL;
+	}
+
+	age = rspamd_get_calendar_ticks () - rspamd_stat_snapshot_timestamp (snap);
+
+	if (age > ctx->snapshot_max_age) {
+		if (!ctx->snapshot_expired) {
+			msg_warn ("bayes snapshot %s is %.0f seconds old, "
+					"use redis for %s until it is rebuilt",
+					ctx->snapshot_path, age, ctx->stcf->clcf->name);
+			ctx->snapshot_expired = TRUE;
+		}
+
+		return NULL;
+	}
+
+	ctx->snapshot_expired = FALSE;
+
+	return snap;
+}
+
+/* Called on connection termination */
+static void
+rspamd_redis_fin (gpointer data)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (data);
+	redisAsyncContext *redis;
+
+	rt->has_event = FALSE;
+	/* Stop timeout */
+	if (ev_is_active (&rt->timeout_event)) {
+		ev_timer_stop (rt->task->event_loop, &rt->timeout_event);
+	}
+
+	if (rt->redis) {
+		redis = rt->redis;
+		rt->redis = NULL;
+		/* This calls for all callbacks pending */
+		redisAsyncFree (redis);
+	}
+}
+
+static void
+rspamd_redis_fin_learn (gpointer data)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (data);
+	redisAsyncContext *redis;
+
+	rt->has_event = FALSE;
+	/* Stop timeout */
+	ev_timer_stop (rt->task->event_loop, &rt->timeout_event);
+
+	if (rt->redis) {
+		redis = rt->redis;
+		rt->redis = NULL;
+		/* This calls for all callbacks pending */
+		redisAsyncFree (redis);
+	}
+}
+
+static void
+rspamd_redis_timeout (EV_P_ ev_timer *w, int revents)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (w->data);
+	struct rspamd_task *task;
+	redisAsyncContext *redis;
+
+	task = rt->task;
+
+	msg_err_task_check ("connection to redis server %s timed out",
+			rspamd_upstream_name (rt->selected));
+
+	rspamd_upstream_fail (rt->selected, FALSE);
+
+	if (rt->redis) {
+		redis = rt->redis;
+		rt->redis = NULL;
+		/* This calls for all callbacks pending */
+		redisAsyncFree (redis);
+	}
+
+	if (!rt->err) {
+		g_set_error (&rt->err, rspamd_redis_stat_quark (), ETIMEDOUT,
+				"error getting reply from redis server %s: timeout",
+				rspamd_upstream_name (rt->selected));
+	}
+}
+
+/* Called when we have connected to the redis server and got stats */
+static void
+rspamd_redis_connected (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (priv);
+	redisReply *reply = r;
+	struct rspamd_task *task;
+	glong val = 0;
+
+	task = rt->task;
+
+	if (c->err == 0) {
+		if (r != NULL) {
+			if (G_UNLIKELY (reply->type == REDIS_REPLY_INTEGER)) {
+				val = reply->integer;
+			}
+			else if (reply->type == REDIS_REPLY_STRING) {
+				rspamd_strtol (reply->str, reply->len, &val);
+			}
+			else {
+				if (reply->type != REDIS_REPLY_NIL) {
+					msg_err_task ("bad learned type for %s: %s, nil expected",
+						rt->stcf->symbol,
+						rspamd_redis_type_to_string (reply->type));
+				}
+
+				val = 0;
+			}
+
+			if (val < 0) {
+				msg_warn_task ("invalid number of learns for %s: %L",
+						rt->stcf->symbol, val);
+				val = 0;
+			}
+
+			rt->learned = val;
+			msg_debug_stat_redis ("connected to redis server, tokens learned for %s: %uL",
+					rt->redis_object_expanded, rt->learned);
+			rspamd_upstream_ok (rt->selected);
+		}
+	}
+	else {
+		msg_err_task ("error getting reply from redis server %s: %s",
+				rspamd_upstream_name (rt->selected), c->errstr);
+		rspamd_upstream_fail (rt->selected, FALSE);
+
+		if (!rt->err) {
+			g_set_error (&rt->err, rspamd_redis_stat_quark (), c->err,
+					"error getting reply from redis server %s: %s",
+					rspamd_upstream_name (rt->selected), c->errstr);
+		}
+	}
+
+}
+
+/* Called when tokens are recorded in the expiry bucket on classification */
+static void
+rspamd_redis_touched (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (priv);
+	redisReply *reply = r;
+	struct rspamd_task *task;
+
+	task = rt->task;
+
+	if (c->err == 0 && reply != NULL && reply->type == REDIS_REPLY_ERROR) {
+		/* E.g. read only slave, that is not fatal for classification */
+		msg_debug_stat_redis ("cannot update expiry bucket for %s: %s",
+				rt->redis_object_expanded, reply->str);
+	}
+
+	if (rt->has_event) {
+		rspamd_session_remove_event (task->s, rspamd_redis_fin, rt);
+	}
+}
+
+/* Called when we have received tokens values from redis */
+static void
+rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (priv);
+	redisReply *reply = r, *elt;
+	struct rspamd_task *task;
+	rspamd_token_t *tok;
+	guint i, processed = 0, found = 0;
+	gulong val;
+	gdouble float_val;
+
+	task = rt->task;
+
+	if (c->err == 0) {
+		if (r != NULL) {
+			if (reply->type == REDIS_REPLY_ARRAY) {
+
+				if (reply->elements == task->tokens->len) {
+					for (i = 0; i < reply->elements; i ++) {
+						tok = g_ptr_array_index (task->tokens, i);
+						elt = reply->element[i];
+
+						if (G_UNLIKELY (elt->type == REDIS_REPLY_INTEGER)) {
+							tok->values[rt->id] = elt->integer;
+							found ++;
+						}
+						else if (elt->type == REDIS_REPLY_STRING) {
+							if (rt->stcf->clcf->flags &
+									RSPAMD_FLAG_CLASSIFIER_INTEGER) {
+								rspamd_strtoul (elt->str, elt->len, &val);
+								tok->values[rt->id] = val;
+							}
+							else {
+								float_val = strtod (elt->str, NULL);
+								tok->values[rt->id] = float_val;
+							}
+
+							found ++;
 						}
 						else {
 							tok->values[rt->id] = 0;
@@ -1219,6 +2539,16 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 	}
 
 	if (rt->has_event) {
+		if (c->err == 0 && rt->redis && rt->ctx->expiry_on_classify &&
+				rt->ctx->expiry_buckets > 0) {
+			if (rspamd_redis_touch_tokens (task, rt, task->tokens,
+					rt->redis_object_expanded, TRUE,
+					rspamd_redis_touched) > 0) {
+				/* Event is removed in rspamd_redis_touched */
+				return;
+			}
+		}
+
 		rspamd_session_remove_event (task->s, rspamd_redis_fin, rt);
 	}
 }
@@ -1347,6 +2677,84 @@ rspamd_redis_parse_classifier_opts (struct redis_stat_ctx *backend,
 	else {
 		backend->expiry = 0;
 	}
+
+	/* Incremental expiry using time sliced buckets */
+	elt = ucl_object_lookup (obj, "expiry_buckets");
+	if (elt) {
+		backend->expiry_buckets = ucl_object_toint (elt);
+	}
+	else {
+		backend->expiry_buckets = 0;
+	}
+
+	elt = ucl_object_lookup (obj, "expiry_bucket");
+	if (elt && ucl_object_todouble (elt) >= 1.0) {
+		backend->expiry_bucket_size = ucl_object_todouble (elt);
+	}
+	else {
+		backend->expiry_bucket_size = REDIS_DEFAULT_EXPIRY_BUCKET;
+	}
+
+	elt = ucl_object_lookup (obj, "expiry_batch");
+	if (elt && ucl_object_toint (elt) > 0) {
+		backend->expiry_batch = ucl_object_toint (elt);
+	}
+	else {
+		backend->expiry_batch = REDIS_DEFAULT_EXPIRY_BATCH;
+	}
+
+	elt = ucl_object_lookup (obj, "expiry_interval");
+	if (elt && ucl_object_todouble (elt) > 0) {
+		backend->expiry_interval = ucl_object_todouble (elt);
+	}
+	else {
+		backend->expiry_interval = REDIS_DEFAULT_EXPIRY_INTERVAL;
+	}
+
+	elt = ucl_object_lookup (obj, "expiry_on_classify");
+	if (elt) {
+		backend->expiry_on_classify = ucl_object_toboolean (elt);
+	}
+	else {
+		backend->expiry_on_classify = FALSE;
+	}
+
+	elt = ucl_object_lookup (obj, "snapshot");
+	if (elt && ucl_object_type (elt) == UCL_STRING) {
+		backend->snapshot_path = ucl_object_tostring (elt);
+	}
+	else {
+		backend->snapshot_path = NULL;
+	}
+
+	elt = ucl_object_lookup (obj, "snapshot_interval");
+	if (elt && ucl_object_todouble (elt) > 0) {
+		backend->snapshot_interval = ucl_object_todouble (elt);
+	}
+	else {
+		backend->snapshot_interval = REDIS_DEFAULT_SNAPSHOT_INTERVAL;
+	}
+
+	elt = ucl_object_lookup (obj, "snapshot_max_age");
+	if (elt && ucl_object_todouble (elt) > 0) {
+		backend->snapshot_max_age = ucl_object_todouble (elt);
+	}
+	else {
+		backend->snapshot_max_age = backend->snapshot_interval *
+				REDIS_DEFAULT_SNAPSHOT_MAX_AGE_MULT;
+	}
+
+	if (backend->snapshot_path && (!backend->new_schema ||
+			backend->enable_users)) {
+		msg_err_config ("bayes snapshot requires new schema and "
+				"is not supported for per user statistics, disable it");
+		backend->snapshot_path = NULL;
+	}
+
+	if (backend->expiry_buckets > 0 && !backend->new_schema) {
+		msg_err_config ("expiry buckets require new schema, disable them");
+		backend->expiry_buckets = 0;
+	}
 }
 
 gpointer
@@ -1441,6 +2849,34 @@ rspamd_redis_init (struct rspamd_stat_ctx *ctx,
 	stf->clcf->flags |= RSPAMD_FLAG_CLASSIFIER_INCREMENTING_BACKEND;
 	backend->stcf = stf;
 
+	if (stf->class_name) {
+		backend->class_field = stf->class_name;
+
+		if (backend->new_schema) {
+			backend->learned_key = rspamd_mempool_strconcat (cfg->cfg_pool,
+					"learns_", stf->class_name, NULL);
+		}
+		else {
+			backend->learned_key = "learns";
+		}
+	}
+	else {
+		backend->class_field = stf->is_spam ? "S" : "H";
+
+		if (backend->new_schema) {
+			backend->learned_key = stf->is_spam ? "learns_spam" : "learns_ham";
+		}
+		else {
+			backend->learned_key = "learns";
+		}
+	}
+
+	if (backend->snapshot_path && stf->class_name) {
+		msg_err_config ("bayes snapshot is not supported for multi-class "
+				"statfile %s, disable it", stf->symbol);
+		backend->snapshot_path = NULL;
+	}
+
 	st_elt = g_malloc0 (sizeof (*st_elt));
 	st_elt->event_loop = ctx->event_loop;
 	st_elt->ctx = backend;
@@ -1451,6 +2887,38 @@ rspamd_redis_init (struct rspamd_stat_ctx *ctx,
 			REDIS_STAT_TIMEOUT);
 	st_elt->async = backend->stat_elt;
 
+	/* Both statfiles share the same tokens, so expire them just once */
+	if (backend->expiry_buckets > 0 && stf->is_spam) {
+		struct rspamd_redis_expiry_elt *exp_elt;
+
+		exp_elt = g_malloc0 (sizeof (*exp_elt));
+		exp_elt->event_loop = ctx->event_loop;
+		exp_elt->ctx = backend;
+		exp_elt->async = rspamd_stat_ctx_register_async (
+				rspamd_redis_async_expiry_cb,
+				rspamd_redis_async_expiry_fin,
+				exp_elt,
+				backend->expiry_interval);
+	}
+
+	/*
+	 * Snapshot contains both spam and ham counts; it is built by the primary
+	 * controller only, whilst scanners just map it
+	 */
+	if (backend->snapshot_path && stf->is_spam &&
+			rspamd_worker_is_primary_controller (ctx->worker)) {
+		struct rspamd_redis_snapshot_elt *snap_elt;
+
+		snap_elt = g_malloc0 (sizeof (*snap_elt));
+		snap_elt->event_loop = ctx->event_loop;
+		snap_elt->ctx = backend;
+		snap_elt->async = rspamd_stat_ctx_register_async (
+				rspamd_redis_async_snapshot_cb,
+				rspamd_redis_async_snapshot_fin,
+				snap_elt,
+				REDIS_SNAPSHOT_CHECK_INTERVAL * 6);
+	}
+
 	return (gpointer)backend;
 }
 
@@ -1465,10 +2933,26 @@ rspamd_redis_runtime (struct rspamd_task *task,
 	struct upstream_list *ups;
 	char *object_expanded = NULL;
 	rspamd_inet_addr_t *addr;
+	struct rspamd_stat_snapshot *snap;
 
 	g_assert (ctx != NULL);
 	g_assert (stcf != NULL);
 
+	if (!learn && (snap = rspamd_redis_maybe_load_snapshot (ctx,
+			task->task_timestamp)) != NULL) {
+		/* Classify locally, no redis connection is needed */
+		rt = rspamd_mempool_alloc0 (task->task_pool, sizeof (*rt));
+		rspamd_mempool_add_destructor (task->task_pool,
+				rspamd_gerror_free_maybe, &rt->err);
+		rt->task = task;
+		rt->ctx = ctx;
+		rt->stcf = stcf;
+		rt->snapshot = snap;
+		rt->redis_object_expanded = (gchar *)ctx->snapshot_path;
+
+		return rt;
+	}
+
 	if (learn) {
 		ups = rspamd_redis_get_servers (ctx, "write_servers");
 
@@ -1550,9 +3034,296 @@ rspamd_redis_close (gpointer p)
 		luaL_unref (L, LUA_REGISTRYINDEX, ctx->conf_ref);
 	}
 
+	if (ctx->mc_ids) {
+		g_array_free (ctx->mc_ids, TRUE);
+		g_ptr_array_free (ctx->mc_fields, TRUE);
+	}
+
+	if (ctx->snapshot) {
+		rspamd_stat_snapshot_close (ctx->snapshot);
+	}
+
 	g_free (ctx);
 }
 
+static gboolean
+rspamd_redis_process_snapshot (struct rspamd_task *task,
+		struct redis_stat_runtime *rt,
+		GPtrArray *tokens,
+		gint id)
+{
+	struct rspamd_stat_snapshot *snap = rt->snapshot;
+	rspamd_token_t *tok;
+	guint i, spam, ham, found = 0;
+
+	rt->id = id;
+	rt->learned = rspamd_stat_snapshot_learns (snap, rt->stcf->is_spam);
+
+	PTR_ARRAY_FOREACH (tokens, i, tok) {
+		if (rspamd_stat_snapshot_lookup (snap, tok->data, &spam, &ham)) {
+			tok->values[id] = rt->stcf->is_spam ? spam : ham;
+			found ++;
+		}
+		else {
+			tok->values[id] = 0;
+		}
+	}
+
+	if (rt->stcf->is_spam) {
+		task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+	}
+	else {
+		task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+	}
+
+	msg_debug_stat_redis ("received tokens for %s from snapshot: "
+			"%d processed, %d found",
+			rt->stcf->symbol, (gint)tokens->len, found);
+
+	return TRUE;
+}
+
+/*
+ * For multi-class classifiers all classes of a token are stored in the same
+ * hash, so the first statfile of a classifier fetches all of them at once
+ */
+static void
+rspamd_redis_check_multiclass (struct redis_stat_ctx *ctx)
+{
+	struct rspamd_stat_ctx *st_ctx;
+	struct rspamd_statfile *st, *first = NULL;
+	struct redis_stat_ctx *sibling;
+	GArray *ids;
+	GPtrArray *fields;
+	guint i;
+
+	if (ctx->mc_checked) {
+		return;
+	}
+
+	ctx->mc_checked = TRUE;
+
+	if (!ctx->new_schema) {
+		return;
+	}
+
+	st_ctx = rspamd_stat_get_ctx ();
+	ids = g_array_new (FALSE, FALSE, sizeof (gint));
+	fields = g_ptr_array_new ();
+
+	for (i = 0; i < st_ctx->statfiles->len; i ++) {
+		st = g_ptr_array_index (st_ctx->statfiles, i);
+
+		if (st->stcf->clcf != ctx->stcf->clcf) {
+			continue;
+		}
+
+		if (st->backend == NULL || st->bkcf == NULL ||
+				strcmp (st->backend->name, REDIS_BACKEND_TYPE) != 0 ||
+				st->stcf->label != NULL) {
+			/* Cannot guarantee that all classes live in the same hash */
+			msg_info ("disable single lookup for classifier %s: statfile %s "
+					"has label or non redis backend",
+					ctx->stcf->clcf->name, st->stcf->symbol);
+			g_array_free (ids, TRUE);
+			g_ptr_array_free (fields, TRUE);
+
+			return;
+		}
+
+		if (first == NULL) {
+			first = st;
+		}
+
+		sibling = REDIS_CTX (st->bkcf);
+		g_array_append_val (ids, st->id);
+		g_ptr_array_add (fields, (gpointer)sibling->class_field);
+	}
+
+	ctx->mc_ids = ids;
+	ctx->mc_fields = fields;
+	ctx->mc_leader = (first != NULL && first->stcf == ctx->stcf);
+}
+
+/* Called when we get learns for a statfile whose tokens are fetched by other */
+static void
+rspamd_redis_learns_only (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (priv);
+	struct rspamd_task *task;
+
+	task = rt->task;
+	rspamd_redis_connected (c, r, priv);
+
+	if (rt->has_event) {
+		rspamd_session_remove_event (task->s, rspamd_redis_fin, rt);
+	}
+}
+
+/* Called when we have received values for all classes from redis */
+static void
+rspamd_redis_processed_multi (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (priv);
+	redisReply *reply = r, *elt, *val;
+	struct rspamd_task *task;
+	rspamd_token_t *tok;
+	GArray *ids;
+	guint i, k, found = 0;
+	gulong num;
+
+	task = rt->task;
+	ids = rt->ctx->mc_ids;
+
+	if (c->err == 0 && r != NULL) {
+		if (reply->type == REDIS_REPLY_ARRAY &&
+				reply->elements == task->tokens->len) {
+			for (i = 0; i < reply->elements; i ++) {
+				tok = g_ptr_array_index (task->tokens, i);
+				elt = reply->element[i];
+
+				if (elt->type != REDIS_REPLY_ARRAY || elt->elements != ids->len) {
+					continue;
+				}
+
+				for (k = 0; k < elt->elements; k ++) {
+					val = elt->element[k];
+					num = 0;
+
+					if (val->type == REDIS_REPLY_STRING) {
+						rspamd_strtoul (val->str, val->len, &num);
+						found ++;
+					}
+					else if (val->type == REDIS_REPLY_INTEGER) {
+						num = val->integer;
+						found ++;
+					}
+
+					tok->values[g_array_index (ids, gint, k)] = num;
+				}
+			}
+
+			msg_debug_stat_redis ("received tokens for %s: %d classes, %d found",
+					rt->redis_object_expanded, (gint)ids->len, found);
+			rspamd_upstream_ok (rt->selected);
+		}
+		else {
+			msg_err_task_check ("got invalid reply from redis: %s, "
+					"array of %d elements expected",
+					rspamd_redis_type_to_string (reply->type),
+					(gint)task->tokens->len);
+		}
+	}
+	else {
+		msg_err_task ("error getting reply from redis server %s: %s",
+				rspamd_upstream_name (rt->selected), c->errstr);
+
+		if (rt->redis) {
+			rspamd_upstream_fail (rt->selected, FALSE);
+		}
+
+		if (!rt->err) {
+			g_set_error (&rt->err, rspamd_redis_stat_quark (), c->err,
+					"cannot get values: error getting reply from redis server %s: %s",
+					rspamd_upstream_name (rt->selected), c->errstr);
+		}
+	}
+
+	if (rt->has_event) {
+		rspamd_session_remove_event (task->s, rspamd_redis_fin, rt);
+	}
+}
+
+static gboolean
+rspamd_redis_process_multiclass (struct rspamd_task *task,
+		struct redis_stat_runtime *rt,
+		GPtrArray *tokens)
+{
+	rspamd_fstring_t *out;
+	rspamd_token_t *tok;
+	const gchar *field;
+	gchar n0[512];
+	guint i, k, l0, prefix_len;
+	gint ret;
+
+	if (!rt->ctx->mc_leader) {
+		/* Values are filled by the leading statfile */
+		ret = redisAsyncCommand (rt->redis, rspamd_redis_learns_only, rt,
+				"HGET %s %s",
+				rt->redis_object_expanded, rt->ctx->learned_key);
+	}
+	else {
+		ret = redisAsyncCommand (rt->redis, rspamd_redis_connected, rt,
+				"HGET %s %s",
+				rt->redis_object_expanded, rt->ctx->learned_key);
+
+		if (ret == REDIS_OK) {
+			out = rspamd_fstring_sized_new (1024);
+			rspamd_mempool_add_destructor (task->task_pool,
+					(rspamd_mempool_destruct_t)rspamd_fstring_free, out);
+			prefix_len = strlen (rt->redis_object_expanded);
+			rspamd_printf_fstring (&out, "*1\r\n$5\r\nMULTI\r\n");
+			redisAsyncFormattedCommand (rt->redis, NULL, NULL,
+					out->str, out->len);
+
+			/* HMGET <prefix_token> <class1> ... <classN> */
+			PTR_ARRAY_FOREACH (tokens, i, tok) {
+				out->len = 0;
+				l0 = rspamd_snprintf (n0, sizeof (n0), "%*s_%uL",
+						prefix_len, rt->redis_object_expanded,
+						tok->data);
+				rspamd_printf_fstring (&out, ""
+						"*%d\r\n"
+						"$5\r\n"
+						"HMGET\r\n"
+						"$%d\r\n"
+						"%s\r\n",
+						rt->ctx->mc_fields->len + 2,
+						l0, n0);
+
+				for (k = 0; k < rt->ctx->mc_fields->len; k ++) {
+					field = g_ptr_array_index (rt->ctx->mc_fields, k);
+					rspamd_printf_fstring (&out, ""
+							"$%d\r\n"
+							"%s\r\n",
+							(gint)strlen (field), field);
+				}
+
+				redisAsyncFormattedCommand (rt->redis, NULL, NULL,
+						out->str, out->len);
+			}
+
+			out->len = 0;
+			rspamd_printf_fstring (&out, "*1\r\n$4\r\nEXEC\r\n");
+			ret = redisAsyncFormattedCommand (rt->redis,
+					rspamd_redis_processed_multi, rt,
+					out->str, out->len);
+		}
+	}
+
+	if (ret != REDIS_OK) {
+		msg_err_task ("call to redis failed: %s", rt->redis->errstr);
+
+		return FALSE;
+	}
+
+	rspamd_session_add_event (task->s, rspamd_redis_fin, rt, M);
+	rt->has_event = TRUE;
+
+	if (ev_is_active (&rt->timeout_event)) {
+		rt->timeout_event.repeat = rt->ctx->timeout;
+		ev_timer_again (task->event_loop, &rt->timeout_event);
+	}
+	else {
+		rt->timeout_event.data = rt;
+		ev_timer_init (&rt->timeout_event, rspamd_redis_timeout,
+				rt->ctx->timeout, 0.);
+		ev_timer_start (task->event_loop, &rt->timeout_event);
+	}
+
+	return TRUE;
+}
+
 gboolean
 rspamd_redis_process_tokens (struct rspamd_task *task,
 		GPtrArray *tokens,
@@ -1561,24 +3332,27 @@ rspamd_redis_process_tokens (struct rspamd_task *task,
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (p);
 	rspamd_fstring_t *query;
 	gint ret;
-	const gchar *learned_key = "learns";
+	const gchar *learned_key = rt->ctx->learned_key;
 
 	if (rspamd_session_blocked (task->s)) {
 		return FALSE;
 	}
 
+	if (rt->snapshot && tokens != NULL) {
+		return rspamd_redis_process_snapshot (task, rt, tokens, id);
+	}
+
 	if (tokens == NULL || tokens->len == 0 || rt->redis == NULL) {
 		return FALSE;
 	}
 
 	rt->id = id;
 
-	if (rt->ctx->new_schema) {
-		if (rt->ctx->stcf->is_spam) {
-			learned_key = "learns_spam";
-		}
-		else {
-			learned_key = "learns_ham";
+	if (rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_MULTICLASS) {
+		rspamd_redis_check_multiclass (rt->ctx);
+
+		if (rt->ctx->mc_ids) {
+			return rspamd_redis_process_multiclass (task, rt, tokens);
 		}
 	}
 
@@ -1658,7 +3432,7 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 	rspamd_token_t *tok;
 	gint ret;
 	goffset off;
-	const gchar *learned_key = "learns";
+	const gchar *learned_key = rt->ctx->learned_key;
 
 	if (rspamd_session_blocked (task->s)) {
 		return FALSE;
@@ -1681,15 +3455,6 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 
 	rt->selected = up;
 
-	if (rt->ctx->new_schema) {
-		if (rt->ctx->stcf->is_spam) {
-			learned_key = "learns_spam";
-		}
-		else {
-			learned_key = "learns_ham";
-		}
-	}
-
 	addr = rspamd_upstream_addr_next (up);
 	g_assert (addr != NULL);
 
@@ -1739,6 +3504,13 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 
 	tok = g_ptr_array_index (task->tokens, 0);
 
+	/* Unlearned tokens are touched as well to get into the snapshot deltas */
+	if (rt->ctx->new_schema && rt->ctx->expiry_buckets > 0 &&
+			(tok->values[id] > 0 || rt->ctx->snapshot_path)) {
+		rspamd_redis_touch_tokens (task, rt, tokens,
+				rt->redis_object_expanded, FALSE, NULL);
+	}
+
 	if (tok->values[id] > 0) {
 		rspamd_printf_fstring (&query, ""
 				"*4\r\n"
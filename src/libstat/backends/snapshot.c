@@ -0,0 +1,420 @@
+/*-
+ * Copyright 2019 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "snapshot.h"
+#include "libutil/util.h"
+#include "libutil/printf.h"
+#include "unix-std.h"
+#include <sys/mman.h>
+
+#define SNAPSHOT_MAGIC "rsbsnap1"
+
+/*
+ * File layout:
+ * header
+ * guint64 tokens[nelts] - sorted tokens
+ * guint16 counts[nelts][2] - spam and ham counts quantized to 16 bits
+ */
+struct rspamd_stat_snapshot_header {
+	gchar magic[8];
+	guint64 nelts;
+	guint64 learns_spam;
+	guint64 learns_ham;
+	gdouble timestamp;
+	gdouble scan_start;
+	gdouble full_scan_start;
+	guchar unused[8];
+};
+
+struct rspamd_stat_snapshot {
+	gpointer map;
+	gsize len;
+	gchar *path;
+	dev_t st_dev;
+	ino_t st_ino;
+	const struct rspamd_stat_snapshot_header *hdr;
+	const guint64 *tokens;
+	const guint16 *counts;
+};
+
+static GQuark
+rspamd_stat_snapshot_quark (void)
+{
+	return g_quark_from_static_string ("stat-snapshot");
+}
+
+struct rspamd_stat_snapshot *
+rspamd_stat_snapshot_open (const gchar *path, GError **err)
+{
+	struct rspamd_stat_snapshot *snap;
+	const struct rspamd_stat_snapshot_header *hdr;
+	struct stat st;
+	gpointer map;
+	gint fd;
+
+	fd = rspamd_file_xopen (path, O_RDONLY, 0, TRUE);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_stat_snapshot_quark (), errno,
+				"cannot open snapshot %s: %s", path, strerror (errno));
+		return NULL;
+	}
+
+	if (fstat (fd, &st) == -1 || st.st_size < (off_t)sizeof (*hdr)) {
+		g_set_error (err, rspamd_stat_snapshot_quark (), EINVAL,
+				"cannot use snapshot %s: bad size", path);
+		close (fd);
+
+		return NULL;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		g_set_error (err, rspamd_stat_snapshot_quark (), errno,
+				"cannot mmap snapshot %s: %s", path, strerror (errno));
+		return NULL;
+	}
+
+	hdr = (const struct rspamd_stat_snapshot_header *)map;
+
+	if (memcmp (hdr->magic, SNAPSHOT_MAGIC, sizeof (hdr->magic)) != 0 ||
+			sizeof (*hdr) + hdr->nelts * (sizeof (guint64) + sizeof (guint16) * 2)
+			!= (gsize)st.st_size) {
+		g_set_error (err, rspamd_stat_snapshot_quark (), EINVAL,
+				"cannot use snapshot %s: bad header", path);
+		munmap (map, st.st_size);
+
+		return NULL;
+	}
+
+	snap = g_malloc0 (sizeof (*snap));
+	snap->map = map;
+	snap->len = st.st_size;
+	snap->path = g_strdup (path);
+	snap->st_dev = st.st_dev;
+	snap->st_ino = st.st_ino;
+	snap->hdr = hdr;
+	snap->tokens = (const guint64 *)(hdr + 1);
+	snap->counts = (const guint16 *)(snap->tokens + hdr->nelts);
+
+	return snap;
+}
+
+gboolean
+rspamd_stat_snapshot_is_stale (struct rspamd_stat_snapshot *snap)
+{
+	struct stat st;
+
+	if (stat (snap->path, &st) == -1) {
+		/* Keep the current one */
+		return FALSE;
+	}
+
+	/* Snapshot is replaced by rename, so inode is changed */
+	return st.st_ino != snap->st_ino || st.st_dev != snap->st_dev;
+}
+
+gboolean
+rspamd_stat_snapshot_lookup (struct rspamd_stat_snapshot *snap,
+		guint64 token, guint *spam, guint *ham)
+{
+	const guint64 *tokens = snap->tokens;
+	guint64 lo = 0, hi, mid;
+
+	if (snap->hdr->nelts == 0) {
+		return FALSE;
+	}
+
+	hi = snap->hdr->nelts - 1;
+
+	if (token < tokens[lo] || token > tokens[hi]) {
+		return FALSE;
+	}
+
+	/*
+	 * Tokens are hashes, so they are distributed uniformly and interpolation
+	 * search requires just a few memory accesses
+	 */
+	while (lo <= hi && token >= tokens[lo] && token <= tokens[hi]) {
+		if (tokens[hi] == tokens[lo]) {
+			mid = lo;
+		}
+		else {
+			mid = lo + (guint64)(((gdouble)(token - tokens[lo]) /
+					(gdouble)(tokens[hi] - tokens[lo])) * (hi - lo));
+
+			if (mid > hi) {
+				mid = hi;
+			}
+		}
+
+		if (tokens[mid] == token) {
+			*spam = snap->counts[mid * 2];
+			*ham = snap->counts[mid * 2 + 1];
+
+			return TRUE;
+		}
+		else if (tokens[mid] < token) {
+			lo = mid + 1;
+		}
+		else {
+			if (mid == 0) {
+				break;
+			}
+
+			hi = mid - 1;
+		}
+	}
+
+	return FALSE;
+}
+
+guint64
+rspamd_stat_snapshot_learns (struct rspamd_stat_snapshot *snap,
+		gboolean spam)
+{
+	return spam ? snap->hdr->learns_spam : snap->hdr->learns_ham;
+}
+
+gdouble
+rspamd_stat_snapshot_timestamp (struct rspamd_stat_snapshot *snap)
+{
+	return snap->hdr->timestamp;
+}
+
+void
+rspamd_stat_snapshot_get_meta (struct rspamd_stat_snapshot *snap,
+		struct rspamd_stat_snapshot_meta *meta)
+{
+	meta->learns_spam = snap->hdr->learns_spam;
+	meta->learns_ham = snap->hdr->learns_ham;
+	meta->scan_start = snap->hdr->scan_start;
+	meta->full_scan_start = snap->hdr->full_scan_start;
+}
+
+void
+rspamd_stat_snapshot_close (struct rspamd_stat_snapshot *snap)
+{
+	if (snap) {
+		munmap (snap->map, snap->len);
+		g_free (snap->path);
+		g_free (snap);
+	}
+}
+
+static gint
+rspamd_stat_snapshot_entry_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_stat_snapshot_entry *e1 = a, *e2 = b;
+
+	if (e1->token < e2->token) {
+		return -1;
+	}
+	else if (e1->token > e2->token) {
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Merges sorted updates with snapshot tokens, updates win */
+struct rspamd_stat_snapshot_merger {
+	struct rspamd_stat_snapshot *base;
+	const struct rspamd_stat_snapshot_entry *updates;
+	gsize nupdates;
+	guint64 bi;
+	gsize ui;
+};
+
+static gboolean
+rspamd_stat_snapshot_merge_next (struct rspamd_stat_snapshot_merger *m,
+		guint64 *token, guint32 *spam, guint32 *ham)
+{
+	const struct rspamd_stat_snapshot_entry *e;
+	guint64 nbase = m->base ? m->base->hdr->nelts : 0;
+
+	for (;;) {
+		if (m->ui < m->nupdates &&
+				(m->bi >= nbase ||
+				m->updates[m->ui].token <= m->base->tokens[m->bi])) {
+			e = &m->updates[m->ui ++];
+
+			/* Keys could be returned by redis scan more than once */
+			while (m->ui < m->nupdates && m->updates[m->ui].token == e->token) {
+				e = &m->updates[m->ui ++];
+			}
+
+			while (m->bi < nbase && m->base->tokens[m->bi] == e->token) {
+				m->bi ++;
+			}
+
+			if (e->spam == 0 && e->ham == 0) {
+				/* Token has been removed */
+				continue;
+			}
+
+			*token = e->token;
+			*spam = e->spam;
+			*ham = e->ham;
+
+			return TRUE;
+		}
+		else if (m->bi < nbase) {
+			*token = m->base->tokens[m->bi];
+			*spam = m->base->counts[m->bi * 2];
+			*ham = m->base->counts[m->bi * 2 + 1];
+			m->bi ++;
+
+			return TRUE;
+		}
+
+		return FALSE;
+	}
+}
+
+/*
+ * Writes merged tokens to a temporary file mapped to memory: the first pass
+ * counts tokens, the second one fills the file
+ */
+static gboolean
+rspamd_stat_snapshot_output (const gchar *path,
+		struct rspamd_stat_snapshot *base,
+		struct rspamd_stat_snapshot_entry *updates, gsize nupdates,
+		const struct rspamd_stat_snapshot_meta *meta, GError **err)
+{
+	struct rspamd_stat_snapshot_header *hdr;
+	struct rspamd_stat_snapshot_merger m;
+	guint16 *counts;
+	guint64 *tokens, token, nelts = 0, i;
+	guint32 spam, ham, max_cnt;
+	gchar tmpbuf[PATH_MAX];
+	gdouble scale;
+	gsize len;
+	gpointer map;
+	gint fd;
+
+	if (nupdates > 0) {
+		qsort (updates, nupdates, sizeof (*updates),
+				rspamd_stat_snapshot_entry_cmp);
+	}
+
+	memset (&m, 0, sizeof (m));
+	m.base = base;
+	m.updates = updates;
+	m.nupdates = nupdates;
+
+	while (rspamd_stat_snapshot_merge_next (&m, &token, &spam, &ham)) {
+		nelts ++;
+	}
+
+	len = sizeof (*hdr) + nelts * (sizeof (guint64) + sizeof (guint16) * 2);
+	rspamd_snprintf (tmpbuf, sizeof (tmpbuf), "%s.new", path);
+	fd = rspamd_file_xopen (tmpbuf, O_RDWR | O_CREAT | O_TRUNC, 00644, FALSE);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_stat_snapshot_quark (), errno,
+				"cannot create snapshot %s: %s", tmpbuf, strerror (errno));
+		return FALSE;
+	}
+
+	if (ftruncate (fd, len) == -1 ||
+			(map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+					fd, 0)) == MAP_FAILED) {
+		g_set_error (err, rspamd_stat_snapshot_quark (), errno,
+				"cannot write snapshot %s: %s", tmpbuf, strerror (errno));
+		close (fd);
+		unlink (tmpbuf);
+
+		return FALSE;
+	}
+
+	close (fd);
+
+	hdr = (struct rspamd_stat_snapshot_header *)map;
+	memset (hdr, 0, sizeof (*hdr));
+	memcpy (hdr->magic, SNAPSHOT_MAGIC, sizeof (hdr->magic));
+	hdr->nelts = nelts;
+	hdr->learns_spam = meta->learns_spam;
+	hdr->learns_ham = meta->learns_ham;
+	hdr->timestamp = rspamd_get_calendar_ticks ();
+	hdr->scan_start = meta->scan_start;
+	hdr->full_scan_start = meta->full_scan_start;
+	tokens = (guint64 *)(hdr + 1);
+	counts = (guint16 *)(tokens + nelts);
+
+	memset (&m, 0, sizeof (m));
+	m.base = base;
+	m.updates = updates;
+	m.nupdates = nupdates;
+	i = 0;
+
+	while (rspamd_stat_snapshot_merge_next (&m, &token, &spam, &ham)) {
+		tokens[i] = token;
+		max_cnt = MAX (spam, ham);
+
+		/* Scale both counts to preserve their ratio */
+		if (max_cnt > G_MAXUINT16) {
+			scale = (gdouble)G_MAXUINT16 / (gdouble)max_cnt;
+			counts[i * 2] = spam * scale;
+			counts[i * 2 + 1] = ham * scale;
+		}
+		else {
+			counts[i * 2] = spam;
+			counts[i * 2 + 1] = ham;
+		}
+
+		i ++;
+	}
+
+	g_assert (i == nelts);
+
+	if (munmap (map, len) == -1) {
+		g_set_error (err, rspamd_stat_snapshot_quark (), errno,
+				"cannot write snapshot %s: %s", tmpbuf, strerror (errno));
+		unlink (tmpbuf);
+
+		return FALSE;
+	}
+
+	if (rename (tmpbuf, path) == -1) {
+		g_set_error (err, rspamd_stat_snapshot_quark (), errno,
+				"cannot rename snapshot %s: %s", tmpbuf, strerror (errno));
+		unlink (tmpbuf);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_stat_snapshot_write (const gchar *path,
+		struct rspamd_stat_snapshot_entry *entries, gsize nelts,
+		const struct rspamd_stat_snapshot_meta *meta, GError **err)
+{
+	return rspamd_stat_snapshot_output (path, NULL, entries, nelts, meta, err);
+}
+
+gboolean
+rspamd_stat_snapshot_merge (struct rspamd_stat_snapshot *base,
+		const gchar *path,
+		struct rspamd_stat_snapshot_entry *updates, gsize nelts,
+		const struct rspamd_stat_snapshot_meta *meta, GError **err)
+{
+	return rspamd_stat_snapshot_output (path, base, updates, nelts, meta, err);
+}
@@ -0,0 +1,124 @@
+/*-
+ * Copyright 2019 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_STAT_SNAPSHOT_H
+#define RSPAMD_STAT_SNAPSHOT_H
+
+#include "config.h"
+
+/*
+ * Immutable read only snapshot of spam/ham token counts, shared between
+ * processes via mmap
+ */
+struct rspamd_stat_snapshot;
+
+struct rspamd_stat_snapshot_entry {
+	guint64 token;
+	guint32 spam;
+	guint32 ham;
+};
+
+struct rspamd_stat_snapshot_meta {
+	guint64 learns_spam;
+	guint64 learns_ham;
+	/* Changes in redis after this time are not in the snapshot */
+	gdouble scan_start;
+	/* Start of the last full scan, snapshot is updated by deltas after it */
+	gdouble full_scan_start;
+};
+
+/**
+ * Maps snapshot from the specified file
+ * @param path
+ * @param err
+ * @return snapshot or NULL
+ */
+struct rspamd_stat_snapshot *rspamd_stat_snapshot_open (const gchar *path,
+		GError **err);
+
+/**
+ * Returns TRUE if snapshot file has been replaced since it was mapped
+ * @param snap
+ * @return
+ */
+gboolean rspamd_stat_snapshot_is_stale (struct rspamd_stat_snapshot *snap);
+
+/**
+ * Finds token in the snapshot
+ * @param snap
+ * @param token
+ * @param spam output spam count
+ * @param ham output ham count
+ * @return TRUE if token has been found
+ */
+gboolean rspamd_stat_snapshot_lookup (struct rspamd_stat_snapshot *snap,
+		guint64 token, guint *spam, guint *ham);
+
+/**
+ * Returns number of spam or ham learns stored in the snapshot
+ */
+guint64 rspamd_stat_snapshot_learns (struct rspamd_stat_snapshot *snap,
+		gboolean spam);
+
+/**
+ * Returns creation time of the snapshot
+ */
+gdouble rspamd_stat_snapshot_timestamp (struct rspamd_stat_snapshot *snap);
+
+/**
+ * Returns learns and scan times stored in the snapshot
+ * @param snap
+ * @param meta
+ */
+void rspamd_stat_snapshot_get_meta (struct rspamd_stat_snapshot *snap,
+		struct rspamd_stat_snapshot_meta *meta);
+
+/**
+ * Unmaps snapshot
+ * @param snap
+ */
+void rspamd_stat_snapshot_close (struct rspamd_stat_snapshot *snap);
+
+/**
+ * Writes snapshot atomically (via temporary file and rename), entries are
+ * sorted in place
+ * @param path
+ * @param entries
+ * @param nelts
+ * @param meta
+ * @param err
+ * @return
+ */
+gboolean rspamd_stat_snapshot_write (const gchar *path,
+		struct rspamd_stat_snapshot_entry *entries, gsize nelts,
+		const struct rspamd_stat_snapshot_meta *meta, GError **err);
+
+/**
+ * Writes a new snapshot atomically from the existing one with changed tokens
+ * applied. Tokens with zero counts are removed. Updates are sorted in place
+ * @param base
+ * @param path
+ * @param updates
+ * @param nelts
+ * @param meta
+ * @param err
+ * @return
+ */
+gboolean rspamd_stat_snapshot_merge (struct rspamd_stat_snapshot *base,
+		const gchar *path,
+		struct rspamd_stat_snapshot_entry *updates, gsize nelts,
+		const struct rspamd_stat_snapshot_meta *meta, GError **err);
+
+#endif
@@ -48,6 +48,21 @@ gboolean bayes_learn_spam (struct rspamd_classifier *ctx,
 		GError **err);
 void bayes_fin (struct rspamd_classifier *);
 
+/* Multi-class bayes algorithm */
+gboolean multiclass_init (struct rspamd_config *cfg,
+					 struct ev_loop *ev_base,
+					 struct rspamd_classifier *);
+gboolean multiclass_classify (struct rspamd_classifier *ctx,
+		GPtrArray *tokens,
+		struct rspamd_task *task);
+gboolean multiclass_learn (struct rspamd_classifier *ctx,
+		GPtrArray *tokens,
+		struct rspamd_task *task,
+		gboolean is_spam,
+		gboolean unlearn,
+		GError **err);
+void multiclass_fin (struct rspamd_classifier *);
+
 /* Generic lua classifier */
 gboolean lua_classifier_init (struct rspamd_config *cfg,
 							  struct ev_loop *ev_base,
@@ -0,0 +1,330 @@
+/*-
+ * Copyright 2019 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Multi-class naive bayesian classifier
+ *
+ * Each statfile represents a class (e.g. spam, ham, phishing, newsletter),
+ * all class counts for a token are stored in a single vector (tok->values),
+ * so all posteriors are calculated in one pass over tokens.
+ */
+#include "classifiers.h"
+#include "rspamd.h"
+#include "stat_internal.h"
+#include "libserver/mempool_vars_internal.h"
+#include "math.h"
+
+#define msg_err_multiclass(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
+        "multiclass", task->task_pool->tag.uid, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_info_multiclass(...)   rspamd_default_log_function (G_LOG_LEVEL_INFO, \
+        "multiclass", task->task_pool->tag.uid, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_debug_multiclass(...)  rspamd_conditional_debug_fast (NULL, task->from_addr, \
+        rspamd_multiclass_log_id, "multiclass", task->task_pool->tag.uid, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+
+INIT_LOG_MODULE(multiclass)
+
+/* Maximum number of classes supported */
+#define MULTICLASS_MAX_CLASSES 32
+
+/*
+ * Mathematically we use pow(complexity, complexity), where complexity is the
+ * window index (the same as in bayes)
+ */
+static const double feature_weight[] = { 0, 3125, 256, 27, 1, 0, 0, 0 };
+
+#define PROB_COMBINE(prob, cnt, weight, assumed) (((weight) * (assumed) + (cnt) * (prob)) / ((weight) + (cnt)))
+
+struct multiclass_task_closure {
+	guint nclasses;
+	gint ids[MULTICLASS_MAX_CLASSES];
+	struct rspamd_statfile *st[MULTICLASS_MAX_CLASSES];
+	/* Vectors processed in a single pass */
+	gdouble learns[MULTICLASS_MAX_CLASSES];
+	gdouble counts[MULTICLASS_MAX_CLASSES];
+	gdouble log_post[MULTICLASS_MAX_CLASSES];
+	guint64 processed_tokens;
+	guint64 text_tokens;
+};
+
+static void
+multiclass_classify_token (struct rspamd_classifier *ctx,
+		rspamd_token_t *tok, struct multiclass_task_closure *cl)
+{
+	guint k, n = cl->nclasses;
+	gdouble total = 0, freq_sum = 0, fw, w, prior, p;
+	gdouble freqs[MULTICLASS_MAX_CLASSES];
+
+	for (k = 0; k < n; k ++) {
+		p = tok->values[cl->ids[k]];
+		cl->counts[k] = p > 0 ? p : 0;
+		total += cl->counts[k];
+	}
+
+	if (total < ctx->cfg->min_token_hits || total == 0) {
+		return;
+	}
+
+	for (k = 0; k < n; k ++) {
+		freqs[k] = cl->counts[k] / cl->learns[k];
+		freq_sum += freqs[k];
+	}
+
+	if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
+		fw = 1.0;
+	}
+	else {
+		fw = feature_weight[tok->window_idx % G_N_ELEMENTS (feature_weight)];
+	}
+
+	w = (fw * total) / (1.0 + fw * total);
+	prior = 1.0 / n;
+
+	for (k = 0; k < n; k ++) {
+		p = PROB_COMBINE (freqs[k] / freq_sum, total, w, prior);
+		cl->log_post[k] += log (p);
+	}
+
+	cl->processed_tokens ++;
+
+	if (!(tok->flags & RSPAMD_STAT_TOKEN_FLAG_META)) {
+		cl->text_tokens ++;
+	}
+}
+
+gboolean
+multiclass_init (struct rspamd_config *cfg,
+			struct ev_loop *ev_base,
+			struct rspamd_classifier *cl)
+{
+	cl->cfg->flags |= RSPAMD_FLAG_CLASSIFIER_INTEGER |
+			RSPAMD_FLAG_CLASSIFIER_MULTICLASS;
+
+	return TRUE;
+}
+
+void
+multiclass_fin (struct rspamd_classifier *cl)
+{
+}
+
+gboolean
+multiclass_classify (struct rspamd_classifier *ctx,
+		GPtrArray *tokens,
+		struct rspamd_task *task)
+{
+	struct multiclass_task_closure cl;
+	struct rspamd_statfile *st;
+	rspamd_token_t *tok;
+	gpointer bk_run;
+	gdouble max_post, norm, conf, best_prob;
+	gchar sumbuf[32];
+	guint i, best = 0;
+	gint id;
+
+	g_assert (ctx != NULL);
+	g_assert (tokens != NULL);
+
+	memset (&cl, 0, sizeof (cl));
+
+	for (i = 0; i < ctx->statfiles_ids->len; i ++) {
+		id = g_array_index (ctx->statfiles_ids, gint, i);
+		st = g_ptr_array_index (ctx->ctx->statfiles, id);
+		bk_run = g_ptr_array_index (task->stat_runtimes, id);
+
+		if (bk_run == NULL) {
+			continue;
+		}
+
+		if (cl.nclasses >= MULTICLASS_MAX_CLASSES) {
+			msg_err_multiclass ("too many classes in classifier %s, "
+					"%d max supported", ctx->cfg->name, MULTICLASS_MAX_CLASSES);
+			break;
+		}
+
+		cl.learns[cl.nclasses] = st->backend->total_learns (task, bk_run,
+				ctx->ctx);
+
+		if (cl.learns[cl.nclasses] < MAX (ctx->cfg->min_learns, 1)) {
+			msg_info_multiclass ("skip class %s (%s) as it has not enough "
+					"learns: %.0f, %ud required",
+					st->stcf->class_name ? st->stcf->class_name : "unnamed",
+					st->stcf->symbol, cl.learns[cl.nclasses],
+					ctx->cfg->min_learns);
+			continue;
+		}
+
+		cl.ids[cl.nclasses] = id;
+		cl.st[cl.nclasses] = st;
+		cl.nclasses ++;
+	}
+
+	if (cl.nclasses < 2) {
+		msg_info_multiclass ("skip classification as classifier %s has "
+				"%ud usable classes, at least 2 are required",
+				ctx->cfg->name, cl.nclasses);
+
+		return TRUE;
+	}
+
+	for (i = 0; i < tokens->len; i ++) {
+		tok = g_ptr_array_index (tokens, i);
+		multiclass_classify_token (ctx, tok, &cl);
+	}
+
+	if (cl.processed_tokens == 0) {
+		msg_info_multiclass ("no tokens found in %s database "
+				"(%ud total tokens), ignore stats",
+				ctx->cfg->name, tokens->len);
+
+		return TRUE;
+	}
+
+	if (ctx->cfg->min_tokens > 0 &&
+			cl.text_tokens < (gint)(ctx->cfg->min_tokens * 0.1)) {
+		msg_info_multiclass ("ignore %s probability since we have "
+				"found too few text tokens: %uL, at least %d is required",
+				ctx->cfg->name,
+				cl.text_tokens,
+				(gint)(ctx->cfg->min_tokens * 0.1));
+
+		return TRUE;
+	}
+
+	/* Softmax over log posteriors */
+	max_post = cl.log_post[0];
+
+	for (i = 1; i < cl.nclasses; i ++) {
+		if (cl.log_post[i] > max_post) {
+			max_post = cl.log_post[i];
+			best = i;
+		}
+	}
+
+	norm = 0;
+
+	for (i = 0; i < cl.nclasses; i ++) {
+		norm += exp (cl.log_post[i] - max_post);
+	}
+
+	best_prob = 1.0 / norm;
+
+	for (i = 0; i < cl.nclasses; i ++) {
+		msg_debug_multiclass ("<%s> class %s: probability %.3f",
+				task->message_id,
+				cl.st[i]->stcf->class_name ?
+						cl.st[i]->stcf->class_name : cl.st[i]->stcf->symbol,
+				exp (cl.log_post[i] - max_post) / norm);
+	}
+
+	st = cl.st[best];
+	rspamd_mempool_set_variable (task->task_pool, RSPAMD_MEMPOOL_STAT_CLASS,
+			st->stcf->class_name ? st->stcf->class_name : st->stcf->symbol,
+			NULL);
+
+	/* Rescale from [1/n..1] to [0..1] confidence */
+	conf = (best_prob - 1.0 / cl.nclasses) / (1.0 - 1.0 / cl.nclasses);
+
+	if (!isfinite (conf)) {
+		msg_err_multiclass ("<%s> internal error: probability is not finite",
+				task->message_id);
+
+		return TRUE;
+	}
+
+	if (conf > 0.05) {
+		rspamd_snprintf (sumbuf, sizeof (sumbuf), "%.2f%%", conf * 100.);
+		rspamd_task_insert_result (task,
+				st->stcf->symbol,
+				MIN (conf, 1.0),
+				sumbuf);
+	}
+
+	return TRUE;
+}
+
+gboolean
+multiclass_learn (struct rspamd_classifier *ctx,
+		GPtrArray *tokens,
+		struct rspamd_task *task,
+		gboolean is_spam,
+		gboolean unlearn,
+		GError **err)
+{
+	guint i, j;
+	gint id;
+	struct rspamd_statfile *st;
+	rspamd_token_t *tok;
+	gboolean incrementing, found = FALSE;
+
+	g_assert (ctx != NULL);
+	g_assert (tokens != NULL);
+
+	incrementing = ctx->cfg->flags & RSPAMD_FLAG_CLASSIFIER_INCREMENTING_BACKEND;
+
+	for (j = 0; j < ctx->statfiles_ids->len; j++) {
+		id = g_array_index (ctx->statfiles_ids, gint, j);
+		st = g_ptr_array_index (ctx->ctx->statfiles, id);
+
+		if (rspamd_stat_is_learn_target (task, st, is_spam)) {
+			found = TRUE;
+			break;
+		}
+	}
+
+	if (!found) {
+		g_set_error (err, g_quark_from_static_string ("multiclass-error"), 404,
+				"cannot find class to learn in classifier %s", ctx->cfg->name);
+
+		return FALSE;
+	}
+
+	for (i = 0; i < tokens->len; i++) {
+		tok = g_ptr_array_index (tokens, i);
+
+		for (j = 0; j < ctx->statfiles_ids->len; j++) {
+			id = g_array_index (ctx->statfiles_ids, gint, j);
+			st = g_ptr_array_index (ctx->ctx->statfiles, id);
+
+			if (rspamd_stat_is_learn_target (task, st, is_spam)) {
+				if (incrementing) {
+					tok->values[id] = 1;
+				}
+				else {
+					tok->values[id]++;
+				}
+			}
+			else if (unlearn && tok->values[id] > 0 &&
+					rspamd_stat_is_unlearn_target (task, st, is_spam)) {
+				if (incrementing) {
+					tok->values[id] = -1;
+				}
+				else {
+					tok->values[id]--;
+				}
+			}
+			else if (incrementing) {
+				tok->values[id] = 0;
+			}
+		}
+	}
+
+	return TRUE;
+}
@@ -0,0 +1,549 @@
+/*-
+ * Copyright 2019 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "learn_filter.h"
+#include "cryptobox.h"
+#include "logger.h"
+#include "libutil/util.h"
+#include "unix-std.h"
+#include <sys/mman.h>
+#include <math.h>
+
+#define LEARN_FILTER_MAGIC "rslfilt1"
+/* Fingerprints per bucket */
+#define LEARN_FILTER_BUCKET_SIZE 4
+/* Expected load factor for 4 slots buckets */
+#define LEARN_FILTER_LOAD 0.95
+#define LEARN_FILTER_MAX_KICKS 500
+/* Readers give up and report a possible match after this number of retries */
+#define LEARN_FILTER_MAX_READ_RETRIES 64
+#define LEARN_FILTER_HASH_SEED 0xb8f5c3b2a3e7d94bULL
+
+enum rspamd_learn_filter_flags {
+	RSPAMD_LEARN_FILTER_READY = (1u << 0),
+	RSPAMD_LEARN_FILTER_OVERFLOW = (1u << 1),
+};
+
+/*
+ * File layout:
+ * header
+ * guint16 slots[nbuckets][LEARN_FILTER_BUCKET_SIZE], 0 means an empty slot
+ *
+ * Writers are serialised by the file lock, readers do not lock: they use
+ * `seq` as a sequence lock, it is odd while a writer modifies slots.
+ */
+struct rspamd_learn_filter_header {
+	gchar magic[8];
+	guint64 nbuckets;
+	guint64 nelts;
+	guint32 fp_bits;
+	guint32 flags;
+	guint64 seq;
+	gdouble ready_time;
+	guchar unused[16];
+};
+
+struct rspamd_learn_filter {
+	struct rspamd_learn_filter_header *hdr;
+	guint16 *slots;
+	gsize len;
+	gchar *path;
+	guint64 mask;
+	gdouble resync_time;
+	guint16 fp_mask;
+	gint fd;
+	gboolean authoritative;
+};
+
+static GQuark
+rspamd_learn_filter_quark (void)
+{
+	return g_quark_from_static_string ("learn-filter");
+}
+
+static void
+rspamd_learn_filter_geometry (gsize capacity, gdouble fp_rate,
+		guint64 *nbuckets, guint32 *fp_bits)
+{
+	guint64 n = 1;
+	gdouble bits;
+
+	while (n * LEARN_FILTER_BUCKET_SIZE * LEARN_FILTER_LOAD < capacity) {
+		n <<= 1;
+	}
+
+	/* Upper bound of false positives rate is 2 * b / 2^f */
+	bits = ceil (log2 (2.0 * LEARN_FILTER_BUCKET_SIZE / fp_rate));
+
+	*nbuckets = n;
+	*fp_bits = CLAMP (bits, 4, 16);
+}
+
+struct rspamd_learn_filter *
+rspamd_learn_filter_open (const gchar *path,
+		gsize capacity, gdouble fp_rate, GError **err)
+{
+	struct rspamd_learn_filter *f;
+	struct rspamd_learn_filter_header *hdr;
+	struct stat st;
+	guint64 nbuckets;
+	guint32 fp_bits;
+	gsize len;
+	gpointer map;
+	gint fd;
+
+	if (fp_rate <= 0 || fp_rate >= 1) {
+		g_set_error (err, rspamd_learn_filter_quark (), EINVAL,
+				"invalid false positive rate for %s: %.4f", path, fp_rate);
+		return NULL;
+	}
+
+	rspamd_learn_filter_geometry (MAX (capacity, 1), fp_rate,
+			&nbuckets, &fp_bits);
+	len = sizeof (*hdr) +
+			nbuckets * LEARN_FILTER_BUCKET_SIZE * sizeof (guint16);
+
+	fd = rspamd_file_xopen (path, O_RDWR | O_CREAT, 00644, FALSE);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_learn_filter_quark (), errno,
+				"cannot open filter %s: %s", path, strerror (errno));
+		return NULL;
+	}
+
+	/* Geometry is checked and fixed under lock */
+	rspamd_file_lock (fd, FALSE);
+
+	if (fstat (fd, &st) == -1) {
+		g_set_error (err, rspamd_learn_filter_quark (), errno,
+				"cannot stat filter %s: %s", path, strerror (errno));
+		rspamd_file_unlock (fd, FALSE);
+		close (fd);
+
+		return NULL;
+	}
+
+	if ((gsize)st.st_size != len) {
+		/* Either new or created with a different geometry, ftruncate zeroes it */
+		if (ftruncate (fd, 0) == -1 || ftruncate (fd, len) == -1) {
+			g_set_error (err, rspamd_learn_filter_quark (), errno,
+					"cannot resize filter %s: %s", path, strerror (errno));
+			rspamd_file_unlock (fd, FALSE);
+			close (fd);
+
+			return NULL;
+		}
+	}
+
+	map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (map == MAP_FAILED) {
+		g_set_error (err, rspamd_learn_filter_quark (), errno,
+				"cannot mmap filter %s: %s", path, strerror (errno));
+		rspamd_file_unlock (fd, FALSE);
+		close (fd);
+
+		return NULL;
+	}
+
+	hdr = (struct rspamd_learn_filter_header *)map;
+
+	if (memcmp (hdr->magic, LEARN_FILTER_MAGIC, sizeof (hdr->magic)) != 0 ||
+			hdr->nbuckets != nbuckets || hdr->fp_bits != fp_bits) {
+		memset (map, 0, len);
+		memcpy (hdr->magic, LEARN_FILTER_MAGIC, sizeof (hdr->magic));
+		hdr->nbuckets = nbuckets;
+		hdr->fp_bits = fp_bits;
+		msg_info ("created learn filter %s: %uL buckets, %ud bits per "
+				"fingerprint", path, nbuckets, fp_bits);
+	}
+
+	rspamd_file_unlock (fd, FALSE);
+
+	f = g_malloc0 (sizeof (*f));
+	f->hdr = hdr;
+	f->slots = (guint16 *)(hdr + 1);
+	f->len = len;
+	f->fd = fd;
+	f->path = g_strdup (path);
+	f->mask = nbuckets - 1;
+	f->fp_mask = (1u << fp_bits) - 1;
+	f->resync_time = RSPAMD_LEARN_FILTER_DEFAULT_RESYNC;
+
+	return f;
+}
+
+struct rspamd_learn_filter *
+rspamd_learn_filter_from_ucl (const ucl_object_t *cf,
+		const gchar *default_path)
+{
+	const ucl_object_t *elt;
+	const gchar *path = default_path;
+	gsize capacity = RSPAMD_LEARN_FILTER_DEFAULT_SIZE;
+	gdouble fp_rate = RSPAMD_LEARN_FILTER_DEFAULT_FP_RATE;
+	struct rspamd_learn_filter *f;
+	GError *err = NULL;
+
+	if (cf == NULL || ucl_object_type (cf) != UCL_OBJECT) {
+		return NULL;
+	}
+
+	elt = ucl_object_lookup (cf, "filter");
+
+	if (elt == NULL || !ucl_object_toboolean (elt)) {
+		return NULL;
+	}
+
+	elt = ucl_object_lookup (cf, "filter_path");
+
+	if (elt != NULL) {
+		path = ucl_object_tostring (elt);
+	}
+
+	elt = ucl_object_lookup (cf, "filter_size");
+
+	if (elt != NULL && ucl_object_toint (elt) > 0) {
+		capacity = ucl_object_toint (elt);
+	}
+
+	elt = ucl_object_lookup (cf, "filter_fp_rate");
+
+	if (elt != NULL) {
+		fp_rate = ucl_object_todouble (elt);
+	}
+
+	f = rspamd_learn_filter_open (path, capacity, fp_rate, &err);
+
+	if (f == NULL) {
+		msg_err ("cannot init learn cache filter: %e", err);
+		g_error_free (err);
+
+		return NULL;
+	}
+
+	elt = ucl_object_lookup (cf, "filter_resync");
+
+	if (elt != NULL) {
+		f->resync_time = ucl_object_todouble (elt);
+	}
+
+	elt = ucl_object_lookup (cf, "filter_authoritative");
+
+	if (elt != NULL) {
+		f->authoritative = ucl_object_toboolean (elt);
+	}
+
+	return f;
+}
+
+static inline void
+rspamd_learn_filter_hash (struct rspamd_learn_filter *f,
+		const guchar *digest, gsize len,
+		guint16 *fp, guint64 *i1, guint64 *i2)
+{
+	guint64 h;
+
+	h = rspamd_cryptobox_fast_hash (digest, len, LEARN_FILTER_HASH_SEED);
+	*fp = (h >> 48) & f->fp_mask;
+
+	if (*fp == 0) {
+		/* Zero is reserved for empty slots */
+		*fp = 1;
+	}
+
+	*i1 = h & f->mask;
+	*i2 = (*i1 ^ ((guint64)*fp * 0x5bd1e995ULL)) & f->mask;
+}
+
+static inline guint64
+rspamd_learn_filter_alt_index (struct rspamd_learn_filter *f,
+		guint64 idx, guint16 fp)
+{
+	return (idx ^ ((guint64)fp * 0x5bd1e995ULL)) & f->mask;
+}
+
+static inline gboolean
+rspamd_learn_filter_bucket_find (struct rspamd_learn_filter *f,
+		guint64 idx, guint16 fp)
+{
+	guint16 *b = &f->slots[idx * LEARN_FILTER_BUCKET_SIZE];
+	guint i;
+
+	for (i = 0; i < LEARN_FILTER_BUCKET_SIZE; i ++) {
+		if (__atomic_load_n (&b[i], __ATOMIC_RELAXED) == fp) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static inline gboolean
+rspamd_learn_filter_bucket_insert (struct rspamd_learn_filter *f,
+		guint64 idx, guint16 fp)
+{
+	guint16 *b = &f->slots[idx * LEARN_FILTER_BUCKET_SIZE];
+	guint i;
+
+	for (i = 0; i < LEARN_FILTER_BUCKET_SIZE; i ++) {
+		if (b[i] == 0) {
+			__atomic_store_n (&b[i], fp, __ATOMIC_RELAXED);
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static inline gboolean
+rspamd_learn_filter_bucket_remove (struct rspamd_learn_filter *f,
+		guint64 idx, guint16 fp)
+{
+	guint16 *b = &f->slots[idx * LEARN_FILTER_BUCKET_SIZE];
+	guint i;
+
+	for (i = 0; i < LEARN_FILTER_BUCKET_SIZE; i ++) {
+		if (b[i] == fp) {
+			__atomic_store_n (&b[i], 0, __ATOMIC_RELAXED);
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ * Writers must hold the file lock. If a previous writer has died in the
+ * middle of update, filter could have lost fingerprints, so it is marked as
+ * incomplete to be rebuilt.
+ */
+static inline void
+rspamd_learn_filter_write_begin (struct rspamd_learn_filter *f)
+{
+	if (__atomic_load_n (&f->hdr->seq, __ATOMIC_RELAXED) & 1) {
+		f->hdr->flags = 0;
+		__atomic_add_fetch (&f->hdr->seq, 1, __ATOMIC_RELEASE);
+	}
+
+	__atomic_add_fetch (&f->hdr->seq, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+}
+
+static inline void
+rspamd_learn_filter_write_end (struct rspamd_learn_filter *f)
+{
+	__atomic_add_fetch (&f->hdr->seq, 1, __ATOMIC_RELEASE);
+}
+
+gboolean
+rspamd_learn_filter_is_ready (struct rspamd_learn_filter *f)
+{
+	guint32 flags = __atomic_load_n (&f->hdr->flags, __ATOMIC_ACQUIRE);
+
+	return (flags & RSPAMD_LEARN_FILTER_READY) &&
+			!(flags & RSPAMD_LEARN_FILTER_OVERFLOW);
+}
+
+gboolean
+rspamd_learn_filter_is_authoritative (struct rspamd_learn_filter *f)
+{
+	return f->authoritative;
+}
+
+void
+rspamd_learn_filter_set_authoritative (struct rspamd_learn_filter *f,
+		gboolean authoritative)
+{
+	f->authoritative = authoritative;
+}
+
+gboolean
+rspamd_learn_filter_need_rebuild (struct rspamd_learn_filter *f)
+{
+	if (!rspamd_learn_filter_is_ready (f)) {
+		return TRUE;
+	}
+
+	/* Learns performed by other hosts are not in the local filter */
+	return f->resync_time > 0 &&
+			rspamd_get_calendar_ticks () - f->hdr->ready_time > f->resync_time;
+}
+
+void
+rspamd_learn_filter_set_ready (struct rspamd_learn_filter *f)
+{
+	rspamd_file_lock (f->fd, FALSE);
+	rspamd_learn_filter_write_begin (f);
+	f->hdr->ready_time = rspamd_get_calendar_ticks ();
+	f->hdr->flags |= RSPAMD_LEARN_FILTER_READY;
+	rspamd_learn_filter_write_end (f);
+	rspamd_file_unlock (f->fd, FALSE);
+}
+
+void
+rspamd_learn_filter_reset (struct rspamd_learn_filter *f)
+{
+	rspamd_file_lock (f->fd, FALSE);
+	rspamd_learn_filter_write_begin (f);
+	/* Readers must stop trusting the filter before slots are cleared */
+	__atomic_store_n (&f->hdr->flags, 0, __ATOMIC_RELEASE);
+	memset (f->slots, 0, f->len - sizeof (*f->hdr));
+	f->hdr->nelts = 0;
+	rspamd_learn_filter_write_end (f);
+	rspamd_file_unlock (f->fd, FALSE);
+}
+
+gboolean
+rspamd_learn_filter_check (struct rspamd_learn_filter *f,
+		const guchar *digest, gsize len)
+{
+	guint16 fp;
+	guint64 i1, i2, seq;
+	guint i;
+	gboolean ret;
+
+	rspamd_learn_filter_hash (f, digest, len, &fp, &i1, &i2);
+
+	/*
+	 * Kicking in another process can move fingerprint between buckets, so
+	 * the lookup is repeated if a writer has modified slots meanwhile
+	 */
+	for (i = 0; i < LEARN_FILTER_MAX_READ_RETRIES; i ++) {
+		seq = __atomic_load_n (&f->hdr->seq, __ATOMIC_ACQUIRE);
+
+		if (seq & 1) {
+			continue;
+		}
+
+		ret = rspamd_learn_filter_bucket_find (f, i1, fp) ||
+				rspamd_learn_filter_bucket_find (f, i2, fp);
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n (&f->hdr->seq, __ATOMIC_RELAXED) == seq) {
+			return ret;
+		}
+	}
+
+	/* Cannot get a consistent view, so let the caller check the storage */
+	return TRUE;
+}
+
+gboolean
+rspamd_learn_filter_add (struct rspamd_learn_filter *f,
+		const guchar *digest, gsize len)
+{
+	guint16 fp, victim, *b;
+	guint64 i1, i2, idx;
+	guint i, slot;
+	gboolean ret = TRUE;
+
+	rspamd_learn_filter_hash (f, digest, len, &fp, &i1, &i2);
+	rspamd_file_lock (f->fd, FALSE);
+
+	if (f->hdr->flags & RSPAMD_LEARN_FILTER_OVERFLOW) {
+		rspamd_file_unlock (f->fd, FALSE);
+
+		return FALSE;
+	}
+
+	rspamd_learn_filter_write_begin (f);
+
+	if (rspamd_learn_filter_bucket_insert (f, i1, fp) ||
+			rspamd_learn_filter_bucket_insert (f, i2, fp)) {
+		f->hdr->nelts ++;
+		rspamd_learn_filter_write_end (f);
+		rspamd_file_unlock (f->fd, FALSE);
+
+		return TRUE;
+	}
+
+	idx = (rspamd_random_uint64_fast () & 1) ? i1 : i2;
+
+	for (i = 0; i < LEARN_FILTER_MAX_KICKS; i ++) {
+		slot = rspamd_random_uint64_fast () % LEARN_FILTER_BUCKET_SIZE;
+		b = &f->slots[idx * LEARN_FILTER_BUCKET_SIZE];
+		victim = b[slot];
+		__atomic_store_n (&b[slot], fp, __ATOMIC_RELAXED);
+		fp = victim;
+		idx = rspamd_learn_filter_alt_index (f, idx, fp);
+
+		if (rspamd_learn_filter_bucket_insert (f, idx, fp)) {
+			f->hdr->nelts ++;
+			rspamd_learn_filter_write_end (f);
+			rspamd_file_unlock (f->fd, FALSE);
+
+			return TRUE;
+		}
+	}
+
+	/*
+	 * We have lost some fingerprint, so the filter can produce false negatives
+	 * now and it must not be used until it is rebuilt with a larger size
+	 */
+	__atomic_or_fetch (&f->hdr->flags, RSPAMD_LEARN_FILTER_OVERFLOW,
+			__ATOMIC_RELEASE);
+	ret = FALSE;
+	rspamd_learn_filter_write_end (f);
+	rspamd_file_unlock (f->fd, FALSE);
+
+	msg_warn ("learn filter %s is full (%uL elements), consider increasing "
+			"filter_size; it is disabled until rebuilt", f->path, f->hdr->nelts);
+
+	return ret;
+}
+
+gboolean
+rspamd_learn_filter_del (struct rspamd_learn_filter *f,
+		const guchar *digest, gsize len)
+{
+	guint16 fp;
+	guint64 i1, i2;
+	gboolean ret;
+
+	rspamd_learn_filter_hash (f, digest, len, &fp, &i1, &i2);
+	rspamd_file_lock (f->fd, FALSE);
+	rspamd_learn_filter_write_begin (f);
+	ret = rspamd_learn_filter_bucket_remove (f, i1, fp) ||
+			rspamd_learn_filter_bucket_remove (f, i2, fp);
+
+	if (ret && f->hdr->nelts > 0) {
+		f->hdr->nelts --;
+	}
+
+	rspamd_learn_filter_write_end (f);
+	rspamd_file_unlock (f->fd, FALSE);
+
+	return ret;
+}
+
+const gchar *
+rspamd_learn_filter_path (struct rspamd_learn_filter *f)
+{
+	return f->path;
+}
+
+void
+rspamd_learn_filter_close (struct rspamd_learn_filter *f)
+{
+	if (f) {
+		munmap (f->hdr, f->len);
+		close (f->fd);
+		g_free (f->path);
+		g_free (f);
+	}
+}
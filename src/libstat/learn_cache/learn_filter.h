@@ -0,0 +1,125 @@
+/*-
+ * Copyright 2019 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_LEARN_FILTER_H
+#define RSPAMD_LEARN_FILTER_H
+
+#include "config.h"
+#include "ucl.h"
+
+/*
+ * Cuckoo filter of learned messages digests stored in a file shared between
+ * processes. It never returns false negatives for learns performed on this
+ * host, so if a digest is not found in an authoritative filter, then it is
+ * not learned and the backing store lookup could be skipped. Learns of other
+ * hosts are added on resync only, so a non-authoritative filter cannot be
+ * used to skip lookups.
+ */
+struct rspamd_learn_filter;
+
+#define RSPAMD_LEARN_FILTER_DEFAULT_SIZE 1000000
+#define RSPAMD_LEARN_FILTER_DEFAULT_FP_RATE 0.01
+/* Rebuild filter from the backing store each hour */
+#define RSPAMD_LEARN_FILTER_DEFAULT_RESYNC 3600.0
+
+/**
+ * Opens or creates filter file, if filter has different geometry it is
+ * recreated and should be rebuilt
+ * @param path
+ * @param capacity expected number of elements
+ * @param fp_rate desired false positive rate
+ * @param err
+ * @return filter or NULL
+ */
+struct rspamd_learn_filter *rspamd_learn_filter_open (const gchar *path,
+		gsize capacity, gdouble fp_rate, GError **err);
+
+/**
+ * Opens filter if it is enabled in the learn cache configuration:
+ * filter = true; filter_path = "..."; filter_size = 1M; filter_fp_rate = 0.01;
+ * filter_resync = 1h; (0 to rebuild only when filter is incomplete)
+ * filter_authoritative = false; (set if only this host learns messages)
+ * @param cf cache configuration
+ * @param default_path
+ * @return filter or NULL if it is disabled or cannot be opened
+ */
+struct rspamd_learn_filter *rspamd_learn_filter_from_ucl (
+		const ucl_object_t *cf, const gchar *default_path);
+
+/**
+ * Returns TRUE if filter is complete and can be used to skip lookups
+ */
+gboolean rspamd_learn_filter_is_ready (struct rspamd_learn_filter *f);
+
+/**
+ * Returns TRUE if all learns are performed on this host, so a digest missing
+ * in a complete filter is definitely not learned
+ */
+gboolean rspamd_learn_filter_is_authoritative (struct rspamd_learn_filter *f);
+
+/**
+ * Sets whether all learns are performed on this host
+ */
+void rspamd_learn_filter_set_authoritative (struct rspamd_learn_filter *f,
+		gboolean authoritative);
+
+/**
+ * Returns TRUE if filter is incomplete or has been built more than
+ * `filter_resync` seconds ago, so it could miss learns of other hosts
+ */
+gboolean rspamd_learn_filter_need_rebuild (struct rspamd_learn_filter *f);
+
+/**
+ * Marks filter as complete after it has been rebuilt from the backing store
+ */
+void rspamd_learn_filter_set_ready (struct rspamd_learn_filter *f);
+
+/**
+ * Removes all elements from the filter and marks it as incomplete
+ */
+void rspamd_learn_filter_reset (struct rspamd_learn_filter *f);
+
+/**
+ * Checks if digest might be in the filter, does not lock the filter
+ * @return FALSE if digest is definitely not in the filter
+ */
+gboolean rspamd_learn_filter_check (struct rspamd_learn_filter *f,
+		const guchar *digest, gsize len);
+
+/**
+ * Adds digest to the filter, on overflow filter is marked as incomplete
+ * @return TRUE if digest has been added
+ */
+gboolean rspamd_learn_filter_add (struct rspamd_learn_filter *f,
+		const guchar *digest, gsize len);
+
+/**
+ * Removes digest from the filter
+ * @return TRUE if digest has been found and removed
+ */
+gboolean rspamd_learn_filter_del (struct rspamd_learn_filter *f,
+		const guchar *digest, gsize len);
+
+/**
+ * Returns path of the filter file
+ */
+const gchar *rspamd_learn_filter_path (struct rspamd_learn_filter *f);
+
+/**
+ * Unmaps filter
+ */
+void rspamd_learn_filter_close (struct rspamd_learn_filter *f);
+
+#endif
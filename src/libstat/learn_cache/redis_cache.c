@@ -23,11 +23,15 @@
 #include "hiredis.h"
 #include "adapters/libev.h"
 #include "lua/lua_common.h"
+#include "learn_filter.h"
+#include "unix-std.h"
 
 #define REDIS_DEFAULT_TIMEOUT 0.5
 #define REDIS_STAT_TIMEOUT 30
 #define REDIS_DEFAULT_PORT 6379
 #define DEFAULT_REDIS_KEY "learned_ids"
+#define REDIS_FILTER_CHECK_INTERVAL 60.0
+#define REDIS_FILTER_SCAN_COUNT 1000
 
 static const gchar *M = "redis learn cache";
 
@@ -39,6 +43,7 @@ struct rspamd_redis_cache_ctx {
 	const gchar *redis_object;
 	gdouble timeout;
 	gint conf_ref;
+	struct rspamd_learn_filter *filter;
 };
 
 struct rspamd_redis_cache_runtime {
@@ -48,6 +53,28 @@ struct rspamd_redis_cache_runtime {
 	ev_timer timer_ev;
 	redisAsyncContext *redis;
 	gboolean has_event;
+	gboolean filter_added;
+};
+
+/* Used to rebuild local filter from the learned ids hash */
+struct rspamd_redis_cache_filter_cbdata;
+
+struct rspamd_redis_cache_filter_elt {
+	struct rspamd_redis_cache_ctx *ctx;
+	struct rspamd_stat_async_elt *async;
+	struct ev_loop *event_loop;
+	struct rspamd_redis_cache_filter_cbdata *cbdata;
+};
+
+struct rspamd_redis_cache_filter_cbdata {
+	struct rspamd_redis_cache_filter_elt *elt;
+	redisAsyncContext *redis;
+	struct upstream *selected;
+	gchar *cursor;
+	guint64 cnt;
+	gdouble start;
+	gint lock_fd;
+	gboolean wanna_die;
 };
 
 static GQuark
@@ -127,9 +154,12 @@ rspamd_stat_cache_redis_get (redisAsyncContext *c, gpointer r, gpointer priv)
 	struct rspamd_redis_cache_runtime *rt = priv;
 	redisReply *reply = r;
 	struct rspamd_task *task;
-	glong val = 0;
+	gint64 val = 0, code;
+	glong lval;
 
 	task = rt->task;
+	code = rspamd_stat_learn_class_code (task,
+			task->flags & RSPAMD_TASK_FLAG_LEARN_SPAM);
 
 	if (c->err == 0) {
 		if (reply) {
@@ -137,7 +167,9 @@ rspamd_stat_cache_redis_get (redisAsyncContext *c, gpointer r, gpointer priv)
 				val = reply->integer;
 			}
 			else if (reply->type == REDIS_REPLY_STRING) {
-				rspamd_strtol (reply->str, reply->len, &val);
+				if (rspamd_strtol (reply->str, reply->len, &lval)) {
+					val = lval;
+				}
 			}
 			else {
 				if (reply->type != REDIS_REPLY_NIL) {
@@ -149,8 +181,7 @@ rspamd_stat_cache_redis_get (redisAsyncContext *c, gpointer r, gpointer priv)
 			}
 		}
 
-		if ((val > 0 && (task->flags & RSPAMD_TASK_FLAG_LEARN_SPAM)) ||
-				(val < 0 && (task->flags & RSPAMD_TASK_FLAG_LEARN_HAM))) {
+		if (val != 0 && val == code) {
 			/* Already learned */
 			msg_info_task ("<%s> has been already "
 					"learned as %s, ignore it", task->message_id,
@@ -158,8 +189,8 @@ rspamd_stat_cache_redis_get (redisAsyncContext *c, gpointer r, gpointer priv)
 			task->flags |= RSPAMD_TASK_FLAG_ALREADY_LEARNED;
 		}
 		else if (val != 0) {
-			/* Unlearn flag */
-			task->flags |= RSPAMD_TASK_FLAG_UNLEARN;
+			/* Unlearn the class that has been learned previously */
+			rspamd_stat_set_unlearn_class (task, val);
 		}
 
 		rspamd_upstream_ok (rt->selected);
@@ -179,6 +210,7 @@ rspamd_stat_cache_redis_set (redisAsyncContext *c, gpointer r, gpointer priv)
 {
 	struct rspamd_redis_cache_runtime *rt = priv;
 	struct rspamd_task *task;
+	const gchar *h;
 
 	task = rt->task;
 
@@ -188,6 +220,13 @@ rspamd_stat_cache_redis_set (redisAsyncContext *c, gpointer r, gpointer priv)
 	}
 	else {
 		rspamd_upstream_fail (rt->selected, FALSE);
+
+		if (rt->filter_added) {
+			/* Id has not been stored, so remove it from the filter as well */
+			h = rspamd_mempool_get_variable (task->task_pool, "words_hash");
+			rspamd_learn_filter_del (rt->ctx->filter, h, strlen (h));
+			rt->filter_added = FALSE;
+		}
 	}
 
 	if (rt->has_event) {
@@ -226,6 +265,196 @@ rspamd_stat_cache_redis_generate_id (struct rspamd_task *task)
 	rspamd_mempool_set_variable (task->task_pool, "words_hash", b32out, g_free);
 }
 
+static void
+rspamd_redis_cache_filter_cleanup (struct rspamd_redis_cache_filter_cbdata *cbdata)
+{
+	if (cbdata && !cbdata->wanna_die) {
+		cbdata->wanna_die = TRUE;
+		redisAsyncFree (cbdata->redis);
+
+		if (cbdata->lock_fd != -1) {
+			rspamd_file_unlock (cbdata->lock_fd, FALSE);
+			close (cbdata->lock_fd);
+		}
+
+		if (cbdata->elt) {
+			cbdata->elt->cbdata = NULL;
+			cbdata->elt->async->enabled = TRUE;
+		}
+
+		g_free (cbdata->cursor);
+		g_free (cbdata);
+	}
+}
+
+/* Called when we get the next portion of learned ids */
+static void
+rspamd_redis_cache_filter_scanned (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_redis_cache_filter_cbdata *cbdata = priv;
+	struct rspamd_redis_cache_ctx *ctx;
+	redisReply *reply = r, *elts, *k;
+	guint i;
+
+	if (cbdata->wanna_die) {
+		return;
+	}
+
+	ctx = cbdata->elt->ctx;
+
+	if (c->err != 0 || reply == NULL || reply->type != REDIS_REPLY_ARRAY ||
+			reply->elements != 2 ||
+			reply->element[0]->type != REDIS_REPLY_STRING ||
+			reply->element[1]->type != REDIS_REPLY_ARRAY) {
+		msg_err ("cannot rebuild learn cache filter: %s",
+				c->err ? c->errstr : "bad reply");
+		rspamd_upstream_fail (cbdata->selected, FALSE);
+		rspamd_redis_cache_filter_cleanup (cbdata);
+
+		return;
+	}
+
+	elts = reply->element[1];
+
+	/* Reply is a flat list of field/value pairs */
+	for (i = 0; i < elts->elements; i += 2) {
+		k = elts->element[i];
+
+		if (k->type == REDIS_REPLY_STRING) {
+			if (!rspamd_learn_filter_add (ctx->filter, k->str, k->len)) {
+				rspamd_redis_cache_filter_cleanup (cbdata);
+
+				return;
+			}
+
+			cbdata->cnt ++;
+		}
+	}
+
+	g_free (cbdata->cursor);
+	cbdata->cursor = g_strndup (reply->element[0]->str,
+			reply->element[0]->len);
+
+	if (strcmp (cbdata->cursor, "0") == 0) {
+		rspamd_upstream_ok (cbdata->selected);
+		rspamd_learn_filter_set_ready (ctx->filter);
+		msg_info ("rebuilt learn cache filter %s: %uL ids in %.2f seconds",
+				rspamd_learn_filter_path (ctx->filter), cbdata->cnt,
+				ev_time () - cbdata->start);
+		rspamd_redis_cache_filter_cleanup (cbdata);
+	}
+	else {
+		redisAsyncCommand (cbdata->redis, rspamd_redis_cache_filter_scanned,
+				cbdata, "HSCAN %s %s COUNT %d",
+				ctx->redis_object, cbdata->cursor, REDIS_FILTER_SCAN_COUNT);
+	}
+}
+
+static void
+rspamd_redis_cache_async_filter_cb (struct rspamd_stat_async_elt *elt,
+		gpointer d)
+{
+	struct rspamd_redis_cache_filter_elt *redis_elt = elt->ud;
+	struct rspamd_redis_cache_filter_cbdata *cbdata;
+	struct rspamd_redis_cache_ctx *ctx;
+	struct upstream_list *ups;
+	rspamd_inet_addr_t *addr;
+	gchar lockbuf[PATH_MAX];
+	gint fd;
+
+	g_assert (redis_elt != NULL);
+
+	ctx = redis_elt->ctx;
+
+	if (redis_elt->cbdata) {
+		if (ev_time () - redis_elt->cbdata->start <
+				REDIS_FILTER_CHECK_INTERVAL * 10) {
+			/* Still building */
+			return;
+		}
+
+		msg_warn ("learn cache filter rebuilding is stuck, restart it");
+		rspamd_redis_cache_filter_cleanup (redis_elt->cbdata);
+	}
+
+	if (!rspamd_learn_filter_need_rebuild (ctx->filter)) {
+		return;
+	}
+
+	/* Only one process on a host rebuilds filter */
+	rspamd_snprintf (lockbuf, sizeof (lockbuf), "%s.lock",
+			rspamd_learn_filter_path (ctx->filter));
+	fd = rspamd_file_xopen (lockbuf, O_RDWR | O_CREAT, 00644, FALSE);
+
+	if (fd == -1) {
+		msg_err ("cannot open filter lock %s: %s", lockbuf, strerror (errno));
+
+		return;
+	}
+
+	if (!rspamd_file_lock (fd, TRUE)) {
+		close (fd);
+
+		return;
+	}
+
+	ups = rspamd_redis_get_servers (ctx, "read_servers");
+
+	/* Another process could finish rebuilding while we have been waiting */
+	if (!ups || !rspamd_learn_filter_need_rebuild (ctx->filter)) {
+		rspamd_file_unlock (fd, FALSE);
+		close (fd);
+
+		return;
+	}
+
+	elt->enabled = FALSE;
+	cbdata = g_malloc0 (sizeof (*cbdata));
+	cbdata->lock_fd = fd;
+	cbdata->cursor = g_strdup ("0");
+	cbdata->start = ev_time ();
+	cbdata->selected = rspamd_upstream_get (ups,
+			RSPAMD_UPSTREAM_ROUND_ROBIN,
+			NULL,
+			0);
+
+	g_assert (cbdata->selected != NULL);
+	addr = rspamd_upstream_addr_next (cbdata->selected);
+	g_assert (addr != NULL);
+
+	if (rspamd_inet_address_get_af (addr) == AF_UNIX) {
+		cbdata->redis = redisAsyncConnectUnix (rspamd_inet_address_to_string (addr));
+	}
+	else {
+		cbdata->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
+				rspamd_inet_address_get_port (addr));
+	}
+
+	g_assert (cbdata->redis != NULL);
+
+	redisLibevAttach (redis_elt->event_loop, cbdata->redis);
+	cbdata->elt = redis_elt;
+	redis_elt->cbdata = cbdata;
+
+	/* Learns performed during rebuilding are added to the filter as well */
+	rspamd_learn_filter_reset (ctx->filter);
+	rspamd_redis_cache_maybe_auth (ctx, cbdata->redis);
+	redisAsyncCommand (cbdata->redis, rspamd_redis_cache_filter_scanned,
+			cbdata, "HSCAN %s %s COUNT %d",
+			ctx->redis_object, cbdata->cursor, REDIS_FILTER_SCAN_COUNT);
+}
+
+static void
+rspamd_redis_cache_async_filter_fin (struct rspamd_stat_async_elt *elt,
+		gpointer d)
+{
+	struct rspamd_redis_cache_filter_elt *redis_elt = elt->ud;
+
+	rspamd_redis_cache_filter_cleanup (redis_elt->cbdata);
+	g_free (redis_elt);
+}
+
 gpointer
 rspamd_stat_cache_redis_init (struct rspamd_stat_ctx *ctx,
 		struct rspamd_config *cfg,
@@ -233,8 +462,10 @@ rspamd_stat_cache_redis_init (struct rspamd_stat_ctx *ctx,
 		const ucl_object_t *cf)
 {
 	struct rspamd_redis_cache_ctx *cache_ctx;
+	struct rspamd_redis_cache_filter_elt *filter_elt;
 	struct rspamd_statfile_config *stf = st->stcf;
 	const ucl_object_t *obj;
+	gchar filter_path[PATH_MAX];
 	gboolean ret = FALSE;
 	lua_State *L = (lua_State *)cfg->lua_state;
 	gint conf_ref = -1;
@@ -326,6 +557,34 @@ rspamd_stat_cache_redis_init (struct rspamd_stat_ctx *ctx,
 
 	cache_ctx->stcf = stf;
 
+	rspamd_snprintf (filter_path, sizeof (filter_path),
+			"%s/learn_cache_%s.filter", RSPAMD_DBDIR, cache_ctx->redis_object);
+	cache_ctx->filter = rspamd_learn_filter_from_ucl (cf, filter_path);
+
+	if (cache_ctx->filter &&
+			!rspamd_learn_filter_is_authoritative (cache_ctx->filter)) {
+		/*
+		 * Other hosts could have learned a message since the last resync,
+		 * so a filter miss can skip redis only if all learns are done here
+		 */
+		msg_warn_config ("learn cache filter %s is disabled: it requires "
+				"filter_authoritative = true, as learns of other hosts are "
+				"not in the filter until it is resynced",
+				rspamd_learn_filter_path (cache_ctx->filter));
+		rspamd_learn_filter_close (cache_ctx->filter);
+		cache_ctx->filter = NULL;
+	}
+
+	if (cache_ctx->filter) {
+		filter_elt = g_malloc0 (sizeof (*filter_elt));
+		filter_elt->event_loop = ctx->event_loop;
+		filter_elt->ctx = cache_ctx;
+		filter_elt->async = rspamd_stat_ctx_register_async (
+				rspamd_redis_cache_async_filter_cb,
+				rspamd_redis_cache_async_filter_fin, filter_elt,
+				REDIS_FILTER_CHECK_INTERVAL);
+	}
+
 	return (gpointer)cache_ctx;
 }
 
@@ -338,6 +597,7 @@ rspamd_stat_cache_redis_runtime (struct rspamd_task *task,
 	struct upstream *up;
 	struct upstream_list *ups;
 	rspamd_inet_addr_t *addr;
+	const gchar *h;
 
 	g_assert (ctx != NULL);
 
@@ -380,10 +640,24 @@ rspamd_stat_cache_redis_runtime (struct rspamd_task *task,
 	}
 
 	rt = rspamd_mempool_alloc0 (task->task_pool, sizeof (*rt));
-	rt->selected = up;
 	rt->task = task;
 	rt->ctx = ctx;
 
+	if (!learn) {
+		rspamd_stat_cache_redis_generate_id (task);
+
+		if (ctx->filter && rspamd_learn_filter_is_ready (ctx->filter)) {
+			h = rspamd_mempool_get_variable (task->task_pool, "words_hash");
+
+			if (!rspamd_learn_filter_check (ctx->filter, h, strlen (h))) {
+				/* Definitely not learned, no need to connect to redis */
+				return rt;
+			}
+		}
+	}
+
+	rt->selected = up;
+
 	addr = rspamd_upstream_addr_next (up);
 	g_assert (addr != NULL);
 
@@ -405,10 +679,6 @@ rspamd_stat_cache_redis_runtime (struct rspamd_task *task,
 			rt->ctx->timeout, 0.0);
 	rspamd_redis_cache_maybe_auth (ctx, rt->redis);
 
-	if (!learn) {
-		rspamd_stat_cache_redis_generate_id (task);
-	}
-
 	return rt;
 }
 
@@ -424,6 +694,11 @@ rspamd_stat_cache_redis_check (struct rspamd_task *task,
 		return RSPAMD_LEARN_INGORE;
 	}
 
+	if (rt->redis == NULL) {
+		/* Filtered out */
+		return RSPAMD_LEARN_OK;
+	}
+
 	h = rspamd_mempool_get_variable (task->task_pool, "words_hash");
 
 	if (h == NULL) {
@@ -452,7 +727,7 @@ rspamd_stat_cache_redis_learn (struct rspamd_task *task,
 {
 	struct rspamd_redis_cache_runtime *rt = runtime;
 	gchar *h;
-	gint flag;
+	gint64 flag;
 
 	if (rspamd_session_blocked (task->s)) {
 		return RSPAMD_LEARN_INGORE;
@@ -461,15 +736,22 @@ rspamd_stat_cache_redis_learn (struct rspamd_task *task,
 	h = rspamd_mempool_get_variable (task->task_pool, "words_hash");
 	g_assert (h != NULL);
 
-	flag = (task->flags & RSPAMD_TASK_FLAG_LEARN_SPAM) ? 1 : -1;
+	/* Spam is 1 and ham is -1, other classes are stored by their codes */
+	flag = rspamd_stat_learn_class_code (task, is_spam);
 
 	if (redisAsyncCommand (rt->redis, rspamd_stat_cache_redis_set, rt,
-			"HSET %s %s %d",
-			rt->ctx->redis_object, h, flag) == REDIS_OK) {
+			"HSET %s %s %lld",
+			rt->ctx->redis_object, h, (long long)flag) == REDIS_OK) {
 		rspamd_session_add_event (task->s,
 				rspamd_redis_cache_fin, rt, M);
 		ev_timer_start (rt->task->event_loop, &rt->timer_ev);
 		rt->has_event = TRUE;
+
+		/* Relearned ids are already in the filter */
+		if (rt->ctx->filter && !(task->flags & RSPAMD_TASK_FLAG_UNLEARN)) {
+			rt->filter_added = rspamd_learn_filter_add (rt->ctx->filter,
+					h, strlen (h));
+		}
 	}
 
 	/* We need to return OK every time */
@@ -488,5 +770,6 @@ rspamd_stat_cache_redis_close (gpointer c)
 		luaL_unref (L, LUA_REGISTRYINDEX, ctx->conf_ref);
 	}
 
+	rspamd_learn_filter_close (ctx->filter);
 	g_free (ctx);
 }
@@ -23,6 +23,7 @@
 #include "fstring.h"
 #include "message.h"
 #include "libutil/sqlite_utils.h"
+#include "learn_filter.h"
 
 static const char *create_tables_sql =
 		""
@@ -109,8 +110,44 @@ static struct rspamd_sqlite3_prstmt prepared_stmts[RSPAMD_STAT_CACHE_MAX] =
 struct rspamd_stat_sqlite3_ctx {
 	sqlite3 *db;
 	GArray *prstmt;
+	struct rspamd_learn_filter *filter;
 };
 
+/*
+ * Fills filter with all digests stored in the database
+ */
+static void
+rspamd_stat_cache_sqlite3_rebuild_filter (struct rspamd_stat_sqlite3_ctx *ctx)
+{
+	sqlite3_stmt *stmt;
+	guint64 cnt = 0;
+
+	if (sqlite3_prepare_v2 (ctx->db, "SELECT digest FROM learns;", -1,
+			&stmt, NULL) != SQLITE_OK) {
+		msg_err ("cannot rebuild learn cache filter: %s",
+				sqlite3_errmsg (ctx->db));
+		return;
+	}
+
+	rspamd_learn_filter_reset (ctx->filter);
+
+	while (sqlite3_step (stmt) == SQLITE_ROW) {
+		if (!rspamd_learn_filter_add (ctx->filter, sqlite3_column_blob (stmt, 0),
+				sqlite3_column_bytes (stmt, 0))) {
+			sqlite3_finalize (stmt);
+
+			return;
+		}
+
+		cnt ++;
+	}
+
+	sqlite3_finalize (stmt);
+	rspamd_learn_filter_set_ready (ctx->filter);
+	msg_info ("rebuilt learn cache filter %s: %uL digests",
+			rspamd_learn_filter_path (ctx->filter), cnt);
+}
+
 gpointer
 rspamd_stat_cache_sqlite3_init (struct rspamd_stat_ctx *ctx,
 		struct rspamd_config *cfg,
@@ -120,6 +157,7 @@ rspamd_stat_cache_sqlite3_init (struct rspamd_stat_ctx *ctx,
 	struct rspamd_stat_sqlite3_ctx *new = NULL;
 	const ucl_object_t *elt;
 	gchar dbpath[PATH_MAX];
+	gchar filter_path[PATH_MAX];
 	const gchar *path = SQLITE_CACHE_PATH;
 	sqlite3 *sqlite;
 	GError *err = NULL;
@@ -156,6 +194,15 @@ rspamd_stat_cache_sqlite3_init (struct rspamd_stat_ctx *ctx,
 			g_free (new);
 			new = NULL;
 		}
+		else {
+			rspamd_snprintf (filter_path, sizeof (filter_path), "%s.filter",
+					dbpath);
+			new->filter = rspamd_learn_filter_from_ucl (cf, filter_path);
+
+			if (new->filter && !rspamd_learn_filter_is_ready (new->filter)) {
+				rspamd_stat_cache_sqlite3_rebuild_filter (new);
+			}
+		}
 	}
 
 	return new;
@@ -206,6 +253,16 @@ rspamd_stat_cache_sqlite3_check (struct rspamd_task *task,
 
 		rspamd_cryptobox_hash_final (&st, out);
 
+		/* Save hash into variables */
+		rspamd_mempool_set_variable (task->task_pool, "words_hash", out, NULL);
+
+		if (ctx->filter && rspamd_learn_filter_is_ready (ctx->filter) &&
+				!rspamd_learn_filter_check (ctx->filter, out,
+						rspamd_cryptobox_HASHBYTES)) {
+			/* Definitely not learned, no need to query database */
+			return RSPAMD_LEARN_OK;
+		}
+
 		rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
 				RSPAMD_STAT_CACHE_TRANSACTION_START_DEF);
 		rc = rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
@@ -214,12 +271,13 @@ rspamd_stat_cache_sqlite3_check (struct rspamd_task *task,
 		rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
 				RSPAMD_STAT_CACHE_TRANSACTION_COMMIT);
 
-		/* Save hash into variables */
-		rspamd_mempool_set_variable (task->task_pool, "words_hash", out, NULL);
-
 		if (rc == SQLITE_OK) {
-			/* We have some existing record in the table */
-			if (!!flag == !!is_spam) {
+			/* We have some existing record in the table, ham is stored as 0 */
+			if (flag == 0) {
+				flag = -1;
+			}
+
+			if (flag == rspamd_stat_learn_class_code (task, is_spam)) {
 				/* Already learned */
 				msg_warn_task ("already seen stat hash: %*bs",
 						rspamd_cryptobox_HASHBYTES, out);
@@ -227,6 +285,8 @@ rspamd_stat_cache_sqlite3_check (struct rspamd_task *task,
 			}
 			else {
 				/* Need to relearn */
+				rspamd_stat_set_unlearn_class (task, flag);
+
 				return RSPAMD_LEARN_UNLEARN;
 			}
 		}
@@ -244,6 +304,7 @@ rspamd_stat_cache_sqlite3_learn (struct rspamd_task *task,
 	gboolean unlearn = !!(task->flags & RSPAMD_TASK_FLAG_UNLEARN);
 	guchar *h;
 	gint64 flag;
+	gint rc;
 
 	h = rspamd_mempool_get_variable (task->task_pool, "words_hash");
 
@@ -251,17 +312,27 @@ rspamd_stat_cache_sqlite3_learn (struct rspamd_task *task,
 		return RSPAMD_LEARN_INGORE;
 	}
 
-	flag = !!is_spam ? 1 : 0;
+	flag = rspamd_stat_learn_class_code (task, is_spam);
+
+	if (flag == -1) {
+		/* Ham */
+		flag = 0;
+	}
 
 	if (!unlearn) {
 		/* Insert result new id */
 		rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
 				RSPAMD_STAT_CACHE_TRANSACTION_START_IM);
-		rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
+		rc = rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
 				RSPAMD_STAT_CACHE_ADD_LEARN,
 				(gint64)rspamd_cryptobox_HASHBYTES, h, flag);
 		rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
 				RSPAMD_STAT_CACHE_TRANSACTION_COMMIT);
+
+		if (ctx->filter && rc == SQLITE_OK) {
+			rspamd_learn_filter_add (ctx->filter, h,
+					rspamd_cryptobox_HASHBYTES);
+		}
 	}
 	else {
 		rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
@@ -287,6 +358,7 @@ rspamd_stat_cache_sqlite3_close (gpointer c)
 	if (ctx != NULL) {
 		rspamd_sqlite3_close_prstmt (ctx->db, ctx->prstmt);
 		sqlite3_close (ctx->db);
+		rspamd_learn_filter_close (ctx->filter);
 		g_free (ctx);
 	}
 
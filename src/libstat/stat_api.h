@@ -75,8 +75,11 @@ typedef enum rspamd_stat_result_e {
 /**
  * Initialise statistics modules
  * @param cfg
+ * @param ev_base event loop for periodic tasks or NULL
+ * @param worker worker that runs periodic tasks or NULL
  */
-void rspamd_stat_init (struct rspamd_config *cfg, struct ev_loop *ev_base);
+void rspamd_stat_init (struct rspamd_config *cfg, struct ev_loop *ev_base,
+		struct rspamd_worker *worker);
 
 /**
  * Finalize statistics
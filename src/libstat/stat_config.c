@@ -38,6 +38,13 @@ static struct rspamd_stat_classifier stat_classifiers[] = {
 		.classify_func = bayes_classify,
 		.learn_spam_func = bayes_learn_spam,
 		.fin_func = bayes_fin,
+	},
+	{
+		.name = "multiclass",
+		.init_func = multiclass_init,
+		.classify_func = multiclass_classify,
+		.learn_spam_func = multiclass_learn,
+		.fin_func = multiclass_fin,
 	}
 };
 
@@ -95,7 +102,8 @@ static struct rspamd_stat_cache stat_caches[] = {
 };
 
 void
-rspamd_stat_init (struct rspamd_config *cfg, struct ev_loop *ev_base)
+rspamd_stat_init (struct rspamd_config *cfg, struct ev_loop *ev_base,
+		struct rspamd_worker *worker)
 {
 	GList *cur, *curst;
 	struct rspamd_classifier_config *clf;
@@ -164,6 +172,7 @@ rspamd_stat_init (struct rspamd_config *cfg, struct ev_loop *ev_base)
 	stat_ctx->classifiers = g_ptr_array_new ();
 	stat_ctx->async_elts = g_queue_new ();
 	stat_ctx->event_loop = ev_base;
+	stat_ctx->worker = worker;
 	stat_ctx->lua_stat_tokens_ref = -1;
 
 	/* Interact with lua_stat */
@@ -94,6 +94,7 @@ struct rspamd_stat_ctx {
 	gpointer tkcf;
 
 	struct ev_loop *event_loop;
+	struct rspamd_worker *worker;
 };
 
 typedef enum rspamd_learn_cache_result {
@@ -111,6 +112,38 @@ struct rspamd_stat_async_elt* rspamd_stat_ctx_register_async (
 		rspamd_stat_async_handler handler, rspamd_stat_async_cleanup cleanup,
 		gpointer d, gdouble timeout);
 
+/**
+ * Checks if a statfile should be learned for the current task: either its
+ * class matches `Learn-Class` request header (or `spam` and `ham` for plain
+ * learns) or its spam flag matches `spam`
+ */
+gboolean rspamd_stat_is_learn_target (struct rspamd_task *task,
+		struct rspamd_statfile *st, gboolean spam);
+
+/**
+ * Checks if a statfile should be unlearned for the current task, that is
+ * only the class the message has been previously learned as
+ */
+gboolean rspamd_stat_is_unlearn_target (struct rspamd_task *task,
+		struct rspamd_statfile *st, gboolean spam);
+
+/**
+ * Returns value stored in learn caches for a class: 1 for spam, -1 for ham
+ * and a positive hash for other classes
+ */
+gint64 rspamd_stat_class_code (const gchar *class_name);
+
+/**
+ * Returns learn cache value for the class that is learned by the task
+ */
+gint64 rspamd_stat_learn_class_code (struct rspamd_task *task, gboolean spam);
+
+/**
+ * Records class the message has been previously learned as and sets
+ * unlearn flag for the task
+ */
+void rspamd_stat_set_unlearn_class (struct rspamd_task *task, gint64 code);
+
 static GQuark rspamd_stat_quark (void)
 {
 	return g_quark_from_static_string ("rspamd-statistics");
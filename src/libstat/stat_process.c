@@ -22,6 +22,7 @@
 #include "libserver/html.h"
 #include "lua/lua_common.h"
 #include "libserver/mempool_vars_internal.h"
+#include "libserver/worker_util.h"
 #include "utlist.h"
 #include <math.h>
 
@@ -31,6 +32,99 @@
 
 static const gdouble similarity_treshold = 80.0;
 
+static const gchar *
+rspamd_stat_learn_class (struct rspamd_task *task, gboolean spam)
+{
+	const gchar *learn_class;
+
+	learn_class = rspamd_mempool_get_variable (task->task_pool,
+			RSPAMD_MEMPOOL_STAT_LEARN_CLASS);
+
+	if (learn_class) {
+		return learn_class;
+	}
+
+	return spam ? "spam" : "ham";
+}
+
+gint64
+rspamd_stat_class_code (const gchar *class_name)
+{
+	if (g_ascii_strcasecmp (class_name, "spam") == 0) {
+		return 1;
+	}
+	else if (g_ascii_strcasecmp (class_name, "ham") == 0) {
+		return -1;
+	}
+
+	/* Positive and never equal to the spam code */
+	return (gint64)(rspamd_icase_hash (class_name, strlen (class_name), 0) >> 2)
+			+ 2;
+}
+
+gint64
+rspamd_stat_learn_class_code (struct rspamd_task *task, gboolean spam)
+{
+	return rspamd_stat_class_code (rspamd_stat_learn_class (task, spam));
+}
+
+static gint64
+rspamd_stat_statfile_class_code (struct rspamd_statfile *st)
+{
+	if (st->stcf->class_name) {
+		return rspamd_stat_class_code (st->stcf->class_name);
+	}
+
+	return st->stcf->is_spam ? 1 : -1;
+}
+
+gboolean
+rspamd_stat_is_learn_target (struct rspamd_task *task,
+		struct rspamd_statfile *st, gboolean spam)
+{
+	if (st->stcf->class_name) {
+		/* Plain spam or ham learn targets only a class with the same name */
+		return g_ascii_strcasecmp (rspamd_stat_learn_class (task, spam),
+				st->stcf->class_name) == 0;
+	}
+
+	return !!spam == !!st->stcf->is_spam;
+}
+
+void
+rspamd_stat_set_unlearn_class (struct rspamd_task *task, gint64 code)
+{
+	gint64 *pcode;
+
+	pcode = rspamd_mempool_alloc (task->task_pool, sizeof (*pcode));
+	*pcode = code;
+	rspamd_mempool_set_variable (task->task_pool,
+			RSPAMD_MEMPOOL_STAT_UNLEARN_CLASS, pcode, NULL);
+	task->flags |= RSPAMD_TASK_FLAG_UNLEARN;
+}
+
+gboolean
+rspamd_stat_is_unlearn_target (struct rspamd_task *task,
+		struct rspamd_statfile *st, gboolean spam)
+{
+	gint64 *prev;
+
+	if (!(task->flags & RSPAMD_TASK_FLAG_UNLEARN) ||
+			rspamd_stat_is_learn_target (task, st, spam)) {
+		return FALSE;
+	}
+
+	prev = rspamd_mempool_get_variable (task->task_pool,
+			RSPAMD_MEMPOOL_STAT_UNLEARN_CLASS);
+
+	if (prev == NULL) {
+		/* Previous class is unknown, so it could be any other class */
+		return TRUE;
+	}
+
+	return rspamd_stat_statfile_class_code (st) == *prev;
+}
+
 static void
 rspamd_stat_tokenize_parts_metadata (struct rspamd_stat_ctx *st_ctx,
 		struct rspamd_task *task)
@@ -310,20 +404,6 @@ rspamd_stat_classifiers_process (struct rspamd_stat_ctx *st_ctx,
 		return;
 	}
 
-	/*
-	 * Do not classify a message if some class is missing
-	 */
-	if (!(task->flags & RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS)) {
-		msg_info_task ("skip statistics as SPAM class is missing");
-
-		return;
-	}
-	if (!(task->flags & RSPAMD_TASK_FLAG_HAS_HAM_TOKENS)) {
-		msg_info_task ("skip statistics as HAM class is missing");
-
-		return;
-	}
-
 	for (i = 0; i < st_ctx->classifiers->len; i++) {
 		cl = g_ptr_array_index (st_ctx->classifiers, i);
 		cl->spam_learns = 0;
@@ -378,6 +458,23 @@ rspamd_stat_classifiers_process (struct rspamd_stat_ctx *st_ctx,
 			}
 		}
 
+		/*
+		 * Do not classify a message by a binary classifier if some class is
+		 * missing, multi-class classifiers check their classes themselves
+		 */
+		if (!skip && !(cl->cfg->flags & RSPAMD_FLAG_CLASSIFIER_MULTICLASS)) {
+			if (!(task->flags & RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS)) {
+				msg_info_task ("skip statistics as SPAM class is missing");
+
+				continue;
+			}
+			if (!(task->flags & RSPAMD_TASK_FLAG_HAS_HAM_TOKENS)) {
+				msg_info_task ("skip statistics as HAM class is missing");
+
+				continue;
+			}
+		}
+
 		if (!skip) {
 			if (cl->cfg->min_tokens > 0 && task->tokens->len < cl->cfg->min_tokens) {
 				msg_debug_bayes (
@@ -703,11 +800,10 @@ rspamd_stat_backends_learn (struct rspamd_stat_ctx *st_ctx,
 				continue;
 			}
 
-			if (!(task->flags & RSPAMD_TASK_FLAG_UNLEARN)) {
-				if (!!spam != !!st->stcf->is_spam) {
-					/* If we are not unlearning, then do not touch another class */
-					continue;
-				}
+			if (!rspamd_stat_is_learn_target (task, st, spam) &&
+					!rspamd_stat_is_unlearn_target (task, st, spam)) {
+				/* Touch only the new and the previously learned classes */
+				continue;
 			}
 
 			if (!st->backend->learn_tokens (task, task->tokens, id, bk_run)) {
@@ -719,10 +815,10 @@ rspamd_stat_backends_learn (struct rspamd_stat_ctx *st_ctx,
 				goto end;
 			}
 			else {
-				if (!!spam == !!st->stcf->is_spam) {
+				if (rspamd_stat_is_learn_target (task, st, spam)) {
 					st->backend->inc_learns (task, bk_run, st_ctx);
 				}
-				else if (task->flags & RSPAMD_TASK_FLAG_UNLEARN) {
+				else {
 					st->backend->dec_learns (task, bk_run, st_ctx);
 				}
 
@@ -808,7 +904,7 @@ rspamd_stat_backends_post_learn (struct rspamd_stat_ctx *st_ctx,
 		}
 	}
 
-	g_atomic_int_add (&task->worker->srv->stat->messages_learned, 1);
+	RSPAMD_STAT_ADD (rspamd_worker_stat (task->worker), messages_learned, 1);
 
 	return res;
 }
@@ -836,6 +932,17 @@ rspamd_stat_learn (struct rspamd_task *task,
 	}
 
 	if (stage == RSPAMD_TASK_STAGE_LEARN_PRE) {
+		rspamd_ftok_t *hdr;
+
+		/* Explicit class for multi-class classifiers */
+		hdr = rspamd_task_get_request_header (task, "Learn-Class");
+
+		if (hdr && hdr->len > 0) {
+			rspamd_mempool_set_variable (task->task_pool,
+					RSPAMD_MEMPOOL_STAT_LEARN_CLASS,
+					rspamd_mempool_ftokdup (task->task_pool, hdr), NULL);
+		}
+
 		/* Process classifiers */
 		if (!rspamd_stat_cache_check (st_ctx, task, classifier, spam, err)) {
 			return RSPAMD_STAT_PROCESS_ERROR;
@@ -675,6 +675,108 @@ rspamd_ucs32_to_normalised (rspamd_stat_token_t *tok,
 	tok->normalized.begin = dest;
 }
 
+enum rspamd_ascii_char_class {
+	RSPAMD_ASCII_CHAR_KEEP = (1u << 0),
+	RSPAMD_ASCII_CHAR_EMOJI = (1u << 1),
+	RSPAMD_ASCII_CHAR_INVISIBLE = (1u << 2),
+};
+
+/*
+ * Classes of ascii characters as they are treated by rspamd_uchars_to_ucs32,
+ * filled using the same ICU predicates to produce exactly the same results
+ */
+static const guchar *
+rspamd_ascii_char_classes (void)
+{
+	static guchar classes[128];
+	static gboolean initialised = FALSE;
+	UChar32 t;
+
+	if (!initialised) {
+		for (t = 0; t < (UChar32)G_N_ELEMENTS (classes); t ++) {
+			if (u_isgraph (t)) {
+				UCharCategory cat;
+
+				cat = u_charType (t);
+#if U_ICU_VERSION_MAJOR_NUM >= 57
+				if (u_hasBinaryProperty (t, UCHAR_EMOJI)) {
+					classes[t] |= RSPAMD_ASCII_CHAR_EMOJI;
+				}
+#endif
+
+				if (cat == U_UPPERCASE_LETTER ||
+						cat == U_LOWERCASE_LETTER ||
+						cat == U_DECIMAL_DIGIT_NUMBER ||
+						cat == U_CONNECTOR_PUNCTUATION ||
+						cat == U_MATH_SYMBOL ||
+						cat == U_CURRENCY_SYMBOL ||
+						cat == U_INITIAL_PUNCTUATION ||
+						cat == U_FINAL_PUNCTUATION) {
+					classes[t] |= RSPAMD_ASCII_CHAR_KEEP;
+				}
+			}
+			else {
+				classes[t] |= RSPAMD_ASCII_CHAR_INVISIBLE;
+			}
+		}
+
+		initialised = TRUE;
+	}
+
+	return classes;
+}
+
+/*
+ * Ascii words are always normalised, so we can fill both unicode and
+ * normalised representations in a single pass and a single allocation
+ * with no ICU conversions
+ */
+static gboolean
+rspamd_normalize_ascii_word (rspamd_stat_token_t *tok, rspamd_mempool_t *pool)
+{
+	const guchar *classes, *p = (const guchar *)tok->original.begin;
+	UChar32 *ucs;
+	gchar *utf;
+	gsize i, len = tok->original.len, nout = 0;
+	guchar c, cls;
+
+	for (i = 0; i < len; i ++) {
+		if (p[i] & 0x80) {
+			return FALSE;
+		}
+	}
+
+	classes = rspamd_ascii_char_classes ();
+	ucs = rspamd_mempool_alloc (pool, len * sizeof (UChar32) + len + 1);
+	utf = (gchar *)(ucs + len);
+
+	for (i = 0; i < len; i ++) {
+		cls = classes[p[i]];
+
+		if (cls & RSPAMD_ASCII_CHAR_KEEP) {
+			c = g_ascii_tolower (p[i]);
+			ucs[nout] = c;
+			utf[nout] = c;
+			nout ++;
+		}
+
+		if (cls & RSPAMD_ASCII_CHAR_EMOJI) {
+			tok->flags |= RSPAMD_STAT_TOKEN_FLAG_EMOJI;
+		}
+		else if (cls & RSPAMD_ASCII_CHAR_INVISIBLE) {
+			tok->flags |= RSPAMD_STAT_TOKEN_FLAG_INVISIBLE_SPACES;
+		}
+	}
+
+	utf[nout] = '\0';
+	tok->unicode.begin = ucs;
+	tok->unicode.len = nout;
+	tok->normalized.begin = utf;
+	tok->normalized.len = nout;
+
+	return TRUE;
+}
+
 void
 rspamd_normalize_single_word (rspamd_stat_token_t *tok, rspamd_mempool_t *pool)
 {
@@ -683,9 +785,14 @@ rspamd_normalize_single_word (rspamd_stat_token_t *tok, rspamd_mempool_t *pool)
 	UChar tmpbuf[1024]; /* Assume that we have no longer words... */
 	gsize ulen;
 
-	utf8_converter = rspamd_get_utf8_converter ();
-
 	if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_UTF) {
+		/* Longer words are treated as broken by the generic path */
+		if (tok->original.len <= G_N_ELEMENTS (tmpbuf) &&
+				rspamd_normalize_ascii_word (tok, pool)) {
+			return;
+		}
+
+		utf8_converter = rspamd_get_utf8_converter ();
 		ulen = ucnv_toUChars (utf8_converter,
 				tmpbuf,
 				G_N_ELEMENTS (tmpbuf),
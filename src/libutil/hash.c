@@ -27,9 +27,11 @@ static const guint eviction_candidates = 16;
 static const gdouble lfu_base_value = 5.0;
 
 struct rspamd_lru_volatile_element_s;
+struct rspamd_lru_tinylfu_s;
 
 struct rspamd_lru_hash_s {
 	guint maxsize;
+	struct rspamd_lru_tinylfu_s *tinylfu;
 	guint eviction_min_prio;
 	guint eviction_used;
 	struct rspamd_lru_element_s **eviction_pool;
@@ -498,6 +500,405 @@ rspamd_lru_hash_evict (rspamd_lru_hash_t *hash, time_t now)
 	}
 }
 
+/*
+ * W-TinyLFU cache
+ *
+ * New elements are placed to a small LRU window, elements evicted from the
+ * window compete with the victim of the main segmented LRU (probation and
+ * protected segments) and the most frequent one is kept. Frequencies are
+ * estimated by a count-min sketch that is halved periodically to forget old
+ * history. All nodes are preallocated and linked by indices, so all
+ * operations are O(1).
+ */
+#define TINYLFU_NIL G_MAXUINT32
+#define TINYLFU_SKETCH_DEPTH 4
+#define TINYLFU_COUNTER_MAX 15
+#define TINYLFU_SAMPLE_FACTOR 10
+
+static const guint tinylfu_window_pct = 1;
+static const guint tinylfu_protected_pct = 80;
+
+enum rspamd_lru_tinylfu_segment {
+	RSPAMD_TINYLFU_WINDOW = 0,
+	RSPAMD_TINYLFU_PROBATION,
+	RSPAMD_TINYLFU_PROTECTED,
+	RSPAMD_TINYLFU_FREE,
+	RSPAMD_TINYLFU_MAX_SEGMENT
+};
+
+struct rspamd_lru_tinylfu_node {
+	gpointer key;
+	gpointer data;
+	time_t creation_time;
+	guint ttl;
+	guint32 hv;
+	guint32 prev;
+	guint32 next;
+	guint8 segment;
+};
+
+struct rspamd_lru_tinylfu_list {
+	guint32 head;
+	guint32 tail;
+	guint len;
+};
+
+struct rspamd_lru_tinylfu_s {
+	GHashTable *tbl;
+	struct rspamd_lru_tinylfu_node *nodes;
+	guint nnodes;
+	struct rspamd_lru_tinylfu_list lists[RSPAMD_TINYLFU_MAX_SEGMENT];
+	guint window_max;
+	guint main_max;
+	guint protected_max;
+	guint8 *sketch;
+	guint32 sketch_mask;
+	guint samples;
+	guint sample_limit;
+};
+
+static inline guint32
+rspamd_lru_tinylfu_mix (guint32 h)
+{
+	/* Hash functions used for lru keys are not always good enough */
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+
+	return h;
+}
+
+static inline guint32
+rspamd_lru_tinylfu_sketch_idx (struct rspamd_lru_tinylfu_s *t, guint32 hv,
+		guint row)
+{
+	guint32 h2 = (hv >> 17) | (hv << 15);
+
+	return row * (t->sketch_mask + 1) +
+			((hv + row * (h2 | 1U)) & t->sketch_mask);
+}
+
+static guint
+rspamd_lru_tinylfu_frequency (struct rspamd_lru_tinylfu_s *t, guint32 hv)
+{
+	guint i, freq = TINYLFU_COUNTER_MAX;
+
+	for (i = 0; i < TINYLFU_SKETCH_DEPTH; i ++) {
+		freq = MIN (freq, t->sketch[rspamd_lru_tinylfu_sketch_idx (t, hv, i)]);
+	}
+
+	return freq;
+}
+
+static void
+rspamd_lru_tinylfu_record (struct rspamd_lru_tinylfu_s *t, guint32 hv)
+{
+	guint i, j, nctr;
+	guint8 *ctr;
+	gboolean added = FALSE;
+
+	for (i = 0; i < TINYLFU_SKETCH_DEPTH; i ++) {
+		ctr = &t->sketch[rspamd_lru_tinylfu_sketch_idx (t, hv, i)];
+
+		if (*ctr < TINYLFU_COUNTER_MAX) {
+			(*ctr) ++;
+			added = TRUE;
+		}
+	}
+
+	if (added && ++t->samples >= t->sample_limit) {
+		/* Aging: halve all counters */
+		nctr = (t->sketch_mask + 1) * TINYLFU_SKETCH_DEPTH;
+
+		for (j = 0; j < nctr; j ++) {
+			t->sketch[j] >>= 1;
+		}
+
+		t->samples /= 2;
+	}
+}
+
+static void
+rspamd_lru_tinylfu_unlink (struct rspamd_lru_tinylfu_s *t, guint32 idx)
+{
+	struct rspamd_lru_tinylfu_node *n = &t->nodes[idx];
+	struct rspamd_lru_tinylfu_list *l = &t->lists[n->segment];
+
+	if (n->prev != TINYLFU_NIL) {
+		t->nodes[n->prev].next = n->next;
+	}
+	else {
+		l->head = n->next;
+	}
+
+	if (n->next != TINYLFU_NIL) {
+		t->nodes[n->next].prev = n->prev;
+	}
+	else {
+		l->tail = n->prev;
+	}
+
+	n->prev = TINYLFU_NIL;
+	n->next = TINYLFU_NIL;
+	l->len --;
+}
+
+static void
+rspamd_lru_tinylfu_push (struct rspamd_lru_tinylfu_s *t, guint32 idx,
+		enum rspamd_lru_tinylfu_segment seg)
+{
+	struct rspamd_lru_tinylfu_node *n = &t->nodes[idx];
+	struct rspamd_lru_tinylfu_list *l = &t->lists[seg];
+
+	n->segment = seg;
+	n->prev = TINYLFU_NIL;
+	n->next = l->head;
+
+	if (l->head != TINYLFU_NIL) {
+		t->nodes[l->head].prev = idx;
+	}
+	else {
+		l->tail = idx;
+	}
+
+	l->head = idx;
+	l->len ++;
+}
+
+static void
+rspamd_lru_tinylfu_remove_node (rspamd_lru_hash_t *hash, guint32 idx)
+{
+	struct rspamd_lru_tinylfu_s *t = hash->tinylfu;
+	struct rspamd_lru_tinylfu_node *n = &t->nodes[idx];
+
+	g_hash_table_remove (t->tbl, n->key);
+	rspamd_lru_tinylfu_unlink (t, idx);
+
+	if (hash->key_destroy) {
+		hash->key_destroy (n->key);
+	}
+
+	if (hash->value_destroy) {
+		hash->value_destroy (n->data);
+	}
+
+	n->key = NULL;
+	n->data = NULL;
+	rspamd_lru_tinylfu_push (t, idx, RSPAMD_TINYLFU_FREE);
+}
+
+static inline gboolean
+rspamd_lru_tinylfu_expired (struct rspamd_lru_tinylfu_node *n, time_t now)
+{
+	return n->ttl != 0 && now - n->creation_time > (time_t)n->ttl;
+}
+
+static void
+rspamd_lru_tinylfu_touch (struct rspamd_lru_tinylfu_s *t, guint32 idx)
+{
+	struct rspamd_lru_tinylfu_node *n = &t->nodes[idx];
+	guint32 demoted;
+
+	rspamd_lru_tinylfu_unlink (t, idx);
+
+	switch (n->segment) {
+	case RSPAMD_TINYLFU_WINDOW:
+		rspamd_lru_tinylfu_push (t, idx, RSPAMD_TINYLFU_WINDOW);
+		break;
+	case RSPAMD_TINYLFU_PROBATION:
+	case RSPAMD_TINYLFU_PROTECTED:
+		rspamd_lru_tinylfu_push (t, idx, RSPAMD_TINYLFU_PROTECTED);
+
+		if (t->lists[RSPAMD_TINYLFU_PROTECTED].len > t->protected_max) {
+			demoted = t->lists[RSPAMD_TINYLFU_PROTECTED].tail;
+			rspamd_lru_tinylfu_unlink (t, demoted);
+			rspamd_lru_tinylfu_push (t, demoted, RSPAMD_TINYLFU_PROBATION);
+		}
+		break;
+	default:
+		g_assert_not_reached ();
+	}
+}
+
+/*
+ * Moves the window victim to the main space if it is more frequent than
+ * the main victim, otherwise evicts it
+ */
+static void
+rspamd_lru_tinylfu_maintain (rspamd_lru_hash_t *hash, time_t now)
+{
+	struct rspamd_lru_tinylfu_s *t = hash->tinylfu;
+	guint32 cand, victim;
+
+	while (t->lists[RSPAMD_TINYLFU_WINDOW].len > t->window_max) {
+		cand = t->lists[RSPAMD_TINYLFU_WINDOW].tail;
+		rspamd_lru_tinylfu_unlink (t, cand);
+
+		if (t->lists[RSPAMD_TINYLFU_PROBATION].len +
+				t->lists[RSPAMD_TINYLFU_PROTECTED].len < t->main_max) {
+			rspamd_lru_tinylfu_push (t, cand, RSPAMD_TINYLFU_PROBATION);
+			continue;
+		}
+
+		victim = t->lists[RSPAMD_TINYLFU_PROBATION].tail;
+
+		if (victim == TINYLFU_NIL) {
+			victim = t->lists[RSPAMD_TINYLFU_PROTECTED].tail;
+		}
+
+		rspamd_lru_tinylfu_push (t, cand, RSPAMD_TINYLFU_PROBATION);
+
+		if (!rspamd_lru_tinylfu_expired (&t->nodes[victim], now) &&
+				rspamd_lru_tinylfu_frequency (t, t->nodes[cand].hv) <=
+				rspamd_lru_tinylfu_frequency (t, t->nodes[victim].hv)) {
+			victim = cand;
+		}
+
+		rspamd_lru_tinylfu_remove_node (hash, victim);
+	}
+}
+
+static struct rspamd_lru_tinylfu_s *
+rspamd_lru_tinylfu_new (guint maxsize)
+{
+	struct rspamd_lru_tinylfu_s *t;
+	guint i, width;
+
+	t = g_malloc0 (sizeof (*t));
+	/* One extra node is used transiently on insertion */
+	t->nnodes = maxsize + 1;
+	t->nodes = g_malloc0 (sizeof (*t->nodes) * t->nnodes);
+
+	for (i = 0; i < RSPAMD_TINYLFU_MAX_SEGMENT; i ++) {
+		t->lists[i].head = TINYLFU_NIL;
+		t->lists[i].tail = TINYLFU_NIL;
+	}
+
+	for (i = 0; i < t->nnodes; i ++) {
+		t->nodes[i].prev = TINYLFU_NIL;
+		t->nodes[i].next = TINYLFU_NIL;
+		rspamd_lru_tinylfu_push (t, i, RSPAMD_TINYLFU_FREE);
+	}
+
+	t->window_max = MAX (1, maxsize * tinylfu_window_pct / 100);
+	t->main_max = maxsize - t->window_max;
+	t->protected_max = MAX (1, t->main_max * tinylfu_protected_pct / 100);
+
+	width = maxsize;
+	kroundup32 (width);
+	t->sketch_mask = width - 1;
+	t->sketch = g_malloc0 (width * TINYLFU_SKETCH_DEPTH);
+	t->sample_limit = maxsize * TINYLFU_SAMPLE_FACTOR;
+
+	return t;
+}
+
+static gpointer
+rspamd_lru_tinylfu_lookup (rspamd_lru_hash_t *hash, gconstpointer key,
+		time_t now)
+{
+	struct rspamd_lru_tinylfu_s *t = hash->tinylfu;
+	struct rspamd_lru_tinylfu_node *n;
+	guint32 hv;
+
+	n = g_hash_table_lookup (t->tbl, key);
+
+	if (n == NULL) {
+		/* Misses are also counted to estimate popularity of new keys */
+		hv = rspamd_lru_tinylfu_mix (hash->hfunc (key));
+		rspamd_lru_tinylfu_record (t, hv);
+
+		return NULL;
+	}
+
+	if (rspamd_lru_tinylfu_expired (n, now)) {
+		rspamd_lru_tinylfu_remove_node (hash, n - t->nodes);
+
+		return NULL;
+	}
+
+	rspamd_lru_tinylfu_record (t, n->hv);
+	rspamd_lru_tinylfu_touch (t, n - t->nodes);
+
+	return n->data;
+}
+
+static void
+rspamd_lru_tinylfu_insert (rspamd_lru_hash_t *hash, gpointer key,
+		gpointer value, time_t now, guint ttl)
+{
+	struct rspamd_lru_tinylfu_s *t = hash->tinylfu;
+	struct rspamd_lru_tinylfu_node *n;
+	guint32 idx;
+
+	n = g_hash_table_lookup (t->tbl, key);
+
+	if (n != NULL) {
+		/* Existing element, be careful about destructors */
+		if (hash->value_destroy) {
+			hash->value_destroy (n->data);
+		}
+
+		if (hash->key_destroy) {
+			g_hash_table_steal (t->tbl, n->key);
+			hash->key_destroy (n->key);
+			n->key = key;
+			g_hash_table_insert (t->tbl, key, n);
+		}
+
+		n->data = value;
+		n->creation_time = now;
+		n->ttl = ttl;
+		rspamd_lru_tinylfu_record (t, n->hv);
+		rspamd_lru_tinylfu_touch (t, n - t->nodes);
+
+		return;
+	}
+
+	idx = t->lists[RSPAMD_TINYLFU_FREE].head;
+	g_assert (idx != TINYLFU_NIL);
+	rspamd_lru_tinylfu_unlink (t, idx);
+	n = &t->nodes[idx];
+	n->key = key;
+	n->data = value;
+	n->creation_time = now;
+	n->ttl = ttl;
+	n->hv = rspamd_lru_tinylfu_mix (hash->hfunc (key));
+	rspamd_lru_tinylfu_record (t, n->hv);
+	rspamd_lru_tinylfu_push (t, idx, RSPAMD_TINYLFU_WINDOW);
+	g_hash_table_insert (t->tbl, key, n);
+
+	rspamd_lru_tinylfu_maintain (hash, now);
+}
+
+static void
+rspamd_lru_tinylfu_destroy (rspamd_lru_hash_t *hash)
+{
+	struct rspamd_lru_tinylfu_s *t = hash->tinylfu;
+	struct rspamd_lru_tinylfu_node *n;
+	guint i;
+
+	for (i = 0; i < t->nnodes; i ++) {
+		n = &t->nodes[i];
+
+		if (n->segment != RSPAMD_TINYLFU_FREE) {
+			if (hash->key_destroy) {
+				hash->key_destroy (n->key);
+			}
+			if (hash->value_destroy) {
+				hash->value_destroy (n->data);
+			}
+		}
+	}
+
+	g_hash_table_unref (t->tbl);
+	g_free (t->nodes);
+	g_free (t->sketch);
+	g_free (t);
+}
+
 rspamd_lru_hash_t *
 rspamd_lru_hash_new_full (gint maxsize,
 						  GDestroyNotify key_destroy,
@@ -527,6 +928,31 @@ rspamd_lru_hash_new_full (gint maxsize,
 	return h;
 }
 
+rspamd_lru_hash_t *
+rspamd_lru_hash_new_tinylfu (gint maxsize,
+		GDestroyNotify key_destroy,
+		GDestroyNotify value_destroy,
+		GHashFunc hf,
+		GEqualFunc cmpf)
+{
+	rspamd_lru_hash_t *h;
+
+	if (maxsize < 2) {
+		maxsize = 2;
+	}
+
+	h = g_malloc0 (sizeof (rspamd_lru_hash_t));
+	h->hfunc = hf;
+	h->eqfunc = cmpf;
+	h->maxsize = maxsize;
+	h->value_destroy = value_destroy;
+	h->key_destroy = key_destroy;
+	h->tinylfu = rspamd_lru_tinylfu_new (maxsize);
+	h->tinylfu->tbl = g_hash_table_new (hf, cmpf);
+
+	return h;
+}
+
 rspamd_lru_hash_t *
 rspamd_lru_hash_new (gint maxsize,
 					 GDestroyNotify key_destroy,
@@ -543,6 +969,10 @@ rspamd_lru_hash_lookup (rspamd_lru_hash_t *hash, gconstpointer key, time_t now)
 	rspamd_lru_element_t *res;
 	rspamd_lru_vol_element_t *vnode;
 
+	if (hash->tinylfu) {
+		return rspamd_lru_tinylfu_lookup (hash, key, now);
+	}
+
 	vnode = rspamd_lru_hash_get (hash, (gpointer)key);
 	if (vnode != NULL) {
 		res = &vnode->e;
@@ -573,6 +1003,19 @@ rspamd_lru_hash_remove (rspamd_lru_hash_t *hash,
 		gconstpointer key)
 {
 	rspamd_lru_vol_element_t *res;
+	struct rspamd_lru_tinylfu_node *n;
+
+	if (hash->tinylfu) {
+		n = g_hash_table_lookup (hash->tinylfu->tbl, key);
+
+		if (n != NULL) {
+			rspamd_lru_tinylfu_remove_node (hash, n - hash->tinylfu->nodes);
+
+			return TRUE;
+		}
+
+		return FALSE;
+	}
 
 	res = rspamd_lru_hash_get (hash, key);
 
@@ -596,6 +1039,12 @@ rspamd_lru_hash_insert (rspamd_lru_hash_t *hash,
 	rspamd_lru_vol_element_t *vnode;
 	gint ret;
 
+	if (hash->tinylfu) {
+		rspamd_lru_tinylfu_insert (hash, key, value, now, ttl);
+
+		return;
+	}
+
 	vnode = rspamd_lru_hash_put (hash, key, &ret);
 	node = &vnode->e;
 
@@ -646,6 +1095,13 @@ void
 rspamd_lru_hash_destroy (rspamd_lru_hash_t *hash)
 {
 	if (hash) {
+		if (hash->tinylfu) {
+			rspamd_lru_tinylfu_destroy (hash);
+			g_free (hash);
+
+			return;
+		}
+
 		if (hash->key_destroy || hash->value_destroy) {
 			gpointer k;
 			rspamd_lru_vol_element_t cur;
@@ -679,8 +1135,25 @@ rspamd_lru_hash_foreach (rspamd_lru_hash_t *h, int it, gpointer *k,
 						 gpointer *v)
 {
 	gint i;
+	struct rspamd_lru_tinylfu_node *n;
+
 	g_assert (it >= 0);
 
+	if (h->tinylfu) {
+		for (i = it; i < (gint)h->tinylfu->nnodes; i ++) {
+			n = &h->tinylfu->nodes[i];
+
+			if (n->segment != RSPAMD_TINYLFU_FREE) {
+				*k = n->key;
+				*v = n->data;
+
+				return i + 1;
+			}
+		}
+
+		return -1;
+	}
+
 	for (i = it; i != kh_end (h); ++i) {
 		if (!kh_exist (h, i)) {
 			continue;
@@ -696,13 +1169,17 @@ rspamd_lru_hash_foreach (rspamd_lru_hash_t *h, int it, gpointer *k,
 		return -1;
 	}
 
-	return i;
+	return i + 1;
 }
 
 
 guint
 rspamd_lru_hash_size (rspamd_lru_hash_t *hash)
 {
+	if (hash->tinylfu) {
+		return g_hash_table_size (hash->tinylfu->tbl);
+	}
+
 	return kh_size (hash);
 }
 
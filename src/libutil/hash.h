@@ -42,6 +42,23 @@ rspamd_lru_hash_t * rspamd_lru_hash_new_full (gint maxsize,
 											  GHashFunc hfunc,
 											  GEqualFunc eqfunc);
 
+/**
+ * Create new lru hash with W-TinyLFU admission policy: it uses a small LRU
+ * window, a segmented LRU for the main space and a frequency sketch to
+ * decide which elements are kept. It has better hit ratio on skewed and
+ * scan-like workloads and all operations are O(1), however it uses
+ * slightly more memory per element
+ * @param maxsize maximum elements in a hash
+ * @param hash_func pointer to hash function
+ * @param key_equal_func pointer to function for comparing keys
+ * @return new rspamd_hash object
+ */
+rspamd_lru_hash_t * rspamd_lru_hash_new_tinylfu (gint maxsize,
+												 GDestroyNotify key_destroy,
+												 GDestroyNotify value_destroy,
+												 GHashFunc hfunc,
+												 GEqualFunc eqfunc);
+
 /**
  * Lookup item from hash
  * @param hash hash object
@@ -85,7 +102,7 @@ void rspamd_lru_hash_destroy (rspamd_lru_hash_t *hash);
  * @param it
  * @param k
  * @param v
- * @return new it or -1 if iteration has been reached over
+ * @return next it or -1 if iteration has been reached over
  */
 int rspamd_lru_hash_foreach (rspamd_lru_hash_t *hash, int it, gpointer *k,
 		gpointer *v);
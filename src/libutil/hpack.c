@@ -0,0 +1,756 @@
+/*-
+ * Copyright 2019 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "hpack.h"
+
+/* Huffman codes from RFC 7541 appendix B, the last one is EOS */
+static const guint32 huff_codes[257] = {
+		0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+		0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+		0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+		0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+		0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+		0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+		0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+		0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+		0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+		0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+		0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+		0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+		0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+		0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+		0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+		0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+		0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+		0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+		0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+		0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+		0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+		0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+		0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+		0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+		0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+		0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+		0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+		0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+		0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+		0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+		0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+		0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+		0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+		0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+		0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+		0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+		0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+		0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+		0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+		0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+		0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+		0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+		0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee, 0x3fffffff
+};
+
+static const guint8 huff_lens[257] = {
+		13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+		28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+		6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+		5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+		13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+		7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+		15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+		6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+		20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+		24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+		22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+		21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+		26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+		19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+		20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+		26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+		30
+};
+
+static const struct rspamd_hpack_static_elt {
+	const gchar *name;
+	const gchar *value;
+} static_table[] = {
+		{":authority", ""},
+		{":method", "GET"},
+		{":method", "POST"},
+		{":path", "/"},
+		{":path", "/index.html"},
+		{":scheme", "http"},
+		{":scheme", "https"},
+		{":status", "200"},
+		{":status", "204"},
+		{":status", "206"},
+		{":status", "304"},
+		{":status", "400"},
+		{":status", "404"},
+		{":status", "500"},
+		{"accept-charset", ""},
+		{"accept-encoding", "gzip, deflate"},
+		{"accept-language", ""},
+		{"accept-ranges", ""},
+		{"accept", ""},
+		{"access-control-allow-origin", ""},
+		{"age", ""},
+		{"allow", ""},
+		{"authorization", ""},
+		{"cache-control", ""},
+		{"content-disposition", ""},
+		{"content-encoding", ""},
+		{"content-language", ""},
+		{"content-length", ""},
+		{"content-location", ""},
+		{"content-range", ""},
+		{"content-type", ""},
+		{"cookie", ""},
+		{"date", ""},
+		{"etag", ""},
+		{"expect", ""},
+		{"expires", ""},
+		{"from", ""},
+		{"host", ""},
+		{"if-match", ""},
+		{"if-modified-since", ""},
+		{"if-none-match", ""},
+		{"if-range", ""},
+		{"if-unmodified-since", ""},
+		{"last-modified", ""},
+		{"link", ""},
+		{"location", ""},
+		{"max-forwards", ""},
+		{"proxy-authenticate", ""},
+		{"proxy-authorization", ""},
+		{"range", ""},
+		{"referer", ""},
+		{"refresh", ""},
+		{"retry-after", ""},
+		{"server", ""},
+		{"set-cookie", ""},
+		{"strict-transport-security", ""},
+		{"transfer-encoding", ""},
+		{"user-agent", ""},
+		{"vary", ""},
+		{"via", ""},
+		{"www-authenticate", ""}
+};
+
+#define HUFF_EOS 256
+#define HUFF_MAX_BITS 30
+/* Overhead of the dynamic table entry as defined by RFC */
+#define HPACK_ENTRY_OVERHEAD 32
+/* Protect from the insane lengths */
+#define HPACK_MAX_INT G_MAXUINT32
+
+struct rspamd_hpack_entry {
+	gsize nlen;
+	gsize vlen;
+	gchar data[]; /* name followed by value */
+};
+
+struct rspamd_hpack_table {
+	struct rspamd_hpack_entry **entries; /* ring buffer, from the oldest */
+	guint cap;
+	guint first;
+	guint nelts;
+	gsize size;
+	gsize max_size;
+	gsize settings_size;
+	gboolean size_update;
+};
+
+/* Canonical huffman decoding tables */
+static guint32 huff_first_code[HUFF_MAX_BITS + 1];
+static guint16 huff_first_idx[HUFF_MAX_BITS + 1];
+static guint16 huff_count[HUFF_MAX_BITS + 1];
+static guint16 huff_sorted[257];
+static gboolean huff_initialized = FALSE;
+
+static GQuark
+rspamd_hpack_quark (void)
+{
+	return g_quark_from_static_string ("hpack");
+}
+
+static void
+rspamd_hpack_huff_init (void)
+{
+	guint i, len, idx = 0;
+	guint32 code = 0;
+
+	memset (huff_count, 0, sizeof (huff_count));
+
+	for (i = 0; i < G_N_ELEMENTS (huff_lens); i ++) {
+		huff_count[huff_lens[i]] ++;
+	}
+
+	/* Codes are canonical, so symbols of the same length are consecutive */
+	for (len = 1; len <= HUFF_MAX_BITS; len ++) {
+		code <<= 1;
+		huff_first_code[len] = code;
+		huff_first_idx[len] = idx;
+
+		for (i = 0; i < G_N_ELEMENTS (huff_lens); i ++) {
+			if (huff_lens[i] == len) {
+				huff_sorted[idx ++] = i;
+			}
+		}
+
+		code += huff_count[len];
+	}
+
+	huff_initialized = TRUE;
+}
+
+static gboolean
+rspamd_hpack_huff_decode (const guchar *in, gsize len, rspamd_fstring_t **out)
+{
+	guint32 code = 0;
+	guint bits = 0, i, j, sym;
+	guchar c;
+
+	if (!huff_initialized) {
+		rspamd_hpack_huff_init ();
+	}
+
+	for (i = 0; i < len; i ++) {
+		for (j = 0; j < 8; j ++) {
+			code = (code << 1) | ((in[i] >> (7 - j)) & 1);
+			bits ++;
+
+			if (bits > HUFF_MAX_BITS) {
+				return FALSE;
+			}
+
+			if (code - huff_first_code[bits] < huff_count[bits]) {
+				sym = huff_sorted[huff_first_idx[bits] +
+						code - huff_first_code[bits]];
+
+				if (sym == HUFF_EOS) {
+					return FALSE;
+				}
+
+				c = sym;
+				*out = rspamd_fstring_append (*out, (const gchar *)&c, 1);
+				code = 0;
+				bits = 0;
+			}
+		}
+	}
+
+	/* Padding must be the most significant bits of EOS */
+	if (bits > 7 || code != (1u << bits) - 1) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gsize
+rspamd_hpack_huff_len (const guchar *in, gsize len)
+{
+	gsize bits = 0, i;
+
+	for (i = 0; i < len; i ++) {
+		bits += huff_lens[in[i]];
+	}
+
+	return (bits + 7) / 8;
+}
+
+static void
+rspamd_hpack_huff_encode (const guchar *in, gsize len, rspamd_fstring_t **out)
+{
+	guint64 acc = 0;
+	guint bits = 0;
+	gsize i;
+	guchar c;
+
+	for (i = 0; i < len; i ++) {
+		acc = (acc << huff_lens[in[i]]) | huff_codes[in[i]];
+		bits += huff_lens[in[i]];
+
+		while (bits >= 8) {
+			bits -= 8;
+			c = (acc >> bits) & 0xff;
+			*out = rspamd_fstring_append (*out, (const gchar *)&c, 1);
+		}
+	}
+
+	if (bits > 0) {
+		/* Pad with EOS prefix */
+		c = ((acc << (8 - bits)) | (0xff >> bits)) & 0xff;
+		*out = rspamd_fstring_append (*out, (const gchar *)&c, 1);
+	}
+}
+
+static void
+rspamd_hpack_encode_int (rspamd_fstring_t **out, guchar first,
+		guint prefix_bits, guint64 val)
+{
+	guint64 max_prefix = (1u << prefix_bits) - 1;
+	guchar c;
+
+	if (val < max_prefix) {
+		c = first | val;
+		*out = rspamd_fstring_append (*out, (const gchar *)&c, 1);
+
+		return;
+	}
+
+	c = first | max_prefix;
+	*out = rspamd_fstring_append (*out, (const gchar *)&c, 1);
+	val -= max_prefix;
+
+	while (val >= 0x80) {
+		c = (val & 0x7f) | 0x80;
+		*out = rspamd_fstring_append (*out, (const gchar *)&c, 1);
+		val >>= 7;
+	}
+
+	c = val;
+	*out = rspamd_fstring_append (*out, (const gchar *)&c, 1);
+}
+
+static gboolean
+rspamd_hpack_decode_int (const guchar **p, const guchar *end,
+		guint prefix_bits, guint64 *res)
+{
+	guint64 max_prefix = (1u << prefix_bits) - 1, val;
+	guint shift = 0;
+	const guchar *c = *p;
+
+	if (c >= end) {
+		return FALSE;
+	}
+
+	val = *c & max_prefix;
+	c ++;
+
+	if (val == max_prefix) {
+		for (;;) {
+			if (c >= end || shift > 28) {
+				return FALSE;
+			}
+
+			val += (guint64)(*c & 0x7f) << shift;
+			shift += 7;
+
+			if (!(*c++ & 0x80)) {
+				break;
+			}
+		}
+
+		if (val > HPACK_MAX_INT) {
+			return FALSE;
+		}
+	}
+
+	*p = c;
+	*res = val;
+
+	return TRUE;
+}
+
+static void
+rspamd_hpack_encode_str (rspamd_fstring_t **out, const rspamd_ftok_t *str)
+{
+	gsize hlen;
+
+	hlen = rspamd_hpack_huff_len ((const guchar *)str->begin, str->len);
+
+	if (hlen < str->len) {
+		rspamd_hpack_encode_int (out, 0x80, 7, hlen);
+		rspamd_hpack_huff_encode ((const guchar *)str->begin, str->len, out);
+	}
+	else {
+		rspamd_hpack_encode_int (out, 0, 7, str->len);
+		*out = rspamd_fstring_append (*out, str->begin, str->len);
+	}
+}
+
+/*
+ * Decodes string to `buf` and sets `res` to the decoded data
+ */
+static gboolean
+rspamd_hpack_decode_str (const guchar **p, const guchar *end,
+		rspamd_fstring_t **buf, rspamd_ftok_t *res)
+{
+	guint64 len;
+	gboolean huffman;
+
+	if (*p >= end) {
+		return FALSE;
+	}
+
+	huffman = (**p & 0x80) != 0;
+
+	if (!rspamd_hpack_decode_int (p, end, 7, &len) || len > (gsize)(end - *p)) {
+		return FALSE;
+	}
+
+	(*buf)->len = 0;
+
+	if (huffman) {
+		if (!rspamd_hpack_huff_decode (*p, len, buf)) {
+			return FALSE;
+		}
+	}
+	else {
+		*buf = rspamd_fstring_append (*buf, (const gchar *)*p, len);
+	}
+
+	*p += len;
+	res->begin = (*buf)->str;
+	res->len = (*buf)->len;
+
+	return TRUE;
+}
+
+struct rspamd_hpack_table *
+rspamd_hpack_table_new (gsize max_size)
+{
+	struct rspamd_hpack_table *t;
+
+	t = g_malloc0 (sizeof (*t));
+	t->cap = 16;
+	t->entries = g_malloc0 (sizeof (*t->entries) * t->cap);
+	t->max_size = max_size;
+	t->settings_size = max_size;
+
+	return t;
+}
+
+static void
+rspamd_hpack_table_evict (struct rspamd_hpack_table *t, gsize need)
+{
+	struct rspamd_hpack_entry *e;
+
+	while (t->nelts > 0 && t->size + need > t->max_size) {
+		e = t->entries[t->first];
+		t->size -= e->nlen + e->vlen + HPACK_ENTRY_OVERHEAD;
+		g_free (e);
+		t->entries[t->first] = NULL;
+		t->first = (t->first + 1) & (t->cap - 1);
+		t->nelts --;
+	}
+}
+
+static struct rspamd_hpack_entry *
+rspamd_hpack_table_add (struct rspamd_hpack_table *t,
+		const rspamd_ftok_t *name, const rspamd_ftok_t *value)
+{
+	struct rspamd_hpack_entry *e, **nentries;
+	gsize esize = name->len + value->len + HPACK_ENTRY_OVERHEAD;
+	guint i;
+
+	/* Copy before eviction as name might point to an evicted entry */
+	e = g_malloc (sizeof (*e) + name->len + value->len);
+	e->nlen = name->len;
+	e->vlen = value->len;
+	memcpy (e->data, name->begin, name->len);
+	memcpy (e->data + name->len, value->begin, value->len);
+
+	if (esize > t->max_size) {
+		/* Not an error, but the table is cleared */
+		rspamd_hpack_table_evict (t, t->max_size + 1);
+		g_free (e);
+
+		return NULL;
+	}
+
+	rspamd_hpack_table_evict (t, esize);
+
+	if (t->nelts == t->cap) {
+		nentries = g_malloc0 (sizeof (*nentries) * t->cap * 2);
+
+		for (i = 0; i < t->nelts; i ++) {
+			nentries[i] = t->entries[(t->first + i) & (t->cap - 1)];
+		}
+
+		g_free (t->entries);
+		t->entries = nentries;
+		t->first = 0;
+		t->cap *= 2;
+	}
+
+	t->entries[(t->first + t->nelts) & (t->cap - 1)] = e;
+	t->nelts ++;
+	t->size += esize;
+
+	return e;
+}
+
+/* Index 1 is the newest entry */
+static struct rspamd_hpack_entry *
+rspamd_hpack_table_get (struct rspamd_hpack_table *t, guint idx)
+{
+	if (idx == 0 || idx > t->nelts) {
+		return NULL;
+	}
+
+	return t->entries[(t->first + t->nelts - idx) & (t->cap - 1)];
+}
+
+void
+rspamd_hpack_table_set_max_size (struct rspamd_hpack_table *t,
+		gsize max_size)
+{
+	if (max_size != t->max_size) {
+		t->max_size = max_size;
+		t->settings_size = max_size;
+		t->size_update = TRUE;
+		rspamd_hpack_table_evict (t, 0);
+	}
+}
+
+void
+rspamd_hpack_table_free (struct rspamd_hpack_table *t)
+{
+	guint i;
+
+	if (t) {
+		for (i = 0; i < t->nelts; i ++) {
+			g_free (t->entries[(t->first + i) & (t->cap - 1)]);
+		}
+
+		g_free (t->entries);
+		g_free (t);
+	}
+}
+
+static gboolean
+rspamd_hpack_lookup (struct rspamd_hpack_table *t, guint64 idx,
+		rspamd_ftok_t *name, rspamd_ftok_t *value)
+{
+	struct rspamd_hpack_entry *e;
+
+	if (idx == 0) {
+		return FALSE;
+	}
+
+	if (idx <= G_N_ELEMENTS (static_table)) {
+		name->begin = static_table[idx - 1].name;
+		name->len = strlen (name->begin);
+		value->begin = static_table[idx - 1].value;
+		value->len = strlen (value->begin);
+
+		return TRUE;
+	}
+
+	e = rspamd_hpack_table_get (t, idx - G_N_ELEMENTS (static_table));
+
+	if (e == NULL) {
+		return FALSE;
+	}
+
+	name->begin = e->data;
+	name->len = e->nlen;
+	value->begin = e->data + e->nlen;
+	value->len = e->vlen;
+
+	return TRUE;
+}
+
+gboolean
+rspamd_hpack_decode (struct rspamd_hpack_table *t,
+		const guchar *in, gsize len,
+		rspamd_hpack_header_cb cb, gpointer ud,
+		GError **err)
+{
+	const guchar *p = in, *end = in + len;
+	rspamd_fstring_t *nbuf, *vbuf;
+	rspamd_ftok_t name, value, unused;
+	struct rspamd_hpack_entry *e;
+	guint64 idx;
+	gboolean ret = FALSE, indexed, headers_seen = FALSE;
+
+	nbuf = rspamd_fstring_sized_new (64);
+	vbuf = rspamd_fstring_sized_new (128);
+
+	while (p < end) {
+		if (*p & 0x80) {
+			/* Indexed header field */
+			if (!rspamd_hpack_decode_int (&p, end, 7, &idx) ||
+					!rspamd_hpack_lookup (t, idx, &name, &value)) {
+				g_set_error (err, rspamd_hpack_quark (), 400,
+						"invalid header index");
+				goto end;
+			}
+		}
+		else if ((*p & 0xe0) == 0x20) {
+			/* Dynamic table size update */
+			if (headers_seen ||
+					!rspamd_hpack_decode_int (&p, end, 5, &idx) ||
+					idx > t->settings_size) {
+				g_set_error (err, rspamd_hpack_quark (), 400,
+						"invalid table size update");
+				goto end;
+			}
+
+			t->max_size = idx;
+			rspamd_hpack_table_evict (t, 0);
+
+			continue;
+		}
+		else {
+			/* Literal header field */
+			indexed = (*p & 0x40) != 0;
+
+			if (!rspamd_hpack_decode_int (&p, end, indexed ? 6 : 4, &idx)) {
+				g_set_error (err, rspamd_hpack_quark (), 400,
+						"invalid header index");
+				goto end;
+			}
+
+			if (idx > 0) {
+				if (!rspamd_hpack_lookup (t, idx, &name, &unused)) {
+					g_set_error (err, rspamd_hpack_quark (), 400,
+							"invalid header index");
+					goto end;
+				}
+			}
+			else if (!rspamd_hpack_decode_str (&p, end, &nbuf, &name)) {
+				g_set_error (err, rspamd_hpack_quark (), 400,
+						"invalid header name");
+				goto end;
+			}
+
+			if (!rspamd_hpack_decode_str (&p, end, &vbuf, &value)) {
+				g_set_error (err, rspamd_hpack_quark (), 400,
+						"invalid header value");
+				goto end;
+			}
+
+			if (indexed) {
+				if (idx > G_N_ELEMENTS (static_table)) {
+					/* Name entry might be evicted when the new one is added */
+					nbuf = rspamd_fstring_assign (nbuf, name.begin, name.len);
+					name.begin = nbuf->str;
+				}
+
+				e = rspamd_hpack_table_add (t, &name, &value);
+
+				if (e) {
+					name.begin = e->data;
+					value.begin = e->data + e->nlen;
+				}
+			}
+		}
+
+		headers_seen = TRUE;
+
+		if (!cb (&name, &value, ud)) {
+			g_set_error (err, rspamd_hpack_quark (), 400,
+					"header has been rejected");
+			goto end;
+		}
+	}
+
+	ret = TRUE;
+
+end:
+	rspamd_fstring_free (nbuf);
+	rspamd_fstring_free (vbuf);
+
+	return ret;
+}
+
+void
+rspamd_hpack_encode_start (struct rspamd_hpack_table *t,
+		rspamd_fstring_t **out)
+{
+	if (t->size_update) {
+		rspamd_hpack_encode_int (out, 0x20, 5, t->max_size);
+		t->size_update = FALSE;
+	}
+}
+
+void
+rspamd_hpack_encode (struct rspamd_hpack_table *t,
+		rspamd_fstring_t **out,
+		const rspamd_ftok_t *name,
+		const rspamd_ftok_t *value,
+		gboolean indexed)
+{
+	guint i, name_idx = 0;
+	struct rspamd_hpack_entry *e;
+	const gchar *sname;
+
+	for (i = 0; i < G_N_ELEMENTS (static_table); i ++) {
+		sname = static_table[i].name;
+
+		if (strlen (sname) == name->len &&
+				memcmp (sname, name->begin, name->len) == 0) {
+			if (strlen (static_table[i].value) == value->len &&
+					memcmp (static_table[i].value, value->begin, value->len) == 0) {
+				rspamd_hpack_encode_int (out, 0x80, 7, i + 1);
+
+				return;
+			}
+
+			if (name_idx == 0) {
+				name_idx = i + 1;
+			}
+		}
+	}
+
+	if (indexed) {
+		for (i = 1; i <= t->nelts; i ++) {
+			e = rspamd_hpack_table_get (t, i);
+
+			if (e->nlen == name->len &&
+					memcmp (e->data, name->begin, name->len) == 0) {
+				if (e->vlen == value->len &&
+						memcmp (e->data + e->nlen, value->begin, value->len) == 0) {
+					rspamd_hpack_encode_int (out, 0x80, 7,
+							i + G_N_ELEMENTS (static_table));
+
+					return;
+				}
+
+				if (name_idx == 0) {
+					name_idx = i + G_N_ELEMENTS (static_table);
+				}
+			}
+		}
+
+		if (name->len + value->len + HPACK_ENTRY_OVERHEAD > t->max_size) {
+			indexed = FALSE;
+		}
+	}
+
+	if (indexed) {
+		/* Literal with incremental indexing */
+		rspamd_hpack_encode_int (out, 0x40, 6, name_idx);
+	}
+	else {
+		/* Literal without indexing */
+		rspamd_hpack_encode_int (out, 0, 4, name_idx);
+	}
+
+	if (name_idx == 0) {
+		rspamd_hpack_encode_str (out, name);
+	}
+
+	rspamd_hpack_encode_str (out, value);
+
+	if (indexed) {
+		rspamd_hpack_table_add (t, name, value);
+	}
+}
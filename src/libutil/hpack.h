@@ -0,0 +1,101 @@
+/*-
+ * Copyright 2019 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_HPACK_H
+#define RSPAMD_HPACK_H
+
+#include "config.h"
+#include "fstring.h"
+
+/*
+ * HPACK header compression for HTTP/2 (RFC 7541)
+ */
+
+/* Default size of the dynamic table */
+#define RSPAMD_HPACK_DEFAULT_TABLE_SIZE 4096
+
+/*
+ * Dynamic table, each direction of HTTP/2 connection has its own table
+ */
+struct rspamd_hpack_table;
+
+/**
+ * Called for each decoded header, name and value are valid within a callback
+ * only
+ * @return FALSE to stop decoding
+ */
+typedef gboolean (*rspamd_hpack_header_cb) (const rspamd_ftok_t *name,
+		const rspamd_ftok_t *value, gpointer ud);
+
+/**
+ * Creates new dynamic table
+ * @param max_size maximum size allowed by settings
+ * @return
+ */
+struct rspamd_hpack_table *rspamd_hpack_table_new (gsize max_size);
+
+/**
+ * Changes maximum size of the table, for encoder it also schedules size
+ * update that is emitted at the beginning of the next header block
+ * @param t
+ * @param max_size
+ */
+void rspamd_hpack_table_set_max_size (struct rspamd_hpack_table *t,
+		gsize max_size);
+
+/**
+ * Destroys dynamic table
+ * @param t
+ */
+void rspamd_hpack_table_free (struct rspamd_hpack_table *t);
+
+/**
+ * Decodes header block calling `cb` for each header
+ * @param t decoder dynamic table
+ * @param in
+ * @param len
+ * @param cb
+ * @param ud
+ * @param err
+ * @return TRUE if the whole block has been decoded
+ */
+gboolean rspamd_hpack_decode (struct rspamd_hpack_table *t,
+		const guchar *in, gsize len,
+		rspamd_hpack_header_cb cb, gpointer ud,
+		GError **err);
+
+/**
+ * Starts new header block, must be called before encoding of the first header
+ * @param t encoder dynamic table
+ * @param out
+ */
+void rspamd_hpack_encode_start (struct rspamd_hpack_table *t,
+		rspamd_fstring_t **out);
+
+/**
+ * Appends header to the header block, name must be in lowercase
+ * @param t encoder dynamic table
+ * @param out
+ * @param name
+ * @param value
+ * @param indexed if FALSE then header is never added to the dynamic table
+ */
+void rspamd_hpack_encode (struct rspamd_hpack_table *t,
+		rspamd_fstring_t **out,
+		const rspamd_ftok_t *name,
+		const rspamd_ftok_t *value,
+		gboolean indexed);
+
+#endif
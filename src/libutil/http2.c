@@ -0,0 +1,2259 @@
+/*-
+ * Copyright 2019 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "http2.h"
+#include "http_private.h"
+#include "hpack.h"
+#include "libev_helper.h"
+#include "logger.h"
+#include "printf.h"
+#include "util.h"
+#include "contrib/http-parser/http_parser.h"
+#include "unix-std.h"
+
+/*
+ * Streams are mapped to HTTP/1.1 connections: incoming requests (or replies)
+ * are converted to HTTP/1.1 messages that are read by a connection, and
+ * messages written by a connection are parsed and sent as HEADERS and DATA
+ * frames.
+ */
+
+INIT_LOG_MODULE(http2)
+
+#define msg_debug_http2(...)  rspamd_conditional_debug_fast (NULL, NULL, \
+        rspamd_http2_log_id, "http2", NULL, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+
+#define RSPAMD_HTTP2_FRAME_HDR_LEN 9
+/* We never change the default maximum frame size for incoming frames */
+#define RSPAMD_HTTP2_MAX_FRAME_SIZE 16384
+#define RSPAMD_HTTP2_DEFAULT_WINDOW 65535
+/*
+ * Bodies are delivered when a stream is complete, so stream windows are
+ * returned on receipt. Connection window is returned only when connections
+ * consume the data, so it limits the memory buffered by a session
+ */
+#define RSPAMD_HTTP2_STREAM_WINDOW (1024 * 1024)
+#define RSPAMD_HTTP2_SESSION_WINDOW (1u << 24u)
+/* Minimum connection window update */
+#define RSPAMD_HTTP2_WINDOW_UPDATE_MIN (64 * 1024)
+#define RSPAMD_HTTP2_MAX_WINDOW 0x7fffffff
+/* Stop producing frames when so many bytes are waiting to be written */
+#define RSPAMD_HTTP2_OUT_HIGHWATER (256 * 1024)
+/* Peer that sends control frames and does not read replies is dropped */
+#define RSPAMD_HTTP2_OUT_MAX (1024 * 1024)
+/* Rapid reset protection: streams reset by peer per interval */
+#define RSPAMD_HTTP2_MAX_RESETS 100
+#define RSPAMD_HTTP2_RESET_INTERVAL 1.0
+#define RSPAMD_HTTP2_MAX_HEADERS_SIZE (64 * 1024)
+#define RSPAMD_HTTP2_MAX_STREAM_ID 0x7fffff00
+
+enum rspamd_http2_frame_type {
+	RSPAMD_HTTP2_DATA = 0,
+	RSPAMD_HTTP2_HEADERS = 1,
+	RSPAMD_HTTP2_PRIORITY = 2,
+	RSPAMD_HTTP2_RST_STREAM = 3,
+	RSPAMD_HTTP2_SETTINGS = 4,
+	RSPAMD_HTTP2_PUSH_PROMISE = 5,
+	RSPAMD_HTTP2_PING = 6,
+	RSPAMD_HTTP2_GOAWAY = 7,
+	RSPAMD_HTTP2_WINDOW_UPDATE = 8,
+	RSPAMD_HTTP2_CONTINUATION = 9,
+};
+
+#define RSPAMD_HTTP2_FLAG_END_STREAM 0x1
+#define RSPAMD_HTTP2_FLAG_ACK 0x1
+#define RSPAMD_HTTP2_FLAG_END_HEADERS 0x4
+#define RSPAMD_HTTP2_FLAG_PADDED 0x8
+#define RSPAMD_HTTP2_FLAG_PRIORITY 0x20
+
+enum rspamd_http2_error_code {
+	RSPAMD_HTTP2_NO_ERROR = 0,
+	RSPAMD_HTTP2_PROTOCOL_ERROR = 1,
+	RSPAMD_HTTP2_INTERNAL_ERROR = 2,
+	RSPAMD_HTTP2_FLOW_CONTROL_ERROR = 3,
+	RSPAMD_HTTP2_STREAM_CLOSED = 5,
+	RSPAMD_HTTP2_FRAME_SIZE_ERROR = 6,
+	RSPAMD_HTTP2_REFUSED_STREAM = 7,
+	RSPAMD_HTTP2_CANCEL = 8,
+	RSPAMD_HTTP2_COMPRESSION_ERROR = 9,
+	RSPAMD_HTTP2_ENHANCE_YOUR_CALM = 11,
+};
+
+enum rspamd_http2_settings_id {
+	RSPAMD_HTTP2_SETTINGS_HEADER_TABLE_SIZE = 1,
+	RSPAMD_HTTP2_SETTINGS_ENABLE_PUSH = 2,
+	RSPAMD_HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS = 3,
+	RSPAMD_HTTP2_SETTINGS_INITIAL_WINDOW_SIZE = 4,
+	RSPAMD_HTTP2_SETTINGS_MAX_FRAME_SIZE = 5,
+};
+
+enum rspamd_http2_session_flags {
+	RSPAMD_HTTP2_SESSION_SERVER = 1u << 0u,
+	RSPAMD_HTTP2_SESSION_PREFACE = 1u << 1u,
+	RSPAMD_HTTP2_SESSION_GOAWAY_SENT = 1u << 2u,
+	RSPAMD_HTTP2_SESSION_GOAWAY_RECEIVED = 1u << 3u,
+	RSPAMD_HTTP2_SESSION_DEAD = 1u << 4u,
+};
+
+enum rspamd_http2_stream_flags {
+	RSPAMD_HTTP2_STREAM_HEADERS_RECEIVED = 1u << 0u,
+	RSPAMD_HTTP2_STREAM_REMOTE_CLOSED = 1u << 1u,
+	RSPAMD_HTTP2_STREAM_LOCAL_CLOSED = 1u << 2u,
+	RSPAMD_HTTP2_STREAM_RESET = 1u << 3u,
+	RSPAMD_HTTP2_STREAM_HEADERS_READY = 1u << 4u,
+	RSPAMD_HTTP2_STREAM_HEADERS_SENT = 1u << 5u,
+	RSPAMD_HTTP2_STREAM_MESSAGE_DONE = 1u << 6u,
+	RSPAMD_HTTP2_STREAM_QUEUED = 1u << 7u,
+	RSPAMD_HTTP2_STREAM_DETACHED = 1u << 8u,
+	RSPAMD_HTTP2_STREAM_HDR_VALUE = 1u << 9u,
+	RSPAMD_HTTP2_STREAM_HAS_HOST = 1u << 10u,
+	RSPAMD_HTTP2_STREAM_MALFORMED = 1u << 11u,
+};
+
+#define IS_SERVER(s) ((s)->flags & RSPAMD_HTTP2_SESSION_SERVER)
+#define IS_DEAD(s) ((s)->flags & RSPAMD_HTTP2_SESSION_DEAD)
+
+struct rspamd_http2_session {
+	struct rspamd_http_context *ctx;
+	gint fd;
+	enum rspamd_http2_session_flags flags;
+	struct rspamd_io_ev ev;
+	ev_tstamp timeout;
+	rspamd_fstring_t *in;
+	rspamd_fstring_t *out;
+	gsize out_pos;
+	struct rspamd_hpack_table *dec;
+	struct rspamd_hpack_table *enc;
+	/* Stream id -> stream */
+	GHashTable *streams;
+	/* Streams that have something to send */
+	GQueue pending;
+	/* Header block split to CONTINUATION frames */
+	rspamd_fstring_t *hblock;
+	guint32 cont_id;
+	guint8 cont_flags;
+	/* Last stream initiated by peer (server) or next stream id (client) */
+	guint32 last_stream_id;
+	guint32 next_stream_id;
+	guint nactive;
+	gint64 send_window;
+	gint64 peer_initial_window;
+	/* Connection window granted to peer and data consumed since update */
+	gint64 recv_window;
+	gsize recv_limit;
+	gsize recv_unacked;
+	guint nresets;
+	ev_tstamp resets_start;
+	guint32 peer_max_frame;
+	guint32 peer_max_streams;
+	guint max_streams;
+	/* Server handlers */
+	rspamd_http_body_handler_t body_handler;
+	rspamd_http_error_handler_t error_handler;
+	rspamd_http_finish_handler_t finish_handler;
+	unsigned opts;
+	gsize max_size;
+	struct rspamd_cryptobox_keypair *key;
+	rspamd_http2_stream_handler_t stream_handler;
+	rspamd_http2_session_fin_t fin_handler;
+	gpointer ud;
+	/* Client session key */
+	rspamd_inet_addr_t *addr;
+	gchar *host;
+	ref_entry_t ref;
+};
+
+struct rspamd_http2_stream {
+	struct rspamd_http2_session *session;
+	struct rspamd_http_connection *conn;
+	guint32 id;
+	enum rspamd_http2_stream_flags flags;
+	gint64 send_window;
+	gint64 recv_window;
+	/* Incoming message */
+	rspamd_fstring_t *in_method;
+	rspamd_fstring_t *in_path;
+	rspamd_fstring_t *in_authority;
+	gint in_status;
+	rspamd_fstring_t *in_head;
+	rspamd_fstring_t *in_body;
+	gsize in_pos;
+	/* Part of the body that is not returned to the connection window */
+	gsize in_buffered;
+	/* Outgoing message */
+	struct http_parser parser;
+	rspamd_fstring_t *out_url;
+	/* Names and values of outgoing headers */
+	GPtrArray *out_hdrs;
+	rspamd_fstring_t *out_body;
+	gsize out_body_pos;
+};
+
+struct rspamd_http2_detect_cbdata {
+	struct rspamd_http_context *ctx;
+	struct rspamd_io_ev ev;
+	ev_timer retry;
+	rspamd_http2_detect_handler_t handler;
+	gpointer ud;
+	gint fd;
+};
+
+static void rspamd_http2_session_write_pending (
+		struct rspamd_http2_session *session);
+static void rspamd_http2_session_terminate (
+		struct rspamd_http2_session *session);
+static void rspamd_http2_stream_free (struct rspamd_http2_stream *st);
+
+static const gchar *connection_headers[] = {
+		"connection",
+		"keep-alive",
+		"proxy-connection",
+		"transfer-encoding",
+		"upgrade",
+		"te",
+		"content-length",
+};
+
+static gboolean
+rspamd_http2_is_connection_header (const gchar *name, gsize len)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (connection_headers); i ++) {
+		if (len == strlen (connection_headers[i]) &&
+				rspamd_lc_cmp (name, connection_headers[i], len) == 0) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static inline gboolean
+rspamd_http2_tok_equal (const rspamd_ftok_t *tok, const gchar *s)
+{
+	gsize len = strlen (s);
+
+	return tok->len == len && memcmp (tok->begin, s, len) == 0;
+}
+
+/* Values are pasted to HTTP/1.1 messages, so line breaks are not allowed */
+static gboolean
+rspamd_http2_token_valid (const rspamd_ftok_t *tok, gboolean is_name)
+{
+	gsize i;
+	guchar c;
+
+	if (is_name && tok->len == 0) {
+		return FALSE;
+	}
+
+	for (i = 0; i < tok->len; i ++) {
+		c = tok->begin[i];
+
+		if (c == '\r' || c == '\n' || c == '\0') {
+			return FALSE;
+		}
+
+		if (is_name && (c == ':' || c == ' ' || g_ascii_isupper (c))) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static inline guint32
+rspamd_http2_read_u32 (const guchar *p)
+{
+	return ((guint32)p[0] << 24u) | ((guint32)p[1] << 16u) |
+			((guint32)p[2] << 8u) | (guint32)p[3];
+}
+
+static void
+rspamd_http2_frame_header (struct rspamd_http2_session *session,
+		gsize len, guint8 type, guint8 flags, guint32 id)
+{
+	guchar hdr[RSPAMD_HTTP2_FRAME_HDR_LEN];
+
+	hdr[0] = (len >> 16u) & 0xffu;
+	hdr[1] = (len >> 8u) & 0xffu;
+	hdr[2] = len & 0xffu;
+	hdr[3] = type;
+	hdr[4] = flags;
+	hdr[5] = (id >> 24u) & 0x7fu;
+	hdr[6] = (id >> 16u) & 0xffu;
+	hdr[7] = (id >> 8u) & 0xffu;
+	hdr[8] = id & 0xffu;
+
+	session->out = rspamd_fstring_append (session->out, hdr, sizeof (hdr));
+}
+
+static void
+rspamd_http2_frame_u32 (struct rspamd_http2_session *session,
+		guint8 type, guint32 id, guint32 val)
+{
+	guchar payload[4];
+
+	payload[0] = (val >> 24u) & 0xffu;
+	payload[1] = (val >> 16u) & 0xffu;
+	payload[2] = (val >> 8u) & 0xffu;
+	payload[3] = val & 0xffu;
+
+	rspamd_http2_frame_header (session, sizeof (payload), type, 0, id);
+	session->out = rspamd_fstring_append (session->out, payload,
+			sizeof (payload));
+}
+
+static void
+rspamd_http2_send_settings (struct rspamd_http2_session *session)
+{
+	guchar payload[18], *p = payload;
+	guint32 vals[3][2];
+	guint i, nvals = 0;
+
+	if (IS_SERVER (session)) {
+		vals[nvals][0] = RSPAMD_HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS;
+		vals[nvals++][1] = session->max_streams;
+	}
+	else {
+		vals[nvals][0] = RSPAMD_HTTP2_SETTINGS_ENABLE_PUSH;
+		vals[nvals++][1] = 0;
+	}
+
+	vals[nvals][0] = RSPAMD_HTTP2_SETTINGS_INITIAL_WINDOW_SIZE;
+	vals[nvals++][1] = RSPAMD_HTTP2_STREAM_WINDOW;
+
+	for (i = 0; i < nvals; i ++) {
+		*p++ = (vals[i][0] >> 8u) & 0xffu;
+		*p++ = vals[i][0] & 0xffu;
+		*p++ = (vals[i][1] >> 24u) & 0xffu;
+		*p++ = (vals[i][1] >> 16u) & 0xffu;
+		*p++ = (vals[i][1] >> 8u) & 0xffu;
+		*p++ = vals[i][1] & 0xffu;
+	}
+
+	rspamd_http2_frame_header (session, p - payload, RSPAMD_HTTP2_SETTINGS,
+			0, 0);
+	session->out = rspamd_fstring_append (session->out, payload, p - payload);
+	/* Connection window is not affected by settings */
+	rspamd_http2_frame_u32 (session, RSPAMD_HTTP2_WINDOW_UPDATE, 0,
+			session->recv_limit - RSPAMD_HTTP2_DEFAULT_WINDOW);
+	session->recv_window = session->recv_limit;
+}
+
+static void
+rspamd_http2_send_goaway (struct rspamd_http2_session *session,
+		enum rspamd_http2_error_code code)
+{
+	guchar payload[8];
+	guint32 last_id = IS_SERVER (session) ? session->last_stream_id : 0;
+
+	if (session->flags & RSPAMD_HTTP2_SESSION_GOAWAY_SENT) {
+		return;
+	}
+
+	payload[0] = (last_id >> 24u) & 0x7fu;
+	payload[1] = (last_id >> 16u) & 0xffu;
+	payload[2] = (last_id >> 8u) & 0xffu;
+	payload[3] = last_id & 0xffu;
+	payload[4] = 0;
+	payload[5] = 0;
+	payload[6] = 0;
+	payload[7] = code;
+
+	rspamd_http2_frame_header (session, sizeof (payload),
+			RSPAMD_HTTP2_GOAWAY, 0, 0);
+	session->out = rspamd_fstring_append (session->out, payload,
+			sizeof (payload));
+	session->flags |= RSPAMD_HTTP2_SESSION_GOAWAY_SENT;
+}
+
+/*
+ * Connection error: tell peer what is wrong and close everything
+ */
+static gboolean
+rspamd_http2_session_fail (struct rspamd_http2_session *session,
+		enum rspamd_http2_error_code code, const gchar *reason)
+{
+	msg_info ("http2 connection error: %s", reason);
+
+	if (!IS_DEAD (session)) {
+		rspamd_http2_send_goaway (session, code);
+		/* Best effort */
+		rspamd_http2_session_write_pending (session);
+		rspamd_http2_session_terminate (session);
+	}
+
+	return FALSE;
+}
+
+/*
+ * Outgoing messages
+ */
+
+static gint
+rspamd_http2_out_on_url (http_parser *parser, const gchar *at, size_t length)
+{
+	struct rspamd_http2_stream *st = (struct rspamd_http2_stream *)parser->data;
+
+	st->out_url = rspamd_fstring_append (st->out_url, at, length);
+
+	return 0;
+}
+
+static gint
+rspamd_http2_out_on_header_field (http_parser *parser, const gchar *at,
+		size_t length)
+{
+	struct rspamd_http2_stream *st = (struct rspamd_http2_stream *)parser->data;
+	rspamd_fstring_t *name;
+
+	if (st->out_hdrs->len == 0 || (st->flags & RSPAMD_HTTP2_STREAM_HDR_VALUE)) {
+		g_ptr_array_add (st->out_hdrs, rspamd_fstring_new_init (at, length));
+		g_ptr_array_add (st->out_hdrs, rspamd_fstring_new ());
+		st->flags &= ~RSPAMD_HTTP2_STREAM_HDR_VALUE;
+	}
+	else {
+		/* Field is split between buffers */
+		name = g_ptr_array_index (st->out_hdrs, st->out_hdrs->len - 2);
+		g_ptr_array_index (st->out_hdrs, st->out_hdrs->len - 2) =
+				rspamd_fstring_append (name, at, length);
+	}
+
+	return 0;
+}
+
+static gint
+rspamd_http2_out_on_header_value (http_parser *parser, const gchar *at,
+		size_t length)
+{
+	struct rspamd_http2_stream *st = (struct rspamd_http2_stream *)parser->data;
+	rspamd_fstring_t *value;
+
+	if (st->out_hdrs->len == 0) {
+		return -1;
+	}
+
+	value = g_ptr_array_index (st->out_hdrs, st->out_hdrs->len - 1);
+	g_ptr_array_index (st->out_hdrs, st->out_hdrs->len - 1) =
+			rspamd_fstring_append (value, at, length);
+	st->flags |= RSPAMD_HTTP2_STREAM_HDR_VALUE;
+
+	return 0;
+}
+
+static gint
+rspamd_http2_out_on_headers_complete (http_parser *parser)
+{
+	struct rspamd_http2_stream *st = (struct rspamd_http2_stream *)parser->data;
+	rspamd_fstring_t *name;
+	guint i;
+
+	if (st->flags & RSPAMD_HTTP2_STREAM_HEADERS_READY) {
+		/* Only one message per stream */
+		return -1;
+	}
+
+	for (i = 0; i < st->out_hdrs->len; i += 2) {
+		name = g_ptr_array_index (st->out_hdrs, i);
+		rspamd_str_lc (name->str, name->len);
+	}
+
+	st->flags |= RSPAMD_HTTP2_STREAM_HEADERS_READY;
+
+	if (!(st->flags & RSPAMD_HTTP2_STREAM_QUEUED)) {
+		g_queue_push_tail (&st->session->pending, st);
+		st->flags |= RSPAMD_HTTP2_STREAM_QUEUED;
+	}
+
+	return 0;
+}
+
+static gint
+rspamd_http2_out_on_body (http_parser *parser, const gchar *at, size_t length)
+{
+	struct rspamd_http2_stream *st = (struct rspamd_http2_stream *)parser->data;
+
+	st->out_body = rspamd_fstring_append (st->out_body, at, length);
+
+	return 0;
+}
+
+static gint
+rspamd_http2_out_on_message_complete (http_parser *parser)
+{
+	struct rspamd_http2_stream *st = (struct rspamd_http2_stream *)parser->data;
+
+	st->flags |= RSPAMD_HTTP2_STREAM_MESSAGE_DONE;
+
+	return 0;
+}
+
+static const struct http_parser_settings rspamd_http2_out_settings = {
+		.on_url = rspamd_http2_out_on_url,
+		.on_header_field = rspamd_http2_out_on_header_field,
+		.on_header_value = rspamd_http2_out_on_header_value,
+		.on_headers_complete = rspamd_http2_out_on_headers_complete,
+		.on_body = rspamd_http2_out_on_body,
+		.on_message_complete = rspamd_http2_out_on_message_complete,
+};
+
+static void
+rspamd_http2_encode_header (struct rspamd_http2_session *session,
+		rspamd_fstring_t **blk, const gchar *name, const gchar *value,
+		gsize vlen)
+{
+	rspamd_ftok_t n, v;
+
+	n.begin = name;
+	n.len = strlen (name);
+	v.begin = value;
+	v.len = vlen;
+
+	rspamd_hpack_encode (session->enc, blk, &n, &v, TRUE);
+}
+
+static void
+rspamd_http2_stream_send_headers (struct rspamd_http2_stream *st)
+{
+	struct rspamd_http2_session *session = st->session;
+	rspamd_fstring_t *blk, *name, *value, *host = NULL;
+	rspamd_ftok_t n, v;
+	const gchar *method;
+	gchar status[16];
+	gsize pos = 0, chunk;
+	guint i;
+	guint8 flags = 0;
+
+	blk = rspamd_fstring_sized_new (256);
+	rspamd_hpack_encode_start (session->enc, &blk);
+
+	if (IS_SERVER (session)) {
+		rspamd_snprintf (status, sizeof (status), "%d",
+				(gint)st->parser.status_code);
+		rspamd_http2_encode_header (session, &blk, ":status", status,
+				strlen (status));
+	}
+	else {
+		for (i = 0; i < st->out_hdrs->len; i += 2) {
+			name = g_ptr_array_index (st->out_hdrs, i);
+
+			if (name->len == 4 && memcmp (name->str, "host", 4) == 0) {
+				host = g_ptr_array_index (st->out_hdrs, i + 1);
+				break;
+			}
+		}
+
+		method = http_method_str (st->parser.method);
+		rspamd_http2_encode_header (session, &blk, ":method", method,
+				strlen (method));
+		rspamd_http2_encode_header (session, &blk, ":scheme", "http", 4);
+
+		if (host) {
+			rspamd_http2_encode_header (session, &blk, ":authority",
+					host->str, host->len);
+		}
+		else if (session->host) {
+			rspamd_http2_encode_header (session, &blk, ":authority",
+					session->host, strlen (session->host));
+		}
+
+		if (st->out_url && st->out_url->len > 0) {
+			rspamd_http2_encode_header (session, &blk, ":path",
+					st->out_url->str, st->out_url->len);
+		}
+		else {
+			rspamd_http2_encode_header (session, &blk, ":path", "/", 1);
+		}
+	}
+
+	for (i = 0; i < st->out_hdrs->len; i += 2) {
+		name = g_ptr_array_index (st->out_hdrs, i);
+		value = g_ptr_array_index (st->out_hdrs, i + 1);
+
+		if (rspamd_http2_is_connection_header (name->str, name->len) ||
+				(name->len == 4 && memcmp (name->str, "host", 4) == 0)) {
+			continue;
+		}
+
+		n.begin = name->str;
+		n.len = name->len;
+		v.begin = value->str;
+		v.len = value->len;
+		/* Dates are different for each message */
+		rspamd_hpack_encode (session->enc, &blk, &n, &v,
+				!rspamd_http2_tok_equal (&n, "date"));
+	}
+
+	if ((st->flags & RSPAMD_HTTP2_STREAM_MESSAGE_DONE) &&
+			(st->out_body == NULL || st->out_body->len == 0)) {
+		flags |= RSPAMD_HTTP2_FLAG_END_STREAM;
+		st->flags |= RSPAMD_HTTP2_STREAM_LOCAL_CLOSED;
+	}
+
+	chunk = MIN (blk->len, session->peer_max_frame);
+	rspamd_http2_frame_header (session, chunk, RSPAMD_HTTP2_HEADERS,
+			flags | (chunk == blk->len ? RSPAMD_HTTP2_FLAG_END_HEADERS : 0),
+			st->id);
+	session->out = rspamd_fstring_append (session->out, blk->str, chunk);
+	pos = chunk;
+
+	while (pos < blk->len) {
+		chunk = MIN (blk->len - pos, session->peer_max_frame);
+		rspamd_http2_frame_header (session, chunk, RSPAMD_HTTP2_CONTINUATION,
+				pos + chunk == blk->len ? RSPAMD_HTTP2_FLAG_END_HEADERS : 0,
+				st->id);
+		session->out = rspamd_fstring_append (session->out, blk->str + pos,
+				chunk);
+		pos += chunk;
+	}
+
+	rspamd_fstring_free (blk);
+
+	for (i = 0; i < st->out_hdrs->len; i ++) {
+		rspamd_fstring_free (g_ptr_array_index (st->out_hdrs, i));
+	}
+
+	g_ptr_array_set_size (st->out_hdrs, 0);
+	st->flags |= RSPAMD_HTTP2_STREAM_HEADERS_SENT;
+}
+
+static void
+rspamd_http2_stream_send_data (struct rspamd_http2_stream *st)
+{
+	struct rspamd_http2_session *session = st->session;
+	gsize remain;
+	gint64 n;
+	gboolean end;
+
+	while (!(st->flags & RSPAMD_HTTP2_STREAM_LOCAL_CLOSED)) {
+		remain = st->out_body ? st->out_body->len - st->out_body_pos : 0;
+		n = MIN ((gint64)remain, (gint64)session->peer_max_frame);
+		n = MIN (n, session->send_window);
+		n = MIN (n, st->send_window);
+		end = (st->flags & RSPAMD_HTTP2_STREAM_MESSAGE_DONE) &&
+				n == (gint64)remain;
+
+		if (n <= 0 && !end) {
+			/* No data or no window */
+			break;
+		}
+
+		rspamd_http2_frame_header (session, n, RSPAMD_HTTP2_DATA,
+				end ? RSPAMD_HTTP2_FLAG_END_STREAM : 0, st->id);
+
+		if (n > 0) {
+			session->out = rspamd_fstring_append (session->out,
+					st->out_body->str + st->out_body_pos, n);
+			st->out_body_pos += n;
+			session->send_window -= n;
+			st->send_window -= n;
+		}
+
+		if (end) {
+			st->flags |= RSPAMD_HTTP2_STREAM_LOCAL_CLOSED;
+		}
+		else if (session->out->len >= RSPAMD_HTTP2_OUT_HIGHWATER) {
+			break;
+		}
+	}
+
+	if (st->out_body && st->out_body_pos == st->out_body->len) {
+		rspamd_fstring_clear (st->out_body);
+		st->out_body_pos = 0;
+	}
+}
+
+/*
+ * Produces frames for all streams that have something to send and allowed
+ * to do it by flow control and concurrency limits
+ */
+static void
+rspamd_http2_session_schedule (struct rspamd_http2_session *session)
+{
+	GList *cur, *next;
+	struct rspamd_http2_stream *st;
+
+	cur = session->pending.head;
+
+	while (cur && !IS_DEAD (session) &&
+			session->out->len < RSPAMD_HTTP2_OUT_HIGHWATER) {
+		next = cur->next;
+		st = (struct rspamd_http2_stream *)cur->data;
+
+		if (!(st->flags & RSPAMD_HTTP2_STREAM_HEADERS_SENT)) {
+			if (!(st->flags & RSPAMD_HTTP2_STREAM_HEADERS_READY)) {
+				cur = next;
+				continue;
+			}
+
+			if (st->id == 0) {
+				/* New client stream */
+				if (session->nactive >= session->peer_max_streams ||
+						(session->flags & RSPAMD_HTTP2_SESSION_GOAWAY_RECEIVED)) {
+					cur = next;
+					continue;
+				}
+
+				st->id = session->next_stream_id;
+				session->next_stream_id += 2;
+				session->nactive ++;
+				st->send_window = session->peer_initial_window;
+				g_hash_table_insert (session->streams,
+						GUINT_TO_POINTER (st->id), st);
+
+				if (session->next_stream_id > RSPAMD_HTTP2_MAX_STREAM_ID) {
+					/* Do not reuse this session for new streams */
+					session->flags |= RSPAMD_HTTP2_SESSION_GOAWAY_RECEIVED;
+				}
+			}
+
+			rspamd_http2_stream_send_headers (st);
+		}
+
+		rspamd_http2_stream_send_data (st);
+
+		if (st->flags & RSPAMD_HTTP2_STREAM_LOCAL_CLOSED) {
+			g_queue_delete_link (&session->pending, cur);
+			st->flags &= ~RSPAMD_HTTP2_STREAM_QUEUED;
+
+			if (st->conn == NULL &&
+					(st->flags & RSPAMD_HTTP2_STREAM_REMOTE_CLOSED)) {
+				rspamd_http2_stream_free (st);
+			}
+		}
+
+		cur = next;
+	}
+}
+
+static void
+rspamd_http2_session_update_watcher (struct rspamd_http2_session *session)
+{
+	short what = EV_READ;
+
+	if (IS_DEAD (session)) {
+		return;
+	}
+
+	if (session->out_pos < session->out->len) {
+		what |= EV_WRITE;
+	}
+
+	if ((session->ev.io.events & (EV_READ|EV_WRITE)) != what) {
+		rspamd_ev_watcher_reschedule (session->ctx->event_loop,
+				&session->ev, what);
+	}
+}
+
+static void
+rspamd_http2_session_write_pending (struct rspamd_http2_session *session)
+{
+	gssize r;
+
+	while (!IS_DEAD (session)) {
+		if (session->out_pos >= session->out->len) {
+			rspamd_fstring_clear (session->out);
+			session->out_pos = 0;
+
+			if (!(session->flags & RSPAMD_HTTP2_SESSION_GOAWAY_SENT)) {
+				rspamd_http2_session_schedule (session);
+			}
+
+			if (session->out->len == 0) {
+				break;
+			}
+		}
+
+		r = write (session->fd, session->out->str + session->out_pos,
+				session->out->len - session->out_pos);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			if (errno != EAGAIN) {
+				msg_info ("http2 write error: %s", strerror (errno));
+				rspamd_http2_session_terminate (session);
+			}
+
+			break;
+		}
+
+		session->out_pos += r;
+	}
+
+	rspamd_http2_session_update_watcher (session);
+}
+
+/*
+ * Returns consumed data to the connection window, small updates are coalesced
+ */
+static void
+rspamd_http2_session_consume (struct rspamd_http2_session *session, gsize len)
+{
+	session->recv_unacked += len;
+
+	if (!IS_DEAD (session) &&
+			session->recv_unacked >= RSPAMD_HTTP2_WINDOW_UPDATE_MIN) {
+		rspamd_http2_frame_u32 (session, RSPAMD_HTTP2_WINDOW_UPDATE, 0,
+				session->recv_unacked);
+		session->recv_window += session->recv_unacked;
+		session->recv_unacked = 0;
+	}
+}
+
+/*
+ * Streams
+ */
+
+static struct rspamd_http2_stream *
+rspamd_http2_stream_new (struct rspamd_http2_session *session, guint32 id)
+{
+	struct rspamd_http2_stream *st;
+
+	st = g_malloc0 (sizeof (*st));
+	st->session = session;
+	st->id = id;
+	st->send_window = session->peer_initial_window;
+	st->recv_window = RSPAMD_HTTP2_STREAM_WINDOW;
+	st->out_hdrs = g_ptr_array_new ();
+	http_parser_init (&st->parser,
+			IS_SERVER (session) ? HTTP_RESPONSE : HTTP_REQUEST);
+	st->parser.data = st;
+	REF_RETAIN (session);
+
+	if (id != 0) {
+		g_hash_table_insert (session->streams, GUINT_TO_POINTER (id), st);
+	}
+
+	return st;
+}
+
+static void
+rspamd_http2_stream_detach (struct rspamd_http2_stream *st)
+{
+	struct rspamd_http2_session *session = st->session;
+
+	if (st->flags & RSPAMD_HTTP2_STREAM_DETACHED) {
+		return;
+	}
+
+	if (st->id != 0) {
+		g_hash_table_remove (session->streams, GUINT_TO_POINTER (st->id));
+
+		if (!IS_SERVER (session)) {
+			session->nactive --;
+		}
+	}
+
+	if (st->flags & RSPAMD_HTTP2_STREAM_QUEUED) {
+		g_queue_remove (&session->pending, st);
+		st->flags &= ~RSPAMD_HTTP2_STREAM_QUEUED;
+	}
+
+	st->flags |= RSPAMD_HTTP2_STREAM_DETACHED;
+}
+
+static void
+rspamd_http2_stream_free (struct rspamd_http2_stream *st)
+{
+	struct rspamd_http2_session *session = st->session;
+	guint i;
+
+	rspamd_http2_stream_detach (st);
+
+	if (st->in_buffered > 0) {
+		/* Unread body is dropped */
+		rspamd_http2_session_consume (session, st->in_buffered);
+		rspamd_http2_session_update_watcher (session);
+	}
+
+	if (st->in_method) {
+		rspamd_fstring_free (st->in_method);
+	}
+	if (st->in_path) {
+		rspamd_fstring_free (st->in_path);
+	}
+	if (st->in_authority) {
+		rspamd_fstring_free (st->in_authority);
+	}
+	if (st->in_head) {
+		rspamd_fstring_free (st->in_head);
+	}
+	if (st->in_body) {
+		rspamd_fstring_free (st->in_body);
+	}
+	if (st->out_url) {
+		rspamd_fstring_free (st->out_url);
+	}
+	if (st->out_body) {
+		rspamd_fstring_free (st->out_body);
+	}
+
+	for (i = 0; i < st->out_hdrs->len; i ++) {
+		rspamd_fstring_free (g_ptr_array_index (st->out_hdrs, i));
+	}
+
+	g_ptr_array_free (st->out_hdrs, TRUE);
+	g_free (st);
+
+	REF_RELEASE (session);
+}
+
+/*
+ * Stream is closed before the message exchange is finished
+ */
+static void
+rspamd_http2_stream_abort (struct rspamd_http2_stream *st, gboolean send_rst,
+		enum rspamd_http2_error_code code)
+{
+	struct rspamd_http2_session *session = st->session;
+
+	if (send_rst && st->id != 0 && !IS_DEAD (session)) {
+		rspamd_http2_frame_u32 (session, RSPAMD_HTTP2_RST_STREAM, st->id, code);
+	}
+
+	rspamd_http2_stream_detach (st);
+	st->flags |= RSPAMD_HTTP2_STREAM_RESET;
+
+	if (st->conn) {
+		rspamd_http_connection_h2_notify (st->conn);
+	}
+	else {
+		rspamd_http2_stream_free (st);
+	}
+}
+
+/*
+ * Converts the received message to HTTP/1.1 and passes it to a connection
+ */
+static void
+rspamd_http2_stream_deliver (struct rspamd_http2_stream *st)
+{
+	rspamd_fstring_t *head = st->in_head, *hdrs;
+	gsize body_len = st->in_body ? st->in_body->len : 0;
+
+	hdrs = head;
+	head = rspamd_fstring_sized_new ((hdrs ? hdrs->len : 0) + 256);
+
+	if (IS_SERVER (st->session)) {
+		rspamd_printf_fstring (&head, "%V %V HTTP/1.1\r\n",
+				st->in_method, st->in_path);
+
+		if (st->in_authority && !(st->flags & RSPAMD_HTTP2_STREAM_HAS_HOST)) {
+			rspamd_printf_fstring (&head, "Host: %V\r\n", st->in_authority);
+		}
+	}
+	else {
+		rspamd_printf_fstring (&head, "HTTP/1.1 %d %s\r\n",
+				st->in_status, rspamd_http_code_to_str (st->in_status));
+	}
+
+	if (hdrs) {
+		head = rspamd_fstring_append (head, hdrs->str, hdrs->len);
+		rspamd_fstring_free (hdrs);
+	}
+
+	/* Each stream carries exactly one message */
+	rspamd_printf_fstring (&head, "Connection: close\r\n"
+			"Content-Length: %z\r\n\r\n", body_len);
+
+	st->in_head = head;
+	st->in_pos = 0;
+	st->flags |= RSPAMD_HTTP2_STREAM_REMOTE_CLOSED;
+
+	if (st->conn) {
+		rspamd_http_connection_h2_notify (st->conn);
+	}
+}
+
+static gboolean
+rspamd_http2_stream_header_cb (const rspamd_ftok_t *name,
+		const rspamd_ftok_t *value, gpointer ud)
+{
+	struct rspamd_http2_stream *st = (struct rspamd_http2_stream *)ud;
+	rspamd_fstring_t **pseudo = NULL;
+	gulong status;
+
+	if (st->flags & RSPAMD_HTTP2_STREAM_MALFORMED) {
+		return TRUE;
+	}
+
+	if (name->len > 0 && name->begin[0] == ':') {
+		if (IS_SERVER (st->session)) {
+			if (rspamd_http2_tok_equal (name, ":method")) {
+				pseudo = &st->in_method;
+			}
+			else if (rspamd_http2_tok_equal (name, ":path")) {
+				pseudo = &st->in_path;
+			}
+			else if (rspamd_http2_tok_equal (name, ":authority")) {
+				pseudo = &st->in_authority;
+			}
+			else if (rspamd_http2_tok_equal (name, ":scheme")) {
+				return TRUE;
+			}
+		}
+		else if (rspamd_http2_tok_equal (name, ":status")) {
+			if (value->len == 3 &&
+					rspamd_strtoul (value->begin, value->len, &status)) {
+				st->in_status = status;
+
+				return TRUE;
+			}
+		}
+
+		if (pseudo == NULL || *pseudo != NULL || value->len == 0 ||
+				memchr (value->begin, ' ', value->len) != NULL ||
+				!rspamd_http2_token_valid (value, FALSE)) {
+			st->flags |= RSPAMD_HTTP2_STREAM_MALFORMED;
+		}
+		else {
+			*pseudo = rspamd_fstring_new_init (value->begin, value->len);
+		}
+
+		return TRUE;
+	}
+
+	if (!rspamd_http2_token_valid (name, TRUE) ||
+			!rspamd_http2_token_valid (value, FALSE)) {
+		st->flags |= RSPAMD_HTTP2_STREAM_MALFORMED;
+
+		return TRUE;
+	}
+
+	if (rspamd_http2_is_connection_header (name->begin, name->len)) {
+		return TRUE;
+	}
+
+	if (rspamd_http2_tok_equal (name, "host")) {
+		st->flags |= RSPAMD_HTTP2_STREAM_HAS_HOST;
+	}
+
+	if (st->in_head && st->in_head->len + name->len + value->len >
+			RSPAMD_HTTP2_MAX_HEADERS_SIZE) {
+		st->flags |= RSPAMD_HTTP2_STREAM_MALFORMED;
+
+		return TRUE;
+	}
+
+	/* Collect headers, request line is added when message is complete */
+	if (st->in_head == NULL) {
+		st->in_head = rspamd_fstring_sized_new (256);
+	}
+
+	rspamd_printf_fstring (&st->in_head, "%T: %T\r\n", name, value);
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_http2_ignore_header_cb (const rspamd_ftok_t *name,
+		const rspamd_ftok_t *value, gpointer ud)
+{
+	return TRUE;
+}
+
+static gboolean
+rspamd_http2_decode_block (struct rspamd_http2_session *session,
+		const guchar *blk, gsize len,
+		rspamd_hpack_header_cb cb, gpointer ud)
+{
+	GError *err = NULL;
+
+	if (!rspamd_hpack_decode (session->dec, blk, len, cb, ud, &err)) {
+		msg_info ("cannot decode http2 headers: %e", err);
+		g_error_free (err);
+
+		return rspamd_http2_session_fail (session,
+				RSPAMD_HTTP2_COMPRESSION_ERROR, "bad header block");
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_http2_session_new_stream (struct rspamd_http2_session *session,
+		struct rspamd_http2_stream *st)
+{
+	struct rspamd_http_connection *conn;
+
+	conn = rspamd_http_connection_new_h2_stream (session->ctx, st,
+			session->body_handler, session->error_handler,
+			session->finish_handler, session->opts, RSPAMD_HTTP_SERVER);
+
+	if (session->max_size > 0) {
+		rspamd_http_connection_set_max_size (conn, session->max_size);
+	}
+
+	if (session->key) {
+		rspamd_http_connection_set_key (conn, session->key);
+	}
+
+	msg_debug_http2 ("new stream %ud", st->id);
+	session->stream_handler (session, conn, session->ud);
+}
+
+static gboolean
+rspamd_http2_session_headers (struct rspamd_http2_session *session,
+		guint32 id, guint8 flags, const guchar *blk, gsize len)
+{
+	struct rspamd_http2_stream *st;
+	gboolean is_new = FALSE;
+
+	st = g_hash_table_lookup (session->streams, GUINT_TO_POINTER (id));
+
+	if (st == NULL) {
+		if (!IS_SERVER (session) || (id & 1u) == 0 ||
+				id <= session->last_stream_id) {
+			if (!rspamd_http2_decode_block (session, blk, len,
+					rspamd_http2_ignore_header_cb, NULL)) {
+				return FALSE;
+			}
+
+			rspamd_http2_frame_u32 (session, RSPAMD_HTTP2_RST_STREAM, id,
+					RSPAMD_HTTP2_STREAM_CLOSED);
+
+			return TRUE;
+		}
+
+		session->last_stream_id = id;
+
+		if ((session->flags & RSPAMD_HTTP2_SESSION_GOAWAY_SENT) ||
+				g_hash_table_size (session->streams) >= session->max_streams) {
+			if (!rspamd_http2_decode_block (session, blk, len,
+					rspamd_http2_ignore_header_cb, NULL)) {
+				return FALSE;
+			}
+
+			rspamd_http2_frame_u32 (session, RSPAMD_HTTP2_RST_STREAM, id,
+					RSPAMD_HTTP2_REFUSED_STREAM);
+
+			return TRUE;
+		}
+
+		st = rspamd_http2_stream_new (session, id);
+		is_new = TRUE;
+	}
+
+	if (st->flags & (RSPAMD_HTTP2_STREAM_HEADERS_RECEIVED|
+			RSPAMD_HTTP2_STREAM_REMOTE_CLOSED)) {
+		/* Trailers are ignored */
+		if (!rspamd_http2_decode_block (session, blk, len,
+				rspamd_http2_ignore_header_cb, NULL)) {
+			return FALSE;
+		}
+
+		if ((st->flags & RSPAMD_HTTP2_STREAM_REMOTE_CLOSED) ||
+				!(flags & RSPAMD_HTTP2_FLAG_END_STREAM)) {
+			rspamd_http2_stream_abort (st, TRUE, RSPAMD_HTTP2_PROTOCOL_ERROR);
+
+			return TRUE;
+		}
+	}
+	else {
+		if (!rspamd_http2_decode_block (session, blk, len,
+				rspamd_http2_stream_header_cb, st)) {
+			return FALSE;
+		}
+
+		if (!IS_SERVER (session) && st->in_status >= 100 &&
+				st->in_status < 200) {
+			/* Informational reply, wait for the real one */
+			st->in_status = 0;
+
+			if (st->in_head) {
+				rspamd_fstring_clear (st->in_head);
+			}
+
+			return TRUE;
+		}
+
+		if ((st->flags & RSPAMD_HTTP2_STREAM_MALFORMED) ||
+				(IS_SERVER (session) &&
+						(st->in_method == NULL || st->in_path == NULL)) ||
+				(!IS_SERVER (session) && st->in_status == 0)) {
+			msg_info ("malformed http2 headers in stream %ud", id);
+			rspamd_http2_stream_abort (st, TRUE, RSPAMD_HTTP2_PROTOCOL_ERROR);
+
+			return TRUE;
+		}
+
+		st->flags |= RSPAMD_HTTP2_STREAM_HEADERS_RECEIVED;
+
+		if (is_new) {
+			rspamd_http2_session_new_stream (session, st);
+
+			if (IS_DEAD (session)) {
+				return FALSE;
+			}
+
+			/* Handler might have released a stream */
+			st = g_hash_table_lookup (session->streams, GUINT_TO_POINTER (id));
+
+			if (st == NULL) {
+				return TRUE;
+			}
+		}
+	}
+
+	if (flags & RSPAMD_HTTP2_FLAG_END_STREAM) {
+		rspamd_http2_stream_deliver (st);
+	}
+
+	return TRUE;
+}
+
+/*
+ * Frames processing
+ */
+
+static gboolean
+rspamd_http2_session_data (struct rspamd_http2_session *session,
+		guint32 id, guint8 flags, const guchar *p, gsize len)
+{
+	struct rspamd_http2_stream *st;
+	gsize flen = len;
+	guint8 padlen;
+
+	if (id == 0) {
+		return rspamd_http2_session_fail (session,
+				RSPAMD_HTTP2_PROTOCOL_ERROR, "data frame for stream 0");
+	}
+
+	if ((gint64)flen > session->recv_window) {
+		return rspamd_http2_session_fail (session,
+				RSPAMD_HTTP2_FLOW_CONTROL_ERROR, "connection window exceeded");
+	}
+
+	session->recv_window -= flen;
+
+	if (flags & RSPAMD_HTTP2_FLAG_PADDED) {
+		if (len < 1 || (padlen = p[0]) >= len) {
+			return rspamd_http2_session_fail (session,
+					RSPAMD_HTTP2_PROTOCOL_ERROR, "bad padding");
+		}
+
+		p ++;
+		len -= padlen + 1;
+		/* Padding is never buffered */
+		rspamd_http2_session_consume (session, flen - len);
+	}
+
+	st = g_hash_table_lookup (session->streams, GUINT_TO_POINTER (id));
+
+	if (st == NULL || !(st->flags & RSPAMD_HTTP2_STREAM_HEADERS_RECEIVED) ||
+			(st->flags & RSPAMD_HTTP2_STREAM_REMOTE_CLOSED)) {
+		rspamd_http2_session_consume (session, len);
+
+		if (st) {
+			rspamd_http2_stream_abort (st, TRUE, RSPAMD_HTTP2_STREAM_CLOSED);
+		}
+		else {
+			rspamd_http2_frame_u32 (session, RSPAMD_HTTP2_RST_STREAM, id,
+					RSPAMD_HTTP2_STREAM_CLOSED);
+		}
+
+		return TRUE;
+	}
+
+	if ((gint64)flen > st->recv_window) {
+		rspamd_http2_session_consume (session, len);
+		rspamd_http2_stream_abort (st, TRUE, RSPAMD_HTTP2_FLOW_CONTROL_ERROR);
+
+		return TRUE;
+	}
+
+	st->recv_window -= flen;
+
+	if (len > 0) {
+		if (st->in_body == NULL) {
+			st->in_body = rspamd_fstring_sized_new (len);
+		}
+
+		if (session->max_size > 0 && st->in_body->len + len > session->max_size) {
+			msg_info ("http2 stream %ud body is too large: %z",
+					id, st->in_body->len + len);
+			rspamd_http2_session_consume (session, len);
+			rspamd_http2_stream_abort (st, TRUE, RSPAMD_HTTP2_REFUSED_STREAM);
+
+			return TRUE;
+		}
+
+		st->in_body = rspamd_fstring_append (st->in_body, p, len);
+		st->in_buffered += len;
+	}
+
+	if (flags & RSPAMD_HTTP2_FLAG_END_STREAM) {
+		rspamd_http2_stream_deliver (st);
+	}
+	else if (st->recv_window <= RSPAMD_HTTP2_STREAM_WINDOW / 2) {
+		/* Body size is still limited by max size and the connection window */
+		rspamd_http2_frame_u32 (session, RSPAMD_HTTP2_WINDOW_UPDATE, id,
+				RSPAMD_HTTP2_STREAM_WINDOW - st->recv_window);
+		st->recv_window = RSPAMD_HTTP2_STREAM_WINDOW;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_http2_session_headers_frame (struct rspamd_http2_session *session,
+		guint32 id, guint8 flags, const guchar *p, gsize len)
+{
+	guint8 padlen = 0;
+
+	if (id == 0) {
+		return rspamd_http2_session_fail (session,
+				RSPAMD_HTTP2_PROTOCOL_ERROR, "headers frame for stream 0");
+	}
+
+	if (flags & RSPAMD_HTTP2_FLAG_PADDED) {
+		if (len < 1) {
+			return rspamd_http2_session_fail (session,
+					RSPAMD_HTTP2_PROTOCOL_ERROR, "bad padding");
+		}
+
+		padlen = p[0];
+		p ++;
+		len --;
+	}
+
+	if (flags & RSPAMD_HTTP2_FLAG_PRIORITY) {
+		if (len < 5) {
+			return rspamd_http2_session_fail (session,
+					RSPAMD_HTTP2_PROTOCOL_ERROR, "bad priority");
+		}
+
+		p += 5;
+		len -= 5;
+	}
+
+	if (padlen > len) {
+		return rspamd_http2_session_fail (session,
+				RSPAMD_HTTP2_PROTOCOL_ERROR, "bad padding");
+	}
+
+	len -= padlen;
+
+	if (!(flags & RSPAMD_HTTP2_FLAG_END_HEADERS)) {
+		/* Wait for CONTINUATION frames */
+		session->cont_id = id;
+		session->cont_flags = flags;
+
+		if (session->hblock == NULL) {
+			session->hblock = rspamd_fstring_sized_new (len);
+		}
+
+		session->hblock = rspamd_fstring_append (session->hblock, p, len);
+
+		return TRUE;
+	}
+
+	return rspamd_http2_session_headers (session, id, flags, p, len);
+}
+
+static gboolean
+rspamd_http2_session_continuation (struct rspamd_http2_session *session,
+		guint32 id, guint8 flags, const guchar *p, gsize len)
+{
+	gboolean ret;
+
+	if (session->cont_id == 0 || id != session->cont_id) {
+		return rspamd_http2_session_fail (session,
+				RSPAMD_HTTP2_PROTOCOL_ERROR, "unexpected continuation");
+	}
+
+	if (session->hblock->len + len > RSPAMD_HTTP2_MAX_HEADERS_SIZE * 4) {
+		return rspamd_http2_session_fail (session,
+				RSPAMD_HTTP2_PROTOCOL_ERROR, "header block is too large");
+	}
+
+	session->hblock = rspamd_fstring_append (session->hblock, p, len);
+
+	if (!(flags & RSPAMD_HTTP2_FLAG_END_HEADERS)) {
+		return TRUE;
+	}
+
+	session->cont_id = 0;
+	ret = rspamd_http2_session_headers (session, id, session->cont_flags,
+			session->hblock->str, session->hblock->len);
+
+	if (session->hblock) {
+		rspamd_fstring_clear (session->hblock);
+	}
+
+	return ret;
+}
+
+static gboolean
+rspamd_http2_session_settings (struct rspamd_http2_session *session,
+		guint32 id, guint8 flags, const guchar *p, gsize len)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_http2_stream *st;
+	guint16 sid;
+	guint32 val;
+	gint64 delta;
+
+	if (id != 0) {
+		return rspamd_http2_session_fail (session,
+				RSPAMD_HTTP2_PROTOCOL_ERROR, "settings for a stream");
+	}
+
+	if (flags & RSPAMD_HTTP2_FLAG_ACK) {
+		return TRUE;
+	}
+
+	if (len % 6 != 0) {
+		return rspamd_http2_session_fail (session,
+				RSPAMD_HTTP2_FRAME_SIZE_ERROR, "bad settings length");
+	}
+
+	for (; len > 0; p += 6, len -= 6) {
+		sid = ((guint16)p[0] << 8u) | p[1];
+		val = rspamd_http2_read_u32 (p + 2);
+
+		switch (sid) {
+		case RSPAMD_HTTP2_SETTINGS_HEADER_TABLE_SIZE:
+			rspamd_hpack_table_set_max_size (session->enc,
+					MIN (val, RSPAMD_HPACK_DEFAULT_TABLE_SIZE));
+			break;
+		case RSPAMD_HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS:
+			session->peer_max_streams = val;
+			break;
+		case RSPAMD_HTTP2_SETTINGS_INITIAL_WINDOW_SIZE:
+			if (val > RSPAMD_HTTP2_MAX_WINDOW) {
+				return rspamd_http2_session_fail (session,
+						RSPAMD_HTTP2_FLOW_CONTROL_ERROR, "bad window size");
+			}
+
+			delta = (gint64)val - session->peer_initial_window;
+			session->peer_initial_window = val;
+			g_hash_table_iter_init (&it, session->streams);
+
+			while (g_hash_table_iter_next (&it, &k, &v)) {
+				st = (struct rspamd_http2_stream *)v;
+				st->send_window += delta;
+			}
+			break;
+		case RSPAMD_HTTP2_SETTINGS_MAX_FRAME_SIZE:
+			if (val < RSPAMD_HTTP2_MAX_FRAME_SIZE || val > 0xffffff) {
+				return rspamd_http2_session_fail (session,
+						RSPAMD_HTTP2_PROTOCOL_ERROR, "bad frame size");
+			}
+
+			session->peer_max_frame = val;
+			break;
+		default:
+			/* Unknown and irrelevant settings are ignored */
+			break;
+		}
+	}
+
+	rspamd_http2_frame_header (session, 0, RSPAMD_HTTP2_SETTINGS,
+			RSPAMD_HTTP2_FLAG_ACK, 0);
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_http2_session_goaway (struct rspamd_http2_session *session,
+		const guchar *p, gsize len)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	GList *cur;
+	GPtrArray *aborted;
+	struct rspamd_http2_stream *st;
+	guint32 last_id;
+	guint i;
+
+	if (len < 8) {
+		return rspamd_http2_session_fail (session,
+				RSPAMD_HTTP2_FRAME_SIZE_ERROR, "bad goaway length");
+	}
+
+	last_id = rspamd_http2_read_u32 (p) & 0x7fffffffu;
+	session->flags |= RSPAMD_HTTP2_SESSION_GOAWAY_RECEIVED;
+	msg_debug_http2 ("got goaway, last stream: %ud, code: %ud", last_id,
+			rspamd_http2_read_u32 (p + 4));
+
+	if (IS_SERVER (session)) {
+		return TRUE;
+	}
+
+	/* Streams that are not processed by a peer could be retried elsewhere */
+	aborted = g_ptr_array_new ();
+	g_hash_table_iter_init (&it, session->streams);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		st = (struct rspamd_http2_stream *)v;
+
+		if (st->id > last_id) {
+			g_ptr_array_add (aborted, st);
+		}
+	}
+
+	for (cur = session->pending.head; cur != NULL; cur = cur->next) {
+		st = (struct rspamd_http2_stream *)cur->data;
+
+		if (st->id == 0) {
+			g_ptr_array_add (aborted, st);
+		}
+	}
+
+	for (i = 0; i < aborted->len; i ++) {
+		rspamd_http2_stream_abort (g_ptr_array_index (aborted, i), FALSE, 0);
+	}
+
+	g_ptr_array_free (aborted, TRUE);
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_http2_session_window_update (struct rspamd_http2_session *session,
+		guint32 id, const guchar *p, gsize len)
+{
+	struct rspamd_http2_stream *st;
+	guint32 incr;
+
+	if (len != 4) {
+		return rspamd_http2_session_fail (session,
+				RSPAMD_HTTP2_FRAME_SIZE_ERROR, "bad window update length");
+	}
+
+	incr = rspamd_http2_read_u32 (p) & 0x7fffffffu;
+
+	if (id == 0) {
+		if (incr == 0) {
+			return rspamd_http2_session_fail (session,
+					RSPAMD_HTTP2_PROTOCOL_ERROR, "zero window update");
+		}
+
+		session->send_window += incr;
+
+		if (session->send_window > RSPAMD_HTTP2_MAX_WINDOW) {
+			return rspamd_http2_session_fail (session,
+					RSPAMD_HTTP2_FLOW_CONTROL_ERROR, "window overflow");
+		}
+
+		return TRUE;
+	}
+
+	st = g_hash_table_lookup (session->streams, GUINT_TO_POINTER (id));
+
+	if (st != NULL) {
+		st->send_window += incr;
+
+		if (incr == 0) {
+			rspamd_http2_stream_abort (st, TRUE, RSPAMD_HTTP2_PROTOCOL_ERROR);
+		}
+		else if (st->send_window > RSPAMD_HTTP2_MAX_WINDOW) {
+			rspamd_http2_stream_abort (st, TRUE,
+					RSPAMD_HTTP2_FLOW_CONTROL_ERROR);
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Each reset of an active stream costs us a request processing, so peer that
+ * opens and resets streams in a loop is disconnected
+ */
+static gboolean
+rspamd_http2_session_count_reset (struct rspamd_http2_session *session)
+{
+	ev_tstamp now = ev_now (session->ctx->event_loop);
+
+	if (now - session->resets_start > RSPAMD_HTTP2_RESET_INTERVAL) {
+		session->resets_start = now;
+		session->nresets = 0;
+	}
+
+	if (++session->nresets > RSPAMD_HTTP2_MAX_RESETS) {
+		return rspamd_http2_session_fail (session,
+				RSPAMD_HTTP2_ENHANCE_YOUR_CALM, "too many streams are reset");
+	}
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_http2_session_frame (struct rspamd_http2_session *session,
+		guint8 type, guint8 flags, guint32 id, const guchar *p, gsize len)
+{
+	struct rspamd_http2_stream *st;
+
+	if (session->cont_id != 0 && type != RSPAMD_HTTP2_CONTINUATION) {
+		return rspamd_http2_session_fail (session,
+				RSPAMD_HTTP2_PROTOCOL_ERROR, "continuation expected");
+	}
+
+	switch (type) {
+	case RSPAMD_HTTP2_DATA:
+		return rspamd_http2_session_data (session, id, flags, p, len);
+	case RSPAMD_HTTP2_HEADERS:
+		return rspamd_http2_session_headers_frame (session, id, flags, p, len);
+	case RSPAMD_HTTP2_CONTINUATION:
+		return rspamd_http2_session_continuation (session, id, flags, p, len);
+	case RSPAMD_HTTP2_SETTINGS:
+		return rspamd_http2_session_settings (session, id, flags, p, len);
+	case RSPAMD_HTTP2_WINDOW_UPDATE:
+		return rspamd_http2_session_window_update (session, id, p, len);
+	case RSPAMD_HTTP2_GOAWAY:
+		return rspamd_http2_session_goaway (session, p, len);
+	case RSPAMD_HTTP2_PRIORITY:
+		if (id == 0 || len != 5) {
+			return rspamd_http2_session_fail (session,
+					RSPAMD_HTTP2_PROTOCOL_ERROR, "bad priority frame");
+		}
+		/* Streams are served in order anyway */
+		break;
+	case RSPAMD_HTTP2_RST_STREAM:
+		if (id == 0 || len != 4) {
+			return rspamd_http2_session_fail (session,
+					RSPAMD_HTTP2_PROTOCOL_ERROR, "bad rst_stream frame");
+		}
+
+		st = g_hash_table_lookup (session->streams, GUINT_TO_POINTER (id));
+
+		if (st) {
+			msg_debug_http2 ("stream %ud is reset by peer: %ud", id,
+					rspamd_http2_read_u32 (p));
+			rspamd_http2_stream_abort (st, FALSE, 0);
+
+			return rspamd_http2_session_count_reset (session);
+		}
+		break;
+	case RSPAMD_HTTP2_PING:
+		if (id != 0 || len != 8) {
+			return rspamd_http2_session_fail (session,
+					RSPAMD_HTTP2_PROTOCOL_ERROR, "bad ping frame");
+		}
+
+		if (!(flags & RSPAMD_HTTP2_FLAG_ACK)) {
+			rspamd_http2_frame_header (session, len, RSPAMD_HTTP2_PING,
+					RSPAMD_HTTP2_FLAG_ACK, 0);
+			session->out = rspamd_fstring_append (session->out, p, len);
+		}
+		break;
+	case RSPAMD_HTTP2_PUSH_PROMISE:
+		return rspamd_http2_session_fail (session,
+				RSPAMD_HTTP2_PROTOCOL_ERROR, "push is disabled");
+	default:
+		/* Unknown frames must be ignored */
+		break;
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_http2_session_process (struct rspamd_http2_session *session)
+{
+	const guchar *p;
+	gsize pos = 0, avail, flen;
+	guint32 id;
+
+	while (!IS_DEAD (session)) {
+		p = (const guchar *)session->in->str + pos;
+		avail = session->in->len - pos;
+
+		if (IS_SERVER (session) &&
+				!(session->flags & RSPAMD_HTTP2_SESSION_PREFACE)) {
+			if (avail < RSPAMD_HTTP2_PREFACE_LEN) {
+				break;
+			}
+
+			if (memcmp (p, RSPAMD_HTTP2_PREFACE,
+					RSPAMD_HTTP2_PREFACE_LEN) != 0) {
+				rspamd_http2_session_fail (session,
+						RSPAMD_HTTP2_PROTOCOL_ERROR, "bad preface");
+				break;
+			}
+
+			pos += RSPAMD_HTTP2_PREFACE_LEN;
+			session->flags |= RSPAMD_HTTP2_SESSION_PREFACE;
+			continue;
+		}
+
+		if (avail < RSPAMD_HTTP2_FRAME_HDR_LEN) {
+			break;
+		}
+
+		if (session->out->len - session->out_pos > RSPAMD_HTTP2_OUT_MAX) {
+			rspamd_http2_session_fail (session,
+					RSPAMD_HTTP2_ENHANCE_YOUR_CALM, "peer does not read replies");
+			break;
+		}
+
+		flen = ((gsize)p[0] << 16u) | ((gsize)p[1] << 8u) | p[2];
+
+		if (flen > RSPAMD_HTTP2_MAX_FRAME_SIZE) {
+			rspamd_http2_session_fail (session,
+					RSPAMD_HTTP2_FRAME_SIZE_ERROR, "frame is too large");
+			break;
+		}
+
+		if (avail < RSPAMD_HTTP2_FRAME_HDR_LEN + flen) {
+			break;
+		}
+
+		id = rspamd_http2_read_u32 (p + 5) & 0x7fffffffu;
+		pos += RSPAMD_HTTP2_FRAME_HDR_LEN + flen;
+
+		if (!rspamd_http2_session_frame (session, p[3], p[4], id,
+				p + RSPAMD_HTTP2_FRAME_HDR_LEN, flen)) {
+			break;
+		}
+	}
+
+	if (!IS_DEAD (session) && pos > 0) {
+		rspamd_fstring_erase (session->in, 0, pos);
+	}
+}
+
+static gboolean
+rspamd_http2_session_idle (struct rspamd_http2_session *session)
+{
+	return g_hash_table_size (session->streams) == 0 &&
+			session->pending.length == 0;
+}
+
+static void
+rspamd_http2_session_handler (gint fd, short what, gpointer ud)
+{
+	struct rspamd_http2_session *session = (struct rspamd_http2_session *)ud;
+	guchar buf[16384];
+	gssize r;
+
+	REF_RETAIN (session);
+
+	if (what & EV_READ) {
+		r = read (fd, buf, sizeof (buf));
+
+		if (r == 0) {
+			msg_debug_http2 ("http2 connection is closed by peer");
+			rspamd_http2_session_terminate (session);
+		}
+		else if (r == -1) {
+			if (errno != EAGAIN && errno != EINTR) {
+				msg_info ("http2 read error: %s", strerror (errno));
+				rspamd_http2_session_terminate (session);
+			}
+		}
+		else {
+			session->in = rspamd_fstring_append (session->in, buf, r);
+			rspamd_http2_session_process (session);
+		}
+	}
+	else if (what == EV_TIMEOUT) {
+		if (rspamd_http2_session_idle (session)) {
+			msg_debug_http2 ("close idle http2 connection");
+			rspamd_http2_send_goaway (session, RSPAMD_HTTP2_NO_ERROR);
+			rspamd_http2_session_write_pending (session);
+			rspamd_http2_session_terminate (session);
+		}
+		else {
+			/* Streams have their own timeouts */
+			rspamd_ev_watcher_reschedule (session->ctx->event_loop,
+					&session->ev, session->ev.io.events & (EV_READ|EV_WRITE));
+		}
+	}
+
+	if (!IS_DEAD (session)) {
+		rspamd_http2_session_write_pending (session);
+
+		if ((session->flags & RSPAMD_HTTP2_SESSION_GOAWAY_RECEIVED) &&
+				IS_SERVER (session) && rspamd_http2_session_idle (session)) {
+			rspamd_http2_session_terminate (session);
+		}
+	}
+
+	REF_RELEASE (session);
+}
+
+static void
+rspamd_http2_session_dtor (struct rspamd_http2_session *session)
+{
+	rspamd_fstring_free (session->in);
+	rspamd_fstring_free (session->out);
+
+	if (session->hblock) {
+		rspamd_fstring_free (session->hblock);
+	}
+
+	rspamd_hpack_table_free (session->dec);
+	rspamd_hpack_table_free (session->enc);
+	g_hash_table_unref (session->streams);
+
+	if (session->key) {
+		rspamd_keypair_unref (session->key);
+	}
+
+	if (session->addr) {
+		rspamd_inet_address_free (session->addr);
+	}
+
+	g_free (session->host);
+	g_free (session);
+}
+
+static void
+rspamd_http2_session_terminate (struct rspamd_http2_session *session)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	GList *cur;
+	GPtrArray *streams;
+	struct rspamd_http2_stream *st;
+	guint i;
+
+	if (IS_DEAD (session)) {
+		return;
+	}
+
+	session->flags |= RSPAMD_HTTP2_SESSION_DEAD;
+	rspamd_ev_watcher_stop (session->ctx->event_loop, &session->ev);
+	close (session->fd);
+	session->fd = -1;
+
+	if (!IS_SERVER (session)) {
+		g_queue_remove (&session->ctx->http2_sessions, session);
+	}
+
+	/* All unfinished streams are failed */
+	streams = g_ptr_array_new ();
+	g_hash_table_iter_init (&it, session->streams);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		g_ptr_array_add (streams, v);
+	}
+
+	for (cur = session->pending.head; cur != NULL; cur = cur->next) {
+		st = (struct rspamd_http2_stream *)cur->data;
+
+		if (st->id == 0) {
+			g_ptr_array_add (streams, st);
+		}
+	}
+
+	for (i = 0; i < streams->len; i ++) {
+		st = g_ptr_array_index (streams, i);
+		rspamd_http2_stream_abort (st, FALSE, 0);
+	}
+
+	g_ptr_array_free (streams, TRUE);
+
+	if (session->fin_handler) {
+		session->fin_handler (session, session->ud);
+	}
+
+	REF_RELEASE (session);
+}
+
+static struct rspamd_http2_session *
+rspamd_http2_session_new_common (struct rspamd_http_context *ctx,
+		gint fd, ev_tstamp timeout, gboolean is_server)
+{
+	struct rspamd_http2_session *session;
+
+	session = g_malloc0 (sizeof (*session));
+	session->ctx = ctx;
+	session->fd = fd;
+	session->timeout = timeout;
+	session->in = rspamd_fstring_sized_new (RSPAMD_HTTP2_MAX_FRAME_SIZE);
+	session->out = rspamd_fstring_sized_new (RSPAMD_HTTP2_MAX_FRAME_SIZE);
+	session->dec = rspamd_hpack_table_new (RSPAMD_HPACK_DEFAULT_TABLE_SIZE);
+	session->enc = rspamd_hpack_table_new (RSPAMD_HPACK_DEFAULT_TABLE_SIZE);
+	session->streams = g_hash_table_new (g_direct_hash, g_direct_equal);
+	session->send_window = RSPAMD_HTTP2_DEFAULT_WINDOW;
+	session->recv_limit = RSPAMD_HTTP2_SESSION_WINDOW;
+	session->peer_initial_window = RSPAMD_HTTP2_DEFAULT_WINDOW;
+	session->peer_max_frame = RSPAMD_HTTP2_MAX_FRAME_SIZE;
+	/* Unlimited until peer settings are received */
+	session->peer_max_streams = G_MAXUINT32;
+	session->max_streams = ctx->config.http2_max_streams > 0 ?
+			ctx->config.http2_max_streams : RSPAMD_HTTP2_DEFAULT_MAX_STREAMS;
+	session->next_stream_id = 1;
+	REF_INIT_RETAIN (session, rspamd_http2_session_dtor);
+
+	if (is_server) {
+		session->flags |= RSPAMD_HTTP2_SESSION_SERVER;
+	}
+	else {
+		session->out = rspamd_fstring_append (session->out,
+				RSPAMD_HTTP2_PREFACE, RSPAMD_HTTP2_PREFACE_LEN);
+	}
+
+	rspamd_http2_send_settings (session);
+	rspamd_ev_watcher_init (&session->ev, fd, EV_READ|EV_WRITE,
+			rspamd_http2_session_handler, session);
+	rspamd_ev_watcher_start (ctx->event_loop, &session->ev, timeout);
+
+	return session;
+}
+
+gboolean
+rspamd_http2_server_enabled (struct rspamd_http_context *ctx)
+{
+	return ctx->config.server_http2;
+}
+
+struct rspamd_http2_session *
+rspamd_http2_session_new_server (struct rspamd_http_context *ctx,
+		gint fd,
+		ev_tstamp timeout,
+		rspamd_http_body_handler_t body_handler,
+		rspamd_http_error_handler_t error_handler,
+		rspamd_http_finish_handler_t finish_handler,
+		unsigned opts,
+		rspamd_http2_stream_handler_t stream_handler,
+		rspamd_http2_session_fin_t fin_handler,
+		gpointer ud)
+{
+	struct rspamd_http2_session *session;
+
+	g_assert (stream_handler != NULL);
+
+	if (ctx == NULL) {
+		ctx = rspamd_http_context_default ();
+	}
+
+	session = rspamd_http2_session_new_common (ctx, fd, timeout, TRUE);
+	session->body_handler = body_handler;
+	session->error_handler = error_handler;
+	session->finish_handler = finish_handler;
+	/* Each stream has exactly one request */
+	session->opts = opts & ~RSPAMD_HTTP_SERVER_KEEP_ALIVE;
+	session->stream_handler = stream_handler;
+	session->fin_handler = fin_handler;
+	session->ud = ud;
+
+	return session;
+}
+
+void
+rspamd_http2_session_set_max_size (struct rspamd_http2_session *session,
+		gsize sz)
+{
+	gsize limit = MIN (sz, RSPAMD_HTTP2_MAX_WINDOW);
+
+	session->max_size = sz;
+
+	if (limit > session->recv_limit && !IS_DEAD (session)) {
+		/* The largest message must fit connection window */
+		rspamd_http2_frame_u32 (session, RSPAMD_HTTP2_WINDOW_UPDATE, 0,
+				limit - session->recv_limit);
+		session->recv_window += limit - session->recv_limit;
+		session->recv_limit = limit;
+		rspamd_http2_session_update_watcher (session);
+	}
+}
+
+void
+rspamd_http2_session_set_key (struct rspamd_http2_session *session,
+		struct rspamd_cryptobox_keypair *key)
+{
+	g_assert (key != NULL);
+
+	if (session->key) {
+		rspamd_keypair_unref (session->key);
+	}
+
+	session->key = rspamd_keypair_ref (key);
+}
+
+void
+rspamd_http2_session_close (struct rspamd_http2_session *session)
+{
+	if (!IS_DEAD (session)) {
+		REF_RETAIN (session);
+		rspamd_http2_send_goaway (session, RSPAMD_HTTP2_NO_ERROR);
+		rspamd_http2_session_write_pending (session);
+		rspamd_http2_session_terminate (session);
+		REF_RELEASE (session);
+	}
+}
+
+struct rspamd_http2_stream *
+rspamd_http2_client_stream_new (struct rspamd_http_context *ctx,
+		const rspamd_inet_addr_t *addr, const gchar *host)
+{
+	struct rspamd_http2_session *session = NULL, *cur_session;
+	GList *cur;
+	gint fd;
+
+	for (cur = ctx->http2_sessions.head; cur != NULL; cur = cur->next) {
+		cur_session = (struct rspamd_http2_session *)cur->data;
+
+		if (!(cur_session->flags & (RSPAMD_HTTP2_SESSION_GOAWAY_SENT|
+				RSPAMD_HTTP2_SESSION_GOAWAY_RECEIVED)) &&
+				rspamd_inet_address_equal (cur_session->addr, addr) &&
+				g_strcmp0 (cur_session->host, host) == 0) {
+			session = cur_session;
+			break;
+		}
+	}
+
+	if (session == NULL) {
+		fd = rspamd_inet_address_connect (addr, SOCK_STREAM, TRUE);
+
+		if (fd == -1) {
+			msg_info ("cannot connect to %s: %s",
+					rspamd_inet_address_to_string (addr),
+					strerror (errno));
+
+			return NULL;
+		}
+
+		session = rspamd_http2_session_new_common (ctx, fd,
+				ctx->config.keepalive_interval, FALSE);
+		session->addr = rspamd_inet_address_copy (addr);
+		session->host = g_strdup (host);
+		g_queue_push_tail (&ctx->http2_sessions, session);
+		msg_debug_http2 ("new http2 connection to %s",
+				rspamd_inet_address_to_string_pretty (addr));
+	}
+
+	return rspamd_http2_stream_new (session, 0);
+}
+
+void
+rspamd_http2_context_cleanup (struct rspamd_http_context *ctx)
+{
+	struct rspamd_http2_session *session;
+
+	while ((session = g_queue_peek_head (&ctx->http2_sessions)) != NULL) {
+		/* Removes session from the queue */
+		rspamd_http2_session_close (session);
+	}
+}
+
+void
+rspamd_http2_stream_attach (struct rspamd_http2_stream *st,
+		struct rspamd_http_connection *conn)
+{
+	st->conn = conn;
+}
+
+gssize
+rspamd_http2_stream_read (struct rspamd_http2_stream *st, gchar *buf,
+		gsize len)
+{
+	struct rspamd_http2_session *session = st->session;
+	gsize head_len, body_len, r = 0, n;
+
+	if (!(st->flags & RSPAMD_HTTP2_STREAM_REMOTE_CLOSED)) {
+		errno = (st->flags & RSPAMD_HTTP2_STREAM_RESET) ? ECONNRESET : EAGAIN;
+
+		return -1;
+	}
+
+	head_len = st->in_head->len;
+	body_len = st->in_body ? st->in_body->len : 0;
+
+	if (st->in_pos < head_len) {
+		n = MIN (len, head_len - st->in_pos);
+		memcpy (buf, st->in_head->str + st->in_pos, n);
+		st->in_pos += n;
+		r += n;
+	}
+
+	if (r < len && st->in_pos >= head_len && st->in_pos < head_len + body_len) {
+		n = MIN (len - r, head_len + body_len - st->in_pos);
+		memcpy (buf + r, st->in_body->str + st->in_pos - head_len, n);
+		st->in_pos += n;
+		r += n;
+
+		/* Data is owned by the connection now */
+		st->in_buffered -= n;
+		rspamd_http2_session_consume (session, n);
+		rspamd_http2_session_update_watcher (session);
+	}
+
+	return r;
+}
+
+gboolean
+rspamd_http2_stream_has_data (struct rspamd_http2_stream *st)
+{
+	gsize total;
+
+	if (st->flags & RSPAMD_HTTP2_STREAM_REMOTE_CLOSED) {
+		total = st->in_head->len + (st->in_body ? st->in_body->len : 0);
+
+		return st->in_pos < total;
+	}
+
+	return (st->flags & RSPAMD_HTTP2_STREAM_RESET) ? TRUE : FALSE;
+}
+
+gssize
+rspamd_http2_stream_writev (struct rspamd_http2_stream *st,
+		const struct iovec *iov, guint niov)
+{
+	struct rspamd_http2_session *session = st->session;
+	gsize total = 0, nparsed;
+	guint i;
+
+	if (IS_DEAD (session) || (st->flags & (RSPAMD_HTTP2_STREAM_RESET|
+			RSPAMD_HTTP2_STREAM_LOCAL_CLOSED))) {
+		errno = ECONNRESET;
+
+		return -1;
+	}
+
+	for (i = 0; i < niov; i ++) {
+		nparsed = http_parser_execute (&st->parser, &rspamd_http2_out_settings,
+				iov[i].iov_base, iov[i].iov_len);
+
+		if (nparsed != iov[i].iov_len || st->parser.http_errno != HPE_OK) {
+			msg_info ("cannot convert message to http2: %s",
+					http_errno_description (st->parser.http_errno));
+			errno = EINVAL;
+
+			return -1;
+		}
+
+		total += nparsed;
+	}
+
+	REF_RETAIN (session);
+	rspamd_http2_session_write_pending (session);
+	REF_RELEASE (session);
+
+	return total;
+}
+
+void
+rspamd_http2_stream_release (struct rspamd_http2_stream *st)
+{
+	struct rspamd_http2_session *session = st->session;
+
+	st->conn = NULL;
+
+	if (IS_DEAD (session) || (st->flags & RSPAMD_HTTP2_STREAM_RESET)) {
+		rspamd_http2_stream_free (st);
+
+		return;
+	}
+
+	if (!(st->flags & RSPAMD_HTTP2_STREAM_REMOTE_CLOSED) ||
+			!(st->flags & RSPAMD_HTTP2_STREAM_MESSAGE_DONE)) {
+		/* Message exchange is not finished */
+		REF_RETAIN (session);
+		rspamd_http2_stream_abort (st, TRUE, RSPAMD_HTTP2_CANCEL);
+		rspamd_http2_session_write_pending (session);
+		REF_RELEASE (session);
+
+		return;
+	}
+
+	if (st->flags & RSPAMD_HTTP2_STREAM_LOCAL_CLOSED) {
+		rspamd_http2_stream_free (st);
+	}
+
+	/* Otherwise stream is freed when all data is sent */
+}
+
+static void
+rspamd_http2_detect_fin (struct rspamd_http2_detect_cbdata *cbd,
+		gboolean is_http2)
+{
+	rspamd_ev_watcher_stop (cbd->ctx->event_loop, &cbd->ev);
+	ev_timer_stop (cbd->ctx->event_loop, &cbd->retry);
+	cbd->handler (cbd->fd, is_http2, cbd->ud);
+	g_free (cbd);
+}
+
+static void
+rspamd_http2_detect_retry (EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_http2_detect_cbdata *cbd =
+			(struct rspamd_http2_detect_cbdata *)w->data;
+
+	ev_io_start (EV_A_ &cbd->ev.io);
+}
+
+static void
+rspamd_http2_detect_handler (gint fd, short what, gpointer ud)
+{
+	struct rspamd_http2_detect_cbdata *cbd =
+			(struct rspamd_http2_detect_cbdata *)ud;
+	gchar buf[RSPAMD_HTTP2_PREFACE_LEN];
+	gssize r;
+
+	if (what == EV_TIMEOUT) {
+		/* Let HTTP/1 code to report timeout */
+		rspamd_http2_detect_fin (cbd, FALSE);
+
+		return;
+	}
+
+	r = recv (fd, buf, sizeof (buf), MSG_PEEK);
+
+	if (r == -1 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	}
+
+	if (r <= 0 || memcmp (buf, RSPAMD_HTTP2_PREFACE, r) != 0) {
+		rspamd_http2_detect_fin (cbd, FALSE);
+	}
+	else if (r >= 3) {
+		/* No HTTP/1 method starts with "PRI" */
+		rspamd_http2_detect_fin (cbd, TRUE);
+	}
+	else {
+		/* Data is not consumed, so wait a bit instead of spinning */
+		ev_io_stop (cbd->ctx->event_loop, &cbd->ev.io);
+		ev_timer_set (&cbd->retry, 0.05, 0.0);
+		ev_timer_start (cbd->ctx->event_loop, &cbd->retry);
+	}
+}
+
+void
+rspamd_http2_detect (struct rspamd_http_context *ctx,
+		gint fd, ev_tstamp timeout,
+		rspamd_http2_detect_handler_t handler, gpointer ud)
+{
+	struct rspamd_http2_detect_cbdata *cbd;
+
+	if (ctx == NULL) {
+		ctx = rspamd_http_context_default ();
+	}
+
+	cbd = g_malloc0 (sizeof (*cbd));
+	cbd->ctx = ctx;
+	cbd->fd = fd;
+	cbd->handler = handler;
+	cbd->ud = ud;
+	ev_init (&cbd->retry, rspamd_http2_detect_retry);
+	cbd->retry.data = cbd;
+
+	rspamd_ev_watcher_init (&cbd->ev, fd, EV_READ,
+			rspamd_http2_detect_handler, cbd);
+	rspamd_ev_watcher_start (ctx->event_loop, &cbd->ev, timeout);
+}
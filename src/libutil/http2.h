@@ -0,0 +1,128 @@
+/*-
+ * Copyright 2019 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_HTTP2_H
+#define RSPAMD_HTTP2_H
+
+#include "config.h"
+#include "http_connection.h"
+
+/*
+ * Cleartext HTTP/2 (h2c) with prior knowledge.
+ *
+ * Session owns a socket and multiplexes streams over it. Each stream is
+ * represented by a normal HTTP connection object, so the existing handlers
+ * work with HTTP/2 requests and replies without modifications.
+ */
+
+#define RSPAMD_HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define RSPAMD_HTTP2_PREFACE_LEN (sizeof (RSPAMD_HTTP2_PREFACE) - 1)
+#define RSPAMD_HTTP2_DEFAULT_MAX_STREAMS 256
+
+struct rspamd_http2_session;
+struct rspamd_http_context;
+
+/**
+ * Called for each new request stream, handler owns `conn` and should call
+ * `rspamd_http_connection_read_message` to get the request. Stream is reset
+ * if the connection is released before the reply is written
+ */
+typedef void (*rspamd_http2_stream_handler_t) (
+		struct rspamd_http2_session *session,
+		struct rspamd_http_connection *conn,
+		gpointer ud);
+
+/**
+ * Called once when server session is closed
+ */
+typedef void (*rspamd_http2_session_fin_t) (
+		struct rspamd_http2_session *session,
+		gpointer ud);
+
+/**
+ * Called when the protocol of a new connection is known
+ */
+typedef void (*rspamd_http2_detect_handler_t) (gint fd, gboolean is_http2,
+		gpointer ud);
+
+/**
+ * Returns TRUE if HTTP/2 is enabled for servers in the HTTP context
+ * @param ctx
+ * @return
+ */
+gboolean rspamd_http2_server_enabled (struct rspamd_http_context *ctx);
+
+/**
+ * Waits for the first data on the accepted socket and checks if a client
+ * has sent HTTP/2 connection preface, data is not consumed
+ * @param ctx
+ * @param fd
+ * @param timeout
+ * @param handler
+ * @param ud
+ */
+void rspamd_http2_detect (struct rspamd_http_context *ctx,
+		gint fd, ev_tstamp timeout,
+		rspamd_http2_detect_handler_t handler, gpointer ud);
+
+/**
+ * Creates server session for a socket, session owns the socket
+ * @param ctx
+ * @param fd
+ * @param timeout idle timeout
+ * @param body_handler body handler for stream connections
+ * @param error_handler error handler for stream connections
+ * @param finish_handler finish handler for stream connections
+ * @param opts options for stream connections
+ * @param stream_handler called for each new request
+ * @param fin_handler called when session is closed
+ * @param ud opaque data for session handlers
+ * @return
+ */
+struct rspamd_http2_session *rspamd_http2_session_new_server (
+		struct rspamd_http_context *ctx,
+		gint fd,
+		ev_tstamp timeout,
+		rspamd_http_body_handler_t body_handler,
+		rspamd_http_error_handler_t error_handler,
+		rspamd_http_finish_handler_t finish_handler,
+		unsigned opts,
+		rspamd_http2_stream_handler_t stream_handler,
+		rspamd_http2_session_fin_t fin_handler,
+		gpointer ud);
+
+/**
+ * Sets maximum size of a request body
+ * @param session
+ * @param sz
+ */
+void rspamd_http2_session_set_max_size (struct rspamd_http2_session *session,
+		gsize sz);
+
+/**
+ * Sets encryption key for stream connections
+ * @param session
+ * @param key
+ */
+void rspamd_http2_session_set_key (struct rspamd_http2_session *session,
+		struct rspamd_cryptobox_keypair *key);
+
+/**
+ * Sends GOAWAY and closes the session, unfinished streams are failed
+ * @param session
+ */
+void rspamd_http2_session_close (struct rspamd_http2_session *session);
+
+#endif
@@ -35,6 +35,14 @@
 
 #include <openssl/err.h>
 
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+#include <sys/sendfile.h>
+#define RSPAMD_HTTP_USE_SENDFILE 1
+#endif
+
+/* Request bodies of this size or larger are read to anonymous memory files */
+#define RSPAMD_HTTP_MEMFD_MIN (1024 * 1024)
+
 #define ENCRYPTED_VERSION " HTTP/1.0"
 
 struct _rspamd_http_privbuf {
@@ -53,11 +61,15 @@ enum rspamd_http_priv_flags {
 	RSPAMD_HTTP_CONN_FLAG_PROXY = 1u << 5u,
 	RSPAMD_HTTP_CONN_FLAG_PROXY_REQUEST = 1u << 6u,
 	RSPAMD_HTTP_CONN_OWN_SOCKET = 1u << 7u,
+	RSPAMD_HTTP_CONN_FLAG_KEEPALIVE = 1u << 8u,
 };
 
 #define IS_CONN_ENCRYPTED(c) ((c)->flags & RSPAMD_HTTP_CONN_FLAG_ENCRYPTED)
 #define IS_CONN_RESETED(c) ((c)->flags & RSPAMD_HTTP_CONN_FLAG_RESETED)
 
+/* Enough for a reply with a dozen of headers */
+#define RSPAMD_HTTP_PREALLOC_IOV 16
+
 struct rspamd_http_connection_private {
 	struct rspamd_http_context *ctx;
 	struct rspamd_ssl_connection *ssl;
@@ -76,6 +88,16 @@ struct rspamd_http_connection_private {
 	enum rspamd_http_priv_flags flags;
 	gsize wr_pos;
 	gsize wr_total;
+	/* Shared memory body written by sendfile after iov */
+	gint sf_fd;
+	goffset sf_offset;
+	gsize sf_len;
+	gsize sf_sent;
+	struct iovec out_prealloc[RSPAMD_HTTP_PREALLOC_IOV];
+	/* Pipelined data read with the previous request */
+	rspamd_fstring_t *pipelined;
+	/* HTTP/2 stream used instead of a socket */
+	struct rspamd_http2_stream *h2;
 };
 
 static const rspamd_ftok_t key_header = {
@@ -112,7 +134,7 @@ rspamd_http_privbuf_dtor (gpointer ud)
 	g_free (p);
 }
 
-static const gchar *
+const gchar *
 rspamd_http_code_to_str (gint code)
 {
 	if (code == 200) {
@@ -169,8 +191,8 @@ rspamd_http_parse_key (rspamd_ftok_t *data, struct rspamd_http_connection *conn,
 						priv->msg->peer_key = pk;
 
 						if (priv->cache && priv->msg->peer_key) {
-							rspamd_keypair_cache_process (priv->cache,
-									priv->local_key,
+							rspamd_http_context_process_keys (priv->ctx,
+									priv->cache, priv->local_key,
 									priv->msg->peer_key);
 						}
 					}
@@ -382,7 +404,16 @@ rspamd_http_on_headers_complete (http_parser * parser)
 			return -1;
 		}
 
-		if (!rspamd_http_message_set_body (msg, NULL, parser->content_length)) {
+		if (conn->type == RSPAMD_HTTP_SERVER &&
+				(conn->opts & RSPAMD_HTTP_SERVER_MEMFD) &&
+				!(msg->flags & RSPAMD_HTTP_FLAG_SHMEM) &&
+				parser->content_length >= RSPAMD_HTTP_MEMFD_MIN &&
+				rspamd_http_message_set_body_memfd (msg,
+						parser->content_length)) {
+			/* Large body is read in place and never reallocated */
+		}
+		else if (!rspamd_http_message_set_body (msg, NULL,
+				parser->content_length)) {
 			return -1;
 		}
 	}
@@ -443,8 +474,16 @@ rspamd_http_on_body (http_parser * parser, const gchar *at, size_t length)
 			return -1;
 		}
 
-		/* We might have some leftover in our private buffer */
-		if (pbuf->data->len == length) {
+		/*
+		 * We might have some leftover in our private buffer, however, if
+		 * the body has been allocated by Content-Length then the rest of it
+		 * could be read in place and the leftover is never written there
+		 */
+		if (pbuf->data->len == length ||
+				(!(parser->flags & F_CHUNKED) &&
+				parser->content_length != ULLONG_MAX &&
+				msg->body_buf.allocated_len - msg->body_buf.len >=
+						parser->content_length)) {
 			/* Switch to zero-copy mode */
 			rspamd_http_switch_zc (pbuf, msg);
 		}
@@ -454,6 +493,7 @@ rspamd_http_on_body (http_parser * parser, const gchar *at, size_t length)
 			/* Likely chunked encoding */
 			memmove ((gchar *)msg->body_buf.begin + msg->body_buf.len, at, length);
 			p = msg->body_buf.begin + msg->body_buf.len;
+			msg->body_copied += length;
 		}
 
 		/* Adjust zero-copy buf */
@@ -650,6 +690,21 @@ rspamd_http_on_message_complete (http_parser * parser)
 		return -1;
 	}
 
+	if (conn->opts & RSPAMD_HTTP_SERVER_KEEP_ALIVE) {
+		if (http_should_keep_alive (parser) &&
+				!(priv->msg->flags & RSPAMD_HTTP_FLAG_SPAMC)) {
+			priv->flags |= RSPAMD_HTTP_CONN_FLAG_KEEPALIVE;
+			/*
+			 * Requests are processed one by one, so the rest of the input
+			 * is saved and parsed after the reply is sent
+			 */
+			http_parser_pause (parser, 1);
+		}
+		else {
+			priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_KEEPALIVE;
+		}
+	}
+
 	if ((conn->opts & RSPAMD_HTTP_BODY_PARTIAL) == 0 && IS_CONN_ENCRYPTED (priv)) {
 		mode = rspamd_keypair_alg (priv->local_key);
 
@@ -687,19 +742,24 @@ rspamd_http_on_message_complete (http_parser * parser)
 	}
 
 	if (ret == 0) {
+		struct rspamd_http_message *msg;
+
 		rspamd_ev_watcher_stop (priv->ctx->event_loop, &priv->ev);
 		rspamd_http_connection_ref (conn);
-		ret = conn->finish_handler (conn, priv->msg);
+		/* Finish handler can steal message but we still need its headers */
+		msg = rspamd_http_message_ref (priv->msg);
+		ret = conn->finish_handler (conn, msg);
 
 		if (conn->opts & RSPAMD_HTTP_CLIENT_KEEP_ALIVE) {
 			rspamd_http_context_push_keepalive (conn->priv->ctx, conn,
-					priv->msg, conn->priv->ctx->event_loop);
+					msg, conn->priv->ctx->event_loop);
 			rspamd_http_connection_reset (conn);
 		}
 		else {
 			conn->finished = TRUE;
 		}
 
+		rspamd_http_message_unref (msg);
 		rspamd_http_connection_unref (conn);
 	}
 
@@ -770,6 +830,22 @@ rspamd_http_write_helper (struct rspamd_http_connection *conn)
 		goto call_finish_handler;
 	}
 
+#ifdef RSPAMD_HTTP_USE_SENDFILE
+	if (priv->sf_len > 0 && priv->wr_pos >= priv->wr_total - priv->sf_len) {
+		/* Headers are written, send body directly from the shared memory */
+		off_t off = priv->sf_offset +
+				(priv->wr_pos - (priv->wr_total - priv->sf_len));
+
+		r = sendfile (conn->fd, priv->sf_fd, &off, priv->wr_total - priv->wr_pos);
+
+		if (r > 0) {
+			priv->sf_sent += r;
+		}
+
+		goto written;
+	}
+#endif
+
 	start = &priv->out[0];
 	niov = priv->outlen;
 	remain = priv->wr_pos;
@@ -802,10 +878,16 @@ rspamd_http_write_helper (struct rspamd_http_connection *conn)
 	if (priv->ssl) {
 		r = rspamd_ssl_writev (priv->ssl, msg.msg_iov, msg.msg_iovlen);
 	}
+	else if (priv->h2) {
+		r = rspamd_http2_stream_writev (priv->h2, msg.msg_iov, msg.msg_iovlen);
+	}
 	else {
 		r = sendmsg (conn->fd, &msg, flags);
 	}
 
+#ifdef RSPAMD_HTTP_USE_SENDFILE
+written:
+#endif
 	if (r == -1) {
 		if (!priv->ssl) {
 			err = g_error_new (HTTP_ERROR, errno, "IO write error: %s", strerror (errno));
@@ -827,6 +909,11 @@ rspamd_http_write_helper (struct rspamd_http_connection *conn)
 	else {
 		/* Want to write more */
 		priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_RESETED;
+
+		if (priv->h2) {
+			/* Stream is always writable */
+			ev_feed_event (priv->ctx->event_loop, &priv->ev.io, EV_WRITE);
+		}
 	}
 
 	return;
@@ -844,6 +931,42 @@ call_finish_handler:
 	}
 }
 
+/*
+ * Reads the rest of a body in place and the data after it, i.e. the next
+ * pipelined request, to the private buffer by a single call
+ */
+static gssize
+rspamd_http_readv_body (gint fd,
+		struct rspamd_http_connection_private *priv,
+		gchar *data, gsize len)
+{
+	struct iovec iov[2];
+	gssize r;
+
+	iov[0].iov_base = data;
+	iov[0].iov_len = len;
+	iov[1].iov_base = priv->buf->data->str;
+	iov[1].iov_len = priv->buf->data->allocated;
+
+	r = readv (fd, iov, G_N_ELEMENTS (iov));
+
+	if (r > (gssize)len) {
+		/* Parsed when the next request is read */
+		if (priv->pipelined == NULL) {
+			priv->pipelined = rspamd_fstring_new_init (priv->buf->data->str,
+					r - len);
+		}
+		else {
+			priv->pipelined = rspamd_fstring_append (priv->pipelined,
+					priv->buf->data->str, r - len);
+		}
+
+		r = len;
+	}
+
+	return r;
+}
+
 static gssize
 rspamd_http_try_read (gint fd,
 		struct rspamd_http_connection *conn,
@@ -874,9 +997,36 @@ rspamd_http_try_read (gint fd,
 		}
 	}
 
-	if (priv->ssl) {
+	if (priv->pipelined && priv->pipelined->len > 0) {
+		/* Data read with the previous request is parsed first */
+		r = MIN (priv->pipelined->len, len);
+		memcpy (data, priv->pipelined->str, r);
+		priv->pipelined->len -= r;
+
+		if (priv->pipelined->len > 0) {
+			memmove (priv->pipelined->str, priv->pipelined->str + r,
+					priv->pipelined->len);
+			ev_feed_event (priv->ctx->event_loop, &priv->ev.io, EV_READ);
+		}
+	}
+	else if (priv->h2) {
+		r = rspamd_http2_stream_read (priv->h2, data, len);
+
+		if (r > 0 && rspamd_http2_stream_has_data (priv->h2)) {
+			ev_feed_event (priv->ctx->event_loop, &priv->ev.io, EV_READ);
+		}
+	}
+	else if (priv->ssl) {
 		r = rspamd_ssl_read (priv->ssl, data, len);
 	}
+	else if (pbuf->zc_buf != NULL && !(priv->parser.flags & F_CHUNKED) &&
+			priv->parser.content_length != ULLONG_MAX &&
+			priv->parser.content_length > 0 &&
+			priv->parser.content_length <= len) {
+		/* Parser knows how many bytes of the body are left */
+		r = rspamd_http_readv_body (fd, priv, data,
+				priv->parser.content_length);
+	}
 	else {
 		r = read (fd, data, len);
 	}
@@ -911,6 +1061,72 @@ rspamd_http_ssl_err_handler (gpointer ud, GError *err)
 	rspamd_http_connection_unref (conn);
 }
 
+/*
+ * Requests boundaries are lost after a malformed request, so the connection
+ * is closed after the error reply and stashed requests are dropped
+ */
+static void
+rspamd_http_connection_stop_keepalive (struct rspamd_http_connection_private *priv)
+{
+	priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_KEEPALIVE;
+
+	if (priv->pipelined) {
+		priv->pipelined->len = 0;
+	}
+}
+
+/*
+ * Malformed request is a client error, so servers reply with 400
+ */
+static gint
+rspamd_http_connection_parser_error_code (struct rspamd_http_connection *conn)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+
+	if (conn->type == RSPAMD_HTTP_SERVER) {
+		return 400;
+	}
+
+	return 500 + priv->parser.http_errno;
+}
+
+/*
+ * Parser is paused after a keep-alive request, so the rest of the data
+ * read belongs to the next request(s) and is saved until the reply is sent
+ */
+static gboolean
+rspamd_http_connection_save_pipelined (struct rspamd_http_connection_private *priv,
+		const gchar *d, gsize nparsed, gsize r)
+{
+	if (priv->parser.http_errno != HPE_PAUSED) {
+		/* Connection might be already reset by the finish handler */
+		if (!(priv->flags & RSPAMD_HTTP_CONN_FLAG_KEEPALIVE) ||
+				priv->parser.http_errno != HPE_OK || nparsed >= r) {
+			return FALSE;
+		}
+	}
+	else if (nparsed >= r) {
+		return TRUE;
+	}
+
+	if (priv->pipelined == NULL) {
+		priv->pipelined = rspamd_fstring_new_init (d + nparsed, r - nparsed);
+	}
+	else {
+		/* Prepend to the data that has not been parsed yet */
+		rspamd_fstring_t *nb;
+
+		nb = rspamd_fstring_sized_new (r - nparsed + priv->pipelined->len);
+		nb = rspamd_fstring_append (nb, d + nparsed, r - nparsed);
+		nb = rspamd_fstring_append (nb, priv->pipelined->str,
+				priv->pipelined->len);
+		rspamd_fstring_free (priv->pipelined);
+		priv->pipelined = nb;
+	}
+
+	return TRUE;
+}
+
 static void
 rspamd_http_event_handler (int fd, short what, gpointer ud)
 {
@@ -919,6 +1135,7 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 	struct _rspamd_http_privbuf *pbuf;
 	const gchar *d;
 	gssize r;
+	gsize nparsed;
 	GError *err;
 
 	priv = conn->priv;
@@ -930,8 +1147,15 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 		r = rspamd_http_try_read (fd, conn, priv, pbuf, &d);
 
 		if (r > 0) {
-			if (http_parser_execute (&priv->parser, &priv->parser_cb,
-					d, r) != (size_t)r || priv->parser.http_errno != 0) {
+			nparsed = http_parser_execute (&priv->parser, &priv->parser_cb,
+					d, r);
+
+			if (rspamd_http_connection_save_pipelined (priv, d, nparsed, r)) {
+				/* Next request is already here, it is parsed later */
+			}
+			else if (nparsed != (size_t)r || priv->parser.http_errno != 0) {
+				rspamd_http_connection_stop_keepalive (priv);
+
 				if (priv->flags & RSPAMD_HTTP_CONN_FLAG_TOO_LARGE) {
 					err = g_error_new (HTTP_ERROR, 413,
 							"Request entity too large: %zu",
@@ -942,7 +1166,8 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 							"Encryption required");
 				}
 				else {
-					err = g_error_new (HTTP_ERROR, 500 + priv->parser.http_errno,
+					err = g_error_new (HTTP_ERROR,
+							rspamd_http_connection_parser_error_code (conn),
 							"HTTP parser error: %s",
 							http_errno_description (priv->parser.http_errno));
 				}
@@ -979,7 +1204,10 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 			return;
 		}
 		else {
-			if (!priv->ssl) {
+			if (priv->h2 && errno == EAGAIN) {
+				/* Stream has no complete message yet */
+			}
+			else if (!priv->ssl) {
 				err = g_error_new (HTTP_ERROR,
 						errno,
 						"IO read error: %s",
@@ -999,9 +1227,16 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 		r = rspamd_http_try_read (fd, conn, priv, pbuf, &d);
 
 		if (r > 0) {
-			if (http_parser_execute (&priv->parser, &priv->parser_cb,
-					d, r) != (size_t)r || priv->parser.http_errno != 0) {
-				err = g_error_new (HTTP_ERROR, priv->parser.http_errno,
+			nparsed = http_parser_execute (&priv->parser, &priv->parser_cb,
+					d, r);
+
+			if (rspamd_http_connection_save_pipelined (priv, d, nparsed, r)) {
+				/* Next request is already here, it is parsed later */
+			}
+			else if (nparsed != (size_t)r || priv->parser.http_errno != 0) {
+				rspamd_http_connection_stop_keepalive (priv);
+				err = g_error_new (HTTP_ERROR,
+						rspamd_http_connection_parser_error_code (conn),
 						"HTTP parser error: %s",
 						http_errno_description (priv->parser.http_errno));
 
@@ -1236,6 +1471,62 @@ rspamd_http_connection_new_keepalive (struct rspamd_http_context *ctx,
 	return conn;
 }
 
+struct rspamd_http_connection *
+rspamd_http_connection_new_h2_stream (struct rspamd_http_context *ctx,
+									  struct rspamd_http2_stream *st,
+									  rspamd_http_body_handler_t body_handler,
+									  rspamd_http_error_handler_t error_handler,
+									  rspamd_http_finish_handler_t finish_handler,
+									  unsigned opts,
+									  enum rspamd_http_connection_type type)
+{
+	struct rspamd_http_connection *conn;
+
+	conn = rspamd_http_connection_new_common (ctx, -1, body_handler,
+			error_handler, finish_handler, opts, type, 0, NULL);
+	conn->priv->h2 = st;
+	rspamd_http2_stream_attach (st, conn);
+
+	return conn;
+}
+
+struct rspamd_http_connection *
+rspamd_http_connection_new_http2 (struct rspamd_http_context *ctx,
+								  rspamd_http_body_handler_t body_handler,
+								  rspamd_http_error_handler_t error_handler,
+								  rspamd_http_finish_handler_t finish_handler,
+								  rspamd_inet_addr_t *addr,
+								  const gchar *host)
+{
+	struct rspamd_http2_stream *st;
+
+	if (ctx == NULL) {
+		ctx = rspamd_http_context_default ();
+	}
+
+	st = rspamd_http2_client_stream_new (ctx, addr, host);
+
+	if (st == NULL) {
+		return NULL;
+	}
+
+	return rspamd_http_connection_new_h2_stream (ctx, st,
+			body_handler, error_handler, finish_handler,
+			RSPAMD_HTTP_CLIENT_SIMPLE, RSPAMD_HTTP_CLIENT);
+}
+
+void
+rspamd_http_connection_h2_notify (struct rspamd_http_connection *conn)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+	short what = priv->ev.io.events & (EV_READ|EV_WRITE);
+
+	/* Connection is not waiting for anything otherwise */
+	if (!IS_CONN_RESETED (priv) && !conn->finished && what != 0) {
+		ev_feed_event (priv->ctx->event_loop, &priv->ev.io, what);
+	}
+}
+
 void
 rspamd_http_connection_reset (struct rspamd_http_connection *conn)
 {
@@ -1270,10 +1561,15 @@ rspamd_http_connection_reset (struct rspamd_http_connection *conn)
 	}
 
 	if (priv->out != NULL) {
-		g_free (priv->out);
+		if (priv->out != priv->out_prealloc) {
+			g_free (priv->out);
+		}
+
 		priv->out = NULL;
 	}
 
+	priv->sf_len = 0;
+
 	priv->flags |= RSPAMD_HTTP_CONN_FLAG_RESETED;
 }
 
@@ -1448,6 +1744,14 @@ rspamd_http_connection_free (struct rspamd_http_connection *conn)
 			close (conn->fd);
 		}
 
+		if (priv->pipelined) {
+			rspamd_fstring_free (priv->pipelined);
+		}
+
+		if (priv->h2) {
+			rspamd_http2_stream_release (priv->h2);
+		}
+
 		g_free (priv);
 	}
 
@@ -1484,11 +1788,19 @@ rspamd_http_connection_read_message_common (struct rspamd_http_connection *conn,
 	REF_INIT_RETAIN (priv->buf, rspamd_http_privbuf_dtor);
 	priv->buf->data = rspamd_fstring_sized_new (8192);
 	priv->flags |= RSPAMD_HTTP_CONN_FLAG_NEW_HEADER;
+	/* Set when the request is read */
+	priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_KEEPALIVE;
 
 	rspamd_ev_watcher_init (&priv->ev, conn->fd, EV_READ,
 			rspamd_http_event_handler, conn);
 	rspamd_ev_watcher_start (priv->ctx->event_loop, &priv->ev, priv->timeout);
 
+	if ((priv->pipelined && priv->pipelined->len > 0) ||
+			(priv->h2 && rspamd_http2_stream_has_data (priv->h2))) {
+		/* Socket might have no more data, so do not wait for it */
+		ev_feed_event (priv->ctx->event_loop, &priv->ev.io, EV_READ);
+	}
+
 	priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_RESETED;
 }
 
@@ -1538,7 +1850,12 @@ rspamd_http_connection_encrypt_message (
 	 * Create segments from the following:
 	 * Method, [URL], CRLF, nheaders, CRLF, body
 	 */
-	segments = g_new (struct rspamd_cryptobox_segment, hdrcount + 5);
+	if (hdrcount + 5 <= RSPAMD_HTTP_PREALLOC_IOV) {
+		segments = g_alloca (sizeof (*segments) * (hdrcount + 5));
+	}
+	else {
+		segments = g_new (struct rspamd_cryptobox_segment, hdrcount + 5);
+	}
 
 	segments[0].data = pmethod;
 	segments[0].len = methodlen;
@@ -1609,7 +1926,9 @@ rspamd_http_connection_encrypt_message (
 
 	priv->wr_total = outlen;
 
-	g_free (segments);
+	if (hdrcount + 5 > RSPAMD_HTTP_PREALLOC_IOV) {
+		g_free (segments);
+	}
 }
 
 static void
@@ -1629,16 +1948,25 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 		struct rspamd_http_connection_private* priv,
 		struct rspamd_cryptobox_pubkey* peer_key)
 {
-	gchar datebuf[64];
+	/* Replies are usually sent within the same second */
+	static gchar datebuf[64];
+	static time_t last_date = (time_t)-1;
 	gint meth_len = 0;
 	const gchar *conn_type = "close";
 
 	if (conn->type == RSPAMD_HTTP_SERVER) {
+		if (priv->flags & RSPAMD_HTTP_CONN_FLAG_KEEPALIVE) {
+			conn_type = "keep-alive";
+		}
+
 		/* Format reply */
 		if (msg->method < HTTP_SYMBOLS) {
 			rspamd_ftok_t status;
 
-			rspamd_http_date_format (datebuf, sizeof (datebuf), msg->date);
+			if (msg->date != last_date) {
+				rspamd_http_date_format (datebuf, sizeof (datebuf), msg->date);
+				last_date = msg->date;
+			}
 
 			if (mime_type == NULL) {
 				mime_type =
@@ -1673,12 +2001,12 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 					meth_len =
 							rspamd_snprintf (repbuf, replen,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z\r\n"
 											"Content-Type: %s", /* NO \r\n at the end ! */
-									msg->code, &status, "rspamd/" RVERSION,
+									msg->code, &status, conn_type, "rspamd/" RVERSION,
 									datebuf,
 									bodylen, mime_type);
 				}
@@ -1686,11 +2014,11 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 					meth_len =
 							rspamd_snprintf (repbuf, replen,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z", /* NO \r\n at the end ! */
-									msg->code, &status, "rspamd/" RVERSION,
+									msg->code, &status, conn_type, "rspamd/" RVERSION,
 									datebuf,
 									bodylen);
 				}
@@ -1698,24 +2026,24 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 				/* External reply */
 				rspamd_printf_fstring (buf,
 						"HTTP/1.1 200 OK\r\n"
-						"Connection: close\r\n"
+						"Connection: %s\r\n"
 						"Server: rspamd\r\n"
 						"Date: %s\r\n"
 						"Content-Length: %z\r\n"
 						"Content-Type: application/octet-stream\r\n",
-						datebuf, enclen);
+						conn_type, datebuf, enclen);
 			}
 			else {
 				if (mime_type) {
 					meth_len =
 							rspamd_printf_fstring (buf,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z\r\n"
 											"Content-Type: %s\r\n",
-									msg->code, &status, "rspamd/" RVERSION,
+									msg->code, &status, conn_type, "rspamd/" RVERSION,
 									datebuf,
 									bodylen, mime_type);
 				}
@@ -1723,11 +2051,11 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 					meth_len =
 							rspamd_printf_fstring (buf,
 									"HTTP/1.1 %d %T\r\n"
-											"Connection: close\r\n"
+											"Connection: %s\r\n"
 											"Server: %s\r\n"
 											"Date: %s\r\n"
 											"Content-Length: %z\r\n",
-									msg->code, &status, "rspamd/" RVERSION,
+									msg->code, &status, conn_type, "rspamd/" RVERSION,
 									datebuf,
 									bodylen);
 				}
@@ -1907,6 +2235,8 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 	conn->ud = ud;
 	priv->msg = msg;
 	priv->timeout = timeout;
+	priv->sf_len = 0;
+	priv->sf_sent = 0;
 
 	priv->header = NULL;
 	priv->buf = g_malloc0 (sizeof (*priv->buf));
@@ -1922,15 +2252,22 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 
 	if (msg->peer_key != NULL) {
 		if (priv->local_key == NULL) {
-			/* Automatically generate a temporary keypair */
-			priv->local_key = rspamd_keypair_new (RSPAMD_KEYPAIR_KEX,
-					RSPAMD_CRYPTOBOX_MODE_25519);
+			if (conn->type == RSPAMD_HTTP_CLIENT &&
+					msg->peer_key->alg == RSPAMD_CRYPTOBOX_MODE_25519) {
+				/* Reuse session key to save public key operations */
+				priv->local_key = rspamd_http_context_client_keypair (priv->ctx);
+			}
+			else {
+				/* Automatically generate a temporary keypair */
+				priv->local_key = rspamd_keypair_new (RSPAMD_KEYPAIR_KEX,
+						RSPAMD_CRYPTOBOX_MODE_25519);
+			}
 		}
 
 		encrypted = TRUE;
 
 		if (priv->cache) {
-			rspamd_keypair_cache_process (priv->cache,
+			rspamd_http_context_process_keys (priv->ctx, priv->cache,
 					priv->local_key, priv->msg->peer_key);
 		}
 	}
@@ -2066,6 +2403,19 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 				if (msg->method == HTTP_INVALID) {
 					msg->method = HTTP_POST;
 				}
+
+#ifdef RSPAMD_HTTP_USE_SENDFILE
+				if ((msg->flags & RSPAMD_HTTP_FLAG_SHMEM) &&
+						!(msg->flags & RSPAMD_HTTP_FLAG_SSL) &&
+						priv->ssl == NULL && priv->h2 == NULL &&
+						msg->body_buf.c.shared.shm_fd != -1) {
+					/* Body is in a file, so it is not copied to userspace */
+					priv->sf_fd = msg->body_buf.c.shared.shm_fd;
+					priv->sf_offset = msg->body_buf.begin - msg->body_buf.str;
+					priv->sf_len = bodylen;
+					priv->outlen = 2;
+				}
+#endif
 			}
 		}
 		else if (msg->body_buf.len > 0) {
@@ -2099,7 +2449,14 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 	}
 
 	/* Allocate iov */
-	priv->out = g_malloc0 (sizeof (struct iovec) * priv->outlen);
+	if (priv->outlen <= G_N_ELEMENTS (priv->out_prealloc)) {
+		priv->out = priv->out_prealloc;
+		memset (priv->out, 0, sizeof (struct iovec) * priv->outlen);
+	}
+	else {
+		priv->out = g_malloc0 (sizeof (struct iovec) * priv->outlen);
+	}
+
 	priv->wr_pos = 0;
 
 	meth_len = rspamd_http_message_write_header (mime_type, encrypted,
@@ -2180,7 +2537,7 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 			priv->wr_total -= 2;
 		}
 
-		if (pbody != NULL) {
+		if (pbody != NULL && priv->sf_len == 0) {
 			priv->out[i].iov_base = pbody;
 			priv->out[i++].iov_len = bodylen;
 		}
@@ -2238,6 +2595,10 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 		rspamd_ev_watcher_init (&priv->ev, conn->fd, EV_WRITE,
 				rspamd_http_event_handler, conn);
 		rspamd_ev_watcher_start (priv->ctx->event_loop, &priv->ev, priv->timeout);
+
+		if (priv->h2) {
+			ev_feed_event (priv->ctx->event_loop, &priv->ev.io, EV_WRITE);
+		}
 	}
 }
 
@@ -2273,6 +2634,22 @@ rspamd_http_connection_set_max_size (struct rspamd_http_connection *conn,
 	conn->max_size = sz;
 }
 
+gboolean
+rspamd_http_connection_is_keepalive (struct rspamd_http_connection *conn)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+
+	return (priv->flags & RSPAMD_HTTP_CONN_FLAG_KEEPALIVE) ? TRUE : FALSE;
+}
+
+gsize
+rspamd_http_connection_get_sendfile_bytes (struct rspamd_http_connection *conn)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+
+	return priv->sf_sent;
+}
+
 void
 rspamd_http_connection_set_key (struct rspamd_http_connection *conn,
 		struct rspamd_cryptobox_keypair *key)
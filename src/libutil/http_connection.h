@@ -85,6 +85,8 @@ enum rspamd_http_options {
 	RSPAMD_HTTP_CLIENT_SHARED = 1u << 3, /**< Store reply in shared memory */
 	RSPAMD_HTTP_REQUIRE_ENCRYPTION = 1u << 4,
 	RSPAMD_HTTP_CLIENT_KEEP_ALIVE = 1u << 5,
+	RSPAMD_HTTP_SERVER_KEEP_ALIVE = 1u << 6, /**< Allow keep-alive and pipelined requests for server */
+	RSPAMD_HTTP_SERVER_MEMFD = 1u << 7, /**< Read large request bodies to anonymous memory files */
 };
 
 typedef int (*rspamd_http_body_handler_t) (struct rspamd_http_connection *conn,
@@ -153,6 +155,26 @@ struct rspamd_http_connection *rspamd_http_connection_new_keepalive (
 		rspamd_inet_addr_t *addr,
 		const gchar *host);
 
+/**
+ * Creates a client connection that is sent as a stream of HTTP/2 session
+ * (cleartext, prior knowledge), sessions are shared by all connections to
+ * the same address and host
+ * @param ctx
+ * @param body_handler
+ * @param error_handler
+ * @param finish_handler
+ * @param addr
+ * @param host
+ * @return
+ */
+struct rspamd_http_connection *rspamd_http_connection_new_http2 (
+		struct rspamd_http_context *ctx,
+		rspamd_http_body_handler_t body_handler,
+		rspamd_http_error_handler_t error_handler,
+		rspamd_http_finish_handler_t finish_handler,
+		rspamd_inet_addr_t *addr,
+		const gchar *host);
+
 /**
  * Creates an ordinary connection using the address specified (if proxy is not set)
  * @param ctx
@@ -296,4 +318,21 @@ void rspamd_http_connection_set_max_size (struct rspamd_http_connection *conn,
 
 void rspamd_http_connection_disable_encryption (struct rspamd_http_connection *conn);
 
+/**
+ * Returns TRUE if the last request received by a server connection allows
+ * keep-alive, so the connection could be used to read the next request
+ * after the reply is written
+ * @param conn
+ * @return
+ */
+gboolean rspamd_http_connection_is_keepalive (struct rspamd_http_connection *conn);
+
+/**
+ * Returns number of body bytes of the last written message that were sent
+ * by sendfile directly from the shared memory
+ * @param conn
+ * @return
+ */
+gsize rspamd_http_connection_get_sendfile_bytes (struct rspamd_http_connection *conn);
+
 #endif /* HTTP_H_ */
@@ -24,9 +24,13 @@
 #include "contrib/http-parser/http_parser.h"
 #include "rspamd.h"
 #include "libev_helper.h"
+#include "http2.h"
 
 INIT_LOG_MODULE(http_context)
 
+/* Rotation of the client keypair when neither timer nor limit is set */
+#define RSPAMD_HTTP_CLIENT_KEY_DEFAULT_MAX_USES 1024
+
 #define msg_debug_http_context(...)  rspamd_conditional_debug_fast (NULL, NULL, \
         rspamd_http_context_log_id, "http_context", NULL, \
         G_STRFUNC, \
@@ -68,18 +72,80 @@ static void
 rspamd_http_context_client_rotate_ev (struct ev_loop *loop, ev_timer *w, int revents)
 {
 	struct rspamd_http_context *ctx = (struct rspamd_http_context *)w->data;
-	gpointer kp;
+	guint64 hits = 0, misses = 0;
+	guint size = 0;
 
 	w->repeat = rspamd_time_jitter (ctx->config.client_key_rotate_time, 0);
-	msg_debug_http_context ("rotate local keypair, next rotate in %.0f seconds",
-			w->repeat);
+	msg_debug_http_context ("rotate local keypair after %ud uses, "
+			"next rotate in %.0f seconds",
+			ctx->client_kp_uses, w->repeat);
+
+	if (ctx->client_kp_cache) {
+		rspamd_keypair_cache_stat (ctx->client_kp_cache, &hits, &misses, &size);
+		msg_debug_http_context ("client keys cache: %ud elements, "
+				"%uL hits, %uL misses", size, hits, misses);
+	}
+
+	if (ctx->server_kp_cache) {
+		rspamd_keypair_cache_stat (ctx->server_kp_cache, &hits, &misses, &size);
+		msg_debug_http_context ("server keys cache: %ud elements, "
+				"%uL hits, %uL misses", size, hits, misses);
+	}
 
 	ev_timer_again (loop, w);
 
-	kp = ctx->client_kp;
-	ctx->client_kp = rspamd_keypair_new (RSPAMD_KEYPAIR_KEX,
-			RSPAMD_CRYPTOBOX_MODE_25519);
-	rspamd_keypair_unref (kp);
+	/* New keypair is generated on the next use */
+	if (ctx->client_kp) {
+		rspamd_keypair_unref (ctx->client_kp);
+		ctx->client_kp = NULL;
+	}
+}
+
+static gboolean
+rspamd_http_context_client_keypair_expired (struct rspamd_http_context *ctx)
+{
+	gdouble rotate_time = ctx->config.client_key_rotate_time;
+
+	if (ctx->config.client_key_max_uses > 0 &&
+			ctx->client_kp_uses >= ctx->config.client_key_max_uses) {
+		return TRUE;
+	}
+
+	if (ctx->event_loop != NULL && rotate_time > 0) {
+		/* Rotated by timer */
+		return FALSE;
+	}
+
+	/* No timer, so the keypair is checked on use */
+	if (rotate_time > 0 &&
+			rspamd_get_ticks (FALSE) - ctx->client_kp_ctime >= rotate_time) {
+		return TRUE;
+	}
+
+	return ctx->config.client_key_max_uses == 0 &&
+			ctx->client_kp_uses >= RSPAMD_HTTP_CLIENT_KEY_DEFAULT_MAX_USES;
+}
+
+struct rspamd_cryptobox_keypair *
+rspamd_http_context_client_keypair (struct rspamd_http_context *ctx)
+{
+	if (ctx->client_kp && rspamd_http_context_client_keypair_expired (ctx)) {
+		msg_debug_http_context ("rotate local keypair after %ud uses",
+				ctx->client_kp_uses);
+		rspamd_keypair_unref (ctx->client_kp);
+		ctx->client_kp = NULL;
+	}
+
+	if (ctx->client_kp == NULL) {
+		ctx->client_kp = rspamd_keypair_new (RSPAMD_KEYPAIR_KEX,
+				RSPAMD_CRYPTOBOX_MODE_25519);
+		ctx->client_kp_uses = 0;
+		ctx->client_kp_ctime = rspamd_get_ticks (FALSE);
+	}
+
+	ctx->client_kp_uses ++;
+
+	return rspamd_keypair_ref (ctx->client_kp);
 }
 
 static struct rspamd_http_context*
@@ -100,6 +166,7 @@ rspamd_http_context_new_default (struct rspamd_config *cfg,
 	ctx->config.client_key_rotate_time = default_rotate_time;
 	ctx->config.user_agent = default_user_agent;
 	ctx->config.keepalive_interval = default_keepalive_interval;
+	ctx->config.http2_max_streams = RSPAMD_HTTP2_DEFAULT_MAX_STREAMS;
 	ctx->ups_ctx = ups_ctx;
 
 	if (cfg) {
@@ -234,6 +301,14 @@ rspamd_http_context_create (struct rspamd_config *cfg,
 				ctx->config.client_key_rotate_time = ucl_object_todouble (rotate_time);
 			}
 
+			const ucl_object_t *rotate_messages;
+
+			rotate_messages = ucl_object_lookup (client_obj, "rotate_messages");
+
+			if (rotate_messages) {
+				ctx->config.client_key_max_uses = ucl_object_toint (rotate_messages);
+			}
+
 			const ucl_object_t *user_agent;
 
 			user_agent = ucl_object_lookup (client_obj, "user_agent");
@@ -265,13 +340,25 @@ rspamd_http_context_create (struct rspamd_config *cfg,
 		server_obj = ucl_object_lookup (http_obj, "server");
 
 		if (server_obj) {
-			const ucl_object_t *kp_size;
+			const ucl_object_t *kp_size, *http2, *max_streams;
 
 			kp_size = ucl_object_lookup (server_obj, "cache_size");
 
 			if (kp_size) {
 				ctx->config.kp_cache_size_server = ucl_object_toint (kp_size);
 			}
+
+			http2 = ucl_object_lookup (server_obj, "http2");
+
+			if (http2) {
+				ctx->config.server_http2 = ucl_object_toboolean (http2);
+			}
+
+			max_streams = ucl_object_lookup (server_obj, "max_streams");
+
+			if (max_streams) {
+				ctx->config.http2_max_streams = ucl_object_toint (max_streams);
+			}
 		}
 	}
 
@@ -296,13 +383,11 @@ rspamd_http_context_free (struct rspamd_http_context *ctx)
 		rspamd_keypair_cache_destroy (ctx->server_kp_cache);
 	}
 
-	if (ctx->config.client_key_rotate_time > 0) {
-		/* Event is removed on base event loop termination */
-		/* event_del (&ctx->client_rotate_ev); */
+	rspamd_http2_context_cleanup (ctx);
 
-		if (ctx->client_kp) {
-			rspamd_keypair_unref (ctx->client_kp);
-		}
+	/* Rotate event is removed on base event loop termination */
+	if (ctx->client_kp) {
+		rspamd_keypair_unref (ctx->client_kp);
 	}
 
 	struct rspamd_keepalive_hash_key *hk;
@@ -352,6 +437,33 @@ rspamd_http_context_default (void)
 	return default_ctx;
 }
 
+void
+rspamd_http_context_set_stat (struct rspamd_http_context *ctx,
+		struct rspamd_stat *stat)
+{
+	ctx->stat = stat;
+}
+
+void
+rspamd_http_context_process_keys (struct rspamd_http_context *ctx,
+		struct rspamd_keypair_cache *cache,
+		struct rspamd_cryptobox_keypair *lk,
+		struct rspamd_cryptobox_pubkey *rk)
+{
+	gboolean hit;
+
+	hit = rspamd_keypair_cache_process (cache, lk, rk);
+
+	if (ctx->stat) {
+		if (hit) {
+			RSPAMD_STAT_ADD (ctx->stat, keypair_cache_hits, 1);
+		}
+		else {
+			RSPAMD_STAT_ADD (ctx->stat, keypair_cache_misses, 1);
+		}
+	}
+}
+
 gint32
 rspamd_keep_alive_key_hash (struct rspamd_keepalive_hash_key *k)
 {
@@ -27,6 +27,7 @@ struct rspamd_http_context;
 struct rspamd_config;
 struct rspamd_http_message;
 struct upstream_ctx;
+struct rspamd_stat;
 
 struct rspamd_http_context_cfg {
 	guint kp_cache_size_client;
@@ -34,8 +35,11 @@ struct rspamd_http_context_cfg {
 	guint ssl_cache_size;
 	gdouble keepalive_interval;
 	gdouble client_key_rotate_time;
+	guint client_key_max_uses;
 	const gchar *user_agent;
 	const gchar *http_proxy;
+	gboolean server_http2;
+	guint http2_max_streams;
 };
 
 /**
@@ -59,6 +63,15 @@ void rspamd_http_context_free (struct rspamd_http_context *ctx);
 
 struct rspamd_http_context* rspamd_http_context_default (void);
 
+/**
+ * Sets process counters that are updated by the context, e.g. keys cache
+ * hits and misses
+ * @param ctx
+ * @param stat
+ */
+void rspamd_http_context_set_stat (struct rspamd_http_context *ctx,
+		struct rspamd_stat *stat);
+
 /**
  * Returns preserved keepalive connection if it's available.
  * Refcount is transferred to caller!
@@ -160,6 +160,12 @@ rspamd_http_message_get_flags (struct rspamd_http_message *msg)
 	return msg->flags;
 }
 
+gsize
+rspamd_http_message_get_body_copied (struct rspamd_http_message *msg)
+{
+	return msg->body_copied;
+}
+
 void
 rspamd_http_message_shmem_unref (struct rspamd_storage_shmem *p)
 {
@@ -302,6 +308,50 @@ rspamd_http_message_set_body_from_fd (struct rspamd_http_message *msg,
 	return TRUE;
 }
 
+gboolean
+rspamd_http_message_set_body_memfd (struct rspamd_http_message *msg,
+									gsize len)
+{
+#ifdef HAVE_MEMFD_CREATE
+	union _rspamd_storage_u *storage;
+	gint fd;
+
+	fd = memfd_create ("rspamd-http-body", MFD_CLOEXEC);
+
+	if (fd == -1) {
+		return FALSE;
+	}
+
+	if (ftruncate (fd, len) == -1) {
+		close (fd);
+
+		return FALSE;
+	}
+
+	rspamd_http_message_storage_cleanup (msg);
+
+	storage = &msg->body_buf.c;
+	msg->flags |= RSPAMD_HTTP_FLAG_SHMEM|RSPAMD_HTTP_FLAG_HAS_BODY;
+	/* Segment has no name, so it is never passed by the Shm header */
+	storage->shared.name = NULL;
+	storage->shared.shm_fd = fd;
+	msg->body_buf.str = mmap (NULL, len,
+			PROT_WRITE|PROT_READ, MAP_SHARED, fd, 0);
+
+	if (msg->body_buf.str == MAP_FAILED) {
+		return FALSE;
+	}
+
+	msg->body_buf.begin = msg->body_buf.str;
+	msg->body_buf.len = 0;
+	msg->body_buf.allocated_len = len;
+
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
 gboolean
 rspamd_http_message_set_body_from_fstring_steal (struct rspamd_http_message *msg,
 												 rspamd_fstring_t *fstr)
@@ -425,6 +475,8 @@ rspamd_http_message_append_body (struct rspamd_http_message *msg,
 		msg->body_buf.allocated_len = storage->normal->allocated;
 	}
 
+	msg->body_copied += len;
+
 	return TRUE;
 }
 
@@ -110,6 +110,17 @@ void rspamd_http_message_set_method (struct rspamd_http_message *msg,
 gboolean rspamd_http_message_set_body_from_fd (struct rspamd_http_message *msg,
 											   gint fd);
 
+/**
+ * Allocates message's body of the specified size in an anonymous memory
+ * file, so it could be read in place and sent by sendfile without copying
+ * @param msg
+ * @param len
+ * @return TRUE if a message's body has been allocated, FALSE if memory
+ * files are not supported
+ */
+gboolean rspamd_http_message_set_body_memfd (struct rspamd_http_message *msg,
+											 gsize len);
+
 /**
  * Uses rspamd_fstring_t as message's body, string is consumed by this operation
  * @param msg
@@ -218,4 +229,12 @@ void rspamd_http_message_shmem_unref (struct rspamd_storage_shmem *p);
  */
 guint rspamd_http_message_get_flags (struct rspamd_http_message *msg);
 
+/**
+ * Returns number of bytes that were copied to the message body when it was
+ * read, e.g. leftovers from the headers buffer or chunked encoding data
+ * @param msg
+ * @return
+ */
+gsize rspamd_http_message_get_body_copied (struct rspamd_http_message *msg);
+
 #endif
@@ -75,6 +75,8 @@ struct rspamd_http_message {
 	gint code;
 	enum http_method method;
 	gint flags;
+	/* Bytes copied to the body buffer instead of reading them in place */
+	gsize body_copied;
 	ref_entry_t ref;
 };
 
@@ -95,6 +97,8 @@ struct rspamd_http_context {
 	struct rspamd_http_context_cfg config;
 	struct rspamd_keypair_cache *client_kp_cache;
 	struct rspamd_cryptobox_keypair *client_kp;
+	guint client_kp_uses;
+	gdouble client_kp_ctime;
 	struct rspamd_keypair_cache *server_kp_cache;
 	struct upstream_ctx *ups_ctx;
 	struct upstream_list *http_proxies;
@@ -103,11 +107,92 @@ struct rspamd_http_context {
 	struct ev_loop *event_loop;
 	ev_timer client_rotate_ev;
 	khash_t (rspamd_keep_alive_hash) *keep_alive_hash;
+	/* Client HTTP/2 sessions */
+	GQueue http2_sessions;
+	/* Process counters, if any */
+	struct rspamd_stat *stat;
 };
 
 #define HTTP_ERROR http_error_quark ()
 GQuark http_error_quark (void);
 
+/**
+ * Returns shared local keypair for encrypted client connections, so the
+ * shared secret is reused (on both sides) until the keypair is rotated
+ * @param ctx
+ * @return referenced keypair
+ */
+struct rspamd_cryptobox_keypair *rspamd_http_context_client_keypair (
+		struct rspamd_http_context *ctx);
+
+/**
+ * Sets shared secret for the keys using the cache and counts cache hits
+ * @param ctx
+ * @param cache
+ * @param lk local key
+ * @param rk remote key
+ */
+void rspamd_http_context_process_keys (struct rspamd_http_context *ctx,
+		struct rspamd_keypair_cache *cache,
+		struct rspamd_cryptobox_keypair *lk,
+		struct rspamd_cryptobox_pubkey *rk);
+
+const gchar *rspamd_http_code_to_str (gint code);
+
+/*
+ * HTTP/2 streams used by connections instead of sockets
+ */
+struct rspamd_http2_stream;
+
+/**
+ * Creates connection that reads and writes messages using HTTP/2 stream
+ */
+struct rspamd_http_connection *rspamd_http_connection_new_h2_stream (
+		struct rspamd_http_context *ctx,
+		struct rspamd_http2_stream *st,
+		rspamd_http_body_handler_t body_handler,
+		rspamd_http_error_handler_t error_handler,
+		rspamd_http_finish_handler_t finish_handler,
+		unsigned opts,
+		enum rspamd_http_connection_type type);
+
+/**
+ * Wakes up connection when stream has new data or has been reset
+ */
+void rspamd_http_connection_h2_notify (struct rspamd_http_connection *conn);
+
+/**
+ * Opens a new stream in HTTP/2 session to the specified address, session
+ * is reused if it already exists
+ * @return stream or NULL if connection has failed
+ */
+struct rspamd_http2_stream *rspamd_http2_client_stream_new (
+		struct rspamd_http_context *ctx,
+		const rspamd_inet_addr_t *addr, const gchar *host);
+void rspamd_http2_stream_attach (struct rspamd_http2_stream *st,
+		struct rspamd_http_connection *conn);
+/**
+ * Reads HTTP/1.1 representation of the received message
+ * @return -1 with EAGAIN if message is not received yet
+ */
+gssize rspamd_http2_stream_read (struct rspamd_http2_stream *st,
+		gchar *buf, gsize len);
+gboolean rspamd_http2_stream_has_data (struct rspamd_http2_stream *st);
+/**
+ * Converts HTTP/1.1 message to HTTP/2 frames
+ * @return number of bytes consumed (always all of them) or -1
+ */
+gssize rspamd_http2_stream_writev (struct rspamd_http2_stream *st,
+		const struct iovec *iov, guint niov);
+/**
+ * Called when connection does not need stream anymore
+ */
+void rspamd_http2_stream_release (struct rspamd_http2_stream *st);
+/**
+ * Closes client HTTP/2 sessions
+ */
+void rspamd_http2_context_cleanup (struct rspamd_http_context *ctx);
+
 void rspamd_http_message_storage_cleanup (struct rspamd_http_message *msg);
 gboolean rspamd_http_message_grow_body (struct rspamd_http_message *msg,
 										gsize len);
@@ -17,6 +17,7 @@
 #include "libutil/http_router.h"
 #include "libutil/http_connection.h"
 #include "libutil/http_private.h"
+#include "libutil/http2.h"
 #include "libutil/regexp.h"
 #include "libutil/printf.h"
 #include "libutil/logger.h"
@@ -52,7 +53,10 @@ static void
 rspamd_http_entry_free (struct rspamd_http_connection_entry *entry)
 {
 	if (entry != NULL) {
-		close (entry->conn->fd);
+		if (entry->conn->fd != -1) {
+			close (entry->conn->fd);
+		}
+
 		rspamd_http_connection_unref (entry->conn);
 		if (entry->rt->finish_handler) {
 			entry->rt->finish_handler (entry);
@@ -513,6 +517,83 @@ rspamd_http_router_handle_socket (struct rspamd_http_connection_router *router,
 	DL_PREPEND (router->conns, conn);
 }
 
+struct rspamd_http_router_http2_cbdata {
+	struct rspamd_http_connection_router *rt;
+	struct rspamd_http2_session *session;
+	rspamd_http_router_stream_ud_t stream_ud;
+	gpointer ud;
+	GDestroyNotify ud_dtor;
+};
+
+static void
+rspamd_http_router_http2_stream (struct rspamd_http2_session *session,
+		struct rspamd_http_connection *conn,
+		gpointer ud)
+{
+	struct rspamd_http_router_http2_cbdata *cbd =
+			(struct rspamd_http_router_http2_cbdata *)ud;
+	struct rspamd_http_connection_entry *entry;
+
+	entry = g_malloc0 (sizeof (struct rspamd_http_connection_entry));
+	entry->rt = cbd->rt;
+	entry->ud = cbd->stream_ud (cbd->ud);
+	entry->is_reply = FALSE;
+	entry->conn = conn;
+
+	rspamd_http_connection_read_message (conn, entry, cbd->rt->timeout);
+	DL_PREPEND (cbd->rt->conns, entry);
+}
+
+static void
+rspamd_http_router_http2_fin (struct rspamd_http2_session *session,
+		gpointer ud)
+{
+	struct rspamd_http_router_http2_cbdata *cbd =
+			(struct rspamd_http_router_http2_cbdata *)ud;
+
+	g_queue_remove (&cbd->rt->http2_sessions, cbd);
+
+	if (cbd->ud_dtor) {
+		cbd->ud_dtor (cbd->ud);
+	}
+
+	g_free (cbd);
+}
+
+void
+rspamd_http_router_handle_http2_socket (
+		struct rspamd_http_connection_router *router,
+		gint fd,
+		rspamd_http_router_stream_ud_t stream_ud,
+		gpointer ud,
+		GDestroyNotify ud_dtor)
+{
+	struct rspamd_http_router_http2_cbdata *cbd;
+
+	g_assert (stream_ud != NULL);
+
+	cbd = g_malloc0 (sizeof (*cbd));
+	cbd->rt = router;
+	cbd->stream_ud = stream_ud;
+	cbd->ud = ud;
+	cbd->ud_dtor = ud_dtor;
+	cbd->session = rspamd_http2_session_new_server (router->ctx, fd,
+			router->timeout,
+			NULL,
+			rspamd_http_router_error_handler,
+			rspamd_http_router_finish_handler,
+			0,
+			rspamd_http_router_http2_stream,
+			rspamd_http_router_http2_fin,
+			cbd);
+
+	if (router->key) {
+		rspamd_http2_session_set_key (cbd->session, router->key);
+	}
+
+	g_queue_push_tail (&router->http2_sessions, cbd);
+}
+
 void
 rspamd_http_router_free (struct rspamd_http_connection_router *router)
 {
@@ -525,6 +606,14 @@ rspamd_http_router_free (struct rspamd_http_connection_router *router)
 			rspamd_http_entry_free (conn);
 		}
 
+		while (router->http2_sessions.length > 0) {
+			struct rspamd_http_router_http2_cbdata *cbd;
+
+			/* Removes itself from the queue */
+			cbd = g_queue_peek_head (&router->http2_sessions);
+			rspamd_http2_session_close (cbd->session);
+		}
+
 		if (router->key) {
 			rspamd_keypair_unref (router->key);
 		}
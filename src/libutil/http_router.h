@@ -28,6 +28,8 @@ typedef int (*rspamd_http_router_handler_t) (struct rspamd_http_connection_entry
 typedef void (*rspamd_http_router_error_handler_t) (struct rspamd_http_connection_entry *conn_ent,
 													GError *err);
 typedef void (*rspamd_http_router_finish_handler_t) (struct rspamd_http_connection_entry *conn_ent);
+/* Returns opaque data for a new HTTP/2 stream */
+typedef gpointer (*rspamd_http_router_stream_ud_t) (gpointer ud);
 
 
 struct rspamd_http_connection_entry {
@@ -52,6 +54,8 @@ struct rspamd_http_connection_router {
 	struct rspamd_cryptobox_keypair *key;
 	rspamd_http_router_error_handler_t error_handler;
 	rspamd_http_router_finish_handler_t finish_handler;
+	/* HTTP/2 sessions */
+	GQueue http2_sessions;
 };
 
 /**
@@ -128,6 +132,22 @@ void rspamd_http_router_handle_socket (
 		gint fd,
 		gpointer ud);
 
+/**
+ * Handle new accepted socket that uses HTTP/2, each stream is handled as
+ * a separate connection
+ * @param router router object
+ * @param fd server socket
+ * @param stream_ud creates opaque userdata for each stream from `ud`
+ * @param ud opaque userdata of the socket
+ * @param ud_dtor called for `ud` when the socket is closed
+ */
+void rspamd_http_router_handle_http2_socket (
+		struct rspamd_http_connection_router *router,
+		gint fd,
+		rspamd_http_router_stream_ud_t stream_ud,
+		gpointer ud,
+		GDestroyNotify ud_dtor);
+
 /**
  * Free router and all connections associated
  * @param router
@@ -67,7 +67,11 @@ rspamd_ev_watcher_start (struct ev_loop *loop,
 	g_assert (ev->cb != NULL);
 
 	ev->last_activity = ev_now (EV_A);
-	ev_io_start (EV_A_ &ev->io);
+
+	/* Watchers without fd are used as timers with fed IO events */
+	if (ev->io.fd >= 0) {
+		ev_io_start (EV_A_ &ev->io);
+	}
 
 	if (timeout > 0) {
 		ev->timeout = timeout;
@@ -99,11 +103,13 @@ rspamd_ev_watcher_reschedule (struct ev_loop *loop,
 	if (ev_is_pending (&ev->io) || ev_is_active (&ev->io)) {
 		ev_io_stop (EV_A_ &ev->io);
 		ev_io_set (&ev->io, ev->io.fd, what);
-		ev_io_start (EV_A_ &ev->io);
 	}
 	else {
 		ev->io.data = ev;
 		ev_io_init (&ev->io, rspamd_ev_watcher_io_cb, ev->io.fd, what);
+	}
+
+	if (ev->io.fd >= 0) {
 		ev_io_start (EV_A_ &ev->io);
 	}
 
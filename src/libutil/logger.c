@@ -113,6 +113,10 @@ static const gchar lf_chr = '\n';
 
 static rspamd_logger_t *default_logger = NULL;
 static struct rspamd_log_modules *log_modules = NULL;
+/* Maps could be loaded by a pool of threads, so messages are serialised */
+G_LOCK_DEFINE_STATIC (log_lock);
+/* Debug modules could be registered by the first message of a module */
+G_LOCK_DEFINE_STATIC (log_modules_lock);
 
 static void syslog_log_function (const gchar *module,
 		const gchar *id, const gchar *function,
@@ -709,6 +713,7 @@ rspamd_common_logv (rspamd_logger_t *rspamd_log, gint level_flags,
 
 		if (rspamd_logger_need_log (rspamd_log, level_flags, mod_id)) {
 			end = rspamd_vsnprintf (logbuf, sizeof (logbuf), fmt, args);
+			G_LOCK (log_lock);
 
 			if ((level_flags & RSPAMD_LOG_ENCRYPTED) && rspamd_log->pk) {
 				gchar *encrypted;
@@ -747,6 +752,8 @@ rspamd_common_logv (rspamd_logger_t *rspamd_log, gint level_flags,
 			default:
 				break;
 			}
+
+			G_UNLOCK (log_lock);
 		}
 	}
 }
@@ -1240,6 +1247,7 @@ rspamd_conditional_debug (rspamd_logger_t *rspamd_log,
 			}
 		}
 
+		G_LOCK (log_lock);
 		va_start (vp, fmt);
 		end = rspamd_vsnprintf (logbuf, sizeof (logbuf), fmt, vp);
 		*end = '\0';
@@ -1249,6 +1257,7 @@ rspamd_conditional_debug (rspamd_logger_t *rspamd_log,
 				G_LOG_LEVEL_DEBUG | RSPAMD_LOG_FORCED,
 				logbuf,
 				rspamd_log);
+		G_UNLOCK (log_lock);
 	}
 }
 
@@ -1275,6 +1284,7 @@ rspamd_conditional_debug_fast (rspamd_logger_t *rspamd_log,
 			}
 		}
 
+		G_LOCK (log_lock);
 		va_start (vp, fmt);
 		end = rspamd_vsnprintf (logbuf, sizeof (logbuf), fmt, vp);
 		*end = '\0';
@@ -1284,6 +1294,7 @@ rspamd_conditional_debug_fast (rspamd_logger_t *rspamd_log,
 				G_LOG_LEVEL_DEBUG | RSPAMD_LOG_FORCED,
 				logbuf,
 				rspamd_log);
+		G_UNLOCK (log_lock);
 	}
 }
 
@@ -1300,11 +1311,13 @@ rspamd_glib_log_function (const gchar *log_domain,
 
 	if (rspamd_log->enabled &&
 			rspamd_logger_need_log (rspamd_log, log_level, -1)) {
+		G_LOCK (log_lock);
 		rspamd_log->log_func ("glib", NULL,
 				NULL,
 				log_level,
 				message,
 				rspamd_log);
+		G_UNLOCK (log_lock);
 	}
 }
 
@@ -1436,10 +1449,16 @@ rspamd_logger_allocate_mod_bit (void)
 		return log_modules->bitset_len - 1;
 	}
 	else {
-		/* Need to expand */
+		guchar *nbitset;
+
+		/*
+		 * Need to expand: bitset is checked without locking, so the old one
+		 * is never freed, it is tiny and expanded just a few times
+		 */
+		nbitset = g_malloc0 (log_modules->bitset_allocated * 2);
+		memcpy (nbitset, log_modules->bitset, log_modules->bitset_allocated);
 		log_modules->bitset_allocated *= 2;
-		log_modules->bitset = g_realloc (log_modules->bitset,
-				log_modules->bitset_allocated);
+		g_atomic_pointer_set (&log_modules->bitset, nbitset);
 
 		return rspamd_logger_allocate_mod_bit ();
 	}
@@ -1454,6 +1473,8 @@ rspamd_logger_add_debug_module (const gchar *mname)
 		return (guint)-1;
 	}
 
+	G_LOCK (log_modules_lock);
+
 	if (log_modules == NULL) {
 		log_modules = g_malloc0 (sizeof (*log_modules));
 		log_modules->modules = g_hash_table_new (rspamd_strcase_hash,
@@ -1471,6 +1492,8 @@ rspamd_logger_add_debug_module (const gchar *mname)
 		g_hash_table_insert (log_modules->modules, m->mname, m);
 	}
 
+	G_UNLOCK (log_modules_lock);
+
 	return m->id;
 }
 
@@ -19,11 +19,14 @@
 #include "config.h"
 #include "map.h"
 #include "map_private.h"
+#include "map_helpers.h"
+#include "regexp.h"
 #include "http_connection.h"
 #include "http_private.h"
 #include "rspamd.h"
 #include "contrib/zstd/zstd.h"
 #include "contrib/libev/ev.h"
+#include <zlib.h>
 
 #undef MAP_DEBUG_REFS
 #ifdef MAP_DEBUG_REFS
@@ -45,6 +48,7 @@ static void free_http_cbdata_common (struct http_callback_data *cbd,
 									 gboolean plan_new);
 static void free_http_cbdata_dtor (gpointer p);
 static void free_http_cbdata (struct http_callback_data *cbd);
+static void rspamd_map_decoder_free (struct rspamd_map_decoder *dec);
 static void rspamd_map_process_periodic (struct map_periodic_cbdata *cbd);
 static void rspamd_map_schedule_periodic (struct rspamd_map *map, gboolean locked,
 										  gboolean initial, gboolean errored);
@@ -60,6 +64,7 @@ static gboolean rspamd_map_save_http_cached_file (struct rspamd_map *map,
 												  gsize len);
 
 guint rspamd_map_log_id = (guint)-1;
+guint rspamd_map_stat_shard = 0;
 RSPAMD_CONSTRUCTOR(rspamd_map_log_init)
 {
 	rspamd_map_log_id = rspamd_logger_add_debug_module("map");
@@ -264,6 +269,10 @@ free_http_cbdata_common (struct http_callback_data *cbd, gboolean plan_new)
 		rspamd_pubkey_unref (cbd->pk);
 	}
 
+	if (cbd->decoder) {
+		rspamd_map_decoder_free (cbd->decoder);
+	}
+
 	if (cbd->conn) {
 		rspamd_http_connection_unref (cbd->conn);
 		cbd->conn = NULL;
@@ -284,6 +293,233 @@ free_http_cbdata_common (struct http_callback_data *cbd, gboolean plan_new)
 	g_free (cbd);
 }
 
+/*
+ * Streaming decoder for compressed maps: data is decompressed to a bounded
+ * buffer that is passed to the map parser chunk by chunk, so the whole
+ * uncompressed map is never stored in memory
+ */
+#define RSPAMD_MAP_DECODER_BUFLEN (1024 * 1024)
+
+struct rspamd_map_decoder {
+	enum rspamd_map_compression type;
+	struct rspamd_map *map;
+	struct map_periodic_cbdata *periodic;
+	ZSTD_DStream *zstream;
+	z_stream gz;
+	gchar *buf;
+	gsize buflen;
+	gsize pos;
+	gsize total_in;
+	gsize total_out;
+};
+
+static struct rspamd_map_decoder *
+rspamd_map_decoder_new (struct rspamd_map *map,
+		enum rspamd_map_compression type,
+		struct map_periodic_cbdata *periodic)
+{
+	struct rspamd_map_decoder *dec;
+
+	dec = g_malloc0 (sizeof (*dec));
+	dec->type = type;
+	dec->map = map;
+	dec->periodic = periodic;
+
+	switch (type) {
+	case RSPAMD_MAP_COMPRESSION_ZSTD:
+		dec->zstream = ZSTD_createDStream ();
+		ZSTD_initDStream (dec->zstream);
+		break;
+	case RSPAMD_MAP_COMPRESSION_GZIP:
+		/* Gzip header is expected */
+		if (inflateInit2 (&dec->gz, MAX_WBITS + 16) != Z_OK) {
+			msg_err_map ("cannot init gzip decompression: %s",
+					dec->gz.msg ? dec->gz.msg : "unknown error");
+			g_free (dec);
+
+			return NULL;
+		}
+		break;
+	default:
+		g_assert_not_reached ();
+	}
+
+	dec->buflen = RSPAMD_MAP_DECODER_BUFLEN;
+	dec->buf = g_malloc (dec->buflen);
+
+	return dec;
+}
+
+static void
+rspamd_map_decoder_free (struct rspamd_map_decoder *dec)
+{
+	if (dec) {
+		if (dec->type == RSPAMD_MAP_COMPRESSION_ZSTD) {
+			ZSTD_freeDStream (dec->zstream);
+		}
+		else {
+			inflateEnd (&dec->gz);
+		}
+
+		g_free (dec->buf);
+		g_free (dec);
+	}
+}
+
+/* Passes decompressed data to the parser and keeps an unparsed tail */
+static void
+rspamd_map_decoder_flush (struct rspamd_map_decoder *dec, gboolean final)
+{
+	gchar *end = dec->buf + dec->pos, *p;
+	gsize remain;
+
+	p = dec->map->read_callback (dec->buf, dec->pos, &dec->periodic->cbdata,
+			final);
+	dec->periodic->streamed = TRUE;
+
+	if (!final && p && p >= dec->buf && p < end) {
+		remain = end - p;
+
+		if (p > dec->buf) {
+			memmove (dec->buf, p, remain);
+		}
+
+		dec->pos = remain;
+
+		if (remain == dec->buflen) {
+			/* Too large element */
+			dec->buflen *= 2;
+			dec->buf = g_realloc (dec->buf, dec->buflen);
+		}
+	}
+	else {
+		dec->pos = 0;
+	}
+}
+
+static gboolean
+rspamd_map_decoder_feed (struct rspamd_map_decoder *dec,
+		const guchar *in, gsize inlen)
+{
+	struct rspamd_map *map = dec->map;
+	ZSTD_inBuffer zin;
+	ZSTD_outBuffer zout;
+	gboolean full;
+	gsize r, prev;
+	gint ret;
+
+	dec->total_in += inlen;
+
+	if (dec->type == RSPAMD_MAP_COMPRESSION_ZSTD) {
+		zin.src = in;
+		zin.size = inlen;
+		zin.pos = 0;
+
+		for (;;) {
+			zout.dst = dec->buf;
+			zout.size = dec->buflen;
+			zout.pos = dec->pos;
+			prev = dec->pos;
+
+			r = ZSTD_decompressStream (dec->zstream, &zout, &zin);
+
+			if (ZSTD_isError (r)) {
+				msg_err_map ("cannot decompress data: %s",
+						ZSTD_getErrorName (r));
+
+				return FALSE;
+			}
+
+			dec->pos = zout.pos;
+			dec->total_out += zout.pos - prev;
+			/* Decoder might have more data buffered if output is full */
+			full = zout.pos == zout.size;
+
+			if (full) {
+				rspamd_map_decoder_flush (dec, FALSE);
+			}
+			else if (zin.pos == zin.size) {
+				break;
+			}
+		}
+	}
+	else {
+		dec->gz.next_in = (Bytef *)in;
+		dec->gz.avail_in = inlen;
+
+		for (;;) {
+			dec->gz.next_out = (Bytef *)dec->buf + dec->pos;
+			dec->gz.avail_out = dec->buflen - dec->pos;
+			prev = dec->pos;
+
+			ret = inflate (&dec->gz, Z_NO_FLUSH);
+
+			if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+				msg_err_map ("cannot decompress data: %s",
+						dec->gz.msg ? dec->gz.msg : zError (ret));
+
+				return FALSE;
+			}
+
+			dec->pos = dec->buflen - dec->gz.avail_out;
+			dec->total_out += dec->pos - prev;
+			full = dec->gz.avail_out == 0;
+
+			if (full) {
+				rspamd_map_decoder_flush (dec, FALSE);
+			}
+			else if (ret == Z_STREAM_END && dec->gz.avail_in > 0) {
+				/* Concatenated gzip members */
+				inflateReset (&dec->gz);
+			}
+			else if (dec->gz.avail_in == 0 || ret != Z_OK) {
+				break;
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_map_decoder_finish (struct rspamd_map_decoder *dec)
+{
+	rspamd_map_decoder_flush (dec, TRUE);
+}
+
+/* Decodes the whole buffer, returns size of the uncompressed data */
+static gboolean
+rspamd_map_decode_buffer (struct rspamd_map *map,
+		enum rspamd_map_compression type,
+		const guchar *in, gsize len,
+		struct map_periodic_cbdata *periodic,
+		gsize *outlen)
+{
+	struct rspamd_map_decoder *dec;
+
+	dec = rspamd_map_decoder_new (map, type, periodic);
+
+	if (dec == NULL) {
+		return FALSE;
+	}
+
+	if (!rspamd_map_decoder_feed (dec, in, len)) {
+		rspamd_map_decoder_free (dec);
+
+		return FALSE;
+	}
+
+	rspamd_map_decoder_finish (dec);
+
+	if (outlen) {
+		*outlen = dec->total_out;
+	}
+
+	rspamd_map_decoder_free (dec);
+
+	return TRUE;
+}
+
 static void
 free_http_cbdata (struct http_callback_data *cbd)
 {
@@ -339,6 +575,53 @@ http_map_error (struct rspamd_http_connection *conn,
 	MAP_RELEASE (cbd, "http_callback_data");
 }
 
+/*
+ * Unsigned compressed maps are decompressed and parsed as data arrives,
+ * compressed body is still stored in shared memory to be cached
+ */
+static inline gboolean
+rspamd_map_http_can_stream (struct rspamd_map_backend *bk, gboolean check)
+{
+	return !check && !bk->is_signed &&
+			bk->compression != RSPAMD_MAP_COMPRESSION_NONE;
+}
+
+static int
+http_map_body_chunk (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg,
+		const gchar *chunk,
+		gsize len)
+{
+	struct http_callback_data *cbd = conn->ud;
+	struct rspamd_map *map;
+
+	map = cbd->map;
+
+	if (msg->code != 200 || cbd->stage != map_load_file ||
+			!rspamd_map_http_can_stream (cbd->bk, cbd->check)) {
+		return 0;
+	}
+
+	if (cbd->decoder == NULL) {
+		cbd->decoder = rspamd_map_decoder_new (map, cbd->bk->compression,
+				cbd->periodic);
+
+		if (cbd->decoder == NULL) {
+			return -1;
+		}
+	}
+
+	if (!rspamd_map_decoder_feed (cbd->decoder, chunk, len)) {
+		msg_err_map ("%s(%s): cannot decode map data",
+				cbd->bk->uri,
+				rspamd_inet_address_to_string_pretty (cbd->addr));
+
+		return -1;
+	}
+
+	return 0;
+}
+
 static void
 rspamd_map_cache_cb (struct ev_loop *loop, ev_timer *w, int revents)
 {
@@ -717,61 +1000,37 @@ read_data:
 		}
 
 
-		if (cbd->bk->is_compressed) {
-			ZSTD_DStream *zstream;
-			ZSTD_inBuffer zin;
-			ZSTD_outBuffer zout;
-			guchar *out;
-			gsize outlen, r;
-
-			zstream = ZSTD_createDStream ();
-			ZSTD_initDStream (zstream);
-
-			zin.pos = 0;
-			zin.src = in;
-			zin.size = dlen;
-
-			if ((outlen = ZSTD_getDecompressedSize (zin.src, zin.size)) == 0) {
-				outlen = ZSTD_DStreamOutSize ();
-			}
-
-			out = g_malloc (outlen);
-
-			zout.dst = out;
-			zout.pos = 0;
-			zout.size = outlen;
-
-			while (zin.pos < zin.size) {
-				r = ZSTD_decompressStream (zstream, &zout, &zin);
-
-				if (ZSTD_isError (r)) {
-					msg_err_map ("%s(%s): cannot decompress data: %s",
-							cbd->bk->uri,
-							rspamd_inet_address_to_string_pretty (cbd->addr),
-							ZSTD_getErrorName (r));
-					ZSTD_freeDStream (zstream);
-					g_free (out);
-					MAP_RELEASE (cbd->shmem_data, "shmem_data");
-					goto err;
-				}
-
-				if (zout.pos == zout.size) {
-					/* We need to extend output buffer */
-					zout.size = zout.size * 1.5 + 1.0;
-					out = g_realloc (zout.dst, zout.size);
-					zout.dst = out;
-				}
+		if (cbd->decoder) {
+			/* Data has been already parsed while reading */
+			rspamd_map_decoder_finish (cbd->decoder);
+			msg_info_map ("%s(%s): read map data %z bytes compressed, "
+					"%z uncompressed, next check at %s",
+					cbd->bk->uri,
+					rspamd_inet_address_to_string_pretty (cbd->addr),
+					dlen, cbd->decoder->total_out, next_check_date);
+			rspamd_map_save_http_cached_file (map, bk, cbd->data, in,
+					cbd->data_len);
+		}
+		else if (cbd->bk->compression != RSPAMD_MAP_COMPRESSION_NONE) {
+			gsize outlen = 0;
+
+			if (!rspamd_map_decode_buffer (map, cbd->bk->compression,
+					in, cbd->data_len, cbd->periodic, &outlen)) {
+				msg_err_map ("%s(%s): cannot decompress data",
+						cbd->bk->uri,
+						rspamd_inet_address_to_string_pretty (cbd->addr));
+				MAP_RELEASE (cbd->shmem_data, "shmem_data");
+				munmap (in, dlen);
+				goto err;
 			}
 
-			ZSTD_freeDStream (zstream);
 			msg_info_map ("%s(%s): read map data %z bytes compressed, "
 					"%z uncompressed, next check at %s",
 					cbd->bk->uri,
 					rspamd_inet_address_to_string_pretty (cbd->addr),
-					dlen, zout.pos, next_check_date);
-			map->read_callback (out, zout.pos, &cbd->periodic->cbdata, TRUE);
-			rspamd_map_save_http_cached_file (map, bk, cbd->data, out, zout.pos);
-			g_free (out);
+					dlen, outlen, next_check_date);
+			rspamd_map_save_http_cached_file (map, bk, cbd->data, in,
+					cbd->data_len);
 		}
 		else {
 			msg_info_map ("%s(%s): read map data %z bytes, next check at %s",
@@ -931,6 +1190,110 @@ read_map_file_chunks (struct rspamd_map *map, struct map_cb_data *cbdata,
 	return TRUE;
 }
 
+#define RSPAMD_MAP_DELTA_TAIL_LEN 4096
+
+static guint64
+rspamd_map_file_tail_hash (const guchar *bytes, goffset off)
+{
+	goffset start = off > RSPAMD_MAP_DELTA_TAIL_LEN ?
+			off - RSPAMD_MAP_DELTA_TAIL_LEN : 0;
+
+	return rspamd_cryptobox_fast_hash (bytes + start, off - start,
+			rspamd_hash_seed ());
+}
+
+/*
+ * Remembers the position of the data that has been read, so the lines
+ * appended later could be applied as changes
+ */
+static void
+rspamd_map_file_save_delta_state (struct rspamd_map *map,
+		struct file_map_data *data, struct stat *st)
+{
+	guchar *bytes;
+	gsize len;
+
+	data->delta_offset = 0;
+
+	if (st->st_size == 0) {
+		return;
+	}
+
+	bytes = rspamd_file_xmap (data->filename, PROT_READ, &len, TRUE);
+
+	if (bytes == NULL) {
+		return;
+	}
+
+	if (len >= (gsize)st->st_size) {
+		data->delta_offset = st->st_size;
+		data->delta_ino = st->st_ino;
+		data->delta_tail_hash = rspamd_map_file_tail_hash (bytes,
+				data->delta_offset);
+	}
+
+	munmap (bytes, len);
+}
+
+/*
+ * Applies lines appended to the file since the previous read to the current
+ * map data. Returns FALSE if the whole file should be read instead.
+ */
+static gboolean
+read_map_file_delta (struct rspamd_map *map, struct file_map_data *data,
+		struct map_periodic_cbdata *periodic, struct stat *st)
+{
+	guchar *bytes, *end;
+	gsize len, dlen;
+
+	if (data->delta_offset == 0 || data->delta_ino != st->st_ino ||
+			st->st_size < data->delta_offset) {
+		return FALSE;
+	}
+
+	bytes = rspamd_file_xmap (data->filename, PROT_READ, &len, TRUE);
+
+	if (bytes == NULL) {
+		return FALSE;
+	}
+
+	if (len < (gsize)data->delta_offset ||
+			rspamd_map_file_tail_hash (bytes, data->delta_offset) !=
+			data->delta_tail_hash) {
+		/* File has been rewritten, not appended */
+		munmap (bytes, len);
+
+		return FALSE;
+	}
+
+	/* Skip incomplete line that is being written now */
+	end = bytes + len;
+
+	while (end > bytes + data->delta_offset && *(end - 1) != '\n') {
+		end --;
+	}
+
+	dlen = end - (bytes + data->delta_offset);
+
+	/* Apply changes in place, readers never see partially updated data */
+	periodic->cbdata.cur_data = *map->user_data;
+	periodic->cbdata.prev_data = NULL;
+	periodic->cbdata.delta = TRUE;
+
+	if (dlen > 0) {
+		map->read_callback ((gchar *)bytes + data->delta_offset, dlen,
+				&periodic->cbdata, TRUE);
+	}
+
+	msg_info_map ("%s: applied %z bytes of changes", data->filename, dlen);
+	data->delta_offset += dlen;
+	data->delta_tail_hash = rspamd_map_file_tail_hash (bytes,
+			data->delta_offset);
+	munmap (bytes, len);
+
+	return TRUE;
+}
+
 /**
  * Callback for reading data from file
  */
@@ -967,6 +1330,15 @@ read_map_file (struct rspamd_map *map, struct file_map_data *data,
 	ev_stat_stat (map->event_loop, &data->st_ev);
 	len = st.st_size;
 
+	if (map->delta_updates && *map->user_data != NULL) {
+		if (read_map_file_delta (map, data, periodic, &st)) {
+			return TRUE;
+		}
+
+		msg_info_map ("%s: cannot apply changes, read the whole file",
+				data->filename);
+	}
+
 	if (bk->is_signed) {
 		bytes = rspamd_file_xmap (data->filename, PROT_READ, &len, TRUE);
 
@@ -985,7 +1357,9 @@ read_map_file (struct rspamd_map *map, struct file_map_data *data,
 	}
 
 	if (len > 0) {
-		if (bk->is_compressed) {
+		if (bk->compression != RSPAMD_MAP_COMPRESSION_NONE) {
+			gsize outlen = 0;
+
 			bytes = rspamd_file_xmap (data->filename, PROT_READ, &len, TRUE);
 
 			if (bytes == NULL) {
@@ -993,57 +1367,17 @@ read_map_file (struct rspamd_map *map, struct file_map_data *data,
 				return FALSE;
 			}
 
-			ZSTD_DStream *zstream;
-			ZSTD_inBuffer zin;
-			ZSTD_outBuffer zout;
-			guchar *out;
-			gsize outlen, r;
-
-			zstream = ZSTD_createDStream ();
-			ZSTD_initDStream (zstream);
-
-			zin.pos = 0;
-			zin.src = bytes;
-			zin.size = len;
-
-			if ((outlen = ZSTD_getDecompressedSize (zin.src, zin.size)) == 0) {
-				outlen = ZSTD_DStreamOutSize ();
-			}
-
-			out = g_malloc (outlen);
-
-			zout.dst = out;
-			zout.pos = 0;
-			zout.size = outlen;
+			if (!rspamd_map_decode_buffer (map, bk->compression, bytes, len,
+					periodic, &outlen)) {
+				msg_err_map ("%s: cannot decompress data", data->filename);
+				munmap (bytes, len);
 
-			while (zin.pos < zin.size) {
-				r = ZSTD_decompressStream (zstream, &zout, &zin);
-
-				if (ZSTD_isError (r)) {
-					msg_err_map ("%s: cannot decompress data: %s",
-							data->filename,
-							ZSTD_getErrorName (r));
-					ZSTD_freeDStream (zstream);
-					g_free (out);
-					munmap (bytes, len);
-					return FALSE;
-				}
-
-				if (zout.pos == zout.size) {
-					/* We need to extend output buffer */
-					zout.size = zout.size * 1.5 + 1.0;
-					out = g_realloc (zout.dst, zout.size);
-					zout.dst = out;
-				}
+				return FALSE;
 			}
 
-			ZSTD_freeDStream (zstream);
 			msg_info_map ("%s: read map data, %z bytes compressed, "
 					"%z uncompressed)", data->filename,
-					len, zout.pos);
-			map->read_callback (out, zout.pos, &periodic->cbdata, TRUE);
-			g_free (out);
-
+					len, outlen);
 			munmap (bytes, len);
 		}
 		else {
@@ -1059,6 +1393,10 @@ read_map_file (struct rspamd_map *map, struct file_map_data *data,
 		map->read_callback (NULL, 0, &periodic->cbdata, TRUE);
 	}
 
+	if (map->delta_updates) {
+		rspamd_map_file_save_delta_state (map, data, &st);
+	}
+
 	return TRUE;
 }
 
@@ -1079,58 +1417,20 @@ read_map_static (struct rspamd_map *map, struct static_map_data *data,
 	len = data->len;
 
 	if (len > 0) {
-		if (bk->is_compressed) {
-			ZSTD_DStream *zstream;
-			ZSTD_inBuffer zin;
-			ZSTD_outBuffer zout;
-			guchar *out;
-			gsize outlen, r;
-
-			zstream = ZSTD_createDStream ();
-			ZSTD_initDStream (zstream);
-
-			zin.pos = 0;
-			zin.src = bytes;
-			zin.size = len;
-
-			if ((outlen = ZSTD_getDecompressedSize (zin.src, zin.size)) == 0) {
-				outlen = ZSTD_DStreamOutSize ();
-			}
-
-			out = g_malloc (outlen);
-
-			zout.dst = out;
-			zout.pos = 0;
-			zout.size = outlen;
-
-			while (zin.pos < zin.size) {
-				r = ZSTD_decompressStream (zstream, &zout, &zin);
+		if (bk->compression != RSPAMD_MAP_COMPRESSION_NONE) {
+			gsize outlen = 0;
 
-				if (ZSTD_isError (r)) {
-					msg_err_map ("%s: cannot decompress data: %s",
-							map->name,
-							ZSTD_getErrorName (r));
-					ZSTD_freeDStream (zstream);
-					g_free (out);
+			if (!rspamd_map_decode_buffer (map, bk->compression, bytes, len,
+					periodic, &outlen)) {
+				msg_err_map ("%s: cannot decompress data", map->name);
 
-					return FALSE;
-				}
-
-				if (zout.pos == zout.size) {
-					/* We need to extend output buffer */
-					zout.size = zout.size * 1.5 + 1.0;
-					out = g_realloc (zout.dst, zout.size);
-					zout.dst = out;
-				}
+				return FALSE;
 			}
 
-			ZSTD_freeDStream (zstream);
 			msg_info_map ("%s: read map data, %z bytes compressed, "
 					"%z uncompressed)",
 					map->name,
-					len, zout.pos);
-			map->read_callback (out, zout.pos, &periodic->cbdata, TRUE);
-			g_free (out);
+					len, outlen);
 		}
 		else {
 			msg_info_map ("%s: read map data, %z bytes",
@@ -1147,6 +1447,131 @@ read_map_static (struct rspamd_map *map, struct static_map_data *data,
 	return TRUE;
 }
 
+/*
+ * Saves freshly read map data as a new generation of the shared image, so
+ * other processes could attach it instead of reading and parsing the same data.
+ * Must be called with the map lock being held.
+ */
+static void
+rspamd_map_publish_image (struct rspamd_map *map,
+		struct map_periodic_cbdata *periodic)
+{
+	struct rspamd_map_shared_image *shared = map->shared_image;
+	gchar path[PATH_MAX], old_path[PATH_MAX];
+	gpointer data;
+	GError *err = NULL;
+	gint gen;
+
+	gen = g_atomic_int_get (&shared->gen) + 1;
+	rspamd_snprintf (path, sizeof (path), "%s/%s_%ud_%d.img",
+			map->cfg->maps_cache_dir, map->tag, map->id, gen);
+
+	if (!map->image_ops->save (map, *map->user_data, path, &err)) {
+		msg_err_map ("cannot save shared image: %e", err);
+		g_error_free (err);
+
+		return;
+	}
+
+	data = map->image_ops->load (map, path, &err);
+
+	if (data == NULL) {
+		msg_err_map ("cannot load shared image: %e", err);
+		g_error_free (err);
+		unlink (path);
+
+		return;
+	}
+
+	rspamd_strlcpy (old_path, shared->path, sizeof (old_path));
+	rspamd_strlcpy (shared->path, path, sizeof (shared->path));
+	shared->stamp = time (NULL);
+	g_atomic_int_set (&shared->gen, gen);
+	map->image_gen = gen;
+
+	/* Processes that still use the previous image keep it mapped */
+	if (old_path[0] != '\0') {
+		unlink (old_path);
+	}
+
+	/* Drop our private copy in favour of the shared one */
+	periodic->cbdata.prev_data = *map->user_data;
+	periodic->cbdata.cur_data = data;
+	map->fin_callback (&periodic->cbdata, map->user_data);
+
+	msg_info_map ("published shared image %s, generation %d", path, gen);
+}
+
+/*
+ * Attaches image published by another process if it is newer than the
+ * current map data. Must be called with the map lock being held.
+ */
+static gboolean
+rspamd_map_attach_image (struct rspamd_map *map,
+		struct map_periodic_cbdata *periodic)
+{
+	struct rspamd_map_shared_image *shared = map->shared_image;
+	struct rspamd_map_backend *bk;
+	struct map_cb_data cbdata;
+	gpointer data;
+	GError *err = NULL;
+	gint gen;
+	guint i;
+
+	if (shared == NULL) {
+		return FALSE;
+	}
+
+	gen = g_atomic_int_get (&shared->gen);
+
+	if (gen == 0 || gen == map->image_gen) {
+		return FALSE;
+	}
+
+	data = map->image_ops->load (map, shared->path, &err);
+	/* Do not retry the same generation */
+	map->image_gen = gen;
+
+	if (data == NULL) {
+		msg_warn_map ("cannot attach shared image, read map data: %e", err);
+		g_error_free (err);
+
+		return FALSE;
+	}
+
+	memset (&cbdata, 0, sizeof (cbdata));
+	cbdata.map = map;
+	cbdata.prev_data = *map->user_data;
+	cbdata.cur_data = data;
+	map->fin_callback (&cbdata, map->user_data);
+
+	/* Image includes all changes of backends noticed before it was built */
+	PTR_ARRAY_FOREACH (map->backends, i, bk) {
+		switch (bk->protocol) {
+		case MAP_PROTO_HTTP:
+		case MAP_PROTO_HTTPS:
+			if (g_atomic_int_get (&bk->data.hd->cache->available) == 1) {
+				bk->data.hd->last_modified = bk->data.hd->cache->last_modified;
+			}
+			break;
+		case MAP_PROTO_FILE:
+			if (bk->data.fd->st_ev.attr.st_mtime <= shared->stamp) {
+				bk->data.fd->need_modify = FALSE;
+			}
+			break;
+		case MAP_PROTO_STATIC:
+			bk->data.sd->processed = TRUE;
+			break;
+		}
+	}
+
+	periodic->need_modify = FALSE;
+	msg_info_map ("attached shared image %s, generation %d",
+			shared->path, gen);
+
+	return TRUE;
+}
+
 static void
 rspamd_map_periodic_dtor (struct map_periodic_cbdata *periodic)
 {
@@ -1155,9 +1580,29 @@ rspamd_map_periodic_dtor (struct map_periodic_cbdata *periodic)
 	map = periodic->map;
 	msg_debug_map ("periodic dtor %p", periodic);
 
-	if (periodic->need_modify) {
+	if (periodic->need_modify && periodic->errored && periodic->streamed) {
+		/* Data has been parsed partially, so keep the previous version */
+		msg_err_map ("discard partially read data for %s", map->name);
+
+		if (map->dtor) {
+			map->dtor (&periodic->cbdata);
+		}
+	}
+	else if (periodic->need_modify) {
 		/* We are done */
 		periodic->map->fin_callback (&periodic->cbdata, periodic->map->user_data);
+
+		if (periodic->locked) {
+			/* Includes time spent on waiting for remote backends */
+			map->load_time = rspamd_get_ticks (FALSE) - periodic->start;
+			msg_info_map ("reread %s in %.3f seconds", map->name,
+					map->load_time);
+		}
+
+		if (map->shared_image && periodic->locked && !periodic->errored &&
+				*map->user_data) {
+			rspamd_map_publish_image (map, periodic);
+		}
 	}
 	else {
 		/* Not modified */
@@ -1278,8 +1723,14 @@ rspamd_map_dns_callback (struct rdns_reply *reply, void *arg)
 
 			if (cbd->addr != NULL) {
 				rspamd_inet_address_set_port (cbd->addr, cbd->data->port);
+
+				if (rspamd_map_http_can_stream (cbd->bk, cbd->check)) {
+					flags |= RSPAMD_HTTP_BODY_PARTIAL;
+				}
+
 				cbd->conn = rspamd_http_connection_new_client (NULL,
-						NULL,
+						(flags & RSPAMD_HTTP_BODY_PARTIAL) ?
+								http_map_body_chunk : NULL,
 						http_map_error,
 						http_map_finish,
 						flags,
@@ -1340,57 +1791,20 @@ rspamd_map_read_cached (struct rspamd_map *map, struct rspamd_map_backend *bk,
 		return FALSE;
 	}
 
-	if (bk->is_compressed) {
-		ZSTD_DStream *zstream;
-		ZSTD_inBuffer zin;
-		ZSTD_outBuffer zout;
-		guchar *out;
-		gsize outlen, r;
-
-		zstream = ZSTD_createDStream ();
-		ZSTD_initDStream (zstream);
-
-		zin.pos = 0;
-		zin.src = in;
-		zin.size = len;
-
-		if ((outlen = ZSTD_getDecompressedSize (zin.src, zin.size)) == 0) {
-			outlen = ZSTD_DStreamOutSize ();
-		}
+	if (bk->compression != RSPAMD_MAP_COMPRESSION_NONE) {
+		gsize outlen = 0;
 
-		out = g_malloc (outlen);
+		if (!rspamd_map_decode_buffer (map, bk->compression, in,
+				data->cache->len, periodic, &outlen)) {
+			msg_err_map ("%s: cannot decompress data", bk->uri);
+			munmap (in, len);
 
-		zout.dst = out;
-		zout.pos = 0;
-		zout.size = outlen;
-
-		while (zin.pos < zin.size) {
-			r = ZSTD_decompressStream (zstream, &zout, &zin);
-
-			if (ZSTD_isError (r)) {
-				msg_err_map ("%s: cannot decompress data: %s",
-						bk->uri,
-						ZSTD_getErrorName (r));
-				ZSTD_freeDStream (zstream);
-				g_free (out);
-				munmap (in, len);
-				return FALSE;
-			}
-
-			if (zout.pos == zout.size) {
-				/* We need to extend output buffer */
-				zout.size = zout.size * 1.5 + 1.0;
-				out = g_realloc (zout.dst, zout.size);
-				zout.dst = out;
-			}
+			return FALSE;
 		}
 
-		ZSTD_freeDStream (zstream);
 		msg_info_map ("%s: read map data cached %z bytes compressed, "
 				"%z uncompressed", bk->uri,
-				len, zout.pos);
-		map->read_callback (out, zout.pos, &periodic->cbdata, TRUE);
-		g_free (out);
+				len, outlen);
 	}
 	else {
 		msg_info_map ("%s: read map data cached %z bytes", bk->uri,
@@ -1497,7 +1911,7 @@ static gboolean
 rspamd_map_read_http_cached_file (struct rspamd_map *map,
 								  struct rspamd_map_backend *bk,
 								  struct http_map_data *htdata,
-								  struct map_cb_data *cbdata)
+								  struct map_periodic_cbdata *periodic)
 {
 	gchar path[PATH_MAX];
 	guchar digest[rspamd_cryptobox_HASHBYTES];
@@ -1553,8 +1967,36 @@ rspamd_map_read_http_cached_file (struct rspamd_map *map,
 	htdata->last_modified = header.mtime;
 
 	/* Now read file data */
+	if (bk->compression != RSPAMD_MAP_COMPRESSION_NONE) {
+		/* Cached data is stored compressed */
+		guchar *in;
+		gsize len;
+		gboolean ret;
+
+		in = rspamd_file_xmap (path, PROT_READ, &len, TRUE);
+
+		if (in == NULL || len < header.data_off) {
+			msg_err_map ("cannot map file %s: %s", path, strerror (errno));
+
+			if (in) {
+				munmap (in, len);
+			}
+
+			return FALSE;
+		}
+
+		ret = rspamd_map_decode_buffer (map, bk->compression,
+				in + header.data_off, len - header.data_off, periodic, NULL);
+		munmap (in, len);
+
+		if (!ret) {
+			msg_err_map ("cannot decompress cached data from %s", path);
+
+			return FALSE;
+		}
+	}
 	/* Perform buffered read: fail-safe */
-	if (!read_map_file_chunks (map, cbdata, path,
+	else if (!read_map_file_chunks (map, &periodic->cbdata, path,
 			st.st_size - header.data_off, header.data_off)) {
 		return FALSE;
 	}
@@ -1645,9 +2087,14 @@ check:
 	/* Send both A and AAAA requests */
 	if (rspamd_parse_inet_address (&cbd->addr, data->host, strlen (data->host))) {
 		rspamd_inet_address_set_port (cbd->addr, cbd->data->port);
+
+		if (rspamd_map_http_can_stream (bk, check)) {
+			flags |= RSPAMD_HTTP_BODY_PARTIAL;
+		}
+
 		cbd->conn = rspamd_http_connection_new_client (
 				NULL,
-				NULL,
+				(flags & RSPAMD_HTTP_BODY_PARTIAL) ? http_map_body_chunk : NULL,
 				http_map_error,
 				http_map_finish,
 				flags,
@@ -1834,6 +2281,7 @@ rspamd_map_process_periodic (struct map_periodic_cbdata *cbd)
 		else {
 			msg_debug_map ("locked map");
 			cbd->locked = TRUE;
+			cbd->start = rspamd_get_ticks (FALSE);
 		}
 	}
 
@@ -1851,6 +2299,13 @@ rspamd_map_process_periodic (struct map_periodic_cbdata *cbd)
 		return;
 	}
 
+	if (cbd->cur_backend == 0 && rspamd_map_attach_image (map, cbd)) {
+		/* Data has been built by another process */
+		MAP_RELEASE (cbd, "periodic");
+
+		return;
+	}
+
 	/* For each backend we need to check for modifications */
 	if (cbd->cur_backend >= cbd->map->backends->len) {
 		/* Last backend */
@@ -1931,6 +2386,9 @@ rspamd_map_on_stat (struct ev_loop *loop, ev_stat *w, int revents)
 	}
 }
 
+static void rspamd_map_read_local (struct rspamd_config *cfg,
+		gboolean only_empty);
+
 /* Start watching event for all maps */
 void
 rspamd_map_watch (struct rspamd_config *cfg,
@@ -1984,110 +2442,207 @@ rspamd_map_watch (struct rspamd_config *cfg,
 
 		cur = g_list_next (cur);
 	}
+
+	/*
+	 * Maps that have not been preloaded are read before the loop starts,
+	 * so that parsing of big local maps is not serialised by the periodic
+	 * checks
+	 */
+	rspamd_map_read_local (cfg, TRUE);
 }
 
-void
-rspamd_map_preload (struct rspamd_config *cfg)
+/*
+ * Reads all backends of a map synchronously, it could be called from a thread
+ * of the preload pool if read and fin callbacks of the map are thread safe
+ */
+static void
+rspamd_map_preload_single (struct rspamd_map *map)
 {
-	GList *cur = cfg->maps;
-	struct rspamd_map *map;
+	struct map_periodic_cbdata fake_cbd;
 	struct rspamd_map_backend *bk;
+	gboolean succeed = TRUE;
+	gdouble start;
 	guint i;
-	gboolean map_ok;
 
-	/* First of all do synced read of data */
-	while (cur) {
-		map = cur->data;
-		map_ok = TRUE;
+	memset (&fake_cbd, 0, sizeof (fake_cbd));
+	fake_cbd.cbdata.state = 0;
+	fake_cbd.cbdata.prev_data = *map->user_data;
+	fake_cbd.cbdata.cur_data = NULL;
+	fake_cbd.cbdata.map = map;
+	fake_cbd.map = map;
+	start = rspamd_get_ticks (FALSE);
 
-		PTR_ARRAY_FOREACH (map->backends, i, bk) {
-			if (!(bk->protocol == MAP_PROTO_FILE ||
-				  bk->protocol == MAP_PROTO_STATIC)) {
+	PTR_ARRAY_FOREACH (map->backends, i, bk) {
+		fake_cbd.cur_backend = i;
 
-				if (bk->protocol == MAP_PROTO_HTTP ||
-						bk->protocol == MAP_PROTO_HTTPS) {
-					if (!rspamd_map_has_http_cached_file (map, bk)) {
+		if (bk->protocol == MAP_PROTO_FILE) {
+			if (!read_map_file (map, bk->data.fd, bk, &fake_cbd)) {
+				succeed = FALSE;
+				break;
+			}
+		}
+		else if (bk->protocol == MAP_PROTO_STATIC) {
+			if (!read_map_static (map, bk->data.sd, bk, &fake_cbd)) {
+				succeed = FALSE;
+				break;
+			}
+		}
+		else if (bk->protocol == MAP_PROTO_HTTP ||
+				 bk->protocol == MAP_PROTO_HTTPS) {
+			if (!rspamd_map_read_http_cached_file (map, bk, bk->data.hd,
+					&fake_cbd)) {
 
-						if (!map->fallback_backend) {
-							map_ok = FALSE;
-						}
+				if (map->fallback_backend) {
+					/* Try fallback */
+					g_assert (map->fallback_backend->protocol ==
+							  MAP_PROTO_FILE);
+					if (!read_map_file (map,
+							map->fallback_backend->data.fd,
+							map->fallback_backend, &fake_cbd)) {
+						succeed = FALSE;
 						break;
 					}
-					else {
-						continue; /* We are yet fine */
-					}
 				}
-				map_ok = FALSE;
-				break;
+				else {
+					succeed = FALSE;
+					break;
+				}
 			}
 		}
+		else {
+			g_assert_not_reached ();
+		}
+	}
 
-		if (map_ok) {
-			struct map_periodic_cbdata fake_cbd;
-			gboolean succeed = TRUE;
+	if (succeed) {
+		map->fin_callback (&fake_cbd.cbdata, map->user_data);
+		map->load_time = rspamd_get_ticks (FALSE) - start;
+		msg_info_map ("preloaded %s in %.3f seconds", map->name,
+				map->load_time);
+	}
+	else {
+		msg_info_map ("preload of %s failed", map->name);
 
-			memset (&fake_cbd, 0, sizeof (fake_cbd));
-			fake_cbd.cbdata.state = 0;
-			fake_cbd.cbdata.prev_data = *map->user_data;
-			fake_cbd.cbdata.cur_data = NULL;
-			fake_cbd.cbdata.map = map;
-			fake_cbd.map = map;
+		if (fake_cbd.streamed && map->dtor) {
+			map->dtor (&fake_cbd.cbdata);
+		}
+	}
+}
 
-			PTR_ARRAY_FOREACH (map->backends, i, bk) {
-				fake_cbd.cur_backend = i;
+static void
+rspamd_map_preload_thread (gpointer data, gpointer ud)
+{
+	rspamd_map_preload_single ((struct rspamd_map *)data);
+}
 
-				if (bk->protocol == MAP_PROTO_FILE) {
-					if (!read_map_file (map, bk->data.fd, bk, &fake_cbd)) {
-						succeed = FALSE;
-						break;
-					}
-				}
-				else if (bk->protocol == MAP_PROTO_STATIC) {
-					if (!read_map_static (map, bk->data.sd, bk, &fake_cbd)) {
-						succeed = FALSE;
-						break;
-					}
-				}
-				else if (bk->protocol == MAP_PROTO_HTTP ||
-						 bk->protocol == MAP_PROTO_HTTPS) {
-					if (!rspamd_map_read_http_cached_file (map, bk, bk->data.hd,
-							&fake_cbd.cbdata)) {
-
-						if (map->fallback_backend) {
-							/* Try fallback */
-							g_assert (map->fallback_backend->protocol ==
-									  MAP_PROTO_FILE);
-							if (!read_map_file (map,
-									map->fallback_backend->data.fd,
-									map->fallback_backend, &fake_cbd)) {
-								succeed = FALSE;
-								break;
-							}
-						}
-						else {
-							succeed = FALSE;
-							break;
-						}
+/*
+ * Returns TRUE if all backends of a map could be read without network
+ */
+static gboolean
+rspamd_map_has_local_data (struct rspamd_map *map)
+{
+	struct rspamd_map_backend *bk;
+	guint i;
+
+	PTR_ARRAY_FOREACH (map->backends, i, bk) {
+		if (!(bk->protocol == MAP_PROTO_FILE ||
+			  bk->protocol == MAP_PROTO_STATIC)) {
+
+			if (bk->protocol == MAP_PROTO_HTTP ||
+					bk->protocol == MAP_PROTO_HTTPS) {
+				if (!rspamd_map_has_http_cached_file (map, bk)) {
+
+					if (!map->fallback_backend) {
+						return FALSE;
 					}
+					break;
 				}
 				else {
-					g_assert_not_reached ();
+					continue; /* We are yet fine */
 				}
 			}
 
-			if (succeed) {
-				map->fin_callback (&fake_cbd.cbdata, map->user_data);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Synchronously reads maps with local data, using a pool of threads for
+ * maps with thread safe callbacks. If `only_empty` is set, then only maps
+ * that have no data yet are read, and maps with non thread safe callbacks
+ * are left for periodic checks.
+ */
+static void
+rspamd_map_read_local (struct rspamd_config *cfg, gboolean only_empty)
+{
+	GList *cur = cfg->maps;
+	struct rspamd_map *map;
+	GThreadPool *pool = NULL;
+	GError *err = NULL;
+	gboolean pool_checked = FALSE;
+
+	while (cur) {
+		map = cur->data;
+		cur = g_list_next (cur);
+
+		if ((only_empty && *map->user_data != NULL) ||
+				!rspamd_map_has_local_data (map)) {
+			continue;
+		}
+
+		if (!rspamd_map_helper_thread_safe (map->read_callback)) {
+			if (!only_empty) {
+				/* Lua maps are always read by the main thread */
+				rspamd_map_preload_single (map);
 			}
-			else {
-				msg_info_map ("preload of %s failed", map->name);
+
+			continue;
+		}
+
+#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
+		/* Older glib versions require gthread library for thread pools */
+		if (!pool_checked && cfg->map_load_threads > 1) {
+			/* Regexps library state must be initialised before threads use it */
+			rspamd_regexp_library_init (NULL);
+			pool = g_thread_pool_new (rspamd_map_preload_thread, NULL,
+					cfg->map_load_threads, FALSE, &err);
+
+			if (pool == NULL) {
+				msg_err_config ("cannot create threads to load maps: %e", err);
+				g_error_free (err);
 			}
+		}
+#endif
+		pool_checked = TRUE;
 
+		if (pool) {
+			g_thread_pool_push (pool, map, NULL);
+		}
+		else if (!only_empty) {
+			rspamd_map_preload_single (map);
 		}
+	}
 
-		cur = g_list_next (cur);
+	if (pool) {
+		/* Wait for all maps */
+		g_thread_pool_free (pool, FALSE, TRUE);
 	}
 }
 
+void
+rspamd_map_preload (struct rspamd_config *cfg)
+{
+	gdouble start;
+
+	start = rspamd_get_ticks (FALSE);
+	rspamd_map_read_local (cfg, FALSE);
+	msg_info_config ("preloaded maps in %.3f seconds",
+			rspamd_get_ticks (FALSE) - start);
+}
+
 void
 rspamd_map_remove_all (struct rspamd_config *cfg)
 {
@@ -2113,6 +2668,12 @@ rspamd_map_remove_all (struct rspamd_config *cfg)
 			*map->user_data = NULL;
 		}
 
+		if (map->shared_image && map->wrk == NULL &&
+				map->shared_image->path[0] != '\0') {
+			/* Main process owns images, workers just map them */
+			unlink (map->shared_image->path);
+		}
+
 		for (i = 0; i < map->backends->len; i ++) {
 			bk = g_ptr_array_index (map->backends, i);
 
@@ -2149,7 +2710,7 @@ rspamd_map_check_proto (struct rspamd_config *cfg,
 	else if (g_ascii_strcasecmp (pos, "zst+static") == 0) {
 		bk->protocol = MAP_PROTO_STATIC;
 		bk->uri = g_strdup (pos + 4);
-		bk->is_compressed = TRUE;
+		bk->compression = RSPAMD_MAP_COMPRESSION_ZSTD;
 
 		return pos + 4;
 	}
@@ -2357,11 +2918,15 @@ rspamd_map_parse_backend (struct rspamd_config *cfg, const gchar *map_line)
 	if (end - map_line > 5) {
 		p = end - 5;
 		if (g_ascii_strcasecmp (p, ".zstd") == 0) {
-			bk->is_compressed = TRUE;
+			bk->compression = RSPAMD_MAP_COMPRESSION_ZSTD;
 		}
 		p = end - 4;
 		if (g_ascii_strcasecmp (p, ".zst") == 0) {
-			bk->is_compressed = TRUE;
+			bk->compression = RSPAMD_MAP_COMPRESSION_ZSTD;
+		}
+		p = end - 3;
+		if (g_ascii_strcasecmp (p, ".gz") == 0) {
+			bk->compression = RSPAMD_MAP_COMPRESSION_GZIP;
 		}
 	}
 
@@ -2518,6 +3083,74 @@ rspamd_map_add_static_string (struct rspamd_config *cfg,
 	return TRUE;
 }
 
+static void
+rspamd_map_init_shared_image (struct rspamd_config *cfg,
+		struct rspamd_map *map,
+		const ucl_object_t *obj)
+{
+	const ucl_object_t *elt;
+	gboolean shared = cfg->map_shared_images;
+
+	if (obj && ucl_object_type (obj) == UCL_OBJECT) {
+		elt = ucl_object_lookup (obj, "shared");
+
+		if (elt) {
+			shared = ucl_object_toboolean (elt);
+		}
+	}
+
+	if (!shared || cfg->maps_cache_dir == NULL) {
+		return;
+	}
+
+	map->image_ops = rspamd_map_helper_image_ops (map->read_callback);
+
+	if (map->image_ops == NULL) {
+		msg_debug_map ("map type does not support shared images");
+
+		return;
+	}
+
+	map->shared_image = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+			sizeof (*map->shared_image));
+}
+
+static struct rspamd_map_stat *
+rspamd_map_stat_new (struct rspamd_config *cfg)
+{
+	gpointer p;
+
+	/* Shards are aligned to cache lines to avoid false sharing */
+	p = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+			sizeof (struct rspamd_map_stat) * RSPAMD_MAP_STAT_SHARDS + 64);
+
+	return align_ptr (p, 64);
+}
+
+void
+rspamd_map_set_stat_shard (guint id)
+{
+	rspamd_map_stat_shard = id % RSPAMD_MAP_STAT_SHARDS;
+}
+
+void
+rspamd_map_stat_sum (struct rspamd_map *map, struct rspamd_map_stat *st)
+{
+	guint i;
+
+	memset (st, 0, sizeof (*st));
+
+	if (map->stat == NULL) {
+		return;
+	}
+
+	for (i = 0; i < RSPAMD_MAP_STAT_SHARDS; i ++) {
+		st->hits += map->stat[i].hits;
+		st->misses += map->stat[i].misses;
+		st->filtered += map->stat[i].filtered;
+	}
+}
+
 struct rspamd_map *
 rspamd_map_add (struct rspamd_config *cfg,
 				const gchar *map_line,
@@ -2551,6 +3184,7 @@ rspamd_map_add (struct rspamd_config *cfg,
 	map->id = rspamd_random_uint64_fast ();
 	map->locked =
 		rspamd_mempool_alloc0_shared (cfg->cfg_pool, sizeof (gint));
+	map->stat = rspamd_map_stat_new (cfg);
 	map->backends = g_ptr_array_sized_new (1);
 	rspamd_mempool_add_destructor (cfg->cfg_pool, rspamd_ptr_array_free_hard,
 			map->backends);
@@ -2568,6 +3202,7 @@ rspamd_map_add (struct rspamd_config *cfg,
 	}
 
 	rspamd_map_calculate_hash (map);
+	rspamd_map_init_shared_image (cfg, map, NULL);
 	msg_info_map ("added map %s", bk->uri);
 
 	cfg->maps = g_list_prepend (cfg->maps, map);
@@ -2623,6 +3258,7 @@ rspamd_map_add_from_ucl (struct rspamd_config *cfg,
 	map->id = rspamd_random_uint64_fast ();
 	map->locked =
 			rspamd_mempool_alloc0_shared (cfg->cfg_pool, sizeof (gint));
+	map->stat = rspamd_map_stat_new (cfg);
 	map->backends = g_ptr_array_new ();
 	rspamd_mempool_add_destructor (cfg->cfg_pool, rspamd_ptr_array_free_hard,
 			map->backends);
@@ -2798,6 +3434,49 @@ rspamd_map_add_from_ucl (struct rspamd_config *cfg,
 	}
 
 	rspamd_map_calculate_hash (map);
+	rspamd_map_init_shared_image (cfg, map, obj);
+
+	elt = ucl_object_lookup (obj, "delta");
+
+	if (elt && ucl_object_toboolean (elt)) {
+		bk = g_ptr_array_index (map->backends, 0);
+
+		if (map->backends->len != 1 || bk->protocol != MAP_PROTO_FILE ||
+				bk->compression != RSPAMD_MAP_COMPRESSION_NONE ||
+				bk->is_signed) {
+			msg_warn_map ("delta updates are supported for maps with a single "
+					"plain file backend only");
+		}
+		else if (!rspamd_map_helper_delta_supported (map->read_callback)) {
+			msg_warn_map ("delta updates are not supported for this map type");
+		}
+		else {
+			map->delta_updates = TRUE;
+		}
+	}
+
+	elt = ucl_object_lookup (obj, "bloom");
+
+	if (elt && ucl_object_toboolean (elt)) {
+		if (map->read_callback != rspamd_kv_list_read) {
+			msg_warn_map ("bloom filter is supported for hash and kv maps only");
+		}
+		else {
+			map->lookup_filter = TRUE;
+		}
+	}
+
+	elt = ucl_object_lookup (obj, "perfect_hash");
+
+	if (elt && ucl_object_toboolean (elt)) {
+		if (map->read_callback != rspamd_kv_list_read) {
+			msg_warn_map ("perfect hash is supported for hash and kv maps only");
+		}
+		else {
+			map->perfect_hash = TRUE;
+		}
+	}
+
 	msg_debug_map ("added map from ucl");
 
 	cfg->maps = g_list_prepend (cfg->maps, map);
@@ -44,6 +44,8 @@ struct map_cb_data {
 	gint state;
 	void *prev_data;
 	void *cur_data;
+	/* Data is a list of changes for cur_data: +key value, -key */
+	gboolean delta;
 };
 
 /**
@@ -90,6 +92,12 @@ void rspamd_map_watch (struct rspamd_config *cfg,
  */
 void rspamd_map_preload (struct rspamd_config *cfg);
 
+/**
+ * Sets shard of lookups statistics updated by the current process
+ * @param id
+ */
+void rspamd_map_set_stat_shard (guint id);
+
 /**
  * Remove all maps watched (remove events)
  */
@@ -20,9 +20,12 @@
 #include "radix.h"
 #include "rspamd.h"
 #include "cryptobox.h"
+#include <sys/mman.h>
 
 #ifdef WITH_HYPERSCAN
 #include "hs.h"
+#include <glob.h>
+#include <utime.h>
 #endif
 #ifndef WITH_PCRE2
 #include <pcre.h>
@@ -34,27 +37,123 @@
 static const guint64 map_hash_seed = 0xdeadbabeULL;
 static const gchar *hash_fill = "1";
 
+#define RSPAMD_MAP_HASH_IMAGE_MAGIC "rsmhimg2"
+
+/*
+ * Image of a hash map has no pointers, so it could be mapped read only
+ * by many processes at once. Keys are placed by a perfect hash function
+ * (hash and displace), so each lookup checks exactly one slot:
+ * header
+ * guint32 disp[nbuckets] - displacements of buckets of keys
+ * guint16 fps[nslots] - fingerprints of keys (padded to 4 bytes), 0 - empty
+ * struct rspamd_map_hash_image_entry entries[nslots]
+ * gchar strings[strings_len] - null terminated keys and values
+ */
+struct rspamd_map_hash_image_header {
+	gchar magic[8];
+	guint64 digest;
+	guint64 seed;
+	guint32 nelts;
+	guint32 nslots;
+	guint32 nbuckets;
+	guint32 unused;
+	guint64 strings_len;
+};
+
+struct rspamd_map_hash_image_entry {
+	guint32 key_off;
+	guint32 value_off;
+};
+
+/* Average number of keys in a bucket */
+#define RSPAMD_MAP_PHF_BUCKET_SIZE 3
+/* Keys per slot, free slots make placement of the last buckets fast */
+#define RSPAMD_MAP_PHF_LOAD_FACTOR 0.8
+#define RSPAMD_MAP_PHF_MAX_DISP (1u << 12)
+#define RSPAMD_MAP_PHF_MAX_ATTEMPTS 8
+/*
+ * Changes of a compacted map are kept in a hash table checked before the
+ * image, the image is rebuilt when there are too many of them
+ */
+#define RSPAMD_MAP_PHF_OVERFLOW_MIN 1024
+#define RSPAMD_MAP_PHF_OVERFLOW_RATIO 0.1
+
+/* Filter block is a cache line of 512 bits */
+#define RSPAMD_MAP_FILTER_BLOCK_WORDS 8
+#define RSPAMD_MAP_FILTER_BITS_PER_KEY 10
+#define RSPAMD_MAP_FILTER_NHASHES 6
+
+#define RSPAMD_MAP_RADIX_IMAGE_MAGIC "rsmrimg1"
+
+/*
+ * Image of a radix map:
+ * header
+ * flat radix of flat_len bytes, values are indexes in entries
+ * struct rspamd_map_hash_image_entry entries[nvalues] - the first nkeys
+ * entries are map keys, the rest are values that are only referenced by radix
+ * gchar strings[strings_len]
+ */
+struct rspamd_map_radix_image_header {
+	gchar magic[8];
+	guint64 digest;
+	guint32 nkeys;
+	guint32 nvalues;
+	guint64 flat_len;
+	guint64 strings_len;
+};
+
 struct rspamd_map_helper_value {
 	gsize hits;
 	gconstpointer key;
 	gchar value[]; /* Null terminated */
 };
 
+/* Values of ASN maps are parsed once when inserted */
+struct rspamd_map_asn_value {
+	struct rspamd_asn_info info;
+	struct rspamd_map_helper_value val; /* Must be the last */
+};
+
 KHASH_INIT (rspamd_map_hash, const gchar *,
 		struct rspamd_map_helper_value *, true,
 		rspamd_strcase_hash, rspamd_strcase_equal);
 
 struct rspamd_radix_map_helper {
 	rspamd_mempool_t *pool;
+	struct rspamd_map *map;
 	khash_t(rspamd_map_hash) *htb;
 	radix_compressed_t *trie;
 	rspamd_cryptobox_fast_hash_state_t hst;
+	/* Read only image, htb and trie are NULL in this case */
+	radix_flat_t *flat;
+	const struct rspamd_map_radix_image_header *image;
+	gsize image_len;
+	const struct rspamd_map_hash_image_entry *entries;
+	const gchar *strings;
+	/* Parsed image values of ASN maps, prefix is NULL for invalid ones */
+	struct rspamd_asn_info *asn;
 };
 
 struct rspamd_hash_map_helper {
 	rspamd_mempool_t *pool;
+	struct rspamd_map *map;
 	khash_t(rspamd_map_hash) *htb;
 	rspamd_cryptobox_fast_hash_state_t hst;
+	/* Blocked bloom filter of keys checked before htb, NULL if disabled */
+	guint64 *filter;
+	guint32 filter_mask;
+	/* Number of keys the filter has been sized for */
+	gsize filter_nkeys;
+	/*
+	 * Read only image with a perfect hash, htb is NULL in this case. It is
+	 * either mapped from a file shared between processes or compacted
+	 * in memory
+	 */
+	const struct rspamd_map_hash_image_header *image;
+	gsize image_len;
+	gboolean image_mapped;
+	/* Changes applied to the image, NULL value means a removed key */
+	khash_t(rspamd_map_hash) *overflow;
 };
 
 struct rspamd_regexp_map_helper {
@@ -71,6 +170,7 @@ struct rspamd_regexp_map_helper {
 	const gchar **patterns;
 	gint *flags;
 	gint *ids;
+	gchar *hs_cache_path; /* Compiled database cached on disk */
 #endif
 };
 
@@ -494,6 +594,93 @@ rspamd_map_helper_insert_radix_resolve (gpointer st, gconstpointer key, gconstpo
 	rspamd_cryptobox_fast_hash_update (&r->hst, nk, strlen (nk));
 }
 
+/*
+ * Parses value of ASN map: `asn [country]`, e.g. `15169 US` or `AS15169 | US`
+ */
+static gboolean
+rspamd_map_helper_parse_asn (const gchar *value, struct rspamd_asn_info *info)
+{
+	const gchar *p = value, *c;
+	gulong asn;
+
+	while (g_ascii_isspace (*p)) {
+		p ++;
+	}
+
+	if ((p[0] == 'A' || p[0] == 'a') && (p[1] == 'S' || p[1] == 's')) {
+		p += 2;
+	}
+
+	c = p;
+
+	while (g_ascii_isdigit (*p)) {
+		p ++;
+	}
+
+	if (p == c || !rspamd_strtoul (c, p - c, &asn) || asn > G_MAXUINT32) {
+		return FALSE;
+	}
+
+	info->asn = asn;
+	memset (info->country, 0, sizeof (info->country));
+
+	while (g_ascii_isspace (*p) || *p == '|') {
+		p ++;
+	}
+
+	if (g_ascii_isalpha (p[0]) && g_ascii_isalpha (p[1]) &&
+			!g_ascii_isalnum (p[2])) {
+		info->country[0] = g_ascii_toupper (p[0]);
+		info->country[1] = g_ascii_toupper (p[1]);
+	}
+
+	return TRUE;
+}
+
+void
+rspamd_map_helper_insert_asn (gpointer st, gconstpointer key,
+		gconstpointer value)
+{
+	struct rspamd_radix_map_helper *r = (struct rspamd_radix_map_helper *)st;
+	struct rspamd_map *map = r->map;
+	struct rspamd_map_asn_value *asn_val;
+	struct rspamd_asn_info info;
+	gsize vlen;
+	khiter_t k;
+	gconstpointer nk;
+	gint res;
+
+	if (!rspamd_map_helper_parse_asn (value, &info)) {
+		if (map) {
+			msg_err_map ("cannot parse asn for %s: '%s'", key, value);
+		}
+		else {
+			msg_err ("cannot parse asn for %s: '%s'", key, value);
+		}
+
+		return;
+	}
+
+	vlen = strlen (value);
+	asn_val = rspamd_mempool_alloc0 (r->pool, sizeof (*asn_val) +
+			vlen + 1);
+	memcpy (asn_val->val.value, value, vlen);
+	asn_val->info = info;
+
+	k = kh_get (rspamd_map_hash, r->htb, key);
+
+	if (k == kh_end (r->htb)) {
+		nk = rspamd_mempool_strdup (r->pool, key);
+		k = kh_put (rspamd_map_hash, r->htb, nk, &res);
+	}
+
+	nk = kh_key (r->htb, k);
+	asn_val->val.key = nk;
+	kh_value (r->htb, k) = &asn_val->val;
+	rspamd_radix_add_iplist (key, ",", r->trie, &asn_val->val, FALSE);
+	rspamd_cryptobox_fast_hash_update (&r->hst, nk, strlen (nk));
+}
+
 void
 rspamd_map_helper_insert_hash (gpointer st, gconstpointer key, gconstpointer value)
 {
@@ -622,6 +809,147 @@ rspamd_map_helper_traverse_regexp (void *data,
 	});
 }
 
+static inline const guint32 *
+rspamd_map_hash_image_disp (const struct rspamd_map_hash_image_header *hdr)
+{
+	return (const guint32 *)(hdr + 1);
+}
+
+static inline const guint16 *
+rspamd_map_hash_image_fps (const struct rspamd_map_hash_image_header *hdr)
+{
+	return (const guint16 *)(rspamd_map_hash_image_disp (hdr) + hdr->nbuckets);
+}
+
+static inline gsize
+rspamd_map_hash_image_entries_offset (guint32 nbuckets, guint32 nslots)
+{
+	return sizeof (struct rspamd_map_hash_image_header) +
+			sizeof (guint32) * (gsize)nbuckets +
+			sizeof (guint16) * (((gsize)nslots + 1) & ~(gsize)1);
+}
+
+static inline const struct rspamd_map_hash_image_entry *
+rspamd_map_hash_image_entries (const struct rspamd_map_hash_image_header *hdr)
+{
+	return (const struct rspamd_map_hash_image_entry *)((const guchar *)hdr +
+			rspamd_map_hash_image_entries_offset (hdr->nbuckets, hdr->nslots));
+}
+
+static inline guint32
+rspamd_map_hash_image_bucket (guint64 h, guint32 nbuckets)
+{
+	return (h >> 32) % nbuckets;
+}
+
+static inline guint32
+rspamd_map_hash_image_slot (guint64 h, guint32 disp, guint32 nslots)
+{
+	guint64 x = h ^ ((disp + 1ULL) * 0x9E3779B97F4A7C15ULL);
+
+	/* Each displacement gives an independent position of a key */
+	x ^= x >> 31;
+	x *= 0xBF58476D1CE4E5B9ULL;
+	x ^= x >> 27;
+
+	return x % nslots;
+}
+
+static inline guint16
+rspamd_map_hash_image_fp (guint64 h)
+{
+	guint16 fp = h & 0xffff;
+
+	/* Zero marks an empty slot */
+	return fp ? fp : 1;
+}
+
+static inline void
+rspamd_map_helper_count_lookup (struct rspamd_map *map, gboolean found)
+{
+	if (map && map->stat) {
+		if (found) {
+			RSPAMD_MAP_STAT_INC (map, hits);
+		}
+		else {
+			RSPAMD_MAP_STAT_INC (map, misses);
+		}
+	}
+}
+
+static inline guint64 *
+rspamd_map_filter_block (guint64 *filter, guint32 mask, guint64 h)
+{
+	return filter + (gsize)((h >> 32) & mask) * RSPAMD_MAP_FILTER_BLOCK_WORDS;
+}
+
+static void
+rspamd_map_filter_add (guint64 *filter, guint32 mask, guint64 h)
+{
+	guint64 *blk = rspamd_map_filter_block (filter, mask, h);
+	guint64 g = h * 0x9E3779B97F4A7C15ULL;
+	guint32 h1 = g, h2 = (g >> 32) | 1, bit, i;
+
+	for (i = 0; i < RSPAMD_MAP_FILTER_NHASHES; i ++) {
+		bit = (h1 + i * h2) & 511;
+		blk[bit >> 6] |= 1ULL << (bit & 63);
+	}
+}
+
+static gboolean
+rspamd_map_filter_check (guint64 *filter, guint32 mask, guint64 h)
+{
+	guint64 *blk = rspamd_map_filter_block (filter, mask, h);
+	guint64 g = h * 0x9E3779B97F4A7C15ULL;
+	guint32 h1 = g, h2 = (g >> 32) | 1, bit, i;
+
+	for (i = 0; i < RSPAMD_MAP_FILTER_NHASHES; i ++) {
+		bit = (h1 + i * h2) & 511;
+
+		if (!(blk[bit >> 6] & (1ULL << (bit & 63)))) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Builds filter of all keys in a hash map. It is rebuilt on full reads only:
+ * keys added by delta updates are inserted to the existing filter and removed
+ * keys are left there, as they could only cause false positives
+ */
+static void
+rspamd_map_helper_build_filter (struct rspamd_hash_map_helper *ht)
+{
+	gconstpointer k;
+	struct rspamd_map_helper_value *val;
+	guint32 nblocks = 1;
+	gsize nbits;
+
+	if (ht->filter) {
+		g_free (ht->filter);
+		ht->filter = NULL;
+	}
+
+	ht->filter_nkeys = MAX (kh_size (ht->htb), 1);
+	nbits = ht->filter_nkeys * RSPAMD_MAP_FILTER_BITS_PER_KEY;
+
+	while ((gsize)nblocks * RSPAMD_MAP_FILTER_BLOCK_WORDS * 64 < nbits &&
+			nblocks < (1u << 31)) {
+		nblocks <<= 1;
+	}
+
+	ht->filter = g_malloc0 (sizeof (guint64) * RSPAMD_MAP_FILTER_BLOCK_WORDS *
+			nblocks);
+	ht->filter_mask = nblocks - 1;
+
+	kh_foreach (ht->htb, k, val, {
+		rspamd_map_filter_add (ht->filter, ht->filter_mask,
+				rspamd_icase_hash (k, strlen (k), map_hash_seed));
+	});
+}
+
 struct rspamd_hash_map_helper *
 rspamd_map_helper_new_hash (struct rspamd_map *map)
 {
@@ -640,6 +968,7 @@ rspamd_map_helper_new_hash (struct rspamd_map *map)
 	htb = rspamd_mempool_alloc0 (pool, sizeof (*htb));
 	htb->htb = kh_init (rspamd_map_hash);
 	htb->pool = pool;
+	htb->map = map;
 	rspamd_cryptobox_fast_hash_init (&htb->hst, map_hash_seed);
 
 	return htb;
@@ -653,7 +982,27 @@ rspamd_map_helper_destroy_hash (struct rspamd_hash_map_helper *r)
 	}
 
 	rspamd_mempool_t *pool = r->pool;
-	kh_destroy (rspamd_map_hash, r->htb);
+
+	if (r->image) {
+		if (r->image_mapped) {
+			munmap ((gpointer)r->image, r->image_len);
+		}
+		else {
+			g_free ((gpointer)r->image);
+		}
+	}
+	else {
+		kh_destroy (rspamd_map_hash, r->htb);
+	}
+
+	if (r->overflow) {
+		kh_destroy (rspamd_map_hash, r->overflow);
+	}
+
+	if (r->filter) {
+		g_free (r->filter);
+	}
+
 	memset (r, 0, sizeof (*r));
 	rspamd_mempool_delete (pool);
 }
@@ -668,6 +1017,53 @@ rspamd_map_helper_traverse_hash (void *data,
 	struct rspamd_map_helper_value *val;
 	struct rspamd_hash_map_helper *ht = data;
 
+	if (ht->image) {
+		const struct rspamd_map_hash_image_entry *entries;
+		const guint16 *fps;
+		const gchar *strings;
+		guint i;
+
+		/* Images are read only, so there are no hits to report */
+		fps = rspamd_map_hash_image_fps (ht->image);
+		entries = rspamd_map_hash_image_entries (ht->image);
+		strings = (const gchar *)(entries + ht->image->nslots);
+
+		for (i = 0; i < ht->image->nslots; i ++) {
+			if (fps[i] == 0) {
+				continue;
+			}
+
+			if (ht->overflow && kh_get (rspamd_map_hash, ht->overflow,
+					strings + entries[i].key_off) != kh_end (ht->overflow)) {
+				/* Changed or removed */
+				continue;
+			}
+
+			if (!cb (strings + entries[i].key_off,
+					strings + entries[i].value_off, 0, cbdata)) {
+				return;
+			}
+		}
+
+		if (ht->overflow) {
+			kh_foreach (ht->overflow, k, val, {
+				if (val == NULL) {
+					continue;
+				}
+
+				if (!cb (k, val->value, val->hits, cbdata)) {
+					break;
+				}
+
+				if (reset_hits) {
+					val->hits = 0;
+				}
+			});
+		}
+
+		return;
+	}
+
 	kh_foreach (ht->htb, k, val, {
 		if (!cb (k, val->value, val->hits, cbdata)) {
 			break;
@@ -679,114 +1075,884 @@ rspamd_map_helper_traverse_hash (void *data,
 	});
 }
 
-struct rspamd_radix_map_helper *
-rspamd_map_helper_new_radix (struct rspamd_map *map)
+static GQuark
+rspamd_map_helper_image_quark (void)
 {
-	struct rspamd_radix_map_helper *r;
-	rspamd_mempool_t *pool;
+	return g_quark_from_static_string ("map-image");
+}
 
-	if (map) {
-		pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
-				map->tag);
+/*
+ * Writes image atomically via temporary file and rename
+ */
+static gboolean
+rspamd_map_helper_write_image (const gchar *path, const guchar *data,
+		gsize len, GError **err)
+{
+	gchar tmpbuf[PATH_MAX];
+	gint fd;
+
+	rspamd_snprintf (tmpbuf, sizeof (tmpbuf), "%s.new", path);
+	fd = rspamd_file_xopen (tmpbuf, O_WRONLY | O_CREAT | O_TRUNC, 00644, FALSE);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_map_helper_image_quark (), errno,
+				"cannot create image %s: %s", tmpbuf, strerror (errno));
+		return FALSE;
 	}
-	else {
-		pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
-				NULL);
+
+	if (write (fd, data, len) != (gssize)len) {
+		g_set_error (err, rspamd_map_helper_image_quark (), errno,
+				"cannot write image %s: %s", tmpbuf, strerror (errno));
+		close (fd);
+		unlink (tmpbuf);
+
+		return FALSE;
 	}
 
-	r = rspamd_mempool_alloc0 (pool, sizeof (*r));
-	r->trie = radix_create_compressed_with_pool (pool);
-	r->htb = kh_init (rspamd_map_hash);
-	r->pool = pool;
-	rspamd_cryptobox_fast_hash_init (&r->hst, map_hash_seed);
+	close (fd);
 
-	return r;
-}
+	if (rename (tmpbuf, path) == -1) {
+		g_set_error (err, rspamd_map_helper_image_quark (), errno,
+				"cannot rename image %s: %s", tmpbuf, strerror (errno));
+		unlink (tmpbuf);
 
-void
-rspamd_map_helper_destroy_radix (struct rspamd_radix_map_helper *r)
-{
-	if (r == NULL || !r->pool) {
-		return;
+		return FALSE;
 	}
 
-	kh_destroy (rspamd_map_hash, r->htb);
-	rspamd_mempool_t *pool = r->pool;
-	memset (r, 0, sizeof (*r));
-	rspamd_mempool_delete (pool);
+	return TRUE;
 }
 
-static void
-rspamd_map_helper_traverse_radix (void *data,
-		rspamd_map_traverse_cb cb,
-		gpointer cbdata,
-		gboolean reset_hits)
+/*
+ * Maps image read only and checks its magic
+ */
+static gpointer
+rspamd_map_helper_map_image (const gchar *path, const gchar *magic,
+		gsize hdr_len, gsize *len, GError **err)
 {
-	gconstpointer k;
-	struct rspamd_map_helper_value *val;
-	struct rspamd_radix_map_helper *r = data;
+	struct stat st;
+	gpointer image;
+	gint fd;
 
-	kh_foreach (r->htb, k, val, {
-		if (!cb (k, val->value, val->hits, cbdata)) {
-			break;
-		}
+	fd = rspamd_file_xopen (path, O_RDONLY, 0, TRUE);
 
-		if (reset_hits) {
-			val->hits = 0;
-		}
-	});
-}
+	if (fd == -1) {
+		g_set_error (err, rspamd_map_helper_image_quark (), errno,
+				"cannot open image %s: %s", path, strerror (errno));
+		return NULL;
+	}
 
-struct rspamd_regexp_map_helper *
-rspamd_map_helper_new_regexp (struct rspamd_map *map,
-		enum rspamd_regexp_map_flags flags)
-{
-	struct rspamd_regexp_map_helper *re_map;
-	rspamd_mempool_t *pool;
+	if (fstat (fd, &st) == -1 || st.st_size < (off_t)hdr_len) {
+		g_set_error (err, rspamd_map_helper_image_quark (), EINVAL,
+				"cannot use image %s: bad size", path);
+		close (fd);
 
-	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
-			map->tag);
+		return NULL;
+	}
 
-	re_map = rspamd_mempool_alloc0 (pool, sizeof (*re_map));
-	re_map->pool = pool;
-	re_map->values = g_ptr_array_new ();
-	re_map->regexps = g_ptr_array_new ();
-	re_map->map = map;
-	re_map->map_flags = flags;
-	re_map->htb = kh_init (rspamd_map_hash);
-	rspamd_cryptobox_fast_hash_init (&re_map->hst, map_hash_seed);
+	image = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
 
-	return re_map;
-}
+	if (image == MAP_FAILED) {
+		g_set_error (err, rspamd_map_helper_image_quark (), errno,
+				"cannot mmap image %s: %s", path, strerror (errno));
+		return NULL;
+	}
 
+	if (memcmp (image, magic, 8) != 0) {
+		g_set_error (err, rspamd_map_helper_image_quark (), EINVAL,
+				"cannot use image %s: bad magic", path);
+		munmap (image, st.st_size);
 
-void
-rspamd_map_helper_destroy_regexp (struct rspamd_regexp_map_helper *re_map)
+		return NULL;
+	}
+
+	*len = st.st_size;
+
+	return image;
+}
+
+static const gchar *
+rspamd_map_hash_image_find (const struct rspamd_map_hash_image_header *hdr,
+		const gchar *in)
 {
-	rspamd_regexp_t *re;
-	guint i;
+	const struct rspamd_map_hash_image_entry *entries;
+	const gchar *strings;
+	guint64 h;
+	guint32 pos, disp;
 
-	if (!re_map || !re_map->regexps) {
-		return;
+	if (hdr->nelts == 0) {
+		return NULL;
 	}
 
-	for (i = 0; i < re_map->regexps->len; i ++) {
-		re = g_ptr_array_index (re_map->regexps, i);
-		rspamd_regexp_unref (re);
+	h = rspamd_icase_hash (in, strlen (in), hdr->seed);
+	disp = rspamd_map_hash_image_disp (hdr)[
+			rspamd_map_hash_image_bucket (h, hdr->nbuckets)];
+	pos = rspamd_map_hash_image_slot (h, disp, hdr->nslots);
+
+	/* Most of missing keys are rejected without touching strings */
+	if (rspamd_map_hash_image_fps (hdr)[pos] != rspamd_map_hash_image_fp (h)) {
+		return NULL;
 	}
 
-	g_ptr_array_free (re_map->regexps, TRUE);
-	g_ptr_array_free (re_map->values, TRUE);
-	kh_destroy (rspamd_map_hash, re_map->htb);
+	entries = rspamd_map_hash_image_entries (hdr);
+	strings = (const gchar *)(entries + hdr->nslots);
 
-#ifdef WITH_HYPERSCAN
-	if (re_map->hs_scratch) {
-		hs_free_scratch (re_map->hs_scratch);
+	if (g_ascii_strcasecmp (strings + entries[pos].key_off, in) == 0) {
+		return strings + entries[pos].value_off;
 	}
-	if (re_map->hs_db) {
-		hs_free_database (re_map->hs_db);
-	}
-	if (re_map->patterns) {
+
+	return NULL;
+}
+
+struct rspamd_map_hash_image_kv {
+	const gchar *key;
+	const gchar *value;
+	guint64 h;
+};
+
+static gboolean
+rspamd_map_hash_image_collect_cb (gconstpointer key, gconstpointer value,
+		gsize hits, gpointer ud)
+{
+	struct rspamd_map_hash_image_kv kv;
+	GArray *kvs = ud;
+
+	kv.key = key;
+	kv.value = value;
+	kv.h = 0;
+	g_array_append_val (kvs, kv);
+
+	return TRUE;
+}
+
+/*
+ * Places all keys to slots using the specified seed, buckets are processed
+ * from the largest to the smallest, and each bucket gets the first
+ * displacement that moves all its keys to free slots
+ */
+static gboolean
+rspamd_map_hash_image_place (struct rspamd_map_hash_image_kv *kvs, guint32 n,
+		guint64 seed, guint32 nbuckets, guint32 nslots,
+		guint32 *disp, guint16 *fps, guint32 *slot_kv)
+{
+	guint32 *starts, *fill, *members, *order, *by_size, *positions;
+	guint32 i, j, k, b, d, pos, size, max_size = 0;
+	gboolean ret = TRUE, ok = FALSE;
+
+	starts = g_malloc0 (sizeof (*starts) * (nbuckets + 1));
+	fill = g_malloc (sizeof (*fill) * nbuckets);
+	members = g_malloc (sizeof (*members) * MAX (n, 1));
+	order = g_malloc (sizeof (*order) * nbuckets);
+
+	for (i = 0; i < n; i ++) {
+		kvs[i].h = rspamd_icase_hash (kvs[i].key, strlen (kvs[i].key), seed);
+		starts[rspamd_map_hash_image_bucket (kvs[i].h, nbuckets) + 1] ++;
+	}
+
+	for (b = 0; b < nbuckets; b ++) {
+		max_size = MAX (max_size, starts[b + 1]);
+		starts[b + 1] += starts[b];
+	}
+
+	memcpy (fill, starts, sizeof (*fill) * nbuckets);
+
+	for (i = 0; i < n; i ++) {
+		b = rspamd_map_hash_image_bucket (kvs[i].h, nbuckets);
+		members[fill[b] ++] = i;
+	}
+
+	/* Counting sort of buckets by size in descending order */
+	by_size = g_malloc0 (sizeof (*by_size) * (max_size + 2));
+
+	for (b = 0; b < nbuckets; b ++) {
+		by_size[max_size - (starts[b + 1] - starts[b]) + 1] ++;
+	}
+
+	for (i = 0; i <= max_size; i ++) {
+		by_size[i + 1] += by_size[i];
+	}
+
+	for (b = 0; b < nbuckets; b ++) {
+		order[by_size[max_size - (starts[b + 1] - starts[b])] ++] = b;
+	}
+
+	positions = g_malloc (sizeof (*positions) * MAX (max_size, 1));
+	memset (disp, 0, sizeof (*disp) * nbuckets);
+	memset (fps, 0, sizeof (*fps) * nslots);
+
+	for (i = 0; i < nbuckets; i ++) {
+		b = order[i];
+		size = starts[b + 1] - starts[b];
+
+		if (size == 0) {
+			/* All other buckets are empty as well */
+			break;
+		}
+
+		for (d = 0; d < RSPAMD_MAP_PHF_MAX_DISP; d ++) {
+			ok = TRUE;
+
+			for (j = 0; j < size && ok; j ++) {
+				pos = rspamd_map_hash_image_slot (kvs[members[starts[b] + j]].h,
+						d, nslots);
+
+				if (fps[pos] != 0) {
+					ok = FALSE;
+				}
+
+				for (k = 0; k < j && ok; k ++) {
+					if (positions[k] == pos) {
+						ok = FALSE;
+					}
+				}
+
+				positions[j] = pos;
+			}
+
+			if (ok) {
+				break;
+			}
+		}
+
+		if (!ok) {
+			ret = FALSE;
+			break;
+		}
+
+		disp[b] = d;
+
+		for (j = 0; j < size; j ++) {
+			k = members[starts[b] + j];
+			fps[positions[j]] = rspamd_map_hash_image_fp (kvs[k].h);
+			slot_kv[positions[j]] = k;
+		}
+	}
+
+	g_free (starts);
+	g_free (fill);
+	g_free (members);
+	g_free (order);
+	g_free (by_size);
+	g_free (positions);
+
+	return ret;
+}
+
+/*
+ * Builds an image with a perfect hash from the array of keys and values
+ */
+static GByteArray *
+rspamd_map_hash_image_build (GArray *kvs, guint64 digest, GError **err)
+{
+	struct rspamd_map_hash_image_header hdr;
+	struct rspamd_map_hash_image_entry *entries = NULL;
+	struct rspamd_map_hash_image_kv *kv;
+	GByteArray *strings = NULL, *out = NULL;
+	guint32 *disp, *slot_kv = NULL, nbuckets, nslots, i, attempt;
+	guint16 *fps = NULL;
+	const guint16 pad = 0;
+	gboolean placed = FALSE;
+
+	nbuckets = kvs->len / RSPAMD_MAP_PHF_BUCKET_SIZE + 1;
+	nslots = kvs->len / RSPAMD_MAP_PHF_LOAD_FACTOR + 1;
+	disp = g_malloc (sizeof (*disp) * nbuckets);
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, RSPAMD_MAP_HASH_IMAGE_MAGIC, sizeof (hdr.magic));
+
+	for (attempt = 0; attempt < RSPAMD_MAP_PHF_MAX_ATTEMPTS; attempt ++) {
+		if (attempt > 0 && attempt % 2 == 0) {
+			/* Add more free slots if a new seed has not helped */
+			nslots += nslots / 32 + 1;
+		}
+
+		fps = g_realloc (fps, sizeof (*fps) * nslots);
+		slot_kv = g_realloc (slot_kv, sizeof (*slot_kv) * nslots);
+		hdr.seed = map_hash_seed + attempt;
+
+		if (rspamd_map_hash_image_place ((struct rspamd_map_hash_image_kv *)
+				kvs->data, kvs->len, hdr.seed, nbuckets, nslots,
+				disp, fps, slot_kv)) {
+			placed = TRUE;
+			break;
+		}
+	}
+
+	if (!placed) {
+		g_set_error (err, rspamd_map_helper_image_quark (), EINVAL,
+				"cannot build perfect hash for %u keys", kvs->len);
+		goto end;
+	}
+
+	entries = g_malloc0 (sizeof (*entries) * nslots);
+	strings = g_byte_array_new ();
+
+	/* Strings are stored in the order of slots */
+	for (i = 0; i < nslots; i ++) {
+		if (fps[i] == 0) {
+			continue;
+		}
+
+		kv = &g_array_index (kvs, struct rspamd_map_hash_image_kv, slot_kv[i]);
+		entries[i].key_off = strings->len;
+		g_byte_array_append (strings, (const guint8 *)kv->key,
+				strlen (kv->key) + 1);
+		entries[i].value_off = strings->len;
+		g_byte_array_append (strings, (const guint8 *)kv->value,
+				strlen (kv->value) + 1);
+	}
+
+	if (strings->len >= G_MAXUINT32) {
+		g_set_error (err, rspamd_map_helper_image_quark (), E2BIG,
+				"hash map is too large for an image: %u bytes", strings->len);
+		goto end;
+	}
+
+	hdr.digest = digest;
+	hdr.nelts = kvs->len;
+	hdr.nslots = nslots;
+	hdr.nbuckets = nbuckets;
+	hdr.strings_len = strings->len;
+
+	out = g_byte_array_sized_new (
+			rspamd_map_hash_image_entries_offset (nbuckets, nslots) +
+			sizeof (*entries) * nslots + strings->len);
+	g_byte_array_append (out, (const guint8 *)&hdr, sizeof (hdr));
+	g_byte_array_append (out, (const guint8 *)disp, sizeof (*disp) * nbuckets);
+	g_byte_array_append (out, (const guint8 *)fps, sizeof (*fps) * nslots);
+
+	if (nslots & 1) {
+		g_byte_array_append (out, (const guint8 *)&pad, sizeof (pad));
+	}
+
+	g_byte_array_append (out, (const guint8 *)entries,
+			sizeof (*entries) * nslots);
+	g_byte_array_append (out, strings->data, strings->len);
+
+end:
+	g_free (disp);
+	g_free (fps);
+	g_free (slot_kv);
+	g_free (entries);
+
+	if (strings) {
+		g_byte_array_free (strings, TRUE);
+	}
+
+	return out;
+}
+
+/*
+ * Number of elements, including changes of the image
+ */
+static guint
+rspamd_map_helper_hash_size (struct rspamd_hash_map_helper *ht)
+{
+	gconstpointer k;
+	struct rspamd_map_helper_value *val;
+	gboolean in_image;
+	guint n;
+
+	if (ht->image == NULL) {
+		return kh_size (ht->htb);
+	}
+
+	n = ht->image->nelts;
+
+	if (ht->overflow) {
+		kh_foreach (ht->overflow, k, val, {
+			in_image = rspamd_map_hash_image_find (ht->image, k) != NULL;
+
+			if (val != NULL && !in_image) {
+				n ++;
+			}
+			else if (val == NULL && in_image) {
+				n --;
+			}
+		});
+	}
+
+	return n;
+}
+
+static GByteArray *
+rspamd_map_helper_hash_to_image (struct rspamd_hash_map_helper *ht,
+		guint64 digest, GError **err)
+{
+	GByteArray *out;
+	GArray *kvs;
+
+	kvs = g_array_sized_new (FALSE, FALSE,
+			sizeof (struct rspamd_map_hash_image_kv),
+			rspamd_map_helper_hash_size (ht));
+	rspamd_map_helper_traverse_hash (ht, rspamd_map_hash_image_collect_cb,
+			kvs, FALSE);
+	out = rspamd_map_hash_image_build (kvs, digest, err);
+	g_array_free (kvs, TRUE);
+
+	return out;
+}
+
+gboolean
+rspamd_map_helper_save_hash_image (struct rspamd_hash_map_helper *ht,
+		guint64 digest, const gchar *path, GError **err)
+{
+	GByteArray *out;
+	gboolean ret;
+
+	if (ht->image && ht->overflow == NULL) {
+		/* Already compacted or loaded from another image */
+		return rspamd_map_helper_write_image (path,
+				(const guchar *)ht->image, ht->image_len, err);
+	}
+
+	out = rspamd_map_helper_hash_to_image (ht, digest, err);
+
+	if (out == NULL) {
+		return FALSE;
+	}
+
+	ret = rspamd_map_helper_write_image (path, out->data, out->len, err);
+	g_byte_array_free (out, TRUE);
+
+	return ret;
+}
+
+/*
+ * Replaces hash table of a fully read map with a perfect hash in a single
+ * contiguous buffer, the original helper is not modified
+ */
+static struct rspamd_hash_map_helper *
+rspamd_map_helper_compact_hash (struct rspamd_map *map,
+		struct rspamd_hash_map_helper *ht, guint64 digest, GError **err)
+{
+	struct rspamd_hash_map_helper *htb;
+	rspamd_mempool_t *pool;
+	GByteArray *out;
+
+	out = rspamd_map_helper_hash_to_image (ht, digest, err);
+
+	if (out == NULL) {
+		return NULL;
+	}
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+			map ? map->tag : NULL);
+	htb = rspamd_mempool_alloc0 (pool, sizeof (*htb));
+	htb->pool = pool;
+	htb->map = map;
+	htb->image_len = out->len;
+	htb->image = (const struct rspamd_map_hash_image_header *)
+			g_byte_array_free (out, FALSE);
+
+	return htb;
+}
+
+struct rspamd_hash_map_helper *
+rspamd_map_helper_load_hash_image (struct rspamd_map *map, const gchar *path,
+		GError **err)
+{
+	struct rspamd_hash_map_helper *htb;
+	const struct rspamd_map_hash_image_header *hdr;
+	rspamd_mempool_t *pool;
+	gpointer image;
+	gsize len;
+
+	image = rspamd_map_helper_map_image (path, RSPAMD_MAP_HASH_IMAGE_MAGIC,
+			sizeof (*hdr), &len, err);
+
+	if (image == NULL) {
+		return NULL;
+	}
+
+	hdr = (const struct rspamd_map_hash_image_header *)image;
+
+	if (hdr->nslots == 0 || hdr->nbuckets == 0 || hdr->nelts > hdr->nslots ||
+			rspamd_map_hash_image_entries_offset (hdr->nbuckets, hdr->nslots) +
+			sizeof (struct rspamd_map_hash_image_entry) * (gsize)hdr->nslots +
+			hdr->strings_len != len) {
+		g_set_error (err, rspamd_map_helper_image_quark (), EINVAL,
+				"cannot use image %s: bad header", path);
+		munmap (image, len);
+
+		return NULL;
+	}
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+			map ? map->tag : NULL);
+	htb = rspamd_mempool_alloc0 (pool, sizeof (*htb));
+	htb->pool = pool;
+	htb->map = map;
+	htb->image = hdr;
+	htb->image_len = len;
+	htb->image_mapped = TRUE;
+
+	return htb;
+}
+
+struct rspamd_radix_image_cbdata {
+	GHashTable *ids;
+	GArray *entries;
+	GByteArray *strings;
+};
+
+static guint32
+rspamd_radix_image_add_value (struct rspamd_radix_image_cbdata *cbd,
+		const struct rspamd_map_helper_value *val)
+{
+	struct rspamd_map_hash_image_entry e;
+	guint32 id;
+
+	e.key_off = cbd->strings->len;
+	g_byte_array_append (cbd->strings, (const guint8 *)val->key,
+			strlen (val->key) + 1);
+	e.value_off = cbd->strings->len;
+	g_byte_array_append (cbd->strings, (const guint8 *)val->value,
+			strlen (val->value) + 1);
+	id = cbd->entries->len;
+	g_array_append_val (cbd->entries, e);
+	g_hash_table_insert (cbd->ids, (gpointer)val, GUINT_TO_POINTER (id + 1));
+
+	return id;
+}
+
+static guint32
+rspamd_radix_image_value_id (uintptr_t value, gpointer ud)
+{
+	struct rspamd_radix_image_cbdata *cbd = ud;
+	gpointer found;
+
+	found = g_hash_table_lookup (cbd->ids, (gpointer)value);
+
+	if (found) {
+		return GPOINTER_TO_UINT (found) - 1;
+	}
+
+	/* Value replaced in hash but still referenced by trie */
+	return rspamd_radix_image_add_value (cbd,
+			(const struct rspamd_map_helper_value *)value);
+}
+
+gboolean
+rspamd_map_helper_save_radix_image (struct rspamd_radix_map_helper *r,
+		guint64 digest, const gchar *path, GError **err)
+{
+	struct rspamd_map_radix_image_header hdr;
+	struct rspamd_radix_image_cbdata cbd;
+	struct rspamd_map_helper_value *val;
+	GByteArray *flat, *out;
+	gconstpointer k;
+	gboolean ret = FALSE;
+
+	if (r->image) {
+		g_set_error (err, rspamd_map_helper_image_quark (), EINVAL,
+				"radix map is already an image");
+		return FALSE;
+	}
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, RSPAMD_MAP_RADIX_IMAGE_MAGIC, sizeof (hdr.magic));
+	hdr.digest = digest;
+	hdr.nkeys = kh_size (r->htb);
+
+	cbd.ids = g_hash_table_new (g_direct_hash, g_direct_equal);
+	cbd.entries = g_array_sized_new (FALSE, FALSE,
+			sizeof (struct rspamd_map_hash_image_entry), hdr.nkeys);
+	cbd.strings = g_byte_array_new ();
+	flat = g_byte_array_new ();
+	out = g_byte_array_new ();
+
+	/* Keys go first to be traversed */
+	kh_foreach (r->htb, k, val, {
+		rspamd_radix_image_add_value (&cbd, val);
+	});
+
+	if (!radix_flat_serialize (r->trie, rspamd_radix_image_value_id, &cbd,
+			flat, err)) {
+		goto end;
+	}
+
+	if (cbd.strings->len >= G_MAXUINT32) {
+		g_set_error (err, rspamd_map_helper_image_quark (), E2BIG,
+				"radix map is too large for an image: %u bytes",
+				cbd.strings->len);
+		goto end;
+	}
+
+	hdr.nvalues = cbd.entries->len;
+	hdr.flat_len = flat->len;
+	hdr.strings_len = cbd.strings->len;
+
+	g_byte_array_append (out, (const guint8 *)&hdr, sizeof (hdr));
+	g_byte_array_append (out, flat->data, flat->len);
+	g_byte_array_append (out, (const guint8 *)cbd.entries->data,
+			cbd.entries->len * sizeof (struct rspamd_map_hash_image_entry));
+	g_byte_array_append (out, cbd.strings->data, cbd.strings->len);
+
+	ret = rspamd_map_helper_write_image (path, out->data, out->len, err);
+
+end:
+	g_hash_table_unref (cbd.ids);
+	g_array_free (cbd.entries, TRUE);
+	g_byte_array_free (cbd.strings, TRUE);
+	g_byte_array_free (flat, TRUE);
+	g_byte_array_free (out, TRUE);
+
+	return ret;
+}
+
+struct rspamd_radix_map_helper *
+rspamd_map_helper_load_radix_image (struct rspamd_map *map, const gchar *path,
+		GError **err)
+{
+	struct rspamd_radix_map_helper *r;
+	const struct rspamd_map_radix_image_header *hdr;
+	rspamd_mempool_t *pool;
+	radix_flat_t *flat;
+	gpointer image;
+	gsize len;
+
+	image = rspamd_map_helper_map_image (path, RSPAMD_MAP_RADIX_IMAGE_MAGIC,
+			sizeof (*hdr), &len, err);
+
+	if (image == NULL) {
+		return NULL;
+	}
+
+	hdr = (const struct rspamd_map_radix_image_header *)image;
+
+	if (hdr->nkeys > hdr->nvalues || sizeof (*hdr) + hdr->flat_len +
+			sizeof (struct rspamd_map_hash_image_entry) * (gsize)hdr->nvalues +
+			hdr->strings_len != len) {
+		g_set_error (err, rspamd_map_helper_image_quark (), EINVAL,
+				"cannot use image %s: bad header", path);
+		munmap (image, len);
+
+		return NULL;
+	}
+
+	flat = radix_flat_attach ((const guchar *)(hdr + 1), hdr->flat_len, err);
+
+	if (flat == NULL) {
+		munmap (image, len);
+
+		return NULL;
+	}
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+			map ? map->tag : NULL);
+	r = rspamd_mempool_alloc0 (pool, sizeof (*r));
+	r->pool = pool;
+	r->map = map;
+	r->flat = flat;
+	r->image = hdr;
+	r->image_len = len;
+	r->entries = (const struct rspamd_map_hash_image_entry *)
+			((const guchar *)(hdr + 1) + hdr->flat_len);
+	r->strings = (const gchar *)(r->entries + hdr->nvalues);
+
+	if (map && map->read_callback == rspamd_asn_read) {
+		guint i;
+
+		r->asn = rspamd_mempool_alloc0 (pool,
+				sizeof (*r->asn) * MAX (hdr->nvalues, 1));
+
+		for (i = 0; i < hdr->nvalues; i ++) {
+			if (rspamd_map_helper_parse_asn (r->strings + r->entries[i].value_off,
+					&r->asn[i])) {
+				r->asn[i].prefix = r->strings + r->entries[i].key_off;
+			}
+		}
+	}
+
+	return r;
+}
+
+static gboolean
+rspamd_map_helper_save_hash_image_cb (struct rspamd_map *map, gpointer data,
+		const gchar *path, GError **err)
+{
+	return rspamd_map_helper_save_hash_image (data, map->digest, path, err);
+}
+
+static gpointer
+rspamd_map_helper_load_hash_image_cb (struct rspamd_map *map,
+		const gchar *path, GError **err)
+{
+	return rspamd_map_helper_load_hash_image (map, path, err);
+}
+
+static gboolean
+rspamd_map_helper_save_radix_image_cb (struct rspamd_map *map, gpointer data,
+		const gchar *path, GError **err)
+{
+	return rspamd_map_helper_save_radix_image (data, map->digest, path, err);
+}
+
+static gpointer
+rspamd_map_helper_load_radix_image_cb (struct rspamd_map *map,
+		const gchar *path, GError **err)
+{
+	return rspamd_map_helper_load_radix_image (map, path, err);
+}
+
+const struct rspamd_map_image_ops *
+rspamd_map_helper_image_ops (map_cb_t read_callback)
+{
+	static const struct rspamd_map_image_ops hash_ops = {
+		.save = rspamd_map_helper_save_hash_image_cb,
+		.load = rspamd_map_helper_load_hash_image_cb,
+	};
+	static const struct rspamd_map_image_ops radix_ops = {
+		.save = rspamd_map_helper_save_radix_image_cb,
+		.load = rspamd_map_helper_load_radix_image_cb,
+	};
+
+	if (read_callback == rspamd_kv_list_read) {
+		return &hash_ops;
+	}
+	else if (read_callback == rspamd_radix_read ||
+			read_callback == rspamd_asn_read) {
+		return &radix_ops;
+	}
+
+	return NULL;
+}
+
+struct rspamd_radix_map_helper *
+rspamd_map_helper_new_radix (struct rspamd_map *map)
+{
+	struct rspamd_radix_map_helper *r;
+	rspamd_mempool_t *pool;
+
+	if (map) {
+		pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+				map->tag);
+	}
+	else {
+		pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+				NULL);
+	}
+
+	r = rspamd_mempool_alloc0 (pool, sizeof (*r));
+	r->trie = radix_create_compressed_with_pool (pool);
+	r->htb = kh_init (rspamd_map_hash);
+	r->pool = pool;
+	r->map = map;
+	rspamd_cryptobox_fast_hash_init (&r->hst, map_hash_seed);
+
+	if (map && map->shared_image) {
+		/* Needed to save the trie as a flat image */
+		radix_compressed_track_prefixes (r->trie);
+	}
+
+	return r;
+}
+
+void
+rspamd_map_helper_destroy_radix (struct rspamd_radix_map_helper *r)
+{
+	if (r == NULL || !r->pool) {
+		return;
+	}
+
+	if (r->image) {
+		radix_flat_destroy (r->flat);
+		munmap ((gpointer)r->image, r->image_len);
+	}
+	else {
+		kh_destroy (rspamd_map_hash, r->htb);
+	}
+
+	rspamd_mempool_t *pool = r->pool;
+	memset (r, 0, sizeof (*r));
+	rspamd_mempool_delete (pool);
+}
+
+static void
+rspamd_map_helper_traverse_radix (void *data,
+		rspamd_map_traverse_cb cb,
+		gpointer cbdata,
+		gboolean reset_hits)
+{
+	gconstpointer k;
+	struct rspamd_map_helper_value *val;
+	struct rspamd_radix_map_helper *r = data;
+
+	if (r->image) {
+		guint i;
+
+		for (i = 0; i < r->image->nkeys; i ++) {
+			if (!cb (r->strings + r->entries[i].key_off,
+					r->strings + r->entries[i].value_off, 0, cbdata)) {
+				break;
+			}
+		}
+
+		return;
+	}
+
+	kh_foreach (r->htb, k, val, {
+		if (!cb (k, val->value, val->hits, cbdata)) {
+			break;
+		}
+
+		if (reset_hits) {
+			val->hits = 0;
+		}
+	});
+}
+
+struct rspamd_regexp_map_helper *
+rspamd_map_helper_new_regexp (struct rspamd_map *map,
+		enum rspamd_regexp_map_flags flags)
+{
+	struct rspamd_regexp_map_helper *re_map;
+	rspamd_mempool_t *pool;
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+			map->tag);
+
+	re_map = rspamd_mempool_alloc0 (pool, sizeof (*re_map));
+	re_map->pool = pool;
+	re_map->values = g_ptr_array_new ();
+	re_map->regexps = g_ptr_array_new ();
+	re_map->map = map;
+	re_map->map_flags = flags;
+	re_map->htb = kh_init (rspamd_map_hash);
+	rspamd_cryptobox_fast_hash_init (&re_map->hst, map_hash_seed);
+
+	return re_map;
+}
+
+
+void
+rspamd_map_helper_destroy_regexp (struct rspamd_regexp_map_helper *re_map)
+{
+	rspamd_regexp_t *re;
+	guint i;
+
+	if (!re_map || !re_map->regexps) {
+		return;
+	}
+
+	for (i = 0; i < re_map->regexps->len; i ++) {
+		re = g_ptr_array_index (re_map->regexps, i);
+		rspamd_regexp_unref (re);
+	}
+
+	g_ptr_array_free (re_map->regexps, TRUE);
+	g_ptr_array_free (re_map->values, TRUE);
+	kh_destroy (rspamd_map_hash, re_map->htb);
+
+#ifdef WITH_HYPERSCAN
+	if (re_map->hs_scratch) {
+		hs_free_scratch (re_map->hs_scratch);
+	}
+	if (re_map->hs_db) {
+		hs_free_database (re_map->hs_db);
+	}
+	if (re_map->patterns) {
 		g_free (re_map->patterns);
 	}
 	if (re_map->flags) {
@@ -802,6 +1968,106 @@ rspamd_map_helper_destroy_regexp (struct rspamd_regexp_map_helper *re_map)
 	rspamd_mempool_delete (pool);
 }
 
+/*
+ * Images are read only, so changes are stored in the overflow table
+ */
+static void
+rspamd_map_helper_overflow_set (struct rspamd_hash_map_helper *ht,
+		const gchar *key, const gchar *value)
+{
+	struct rspamd_map_helper_value *val = NULL;
+	khiter_t k;
+	gsize vlen;
+	gint r;
+
+	if (ht->overflow == NULL) {
+		ht->overflow = kh_init (rspamd_map_hash);
+		rspamd_cryptobox_fast_hash_init (&ht->hst, ht->image->digest);
+	}
+
+	k = kh_get (rspamd_map_hash, ht->overflow, key);
+
+	if (k == kh_end (ht->overflow)) {
+		k = kh_put (rspamd_map_hash, ht->overflow,
+				rspamd_mempool_strdup (ht->pool, key), &r);
+	}
+
+	if (value) {
+		/* Null termination due to alloc0 */
+		vlen = strlen (value);
+		val = rspamd_mempool_alloc0 (ht->pool, sizeof (*val) + vlen + 1);
+		memcpy (val->value, value, vlen);
+		val->key = kh_key (ht->overflow, k);
+		rspamd_cryptobox_fast_hash_update (&ht->hst, key, strlen (key));
+	}
+
+	kh_value (ht->overflow, k) = val;
+}
+
+/*
+ * Applies a single change: `-key` removes key, `+key value` or `key value`
+ * inserts or replaces it
+ */
+static void
+rspamd_map_helper_apply_hash_delta (gpointer st, gconstpointer key,
+		gconstpointer value)
+{
+	struct rspamd_hash_map_helper *ht = st;
+	const gchar *k = key;
+	khiter_t it;
+
+	if (*k == '-') {
+		if (ht->image) {
+			rspamd_map_helper_overflow_set (ht, k + 1, NULL);
+		}
+		else {
+			it = kh_get (rspamd_map_hash, ht->htb, k + 1);
+
+			if (it != kh_end (ht->htb)) {
+				/* Value is freed with the pool on the next full reload */
+				kh_del (rspamd_map_hash, ht->htb, it);
+			}
+		}
+
+		rspamd_cryptobox_fast_hash_update (&ht->hst, k, strlen (k));
+	}
+	else {
+		if (*k == '+') {
+			k ++;
+		}
+
+		if (ht->image) {
+			rspamd_map_helper_overflow_set (ht, k, value);
+		}
+		else {
+			rspamd_map_helper_insert_hash (st, k, value);
+
+			if (ht->filter) {
+				rspamd_map_filter_add (ht->filter, ht->filter_mask,
+						rspamd_icase_hash (k, strlen (k), map_hash_seed));
+			}
+		}
+	}
+}
+
+gboolean
+rspamd_map_helper_delta_supported (map_cb_t read_callback)
+{
+	return read_callback == rspamd_kv_list_read;
+}
+
+gboolean
+rspamd_map_helper_thread_safe (map_cb_t read_callback)
+{
+	return read_callback == rspamd_kv_list_read ||
+			read_callback == rspamd_radix_read ||
+			read_callback == rspamd_asn_read ||
+			read_callback == rspamd_regexp_list_read_single ||
+			read_callback == rspamd_regexp_list_read_multiple ||
+			read_callback == rspamd_glob_list_read_single ||
+			read_callback == rspamd_glob_list_read_multiple;
+}
+
 gchar *
 rspamd_kv_list_read (
 		gchar * chunk,
@@ -813,11 +2079,17 @@ rspamd_kv_list_read (
 		data->cur_data = rspamd_map_helper_new_hash (data->map);
 	}
 
+	/*
+	 * Changes could be appended before the whole file is reread, so delta
+	 * maps parse change markers on the full read as well
+	 */
 	return rspamd_parse_kv_list (
 			chunk,
 			len,
 			data,
-			rspamd_map_helper_insert_hash,
+			(data->delta || data->map->delta_updates) ?
+					rspamd_map_helper_apply_hash_delta :
+					rspamd_map_helper_insert_hash,
 			"",
 			final);
 }
@@ -830,10 +2102,93 @@ rspamd_kv_list_fin (struct map_cb_data *data, void **target)
 
 	if (data->cur_data) {
 		htb = (struct rspamd_hash_map_helper *)data->cur_data;
-		msg_info_map ("read hash of %d elements", kh_size (htb->htb));
 		data->map->traverse_function = rspamd_map_helper_traverse_hash;
-		data->map->nelts = kh_size (htb->htb);
-		data->map->digest = rspamd_cryptobox_fast_hash_final (&htb->hst);
+
+		if (htb->image && htb->overflow) {
+			rspamd_cryptobox_fast_hash_state_t hst;
+
+			memcpy (&hst, &htb->hst, sizeof (hst));
+			data->map->nelts = rspamd_map_helper_hash_size (htb);
+			data->map->digest = rspamd_cryptobox_fast_hash_final (&hst);
+			msg_info_map ("updated hash image of %d elements, %d changes "
+					"are not compacted", data->map->nelts,
+					kh_size (htb->overflow));
+
+			if (kh_size (htb->overflow) > MAX (RSPAMD_MAP_PHF_OVERFLOW_MIN,
+					htb->image->nelts * RSPAMD_MAP_PHF_OVERFLOW_RATIO)) {
+				struct rspamd_hash_map_helper *compact;
+				GError *err = NULL;
+
+				compact = rspamd_map_helper_compact_hash (map, htb,
+						data->map->digest, &err);
+
+				if (compact) {
+					msg_info_map ("rebuilt hash image of %d elements, %z bytes",
+							compact->image->nelts, compact->image_len);
+					if (data->prev_data) {
+						rspamd_map_helper_destroy_hash (htb);
+					}
+					else {
+						/* Changes are applied in place, so prev_data is free */
+						data->prev_data = htb;
+					}
+
+					data->cur_data = compact;
+				}
+				else {
+					msg_err_map ("cannot compact hash: %e", err);
+					g_error_free (err);
+				}
+			}
+		}
+		else if (htb->image) {
+			msg_info_map ("attached hash image of %d elements",
+					htb->image->nelts);
+			data->map->nelts = htb->image->nelts;
+			data->map->digest = htb->image->digest;
+		}
+		else {
+			/* Hash state is kept intact as changes could be applied later */
+			rspamd_cryptobox_fast_hash_state_t hst;
+
+			memcpy (&hst, &htb->hst, sizeof (hst));
+			msg_info_map ("%s hash of %d elements",
+					data->delta ? "updated" : "read", kh_size (htb->htb));
+			data->map->nelts = kh_size (htb->htb);
+			data->map->digest = rspamd_cryptobox_fast_hash_final (&hst);
+
+			if (map->perfect_hash) {
+				struct rspamd_hash_map_helper *compact;
+				GError *err = NULL;
+
+				compact = rspamd_map_helper_compact_hash (map, htb,
+						data->map->digest, &err);
+
+				if (compact) {
+					msg_info_map ("compacted hash of %d elements to %z bytes",
+							compact->image->nelts, compact->image_len);
+					rspamd_map_helper_destroy_hash (htb);
+					data->cur_data = compact;
+				}
+				else {
+					msg_err_map ("cannot compact hash: %e", err);
+					g_error_free (err);
+				}
+			}
+
+			htb = data->cur_data;
+
+			/*
+			 * Perfect hash has fingerprints that work as a filter. Delta keys
+			 * are already in the filter, so it is rebuilt only when the map
+			 * has grown twice since the filter has been built
+			 */
+			if (map->lookup_filter && htb->htb &&
+					(!data->delta || htb->filter == NULL ||
+					kh_size (htb->htb) > htb->filter_nkeys * 2)) {
+				rspamd_map_helper_build_filter (htb);
+			}
+		}
 	}
 
 	if (target) {
@@ -881,6 +2236,31 @@ rspamd_radix_read (
 			final);
 }
 
+gchar *
+rspamd_asn_read (
+		gchar * chunk,
+		gint len,
+		struct map_cb_data *data,
+		gboolean final)
+{
+	struct rspamd_radix_map_helper *r;
+	struct rspamd_map *map = data->map;
+
+	if (data->cur_data == NULL) {
+		r = rspamd_map_helper_new_radix (map);
+		data->cur_data = r;
+	}
+
+	/* Lines without asn are invalid */
+	return rspamd_parse_kv_list (
+			chunk,
+			len,
+			data,
+			rspamd_map_helper_insert_asn,
+			"",
+			final);
+}
+
 void
 rspamd_radix_fin (struct map_cb_data *data, void **target)
 {
@@ -889,11 +2269,20 @@ rspamd_radix_fin (struct map_cb_data *data, void **target)
 
 	if (data->cur_data) {
 		r = (struct rspamd_radix_map_helper *)data->cur_data;
-		msg_info_map ("read radix trie of %z elements: %s",
-				radix_get_size (r->trie), radix_get_info (r->trie));
 		data->map->traverse_function = rspamd_map_helper_traverse_radix;
-		data->map->nelts = kh_size (r->htb);
-		data->map->digest = rspamd_cryptobox_fast_hash_final (&r->hst);
+
+		if (r->image) {
+			msg_info_map ("attached radix image of %d elements",
+					r->image->nkeys);
+			data->map->nelts = r->image->nkeys;
+			data->map->digest = r->image->digest;
+		}
+		else {
+			msg_info_map ("read radix trie of %z elements: %s",
+					radix_get_size (r->trie), radix_get_info (r->trie));
+			data->map->nelts = kh_size (r->htb);
+			data->map->digest = rspamd_cryptobox_fast_hash_final (&r->hst);
+		}
 	}
 
 	if (target) {
@@ -917,6 +2306,153 @@ rspamd_radix_dtor (struct map_cb_data *data)
 	}
 }
 
+#ifdef WITH_HYPERSCAN
+/* Temporary files older than this are left by crashed writers */
+#define RSPAMD_RE_MAP_CACHE_TMP_TIMEOUT 60.0
+
+static void
+rspamd_re_map_cache_path (struct rspamd_regexp_map_helper *re_map,
+		const guchar *hash, const gchar *suffix, gchar *path, gsize len)
+{
+	rspamd_snprintf (path, len, "%s/%*xs.hsmap%s",
+			re_map->map->cfg->hs_cache_dir,
+			(gint)rspamd_cryptobox_HASHBYTES / 2, hash, suffix);
+}
+
+/*
+ * Removes cache files with the specified suffix that have not been modified
+ * for `max_age` seconds. Databases are touched on load, so only unused ones
+ * are removed.
+ */
+static void
+rspamd_re_map_cache_expire (struct rspamd_map *map, const gchar *suffix,
+		gdouble max_age)
+{
+	gchar pattern[PATH_MAX];
+	glob_t globbuf;
+	struct stat st;
+	gdouble now;
+	guint i;
+	gint rc;
+
+	now = rspamd_get_calendar_ticks ();
+	memset (&globbuf, 0, sizeof (globbuf));
+	rspamd_snprintf (pattern, sizeof (pattern), "%s%c*.hsmap%s",
+			map->cfg->hs_cache_dir, G_DIR_SEPARATOR, suffix);
+
+	if ((rc = glob (pattern, 0, NULL, &globbuf)) == 0) {
+		for (i = 0; i < globbuf.gl_pathc; i ++) {
+			if (stat (globbuf.gl_pathv[i], &st) == -1 ||
+					now - st.st_mtime <= max_age) {
+				continue;
+			}
+
+			msg_info_map ("remove stale hyperscan cache %s",
+					globbuf.gl_pathv[i]);
+
+			if (unlink (globbuf.gl_pathv[i]) == -1 && errno != ENOENT) {
+				msg_warn_map ("cannot unlink %s: %s", globbuf.gl_pathv[i],
+						strerror (errno));
+			}
+		}
+	}
+	else if (rc != GLOB_NOMATCH) {
+		msg_warn_map ("glob %s failed: %s", pattern, strerror (errno));
+	}
+
+	globfree (&globbuf);
+}
+
+static gboolean
+rspamd_re_map_try_load_hs (struct rspamd_regexp_map_helper *re_map,
+		const guchar *hash)
+{
+	gchar fp[PATH_MAX];
+	gpointer data;
+	gsize len;
+
+	if (re_map->map->cfg->hs_cache_dir == NULL) {
+		return FALSE;
+	}
+
+	rspamd_re_map_cache_path (re_map, hash, "", fp, sizeof (fp));
+
+	if ((data = rspamd_file_xmap (fp, PROT_READ, &len, TRUE)) != NULL) {
+		if (hs_deserialize_database (data, len, &re_map->hs_db) == HS_SUCCESS) {
+			munmap (data, len);
+			re_map->hs_cache_path = rspamd_mempool_strdup (re_map->pool, fp);
+			/* Used databases are not expired */
+			(void)utime (fp, NULL);
+
+			return TRUE;
+		}
+
+		munmap (data, len);
+		/* Remove stale file, e.g. from another version of hyperscan */
+		(void)unlink (fp);
+	}
+
+	return FALSE;
+}
+
+static void
+rspamd_re_map_try_save_hs (struct rspamd_regexp_map_helper *re_map,
+		const guchar *hash)
+{
+	struct rspamd_map *map = re_map->map;
+	gchar fp[PATH_MAX], np[PATH_MAX];
+	char *bytes = NULL;
+	gsize len;
+	gint fd;
+
+	if (map->cfg->hs_cache_dir == NULL) {
+		return;
+	}
+
+	rspamd_re_map_cache_expire (map, ".tmp", RSPAMD_RE_MAP_CACHE_TMP_TIMEOUT);
+
+	if (map->cfg->hs_map_cache_expire > 0) {
+		rspamd_re_map_cache_expire (map, "", map->cfg->hs_map_cache_expire);
+	}
+
+	rspamd_re_map_cache_path (re_map, hash, ".tmp", fp, sizeof (fp));
+
+	/* Another process could save the same database concurrently */
+	if ((fd = rspamd_file_xopen (fp, O_WRONLY | O_CREAT | O_EXCL, 00644, 0)) == -1) {
+		return;
+	}
+
+	if (hs_serialize_database (re_map->hs_db, &bytes, &len) != HS_SUCCESS) {
+		msg_warn_map ("cannot serialize hyperscan cache to %s", fp);
+		unlink (fp);
+		close (fd);
+
+		return;
+	}
+
+	if (write (fd, bytes, len) != (gssize)len) {
+		msg_warn_map ("cannot write hyperscan cache to %s: %s",
+				fp, strerror (errno));
+		unlink (fp);
+	}
+	else {
+		rspamd_re_map_cache_path (re_map, hash, "", np, sizeof (np));
+
+		if (rename (fp, np) == -1) {
+			msg_warn_map ("cannot rename hyperscan cache from %s to %s: %s",
+					fp, np, strerror (errno));
+			unlink (fp);
+		}
+		else {
+			re_map->hs_cache_path = rspamd_mempool_strdup (re_map->pool, np);
+		}
+	}
+
+	free (bytes);
+	close (fd);
+}
+#endif
+
 static void
 rspamd_re_map_finalize (struct rspamd_regexp_map_helper *re_map)
 {
@@ -977,23 +2513,48 @@ rspamd_re_map_finalize (struct rspamd_regexp_map_helper *re_map)
 	}
 
 	if (re_map->regexps->len > 0 && re_map->patterns) {
-		if (hs_compile_multi (re_map->patterns,
-				re_map->flags,
-				re_map->ids,
-				re_map->regexps->len,
-				HS_MODE_BLOCK,
-				&plt,
-				&re_map->hs_db,
-				&err) != HS_SUCCESS) {
-
-			msg_err_map ("cannot create tree of regexp when processing '%s': %s",
-					err->expression >= 0 ?
-							re_map->patterns[err->expression] :
-							"unknown regexp", err->message);
-			re_map->hs_db = NULL;
-			hs_free_compile_error (err);
+		rspamd_cryptobox_hash_state_t st;
+		guchar hash[rspamd_cryptobox_HASHBYTES];
 
-			return;
+		/* Database depends on patterns, their flags and the target platform */
+		rspamd_cryptobox_hash_init (&st, NULL, 0);
+
+		for (i = 0; i < re_map->regexps->len; i ++) {
+			rspamd_cryptobox_hash_update (&st,
+					(const guchar *)re_map->patterns[i],
+					strlen (re_map->patterns[i]) + 1);
+		}
+
+		rspamd_cryptobox_hash_update (&st, (const guchar *)re_map->flags,
+				sizeof (*re_map->flags) * re_map->regexps->len);
+		rspamd_cryptobox_hash_update (&st, (const guchar *)&plt, sizeof (plt));
+		rspamd_cryptobox_hash_final (&st, hash);
+
+		if (rspamd_re_map_try_load_hs (re_map, hash)) {
+			msg_info_map ("loaded hyperscan database of %ud regexps from %s",
+					re_map->regexps->len, re_map->hs_cache_path);
+		}
+		else {
+			if (hs_compile_multi (re_map->patterns,
+					re_map->flags,
+					re_map->ids,
+					re_map->regexps->len,
+					HS_MODE_BLOCK,
+					&plt,
+					&re_map->hs_db,
+					&err) != HS_SUCCESS) {
+
+				msg_err_map ("cannot create tree of regexp when processing '%s': %s",
+						err->expression >= 0 ?
+								re_map->patterns[err->expression] :
+								"unknown regexp", err->message);
+				re_map->hs_db = NULL;
+				hs_free_compile_error (err);
+
+				return;
+			}
+
+			rspamd_re_map_try_save_hs (re_map, hash);
 		}
 
 		if (hs_alloc_scratch (re_map->hs_db, &re_map->hs_scratch) != HS_SUCCESS) {
@@ -1124,6 +2685,10 @@ rspamd_regexp_list_fin (struct map_cb_data *data, void **target)
 	}
 
 	if (data->prev_data) {
+		/*
+		 * Cached databases are named by content, so they could be used by
+		 * other processes and are removed by expiration only
+		 */
 		rspamd_map_helper_destroy_regexp (data->prev_data);
 	}
 }
@@ -1192,6 +2757,8 @@ rspamd_match_regexp_map_single (struct rspamd_regexp_map_helper *map,
 				val->hits ++;
 			}
 
+			rspamd_map_helper_count_lookup (map->map, ret != NULL);
+
 			return ret;
 		}
 	}
@@ -1212,6 +2779,8 @@ rspamd_match_regexp_map_single (struct rspamd_regexp_map_helper *map,
 		}
 	}
 
+	rspamd_map_helper_count_lookup (map->map, ret != NULL);
+
 	return ret;
 }
 
@@ -1300,6 +2869,8 @@ rspamd_match_regexp_map_all (struct rspamd_regexp_map_helper *map,
 		}
 	}
 
+	rspamd_map_helper_count_lookup (map->map, ret->len > 0);
+
 	if (ret->len > 0) {
 		return ret;
 	}
@@ -1314,21 +2885,59 @@ rspamd_match_hash_map (struct rspamd_hash_map_helper *map, const gchar *in)
 {
 	khiter_t k;
 	struct rspamd_map_helper_value *val;
+	gconstpointer ret = NULL;
 
-	if (map == NULL || map->htb == NULL) {
+	if (map == NULL) {
 		return NULL;
 	}
 
-	k = kh_get (rspamd_map_hash, map->htb, in);
+	if (map->image) {
+		if (map->overflow &&
+				(k = kh_get (rspamd_map_hash, map->overflow, in)) !=
+				kh_end (map->overflow)) {
+			val = kh_value (map->overflow, k);
 
-	if (k != kh_end (map->htb)) {
-		val = kh_value (map->htb, k);
-		val->hits ++;
+			if (val) {
+				val->hits ++;
+				ret = val->value;
+			}
+		}
+		else {
+			ret = rspamd_map_hash_image_find (map->image, in);
+		}
+	}
+	else if (map->htb) {
+		if (map->filter && !rspamd_map_filter_check (map->filter,
+				map->filter_mask,
+				rspamd_icase_hash (in, strlen (in), map_hash_seed))) {
+			if (map->map && map->map->stat) {
+				RSPAMD_MAP_STAT_INC (map->map, filtered);
+			}
+		}
+		else {
+			k = kh_get (rspamd_map_hash, map->htb, in);
 
-		return val->value;
+			if (k != kh_end (map->htb)) {
+				val = kh_value (map->htb, k);
+				val->hits ++;
+				ret = val->value;
+			}
+		}
 	}
 
-	return NULL;
+	rspamd_map_helper_count_lookup (map->map, ret != NULL);
+
+	return ret;
+}
+
+static inline gconstpointer
+rspamd_map_radix_image_value (struct rspamd_radix_map_helper *map, guint32 id)
+{
+	if (id == RADIX_FLAT_NO_VALUE || id >= map->image->nvalues) {
+		return NULL;
+	}
+
+	return map->strings + map->entries[id].value_off;
 }
 
 gconstpointer
@@ -1336,21 +2945,29 @@ rspamd_match_radix_map (struct rspamd_radix_map_helper *map,
 		const guchar *in, gsize inlen)
 {
 	struct rspamd_map_helper_value *val;
+	gconstpointer ret = NULL;
 
-	if (map == NULL || map->trie == NULL) {
+	if (map == NULL) {
 		return NULL;
 	}
 
-	val = (struct rspamd_map_helper_value *)radix_find_compressed (map->trie,
-			in, inlen);
-
-	if (val != (gconstpointer)RADIX_NO_VALUE) {
-		val->hits ++;
+	if (map->image) {
+		ret = rspamd_map_radix_image_value (map,
+				radix_flat_find (map->flat, in, inlen));
+	}
+	else if (map->trie) {
+		val = (struct rspamd_map_helper_value *)radix_find_compressed (
+				map->trie, in, inlen);
 
-		return val->value;
+		if (val != (gconstpointer)RADIX_NO_VALUE) {
+			val->hits ++;
+			ret = val->value;
+		}
 	}
 
-	return NULL;
+	rspamd_map_helper_count_lookup (map->map, ret != NULL);
+
+	return ret;
 }
 
 gconstpointer
@@ -1358,18 +2975,68 @@ rspamd_match_radix_map_addr (struct rspamd_radix_map_helper *map,
 		const rspamd_inet_addr_t *addr)
 {
 	struct rspamd_map_helper_value *val;
+	gconstpointer ret = NULL;
 
-	if (map == NULL || map->trie == NULL) {
+	if (map == NULL) {
 		return NULL;
 	}
 
-	val = (struct rspamd_map_helper_value *)radix_find_compressed_addr (map->trie, addr);
+	if (map->image) {
+		ret = rspamd_map_radix_image_value (map,
+				radix_flat_find_addr (map->flat, addr));
+	}
+	else if (map->trie) {
+		val = (struct rspamd_map_helper_value *)radix_find_compressed_addr (
+				map->trie, addr);
 
-	if (val != (gconstpointer)RADIX_NO_VALUE) {
-		val->hits ++;
+		if (val != (gconstpointer)RADIX_NO_VALUE) {
+			val->hits ++;
+			ret = val->value;
+		}
+	}
 
-		return val->value;
+	rspamd_map_helper_count_lookup (map->map, ret != NULL);
+
+	return ret;
+}
+
+gboolean
+rspamd_match_asn_map_addr (struct rspamd_radix_map_helper *map,
+		const rspamd_inet_addr_t *addr, struct rspamd_asn_info *info)
+{
+	struct rspamd_map_helper_value *val;
+	struct rspamd_map_asn_value *asn_val;
+	gboolean ret = FALSE;
+	guint32 id;
+
+	if (map == NULL) {
+		return FALSE;
 	}
 
-	return NULL;
+	if (map->image) {
+		id = radix_flat_find_addr (map->flat, addr);
+
+		if (id != RADIX_FLAT_NO_VALUE && id < map->image->nvalues &&
+				map->asn != NULL && map->asn[id].prefix != NULL) {
+			*info = map->asn[id];
+			ret = TRUE;
+		}
+	}
+	else if (map->trie) {
+		val = (struct rspamd_map_helper_value *)radix_find_compressed_addr (
+				map->trie, addr);
+
+		if (val != (gconstpointer)RADIX_NO_VALUE) {
+			val->hits ++;
+			asn_val = (struct rspamd_map_asn_value *)((gchar *)val -
+					G_STRUCT_OFFSET (struct rspamd_map_asn_value, val));
+			*info = asn_val->info;
+			info->prefix = val->key;
+			ret = TRUE;
+		}
+	}
+
+	rspamd_map_helper_count_lookup (map->map, ret);
+
+	return ret;
 }
\ No newline at end of file
@@ -34,6 +34,7 @@ struct rspamd_radix_map_helper;
 struct rspamd_hash_map_helper;
 struct rspamd_regexp_map_helper;
 struct rspamd_map_helper_value;
+struct rspamd_map_image_ops;
 
 enum rspamd_regexp_map_flags {
 	RSPAMD_REGEXP_MAP_FLAG_UTF = (1u << 0),
@@ -44,6 +45,15 @@ enum rspamd_regexp_map_flags {
 typedef void (*insert_func) (gpointer st, gconstpointer key,
 		gconstpointer value);
 
+/**
+ * Result of a lookup in ASN map
+ */
+struct rspamd_asn_info {
+	guint32 asn;
+	gchar country[3]; /* Empty if unknown */
+	const gchar *prefix; /* Network as written in the map */
+};
+
 /**
  * Radix list is a list like ip/mask
  */
@@ -55,6 +65,17 @@ gchar * rspamd_radix_read (
 void rspamd_radix_fin (struct map_cb_data *data, void **target);
 void rspamd_radix_dtor (struct map_cb_data *data);
 
+/**
+ * ASN list is a radix list with values like `asn [country]`:
+ * 8.8.8.0/24 15169 US
+ * It uses radix fin and dtor functions
+ */
+gchar * rspamd_asn_read (
+		gchar *chunk,
+		gint len,
+		struct map_cb_data *data,
+		gboolean final);
+
 /**
  * Kv list is an ordinal list of keys and values separated by whitespace
  */
@@ -151,6 +172,16 @@ gconstpointer rspamd_match_radix_map (struct rspamd_radix_map_helper *map,
 gconstpointer rspamd_match_radix_map_addr (struct rspamd_radix_map_helper *map,
 		const rspamd_inet_addr_t *addr);
 
+/**
+ * Finds ASN, country and network for the specified address in ASN map
+ * @param map
+ * @param addr
+ * @param info filled on success, prefix is owned by map
+ * @return TRUE if address has been found
+ */
+gboolean rspamd_match_asn_map_addr (struct rspamd_radix_map_helper *map,
+		const rspamd_inet_addr_t *addr, struct rspamd_asn_info *info);
+
 /**
  * Creates radix map helper
  * @param map
@@ -172,6 +203,14 @@ void rspamd_map_helper_insert_radix (gpointer st, gconstpointer key, gconstpoint
  */
 void rspamd_map_helper_insert_radix_resolve (gpointer st, gconstpointer key,
 		gconstpointer value);
+/**
+ * Inserts new value into ASN map, invalid values are skipped
+ * @param st
+ * @param key
+ * @param value
+ */
+void rspamd_map_helper_insert_asn (gpointer st, gconstpointer key,
+		gconstpointer value);
 /**
  * Destroys radix map helper
  * @param r
@@ -198,6 +237,70 @@ void rspamd_map_helper_insert_hash (gpointer st, gconstpointer key, gconstpointe
  */
 void rspamd_map_helper_destroy_hash (struct rspamd_hash_map_helper *r);
 
+/**
+ * Saves hash map as a read only image that could be mapped by other processes,
+ * the image is written atomically via temporary file and rename
+ * @param ht
+ * @param digest digest of the map data
+ * @param path
+ * @param err
+ * @return
+ */
+gboolean rspamd_map_helper_save_hash_image (struct rspamd_hash_map_helper *ht,
+		guint64 digest, const gchar *path, GError **err);
+/**
+ * Maps read only hash map image, such a helper could be used for lookups,
+ * traversing and must be destroyed by rspamd_map_helper_destroy_hash
+ * @param map
+ * @param path
+ * @param err
+ * @return
+ */
+struct rspamd_hash_map_helper *rspamd_map_helper_load_hash_image (
+		struct rspamd_map *map, const gchar *path, GError **err);
+/**
+ * Saves radix map as a read only image with flat radix inside, the helper must
+ * be created for a map with shared image to track inserted prefixes
+ * @param r
+ * @param digest digest of the map data
+ * @param path
+ * @param err
+ * @return
+ */
+gboolean rspamd_map_helper_save_radix_image (struct rspamd_radix_map_helper *r,
+		guint64 digest, const gchar *path, GError **err);
+/**
+ * Maps read only radix map image, such a helper must be destroyed by
+ * rspamd_map_helper_destroy_radix
+ * @param map
+ * @param path
+ * @param err
+ * @return
+ */
+struct rspamd_radix_map_helper *rspamd_map_helper_load_radix_image (
+		struct rspamd_map *map, const gchar *path, GError **err);
+/**
+ * Returns TRUE if maps with the specified read callback could apply changes
+ * in place (see `delta` map option)
+ * @param read_callback
+ * @return
+ */
+gboolean rspamd_map_helper_delta_supported (map_cb_t read_callback);
+/**
+ * Returns TRUE if maps with the specified read callback could be read and
+ * finalized outside of the main thread (e.g. they do not call Lua)
+ * @param read_callback
+ * @return
+ */
+gboolean rspamd_map_helper_thread_safe (map_cb_t read_callback);
+/**
+ * Returns image operations suitable for maps with the specified read callback
+ * @param read_callback
+ * @return ops or NULL if maps of this type could not be shared as images
+ */
+const struct rspamd_map_image_ops *rspamd_map_helper_image_ops (
+		map_cb_t read_callback);
+
 /**
  * Create new regexp map
  * @param map
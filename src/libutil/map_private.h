@@ -56,6 +56,10 @@ struct file_map_data {
 	gchar *filename;
 	gboolean need_modify;
 	ev_stat st_ev;
+	/* Position of the data already read, used for appended changes */
+	goffset delta_offset;
+	ino_t delta_ino;
+	guint64 delta_tail_hash;
 };
 
 
@@ -105,6 +109,12 @@ struct static_map_data {
 	gboolean processed;
 };
 
+enum rspamd_map_compression {
+	RSPAMD_MAP_COMPRESSION_NONE = 0,
+	RSPAMD_MAP_COMPRESSION_ZSTD,
+	RSPAMD_MAP_COMPRESSION_GZIP,
+};
+
 union rspamd_map_backend_data {
 	struct file_map_data *fd;
 	struct http_map_data *hd;
@@ -114,7 +124,7 @@ union rspamd_map_backend_data {
 struct rspamd_map_backend {
 	enum fetch_proto protocol;
 	gboolean is_signed;
-	gboolean is_compressed;
+	enum rspamd_map_compression compression;
 	gboolean is_fallback;
 	struct ev_loop *event_loop;
 	guint32 id;
@@ -126,6 +136,58 @@ struct rspamd_map_backend {
 
 struct map_periodic_cbdata;
 
+/*
+ * Maps data could be serialized to a read only image that is built by one
+ * process and mapped by all others instead of parsing the same data again
+ */
+typedef gboolean (*rspamd_map_image_save_t) (struct rspamd_map *map,
+		gpointer data, const gchar *path, GError **err);
+typedef gpointer (*rspamd_map_image_load_t) (struct rspamd_map *map,
+		const gchar *path, GError **err);
+
+struct rspamd_map_image_ops {
+	rspamd_map_image_save_t save;
+	rspamd_map_image_load_t load;
+};
+
+/* Allocated in shared memory and protected by map lock */
+struct rspamd_map_shared_image {
+	gint gen;
+	time_t stamp;
+	gchar path[PATH_MAX];
+};
+
+#define RSPAMD_MAP_STAT_SHARDS 16
+
+/*
+ * Lookups statistics, shared between processes. Each process updates its own
+ * shard, chosen by its statistics slot, and readers sum all shards
+ */
+struct RSPAMD_ALIGNED(64) rspamd_map_stat {
+	guint64 hits;
+	guint64 misses;
+	guint64 filtered; /* Misses rejected by the bloom filter */
+};
+
+extern guint rspamd_map_stat_shard;
+
+/* Shards are rarely shared by several processes, so relaxed atomics are cheap */
+#ifdef HAVE_ATOMIC_BUILTINS
+#define RSPAMD_MAP_STAT_INC(map, field) \
+	__atomic_add_fetch (&(map)->stat[rspamd_map_stat_shard].field, 1, \
+			__ATOMIC_RELAXED)
+#else
+#define RSPAMD_MAP_STAT_INC(map, field) \
+	((map)->stat[rspamd_map_stat_shard].field ++)
+#endif
+
+/**
+ * Sums lookups statistics of all processes
+ * @param map
+ * @param st
+ */
+void rspamd_map_stat_sum (struct rspamd_map *map, struct rspamd_map_stat *st);
+
 struct rspamd_map {
 	struct rspamd_dns_resolver *r;
 	struct rspamd_config *cfg;
@@ -154,6 +216,19 @@ struct rspamd_map {
 	gboolean active_http;
 	/* Shared lock for temporary disabling of map reading (e.g. when this map is written by UI) */
 	gint *locked;
+	/* Shared image of the map data, NULL if sharing is disabled */
+	const struct rspamd_map_image_ops *image_ops;
+	struct rspamd_map_shared_image *shared_image;
+	gint image_gen;
+	/* Apply lines appended to a file map as changes */
+	gboolean delta_updates;
+	/* Compact read only perfect hash instead of a hash table */
+	gboolean perfect_hash;
+	/* Time spent on the last read of the map */
+	gdouble load_time;
+	/* Check bloom filter of keys before lookups */
+	gboolean lookup_filter;
+	struct rspamd_map_stat *stat; /* RSPAMD_MAP_STAT_SHARDS elements */
 	gchar tag[MEMPOOL_UID_LEN];
 };
 
@@ -173,12 +248,15 @@ struct map_periodic_cbdata {
 	gboolean need_modify;
 	gboolean errored;
 	gboolean locked;
+	/* Some data has been already passed to the parser from a stream */
+	gboolean streamed;
 	guint cur_backend;
+	gdouble start;
 	ref_entry_t ref;
 };
 
 static const gchar rspamd_http_file_magic[] =
-		{'r', 'm', 'c', 'd', '1', '0', '0', '0'};
+		{'r', 'm', 'c', 'd', '1', '0', '0', '1'};
 
 struct rspamd_http_file_data {
 	guchar magic[sizeof (rspamd_http_file_magic)];
@@ -187,6 +265,8 @@ struct rspamd_http_file_data {
 	gulong next_check;
 };
 
+struct rspamd_map_decoder;
+
 struct http_callback_data {
 	struct ev_loop *event_loop;
 	struct rspamd_http_connection *conn;
@@ -199,6 +279,7 @@ struct http_callback_data {
 	struct rspamd_storage_shmem *shmem_data;
 	struct rspamd_storage_shmem *shmem_sig;
 	struct rspamd_storage_shmem *shmem_pubkey;
+	struct rspamd_map_decoder *decoder;
 	gsize data_len;
 	gsize sig_len;
 	gsize pubkey_len;
@@ -90,6 +90,8 @@ KHASH_INIT(mempool_entry, const gchar *, struct rspamd_mempool_entry_point *,
 		1, rspamd_entry_hash, rspamd_entry_equal)
 
 static khash_t(mempool_entry) *mempool_entries = NULL;
+/* Pools could be created by threads that load maps */
+G_LOCK_DEFINE_STATIC (mempool_entries);
 
 
 /* Internal statistic */
@@ -148,6 +150,8 @@ rspamd_mempool_get_entry (const gchar *loc)
 	khiter_t k;
 	struct rspamd_mempool_entry_point *elt;
 
+	G_LOCK (mempool_entries);
+
 	if (mempool_entries == NULL) {
 		mempool_entries = kh_init (mempool_entry);
 	}
@@ -156,12 +160,16 @@ rspamd_mempool_get_entry (const gchar *loc)
 
 		if (k != kh_end (mempool_entries)) {
 			elt = kh_value (mempool_entries, k);
+			G_UNLOCK (mempool_entries);
 
 			return elt;
 		}
 	}
 
-	return rspamd_mempool_entry_new (loc);
+	elt = rspamd_mempool_entry_new (loc);
+	G_UNLOCK (mempool_entries);
+
+	return elt;
 }
 
 
@@ -361,7 +369,7 @@ rspamd_mempool_new_ (gsize size, const gchar *tag, const gchar *loc)
 	}
 	new_pool->tag.uid[19] = '\0';
 
-	mem_pool_stat->pools_allocated++;
+	g_atomic_int_inc (&mem_pool_stat->pools_allocated);
 
 	return new_pool;
 }
@@ -406,15 +414,19 @@ memory_pool_alloc_common (rspamd_mempool_t * pool, gsize size,
 		if (cur == NULL || free < size) {
 			/* Allocate new chain element */
 			if (pool->elt_len >= size + MIN_MEM_ALIGNMENT) {
+				G_LOCK (mempool_entries);
 				pool->entry->elts[pool->entry->cur_elts].fragmentation += size;
+				G_UNLOCK (mempool_entries);
 				new = rspamd_mempool_chain_new (pool->elt_len,
 						pool_type);
 			}
 			else {
-				mem_pool_stat->oversized_chunks++;
+				g_atomic_int_inc (&mem_pool_stat->oversized_chunks);
 				g_atomic_int_add (&mem_pool_stat->fragmented_size,
 						free);
+				G_LOCK (mempool_entries);
 				pool->entry->elts[pool->entry->cur_elts].fragmentation += free;
+				G_UNLOCK (mempool_entries);
 				new = rspamd_mempool_chain_new (size + pool->elt_len, pool_type);
 			}
 
@@ -666,6 +678,8 @@ rspamd_mempool_delete (rspamd_mempool_t * pool)
 	}
 
 	if (cur) {
+		/* Entry points are shared by pools of the same location */
+		G_LOCK (mempool_entries);
 		pool->entry->elts[pool->entry->cur_elts].leftover =
 				pool_chain_free (cur);
 
@@ -675,6 +689,8 @@ rspamd_mempool_delete (rspamd_mempool_t * pool)
 		if (pool->entry->cur_elts == 0) {
 			rspamd_mempool_adjust_entry (pool->entry);
 		}
+
+		G_UNLOCK (mempool_entries);
 	}
 
 	/* Call all pool destructors */
@@ -44,6 +44,58 @@ struct radix_tree_compressed {
 	size_t size;
 	guint duplicates;
 	gboolean own_pool;
+	/* Inserted prefixes, used to build flat representation */
+	GArray *prefixes;
+	gboolean flat_unsupported;
+};
+
+#define RADIX_FLAT_MAGIC "rsradix1"
+#define RADIX_FLAT_INDEX_BITS 16
+#define RADIX_FLAT_INDEX_SIZE (1u << RADIX_FLAT_INDEX_BITS)
+
+enum radix_flat_family {
+	RADIX_FLAT_INET = 0,
+	RADIX_FLAT_INET6,
+	RADIX_FLAT_MAX
+};
+
+struct radix_flat_prefix {
+	guint64 hi;
+	guint64 lo;
+	guint plen;
+	uintptr_t value;
+};
+
+/*
+ * Flat layout:
+ * header
+ * guint32 idx[RADIX_FLAT_MAX][RADIX_FLAT_INDEX_SIZE + 1] - the first boundary
+ * with the specified top bits
+ * struct radix_flat_bound bounds[nbounds[RADIX_FLAT_INET]] - IPv4 boundaries
+ * struct radix_flat_bound bounds[nbounds[RADIX_FLAT_INET6]] - IPv6 boundaries
+ *
+ * Prefixes are expanded to non overlapping ranges, each boundary starts a range
+ * that lasts till the next boundary. Addresses are stored as 128 bit numbers,
+ * IPv4 addresses occupy the top 32 bits. Trie compares keys as bitstrings, so
+ * IPv4 table includes all prefixes not longer than 32 bits and IPv6 table
+ * includes all prefixes.
+ */
+struct radix_flat_header {
+	gchar magic[8];
+	guint32 nbounds[RADIX_FLAT_MAX];
+};
+
+struct radix_flat_bound {
+	guint64 hi;
+	guint64 lo;
+	guint32 value;
+	guint32 unused;
+};
+
+struct radix_flat {
+	const struct radix_flat_header *hdr;
+	const guint32 *idx[RADIX_FLAT_MAX];
+	const struct radix_flat_bound *bounds[RADIX_FLAT_MAX];
 };
 
 uintptr_t
@@ -63,6 +115,51 @@ radix_find_compressed (radix_compressed_t * tree, const guint8 *key, gsize keyle
 }
 
 
+static inline void
+radix_flat_load_key (const guint8 *key, gsize keylen, guint64 *hi, guint64 *lo)
+{
+	guint8 buf[16];
+	guint64 t;
+
+	memset (buf, 0, sizeof (buf));
+	memcpy (buf, key, MIN (keylen, sizeof (buf)));
+	memcpy (&t, buf, sizeof (t));
+	*hi = GUINT64_FROM_BE (t);
+	memcpy (&t, buf + sizeof (t), sizeof (t));
+	*lo = GUINT64_FROM_BE (t);
+}
+
+static void
+radix_flat_track_prefix (radix_compressed_t *tree, const guint8 *key,
+		gsize keylen, guint plen, uintptr_t value)
+{
+	struct radix_flat_prefix pfx;
+
+	if (keylen != 4 && keylen != 16) {
+		tree->flat_unsupported = TRUE;
+		return;
+	}
+
+	radix_flat_load_key (key, keylen, &pfx.hi, &pfx.lo);
+
+	/* Clear bits after prefix */
+	if (plen == 0) {
+		pfx.hi = 0;
+		pfx.lo = 0;
+	}
+	else if (plen <= 64) {
+		pfx.hi &= G_MAXUINT64 << (64 - plen);
+		pfx.lo = 0;
+	}
+	else if (plen < 128) {
+		pfx.lo &= G_MAXUINT64 << (128 - plen);
+	}
+
+	pfx.plen = plen;
+	pfx.value = value;
+	g_array_append_val (tree->prefixes, pfx);
+}
+
 uintptr_t
 radix_insert_compressed (radix_compressed_t * tree,
 	guint8 *key, gsize keylen,
@@ -114,6 +211,11 @@ radix_insert_compressed (radix_compressed_t * tree,
 	}
 	else {
 		tree->size ++;
+
+		if (tree->prefixes) {
+			radix_flat_track_prefix (tree, key, keylen, keybits - masklen,
+					value);
+		}
 	}
 
 	return old;
@@ -135,6 +237,8 @@ radix_create_compressed (void)
 	tree->duplicates = 0;
 	tree->tree = btrie_init (tree->pool);
 	tree->own_pool = TRUE;
+	tree->prefixes = NULL;
+	tree->flat_unsupported = FALSE;
 
 	return tree;
 }
@@ -150,6 +254,8 @@ radix_create_compressed_with_pool (rspamd_mempool_t *pool)
 	tree->duplicates = 0;
 	tree->tree = btrie_init (tree->pool);
 	tree->own_pool = FALSE;
+	tree->prefixes = NULL;
+	tree->flat_unsupported = FALSE;
 
 	return tree;
 }
@@ -405,3 +511,345 @@ radix_get_info (radix_compressed_t *tree)
 
 	return btrie_stats (tree->tree, tree->duplicates);
 }
+
+void
+radix_compressed_track_prefixes (radix_compressed_t *tree)
+{
+	g_assert (tree != NULL);
+
+	if (tree->prefixes == NULL) {
+		tree->prefixes = g_array_new (FALSE, FALSE,
+				sizeof (struct radix_flat_prefix));
+		rspamd_mempool_add_destructor (tree->pool, rspamd_array_free_hard,
+				tree->prefixes);
+	}
+}
+
+#define RADIX_FLAT_LT(h1, l1, h2, l2) ((h1) < (h2) || ((h1) == (h2) && (l1) < (l2)))
+
+static gint
+radix_flat_prefix_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct radix_flat_prefix *p1 = a, *p2 = b;
+
+	if (RADIX_FLAT_LT (p1->hi, p1->lo, p2->hi, p2->lo)) {
+		return -1;
+	}
+	else if (RADIX_FLAT_LT (p2->hi, p2->lo, p1->hi, p1->lo)) {
+		return 1;
+	}
+
+	/* Wider prefix goes first */
+	return (gint)p1->plen - (gint)p2->plen;
+}
+
+static void
+radix_flat_emit (GArray *bounds, guint64 hi, guint64 lo, guint32 value)
+{
+	struct radix_flat_bound b, *last;
+
+	if (bounds->len > 0) {
+		last = &g_array_index (bounds, struct radix_flat_bound, bounds->len - 1);
+
+		if (last->hi == hi && last->lo == lo) {
+			/* Range is empty, replace it */
+			g_array_set_size (bounds, bounds->len - 1);
+			radix_flat_emit (bounds, hi, lo, value);
+
+			return;
+		}
+
+		if (last->value == value) {
+			/* Extends the previous range */
+			return;
+		}
+	}
+
+	memset (&b, 0, sizeof (b));
+	b.hi = hi;
+	b.lo = lo;
+	b.value = value;
+	g_array_append_val (bounds, b);
+}
+
+/*
+ * Sets hi:lo to the address that follows the last address covered by
+ * prefix, returns FALSE if prefix ends at the end of address space
+ */
+static gboolean
+radix_flat_prefix_next (const struct radix_flat_prefix *pfx,
+		guint64 *hi, guint64 *lo)
+{
+	guint shift = 128 - pfx->plen;
+
+	if (shift >= 128) {
+		/* The whole space */
+		return FALSE;
+	}
+	else if (shift >= 64) {
+		*lo = 0;
+		*hi = pfx->hi + (G_GUINT64_CONSTANT (1) << (shift - 64));
+
+		return *hi != 0;
+	}
+	else {
+		*hi = pfx->hi;
+		*lo = pfx->lo + (G_GUINT64_CONSTANT (1) << shift);
+
+		if (*lo == 0) {
+			*hi += 1;
+
+			return *hi != 0;
+		}
+
+		return TRUE;
+	}
+}
+
+static void
+radix_flat_build_family (const struct radix_flat_prefix *prefixes, guint n,
+		radix_flat_value_cb cb, gpointer ud, GArray *bounds)
+{
+	const struct radix_flat_prefix *stack[129], *pfx, *prev = NULL;
+	guint depth = 0, i;
+	guint64 nhi, nlo;
+
+	radix_flat_emit (bounds, 0, 0, RADIX_FLAT_NO_VALUE);
+
+	for (i = 0; i <= n; i ++) {
+		pfx = i < n ? &prefixes[i] : NULL;
+
+		if (pfx && prev && pfx->hi == prev->hi && pfx->lo == prev->lo &&
+				pfx->plen == prev->plen) {
+			continue;
+		}
+
+		/* Close ranges that end before the current prefix */
+		while (depth > 0) {
+			if (!radix_flat_prefix_next (stack[depth - 1], &nhi, &nlo)) {
+				/* Range lasts till the end of address space */
+				if (pfx) {
+					break;
+				}
+
+				depth --;
+				continue;
+			}
+
+			if (pfx && RADIX_FLAT_LT (pfx->hi, pfx->lo, nhi, nlo)) {
+				/* Nested prefix */
+				break;
+			}
+
+			depth --;
+			radix_flat_emit (bounds, nhi, nlo, depth > 0 ?
+					cb (stack[depth - 1]->value, ud) : RADIX_FLAT_NO_VALUE);
+		}
+
+		if (pfx) {
+			g_assert (depth < G_N_ELEMENTS (stack));
+			stack[depth ++] = pfx;
+			radix_flat_emit (bounds, pfx->hi, pfx->lo, cb (pfx->value, ud));
+			prev = pfx;
+		}
+	}
+}
+
+gboolean
+radix_flat_serialize (radix_compressed_t *tree, radix_flat_value_cb cb,
+		gpointer ud, GByteArray *out, GError **err)
+{
+	struct radix_flat_header hdr;
+	struct radix_flat_prefix *prefixes, *inet_prefixes;
+	struct radix_flat_bound *b;
+	GArray *bounds[RADIX_FLAT_MAX];
+	guint32 *idx;
+	guint i, j, ninet = 0, f;
+
+	g_assert (tree != NULL);
+
+	if (tree->prefixes == NULL || tree->flat_unsupported) {
+		g_set_error (err, g_quark_from_static_string ("radix"), EINVAL,
+				"radix tree cannot be serialized");
+		return FALSE;
+	}
+
+	g_array_sort (tree->prefixes, radix_flat_prefix_cmp);
+	prefixes = (struct radix_flat_prefix *)tree->prefixes->data;
+	inet_prefixes = g_malloc (sizeof (*inet_prefixes) *
+			MAX (tree->prefixes->len, 1));
+
+	for (i = 0; i < tree->prefixes->len; i ++) {
+		if (prefixes[i].plen <= 32) {
+			inet_prefixes[ninet ++] = prefixes[i];
+		}
+	}
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, RADIX_FLAT_MAGIC, sizeof (hdr.magic));
+	idx = g_malloc0 (sizeof (*idx) * RADIX_FLAT_MAX *
+			(RADIX_FLAT_INDEX_SIZE + 1));
+
+	for (f = 0; f < RADIX_FLAT_MAX; f ++) {
+		bounds[f] = g_array_new (FALSE, FALSE, sizeof (struct radix_flat_bound));
+
+		if (f == RADIX_FLAT_INET) {
+			radix_flat_build_family (inet_prefixes, ninet, cb, ud, bounds[f]);
+		}
+		else {
+			radix_flat_build_family (prefixes, tree->prefixes->len, cb, ud,
+					bounds[f]);
+		}
+
+		hdr.nbounds[f] = bounds[f]->len;
+
+		/* Index by the top bits of address */
+		b = (struct radix_flat_bound *)bounds[f]->data;
+
+		for (i = 0, j = 0; i < RADIX_FLAT_INDEX_SIZE; i ++) {
+			while (j < bounds[f]->len &&
+					(b[j].hi >> (64 - RADIX_FLAT_INDEX_BITS)) < i) {
+				j ++;
+			}
+
+			idx[f * (RADIX_FLAT_INDEX_SIZE + 1) + i] = j;
+		}
+
+		idx[f * (RADIX_FLAT_INDEX_SIZE + 1) + RADIX_FLAT_INDEX_SIZE] =
+				bounds[f]->len;
+	}
+
+	g_byte_array_append (out, (const guint8 *)&hdr, sizeof (hdr));
+	g_byte_array_append (out, (const guint8 *)idx,
+			sizeof (*idx) * RADIX_FLAT_MAX * (RADIX_FLAT_INDEX_SIZE + 1));
+
+	for (f = 0; f < RADIX_FLAT_MAX; f ++) {
+		g_byte_array_append (out, (const guint8 *)bounds[f]->data,
+				bounds[f]->len * sizeof (struct radix_flat_bound));
+		g_array_free (bounds[f], TRUE);
+	}
+
+	g_free (idx);
+	g_free (inet_prefixes);
+
+	return TRUE;
+}
+
+radix_flat_t *
+radix_flat_attach (const guchar *data, gsize len, GError **err)
+{
+	const struct radix_flat_header *hdr;
+	radix_flat_t *flat;
+	gsize expected;
+	guint f;
+
+	hdr = (const struct radix_flat_header *)data;
+
+	if (len < sizeof (*hdr) ||
+			memcmp (hdr->magic, RADIX_FLAT_MAGIC, sizeof (hdr->magic)) != 0) {
+		g_set_error (err, g_quark_from_static_string ("radix"), EINVAL,
+				"invalid flat radix header");
+		return NULL;
+	}
+
+	expected = sizeof (*hdr) + sizeof (guint32) * RADIX_FLAT_MAX *
+			(RADIX_FLAT_INDEX_SIZE + 1);
+
+	for (f = 0; f < RADIX_FLAT_MAX; f ++) {
+		expected += sizeof (struct radix_flat_bound) * (gsize)hdr->nbounds[f];
+	}
+
+	if (len != expected) {
+		g_set_error (err, g_quark_from_static_string ("radix"), EINVAL,
+				"invalid flat radix length: %" G_GSIZE_FORMAT ", %" G_GSIZE_FORMAT
+				" expected", len, expected);
+		return NULL;
+	}
+
+	flat = g_malloc0 (sizeof (*flat));
+	flat->hdr = hdr;
+	data += sizeof (*hdr);
+
+	for (f = 0; f < RADIX_FLAT_MAX; f ++) {
+		flat->idx[f] = (const guint32 *)data;
+		data += sizeof (guint32) * (RADIX_FLAT_INDEX_SIZE + 1);
+	}
+
+	for (f = 0; f < RADIX_FLAT_MAX; f ++) {
+		flat->bounds[f] = (const struct radix_flat_bound *)data;
+		data += sizeof (struct radix_flat_bound) * hdr->nbounds[f];
+	}
+
+	return flat;
+}
+
+guint32
+radix_flat_find (const radix_flat_t *flat, const guint8 *key, gsize keylen)
+{
+	const struct radix_flat_bound *b;
+	const guint32 *idx;
+	guint64 hi, lo;
+	guint32 top, l, r, mid;
+	enum radix_flat_family f;
+
+	if (keylen == 4) {
+		f = RADIX_FLAT_INET;
+	}
+	else if (keylen == 16) {
+		f = RADIX_FLAT_INET6;
+	}
+	else {
+		return RADIX_FLAT_NO_VALUE;
+	}
+
+	if (flat->hdr->nbounds[f] == 0) {
+		return RADIX_FLAT_NO_VALUE;
+	}
+
+	radix_flat_load_key (key, keylen, &hi, &lo);
+	b = flat->bounds[f];
+	idx = flat->idx[f];
+	top = hi >> (64 - RADIX_FLAT_INDEX_BITS);
+
+	/* The last boundary before this index slot covers its beginning */
+	l = idx[top] > 0 ? idx[top] - 1 : 0;
+	r = idx[top + 1];
+
+	while (r - l > 1) {
+		mid = l + (r - l) / 2;
+
+		if (RADIX_FLAT_LT (hi, lo, b[mid].hi, b[mid].lo)) {
+			r = mid;
+		}
+		else {
+			l = mid;
+		}
+	}
+
+	return b[l].value;
+}
+
+guint32
+radix_flat_find_addr (const radix_flat_t *flat, const rspamd_inet_addr_t *addr)
+{
+	const guchar *key;
+	guint klen = 0;
+
+	if (addr == NULL) {
+		return RADIX_FLAT_NO_VALUE;
+	}
+
+	key = rspamd_inet_address_get_hash_key (addr, &klen);
+
+	if (key && klen) {
+		return radix_flat_find (flat, key, klen);
+	}
+
+	return RADIX_FLAT_NO_VALUE;
+}
+
+void
+radix_flat_destroy (radix_flat_t *flat)
+{
+	g_free (flat);
+}
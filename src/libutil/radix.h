@@ -109,4 +109,64 @@ const gchar * radix_get_info (radix_compressed_t *tree);
  */
 rspamd_mempool_t* radix_get_pool (radix_compressed_t *tree);
 
+/*
+ * Flat read only representation of a radix trie: prefixes are expanded to
+ * non overlapping address ranges sorted by the first address with an index
+ * by the top 16 bits of address. It has no pointers inside, so it could be
+ * written to a file and mapped by many processes. Values are 32 bit ids.
+ */
+#define RADIX_FLAT_NO_VALUE G_MAXUINT32
+
+typedef struct radix_flat radix_flat_t;
+typedef guint32 (*radix_flat_value_cb) (uintptr_t value, gpointer ud);
+
+/**
+ * Starts recording of the inserted prefixes, so the tree could be serialized
+ * to the flat form later. Must be called before any insertion.
+ * @param tree
+ */
+void radix_compressed_track_prefixes (radix_compressed_t *tree);
+
+/**
+ * Serializes tree with tracked prefixes to the flat form, only IPv4 and IPv6
+ * keys are supported
+ * @param tree
+ * @param cb converts tree values to 32 bit ids
+ * @param ud
+ * @param out
+ * @param err
+ * @return
+ */
+gboolean radix_flat_serialize (radix_compressed_t *tree, radix_flat_value_cb cb,
+		gpointer ud, GByteArray *out, GError **err);
+
+/**
+ * Attaches flat radix stored in the buffer, buffer must be alive and aligned
+ * @param data
+ * @param len
+ * @param err
+ * @return
+ */
+radix_flat_t *radix_flat_attach (const guchar *data, gsize len, GError **err);
+
+/**
+ * Finds value id for the specified key
+ * @return id or RADIX_FLAT_NO_VALUE
+ */
+guint32 radix_flat_find (const radix_flat_t *flat, const guint8 *key,
+		gsize keylen);
+
+/**
+ * Finds value id for the specified address
+ * @return id or RADIX_FLAT_NO_VALUE
+ */
+guint32 radix_flat_find_addr (const radix_flat_t *flat,
+		const rspamd_inet_addr_t *addr);
+
+/**
+ * Destroys flat radix (buffer is not touched)
+ * @param flat
+ */
+void radix_flat_destroy (radix_flat_t *flat);
+
 #endif
@@ -4119,7 +4119,7 @@ lua_config_init_subsystem (lua_State *L)
 				cfg->lang_det = rspamd_language_detector_init (cfg);
 			}
 			else if (strcmp (parts[i], "stat") == 0) {
-				rspamd_stat_init (cfg, NULL);
+				rspamd_stat_init (cfg, NULL, NULL);
 			}
 			else if (strcmp (parts[i], "dns") == 0) {
 				struct ev_loop *ev_base = lua_check_ev_base (L, 3);
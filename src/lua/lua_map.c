@@ -42,6 +42,14 @@
  */
 LUA_FUNCTION_DEF (map, get_key);
 
+/***
+ * @method map:get_asn(ip)
+ * Finds ASN information for IP address in a map of type `asn`
+ * @param {rspamd_ip|string} ip address to check
+ * @return {table} table with fields `asn` (number), `ipnet` (string) and `country` (string, if known) or `nil`
+ */
+LUA_FUNCTION_DEF (map, get_asn);
+
 
 /***
  * @method map:is_signed()
@@ -113,6 +121,7 @@ LUA_FUNCTION_DEF (map, get_nelts);
 
 static const struct luaL_reg maplib_m[] = {
 	LUA_INTERFACE_DEF (map, get_key),
+	LUA_INTERFACE_DEF (map, get_asn),
 	LUA_INTERFACE_DEF (map, is_signed),
 	LUA_INTERFACE_DEF (map, get_proto),
 	LUA_INTERFACE_DEF (map, get_sign_key),
@@ -596,6 +605,23 @@ lua_config_add_map (lua_State *L)
 			}
 			m->lua_map = map;
 		}
+		else if (strcmp (type, "asn") == 0) {
+			map = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*map));
+			map->data.radix = NULL;
+			map->type = RSPAMD_LUA_MAP_RADIX;
+
+			if ((m = rspamd_map_add_from_ucl (cfg, map_obj, description,
+					rspamd_asn_read,
+					rspamd_radix_fin,
+					rspamd_radix_dtor,
+					(void **)&map->data.radix)) == NULL) {
+				lua_pushnil (L);
+				ucl_object_unref (map_obj);
+
+				return 1;
+			}
+			m->lua_map = map;
+		}
 		else if (strcmp (type, "regexp") == 0) {
 			map = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*map));
 			map->data.re_map = NULL;
@@ -709,7 +735,8 @@ lua_config_get_maps (lua_State*L)
 				/* Implement heuristic */
 				map = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*map));
 
-				if (m->read_callback == rspamd_radix_read) {
+				if (m->read_callback == rspamd_radix_read ||
+						m->read_callback == rspamd_asn_read) {
 					map->type = RSPAMD_LUA_MAP_RADIX;
 					map->data.radix = *m->user_data;
 				}
@@ -912,6 +939,57 @@ lua_map_get_key (lua_State * L)
 	return 1;
 }
 
+static gint
+lua_map_get_asn (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_map *map = lua_check_map (L, 1);
+	struct rspamd_lua_ip *addr = NULL;
+	struct rspamd_asn_info info;
+	const gchar *addr_str;
+	gsize len;
+
+	if (map == NULL || map->type != RSPAMD_LUA_MAP_RADIX) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (lua_type (L, 2) == LUA_TSTRING) {
+		addr_str = lua_tolstring (L, 2, &len);
+		addr = g_alloca (sizeof (*addr));
+		addr->addr = g_alloca (rspamd_inet_address_storage_size ());
+
+		if (!rspamd_parse_inet_address_ip (addr_str, len, addr->addr)) {
+			return luaL_error (L, "invalid ip address: %s", addr_str);
+		}
+	}
+	else {
+		addr = lua_check_ip (L, 2);
+
+		if (addr == NULL || addr->addr == NULL) {
+			return luaL_error (L, "invalid arguments");
+		}
+	}
+
+	if (!rspamd_match_asn_map_addr (map->data.radix, addr->addr, &info)) {
+		lua_pushnil (L);
+
+		return 1;
+	}
+
+	lua_createtable (L, 0, 3);
+	lua_pushinteger (L, info.asn);
+	lua_setfield (L, -2, "asn");
+	lua_pushstring (L, info.prefix);
+	lua_setfield (L, -2, "ipnet");
+
+	if (info.country[0]) {
+		lua_pushstring (L, info.country);
+		lua_setfield (L, -2, "country");
+	}
+
+	return 1;
+}
+
 static gboolean
 lua_map_traverse_cb (gconstpointer key,
 		gconstpointer value, gsize hits, gpointer ud)
@@ -964,6 +964,9 @@ LUA_FUNCTION_DEF (task, store_in_file);
  *
  * - `basic`: basic info, such as message-id
  * - `metrics`: metrics and symbols
+ * - `action`: action and scores without symbols
+ * - `symbols`: symbols names and scores
+ * - `options`: symbols with options and descriptions
  * - `messages`: messages
  * - `dkim`: dkim signature
  * - `milter`: milter control block
@@ -2287,7 +2290,6 @@ lua_task_set_request_header (lua_State *L)
 	LUA_TRACE_POINT;
 	struct rspamd_task *task = lua_check_task (L, 1);
 	const gchar *s, *v = NULL;
-	rspamd_fstring_t *buf;
 	struct rspamd_lua_text *t;
 	rspamd_ftok_t *hdr, *new_name;
 	gsize len, vlen;
@@ -2308,10 +2310,15 @@ lua_task_set_request_header (lua_State *L)
 		}
 
 		if (v != NULL) {
-			buf = rspamd_fstring_new_init (v, vlen);
-			hdr = rspamd_ftok_map (buf);
-			buf = rspamd_fstring_new_init (s, len);
-			new_name = rspamd_ftok_map (buf);
+			hdr = rspamd_mempool_alloc (task->task_pool, sizeof (*hdr));
+			hdr->begin = rspamd_mempool_alloc (task->task_pool, vlen);
+			memcpy ((gchar *)hdr->begin, v, vlen);
+			hdr->len = vlen;
+			new_name = rspamd_mempool_alloc (task->task_pool,
+					sizeof (*new_name));
+			new_name->begin = rspamd_mempool_alloc (task->task_pool, len);
+			memcpy ((gchar *)new_name->begin, s, len);
+			new_name->len = len;
 
 			rspamd_task_add_request_header (task, new_name, hdr);
 		}
@@ -5502,28 +5509,12 @@ lua_task_get_protocol_reply (lua_State *L)
 	if (lua_istable (L, 2)) {
 		for (lua_pushnil (L); lua_next (L, 2); lua_pop (L, 1)) {
 			if (lua_isstring (L, -1)) {
-				const gchar *str = lua_tostring (L, -1);
+				gsize len;
+				const gchar *str = lua_tolstring (L, -1, &len);
+				guint fl = rspamd_protocol_section_flags (str, len);
 
-				if (strcmp (str, "default") == 0) {
-					flags |= RSPAMD_PROTOCOL_DEFAULT;
-				}
-				else if (strcmp (str, "basic") == 0) {
-					flags |= RSPAMD_PROTOCOL_BASIC;
-				}
-				else if (strcmp (str, "metrics") == 0) {
-					flags |= RSPAMD_PROTOCOL_METRICS;
-				}
-				else if (strcmp (str, "messages") == 0) {
-					flags |= RSPAMD_PROTOCOL_MESSAGES;
-				}
-				else if (strcmp (str, "rmilter") == 0) {
-					flags |= RSPAMD_PROTOCOL_RMILTER;
-				}
-				else if (strcmp (str, "dkim") == 0) {
-					flags |= RSPAMD_PROTOCOL_DKIM;
-				}
-				else if (strcmp (str, "extra") == 0) {
-					flags |= RSPAMD_PROTOCOL_EXTRA;
+				if (fl != 0) {
+					flags |= fl;
 				}
 				else {
 					msg_err_task ("invalid protocol flag: %s", str);
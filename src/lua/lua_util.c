@@ -598,6 +598,17 @@ LUA_FUNCTION_DEF (util, parse_content_type);
  */
 LUA_FUNCTION_DEF (util, mime_header_encode);
 
+/***
+ *  @function util.create_lru(size[, policy])
+ * Creates lru cache of the specified size. Keys are strings, values could be
+ * any lua objects. Policy could be `tinylfu` (default), which keeps frequently
+ * used elements and resists scans, or `lru` for approximate lfu based
+ * eviction
+ * @param {number} size maximum number of elements
+ * @param {string} policy eviction policy
+ * @return {lru} lru cache object
+ */
+LUA_FUNCTION_DEF (util, create_lru);
 
 static const struct luaL_reg utillib_f[] = {
 	LUA_INTERFACE_DEF (util, create_event_base),
@@ -659,6 +670,7 @@ static const struct luaL_reg utillib_f[] = {
 	LUA_INTERFACE_DEF (util, pack),
 	LUA_INTERFACE_DEF (util, unpack),
 	LUA_INTERFACE_DEF (util, packsize),
+	LUA_INTERFACE_DEF (util, create_lru),
 	{NULL, NULL}
 };
 
@@ -682,6 +694,68 @@ static const struct luaL_reg ev_baselib_m[] = {
 	{NULL, NULL}
 };
 
+/***
+ * @method lru:get(key)
+ * Returns value for the key or nil if it is not in cache or expired
+ * @param {string} key
+ * @return {any} value
+ */
+LUA_FUNCTION_DEF (lru, get);
+/***
+ * @method lru:set(key, value[, ttl])
+ * Inserts or replaces value for the key
+ * @param {string} key
+ * @param {any} value
+ * @param {number} ttl optional time to live in seconds
+ */
+LUA_FUNCTION_DEF (lru, set);
+/***
+ * @method lru:remove(key)
+ * Removes key from the cache
+ * @param {string} key
+ * @return {boolean} true if key has been removed
+ */
+LUA_FUNCTION_DEF (lru, remove);
+/***
+ * @method lru:size()
+ * Returns number of elements in the cache
+ * @return {number} number of elements
+ */
+LUA_FUNCTION_DEF (lru, size);
+/***
+ * @method lru:capacity()
+ * Returns maximum number of elements in the cache
+ * @return {number} capacity
+ */
+LUA_FUNCTION_DEF (lru, capacity);
+LUA_FUNCTION_DEF (lru, gc);
+
+static const struct luaL_reg lrulib_m[] = {
+	LUA_INTERFACE_DEF (lru, get),
+	LUA_INTERFACE_DEF (lru, set),
+	LUA_INTERFACE_DEF (lru, remove),
+	LUA_INTERFACE_DEF (lru, size),
+	LUA_INTERFACE_DEF (lru, capacity),
+	{"__tostring", rspamd_lua_class_tostring},
+	{"__gc", lua_lru_gc},
+	{NULL, NULL}
+};
+
+/*
+ * Values are stored as registry references, however they cannot be
+ * unreferenced from destructors as the cache is not aware of the current
+ * lua state, so they are unreferenced on the next cache access instead
+ */
+struct lua_lru {
+	rspamd_lru_hash_t *hash;
+	GArray *pending_unref;
+};
+
+struct lua_lru_value {
+	struct lua_lru *lru;
+	gint ref;
+};
+
 static gint64
 lua_check_int64 (lua_State * L, gint pos)
 {
@@ -3721,6 +3795,203 @@ lua_util_unpack (lua_State *L)
 	return n + 1;
 }
 
+static void
+lua_lru_value_dtor (gpointer p)
+{
+	struct lua_lru_value *val = (struct lua_lru_value *)p;
+
+	g_array_append_val (val->lru->pending_unref, val->ref);
+	g_free (val);
+}
+
+static void
+lua_lru_flush_unref (lua_State *L, struct lua_lru *lru)
+{
+	guint i;
+
+	for (i = 0; i < lru->pending_unref->len; i ++) {
+		luaL_unref (L, LUA_REGISTRYINDEX,
+				g_array_index (lru->pending_unref, gint, i));
+	}
+
+	g_array_set_size (lru->pending_unref, 0);
+}
+
+static struct lua_lru *
+lua_check_lru (lua_State *L, gint pos)
+{
+	void *ud = rspamd_lua_check_udata (L, pos, "rspamd{lru}");
+	luaL_argcheck (L, ud != NULL, pos, "'lru' expected");
+	return ud ? *((struct lua_lru **)ud) : NULL;
+}
+
+static gint
+lua_util_create_lru (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct lua_lru *lru, **plru;
+	gint size = luaL_checkinteger (L, 1);
+	const gchar *policy = luaL_optstring (L, 2, "tinylfu");
+
+	if (size <= 0) {
+		return luaL_error (L, "invalid lru size: %d", size);
+	}
+
+	lru = g_malloc0 (sizeof (*lru));
+	lru->pending_unref = g_array_new (FALSE, FALSE, sizeof (gint));
+
+	if (strcmp (policy, "tinylfu") == 0) {
+		lru->hash = rspamd_lru_hash_new_tinylfu (size, g_free,
+				lua_lru_value_dtor, rspamd_ftok_hash, rspamd_ftok_equal);
+	}
+	else if (strcmp (policy, "lru") == 0) {
+		lru->hash = rspamd_lru_hash_new_full (size, g_free,
+				lua_lru_value_dtor, rspamd_ftok_hash, rspamd_ftok_equal);
+	}
+	else {
+		g_array_free (lru->pending_unref, TRUE);
+		g_free (lru);
+
+		return luaL_error (L, "invalid lru policy: %s", policy);
+	}
+
+	plru = lua_newuserdata (L, sizeof (*plru));
+	rspamd_lua_setclass (L, "rspamd{lru}", -1);
+	*plru = lru;
+
+	return 1;
+}
+
+static gint
+lua_lru_get (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct lua_lru *lru = lua_check_lru (L, 1);
+	struct lua_lru_value *val;
+	rspamd_ftok_t key;
+	gsize keylen;
+
+	if (lru == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	key.begin = luaL_checklstring (L, 2, &keylen);
+	key.len = keylen;
+	val = rspamd_lru_hash_lookup (lru->hash, &key,
+			(time_t)rspamd_get_calendar_ticks ());
+	lua_lru_flush_unref (L, lru);
+
+	if (val) {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, val->ref);
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
+static gint
+lua_lru_set (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct lua_lru *lru = lua_check_lru (L, 1);
+	struct lua_lru_value *val;
+	rspamd_ftok_t *key;
+	const gchar *k;
+	gsize keylen;
+	guint ttl;
+
+	if (lru == NULL || lua_isnoneornil (L, 3)) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	k = luaL_checklstring (L, 2, &keylen);
+	ttl = luaL_optinteger (L, 4, 0);
+
+	/* Key data is stored right after the token */
+	key = g_malloc (sizeof (*key) + keylen);
+	memcpy (((gchar *)key) + sizeof (*key), k, keylen);
+	key->begin = ((gchar *)key) + sizeof (*key);
+	key->len = keylen;
+
+	val = g_malloc (sizeof (*val));
+	val->lru = lru;
+	lua_pushvalue (L, 3);
+	val->ref = luaL_ref (L, LUA_REGISTRYINDEX);
+
+	rspamd_lru_hash_insert (lru->hash, key, val,
+			(time_t)rspamd_get_calendar_ticks (), ttl);
+	lua_lru_flush_unref (L, lru);
+
+	return 0;
+}
+
+static gint
+lua_lru_remove (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct lua_lru *lru = lua_check_lru (L, 1);
+	rspamd_ftok_t key;
+	gsize keylen;
+
+	if (lru == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	key.begin = luaL_checklstring (L, 2, &keylen);
+	key.len = keylen;
+	lua_pushboolean (L, rspamd_lru_hash_remove (lru->hash, &key));
+	lua_lru_flush_unref (L, lru);
+
+	return 1;
+}
+
+static gint
+lua_lru_size (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct lua_lru *lru = lua_check_lru (L, 1);
+
+	if (lru == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushinteger (L, rspamd_lru_hash_size (lru->hash));
+
+	return 1;
+}
+
+static gint
+lua_lru_capacity (lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct lua_lru *lru = lua_check_lru (L, 1);
+
+	if (lru == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushinteger (L, rspamd_lru_hash_capacity (lru->hash));
+
+	return 1;
+}
+
+static gint
+lua_lru_gc (lua_State *L)
+{
+	struct lua_lru *lru = lua_check_lru (L, 1);
+
+	if (lru) {
+		rspamd_lru_hash_destroy (lru->hash);
+		lua_lru_flush_unref (L, lru);
+		g_array_free (lru->pending_unref, TRUE);
+		g_free (lru);
+	}
+
+	return 0;
+}
+
 static gint
 lua_load_util (lua_State * L)
 {
@@ -3737,6 +4008,8 @@ luaopen_util (lua_State * L)
 	lua_pop (L, 1);
 	rspamd_lua_new_class (L, "rspamd{int64}", int64lib_m);
 	lua_pop (L, 1);
+	rspamd_lua_new_class (L, "rspamd{lru}", lrulib_m);
+	lua_pop (L, 1);
 	rspamd_lua_add_preload (L, "rspamd_util", lua_load_util);
 }
 
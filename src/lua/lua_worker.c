@@ -79,7 +79,7 @@ lua_worker_get_stat (lua_State *L)
 
 		memset (&mem_st, 0, sizeof (mem_st));
 		rspamd_mempool_stat (&mem_st);
-		memcpy (&stat_copy, w->srv->stat, sizeof (stat_copy));
+		rspamd_worker_stat_sum (w->srv, &stat_copy, TRUE);
 		stat = &stat_copy;
 		top = ucl_object_typed_new (UCL_OBJECT);
 		ucl_object_insert_key (top, ucl_object_fromint (
@@ -93,6 +93,17 @@ local function asn_check(task)
     })
   end
 
+  asn_check_func.map = function(ip)
+    local res = options.asn_map:get_asn(ip)
+
+    if res then
+      lua_util.debugm(N, task, 'found %s in asn map: %s', ip, res)
+      asn_set(tostring(res.asn), res.ipnet, res.country)
+    else
+      lua_util.debugm(N, task, 'cannot find %s in asn map', ip)
+    end
+  end
+
   local ip = task:get_from_ip()
   if not (ip and ip:is_valid()) or
       (not options.check_local and ip:is_local()) then
@@ -116,6 +127,22 @@ local configure_asn_module = function()
       rspamd_logger.errx("Missing required provider_info for rspamd")
       return false
     end
+  elseif options['provider_type'] == 'map' then
+    -- Local dump of prefixes in form `8.8.8.0/24 15169 US`
+    if not (options['provider_info'] and options['provider_info']['map']) then
+      rspamd_logger.errx(rspamd_config, "Missing required provider_info.map for map")
+      return false
+    end
+    options.asn_map = rspamd_config:add_map{
+      type = 'asn',
+      url = options['provider_info']['map'],
+      description = 'ASN and country of IP networks',
+    }
+    if not options.asn_map then
+      rspamd_logger.errx(rspamd_config, "Cannot load asn map %s",
+          options['provider_info']['map'])
+      return false
+    end
   else
     rspamd_logger.errx("Unknown provider_type: %s", options['provider_type'])
     return false
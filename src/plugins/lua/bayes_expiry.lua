@@ -87,6 +87,13 @@ local function check_redis_classifier(cls, cfg)
       end
     end
 
+    if cls.expiry_buckets then
+      logger.infox(rspamd_config,
+          'disable expiry for classifier %s: incremental expiry buckets are used',
+          symbol_spam)
+      return
+    end
+
     if not symbol_spam or not symbol_ham or type(expiry) ~= 'number' then
       logger.debugm(N, rspamd_config,
           'disable expiry for classifier %s: no expiry %s',
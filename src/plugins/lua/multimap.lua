@@ -384,6 +384,48 @@ local multimap_grammar
 
 local function multimap_callback(task, rule)
   local pre_filter = rule['prefilter']
+  local misses_cache
+
+  -- Most lookups are misses and the same values are often checked by several
+  -- rules that share a map, so misses are cached for the whole task
+  local function get_key_cached(map, value)
+    local k = value
+    if type(value) == 'userdata' and value.class == 'rspamd{ip}' then
+      k = value:tostring()
+    end
+
+    if type(k) ~= 'string' then
+      return map:get_key(value)
+    end
+
+    if not misses_cache then
+      misses_cache = task:cache_get('multimap_misses')
+
+      if not misses_cache then
+        misses_cache = {}
+        task:cache_set('multimap_misses', misses_cache)
+      end
+    end
+
+    local map_misses = misses_cache[map]
+
+    if map_misses and map_misses[k] then
+      return nil
+    end
+
+    local ret = map:get_key(value)
+
+    if not ret then
+      if not map_misses then
+        map_misses = {}
+        misses_cache[map] = map_misses
+      end
+
+      map_misses[k] = true
+    end
+
+    return ret
+  end
 
   local function match_element(r, value, callback)
    if not value then
@@ -448,14 +490,14 @@ local function multimap_callback(task, rule)
 
       return ret
     elseif r.radix then
-      ret = r.radix:get_key(value)
+      ret = get_key_cached(r.radix, value)
     elseif r.hash then
       if type(value) == 'userdata' then
         if value.class == 'rspamd{ip}' then
           value = value:tostring()
         end
       end
-      ret = r.hash:get_key(value)
+      ret = get_key_cached(r.hash, value)
     end
 
     if ret then
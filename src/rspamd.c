@@ -1007,6 +1007,7 @@ rspamd_cld_handler (EV_P_ ev_child *w, struct rspamd_main *rspamd_main,
 	}
 
 	REF_RELEASE (wrk->cf);
+	rspamd_worker_stat_release (rspamd_main, wrk);
 
 	if (wrk->finish_actions) {
 		g_ptr_array_free (wrk->finish_actions, TRUE);
@@ -1097,6 +1098,7 @@ main (gint argc, gchar **argv, gchar **env)
 	GQuark type;
 	rspamd_inet_addr_t *control_addr = NULL;
 	struct ev_loop *event_loop;
+	guint ev_flags;
 	struct rspamd_main *rspamd_main;
 	gboolean skip_pid = FALSE;
 
@@ -1104,8 +1106,7 @@ main (gint argc, gchar **argv, gchar **env)
 
 	rspamd_main->server_pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
 			"main");
-	rspamd_main->stat = rspamd_mempool_alloc0_shared (rspamd_main->server_pool,
-			sizeof (struct rspamd_stat));
+	rspamd_worker_stat_init (rspamd_main);
 	rspamd_main->cfg = rspamd_config_new (RSPAMD_CONFIG_INIT_DEFAULT);
 	rspamd_main->spairs = g_hash_table_new_full (rspamd_spair_hash,
 			rspamd_spair_equal, g_free, rspamd_spair_close);
@@ -1300,7 +1301,13 @@ main (gint argc, gchar **argv, gchar **env)
 	rspamd_main->workers = g_hash_table_new (g_direct_hash, g_direct_equal);
 
 	/* Init event base */
-	event_loop = ev_default_loop (EVFLAG_SIGNALFD|EVBACKEND_ALL);
+	ev_flags = rspamd_config_ev_backend_get (rspamd_main->cfg);
+
+	if (ev_flags == 0) {
+		ev_flags = EVBACKEND_ALL;
+	}
+
+	event_loop = ev_default_loop (EVFLAG_SIGNALFD|ev_flags);
 	rspamd_main->event_loop = event_loop;
 
 	if (event_loop) {
@@ -1313,6 +1320,10 @@ main (gint argc, gchar **argv, gchar **env)
 			loop_str = "epoll";
 			poor_backend = FALSE;
 			break;
+		case EVBACKEND_IOURING:
+			loop_str = "io_uring";
+			poor_backend = FALSE;
+			break;
 		case EVBACKEND_POLL:
 			loop_str = "poll";
 			break;
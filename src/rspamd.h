@@ -100,6 +100,7 @@ struct rspamd_worker {
 	GPtrArray *finish_actions;      /**< called when worker is terminated				*/
 	ev_child cld_ev;                /**< to allow reaping								*/
 	rspamd_worker_term_cb term_handler; /**< custom term handler						*/
+	struct rspamd_stat *stat;       /**< counters of this worker in shared memory		*/
 };
 
 struct rspamd_abstract_worker_ctx {
@@ -258,14 +259,49 @@ struct rspamd_cryptobox_library_ctx;
 /**
  * Server statistics
  */
+#define RSPAMD_STAT_MAX_SLOTS 128
+#define RSPAMD_STAT_SCAN_TIME_BUCKETS 12
+
 struct rspamd_stat {
-	guint messages_scanned;                             /**< total number of messages scanned				*/
-	guint actions_stat[METRIC_ACTION_MAX];              /**< statistic for each action						*/
-	guint connections_count;                            /**< total connections count						*/
-	guint control_connections_count;                    /**< connections count to control interface			*/
-	guint messages_learned;                             /**< messages learned								*/
+	guint64 messages_scanned;                           /**< total number of messages scanned				*/
+	guint64 actions_stat[METRIC_ACTION_MAX];            /**< statistic for each action						*/
+	guint64 connections_count;                          /**< total connections count						*/
+	guint64 control_connections_count;                  /**< connections count to control interface			*/
+	guint64 messages_learned;                           /**< messages learned								*/
+	guint64 bytes_received;                             /**< bytes of messages received by scanners		*/
+	guint64 bytes_copied;                               /**< bytes copied while receiving messages			*/
+	guint64 scan_time_buckets[RSPAMD_STAT_SCAN_TIME_BUCKETS]; /**< histogram of scan times					*/
+	guint64 scan_time_usec;                             /**< total scan time in microseconds				*/
+	guint64 keypair_cache_hits;                         /**< encrypted messages that reused shared secret	*/
+	guint64 keypair_cache_misses;                       /**< encrypted messages that computed shared secret	*/
+};
+
+/**
+ * Counters of a single process, readers just sum all slots. Each slot has
+ * exactly one writer, so updates require no locking, except the shared slot
+ * used by processes that have no own slot
+ */
+struct RSPAMD_ALIGNED(64) rspamd_stat_slot {
+	struct rspamd_stat st;                              /**< counters of the process						*/
+	pid_t pid;                                          /**< owner of the slot, 0 if it is free			*/
+	GQuark type;                                        /**< type of the owner process						*/
+	gboolean shared;                                    /**< slot is written by many processes				*/
 };
 
+/* Counters are the first member of a slot */
+#ifdef HAVE_ATOMIC_BUILTINS
+#define RSPAMD_STAT_ADD(st, field, n) do { \
+	if (((struct rspamd_stat_slot *)(st))->shared) { \
+		__atomic_add_fetch (&(st)->field, (n), __ATOMIC_RELAXED); \
+	} \
+	else { \
+		__atomic_store_n (&(st)->field, (st)->field + (n), __ATOMIC_RELAXED); \
+	} \
+} while (0)
+#else
+#define RSPAMD_STAT_ADD(st, field, n) ((st)->field += (n))
+#endif
+
 /**
  * Struct that determine main server object (for logging purposes)
  */
@@ -275,7 +311,8 @@ struct rspamd_main {
 	/* Pid file structure */
 	rspamd_pidfh_t *pfh;                                        /**< struct pidfh for pidfile						*/
 	GQuark type;                                                /**< process type									*/
-	struct rspamd_stat *stat;                                   /**< pointer to statistics							*/
+	struct rspamd_stat *stat;                                   /**< offset added to reported statistics			*/
+	struct rspamd_stat_slot *stat_slots;                        /**< per process statistics in shared memory		*/
 
 	rspamd_mempool_t *server_pool;                              /**< server's memory pool							*/
 	rspamd_mempool_mutex_t *start_mtx;                          /**< server is starting up							*/
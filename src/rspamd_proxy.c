@@ -91,6 +91,8 @@ struct rspamd_http_upstream {
 	gboolean local;
 	gboolean self_scan;
 	gboolean compress;
+	gboolean keepalive;
+	gboolean http2;
 };
 
 struct rspamd_http_mirror {
@@ -158,6 +160,8 @@ enum rspamd_backend_flags {
 	RSPAMD_BACKEND_REPLIED = 1 << 0,
 	RSPAMD_BACKEND_CLOSED = 1 << 1,
 	RSPAMD_BACKEND_PARSED = 1 << 2,
+	RSPAMD_BACKEND_KEEPALIVE = 1 << 3,
+	RSPAMD_BACKEND_HTTP2 = 1 << 4,
 };
 
 struct rspamd_proxy_session;
@@ -397,6 +401,16 @@ rspamd_proxy_parse_upstream (rspamd_mempool_t *pool,
 		up->compress = TRUE;
 	}
 
+	elt = ucl_object_lookup_any (obj, "keepalive", "keep_alive", NULL);
+	if (elt && ucl_object_toboolean (elt)) {
+		up->keepalive = TRUE;
+	}
+
+	elt = ucl_object_lookup (obj, "http2");
+	if (elt && ucl_object_toboolean (elt)) {
+		up->http2 = TRUE;
+	}
+
 	elt = ucl_object_lookup (obj, "hosts");
 
 	if (elt == NULL && !up->self_scan) {
@@ -845,7 +859,11 @@ proxy_backend_close_connection (struct rspamd_proxy_backend_connection *conn)
 		if (conn->backend_conn) {
 			rspamd_http_connection_reset (conn->backend_conn);
 			rspamd_http_connection_unref (conn->backend_conn);
-			close (conn->backend_sock);
+
+			/* Keep-alive and HTTP/2 connections own their sockets */
+			if (!(conn->flags & (RSPAMD_BACKEND_KEEPALIVE|RSPAMD_BACKEND_HTTP2))) {
+				close (conn->backend_sock);
+			}
 		}
 
 		conn->flags |= RSPAMD_BACKEND_CLOSED;
@@ -856,9 +874,13 @@ static gboolean
 proxy_backend_parse_results (struct rspamd_proxy_session *session,
 		struct rspamd_proxy_backend_connection *conn,
 		lua_State *L, gint parser_ref,
-		const gchar *in, gsize inlen)
+		struct rspamd_http_message *msg)
 {
 	struct ucl_parser *parser;
+	const rspamd_ftok_t *ctype;
+	enum ucl_parse_type parse_type = UCL_PARSE_UCL;
+	const gchar *in = msg->body_buf.begin;
+	gsize inlen = msg->body_buf.len;
 	gint err_idx;
 
 	if (inlen == 0 || in == NULL) {
@@ -887,9 +909,18 @@ proxy_backend_parse_results (struct rspamd_proxy_session *session,
 		lua_settop (L, 0);
 	}
 	else {
+		ctype = rspamd_http_message_find_header (msg, "Content-Type");
+
+		if (ctype && rspamd_substring_search_caseless (ctype->begin, ctype->len,
+				RSPAMD_PROTOCOL_MSGPACK_CTYPE,
+				sizeof (RSPAMD_PROTOCOL_MSGPACK_CTYPE) - 1) != -1) {
+			parse_type = UCL_PARSE_MSGPACK;
+		}
+
 		parser = ucl_parser_new (0);
 
-		if (!ucl_parser_add_chunk (parser, in, inlen)) {
+		if (!ucl_parser_add_chunk_full (parser, in, inlen, 0,
+				UCL_DUPLICATE_APPEND, parse_type)) {
 			gchar *encoded;
 
 			encoded = rspamd_encode_base64 (in, inlen, 0, NULL);
@@ -1300,7 +1331,7 @@ proxy_backend_mirror_finish_handler (struct rspamd_http_connection *conn,
 	proxy_request_decompress (msg);
 
 	if (!proxy_backend_parse_results (session, bk_conn, session->ctx->lua_state,
-			bk_conn->parser_from_ref, msg->body_buf.begin, msg->body_buf.len)) {
+			bk_conn->parser_from_ref, msg)) {
 		msg_warn_session ("cannot parse results from the mirror backend %s:%s",
 				bk_conn->name,
 				rspamd_inet_address_to_string (
@@ -1518,7 +1549,7 @@ proxy_backend_master_finish_handler (struct rspamd_http_connection *conn,
 	rspamd_http_connection_reset (session->master_conn->backend_conn);
 
 	if (!proxy_backend_parse_results (session, bk_conn, session->ctx->lua_state,
-			bk_conn->parser_from_ref, msg->body_buf.begin, msg->body_buf.len)) {
+			bk_conn->parser_from_ref, msg)) {
 		msg_warn_session ("cannot parse results from the master backend");
 	}
 
@@ -1586,6 +1617,7 @@ rspamd_proxy_scan_self_reply (struct rspamd_task *task)
 		rspamd_task_set_finish_time (task);
 		rspamd_protocol_http_reply (msg, task, &rep);
 		rspamd_protocol_write_log_pipe (task);
+		ctype = rspamd_protocol_reply_content_type (task);
 		break;
 	case CMD_PING:
 		rspamd_http_message_set_body (msg, "pong" CRLF, 6);
@@ -1777,21 +1809,81 @@ retry:
 			goto err;
 		}
 
-		session->master_conn->backend_sock = rspamd_inet_address_connect (
-				rspamd_upstream_addr_next (session->master_conn->up),
-				SOCK_STREAM, TRUE);
+		session->master_conn->flags &= ~(RSPAMD_BACKEND_KEEPALIVE|
+				RSPAMD_BACKEND_HTTP2);
+
+		if (backend->http2) {
+			/* Requests are multiplexed over a shared connection */
+			session->master_conn->backend_sock = -1;
+			session->master_conn->flags |= RSPAMD_BACKEND_HTTP2;
+			session->master_conn->backend_conn = rspamd_http_connection_new_http2 (
+					session->ctx->http_ctx,
+					NULL,
+					proxy_backend_master_error_handler,
+					proxy_backend_master_finish_handler,
+					rspamd_upstream_addr_next (session->master_conn->up),
+					rspamd_upstream_name (session->master_conn->up));
+
+			if (session->master_conn->backend_conn == NULL) {
+				msg_err_session ("cannot connect upstream: %s(%s)",
+						host ? hostbuf : "default",
+						rspamd_inet_address_to_string (
+								rspamd_upstream_addr_cur (
+										session->master_conn->up)));
+				rspamd_upstream_fail (session->master_conn->up, TRUE);
+				session->retries ++;
+				goto retry;
+			}
+		}
+		else if (backend->keepalive) {
+			/* Reuse an idle connection to this upstream if any */
+			session->master_conn->backend_sock = -1;
+			session->master_conn->flags |= RSPAMD_BACKEND_KEEPALIVE;
+			session->master_conn->backend_conn = rspamd_http_connection_new_keepalive (
+					session->ctx->http_ctx,
+					NULL,
+					proxy_backend_master_error_handler,
+					proxy_backend_master_finish_handler,
+					rspamd_upstream_addr_next (session->master_conn->up),
+					rspamd_upstream_name (session->master_conn->up));
+
+			if (session->master_conn->backend_conn == NULL) {
+				msg_err_session ("cannot connect upstream: %s(%s)",
+						host ? hostbuf : "default",
+						rspamd_inet_address_to_string (
+								rspamd_upstream_addr_cur (
+										session->master_conn->up)));
+				rspamd_upstream_fail (session->master_conn->up, TRUE);
+				session->retries ++;
+				goto retry;
+			}
+		}
+		else {
+			session->master_conn->backend_sock = rspamd_inet_address_connect (
+					rspamd_upstream_addr_next (session->master_conn->up),
+					SOCK_STREAM, TRUE);
+
+			if (session->master_conn->backend_sock == -1) {
+				msg_err_session ("cannot connect upstream: %s(%s)",
+						host ? hostbuf : "default",
+								rspamd_inet_address_to_string (
+										rspamd_upstream_addr_cur (
+												session->master_conn->up)));
+				rspamd_upstream_fail (session->master_conn->up, TRUE);
+				session->retries ++;
+				goto retry;
+			}
 
-		if (session->master_conn->backend_sock == -1) {
-			msg_err_session ("cannot connect upstream: %s(%s)",
-					host ? hostbuf : "default",
-							rspamd_inet_address_to_string (
-									rspamd_upstream_addr_cur (
-											session->master_conn->up)));
-			rspamd_upstream_fail (session->master_conn->up, TRUE);
-			session->retries ++;
-			goto retry;
+			session->master_conn->backend_conn = rspamd_http_connection_new_client_socket (
+					session->ctx->http_ctx,
+					NULL,
+					proxy_backend_master_error_handler,
+					proxy_backend_master_finish_handler,
+					RSPAMD_HTTP_CLIENT_SIMPLE,
+					session->master_conn->backend_sock);
 		}
 
+		session->master_conn->flags &= ~RSPAMD_BACKEND_CLOSED;
 		msg = rspamd_http_connection_copy_msg (session->client_message, &err);
 		if (msg == NULL) {
 			msg_err_session ("cannot copy message to send it to the upstream: %e",
@@ -1804,14 +1896,6 @@ retry:
 			goto err; /* No fallback here */
 		}
 
-		session->master_conn->backend_conn = rspamd_http_connection_new_client_socket (
-				session->ctx->http_ctx,
-				NULL,
-				proxy_backend_master_error_handler,
-				proxy_backend_master_finish_handler,
-				RSPAMD_HTTP_CLIENT_SIMPLE,
-				session->master_conn->backend_sock);
-		session->master_conn->flags &= ~RSPAMD_BACKEND_CLOSED;
 		session->master_conn->parser_from_ref = backend->parser_from_ref;
 		session->master_conn->parser_to_ref = backend->parser_to_ref;
 
@@ -2153,6 +2237,7 @@ start_rspamd_proxy (struct rspamd_worker *worker)
 
 	ctx->http_ctx = rspamd_http_context_create (ctx->cfg, ctx->event_loop,
 			ctx->cfg->ups_ctx);
+	rspamd_http_context_set_stat (ctx->http_ctx, rspamd_worker_stat (worker));
 
 	if (ctx->has_self_scan) {
 		/* Additional initialisation needed */
@@ -34,6 +34,7 @@
 #include "worker_private.h"
 #include "utlist.h"
 #include "libutil/http_private.h"
+#include "libutil/http2.h"
 #include "libmime/lang_detection.h"
 #include <math.h>
 #include <src/libserver/cfg_file_private.h>
@@ -46,6 +47,8 @@
 
 gpointer init_worker (struct rspamd_config *cfg);
 void start_worker (struct rspamd_worker *worker);
+static struct rspamd_task *rspamd_worker_new_task (struct rspamd_worker *worker,
+		gint fd, rspamd_inet_addr_t *addr, struct rspamd_http_connection *conn);
 
 worker_t normal_worker = {
 		"normal",                   /* Name */
@@ -181,7 +184,19 @@ rspamd_worker_guard_handler (EV_P_ ev_io *w, int revents)
 	gchar fake_buf[1024];
 	gssize r;
 
-	r = read (w->fd, fake_buf, sizeof (fake_buf));
+	if (task->http_conn && rspamd_http_connection_is_keepalive (task->http_conn)) {
+		/* Pipelined request must not be consumed */
+		r = recv (w->fd, fake_buf, sizeof (fake_buf), MSG_PEEK);
+
+		if (r > 0) {
+			ev_io_stop (task->event_loop, &task->guard_ev);
+
+			return;
+		}
+	}
+	else {
+		r = read (w->fd, fake_buf, sizeof (fake_buf));
+	}
 
 	if (r > 0) {
 		msg_warn_task ("received extra data after task is loaded, ignoring");
@@ -224,8 +239,16 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 {
 	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
 	struct rspamd_worker_ctx *ctx;
+	struct rspamd_stat *stat;
+	gsize copied;
 
 	ctx = task->worker->ctx;
+	stat = rspamd_worker_stat (task->worker);
+	copied = rspamd_http_message_get_body_copied (msg);
+	msg_debug_task ("received %z bytes of body, %z bytes copied", len, copied);
+
+	RSPAMD_STAT_ADD (stat, bytes_received, len);
+	RSPAMD_STAT_ADD (stat, bytes_copied, copied);
 
 	if (!rspamd_protocol_handle_request (task, msg)) {
 		msg_err_task ("cannot handle request: %e", task->err);
@@ -251,10 +274,13 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 		ev_timer_start (task->event_loop, &task->timeout_ev);
 	}
 
-	/* Set socket guard */
-	task->guard_ev.data = task;
-	ev_io_init (&task->guard_ev, rspamd_worker_guard_handler, task->sock, EV_READ);
-	ev_io_start (task->event_loop, &task->guard_ev);
+	/* Set socket guard, HTTP/2 streams are reset by a session instead */
+	if (task->sock != -1) {
+		task->guard_ev.data = task;
+		ev_io_init (&task->guard_ev, rspamd_worker_guard_handler, task->sock,
+				EV_READ);
+		ev_io_start (task->event_loop, &task->guard_ev);
+	}
 
 	rspamd_task_process (task, RSPAMD_TASK_PROCESS_ALL);
 
@@ -268,6 +294,19 @@ rspamd_worker_error_handler (struct rspamd_http_connection *conn, GError *err)
 	struct rspamd_http_message *msg;
 	rspamd_fstring_t *reply;
 
+	if ((task->flags & RSPAMD_TASK_FLAG_KEEPALIVE) &&
+			task->processed_stages == 0 && err && err->code < 400) {
+		/*
+		 * Peer has closed keep-alive connection or it has been timed out,
+		 * malformed requests have 4xx codes and are always replied
+		 */
+		msg_debug_task ("closing idle keep-alive connection from: %s: %e",
+				rspamd_inet_address_to_string (task->client_addr), err);
+		rspamd_session_destroy (task->s);
+
+		return;
+	}
+
 	msg_info_task ("abnormally closing connection from: %s, error: %e",
 		rspamd_inet_address_to_string (task->client_addr), err);
 	if (task->processed_stages & RSPAMD_TASK_STAGE_REPLIED) {
@@ -304,6 +343,40 @@ rspamd_worker_error_handler (struct rspamd_http_connection *conn, GError *err)
 	}
 }
 
+/*
+ * Passes keep-alive connection to a new task that reads the next request,
+ * the current task is destroyed as usual
+ */
+static gboolean
+rspamd_worker_keepalive (struct rspamd_task *task,
+		struct rspamd_http_connection *conn)
+{
+	struct rspamd_worker *worker = task->worker;
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+	struct rspamd_task *ntask;
+
+	if (!rspamd_http_connection_is_keepalive (conn) || worker->wanna_die ||
+			(ctx->max_tasks != 0 && worker->nconns > ctx->max_tasks)) {
+		return FALSE;
+	}
+
+	ntask = rspamd_worker_new_task (worker, task->sock,
+			rspamd_inet_address_copy (task->client_addr), conn);
+	msg_debug_task ("keep connection from: %s for the next request, "
+			"new task ptr: %p",
+			rspamd_inet_address_to_string (task->client_addr), ntask);
+
+	/* Socket and connection now belong to the new task */
+	task->sock = -1;
+	task->http_conn = NULL;
+	rspamd_session_destroy (task->s);
+
+	rspamd_http_connection_reset (conn);
+	rspamd_http_connection_read_message (conn, ntask, ctx->timeout);
+
+	return TRUE;
+}
+
 static gint
 rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg)
@@ -311,6 +384,10 @@ rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
 
 	if (task->processed_stages & RSPAMD_TASK_STAGE_REPLIED) {
+		if (rspamd_worker_keepalive (task, conn)) {
+			return 0;
+		}
+
 		/* We are done here */
 		msg_debug_task ("normally closing connection from: %s",
 			rspamd_inet_address_to_string (task->client_addr));
@@ -323,44 +400,36 @@ rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 	return 0;
 }
 
-/*
- * Accept new connection and construct task
- */
-static void
-accept_socket (EV_P_ ev_io *w, int revents)
+static gint
+rspamd_worker_http_opts (struct rspamd_worker_ctx *ctx,
+		rspamd_inet_addr_t *addr)
 {
-	struct rspamd_worker *worker = (struct rspamd_worker *) w->data;
-	struct rspamd_worker_ctx *ctx;
-	struct rspamd_task *task;
-	rspamd_inet_addr_t *addr;
-	gint nfd, http_opts = 0;
-
-	ctx = worker->ctx;
+	/* Large messages are read in place to anonymous memory files */
+	gint http_opts = RSPAMD_HTTP_SERVER_MEMFD;
 
-	if (ctx->max_tasks != 0 && worker->nconns > ctx->max_tasks) {
-		msg_info_ctx ("current tasks is now: %uD while maximum is: %uD",
-				worker->nconns,
-			ctx->max_tasks);
-		return;
+	if (ctx->encrypted_only && !rspamd_inet_address_is_local (addr, FALSE)) {
+		http_opts |= RSPAMD_HTTP_REQUIRE_ENCRYPTION;
 	}
 
-	if ((nfd =
-		rspamd_accept_from_socket (w->fd, &addr,
-				rspamd_worker_throttle_accept_events, worker->accept_events)) == -1) {
-		msg_warn_ctx ("accept failed: %s", strerror (errno));
-		return;
-	}
-	/* Check for EAGAIN */
-	if (nfd == 0) {
-		return;
+	if (ctx->keep_alive) {
+		http_opts |= RSPAMD_HTTP_SERVER_KEEP_ALIVE;
 	}
 
-	task = rspamd_task_new (worker, ctx->cfg, NULL, ctx->lang_det, ctx->event_loop);
+	return http_opts;
+}
 
-	msg_info_task ("accepted connection from %s port %d, task ptr: %p",
-		rspamd_inet_address_to_string (addr),
-		rspamd_inet_address_get_port (addr),
-		task);
+/*
+ * Creates task for a new connection, for the next request on a keep-alive
+ * connection or for a new HTTP/2 stream
+ */
+static struct rspamd_task *
+rspamd_worker_new_task (struct rspamd_worker *worker, gint fd,
+		rspamd_inet_addr_t *addr, struct rspamd_http_connection *conn)
+{
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+	struct rspamd_task *task;
+
+	task = rspamd_task_new (worker, ctx->cfg, NULL, ctx->lang_det, ctx->event_loop);
 
 	/* Copy some variables */
 	if (ctx->is_mime) {
@@ -370,26 +439,37 @@ accept_socket (EV_P_ ev_io *w, int revents)
 		task->flags &= ~RSPAMD_TASK_FLAG_MIME;
 	}
 
-	task->sock = nfd;
+	task->sock = fd;
 	task->client_addr = addr;
 
-	worker->srv->stat->connections_count++;
 	task->resolver = ctx->resolver;
 	/* TODO: allow to disable autolearn in protocol */
 	task->flags |= RSPAMD_TASK_FLAG_LEARN_AUTO;
 
-	if (ctx->encrypted_only && !rspamd_inet_address_is_local (addr, FALSE)) {
-		http_opts = RSPAMD_HTTP_REQUIRE_ENCRYPTION;
+	if (conn == NULL) {
+		task->http_conn = rspamd_http_connection_new_server (
+				ctx->http_ctx,
+				fd,
+				rspamd_worker_body_handler,
+				rspamd_worker_error_handler,
+				rspamd_worker_finish_handler,
+				rspamd_worker_http_opts (ctx, addr));
+		rspamd_http_connection_set_max_size (task->http_conn,
+				task->cfg->max_message);
+
+		if (ctx->key) {
+			rspamd_http_connection_set_key (task->http_conn, ctx->key);
+		}
+	}
+	else {
+		/* Connection is reused for the next request or it is a stream */
+		task->http_conn = conn;
+
+		if (rspamd_http_connection_is_keepalive (conn)) {
+			task->flags |= RSPAMD_TASK_FLAG_KEEPALIVE;
+		}
 	}
 
-	task->http_conn = rspamd_http_connection_new_server (
-			ctx->http_ctx,
-			nfd,
-			rspamd_worker_body_handler,
-			rspamd_worker_error_handler,
-			rspamd_worker_finish_handler,
-			http_opts);
-	rspamd_http_connection_set_max_size (task->http_conn, task->cfg->max_message);
 	worker->nconns++;
 	rspamd_mempool_add_destructor (task->task_pool,
 		(rspamd_mempool_destruct_t)reduce_tasks_count, worker);
@@ -398,15 +478,135 @@ accept_socket (EV_P_ ev_io *w, int revents)
 	task->s = rspamd_session_create (task->task_pool, rspamd_task_fin,
 			rspamd_task_restore, (event_finalizer_t )rspamd_task_free, task);
 
-	if (ctx->key) {
-		rspamd_http_connection_set_key (task->http_conn, ctx->key);
+	return task;
+}
+
+struct rspamd_worker_http2_cbdata {
+	struct rspamd_worker *worker;
+	rspamd_inet_addr_t *addr;
+};
+
+static void
+rspamd_worker_http2_stream (struct rspamd_http2_session *session,
+		struct rspamd_http_connection *conn,
+		gpointer ud)
+{
+	struct rspamd_worker_http2_cbdata *cbd =
+			(struct rspamd_worker_http2_cbdata *)ud;
+	struct rspamd_worker_ctx *ctx = cbd->worker->ctx;
+	struct rspamd_task *task;
+
+	task = rspamd_worker_new_task (cbd->worker, -1,
+			rspamd_inet_address_copy (cbd->addr), conn);
+	msg_debug_task ("new http2 stream from %s, task ptr: %p",
+			rspamd_inet_address_to_string (cbd->addr), task);
+	rspamd_http_connection_read_message (conn, task, ctx->timeout);
+}
+
+static void
+rspamd_worker_http2_fin (struct rspamd_http2_session *session, gpointer ud)
+{
+	struct rspamd_worker_http2_cbdata *cbd =
+			(struct rspamd_worker_http2_cbdata *)ud;
+
+	rspamd_inet_address_free (cbd->addr);
+	g_free (cbd);
+}
+
+static void
+rspamd_worker_start_connection (gint fd, gboolean is_http2, gpointer ud)
+{
+	struct rspamd_worker_http2_cbdata *cbd =
+			(struct rspamd_worker_http2_cbdata *)ud;
+	struct rspamd_worker *worker = cbd->worker;
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+	struct rspamd_http2_session *session;
+	struct rspamd_task *task;
+
+	if (is_http2) {
+		msg_info_ctx ("accepted http2 connection from %s port %d",
+				rspamd_inet_address_to_string (cbd->addr),
+				rspamd_inet_address_get_port (cbd->addr));
+		/* Each stream gets its own task */
+		session = rspamd_http2_session_new_server (ctx->http_ctx, fd,
+				ctx->timeout,
+				rspamd_worker_body_handler,
+				rspamd_worker_error_handler,
+				rspamd_worker_finish_handler,
+				rspamd_worker_http_opts (ctx, cbd->addr),
+				rspamd_worker_http2_stream,
+				rspamd_worker_http2_fin,
+				cbd);
+		rspamd_http2_session_set_max_size (session, ctx->cfg->max_message);
+
+		if (ctx->key) {
+			rspamd_http2_session_set_key (session, ctx->key);
+		}
+
+		return;
 	}
 
+	task = rspamd_worker_new_task (worker, fd, cbd->addr, NULL);
+	g_free (cbd);
+
+	msg_info_task ("accepted connection from %s port %d, task ptr: %p",
+		rspamd_inet_address_to_string (task->client_addr),
+		rspamd_inet_address_get_port (task->client_addr),
+		task);
+
 	rspamd_http_connection_read_message (task->http_conn,
 			task,
 			ctx->timeout);
 }
 
+/*
+ * Accept new connection and construct task
+ */
+static void
+accept_socket (EV_P_ ev_io *w, int revents)
+{
+	struct rspamd_worker *worker = (struct rspamd_worker *) w->data;
+	struct rspamd_worker_ctx *ctx;
+	struct rspamd_worker_http2_cbdata *cbd;
+	rspamd_inet_addr_t *addr;
+	gint nfd;
+
+	ctx = worker->ctx;
+
+	if (ctx->max_tasks != 0 && worker->nconns > ctx->max_tasks) {
+		msg_info_ctx ("current tasks is now: %uD while maximum is: %uD",
+				worker->nconns,
+			ctx->max_tasks);
+		return;
+	}
+
+	if ((nfd =
+		rspamd_accept_from_socket (w->fd, &addr,
+				rspamd_worker_throttle_accept_events, worker->accept_events)) == -1) {
+		msg_warn_ctx ("accept failed: %s", strerror (errno));
+		return;
+	}
+	/* Check for EAGAIN */
+	if (nfd == 0) {
+		return;
+	}
+
+	RSPAMD_STAT_ADD (rspamd_worker_stat (worker), connections_count, 1);
+
+	cbd = g_malloc0 (sizeof (*cbd));
+	cbd->worker = worker;
+	cbd->addr = addr;
+
+	if (rspamd_http2_server_enabled (ctx->http_ctx)) {
+		/* HTTP/2 clients are recognised by the connection preface */
+		rspamd_http2_detect (ctx->http_ctx, nfd, ctx->timeout,
+				rspamd_worker_start_connection, cbd);
+	}
+	else {
+		rspamd_worker_start_connection (nfd, FALSE, cbd);
+	}
+}
+
 static gboolean
 rspamd_worker_log_pipe_handler (struct rspamd_main *rspamd_main,
 		struct rspamd_worker *worker, gint fd,
@@ -516,6 +716,15 @@ init_worker (struct rspamd_config *cfg)
 			0,
 			"Allow only encrypted connections");
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keep_alive",
+			rspamd_rcl_parse_struct_boolean,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, keep_alive),
+			0,
+			"Allow keep-alive and pipelined requests");
+
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -579,7 +788,7 @@ rspamd_worker_init_scanner (struct rspamd_worker *worker,
 		struct rspamd_dns_resolver *resolver,
 		struct rspamd_lang_detector **plang_det)
 {
-	rspamd_stat_init (worker->srv->cfg, ev_base);
+	rspamd_stat_init (worker->srv->cfg, ev_base, worker);
 	g_ptr_array_add (worker->finish_actions,
 			(gpointer) rspamd_worker_on_terminate);
 #ifdef WITH_HYPERSCAN
@@ -631,6 +840,7 @@ start_worker (struct rspamd_worker *worker)
 
 	ctx->http_ctx = rspamd_http_context_create (ctx->cfg, ctx->event_loop,
 			ctx->cfg->ups_ctx);
+	rspamd_http_context_set_stat (ctx->http_ctx, rspamd_worker_stat (worker));
 	rspamd_worker_init_scanner (worker, ctx->event_loop, ctx->resolver,
 			&ctx->lang_det);
 	rspamd_lua_run_postloads (ctx->cfg->lua_state, ctx->cfg, ctx->event_loop,
@@ -41,6 +41,8 @@ struct rspamd_worker_ctx {
 	gboolean is_mime;
 	/* Allow encrypted requests only using network */
 	gboolean encrypted_only;
+	/* Allow keep-alive connections */
+	gboolean keep_alive;
 	/* Limit of tasks */
 	guint32 max_tasks;
 	/* Maximum time for task processing */
@@ -0,0 +1,34 @@
+-- LRU cache tests
+
+context("LRU cache", function()
+  local util = require "rspamd_util"
+
+  for _,policy in ipairs({'tinylfu', 'lru'}) do
+    test("Basic operations: " .. policy, function()
+      local lru = util.create_lru(64, policy)
+
+      lru:set('key', 'value')
+      assert_equal(lru:get('key'), 'value')
+      lru:set('key', {1, 2})
+      assert_equal(lru:get('key')[2], 2)
+      assert_equal(lru:size(), 1)
+      assert_true(lru:remove('key'))
+      assert_false(lru:remove('key'))
+      assert_nil(lru:get('key'))
+      assert_equal(lru:capacity(), 64)
+    end)
+  end
+
+  test("Capacity is respected", function()
+    local lru = util.create_lru(64)
+
+    for i = 1,1000 do
+      lru:set('hot', i)
+      lru:get('hot')
+      lru:set('key' .. tostring(i), i)
+      assert_true(lru:size() <= 64)
+    end
+
+    assert_equal(lru:get('hot'), 1000)
+  end)
+end)
@@ -0,0 +1,180 @@
+/*-
+ * Copyright 2019 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "libutil/hpack.h"
+
+/* RFC 7541, C.4: requests with Huffman coding */
+static const struct {
+	const gchar *in;
+	const gchar *out;
+} hpack_requests[] = {
+	{
+		"828684418cf1e3c2e5f23a6ba0ab90f4ff",
+		":method: GET\n:scheme: http\n:path: /\n"
+		":authority: www.example.com\n"
+	},
+	{
+		"828684be5886a8eb10649cbf",
+		":method: GET\n:scheme: http\n:path: /\n"
+		":authority: www.example.com\ncache-control: no-cache\n"
+	},
+	{
+		"828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf",
+		":method: GET\n:scheme: https\n:path: /index.html\n"
+		":authority: www.example.com\ncustom-key: custom-value\n"
+	},
+};
+
+/* RFC 7541, C.6: responses with Huffman coding and 256 bytes table */
+static const struct {
+	const gchar *in;
+	const gchar *out;
+} hpack_responses[] = {
+	{
+		"488264025885aec3771a4b6196d07abe941054d444a8200595040b8166e082a62d1bff"
+		"6e919d29ad171863c78f0b97c8e9ae82ae43d3",
+		":status: 302\ncache-control: private\n"
+		"date: Mon, 21 Oct 2013 20:13:21 GMT\n"
+		"location: https://www.example.com\n"
+	},
+	{
+		"4883640effc1c0bf",
+		":status: 307\ncache-control: private\n"
+		"date: Mon, 21 Oct 2013 20:13:21 GMT\n"
+		"location: https://www.example.com\n"
+	},
+	{
+		"88c16196d07abe941054d444a8200595040b8166e084a62d1bffc05a839bd9ab77ad94e7"
+		"821dd7f2e6c7b335dfdfcd5b3960d5af27087f3672c1ab270fb5291f9587316065c003ed"
+		"4ee5b1063d5007",
+		":status: 200\ncache-control: private\n"
+		"date: Mon, 21 Oct 2013 20:13:22 GMT\n"
+		"location: https://www.example.com\ncontent-encoding: gzip\n"
+		"set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\n"
+	},
+};
+
+static gboolean
+hpack_collect_cb (const rspamd_ftok_t *name, const rspamd_ftok_t *value,
+		gpointer ud)
+{
+	GString *res = (GString *)ud;
+
+	g_string_append_len (res, name->begin, name->len);
+	g_string_append (res, ": ");
+	g_string_append_len (res, value->begin, value->len);
+	g_string_append_c (res, '\n');
+
+	return TRUE;
+}
+
+static void
+hpack_check_vector (struct rspamd_hpack_table *t, const gchar *in,
+		const gchar *expected)
+{
+	guchar *bin;
+	gsize len;
+	GString *res;
+	GError *err = NULL;
+
+	bin = rspamd_decode_hex (in, strlen (in));
+	len = strlen (in) / 2;
+	res = g_string_new (NULL);
+
+	g_assert (rspamd_hpack_decode (t, bin, len, hpack_collect_cb, res, &err));
+	g_assert (err == NULL);
+	g_assert_cmpstr (res->str, ==, expected);
+
+	g_string_free (res, TRUE);
+	g_free (bin);
+}
+
+void
+rspamd_hpack_test_func (void)
+{
+	struct rspamd_hpack_table *dec, *enc;
+	rspamd_fstring_t *out;
+	rspamd_ftok_t name, value;
+	GString *expected, *res;
+	GError *err = NULL;
+	gchar namebuf[32], valbuf[32];
+	guint i, j;
+
+	dec = rspamd_hpack_table_new (RSPAMD_HPACK_DEFAULT_TABLE_SIZE);
+
+	for (i = 0; i < G_N_ELEMENTS (hpack_requests); i ++) {
+		hpack_check_vector (dec, hpack_requests[i].in, hpack_requests[i].out);
+	}
+
+	rspamd_hpack_table_free (dec);
+	dec = rspamd_hpack_table_new (256);
+
+	for (i = 0; i < G_N_ELEMENTS (hpack_responses); i ++) {
+		hpack_check_vector (dec, hpack_responses[i].in,
+				hpack_responses[i].out);
+	}
+
+	rspamd_hpack_table_free (dec);
+
+	/* Encoder output must be decoded back, including table size updates */
+	dec = rspamd_hpack_table_new (RSPAMD_HPACK_DEFAULT_TABLE_SIZE);
+	enc = rspamd_hpack_table_new (RSPAMD_HPACK_DEFAULT_TABLE_SIZE);
+	expected = g_string_new (NULL);
+	res = g_string_new (NULL);
+
+	for (i = 0; i < 50; i ++) {
+		out = rspamd_fstring_new ();
+		g_string_truncate (expected, 0);
+		g_string_truncate (res, 0);
+		rspamd_hpack_encode_start (enc, &out);
+
+		for (j = 0; j < 8; j ++) {
+			if (j == 0) {
+				rspamd_strlcpy (namebuf, ":status", sizeof (namebuf));
+				rspamd_strlcpy (valbuf, "200", sizeof (valbuf));
+			}
+			else {
+				rspamd_snprintf (namebuf, sizeof (namebuf), "x-hdr-%ud", j);
+				rspamd_snprintf (valbuf, sizeof (valbuf), "v%ud-%ud", j,
+						i % (j + 1));
+			}
+
+			name.begin = namebuf;
+			name.len = strlen (namebuf);
+			value.begin = valbuf;
+			value.len = strlen (valbuf);
+			rspamd_hpack_encode (enc, &out, &name, &value, j != 7);
+			rspamd_printf_gstring (expected, "%s: %s\n", namebuf, valbuf);
+		}
+
+		g_assert (rspamd_hpack_decode (dec, (const guchar *)out->str, out->len,
+				hpack_collect_cb, res, &err));
+		g_assert (err == NULL);
+		g_assert_cmpstr (res->str, ==, expected->str);
+		rspamd_fstring_free (out);
+
+		if (i == 20) {
+			rspamd_hpack_table_set_max_size (enc, 100);
+		}
+	}
+
+	g_string_free (expected, TRUE);
+	g_string_free (res, TRUE);
+	rspamd_hpack_table_free (enc);
+	rspamd_hpack_table_free (dec);
+}
@@ -0,0 +1,515 @@
+/*-
+ * Copyright 2019 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "tests.h"
+#include "unix-std.h"
+#include "libutil/http_connection.h"
+#include "libutil/http_private.h"
+#include "libutil/http2.h"
+#include "libutil/hpack.h"
+
+/* Must match limits in http2.c */
+#define H2_TEST_STREAM_WINDOW (1024 * 1024)
+#define H2_TEST_SESSION_WINDOW (1u << 24u)
+#define H2_TEST_WINDOW_UPDATE_MIN (64 * 1024)
+#define H2_TEST_MAX_RESETS 100
+#define H2_TEST_FRAME_SIZE 16384
+/* Crosses the point where the stream window is returned */
+#define H2_TEST_BODY_LEN 600000
+
+#define H2_DATA 0
+#define H2_HEADERS 1
+#define H2_RST_STREAM 3
+#define H2_SETTINGS 4
+#define H2_PING 6
+#define H2_GOAWAY 7
+#define H2_WINDOW_UPDATE 8
+
+#define H2_END_STREAM 0x1
+#define H2_ACK 0x1
+#define H2_END_HEADERS 0x4
+
+extern struct rspamd_main *rspamd_main;
+extern struct ev_loop *event_loop;
+
+struct http2_test_frame {
+	guint8 type;
+	guint8 flags;
+	guint32 id;
+	/* Window increment, reset or goaway code */
+	guint32 val;
+};
+
+struct http2_test_client {
+	gint fd;
+	gboolean eof;
+	GByteArray *in;
+	GArray *frames;
+	guint checked;
+	guint32 initial_window;
+	struct rspamd_hpack_table *enc;
+	struct rspamd_http_context *ctx;
+	struct rspamd_http2_session *session;
+	GPtrArray *conns;
+	gsize body_len;
+	gboolean received;
+};
+
+static guint32
+http2_test_u32 (const guchar *p)
+{
+	return ((guint32)p[0] << 24u) | ((guint32)p[1] << 16u) |
+			((guint32)p[2] << 8u) | (guint32)p[3];
+}
+
+static void
+http2_test_parse (struct http2_test_client *cl)
+{
+	struct http2_test_frame f;
+	const guchar *p;
+	gsize flen, i;
+
+	while (cl->in->len >= 9) {
+		p = cl->in->data;
+		flen = ((gsize)p[0] << 16u) | ((gsize)p[1] << 8u) | p[2];
+
+		if (cl->in->len < 9 + flen) {
+			break;
+		}
+
+		memset (&f, 0, sizeof (f));
+		f.type = p[3];
+		f.flags = p[4];
+		f.id = http2_test_u32 (p + 5) & 0x7fffffffu;
+
+		if ((f.type == H2_WINDOW_UPDATE || f.type == H2_RST_STREAM) &&
+				flen == 4) {
+			f.val = http2_test_u32 (p + 9) & 0x7fffffffu;
+		}
+		else if (f.type == H2_GOAWAY && flen >= 8) {
+			f.val = http2_test_u32 (p + 13);
+		}
+		else if (f.type == H2_SETTINGS && !(f.flags & H2_ACK)) {
+			for (i = 0; i + 6 <= flen; i += 6) {
+				if (p[9 + i] == 0 && p[10 + i] == 4) {
+					cl->initial_window = http2_test_u32 (p + 11 + i);
+				}
+			}
+		}
+
+		g_array_append_val (cl->frames, f);
+		g_byte_array_remove_range (cl->in, 0, 9 + flen);
+	}
+}
+
+static void
+http2_test_pump (struct http2_test_client *cl)
+{
+	guchar buf[16384];
+	gssize r;
+
+	ev_run (event_loop, EVRUN_NOWAIT);
+
+	while ((r = read (cl->fd, buf, sizeof (buf))) > 0) {
+		g_byte_array_append (cl->in, buf, r);
+	}
+
+	if (r == 0) {
+		cl->eof = TRUE;
+	}
+
+	http2_test_parse (cl);
+}
+
+static gboolean
+http2_test_wait (struct http2_test_client *cl, guint8 type, guint32 id,
+		struct http2_test_frame *out)
+{
+	struct http2_test_frame *f;
+	guint i, iter;
+
+	for (iter = 0; iter < 2000; iter ++) {
+		http2_test_pump (cl);
+
+		for (i = cl->checked; i < cl->frames->len; i ++) {
+			f = &g_array_index (cl->frames, struct http2_test_frame, i);
+
+			if (f->type == type && f->id == id) {
+				cl->checked = i + 1;
+
+				if (out) {
+					memcpy (out, f, sizeof (*f));
+				}
+
+				return TRUE;
+			}
+		}
+
+		if (cl->eof) {
+			break;
+		}
+
+		g_usleep (1000);
+	}
+
+	return FALSE;
+}
+
+static gsize
+http2_test_sum_updates (struct http2_test_client *cl, guint from, guint32 id)
+{
+	struct http2_test_frame *f;
+	gsize sum = 0;
+	guint i;
+
+	for (i = from; i < cl->frames->len; i ++) {
+		f = &g_array_index (cl->frames, struct http2_test_frame, i);
+
+		if (f->type == H2_WINDOW_UPDATE && f->id == id) {
+			sum += f->val;
+		}
+	}
+
+	return sum;
+}
+
+static void
+http2_test_send (struct http2_test_client *cl, const guchar *p, gsize len)
+{
+	gssize r;
+	gint flags = 0;
+
+#ifdef MSG_NOSIGNAL
+	flags = MSG_NOSIGNAL;
+#endif
+
+	while (len > 0) {
+		r = send (cl->fd, p, len, flags);
+
+		if (r == -1) {
+			if (errno != EAGAIN && errno != EINTR) {
+				/* Session is closed */
+				return;
+			}
+
+			/* Let server to read data */
+			http2_test_pump (cl);
+			continue;
+		}
+
+		p += r;
+		len -= r;
+	}
+}
+
+static void
+http2_test_frame (struct http2_test_client *cl, guint8 type, guint8 flags,
+		guint32 id, const guchar *payload, gsize len)
+{
+	guchar hdr[9];
+
+	hdr[0] = (len >> 16u) & 0xffu;
+	hdr[1] = (len >> 8u) & 0xffu;
+	hdr[2] = len & 0xffu;
+	hdr[3] = type;
+	hdr[4] = flags;
+	hdr[5] = (id >> 24u) & 0x7fu;
+	hdr[6] = (id >> 16u) & 0xffu;
+	hdr[7] = (id >> 8u) & 0xffu;
+	hdr[8] = id & 0xffu;
+
+	http2_test_send (cl, hdr, sizeof (hdr));
+
+	if (len > 0) {
+		http2_test_send (cl, payload, len);
+	}
+}
+
+static void
+http2_test_frame_u32 (struct http2_test_client *cl, guint8 type, guint32 id,
+		guint32 val)
+{
+	guchar payload[4];
+
+	payload[0] = (val >> 24u) & 0xffu;
+	payload[1] = (val >> 16u) & 0xffu;
+	payload[2] = (val >> 8u) & 0xffu;
+	payload[3] = val & 0xffu;
+
+	http2_test_frame (cl, type, 0, id, payload, sizeof (payload));
+}
+
+static void
+http2_test_request (struct http2_test_client *cl, guint32 id,
+		gboolean end_stream)
+{
+	static const gchar *hdrs[][2] = {
+			{":method", "POST"},
+			{":scheme", "http"},
+			{":path", "/checkv2"},
+	};
+	rspamd_fstring_t *blk;
+	rspamd_ftok_t n, v;
+	guint i;
+
+	blk = rspamd_fstring_sized_new (64);
+	rspamd_hpack_encode_start (cl->enc, &blk);
+
+	for (i = 0; i < G_N_ELEMENTS (hdrs); i ++) {
+		n.begin = hdrs[i][0];
+		n.len = strlen (hdrs[i][0]);
+		v.begin = hdrs[i][1];
+		v.len = strlen (hdrs[i][1]);
+		rspamd_hpack_encode (cl->enc, &blk, &n, &v, TRUE);
+	}
+
+	http2_test_frame (cl, H2_HEADERS,
+			H2_END_HEADERS | (end_stream ? H2_END_STREAM : 0), id,
+			(const guchar *)blk->str, blk->len);
+	rspamd_fstring_free (blk);
+}
+
+static void
+http2_test_error (struct rspamd_http_connection *conn, GError *err)
+{
+	/* Streams reset by the tests */
+}
+
+static gint
+http2_test_finish (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg)
+{
+	struct http2_test_client *cl = conn->ud;
+
+	rspamd_http_message_get_body (msg, &cl->body_len);
+	cl->received = TRUE;
+
+	return 0;
+}
+
+static void
+http2_test_stream (struct rspamd_http2_session *session,
+		struct rspamd_http_connection *conn, gpointer ud)
+{
+	struct http2_test_client *cl = ud;
+
+	g_ptr_array_add (cl->conns, conn);
+	rspamd_http_connection_read_message (conn, cl, 5.0);
+}
+
+static void
+http2_test_fin (struct rspamd_http2_session *session, gpointer ud)
+{
+	struct http2_test_client *cl = ud;
+
+	cl->session = NULL;
+}
+
+static struct http2_test_client *
+http2_test_client_new (void)
+{
+	struct http2_test_client *cl;
+	gint sv[2];
+
+	g_assert (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	rspamd_socket_nonblocking (sv[0]);
+	rspamd_socket_nonblocking (sv[1]);
+
+	cl = g_malloc0 (sizeof (*cl));
+	cl->fd = sv[0];
+	cl->in = g_byte_array_new ();
+	cl->frames = g_array_new (FALSE, FALSE, sizeof (struct http2_test_frame));
+	cl->enc = rspamd_hpack_table_new (4096);
+	cl->conns = g_ptr_array_new ();
+	cl->ctx = rspamd_http_context_create (rspamd_main->cfg, event_loop, NULL);
+	cl->session = rspamd_http2_session_new_server (cl->ctx, sv[1], 5.0,
+			NULL, http2_test_error, http2_test_finish, 0,
+			http2_test_stream, http2_test_fin, cl);
+
+	http2_test_send (cl, (const guchar *)RSPAMD_HTTP2_PREFACE,
+			RSPAMD_HTTP2_PREFACE_LEN);
+	http2_test_frame (cl, H2_SETTINGS, 0, 0, NULL, 0);
+
+	return cl;
+}
+
+static void
+http2_test_client_free (struct http2_test_client *cl)
+{
+	guint i;
+
+	if (cl->session) {
+		rspamd_http2_session_close (cl->session);
+	}
+
+	g_assert (cl->session == NULL);
+
+	for (i = 0; i < cl->conns->len; i ++) {
+		rspamd_http_connection_unref (g_ptr_array_index (cl->conns, i));
+	}
+
+	ev_run (event_loop, EVRUN_NOWAIT);
+	rspamd_http_context_free (cl->ctx);
+	rspamd_hpack_table_free (cl->enc);
+	g_ptr_array_free (cl->conns, TRUE);
+	g_array_free (cl->frames, TRUE);
+	g_byte_array_free (cl->in, TRUE);
+	close (cl->fd);
+	g_free (cl);
+}
+
+static void
+http2_test_flow_control (void)
+{
+	struct http2_test_client *cl;
+	struct http2_test_frame f;
+	guchar *body;
+	gsize pos, chunk;
+	guint mark, iter;
+
+	cl = http2_test_client_new ();
+
+	/* Stream window is advertised, connection window is the buffer limit */
+	g_assert (http2_test_wait (cl, H2_SETTINGS, 0, NULL));
+	g_assert_cmpuint (cl->initial_window, ==, H2_TEST_STREAM_WINDOW);
+	g_assert (http2_test_wait (cl, H2_WINDOW_UPDATE, 0, &f));
+	g_assert_cmpuint (f.val, ==, H2_TEST_SESSION_WINDOW - 65535);
+
+	body = g_malloc (H2_TEST_BODY_LEN);
+	memset (body, 'a', H2_TEST_BODY_LEN);
+	http2_test_request (cl, 1, FALSE);
+	mark = cl->frames->len;
+
+	for (pos = 0; pos + H2_TEST_FRAME_SIZE < H2_TEST_BODY_LEN;
+			pos += H2_TEST_FRAME_SIZE) {
+		http2_test_frame (cl, H2_DATA, 0, 1, body + pos, H2_TEST_FRAME_SIZE);
+	}
+
+	/* Stream window is returned on receipt */
+	g_assert (http2_test_wait (cl, H2_WINDOW_UPDATE, 1, &f));
+	g_assert_cmpuint (f.val, >=, H2_TEST_STREAM_WINDOW / 2);
+	/* But nothing is consumed before the stream is complete */
+	g_assert_cmpuint (http2_test_sum_updates (cl, mark, 0), ==, 0);
+	g_assert (!cl->received);
+
+	chunk = H2_TEST_BODY_LEN - pos;
+	http2_test_frame (cl, H2_DATA, H2_END_STREAM, 1, body + pos, chunk);
+
+	for (iter = 0; iter < 2000; iter ++) {
+		http2_test_pump (cl);
+
+		if (cl->received && http2_test_sum_updates (cl, mark, 0) +
+				H2_TEST_WINDOW_UPDATE_MIN > H2_TEST_BODY_LEN) {
+			break;
+		}
+
+		g_usleep (1000);
+	}
+
+	g_assert (cl->received);
+	g_assert_cmpuint (cl->body_len, ==, H2_TEST_BODY_LEN);
+	/* Connection window is returned as the body is read by the connection */
+	g_assert_cmpuint (http2_test_sum_updates (cl, mark, 0), <=,
+			H2_TEST_BODY_LEN);
+	g_assert_cmpuint (http2_test_sum_updates (cl, mark, 0) +
+			H2_TEST_WINDOW_UPDATE_MIN, >, H2_TEST_BODY_LEN);
+
+	g_free (body);
+	http2_test_client_free (cl);
+}
+
+static void
+http2_test_framing (void)
+{
+	struct http2_test_client *cl;
+	struct http2_test_frame f;
+	guchar payload[H2_TEST_FRAME_SIZE + 1];
+
+	memset (payload, 0, sizeof (payload));
+
+	/* Data for an idle stream resets only that stream */
+	cl = http2_test_client_new ();
+	http2_test_frame (cl, H2_DATA, 0, 3, payload, 16);
+	g_assert (http2_test_wait (cl, H2_RST_STREAM, 3, &f));
+	g_assert_cmpuint (f.val, ==, 5);
+	http2_test_frame (cl, H2_PING, 0, 0, payload, 8);
+	g_assert (http2_test_wait (cl, H2_PING, 0, &f));
+	g_assert (f.flags & H2_ACK);
+	http2_test_client_free (cl);
+
+	/* Data for stream 0 is a connection error */
+	cl = http2_test_client_new ();
+	http2_test_frame (cl, H2_DATA, 0, 0, payload, 16);
+	g_assert (http2_test_wait (cl, H2_GOAWAY, 0, &f));
+	g_assert_cmpuint (f.val, ==, 1);
+	g_assert (cl->session == NULL);
+	http2_test_client_free (cl);
+
+	/* Frames larger than the default maximum are not allowed */
+	cl = http2_test_client_new ();
+	http2_test_frame (cl, H2_DATA, 0, 1, payload, sizeof (payload));
+	g_assert (http2_test_wait (cl, H2_GOAWAY, 0, &f));
+	g_assert_cmpuint (f.val, ==, 6);
+	http2_test_client_free (cl);
+
+	/* Window update must not overflow */
+	cl = http2_test_client_new ();
+	http2_test_frame_u32 (cl, H2_WINDOW_UPDATE, 0, 0x7fffffffu);
+	g_assert (http2_test_wait (cl, H2_GOAWAY, 0, &f));
+	g_assert_cmpuint (f.val, ==, 3);
+	http2_test_client_free (cl);
+}
+
+static void
+http2_test_rapid_reset (void)
+{
+	struct http2_test_client *cl;
+	struct http2_test_frame f;
+	guint32 id;
+	guint i;
+
+	cl = http2_test_client_new ();
+
+	for (i = 0; i < H2_TEST_MAX_RESETS; i ++) {
+		id = i * 2 + 1;
+		http2_test_request (cl, id, FALSE);
+		http2_test_frame_u32 (cl, H2_RST_STREAM, id, 8);
+	}
+
+	/* Limit is not reached yet */
+	http2_test_frame (cl, H2_PING, 0, 0, (const guchar *)"12345678", 8);
+	g_assert (http2_test_wait (cl, H2_PING, 0, &f));
+	g_assert (cl->session != NULL);
+
+	id = H2_TEST_MAX_RESETS * 2 + 1;
+	http2_test_request (cl, id, FALSE);
+	http2_test_frame_u32 (cl, H2_RST_STREAM, id, 8);
+	g_assert (http2_test_wait (cl, H2_GOAWAY, 0, &f));
+	g_assert_cmpuint (f.val, ==, 11);
+	g_assert (cl->session == NULL);
+
+	http2_test_client_free (cl);
+}
+
+void
+rspamd_http2_test_func (void)
+{
+	http2_test_flow_control ();
+	http2_test_framing ();
+	http2_test_rapid_reset ();
+}
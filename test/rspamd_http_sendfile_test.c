@@ -0,0 +1,134 @@
+/*-
+ * Copyright 2019 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "tests.h"
+#include "unix-std.h"
+#include "libutil/http_connection.h"
+#include "libutil/http_private.h"
+
+/* Larger than a socket buffer, so the body is sent by several calls */
+#define SENDFILE_BODY_LEN 300000
+
+extern struct rspamd_main *rspamd_main;
+extern struct ev_loop *event_loop;
+
+struct sendfile_test_cbdata {
+	const guchar *body;
+	gsize sent_file;
+	gboolean written;
+	gboolean received;
+};
+
+static void
+sendfile_test_error (struct rspamd_http_connection *conn, GError *err)
+{
+	msg_err ("http error occurred: %s", err->message);
+	g_assert_not_reached ();
+}
+
+static gint
+sendfile_test_client_finish (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg)
+{
+	struct sendfile_test_cbdata *cbd = conn->ud;
+
+	/* Called when the request is written */
+	cbd->written = TRUE;
+	cbd->sent_file = rspamd_http_connection_get_sendfile_bytes (conn);
+
+	return 0;
+}
+
+static gint
+sendfile_test_server_finish (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg)
+{
+	struct sendfile_test_cbdata *cbd = conn->ud;
+	const gchar *body;
+	gsize len;
+
+	body = rspamd_http_message_get_body (msg, &len);
+	g_assert_cmpuint (len, ==, SENDFILE_BODY_LEN);
+	g_assert (memcmp (body, cbd->body, len) == 0);
+	cbd->received = TRUE;
+	ev_break (event_loop, EVBREAK_ONE);
+
+	return 0;
+}
+
+void
+rspamd_http_sendfile_test_func (void)
+{
+	struct rspamd_http_context *ctx;
+	struct rspamd_http_connection *client, *server;
+	struct rspamd_http_message *msg;
+	struct sendfile_test_cbdata cbd;
+	gchar fname[] = "/tmp/rspamd-sendfile-XXXXXX";
+	guchar *body;
+	gint fd, sv[2], i;
+
+	body = g_malloc (SENDFILE_BODY_LEN);
+
+	for (i = 0; i < SENDFILE_BODY_LEN; i ++) {
+		body[i] = (i * 31 + 7) & 0xff;
+	}
+
+	fd = mkstemp (fname);
+	g_assert (fd != -1);
+	unlink (fname);
+	g_assert (write (fd, body, SENDFILE_BODY_LEN) == SENDFILE_BODY_LEN);
+
+	g_assert (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	rspamd_socket_nonblocking (sv[0]);
+	rspamd_socket_nonblocking (sv[1]);
+
+	memset (&cbd, 0, sizeof (cbd));
+	cbd.body = body;
+	ctx = rspamd_http_context_create (rspamd_main->cfg, event_loop, NULL);
+
+	server = rspamd_http_connection_new_server (ctx, sv[1], NULL,
+			sendfile_test_error, sendfile_test_server_finish, 0);
+	rspamd_http_connection_read_message (server, &cbd, 5.0);
+
+	client = rspamd_http_connection_new_client_socket (ctx, NULL,
+			sendfile_test_error, sendfile_test_client_finish, 0, sv[0]);
+	msg = rspamd_http_new_message (HTTP_REQUEST);
+	msg->url = rspamd_fstring_new_init ("/check", sizeof ("/check") - 1);
+	/* Body is shared memory, so it must not be copied to the socket */
+	g_assert (rspamd_http_message_set_body_from_fd (msg, fd));
+	rspamd_http_connection_write_message (client, msg, NULL, "text/plain",
+			&cbd, 5.0);
+
+	ev_run (event_loop, 0);
+
+	g_assert (cbd.written);
+	g_assert (cbd.received);
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+	g_assert_cmpuint (cbd.sent_file, ==, SENDFILE_BODY_LEN);
+#else
+	g_assert_cmpuint (cbd.sent_file, ==, 0);
+#endif
+
+	rspamd_http_connection_unref (client);
+	rspamd_http_connection_unref (server);
+	rspamd_http_context_free (ctx);
+	close (sv[0]);
+	close (sv[1]);
+	close (fd);
+	g_free (body);
+}
@@ -0,0 +1,183 @@
+/*-
+ * Copyright 2019 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "tests.h"
+#include "unix-std.h"
+#include "libstat/learn_cache/learn_filter.h"
+
+#define LEARN_FILTER_TEST_SIZE 64
+#define LEARN_FILTER_TEST_ELTS 48
+#define LEARN_FILTER_TEST_PROBES 1000
+
+static gsize
+learn_filter_test_digest (gchar *buf, gsize len, const gchar *prefix, gint i)
+{
+	return rspamd_snprintf (buf, len, "%s-%d", prefix, i);
+}
+
+static void
+learn_filter_test_basic (const gchar *path)
+{
+	struct rspamd_learn_filter *f, *other;
+	GError *err = NULL;
+	gchar digest[64];
+	gsize len;
+	gint i, fp = 0;
+
+	f = rspamd_learn_filter_open (path, LEARN_FILTER_TEST_SIZE, 0.01, &err);
+	g_assert (f != NULL);
+	g_assert (!rspamd_learn_filter_is_ready (f));
+	g_assert (rspamd_learn_filter_need_rebuild (f));
+	g_assert (!rspamd_learn_filter_is_authoritative (f));
+
+	rspamd_learn_filter_set_ready (f);
+	g_assert (rspamd_learn_filter_is_ready (f));
+	g_assert (!rspamd_learn_filter_need_rebuild (f));
+
+	for (i = 0; i < LEARN_FILTER_TEST_ELTS; i ++) {
+		len = learn_filter_test_digest (digest, sizeof (digest), "learned", i);
+		g_assert (rspamd_learn_filter_add (f, (const guchar *)digest, len));
+	}
+
+	/* No false negatives */
+	for (i = 0; i < LEARN_FILTER_TEST_ELTS; i ++) {
+		len = learn_filter_test_digest (digest, sizeof (digest), "learned", i);
+		g_assert (rspamd_learn_filter_check (f, (const guchar *)digest, len));
+	}
+
+	/* False positives rate is about 1% */
+	for (i = 0; i < LEARN_FILTER_TEST_PROBES; i ++) {
+		len = learn_filter_test_digest (digest, sizeof (digest), "unknown", i);
+
+		if (rspamd_learn_filter_check (f, (const guchar *)digest, len)) {
+			fp ++;
+		}
+	}
+
+	g_assert_cmpint (fp, <, LEARN_FILTER_TEST_PROBES / 20);
+
+	/* Filter file is shared between processes */
+	other = rspamd_learn_filter_open (path, LEARN_FILTER_TEST_SIZE, 0.01, &err);
+	g_assert (other != NULL);
+	g_assert (rspamd_learn_filter_is_ready (other));
+	len = learn_filter_test_digest (digest, sizeof (digest), "learned", 0);
+	g_assert (rspamd_learn_filter_check (other, (const guchar *)digest, len));
+
+	/* Reset filter is empty and must be rebuilt */
+	rspamd_learn_filter_reset (f);
+	g_assert (!rspamd_learn_filter_is_ready (f));
+	g_assert (!rspamd_learn_filter_check (other, (const guchar *)digest, len));
+
+	/* Removed element is not found by other processes */
+	g_assert (rspamd_learn_filter_add (f, (const guchar *)digest, len));
+	g_assert (rspamd_learn_filter_check (other, (const guchar *)digest, len));
+	g_assert (rspamd_learn_filter_del (f, (const guchar *)digest, len));
+	g_assert (!rspamd_learn_filter_check (other, (const guchar *)digest, len));
+	g_assert (!rspamd_learn_filter_del (f, (const guchar *)digest, len));
+	rspamd_learn_filter_close (other);
+	rspamd_learn_filter_close (f);
+
+	/* Different geometry recreates filter */
+	f = rspamd_learn_filter_open (path, LEARN_FILTER_TEST_SIZE * 16, 0.01, &err);
+	g_assert (f != NULL);
+	g_assert (!rspamd_learn_filter_is_ready (f));
+	rspamd_learn_filter_close (f);
+}
+
+static void
+learn_filter_test_overflow (const gchar *path)
+{
+	struct rspamd_learn_filter *f;
+	GError *err = NULL;
+	gchar digest[64];
+	gsize len;
+	gint i;
+	gboolean overflow = FALSE;
+
+	f = rspamd_learn_filter_open (path, LEARN_FILTER_TEST_SIZE, 0.01, &err);
+	g_assert (f != NULL);
+	rspamd_learn_filter_set_ready (f);
+
+	for (i = 0; i < LEARN_FILTER_TEST_SIZE * 16; i ++) {
+		len = learn_filter_test_digest (digest, sizeof (digest), "overflow", i);
+
+		if (!rspamd_learn_filter_add (f, (const guchar *)digest, len)) {
+			overflow = TRUE;
+			break;
+		}
+	}
+
+	/* Filter that has lost a fingerprint must not be used */
+	g_assert (overflow);
+	g_assert (!rspamd_learn_filter_is_ready (f));
+	g_assert (rspamd_learn_filter_need_rebuild (f));
+	len = learn_filter_test_digest (digest, sizeof (digest), "overflow", 0);
+	g_assert (!rspamd_learn_filter_add (f, (const guchar *)digest, len));
+
+	/* Rebuilt filter is usable again */
+	rspamd_learn_filter_reset (f);
+	g_assert (rspamd_learn_filter_add (f, (const guchar *)digest, len));
+	rspamd_learn_filter_set_ready (f);
+	g_assert (rspamd_learn_filter_is_ready (f));
+	g_assert (rspamd_learn_filter_check (f, (const guchar *)digest, len));
+	rspamd_learn_filter_close (f);
+}
+
+static void
+learn_filter_test_ucl (const gchar *path)
+{
+	struct rspamd_learn_filter *f;
+	ucl_object_t *cf;
+
+	cf = ucl_object_typed_new (UCL_OBJECT);
+	g_assert (rspamd_learn_filter_from_ucl (cf, path) == NULL);
+
+	ucl_object_insert_key (cf, ucl_object_frombool (true), "filter", 0, false);
+	ucl_object_insert_key (cf, ucl_object_fromint (LEARN_FILTER_TEST_SIZE),
+			"filter_size", 0, false);
+	f = rspamd_learn_filter_from_ucl (cf, path);
+	g_assert (f != NULL);
+	g_assert (!rspamd_learn_filter_is_authoritative (f));
+	rspamd_learn_filter_close (f);
+
+	ucl_object_insert_key (cf, ucl_object_frombool (true),
+			"filter_authoritative", 0, false);
+	f = rspamd_learn_filter_from_ucl (cf, path);
+	g_assert (f != NULL);
+	g_assert (rspamd_learn_filter_is_authoritative (f));
+	rspamd_learn_filter_close (f);
+	ucl_object_unref (cf);
+}
+
+void
+rspamd_learn_filter_test_func (void)
+{
+	gchar fname[] = "/tmp/rspamd-learn-filter-XXXXXX";
+	gint fd;
+
+	fd = mkstemp (fname);
+	g_assert (fd != -1);
+	close (fd);
+
+	learn_filter_test_basic (fname);
+	unlink (fname);
+	learn_filter_test_overflow (fname);
+	unlink (fname);
+	learn_filter_test_ucl (fname);
+	unlink (fname);
+}
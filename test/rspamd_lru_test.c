@@ -0,0 +1,236 @@
+/*-
+ * Copyright 2019 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "hash.h"
+#include "ottery.h"
+#include <math.h>
+
+extern gchar *lru_trace;
+
+static const guint trace_keys = 100000;
+static const guint trace_len = 500000;
+static const guint cache_sizes[] = {1000, 10000};
+
+/*
+ * Synthetic trace: zipf distributed keys interrupted by scans of unique keys,
+ * like a burst of messages from a spam campaign
+ */
+static GPtrArray *
+lru_synthetic_trace (void)
+{
+	GPtrArray *trace;
+	gdouble *cdf, sum = 0, r;
+	guint i, lo, hi, mid;
+
+	trace = g_ptr_array_new_full (trace_len, g_free);
+	cdf = g_malloc (sizeof (*cdf) * trace_keys);
+
+	for (i = 0; i < trace_keys; i ++) {
+		sum += 1.0 / pow (i + 1, 0.9);
+		cdf[i] = sum;
+	}
+
+	for (i = 0; i < trace_len; i ++) {
+		if ((i / 10000) % 5 == 4) {
+			g_ptr_array_add (trace, g_strdup_printf ("scan%ud", i));
+			continue;
+		}
+
+		r = ottery_rand_unsigned () / (gdouble)G_MAXUINT * sum;
+		lo = 0;
+		hi = trace_keys - 1;
+
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+
+			if (cdf[mid] < r) {
+				lo = mid + 1;
+			}
+			else {
+				hi = mid;
+			}
+		}
+
+		g_ptr_array_add (trace, g_strdup_printf ("key%ud", lo));
+	}
+
+	g_free (cdf);
+
+	return trace;
+}
+
+/* Real trace: one key per line, e.g. dumped DKIM selectors or SPF domains */
+static GPtrArray *
+lru_file_trace (const gchar *path)
+{
+	GPtrArray *trace;
+	gchar *data, **lines, **cur;
+	GError *err = NULL;
+
+	if (!g_file_get_contents (path, &data, NULL, &err)) {
+		rspamd_printf ("cannot read trace %s: %e\n", path, err);
+		g_error_free (err);
+
+		return NULL;
+	}
+
+	lines = g_strsplit (data, "\n", -1);
+	g_free (data);
+	trace = g_ptr_array_new_full (g_strv_length (lines), g_free);
+
+	for (cur = lines; *cur != NULL; cur ++) {
+		if (**cur != '\0') {
+			g_ptr_array_add (trace, *cur);
+		}
+		else {
+			g_free (*cur);
+		}
+	}
+
+	g_free (lines);
+
+	return trace;
+}
+
+static void
+lru_bench (GPtrArray *trace, guint size, gboolean tinylfu)
+{
+	rspamd_lru_hash_t *hash;
+	const gchar *key;
+	gdouble t1, t2;
+	guint i, hits = 0;
+
+	if (tinylfu) {
+		hash = rspamd_lru_hash_new_tinylfu (size, g_free, NULL,
+				rspamd_strcase_hash, rspamd_strcase_equal);
+	}
+	else {
+		hash = rspamd_lru_hash_new (size, g_free, NULL);
+	}
+
+	t1 = rspamd_get_ticks (FALSE);
+
+	for (i = 0; i < trace->len; i ++) {
+		key = g_ptr_array_index (trace, i);
+
+		if (rspamd_lru_hash_lookup (hash, key, 0)) {
+			hits ++;
+		}
+		else {
+			rspamd_lru_hash_insert (hash, g_strdup (key), GUINT_TO_POINTER (1),
+					0, 0);
+		}
+	}
+
+	t2 = rspamd_get_ticks (FALSE);
+
+	rspamd_printf ("%s: size: %ud, elements: %ud, hit ratio: %.3f, "
+			"ops/sec: %.0f\n",
+			tinylfu ? "tinylfu" : "lru", size, rspamd_lru_hash_size (hash),
+			(gdouble)hits / trace->len, trace->len / (t2 - t1));
+
+	if (tinylfu) {
+		g_assert (rspamd_lru_hash_size (hash) <= size);
+	}
+
+	rspamd_lru_hash_destroy (hash);
+}
+
+static void
+lru_tinylfu_basic (void)
+{
+	rspamd_lru_hash_t *hash;
+	gpointer k, v;
+	gchar keybuf[32];
+	gint it = 0;
+	guint i, cnt = 0;
+
+	hash = rspamd_lru_hash_new_tinylfu (64, g_free, NULL,
+			rspamd_strcase_hash, rspamd_strcase_equal);
+
+	rspamd_lru_hash_insert (hash, g_strdup ("test"), GUINT_TO_POINTER (1),
+			100, 0);
+	g_assert (rspamd_lru_hash_lookup (hash, "test", 100) ==
+			GUINT_TO_POINTER (1));
+
+	/* Replace */
+	rspamd_lru_hash_insert (hash, g_strdup ("test"), GUINT_TO_POINTER (2),
+			100, 0);
+	g_assert (rspamd_lru_hash_lookup (hash, "test", 100) ==
+			GUINT_TO_POINTER (2));
+	g_assert (rspamd_lru_hash_size (hash) == 1);
+
+	/* Expire */
+	rspamd_lru_hash_insert (hash, g_strdup ("volatile"), GUINT_TO_POINTER (3),
+			100, 10);
+	g_assert (rspamd_lru_hash_lookup (hash, "volatile", 105) != NULL);
+	g_assert (rspamd_lru_hash_lookup (hash, "volatile", 200) == NULL);
+
+	/* Remove */
+	g_assert (rspamd_lru_hash_remove (hash, "test"));
+	g_assert (!rspamd_lru_hash_remove (hash, "test"));
+	g_assert (rspamd_lru_hash_size (hash) == 0);
+
+	/* Frequent key survives a scan */
+	rspamd_lru_hash_insert (hash, g_strdup ("hot"), GUINT_TO_POINTER (4),
+			100, 0);
+
+	for (i = 0; i < 10; i ++) {
+		g_assert (rspamd_lru_hash_lookup (hash, "hot", 100) != NULL);
+	}
+
+	for (i = 0; i < 256; i ++) {
+		rspamd_snprintf (keybuf, sizeof (keybuf), "scan%ud", i);
+		rspamd_lru_hash_insert (hash, g_strdup (keybuf), GUINT_TO_POINTER (5),
+				100, 0);
+		g_assert (rspamd_lru_hash_size (hash) <= 64);
+	}
+
+	g_assert (rspamd_lru_hash_lookup (hash, "hot", 100) != NULL);
+
+	while ((it = rspamd_lru_hash_foreach (hash, it, &k, &v)) != -1) {
+		cnt ++;
+	}
+
+	g_assert (cnt == rspamd_lru_hash_size (hash));
+	rspamd_lru_hash_destroy (hash);
+}
+
+void
+rspamd_lru_test_func (void)
+{
+	GPtrArray *trace = NULL;
+	guint i;
+
+	lru_tinylfu_basic ();
+
+	if (lru_trace) {
+		trace = lru_file_trace (lru_trace);
+	}
+
+	if (trace == NULL) {
+		trace = lru_synthetic_trace ();
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (cache_sizes); i ++) {
+		lru_bench (trace, cache_sizes[i], FALSE);
+		lru_bench (trace, cache_sizes[i], TRUE);
+	}
+
+	g_ptr_array_free (trace, TRUE);
+}
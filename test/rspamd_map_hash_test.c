@@ -0,0 +1,270 @@
+/*-
+ * Copyright 2019 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamd.h"
+#include "tests.h"
+#include "unix-std.h"
+#include "map.h"
+#include "map_private.h"
+#include "map_helpers.h"
+
+#define MAP_HASH_TEST_ELTS 5000
+#define MAP_HASH_TEST_PROBES 10000
+/* More than the overflow table could hold before compaction */
+#define MAP_HASH_TEST_DELTA_ELTS 1500
+
+static void
+map_hash_test_check (struct rspamd_hash_map_helper *ht, const gchar *prefix,
+		gint from, gint to, gboolean upper)
+{
+	gchar key[64], value[64];
+	gconstpointer found;
+	gint i;
+
+	for (i = from; i < to; i ++) {
+		rspamd_snprintf (key, sizeof (key), upper ? "%s-KEY-%d" : "%s-key-%d",
+				prefix, i);
+		rspamd_snprintf (value, sizeof (value), "%s-value-%d", prefix, i);
+		found = rspamd_match_hash_map (ht, key);
+		g_assert (found != NULL);
+		g_assert_cmpstr (found, ==, value);
+	}
+}
+
+static gint
+map_hash_test_check_missing (struct rspamd_hash_map_helper *ht)
+{
+	gchar key[64];
+	gint i, found = 0;
+
+	for (i = 0; i < MAP_HASH_TEST_PROBES; i ++) {
+		rspamd_snprintf (key, sizeof (key), "missing-key-%d", i);
+
+		if (rspamd_match_hash_map (ht, key) != NULL) {
+			found ++;
+		}
+	}
+
+	return found;
+}
+
+static gchar *
+map_hash_test_text (const gchar *prefix, gint from, gint to, gsize *len)
+{
+	GString *out = g_string_new (NULL);
+	gint i;
+
+	for (i = from; i < to; i ++) {
+		rspamd_printf_gstring (out, "%s-key-%d %s-value-%d\n",
+				prefix, i, prefix, i);
+	}
+
+	*len = out->len;
+
+	return g_string_free (out, FALSE);
+}
+
+static void
+map_hash_test_read (struct map_cb_data *data, gchar *text, gsize len,
+		gboolean delta, struct rspamd_hash_map_helper **target)
+{
+	data->cur_data = delta ? *target : NULL;
+	data->prev_data = NULL;
+	data->delta = delta;
+	rspamd_kv_list_read (text, len, data, TRUE);
+	rspamd_kv_list_fin (data, (void **)target);
+	g_free (text);
+}
+
+static void
+map_hash_test_image (const gchar *path)
+{
+	struct rspamd_hash_map_helper *ht, *img;
+	GError *err = NULL;
+	gchar key[64], value[64];
+	gint i, fd;
+
+	ht = rspamd_map_helper_new_hash (NULL);
+
+	for (i = 0; i < MAP_HASH_TEST_ELTS; i ++) {
+		rspamd_snprintf (key, sizeof (key), "img-key-%d", i);
+		rspamd_snprintf (value, sizeof (value), "img-value-%d", i);
+		rspamd_map_helper_insert_hash (ht, key, value);
+	}
+
+	g_assert (rspamd_map_helper_save_hash_image (ht, 42, path, &err));
+	rspamd_map_helper_destroy_hash (ht);
+
+	img = rspamd_map_helper_load_hash_image (NULL, path, &err);
+	g_assert (img != NULL);
+	map_hash_test_check (img, "img", 0, MAP_HASH_TEST_ELTS, FALSE);
+	/* Keys are case insensitive */
+	map_hash_test_check (img, "img", 0, MAP_HASH_TEST_ELTS, TRUE);
+	/* Missing keys are rejected by fingerprints or key comparison */
+	g_assert_cmpint (map_hash_test_check_missing (img), ==, 0);
+	rspamd_map_helper_destroy_hash (img);
+
+	/* Empty map */
+	ht = rspamd_map_helper_new_hash (NULL);
+	g_assert (rspamd_map_helper_save_hash_image (ht, 0, path, &err));
+	rspamd_map_helper_destroy_hash (ht);
+	img = rspamd_map_helper_load_hash_image (NULL, path, &err);
+	g_assert (img != NULL);
+	g_assert_cmpint (map_hash_test_check_missing (img), ==, 0);
+	rspamd_map_helper_destroy_hash (img);
+
+	/* Truncated image is rejected */
+	fd = open (path, O_WRONLY);
+	g_assert (fd != -1);
+	g_assert (ftruncate (fd, 16) == 0);
+	close (fd);
+	img = rspamd_map_helper_load_hash_image (NULL, path, &err);
+	g_assert (img == NULL);
+	g_assert (err != NULL);
+	g_error_free (err);
+}
+
+static void
+map_hash_test_delta (const gchar *path)
+{
+	struct rspamd_map map;
+	struct map_cb_data data;
+	struct rspamd_hash_map_helper *ht = NULL, *img;
+	GError *err = NULL;
+	gchar *text;
+	gsize len;
+
+	memset (&map, 0, sizeof (map));
+	memset (&data, 0, sizeof (data));
+	map.name = (gchar *)"perfect-hash-test";
+	map.perfect_hash = TRUE;
+	map.delta_updates = TRUE;
+	data.map = &map;
+
+	text = map_hash_test_text ("phf", 0, MAP_HASH_TEST_ELTS, &len);
+	map_hash_test_read (&data, text, len, FALSE, &ht);
+	g_assert_cmpuint (map.nelts, ==, MAP_HASH_TEST_ELTS);
+	map_hash_test_check (ht, "phf", 0, MAP_HASH_TEST_ELTS, FALSE);
+	g_assert_cmpint (map_hash_test_check_missing (ht), ==, 0);
+
+	/* Small changes are kept in the overflow table */
+	text = g_strdup ("-phf-key-0\n"
+			"+phf-key-1 changed\n"
+			"+added-key added-value\n");
+	map_hash_test_read (&data, text, strlen (text), TRUE, &ht);
+	g_assert (rspamd_match_hash_map (ht, "phf-key-0") == NULL);
+	g_assert_cmpstr (rspamd_match_hash_map (ht, "phf-key-1"), ==, "changed");
+	g_assert_cmpstr (rspamd_match_hash_map (ht, "added-key"), ==,
+			"added-value");
+	map_hash_test_check (ht, "phf", 2, MAP_HASH_TEST_ELTS, FALSE);
+	g_assert_cmpuint (map.nelts, ==, MAP_HASH_TEST_ELTS);
+	g_assert_cmpint (map_hash_test_check_missing (ht), ==, 0);
+
+	/* Image with pending changes is saved with them */
+	g_assert (rspamd_map_helper_save_hash_image (ht, map.digest, path, &err));
+	img = rspamd_map_helper_load_hash_image (NULL, path, &err);
+	g_assert (img != NULL);
+	g_assert (rspamd_match_hash_map (img, "phf-key-0") == NULL);
+	g_assert_cmpstr (rspamd_match_hash_map (img, "phf-key-1"), ==, "changed");
+	map_hash_test_check (img, "phf", 2, MAP_HASH_TEST_ELTS, FALSE);
+	rspamd_map_helper_destroy_hash (img);
+
+	/* Large delta makes the image to be rebuilt */
+	text = map_hash_test_text ("delta", 0, MAP_HASH_TEST_DELTA_ELTS, &len);
+	map_hash_test_read (&data, text, len, TRUE, &ht);
+	g_assert_cmpuint (map.nelts, ==,
+			MAP_HASH_TEST_ELTS + MAP_HASH_TEST_DELTA_ELTS);
+	map_hash_test_check (ht, "delta", 0, MAP_HASH_TEST_DELTA_ELTS, FALSE);
+	map_hash_test_check (ht, "phf", 2, MAP_HASH_TEST_ELTS, FALSE);
+	g_assert (rspamd_match_hash_map (ht, "phf-key-0") == NULL);
+	g_assert_cmpstr (rspamd_match_hash_map (ht, "phf-key-1"), ==, "changed");
+	g_assert_cmpstr (rspamd_match_hash_map (ht, "added-key"), ==,
+			"added-value");
+	g_assert_cmpint (map_hash_test_check_missing (ht), ==, 0);
+
+	/* Changes after compaction go to a new overflow table */
+	text = g_strdup ("-delta-key-0\n");
+	map_hash_test_read (&data, text, strlen (text), TRUE, &ht);
+	g_assert (rspamd_match_hash_map (ht, "delta-key-0") == NULL);
+	map_hash_test_check (ht, "delta", 1, MAP_HASH_TEST_DELTA_ELTS, FALSE);
+
+	rspamd_map_helper_destroy_hash (ht);
+}
+
+static void
+map_hash_test_filter (void)
+{
+	struct rspamd_map map;
+	struct map_cb_data data;
+	struct rspamd_hash_map_helper *ht = NULL;
+	struct rspamd_map_stat stat[RSPAMD_MAP_STAT_SHARDS], sum;
+	gchar *text;
+	gsize len;
+
+	memset (&map, 0, sizeof (map));
+	memset (&data, 0, sizeof (data));
+	memset (stat, 0, sizeof (stat));
+	map.name = (gchar *)"bloom-test";
+	map.lookup_filter = TRUE;
+	map.delta_updates = TRUE;
+	map.stat = stat;
+	data.map = &map;
+
+	text = map_hash_test_text ("bloom", 0, MAP_HASH_TEST_ELTS, &len);
+	map_hash_test_read (&data, text, len, FALSE, &ht);
+	map_hash_test_check (ht, "bloom", 0, MAP_HASH_TEST_ELTS, FALSE);
+	g_assert_cmpint (map_hash_test_check_missing (ht), ==, 0);
+
+	rspamd_map_stat_sum (&map, &sum);
+	g_assert_cmpuint (sum.hits, ==, MAP_HASH_TEST_ELTS);
+	g_assert_cmpuint (sum.misses, ==, MAP_HASH_TEST_PROBES);
+	/* About 1% of false positives */
+	g_assert_cmpuint (sum.filtered, >=, MAP_HASH_TEST_PROBES * 9 / 10);
+
+	/* Keys added by a delta are inserted to the existing filter */
+	text = g_strdup ("-bloom-key-0\n"
+			"+added-key added-value\n");
+	map_hash_test_read (&data, text, strlen (text), TRUE, &ht);
+	g_assert (rspamd_match_hash_map (ht, "bloom-key-0") == NULL);
+	g_assert_cmpstr (rspamd_match_hash_map (ht, "added-key"), ==,
+			"added-value");
+	map_hash_test_check (ht, "bloom", 1, MAP_HASH_TEST_ELTS, FALSE);
+
+	/* Map that has grown twice gets a new filter */
+	text = map_hash_test_text ("grown", 0, MAP_HASH_TEST_ELTS * 2, &len);
+	map_hash_test_read (&data, text, len, TRUE, &ht);
+	map_hash_test_check (ht, "grown", 0, MAP_HASH_TEST_ELTS * 2, FALSE);
+	map_hash_test_check (ht, "bloom", 1, MAP_HASH_TEST_ELTS, FALSE);
+	g_assert_cmpint (map_hash_test_check_missing (ht), ==, 0);
+
+	rspamd_map_helper_destroy_hash (ht);
+}
+
+void
+rspamd_map_hash_test_func (void)
+{
+	gchar fname[] = "/tmp/rspamd-map-hash-XXXXXX";
+	gint fd;
+
+	fd = mkstemp (fname);
+	g_assert (fd != -1);
+	close (fd);
+
+	map_hash_test_image (fname);
+	map_hash_test_delta (fname);
+	map_hash_test_filter ();
+	unlink (fname);
+}
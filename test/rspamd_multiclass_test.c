@@ -0,0 +1,283 @@
+/*-
+ * Copyright 2019 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "tests.h"
+#include "unix-std.h"
+#include "stat_internal.h"
+#include "classifiers/classifiers.h"
+#include "learn_cache/learn_cache.h"
+#include "libserver/mempool_vars_internal.h"
+
+extern struct rspamd_main *rspamd_main;
+
+static const gchar *test_classes[] = {"spam", "ham", "phishing", "newsletter"};
+#define NCLASSES G_N_ELEMENTS (test_classes)
+#define NTOKENS 8
+
+struct multiclass_test_ctx {
+	struct rspamd_stat_ctx st_ctx;
+	struct rspamd_classifier cl;
+	struct rspamd_classifier_config clcf;
+	struct rspamd_statfile st[NCLASSES];
+	struct rspamd_statfile_config stcf[NCLASSES];
+	GPtrArray *tokens;
+};
+
+static void
+multiclass_test_init (struct multiclass_test_ctx *ctx)
+{
+	rspamd_token_t *tok;
+	guint i;
+	gint id;
+
+	memset (ctx, 0, sizeof (*ctx));
+	ctx->st_ctx.statfiles = g_ptr_array_new ();
+	ctx->cl.ctx = &ctx->st_ctx;
+	ctx->cl.cfg = &ctx->clcf;
+	ctx->cl.statfiles_ids = g_array_new (FALSE, FALSE, sizeof (gint));
+	ctx->clcf.name = "multiclass";
+
+	for (i = 0; i < NCLASSES; i ++) {
+		ctx->stcf[i].symbol = (gchar *)test_classes[i];
+		ctx->stcf[i].class_name = (gchar *)test_classes[i];
+		ctx->stcf[i].is_spam = (i == 0);
+		ctx->st[i].id = i;
+		ctx->st[i].stcf = &ctx->stcf[i];
+		ctx->st[i].classifier = &ctx->cl;
+		g_ptr_array_add (ctx->st_ctx.statfiles, &ctx->st[i]);
+		id = i;
+		g_array_append_val (ctx->cl.statfiles_ids, id);
+	}
+
+	ctx->tokens = g_ptr_array_new_with_free_func (g_free);
+
+	for (i = 0; i < NTOKENS; i ++) {
+		tok = g_malloc0 (sizeof (*tok) + NCLASSES * sizeof (gdouble));
+		tok->data = 0xdeadbeef + i;
+		g_ptr_array_add (ctx->tokens, tok);
+	}
+}
+
+static void
+multiclass_test_set_values (struct multiclass_test_ctx *ctx, gdouble v)
+{
+	rspamd_token_t *tok;
+	guint i, j;
+
+	for (i = 0; i < ctx->tokens->len; i ++) {
+		tok = g_ptr_array_index (ctx->tokens, i);
+
+		for (j = 0; j < NCLASSES; j ++) {
+			tok->values[j] = v;
+		}
+	}
+}
+
+static void
+multiclass_test_check_values (struct multiclass_test_ctx *ctx,
+		const gdouble *expected)
+{
+	rspamd_token_t *tok;
+	guint i, j;
+
+	for (i = 0; i < ctx->tokens->len; i ++) {
+		tok = g_ptr_array_index (ctx->tokens, i);
+
+		for (j = 0; j < NCLASSES; j ++) {
+			g_assert_cmpfloat (tok->values[j], ==, expected[j]);
+		}
+	}
+}
+
+static void
+multiclass_test_free (struct multiclass_test_ctx *ctx)
+{
+	g_ptr_array_free (ctx->tokens, TRUE);
+	g_ptr_array_free (ctx->st_ctx.statfiles, TRUE);
+	g_array_free (ctx->cl.statfiles_ids, TRUE);
+}
+
+static struct rspamd_task *
+multiclass_test_task (struct multiclass_test_ctx *ctx, const gchar *learn_class,
+		gboolean spam)
+{
+	struct rspamd_task *task;
+
+	task = rspamd_task_new (NULL, rspamd_main->cfg, NULL, NULL, NULL);
+	task->tokens = ctx->tokens;
+	task->flags |= spam ? RSPAMD_TASK_FLAG_LEARN_SPAM : RSPAMD_TASK_FLAG_LEARN_HAM;
+
+	if (learn_class) {
+		rspamd_mempool_set_variable (task->task_pool,
+				RSPAMD_MEMPOOL_STAT_LEARN_CLASS, (gpointer)learn_class, NULL);
+	}
+
+	return task;
+}
+
+static void
+multiclass_test_task_free (struct rspamd_task *task)
+{
+	task->tokens = NULL;
+	rspamd_task_free (task);
+}
+
+static void
+multiclass_test_learn (struct multiclass_test_ctx *ctx)
+{
+	struct rspamd_task *task;
+	GError *err = NULL;
+	static const gdouble plain_ham[] = {0, 1, 0, 0},
+		phishing[] = {0, 0, 1, 0},
+		relearn[] = {3, 2, 4, 3},
+		relearn_inc[] = {0, -1, 1, 0},
+		unknown_prev[] = {2, 2, 4, 2};
+
+	/* Plain ham learn targets only ham class */
+	multiclass_test_set_values (ctx, 0);
+	task = multiclass_test_task (ctx, NULL, FALSE);
+	g_assert (multiclass_learn (&ctx->cl, ctx->tokens, task, FALSE, FALSE, &err));
+	multiclass_test_check_values (ctx, plain_ham);
+	multiclass_test_task_free (task);
+
+	/* Explicit class */
+	multiclass_test_set_values (ctx, 0);
+	task = multiclass_test_task (ctx, "Phishing", TRUE);
+	g_assert (multiclass_learn (&ctx->cl, ctx->tokens, task, TRUE, FALSE, &err));
+	multiclass_test_check_values (ctx, phishing);
+	multiclass_test_task_free (task);
+
+	/* Relearn from ham to phishing must not touch spam and newsletter */
+	multiclass_test_set_values (ctx, 3);
+	task = multiclass_test_task (ctx, "phishing", TRUE);
+	rspamd_stat_set_unlearn_class (task, rspamd_stat_class_code ("ham"));
+	g_assert (multiclass_learn (&ctx->cl, ctx->tokens, task, TRUE, TRUE, &err));
+	multiclass_test_check_values (ctx, relearn);
+	g_assert (!rspamd_stat_is_unlearn_target (task, &ctx->st[0], TRUE));
+	g_assert (rspamd_stat_is_unlearn_target (task, &ctx->st[1], TRUE));
+	g_assert (!rspamd_stat_is_unlearn_target (task, &ctx->st[2], TRUE));
+	g_assert (!rspamd_stat_is_unlearn_target (task, &ctx->st[3], TRUE));
+	multiclass_test_task_free (task);
+
+	/* The same for incrementing backends, where values are increments */
+	ctx->clcf.flags |= RSPAMD_FLAG_CLASSIFIER_INCREMENTING_BACKEND;
+	multiclass_test_set_values (ctx, 3);
+	task = multiclass_test_task (ctx, "phishing", TRUE);
+	rspamd_stat_set_unlearn_class (task, rspamd_stat_class_code ("ham"));
+	g_assert (multiclass_learn (&ctx->cl, ctx->tokens, task, TRUE, TRUE, &err));
+	multiclass_test_check_values (ctx, relearn_inc);
+	multiclass_test_task_free (task);
+	ctx->clcf.flags &= ~RSPAMD_FLAG_CLASSIFIER_INCREMENTING_BACKEND;
+
+	/* Previous class is unknown, so all other classes are unlearned */
+	multiclass_test_set_values (ctx, 3);
+	task = multiclass_test_task (ctx, "phishing", TRUE);
+	task->flags |= RSPAMD_TASK_FLAG_UNLEARN;
+	g_assert (multiclass_learn (&ctx->cl, ctx->tokens, task, TRUE, TRUE, &err));
+	multiclass_test_check_values (ctx, unknown_prev);
+	multiclass_test_task_free (task);
+
+	/* Unknown class */
+	task = multiclass_test_task (ctx, "unknown", TRUE);
+	g_assert (!multiclass_learn (&ctx->cl, ctx->tokens, task, TRUE, FALSE, &err));
+	g_assert (err != NULL);
+	g_error_free (err);
+	multiclass_test_task_free (task);
+}
+
+static gint
+multiclass_test_cache_check (struct multiclass_test_ctx *ctx, gpointer cache,
+		const gchar *learn_class, gboolean spam, gboolean do_learn)
+{
+	struct rspamd_task *task;
+	gint ret;
+
+	task = multiclass_test_task (ctx, learn_class, spam);
+	ret = rspamd_stat_cache_sqlite3_check (task, spam, cache);
+
+	if (ret == RSPAMD_LEARN_UNLEARN) {
+		/* Only the previous class is unlearned */
+		g_assert (task->flags & RSPAMD_TASK_FLAG_UNLEARN);
+		g_assert (rspamd_stat_is_unlearn_target (task, &ctx->st[2], spam));
+		g_assert (!rspamd_stat_is_unlearn_target (task, &ctx->st[1], spam));
+		g_assert (!rspamd_stat_is_unlearn_target (task, &ctx->st[3], spam));
+	}
+
+	if (do_learn && ret != RSPAMD_LEARN_INGORE) {
+		rspamd_stat_cache_sqlite3_learn (task, spam, cache);
+	}
+
+	multiclass_test_task_free (task);
+
+	return ret;
+}
+
+static void
+multiclass_test_cache (struct multiclass_test_ctx *ctx)
+{
+	gchar fname[] = "/tmp/rspamd-learn-cache-XXXXXX";
+	ucl_object_t *cf;
+	gpointer cache;
+	gint fd;
+
+	fd = mkstemp (fname);
+	g_assert (fd != -1);
+	close (fd);
+	unlink (fname);
+
+	cf = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (cf, ucl_object_fromstring (fname), "path", 0, false);
+	cache = rspamd_stat_cache_sqlite3_init (&ctx->st_ctx, rspamd_main->cfg,
+			&ctx->st[0], cf);
+	g_assert (cache != NULL);
+
+	/* New message */
+	g_assert_cmpint (multiclass_test_cache_check (ctx, cache, "phishing", TRUE,
+			TRUE), ==, RSPAMD_LEARN_OK);
+	/* Learned as the same class */
+	g_assert_cmpint (multiclass_test_cache_check (ctx, cache, "phishing", TRUE,
+			FALSE), ==, RSPAMD_LEARN_INGORE);
+	/* Relearned as spam, phishing is the class to unlearn */
+	g_assert_cmpint (multiclass_test_cache_check (ctx, cache, NULL, TRUE,
+			TRUE), ==, RSPAMD_LEARN_UNLEARN);
+	g_assert_cmpint (multiclass_test_cache_check (ctx, cache, NULL, TRUE,
+			FALSE), ==, RSPAMD_LEARN_INGORE);
+
+	rspamd_stat_cache_sqlite3_close (cache);
+	ucl_object_unref (cf);
+	unlink (fname);
+}
+
+void
+rspamd_multiclass_test_func (void)
+{
+	struct multiclass_test_ctx ctx;
+
+	g_assert_cmpint (rspamd_stat_class_code ("spam"), ==, 1);
+	g_assert_cmpint (rspamd_stat_class_code ("HAM"), ==, -1);
+	g_assert_cmpint (rspamd_stat_class_code ("phishing"), >=, 2);
+	g_assert_cmpint (rspamd_stat_class_code ("phishing"), ==,
+			rspamd_stat_class_code ("PHISHING"));
+	g_assert_cmpint (rspamd_stat_class_code ("phishing"), !=,
+			rspamd_stat_class_code ("newsletter"));
+
+	multiclass_test_init (&ctx);
+	multiclass_test_learn (&ctx);
+	multiclass_test_cache (&ctx);
+	multiclass_test_free (&ctx);
+}
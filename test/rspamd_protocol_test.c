@@ -0,0 +1,213 @@
+/*-
+ * Copyright 2019 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "tests.h"
+#include "libserver/protocol.h"
+#include "libserver/protocol_internal.h"
+#include "libserver/url.h"
+
+extern struct rspamd_main *rspamd_main;
+extern struct ev_loop *event_loop;
+
+static const struct {
+	const gchar *name;
+	guint flags;
+} section_cases[] = {
+	{"default", RSPAMD_PROTOCOL_DEFAULT},
+	{"all", RSPAMD_PROTOCOL_DEFAULT|RSPAMD_PROTOCOL_URLS},
+	{"basic", RSPAMD_PROTOCOL_BASIC},
+	{"action", RSPAMD_PROTOCOL_METRICS},
+	{"Action", RSPAMD_PROTOCOL_METRICS},
+	{"metrics", RSPAMD_PROTOCOL_METRICS|RSPAMD_PROTOCOL_SYMBOLS|
+			RSPAMD_PROTOCOL_SYMBOLS_DETAILS},
+	{"SYMBOLS", RSPAMD_PROTOCOL_SYMBOLS},
+	{"options", RSPAMD_PROTOCOL_SYMBOLS|RSPAMD_PROTOCOL_SYMBOLS_DETAILS},
+	{"messages", RSPAMD_PROTOCOL_MESSAGES},
+	{"milter", RSPAMD_PROTOCOL_RMILTER},
+	{"rmilter", RSPAMD_PROTOCOL_RMILTER},
+	{"dkim", RSPAMD_PROTOCOL_DKIM},
+	{"urls", RSPAMD_PROTOCOL_URLS},
+	{"extra", RSPAMD_PROTOCOL_EXTRA},
+	{"", 0},
+	{"url", 0},
+	{"urlsx", 0},
+	{"unknown", 0},
+};
+
+static void
+rspamd_protocol_test_sections (void)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (section_cases); i ++) {
+		g_assert_cmpuint (rspamd_protocol_section_flags (section_cases[i].name,
+				strlen (section_cases[i].name)), ==, section_cases[i].flags);
+	}
+
+	/* Length limits the comparison, so a prefix of a list is parsed */
+	g_assert_cmpuint (rspamd_protocol_section_flags ("urls,dkim", 4), ==,
+			RSPAMD_PROTOCOL_URLS);
+}
+
+/* All headers recognised by rspamd_protocol_handle_headers */
+static const gchar *known_headers[] = {
+	DELIVER_TO_HEADER, HELO_HEADER, HOSTNAME_HEADER, FROM_HEADER,
+	FILENAME_HEADER, JSON_HEADER, QUEUE_ID_HEADER, RCPT_HEADER,
+	RAW_DATA_HEADER, IP_ADDR_HEADER, PASS_HEADER, PROFILE_HEADER,
+	SUBJECT_HEADER, SETTINGS_ID_HEADER, USER_HEADER, URLS_HEADER,
+	USER_AGENT_HEADER, NO_LOG_HEADER, MLEN_HEADER, MTA_TAG_HEADER,
+	MTA_NAME_HEADER, MILTER_HEADER, TLS_CIPHER_HEADER, ACCEPT_HEADER,
+	REPLY_SECTIONS_HEADER,
+};
+
+/* Perfect hash weights must give a distinct slot to each known header */
+static void
+rspamd_protocol_test_headers (void)
+{
+	static const gchar *unknown[] = {
+		TLS_VERSION_HEADER, CERT_ISSUER_HEADER, MAILER_HEADER,
+		"", "X", "Usr", "Users", "Accept-Encoding", "Content-Length",
+	};
+	gboolean seen[G_N_ELEMENTS (known_headers) + 1];
+	gchar *up;
+	gint id;
+	guint i;
+
+	memset (seen, 0, sizeof (seen));
+
+	for (i = 0; i < G_N_ELEMENTS (known_headers); i ++) {
+		id = rspamd_protocol_header_id (known_headers[i],
+				strlen (known_headers[i]));
+		g_assert_cmpint (id, >, 0);
+		g_assert_cmpint (id, <=, (gint)G_N_ELEMENTS (known_headers));
+		g_assert (!seen[id]);
+		seen[id] = TRUE;
+
+		up = g_ascii_strup (known_headers[i], -1);
+		g_assert_cmpint (rspamd_protocol_header_id (up, strlen (up)), ==, id);
+		g_free (up);
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (unknown); i ++) {
+		g_assert_cmpint (rspamd_protocol_header_id (unknown[i],
+				strlen (unknown[i])), ==, 0);
+	}
+}
+
+static void
+rspamd_protocol_test_reply (void)
+{
+	struct rspamd_task *task;
+	struct rspamd_url *url;
+	ucl_object_t *top;
+	gchar *str;
+
+	task = rspamd_task_new (NULL, rspamd_main->cfg, NULL, NULL, event_loop);
+	task->message_id = "test";
+	url = rspamd_mempool_alloc0 (task->task_pool, sizeof (*url));
+	str = rspamd_mempool_strdup (task->task_pool, "http://example.com/path");
+	g_assert (rspamd_url_parse (url, str, strlen (str), task->task_pool,
+			RSPAMD_URL_PARSE_TEXT) == URI_ERRNO_OK);
+	g_hash_table_insert (task->urls, url, url);
+
+	top = rspamd_protocol_write_ucl (task, RSPAMD_PROTOCOL_BASIC);
+	g_assert (ucl_object_lookup (top, "message-id") != NULL);
+	g_assert (ucl_object_lookup (top, "messages") == NULL);
+	g_assert (ucl_object_lookup (top, "urls") == NULL);
+
+	top = rspamd_protocol_write_ucl (task,
+			RSPAMD_PROTOCOL_MESSAGES|RSPAMD_PROTOCOL_URLS);
+	g_assert (ucl_object_lookup (top, "message-id") == NULL);
+	g_assert (ucl_object_lookup (top, "messages") != NULL);
+	g_assert (ucl_object_lookup (top, "urls") != NULL);
+	g_assert_cmpuint (ucl_array_size (ucl_object_lookup (top, "urls")), ==, 1);
+
+	rspamd_task_free (task);
+}
+
+/* Directly written binary reply must decode to the same object as JSON reply */
+static void
+rspamd_protocol_test_msgpack (enum rspamd_command cmd)
+{
+	struct rspamd_task *task;
+	struct rspamd_url *url;
+	struct ucl_parser *parser;
+	ucl_object_t *top, *decoded;
+	const ucl_object_t *metric;
+	rspamd_fstring_t *reply;
+	guchar *json, *decoded_json;
+	gchar *str;
+
+	task = rspamd_task_new (NULL, rspamd_main->cfg, NULL, NULL, event_loop);
+	task->message_id = "test";
+	task->cmd = cmd;
+	task->result->score = 7.5;
+	ucl_object_insert_key (task->messages, ucl_object_fromstring ("text"),
+			"smtp_message", 0, false);
+	rspamd_task_insert_result (task, "TEST_SYMBOL", 1.0, "option");
+	url = rspamd_mempool_alloc0 (task->task_pool, sizeof (*url));
+	str = rspamd_mempool_strdup (task->task_pool, "http://example.com/path");
+	g_assert (rspamd_url_parse (url, str, strlen (str), task->task_pool,
+			RSPAMD_URL_PARSE_TEXT) == URI_ERRNO_OK);
+	g_hash_table_insert (task->urls, url, url);
+
+	top = rspamd_protocol_write_ucl (task,
+			RSPAMD_PROTOCOL_DEFAULT|RSPAMD_PROTOCOL_URLS);
+	reply = rspamd_fstring_new ();
+	rspamd_protocol_write_msgpack (task,
+			RSPAMD_PROTOCOL_DEFAULT|RSPAMD_PROTOCOL_URLS, &reply);
+
+	parser = ucl_parser_new (0);
+	g_assert (ucl_parser_add_chunk_full (parser, reply->str, reply->len, 0,
+			UCL_DUPLICATE_APPEND, UCL_PARSE_MSGPACK));
+	decoded = ucl_parser_get_object (parser);
+	g_assert (decoded != NULL);
+
+	/* Floats could be NaN, so objects are compared by their JSON form */
+	json = ucl_object_emit (top, UCL_EMIT_JSON_COMPACT);
+	decoded_json = ucl_object_emit (decoded, UCL_EMIT_JSON_COMPACT);
+	g_assert_cmpstr ((const gchar *)json, ==, (const gchar *)decoded_json);
+
+	metric = cmd == CMD_CHECK_V2 ? decoded :
+			ucl_object_lookup (decoded, DEFAULT_METRIC);
+	g_assert (metric != NULL);
+	g_assert_cmpfloat (ucl_object_todouble (ucl_object_lookup (metric,
+			"score")), ==, 7.5);
+	g_assert (ucl_object_lookup_path (decoded,
+			cmd == CMD_CHECK_V2 ? "symbols.TEST_SYMBOL.options" :
+			DEFAULT_METRIC ".TEST_SYMBOL.options") != NULL);
+	g_assert_cmpuint (ucl_array_size (ucl_object_lookup (decoded, "urls")),
+			==, 1);
+
+	free (json);
+	free (decoded_json);
+	ucl_object_unref (decoded);
+	ucl_parser_free (parser);
+	rspamd_fstring_free (reply);
+	rspamd_task_free (task);
+}
+
+void
+rspamd_protocol_test_func (void)
+{
+	rspamd_protocol_test_sections ();
+	rspamd_protocol_test_headers ();
+	rspamd_protocol_test_reply ();
+	rspamd_protocol_test_msgpack (CMD_CHECK_V2);
+	rspamd_protocol_test_msgpack (CMD_CHECK);
+}
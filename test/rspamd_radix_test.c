@@ -18,6 +18,7 @@
 #include "radix.h"
 #include "ottery.h"
 #include "btrie.h"
+#include "map_helpers.h"
 
 const gsize max_elts = 500 * 1024;
 const gint lookup_cycles = 1 * 1024;
@@ -204,12 +205,70 @@ rspamd_btrie_test_vec (void)
 	}
 }
 
+static guint32
+rspamd_radix_test_flat_id (uintptr_t value, gpointer ud)
+{
+	if (value == RADIX_NO_VALUE) {
+		return RADIX_FLAT_NO_VALUE;
+	}
+
+	return value;
+}
+
+static void
+rspamd_radix_test_asn (void)
+{
+	struct rspamd_radix_map_helper *r;
+	struct rspamd_asn_info info;
+	rspamd_inet_addr_t *addr;
+	static const struct {
+		const gchar *ip;
+		guint32 asn;
+		const gchar *country;
+		const gchar *prefix;
+	} tests[] = {
+		{"8.8.8.8", 15169, "US", "8.8.8.0/24"},
+		{"8.8.4.1", 15169, "", "8.8.0.0/16"},
+		{"2a00:1450::1", 15169, "IE", "2a00:1450::/32"},
+		{"1.1.1.1", 0, NULL, NULL},
+	};
+	guint i;
+
+	r = rspamd_map_helper_new_radix (NULL);
+	rspamd_map_helper_insert_asn (r, "8.8.0.0/16", "15169");
+	rspamd_map_helper_insert_asn (r, "8.8.8.0/24", "AS15169 | us");
+	rspamd_map_helper_insert_asn (r, "2a00:1450::/32", "15169 IE");
+	/* Skipped, helper has no map to log with */
+	rspamd_map_helper_insert_asn (r, "1.1.1.0/24", "cloudflare");
+
+	for (i = 0; i < G_N_ELEMENTS (tests); i ++) {
+		g_assert (rspamd_parse_inet_address (&addr, tests[i].ip,
+				strlen (tests[i].ip)));
+
+		if (tests[i].prefix == NULL) {
+			g_assert (!rspamd_match_asn_map_addr (r, addr, &info));
+		}
+		else {
+			g_assert (rspamd_match_asn_map_addr (r, addr, &info));
+			g_assert (info.asn == tests[i].asn);
+			g_assert (strcmp (info.country, tests[i].country) == 0);
+			g_assert (strcmp (info.prefix, tests[i].prefix) == 0);
+		}
+
+		rspamd_inet_address_free (addr);
+	}
+
+	rspamd_map_helper_destroy_radix (r);
+}
+
 void
 rspamd_radix_test_func (void)
 {
 	struct btrie *btrie;
 	rspamd_mempool_t *pool;
-	radix_compressed_t *comp_tree = radix_create_compressed ();
+	radix_compressed_t *comp_tree = radix_create_compressed (), *flat_tree;
+	radix_flat_t *flat;
+	GByteArray *flat_data;
 	struct {
 		guint32 addr;
 		guint32 mask;
@@ -226,6 +285,7 @@ rspamd_radix_test_func (void)
 
 	rspamd_btrie_test_vec ();
 	rspamd_radix_test_vec ();
+	rspamd_radix_test_asn ();
 
 	nelts = max_elts;
 	/* First of all we generate many elements and push them to the array */
@@ -332,6 +392,78 @@ rspamd_radix_test_func (void)
 
 	msg_notice ("Checked %hz elements in %.0f ticks",
 			nelts * lookup_cycles / lookup_divisor, diff);
+
+	msg_notice ("flat radix performance (%z elts)", nelts);
+	flat_tree = radix_create_compressed ();
+	radix_compressed_track_prefixes (flat_tree);
+
+	for (i = 0; i < nelts; i ++) {
+		radix_insert_compressed (flat_tree, addrs[i].addr6,
+				sizeof (addrs[i].addr6),
+				128 - addrs[i].mask6, i + 1);
+		radix_insert_compressed (flat_tree, (guint8 *)&addrs[i].addr,
+				sizeof (addrs[i].addr),
+				32 - addrs[i].mask, i + 1);
+	}
+
+	flat_data = g_byte_array_new ();
+	ts1 = rspamd_get_ticks (TRUE);
+	g_assert (radix_flat_serialize (flat_tree, rspamd_radix_test_flat_id, NULL,
+			flat_data, NULL));
+	ts2 = rspamd_get_ticks (TRUE);
+	diff = (ts2 - ts1);
+
+	msg_notice ("Serialized %hz elements to %ud bytes in %.0f ticks",
+			nelts, flat_data->len, diff);
+
+	flat = radix_flat_attach (flat_data->data, flat_data->len, NULL);
+	g_assert (flat != NULL);
+	diff = 0;
+
+	for (lc = 0; lc < lookup_cycles && all_good; lc ++) {
+		for (i = 0; i < nelts / lookup_divisor; i ++) {
+			check = ottery_rand_range (nelts - 1);
+
+			ts1 = rspamd_get_ticks (TRUE);
+
+			if (radix_flat_find (flat, addrs[check].addr6,
+					sizeof (addrs[check].addr6)) == RADIX_FLAT_NO_VALUE) {
+				all_good = FALSE;
+			}
+
+			ts2 = rspamd_get_ticks (TRUE);
+			diff += ts2 - ts1;
+		}
+	}
+
+	g_assert (all_good);
+
+	msg_notice ("Checked %hz elements in %.0f ticks",
+			nelts * lookup_cycles / lookup_divisor, diff);
+
+	/* Flat lookups must be the same as trie lookups for any address */
+	for (i = 0; i < nelts; i ++) {
+		guint8 addr6[16];
+		guint32 addr;
+
+		ottery_rand_bytes (addr6, sizeof (addr6));
+		addr = ottery_rand_uint32 ();
+
+		g_assert (radix_flat_find (flat, addr6, sizeof (addr6)) ==
+				rspamd_radix_test_flat_id (radix_find_compressed (flat_tree,
+						addr6, sizeof (addr6)), NULL));
+		g_assert (radix_flat_find (flat, (guint8 *)&addr, sizeof (addr)) ==
+				rspamd_radix_test_flat_id (radix_find_compressed (flat_tree,
+						(guint8 *)&addr, sizeof (addr)), NULL));
+		g_assert (radix_flat_find (flat, addrs[i].addr6,
+				sizeof (addrs[i].addr6)) ==
+				rspamd_radix_test_flat_id (radix_find_compressed (flat_tree,
+						addrs[i].addr6, sizeof (addrs[i].addr6)), NULL));
+	}
+
+	radix_flat_destroy (flat);
+	g_byte_array_free (flat_data, TRUE);
+	radix_destroy_compressed (flat_tree);
 	radix_destroy_compressed (comp_tree);
 
 	g_free (addrs);
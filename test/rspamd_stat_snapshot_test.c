@@ -0,0 +1,219 @@
+/*-
+ * Copyright 2019 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "tests.h"
+#include "unix-std.h"
+#include "libstat/backends/snapshot.h"
+
+#define SNAPSHOT_TEST_ELTS 10000
+/* Odd multiplier spreads tokens over the whole range */
+#define SNAPSHOT_TEST_TOKEN(i) ((guint64)(i) * 0x9E3779B97F4A7C15ULL)
+
+static struct rspamd_stat_snapshot_entry *
+snapshot_test_entries (gsize *nelts)
+{
+	struct rspamd_stat_snapshot_entry *entries;
+	gsize i, n = SNAPSHOT_TEST_ELTS + 2;
+
+	entries = g_malloc0 (sizeof (*entries) * n);
+
+	/* Unsorted tokens */
+	for (i = 0; i < SNAPSHOT_TEST_ELTS; i ++) {
+		entries[i].token = SNAPSHOT_TEST_TOKEN (SNAPSHOT_TEST_ELTS - i);
+		entries[i].spam = SNAPSHOT_TEST_ELTS - i;
+		entries[i].ham = i % 7;
+	}
+
+	/* Duplicate key returned by scan */
+	entries[i] = entries[0];
+	/* Counts that do not fit the snapshot */
+	entries[i + 1].token = 42;
+	entries[i + 1].spam = 200000;
+	entries[i + 1].ham = 100000;
+	*nelts = n;
+
+	return entries;
+}
+
+static void
+snapshot_test_check (struct rspamd_stat_snapshot *snap, gsize from, gsize to)
+{
+	guint spam, ham;
+	gsize i;
+
+	for (i = from; i < to; i ++) {
+		g_assert (rspamd_stat_snapshot_lookup (snap,
+				SNAPSHOT_TEST_TOKEN (SNAPSHOT_TEST_ELTS - i), &spam, &ham));
+		g_assert_cmpuint (spam, ==, SNAPSHOT_TEST_ELTS - i);
+		g_assert_cmpuint (ham, ==, i % 7);
+	}
+}
+
+static void
+snapshot_test_write (const gchar *path)
+{
+	struct rspamd_stat_snapshot_entry *entries;
+	struct rspamd_stat_snapshot_meta meta, out;
+	struct rspamd_stat_snapshot *snap;
+	GError *err = NULL;
+	guint spam, ham;
+	gsize nelts, i;
+	gdouble now = rspamd_get_calendar_ticks ();
+
+	entries = snapshot_test_entries (&nelts);
+	meta.learns_spam = 100;
+	meta.learns_ham = 200;
+	meta.scan_start = now - 10;
+	meta.full_scan_start = now - 20;
+	g_assert (rspamd_stat_snapshot_write (path, entries, nelts, &meta, &err));
+	g_free (entries);
+
+	snap = rspamd_stat_snapshot_open (path, &err);
+	g_assert (snap != NULL);
+	snapshot_test_check (snap, 0, SNAPSHOT_TEST_ELTS);
+
+	/* Large counts are scaled keeping their ratio */
+	g_assert (rspamd_stat_snapshot_lookup (snap, 42, &spam, &ham));
+	g_assert_cmpuint (spam, >=, G_MAXUINT16 - 1);
+	g_assert_cmpint (ABS ((gint)spam - (gint)ham * 2), <=, 2);
+
+	/* Missing tokens, including both sides of the range */
+	g_assert (!rspamd_stat_snapshot_lookup (snap, 0, &spam, &ham));
+	g_assert (!rspamd_stat_snapshot_lookup (snap, G_MAXUINT64, &spam, &ham));
+
+	for (i = SNAPSHOT_TEST_ELTS + 1; i < SNAPSHOT_TEST_ELTS * 2; i ++) {
+		g_assert (!rspamd_stat_snapshot_lookup (snap,
+				SNAPSHOT_TEST_TOKEN (i), &spam, &ham));
+	}
+
+	g_assert_cmpuint (rspamd_stat_snapshot_learns (snap, TRUE), ==, 100);
+	g_assert_cmpuint (rspamd_stat_snapshot_learns (snap, FALSE), ==, 200);
+	g_assert (rspamd_stat_snapshot_timestamp (snap) >= now);
+	rspamd_stat_snapshot_get_meta (snap, &out);
+	g_assert_cmpuint (out.learns_spam, ==, 100);
+	g_assert_cmpuint (out.learns_ham, ==, 200);
+	g_assert (out.scan_start == meta.scan_start);
+	g_assert (out.full_scan_start == meta.full_scan_start);
+	g_assert (!rspamd_stat_snapshot_is_stale (snap));
+	rspamd_stat_snapshot_close (snap);
+}
+
+static void
+snapshot_test_merge (const gchar *path)
+{
+	struct rspamd_stat_snapshot_entry updates[3];
+	struct rspamd_stat_snapshot_meta meta;
+	struct rspamd_stat_snapshot *base, *snap;
+	GError *err = NULL;
+	guint spam, ham;
+
+	base = rspamd_stat_snapshot_open (path, &err);
+	g_assert (base != NULL);
+	rspamd_stat_snapshot_get_meta (base, &meta);
+	meta.learns_spam ++;
+
+	/* Added, changed and removed tokens */
+	updates[0].token = 1;
+	updates[0].spam = 1;
+	updates[0].ham = 0;
+	updates[1].token = SNAPSHOT_TEST_TOKEN (SNAPSHOT_TEST_ELTS);
+	updates[1].spam = 0;
+	updates[1].ham = 0;
+	updates[2].token = SNAPSHOT_TEST_TOKEN (1);
+	updates[2].spam = 5;
+	updates[2].ham = 5;
+	g_assert (rspamd_stat_snapshot_merge (base, path, updates,
+			G_N_ELEMENTS (updates), &meta, &err));
+
+	/* Replaced file is detected */
+	g_assert (rspamd_stat_snapshot_is_stale (base));
+	rspamd_stat_snapshot_close (base);
+
+	snap = rspamd_stat_snapshot_open (path, &err);
+	g_assert (snap != NULL);
+	g_assert (rspamd_stat_snapshot_lookup (snap, 1, &spam, &ham));
+	g_assert_cmpuint (spam, ==, 1);
+	g_assert_cmpuint (ham, ==, 0);
+	g_assert (!rspamd_stat_snapshot_lookup (snap,
+			SNAPSHOT_TEST_TOKEN (SNAPSHOT_TEST_ELTS), &spam, &ham));
+	g_assert (rspamd_stat_snapshot_lookup (snap, SNAPSHOT_TEST_TOKEN (1),
+			&spam, &ham));
+	g_assert_cmpuint (spam, ==, 5);
+	g_assert_cmpuint (ham, ==, 5);
+	/* Other tokens are kept from the base snapshot */
+	snapshot_test_check (snap, 1, SNAPSHOT_TEST_ELTS - 1);
+	g_assert (rspamd_stat_snapshot_lookup (snap, 42, &spam, &ham));
+	g_assert_cmpuint (rspamd_stat_snapshot_learns (snap, TRUE), ==, 101);
+	rspamd_stat_snapshot_close (snap);
+}
+
+static void
+snapshot_test_invalid (const gchar *path)
+{
+	struct rspamd_stat_snapshot_meta meta;
+	struct rspamd_stat_snapshot *snap;
+	GError *err = NULL;
+	guint spam, ham;
+	gint fd;
+
+	/* Empty snapshot */
+	memset (&meta, 0, sizeof (meta));
+	g_assert (rspamd_stat_snapshot_write (path, NULL, 0, &meta, &err));
+	snap = rspamd_stat_snapshot_open (path, &err);
+	g_assert (snap != NULL);
+	g_assert (!rspamd_stat_snapshot_lookup (snap, 42, &spam, &ham));
+	rspamd_stat_snapshot_close (snap);
+
+	/* Size that does not match the header is rejected */
+	g_assert (rspamd_stat_snapshot_write (path, NULL, 0, &meta, &err));
+	fd = open (path, O_WRONLY | O_APPEND);
+	g_assert (fd != -1);
+	g_assert (write (fd, "garbage", 7) == 7);
+	close (fd);
+	snap = rspamd_stat_snapshot_open (path, &err);
+	g_assert (snap == NULL);
+	g_assert (err != NULL);
+	g_error_free (err);
+	err = NULL;
+
+	/* Bad magic is rejected */
+	fd = open (path, O_WRONLY | O_TRUNC);
+	g_assert (fd != -1);
+	g_assert (ftruncate (fd, 64) == 0);
+	close (fd);
+	snap = rspamd_stat_snapshot_open (path, &err);
+	g_assert (snap == NULL);
+	g_assert (err != NULL);
+	g_error_free (err);
+}
+
+void
+rspamd_stat_snapshot_test_func (void)
+{
+	gchar fname[] = "/tmp/rspamd-stat-snapshot-XXXXXX";
+	gint fd;
+
+	fd = mkstemp (fname);
+	g_assert (fd != -1);
+	close (fd);
+
+	snapshot_test_write (fname);
+	snapshot_test_merge (fname);
+	snapshot_test_invalid (fname);
+	unlink (fname);
+}
@@ -12,6 +12,7 @@ worker_t *workers[] = { NULL };
 gchar *lua_test = NULL;
 gchar *lua_test_case = NULL;
 gboolean verbose = FALSE;
+gchar *lru_trace = NULL;
 
 static GOptionEntry entries[] =
 {
@@ -19,6 +20,8 @@ static GOptionEntry entries[] =
 	  "Lua test to run (i.e. selectors.lua)", NULL },
 	{ "test-case", 'c', 0, G_OPTION_ARG_STRING, &lua_test_case,
 	  "Lua test to run, lua pattern i.e. \"case .* rcpts\"", NULL },
+	{ "lru-trace", 0, 0, G_OPTION_ARG_FILENAME, &lru_trace,
+	  "Keys trace for lru benchmark, one key per line", NULL },
 	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
 };
 
@@ -56,7 +59,7 @@ main (int argc, char **argv)
 
 	rspamd_lua_set_path ((lua_State *)cfg->lua_state, NULL, NULL);
 	event_loop = ev_default_loop (EVFLAG_SIGNALFD|EVBACKEND_ALL);
-	rspamd_stat_init (cfg, event_loop);
+	rspamd_stat_init (cfg, event_loop, NULL);
 	rspamd_url_init (NULL);
 
 	if (g_test_verbose ()) {
@@ -70,6 +73,7 @@ main (int argc, char **argv)
 
 	g_test_add_func ("/rspamd/mem_pool", rspamd_mem_pool_test_func);
 	g_test_add_func ("/rspamd/radix", rspamd_radix_test_func);
+	g_test_add_func ("/rspamd/map_hash", rspamd_map_hash_test_func);
 	g_test_add_func ("/rspamd/dns", rspamd_dns_test_func);
 	g_test_add_func ("/rspamd/dkim", rspamd_dkim_test_func);
 	g_test_add_func ("/rspamd/rrd", rspamd_rrd_test_func);
@@ -78,6 +82,14 @@ main (int argc, char **argv)
 	g_test_add_func ("/rspamd/lua", rspamd_lua_test_func);
 	g_test_add_func ("/rspamd/cryptobox", rspamd_cryptobox_test_func);
 	g_test_add_func ("/rspamd/heap", rspamd_heap_test_func);
+	g_test_add_func ("/rspamd/lru", rspamd_lru_test_func);
+	g_test_add_func ("/rspamd/hpack", rspamd_hpack_test_func);
+	g_test_add_func ("/rspamd/http_sendfile", rspamd_http_sendfile_test_func);
+	g_test_add_func ("/rspamd/http2", rspamd_http2_test_func);
+	g_test_add_func ("/rspamd/multiclass", rspamd_multiclass_test_func);
+	g_test_add_func ("/rspamd/protocol", rspamd_protocol_test_func);
+	g_test_add_func ("/rspamd/learn_filter", rspamd_learn_filter_test_func);
+	g_test_add_func ("/rspamd/stat_snapshot", rspamd_stat_snapshot_test_func);
 	g_test_add_func ("/rspamd/lua_pcall", rspamd_lua_lua_pcall_vs_resume_test_func);
 
 #if 0
@@ -17,6 +17,9 @@ void rspamd_statfile_test_func (void);
 /* Radix test */
 void rspamd_radix_test_func (void);
 
+/* Perfect hash images and bloom filter of hash maps */
+void rspamd_map_hash_test_func (void);
+
 /* DNS resolving */
 void rspamd_dns_test_func (void);
 
@@ -38,6 +41,22 @@ void rspamd_cryptobox_test_func (void);
 
 void rspamd_heap_test_func (void);
 
+void rspamd_lru_test_func (void);
+
+void rspamd_hpack_test_func (void);
+
+void rspamd_http_sendfile_test_func (void);
+
+void rspamd_http2_test_func (void);
+
+void rspamd_multiclass_test_func (void);
+
+void rspamd_protocol_test_func (void);
+
+void rspamd_learn_filter_test_func (void);
+
+void rspamd_stat_snapshot_test_func (void);
+
 void rspamd_lua_lua_pcall_vs_resume_test_func(void);
 
 #endif
@@ -0,0 +1,99 @@
+/*-
+ * Copyright 2019 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "printf.h"
+#include "util.h"
+#include "task.h"
+#include "protocol.h"
+#include "cfg_file.h"
+#include "libutil/http_private.h"
+
+/*
+ * Parses a typical scan request as sent by MTA integrations
+ */
+
+static const gchar *request_headers[][2] = {
+	{"From", "<sender@example.com>"},
+	{"Rcpt", "<rcpt1@example.net>"},
+	{"Rcpt", "<rcpt2@example.net>"},
+	{"IP", "192.0.2.10"},
+	{"Helo", "mail.example.com"},
+	{"Hostname", "mail.example.com"},
+	{"Queue-Id", "4ABCDEF123"},
+	{"User-Agent", "rspamd-milter"},
+	{"MTA-Tag", "incoming"},
+	{"MTA-Name", "mx1.example.com"},
+	{"Log", "yes"},
+	{"Pass", "none"},
+	{"TLS-Cipher", "ECDHE-RSA-AES256-GCM-SHA384"},
+	{"TLS-Version", "TLSv1.2"},
+	{"Content-Length", "1024"},
+	{"Accept", "*/*"},
+};
+
+int
+main (int argc, char **argv)
+{
+	struct rspamd_config *cfg;
+	rspamd_logger_t *logger = NULL;
+	struct rspamd_http_message *msg;
+	struct rspamd_task *task;
+	gdouble t1, t2, total_time = 0;
+	gulong i, iters = 100000;
+	guint j;
+
+	if (argc > 1) {
+		iters = strtoul (argv[1], NULL, 10);
+	}
+
+	cfg = rspamd_config_new (RSPAMD_CONFIG_INIT_SKIP_LUA);
+	cfg->libs_ctx = rspamd_init_libs ();
+	cfg->log_type = RSPAMD_LOG_CONSOLE;
+	rspamd_set_logger (cfg, g_quark_from_static_string ("protocol"),
+			&logger, NULL);
+	(void) rspamd_log_open (logger);
+	g_log_set_default_handler (rspamd_glib_log_function, logger);
+
+	msg = rspamd_http_new_message (HTTP_REQUEST);
+	msg->url = rspamd_fstring_new_init ("/checkv2", sizeof ("/checkv2") - 1);
+
+	for (j = 0; j < G_N_ELEMENTS (request_headers); j ++) {
+		rspamd_http_message_add_header (msg, request_headers[j][0],
+				request_headers[j][1]);
+	}
+
+	for (i = 0; i < iters; i ++) {
+		task = rspamd_task_new (NULL, cfg, NULL, NULL, NULL);
+
+		t1 = rspamd_get_virtual_ticks ();
+		rspamd_protocol_handle_request (task, msg);
+		rspamd_protocol_handle_headers (task, msg);
+		t2 = rspamd_get_virtual_ticks ();
+
+		total_time += t2 - t1;
+		rspamd_task_free (task);
+	}
+
+	rspamd_printf ("Parsed %ul requests in %.4f seconds, %.2f ns per request\n",
+			iters, total_time, total_time * 1e9 / MAX (iters, 1));
+
+	rspamd_http_message_unref (msg);
+	rspamd_log_close (logger, TRUE);
+	REF_RELEASE (cfg);
+
+	return 0;
+}
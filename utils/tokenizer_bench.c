@@ -0,0 +1,130 @@
+/*-
+ * Copyright 2019 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "printf.h"
+#include "util.h"
+#include "cfg_file.h"
+#include "tokenizers/tokenizers.h"
+
+/*
+ * Runs words extraction of text parts: tokenizing, normalisation and
+ * stemming, and reports CPU time and pool memory per text
+ */
+
+static const gchar default_text[] =
+	"Dear customer, your account has been temporarily suspended due to "
+	"unusual sign-in activity. To restore full access please confirm your "
+	"details within 24 hours by following the secure link below. If you "
+	"do not verify your information, your account will be permanently "
+	"closed and all remaining funds will be frozen. We apologise for any "
+	"inconvenience; this is an automated message, please do not reply. "
+	"Sincerely, Customer Support Team, Example Bank Ltd. 1234 Main Street, "
+	"Springfield. Unsubscribe from these notifications at any time.";
+
+int
+main (int argc, char **argv)
+{
+	struct rspamd_config *cfg;
+	rspamd_logger_t *logger = NULL;
+	rspamd_mempool_t *pool;
+	rspamd_mempool_stat_t st;
+	GArray *words;
+	UText utxt = UTEXT_INITIALIZER;
+	UErrorCode uc_err = U_ZERO_ERROR;
+	gchar *text = (gchar *)default_text;
+	gsize len = sizeof (default_text) - 1;
+	gdouble t1, t2, total_time = 0;
+	guint64 total_mem = 0, total_words = 0;
+	gulong i, iters = 100000;
+	guint before;
+
+	if (argc > 1) {
+		iters = strtoul (argv[1], NULL, 10);
+	}
+
+	if (argc > 2) {
+		GError *err = NULL;
+
+		if (!g_file_get_contents (argv[2], &text, &len, &err)) {
+			rspamd_fprintf (stderr, "cannot read %s: %e\n", argv[2], err);
+			g_error_free (err);
+
+			return EXIT_FAILURE;
+		}
+	}
+
+	cfg = rspamd_config_new (RSPAMD_CONFIG_INIT_SKIP_LUA);
+	cfg->libs_ctx = rspamd_init_libs ();
+	cfg->log_type = RSPAMD_LOG_CONSOLE;
+	rspamd_set_logger (cfg, g_quark_from_static_string ("tokenizer"),
+			&logger, NULL);
+	(void) rspamd_log_open (logger);
+	g_log_set_default_handler (rspamd_glib_log_function, logger);
+
+	utext_openUTF8 (&utxt, text, len, &uc_err);
+
+	if (U_FAILURE (uc_err)) {
+		rspamd_fprintf (stderr, "cannot open text: %s\n", u_errorName (uc_err));
+
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < iters; i ++) {
+		rspamd_mempool_stat (&st);
+		before = st.bytes_allocated;
+		pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "tokenizer");
+
+		t1 = rspamd_get_virtual_ticks ();
+		words = rspamd_tokenize_text (text, len, &utxt, RSPAMD_TOKENIZE_UTF,
+				cfg, NULL, NULL, NULL);
+
+		if (words) {
+			rspamd_normalize_words (words, pool);
+			rspamd_stem_words (words, pool, "en", NULL);
+		}
+		t2 = rspamd_get_virtual_ticks ();
+
+		total_time += t2 - t1;
+		rspamd_mempool_stat (&st);
+		total_mem += st.bytes_allocated - before;
+
+		if (words) {
+			total_mem += words->len * sizeof (rspamd_stat_token_t);
+			total_words += words->len;
+			g_array_free (words, TRUE);
+		}
+
+		rspamd_mempool_delete (pool);
+	}
+
+	iters = MAX (iters, 1);
+	rspamd_printf ("Processed %ul texts of %z bytes (%uL words) in %.4f "
+			"seconds, %.2f us and %uL bytes per text\n",
+			iters, len, total_words / iters, total_time,
+			total_time * 1e6 / iters, total_mem / iters);
+
+	utext_close (&utxt);
+
+	if (text != default_text) {
+		g_free (text);
+	}
+
+	rspamd_log_close (logger, TRUE);
+	REF_RELEASE (cfg);
+
+	return 0;
+}